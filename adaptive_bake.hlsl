@@ -0,0 +1,134 @@
+#include "util.hlsl"
+#include "sampler.hlsl"
+#include "trace_ao.hlsl"
+#include "texel_data.hlsl"
+
+// The adaptive bake path. Each frame traces a round of samples for the texels in the active
+// list, estimates the error of each texel's AO and appends the texels which haven't
+// converged to the active list for the next round. Texels which converge early, like those
+// open to the sky, stop tracing after a few rounds
+
+RaytracingAccelerationStructure scene : register(t0);
+StructuredBuffer<TexelData> texels : register(t1);
+StructuredBuffer<float2> blue_noise : register(t2);
+
+RWStructuredBuffer<float2> accum_buffer : register(u0);
+RWTexture2D<float4> ao_output : register(u1);
+RWStructuredBuffer<uint> next_active_texels : register(u2);
+RWByteAddressBuffer next_active_count : register(u3);
+// Indices into the texel list of the texels to trace this round. The lists are swapped each
+// round, so both are bound as UAVs to avoid transitioning them
+RWStructuredBuffer<uint> active_texels : register(u4);
+// The RAY_STATS_* counters, reset before each bake frame
+RWByteAddressBuffer ray_stats : register(u7);
+
+cbuffer AtlasInfo : register(b0) {
+    int2 dimensions; 
+    int n_samples;
+    float ao_length;
+    // The accumulation is reset when frame_id is 0
+    uint frame_id;
+    int samples_per_frame;
+    // The SAMPLER_* sample generator to use and the seed to decorrelate separate bakes
+    uint sampler_type;
+    uint sampler_seed;
+    // The extra output maps aren't supported by this bake
+    uint bake_outputs;
+    // The AO rays trace the full-res geometry within near_field_radius and the occluder
+    // proxies beyond it, 0 if the scene has no proxies
+    float near_field_radius;
+    // The range of the active list to bake in this dispatch
+    uint texel_offset;
+    uint num_texels;
+    // The per-texel sample budget isn't supported by this bake
+    uint use_sample_budget;
+    // A texel is converged once the standard error of its AO is below the threshold
+    float error_threshold;
+    // Texels take at least min_samples before they can be considered converged
+    int min_samples;
+    // If set the display pass writes the samples taken per texel as a heatmap
+    uint show_heatmap;
+    // The first round traces all texels in the texel list, instead of the active list
+    uint use_active_list;
+}
+
+uint texel_pixel_id(TexelData t)
+{
+    const uint2 texel = texel_coords(t);
+    return texel.y * dimensions.x + texel.x;
+}
+
+// Each AO sample is either occluded or not, so the AO is the mean of a Bernoulli variable
+// and its variance follows from the accumulated counts
+bool texel_converged(float2 accum)
+{
+    if (accum.y >= n_samples) {
+        return true;
+    }
+    if (accum.y < min_samples) {
+        return false;
+    }
+    const float p = accum.x / accum.y;
+    return sqrt(p * (1.f - p) / accum.y) < error_threshold;
+}
+
+float3 heatmap_color(float t)
+{
+    // Blue for texels that stopped early, through green to red for those taking n_samples
+    t = saturate(t);
+    const float3 low = float3(0.f, 0.f, 1.f);
+    const float3 mid = float3(0.f, 1.f, 0.f);
+    const float3 high = float3(1.f, 0.f, 0.f);
+    return t < 0.5f ? lerp(low, mid, t * 2.f) : lerp(mid, high, t * 2.f - 1.f);
+}
+
+[numthreads(64, 1, 1)]
+void bake_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    if (thread_id.x >= num_texels) {
+        return;
+    }
+    const uint list_index = texel_offset + thread_id.x;
+    const uint texel_index = use_active_list ? active_texels[list_index] : list_index;
+    const TexelData t = texels[texel_index];
+    const uint2 texel = texel_coords(t);
+    const uint pixel_id = texel_pixel_id(t);
+
+    float2 accum = frame_id == 0 ? float2(0.f, 0.f) : accum_buffer[pixel_id];
+    const int batch_samples = min(samples_per_frame, max(n_samples - int(accum.y), 0));
+
+    SampleGenerator sg = make_sample_generator(sampler_type,
+                                               pixel_id,
+                                               uint(accum.y),
+                                               frame_id,
+                                               sampler_seed,
+                                               blue_noise_value(blue_noise, texel));
+    const float n_occluded = trace_ao_rays(
+        scene, t.position, t.normal, ao_length, near_field_radius, batch_samples, sg);
+
+    accum += float2(batch_samples - n_occluded, batch_samples);
+    accum_buffer[pixel_id] = accum;
+    record_ray_stats(ray_stats, batch_samples, uint(n_occluded), batch_samples > 0);
+
+    if (!texel_converged(accum)) {
+        uint index = 0;
+        next_active_count.InterlockedAdd(0, 1, index);
+        next_active_texels[index] = texel_index;
+    }
+}
+
+// Write the AO, or the heatmap of samples taken, for all texels in the texel list
+[numthreads(64, 1, 1)]
+void display_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    if (thread_id.x >= num_texels) {
+        return;
+    }
+    const TexelData t = texels[texel_offset + thread_id.x];
+    const float2 accum = accum_buffer[texel_pixel_id(t)];
+    if (show_heatmap) {
+        ao_output[texel_coords(t)] = float4(heatmap_color(accum.y / n_samples), 1.f);
+    } else {
+        ao_output[texel_coords(t)] = accum.x / max(accum.y, 1.f);
+    }
+}
@@ -0,0 +1,5900 @@
+#include "ao_bake.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <codecvt>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <locale>
+#include <map>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+#include <vector>
+#include <SDL.h>
+#include <windows.h>
+#include <psapi.h>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/packing.hpp>
+#include "alpha_test.h"
+#include "arcball_camera.h"
+#include "atlas.h"
+#include "atlas_draws.h"
+#include "bake_job.h"
+#include "bake_server.h"
+#include "blue_noise.h"
+#include "dds.h"
+#include "distributed_bake.h"
+#include "dxr/dx12_utils.h"
+#include "dxr/dxdisplay.h"
+#include "dxr/dxr_utils.h"
+#ifdef DXR_AO_EMBREE
+#include "embree_bake_backend.h"
+#endif
+#include "file_mapping.h"
+#include "image_export.h"
+#include "imgui.h"
+#include "json.hpp"
+#include "mesh_optimize.h"
+#include "mesh_simplify.h"
+#include "multi_gpu_bake.h"
+#include "occluder_proxies.h"
+#include "scene.h"
+#include "scene_cache.h"
+#include "stb_image.h"
+#include "stb_image_write.h"
+#include "tiny_obj_loader.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "util.h"
+#include "vertex_ao_gltf.h"
+#include "util/display/display.h"
+#include "util/display/gldisplay.h"
+#include "util/display/imgui_impl_sdl.h"
+
+#include "render_ao_map_bindless_vs_embedded_dxil.h"
+#include "render_ao_map_fs_embedded_dxil.h"
+#include "render_ao_map_table_vs_embedded_dxil.h"
+#include "render_ao_map_vs_embedded_dxil.h"
+#include "render_ao_map_permutations.h"
+#include "adaptive_bake_cs_embedded_dxil.h"
+#include "adaptive_display_cs_embedded_dxil.h"
+#include "bc4_encode_cs_embedded_dxil.h"
+#include "bc5_encode_cs_embedded_dxil.h"
+#include "dilate_init_cs_embedded_dxil.h"
+#include "dilate_jump_cs_embedded_dxil.h"
+#include "dilate_resolve_cs_embedded_dxil.h"
+#include "denoise_index_cs_embedded_dxil.h"
+#include "denoise_atrous_cs_embedded_dxil.h"
+#include "sample_budget_importance_cs_embedded_dxil.h"
+#include "sample_budget_assign_cs_embedded_dxil.h"
+#include "rebake_mark_cs_embedded_dxil.h"
+#include "preview_upsample_cs_embedded_dxil.h"
+#include "vertex_ao_cs_embedded_dxil.h"
+#include "lightmap_uv_check_fs_embedded_dxil.h"
+#include "lightmap_uv_check_vs_embedded_dxil.h"
+#include "texel_bake_cs_embedded_dxil.h"
+#include "texel_bake_rt_embedded_dxil.h"
+#include "texel_gbuffer_fs_embedded_dxil.h"
+#include "wavefront_raygen_cs_embedded_dxil.h"
+#include "wavefront_resolve_cs_embedded_dxil.h"
+#include "wavefront_scan_cs_embedded_dxil.h"
+#include "wavefront_scatter_cs_embedded_dxil.h"
+#include "wavefront_trace_cs_embedded_dxil.h"
+
+
+int win_width = 512;
+int win_height = 512;
+
+size_t bake_bytes_per_texel(const AppOptions &options)
+{
+    size_t bytes = options.ao_format == DXGI_FORMAT_R8G8B8A8_UNORM ? 4
+                   : options.ao_format == DXGI_FORMAT_R8_UNORM     ? 1
+                                                                   : 2;
+    // The accumulation buffer's float2 and the extras' and direct lighting's float4
+    bytes += 2 * sizeof(float);
+    const uint32_t bake_outputs = requested_bake_outputs(options);
+    if (bake_outputs & BAKE_OUTPUT_AO_EXTRAS) {
+        bytes += 4 * sizeof(float);
+    }
+    if (bake_outputs & BAKE_OUTPUT_DIRECT_LIGHT) {
+        bytes += 4 * sizeof(float);
+    }
+    if (options.compute_bake) {
+        bytes += sizeof(TexelData);
+        if (options.ray_budget > 0.0) {
+            bytes += sizeof(uint32_t);
+        }
+    }
+    return bytes;
+}
+
+uint64_t resolve_texel_budget(const AppOptions &options)
+{
+    std::vector<uint64_t> budgets;
+    if (options.atlas_budget_mtexels > 0.0) {
+        budgets.push_back(static_cast<uint64_t>(options.atlas_budget_mtexels * 1e6));
+    }
+    if (options.atlas_vram_budget_mb > 0.0) {
+        budgets.push_back(static_cast<uint64_t>(options.atlas_vram_budget_mb * 1024 * 1024 /
+                                                bake_bytes_per_texel(options)));
+    }
+    if (options.atlas_max_pages > 0) {
+        const uint64_t resolution = options.atlas_options.pack_options.resolution;
+        budgets.push_back(resolution * resolution * options.atlas_max_pages);
+    }
+    if (budgets.empty()) {
+        return 0;
+    }
+    return std::max(*std::min_element(budgets.begin(), budgets.end()), uint64_t(1));
+}
+
+std::string bake_cost_summary(const glm::uvec2 &atlas_size,
+                              int n_samples,
+                              size_t bytes_per_texel)
+{
+    const double texels = double(atlas_size.x) * atlas_size.y;
+    std::stringstream ss;
+    ss << pretty_print_count(texels) << " texels x " << n_samples
+       << " spp = " << pretty_print_count(texels * n_samples) << " rays, "
+       << pretty_print_count(texels * bytes_per_texel) << "b of bake buffers";
+    return ss.str();
+}
+
+uint32_t requested_bake_outputs(const AppOptions &options)
+{
+    uint32_t bake_outputs = 0;
+    if (!options.bent_normal_output.empty()) {
+        bake_outputs |= BAKE_OUTPUT_BENT_NORMAL;
+    }
+    if (!options.hit_distance_output.empty()) {
+        bake_outputs |= BAKE_OUTPUT_HIT_DISTANCE;
+    }
+    if (!options.direct_light_output.empty()) {
+        bake_outputs |= BAKE_OUTPUT_DIRECT_LIGHT;
+    }
+    return bake_outputs;
+}
+
+void run_app(const AppOptions &options, SDL_Window *window, DXDisplay *display)
+{
+    ImGuiIO &io = ImGui::GetIO();
+
+    display->resize(win_width, win_height);
+    auto &device = display->device;
+
+    dxr::HeapAllocator heap_allocator(device.Get());
+    if (options.placed_resources) {
+        dxr::set_resource_allocator(&heap_allocator);
+    }
+    std::unique_ptr<dxr::PipelineCache> pipeline_cache =
+        open_pipeline_cache(device.Get(), options);
+    dxr::CommandContext cmd_ctx(device.Get());
+    dxr::GpuProfiler profiler(device.Get(), cmd_ctx.queue.Get(), gpu_profiler_regions);
+
+    AtlasOptions atlas_options = options.atlas_options;
+    uint32_t bvh_profile = resolve_bvh_profile(options.bvh_profile, options.n_samples);
+    BakeScene bake_scene = load_bake_scene(options.scene_file,
+                                           options.scene_load,
+                                           atlas_options,
+                                           bvh_profile,
+                                           device.Get(),
+                                           cmd_ctx,
+                                           window,
+                                           profiler,
+                                           nullptr);
+    if (bake_scene.cancelled) {
+        return;
+    }
+    std::cout << "Predicted bake cost: "
+              << bake_cost_summary(
+                     bake_scene.atlas_size, options.n_samples, bake_bytes_per_texel(options))
+              << "\n";
+    glm::uvec2 atlas_size = bake_scene.atlas_size;
+
+    // The window keeps its size, the display shows a pan and zoom view of the atlas
+    const uint32_t bake_outputs = requested_bake_outputs(options);
+    // The display shows the AO image's RGB channels, so it must be RGBA8
+    BakeTarget bake_target = create_bake_target(
+        device.Get(), atlas_size, bake_outputs, DXGI_FORMAT_R8G8B8A8_UNORM);
+
+    BakePipeline bake_pipeline =
+        create_bake_pipeline(device.Get(), DXGI_FORMAT_R8G8B8A8_UNORM);
+    BlockCompressPipeline bc_pipeline = create_block_compress_pipeline(device.Get());
+    dxr::AsyncReadback ao_readback(device.Get());
+    RayStatsQuery ray_stats_query = create_ray_stats_query(device.Get(), cmd_ctx);
+
+    ComputeBakePipeline compute_pipeline = create_compute_bake_pipeline(device.Get());
+    write_compute_bake_output(device.Get(), compute_pipeline, bake_target);
+    dxr::RTPipeline raygen_pipeline =
+        create_raygen_bake_pipeline(device.Get(), cmd_ctx, compute_pipeline);
+    WavefrontPipeline wavefront_pipeline =
+        create_wavefront_pipeline(device.Get(), compute_pipeline);
+    AdaptiveBake adaptive_bake = create_adaptive_bake(device.Get(), compute_pipeline);
+    DilatePipeline dilate_pipeline = create_dilate_pipeline(device.Get(), compute_pipeline);
+    DenoisePipeline denoise_pipeline = create_denoise_pipeline(device.Get(), compute_pipeline);
+    int gutter = options.gutter;
+    DenoiseSettings denoise_settings = options.denoise_settings;
+    bool compute_bake = options.compute_bake;
+    bool wavefront = options.wavefront;
+    bool raygen_bake = options.raygen_bake;
+    // The last Mrays/s of the inline ray query and raygen compute bakes, to compare them
+    std::array<float, 2> backend_mrays = {0.f, 0.f};
+    bool adaptive = options.adaptive;
+    AdaptiveSettings adaptive_settings = options.adaptive_settings;
+    // Built on first use and when the atlas changes
+    TexelGBuffer texel_gbuffer;
+    SampleBudgetPipeline sample_budget_pipeline = create_sample_budget_pipeline(device.Get());
+    RebakePipeline rebake_pipeline = create_rebake_pipeline(device.Get());
+    PreviewBake preview = create_preview_bake(device.Get(), compute_pipeline);
+    preview.base_samples = options.preview_samples;
+    build_preview_levels(
+        device.Get(), cmd_ctx, compute_pipeline, preview, bake_scene, options.preview_scale);
+    save_pipeline_cache(pipeline_cache.get());
+    bool use_ray_budget = options.ray_budget > 0.0;
+    float ray_budget_mrays = use_ray_budget ? float(options.ray_budget * 1e-6) : 64.f;
+
+    const std::string rt_backend = "DirectX Ray Tracing";
+    const std::string cpu_brand = get_cpu_brand();
+    const std::string gpu_brand = display->gpu_brand();
+    const std::string image_output = "dxr_ao_bake.png";
+    const std::string display_frontend = display->name();
+
+    AtlasParams atlas_params(atlas_size);
+    atlas_params.n_samples = options.n_samples;
+    atlas_params.ao_length = options.ao_length;
+    if (options.samples_per_frame > 0) {
+        atlas_params.samples_per_frame = options.samples_per_frame;
+    }
+    atlas_params.sampler_type = options.sampler_type;
+    atlas_params.sampler_seed = options.sampler_seed;
+    atlas_params.bake_outputs = bake_outputs;
+    atlas_params.near_field_radius = bake_scene.near_field_radius;
+    bool accumulate = true;
+    int accumulated_samples = 0;
+    bool regenerate_atlas = false;
+    // Set when the BVH profile changes, the stats are those of the last rebuild
+    bool rebuild_bvhs = false;
+    dxr::MeshBuildStats bvh_build_stats;
+    double bvh_tlas_ms = 0.0;
+    // The instance moved in the Edit panel is offset from its loaded transform. Set when
+    // the offset changes, only the texels near the instance are re-baked
+    bool move_instance = false;
+    int edit_instance = 0;
+    glm::vec3 edit_offset(0.f);
+    std::vector<glm::mat4> loaded_transforms;
+    for (const auto &inst : bake_scene.scene_bvh.instances) {
+        loaded_transforms.push_back(inst.transform);
+    }
+    // The tiles being re-baked after an edit, the whole atlas is baked if empty
+    std::vector<glm::uvec2> rebake_tiles;
+    // Set when the denoising or heatmap settings change, as the AO image must be rewritten
+    // even if the bake has converged
+    bool refresh_ao = false;
+    // Without accumulation each frame bakes all the samples from scratch, so once a frame
+    // has baked this is cleared until a change to the settings, scene or atlas sets it
+    bool bake_dirty = true;
+
+    size_t frame_id = 0;
+    float render_time = 0.f;
+    float rays_per_second = 0.f;
+    RayStats ray_stats;
+    glm::vec2 prev_mouse(-2.f);
+    const auto display_interval = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::duration<double>(1.0 / std::max(options.display_fps, 1.f)));
+    auto next_present = std::chrono::steady_clock::now();
+    bool done = false;
+    bool save_image = false;
+    while (!done) {
+        SDL_Event event;
+        while (SDL_PollEvent(&event)) {
+            ImGui_ImplSDL2_ProcessEvent(&event);
+            if (event.type == SDL_QUIT) {
+                done = true;
+            }
+            if (!io.WantCaptureKeyboard && event.type == SDL_KEYDOWN) {
+                if (event.key.keysym.sym == SDLK_ESCAPE) {
+                    done = true;
+                } else if (event.key.keysym.sym == SDLK_f) {
+                    display->reset_view();
+                }
+            }
+            if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE &&
+                event.window.windowID == SDL_GetWindowID(window)) {
+                done = true;
+            }
+            // Dragging with the left or right button pans the atlas view, and the wheel
+            // zooms it around the cursor
+            if (!io.WantCaptureMouse) {
+                if (event.type == SDL_MOUSEMOTION) {
+                    const glm::vec2 cur_mouse(event.motion.x, event.motion.y);
+                    if (prev_mouse != glm::vec2(-2.f) &&
+                        (event.motion.state & (SDL_BUTTON_LMASK | SDL_BUTTON_RMASK))) {
+                        display->pan_view(cur_mouse - prev_mouse);
+                    }
+                    prev_mouse = cur_mouse;
+                } else if (event.type == SDL_MOUSEWHEEL && event.wheel.y != 0) {
+                    int mouse_x = 0;
+                    int mouse_y = 0;
+                    SDL_GetMouseState(&mouse_x, &mouse_y);
+                    display->zoom_view(std::pow(1.25f, float(event.wheel.y)),
+                                       glm::vec2(mouse_x, mouse_y));
+                }
+            }
+            // Minimizing can report an empty window, which the swap chain can't be sized to
+            if (event.type == SDL_WINDOWEVENT &&
+                event.window.event == SDL_WINDOWEVENT_RESIZED && event.window.data1 > 0 &&
+                event.window.data2 > 0) {
+                frame_id = 0;
+                win_width = event.window.data1;
+                win_height = event.window.data2;
+                io.DisplaySize.x = win_width;
+                io.DisplaySize.y = win_height;
+
+                display->resize(win_width, win_height);
+            }
+        }
+
+        if (rebuild_bvhs) {
+            rebuild_bvhs = false;
+            bvh_tlas_ms = rebuild_scene_bvhs(device.Get(),
+                                             cmd_ctx,
+                                             bake_scene,
+                                             bvh_profile,
+                                             true,
+                                             bvh_build_stats,
+                                             profiler);
+            std::cout << "Rebuilt BVHs with the " << bvh_profile_names[bvh_profile]
+                      << " profile\n";
+            if (bvh_build_stats.num_build_groups != 0) {
+                print_blas_build_stats(bvh_build_stats);
+            }
+            std::cout << "TLAS build: " << bvh_tlas_ms << "ms\n";
+            atlas_params.frame_id = 0;
+            accumulated_samples = 0;
+            bake_dirty = true;
+            restart_preview(preview);
+        }
+
+        if (regenerate_atlas) {
+            regenerate_atlas = false;
+            // Keep the current atlas if the user cancels the new one
+            BakeScene new_scene = load_bake_scene(options.scene_file,
+                                                  options.scene_load,
+                                                  atlas_options,
+                                                  bvh_profile,
+                                                  device.Get(),
+                                                  cmd_ctx,
+                                                  window,
+                                                  profiler,
+                                                  nullptr);
+            if (!new_scene.cancelled) {
+                // The incremental unwrap keeps the unchanged instances' regions in place, so
+                // if the layout still matches only the texels near the changed instances
+                // are re-baked. The adaptive bake's active list restarts instead
+                std::vector<std::array<glm::vec3, 2>> dirty_bounds;
+                const bool keep_bake = atlas_options.incremental &&
+                                       atlas_params.frame_id != 0 &&
+                                       !(compute_bake && adaptive) &&
+                                       find_changed_instances(bake_scene,
+                                                              new_scene,
+                                                              atlas_params.ao_length,
+                                                              dirty_bounds);
+                bake_scene = std::move(new_scene);
+                atlas_params.near_field_radius = bake_scene.near_field_radius;
+                accumulated_samples = 0;
+                bake_dirty = true;
+                if (keep_bake) {
+                    texel_gbuffer = build_texel_gbuffer(device.Get(),
+                                                        cmd_ctx,
+                                                        compute_pipeline,
+                                                        bake_scene,
+                                                        bake_target,
+                                                        false);
+                    resize_adaptive_lists(device.Get(), adaptive_bake, texel_gbuffer);
+                    resize_denoise_buffers(
+                        device.Get(), denoise_pipeline, texel_gbuffer, atlas_size);
+                    std::vector<glm::uvec2> tiles = mark_rebake_texels(device.Get(),
+                                                                       cmd_ctx,
+                                                                       rebake_pipeline,
+                                                                       bake_target,
+                                                                       texel_gbuffer,
+                                                                       atlas_size,
+                                                                       dirty_bounds,
+                                                                       options.tile_size,
+                                                                       profiler);
+                    std::cout << "Atlas layout kept, re-baking " << tiles.size()
+                              << " tiles near the changed instances\n";
+                    merge_rebake_tiles(rebake_tiles, tiles);
+                } else {
+                    atlas_size = bake_scene.atlas_size;
+                    bake_target = create_bake_target(
+                        device.Get(), atlas_size, bake_outputs, DXGI_FORMAT_R8G8B8A8_UNORM);
+                    write_compute_bake_output(device.Get(), compute_pipeline, bake_target);
+                    texel_gbuffer = TexelGBuffer();
+                    atlas_params.dimensions = glm::ivec2(atlas_size);
+                    atlas_params.frame_id = 0;
+                    build_preview_levels(device.Get(),
+                                         cmd_ctx,
+                                         compute_pipeline,
+                                         preview,
+                                         bake_scene,
+                                         options.preview_scale);
+                }
+
+                loaded_transforms.clear();
+                for (const auto &inst : bake_scene.scene_bvh.instances) {
+                    loaded_transforms.push_back(inst.transform);
+                }
+                edit_instance = 0;
+                edit_offset = glm::vec3(0.f);
+            }
+        }
+
+        if (move_instance) {
+            move_instance = false;
+            std::vector<std::array<glm::vec3, 2>> dirty_bounds;
+            update_instance_transform(
+                device.Get(),
+                cmd_ctx,
+                bake_scene,
+                edit_instance,
+                glm::translate(glm::mat4(1.f), edit_offset) * loaded_transforms[edit_instance],
+                atlas_params.ao_length,
+                dirty_bounds,
+                profiler);
+
+            // The moved instance's texels have new positions, the rest of the AO image is
+            // kept as only the dirty texels are re-baked
+            texel_gbuffer = build_texel_gbuffer(
+                device.Get(), cmd_ctx, compute_pipeline, bake_scene, bake_target, false);
+            resize_adaptive_lists(device.Get(), adaptive_bake, texel_gbuffer);
+            resize_denoise_buffers(device.Get(), denoise_pipeline, texel_gbuffer, atlas_size);
+
+            // The adaptive bake's active list only holds unconverged texels, so it restarts
+            if (compute_bake && adaptive) {
+                atlas_params.frame_id = 0;
+            } else if (atlas_params.frame_id != 0) {
+                std::vector<glm::uvec2> tiles = mark_rebake_texels(device.Get(),
+                                                                   cmd_ctx,
+                                                                   rebake_pipeline,
+                                                                   bake_target,
+                                                                   texel_gbuffer,
+                                                                   atlas_size,
+                                                                   dirty_bounds,
+                                                                   options.tile_size,
+                                                                   profiler);
+                merge_rebake_tiles(rebake_tiles, tiles);
+            }
+            accumulated_samples = 0;
+            bake_dirty = true;
+            // A move before the full atlas has started previews the moved scene
+            if (atlas_params.frame_id == 0) {
+                restart_preview(preview);
+            }
+        }
+
+        if (!accumulate && (bake_dirty || refresh_ao)) {
+            atlas_params.frame_id = 0;
+            accumulated_samples = 0;
+        }
+        if (atlas_params.frame_id == 0) {
+            rebake_tiles.clear();
+        }
+
+        // The preview levels are baked before the full atlas, whose frames start once
+        // they're done. Without accumulation each frame takes all the samples, so there's
+        // nothing to preview
+        const bool previewing = accumulate && preview.level < preview.levels.size();
+
+        // The dilation, denoiser and preview upsampling also need the texel G-buffer
+        if ((compute_bake || gutter > 0 || denoise_settings.enabled || previewing) &&
+            texel_gbuffer.texels.size() == 0) {
+            texel_gbuffer = build_texel_gbuffer(
+                device.Get(), cmd_ctx, compute_pipeline, bake_scene, bake_target, true);
+            resize_adaptive_lists(device.Get(), adaptive_bake, texel_gbuffer);
+            resize_denoise_buffers(device.Get(), denoise_pipeline, texel_gbuffer, atlas_size);
+        }
+
+        // The budget is recomputed when the G-buffer is rebuilt or the budget changes
+        const bool budgeted = compute_bake && !adaptive && !wavefront && use_ray_budget;
+        if (budgeted && texel_gbuffer.sample_budget.size() == 0) {
+            compute_sample_budget(device.Get(),
+                                  cmd_ctx,
+                                  sample_budget_pipeline,
+                                  bake_scene,
+                                  texel_gbuffer,
+                                  ray_budget_mrays * 1e6,
+                                  profiler);
+        } else if (!budgeted && texel_gbuffer.sample_budget.size() != 0) {
+            texel_gbuffer.sample_budget = dxr::Buffer();
+        }
+
+        AtlasParams frame_params = atlas_params;
+        if (budgeted) {
+            // Texels stop accumulating once they've taken their budgeted samples
+            frame_params.n_samples = std::max(int(sample_budget_pipeline.max_samples), 1);
+        }
+        if (!accumulate) {
+            frame_params.samples_per_frame = frame_params.n_samples;
+        }
+        // Once the texels have taken all their samples the loop stops baking and idles,
+        // only redrawing the UI, until a change restarts the accumulation. A change to how
+        // the AO image is post-processed or shown bakes one more frame to rewrite it, which
+        // traces no rays as the texels are done. Without accumulation the bake is done once
+        // a frame has baked with nothing changed since
+        const bool converged =
+            accumulate ? !previewing && atlas_params.frame_id != 0 &&
+                             (accumulated_samples >= frame_params.n_samples ||
+                              (compute_bake && adaptive && adaptive_bake.num_active == 0))
+                       : !bake_dirty;
+        const bool bake_ao = !converged || refresh_ao;
+        refresh_ao = false;
+        if (bake_ao) {
+            if (!previewing) {
+                accumulated_samples =
+                    std::min(accumulated_samples + frame_params.samples_per_frame,
+                             frame_params.n_samples);
+            }
+            BakeTarget &stats_target =
+                previewing ? preview.levels[preview.level] : bake_target;
+            begin_ray_stats(cmd_ctx, ray_stats_query, stats_target);
+            if (previewing) {
+                bake_preview_frame(cmd_ctx,
+                                   bake_pipeline,
+                                   compute_pipeline,
+                                   preview,
+                                   bake_scene,
+                                   bake_target,
+                                   texel_gbuffer,
+                                   frame_params,
+                                   options.tile_size,
+                                   profiler);
+            } else if (compute_bake) {
+                if (adaptive) {
+                    bake_frame_adaptive(cmd_ctx,
+                                        compute_pipeline,
+                                        adaptive_bake,
+                                        bake_scene,
+                                        bake_target,
+                                        texel_gbuffer,
+                                        frame_params,
+                                        adaptive_settings,
+                                        options.tile_size,
+                                        profiler);
+                } else if (wavefront) {
+                    bake_frame_wavefront(cmd_ctx,
+                                         compute_pipeline,
+                                         wavefront_pipeline,
+                                         bake_scene,
+                                         bake_target,
+                                         texel_gbuffer,
+                                         frame_params,
+                                         options.tile_size,
+                                         profiler);
+                } else {
+                    bake_frame_compute(cmd_ctx,
+                                       compute_pipeline,
+                                       bake_scene,
+                                       bake_target,
+                                       texel_gbuffer,
+                                       frame_params,
+                                       options.tile_size,
+                                       profiler,
+                                       raygen_bake ? &raygen_pipeline : nullptr);
+                }
+            } else {
+                bake_frame(cmd_ctx,
+                           bake_pipeline,
+                           bake_scene,
+                           bake_target,
+                           frame_params,
+                           options.tile_size,
+                           rebake_tiles,
+                           profiler);
+            }
+            ray_stats = end_ray_stats(cmd_ctx, ray_stats_query, stats_target);
+            render_time = ray_stats.gpu_ms;
+            if (render_time > 0.f) {
+                rays_per_second = ray_stats.rays / (render_time * 1.0e-3f);
+                if (compute_bake && !adaptive && !wavefront) {
+                    backend_mrays[raygen_bake ? 1 : 0] = rays_per_second * 1.0e-6f;
+                }
+            }
+            // The heatmap isn't denoised or dilated, as they write the AO
+            if (!previewing && !(compute_bake && adaptive && adaptive_settings.show_heatmap)) {
+                if (denoise_settings.enabled) {
+                    denoise_ao_image(cmd_ctx,
+                                     compute_pipeline,
+                                     denoise_pipeline,
+                                     bake_target,
+                                     texel_gbuffer,
+                                     denoise_settings,
+                                     profiler);
+                }
+                dxr::Buffer &ao_source = denoise_settings.enabled
+                                             ? denoise_pipeline.denoised_accum
+                                             : bake_target.accum_buf;
+                dilate_ao_image(cmd_ctx,
+                                compute_pipeline,
+                                dilate_pipeline,
+                                bake_target,
+                                texel_gbuffer,
+                                ao_source,
+                                gutter,
+                                profiler);
+            }
+
+            // The finest preview fades out as the full atlas takes its first samples. The
+            // adaptive bake only rewrites its unconverged texels, so it switches over directly
+            if (!previewing && preview.handoff_samples > 0) {
+                if (accumulated_samples < preview.handoff_samples && rebake_tiles.empty() &&
+                    !(compute_bake && adaptive)) {
+                    upsample_preview(cmd_ctx,
+                                     compute_pipeline,
+                                     preview,
+                                     preview.levels.size() - 1,
+                                     bake_target,
+                                     texel_gbuffer,
+                                     preview.handoff_samples,
+                                     profiler);
+                } else {
+                    preview.handoff_samples = 0;
+                }
+            }
+        }
+
+        ++frame_id;
+        if (bake_ao && !previewing) {
+            ++atlas_params.frame_id;
+            bake_dirty = false;
+        }
+
+        if (save_image) {
+            // Saving doesn't stall the UI, the image is encoded on the readback's worker
+            write_ao_image_async(cmd_ctx, ao_readback, bake_target.ao_image, image_output);
+            if (bake_outputs != 0) {
+                write_bake_outputs(device.Get(),
+                                   cmd_ctx,
+                                   bc_pipeline,
+                                   bake_target,
+                                   options,
+                                   atlas_params.ao_length);
+            }
+            save_image = false;
+        }
+
+        display->new_frame();
+
+        ImGui_ImplSDL2_NewFrame(window);
+        ImGui::NewFrame();
+
+        ImGui::Begin("Render Info");
+        ImGui::Text("Total Application Time: %.3f ms/frame (%.1f FPS)",
+                    1000.0f / ImGui::GetIO().Framerate,
+                    ImGui::GetIO().Framerate);
+        ImGui::Text("RT Backend: %s", rt_backend.c_str());
+        ImGui::Text("CPU: %s", cpu_brand.c_str());
+        ImGui::Text("GPU: %s", gpu_brand.c_str());
+        ImGui::Text("Bake Time: %.3f ms/frame (%.1f MRay/s)",
+                    render_time,
+                    rays_per_second * 1.0e-6f);
+        ImGui::Text("Rays/Frame: %s, %.1f%% hit, %u active texels",
+                    pretty_print_count(ray_stats.rays).c_str(),
+                    100.0 * ray_stats.hits / std::max(ray_stats.rays, uint64_t(1)),
+                    ray_stats.active_texels);
+        if (previewing) {
+            ImGui::Text("Status: Previewing");
+        } else if (converged) {
+            ImGui::Text("Status: Converged, idle");
+        } else {
+            ImGui::Text("Status: Baking");
+        }
+        bool reset_accumulation =
+            ImGui::SliderInt("AO Samples", &atlas_params.n_samples, 1, 4096);
+        reset_accumulation |=
+            ImGui::SliderFloat("AO Length", &atlas_params.ao_length, 0.1, 10.f);
+        int sampler_type = atlas_params.sampler_type;
+        if (ImGui::Combo(
+                "Sampler", &sampler_type, sampler_names.data(), sampler_names.size())) {
+            atlas_params.sampler_type = sampler_type;
+            reset_accumulation = true;
+        }
+        reset_accumulation |= ImGui::Checkbox("Accumulate Samples", &accumulate);
+        reset_accumulation |= ImGui::Checkbox("Compute Bake", &compute_bake);
+        if (compute_bake) {
+            reset_accumulation |= ImGui::Checkbox("Adaptive Sampling", &adaptive);
+            if (!adaptive) {
+                reset_accumulation |= ImGui::Checkbox("Wavefront Rays", &wavefront);
+            }
+            if (!adaptive && !wavefront) {
+                reset_accumulation |= ImGui::Checkbox("DispatchRays Bake", &raygen_bake);
+                ImGui::Text("Mrays/s: %.2f ray query, %.2f raygen",
+                            backend_mrays[0],
+                            backend_mrays[1]);
+            }
+        }
+        if (compute_bake && !adaptive && !wavefront) {
+            reset_accumulation |= ImGui::Checkbox("Ray Budget", &use_ray_budget);
+        }
+        if (budgeted) {
+            if (ImGui::SliderFloat(
+                    "Budget (MRays)", &ray_budget_mrays, 1.f, 16384.f, "%.0f", 3.f)) {
+                // Recomputed next frame
+                texel_gbuffer.sample_budget = dxr::Buffer();
+                reset_accumulation = true;
+            }
+            ImGui::Text("Budgeted: %s samples, up to %u/texel",
+                        pretty_print_count(sample_budget_pipeline.total_samples).c_str(),
+                        sample_budget_pipeline.max_samples);
+        }
+        if (compute_bake && adaptive) {
+            reset_accumulation |= ImGui::SliderFloat("Error Threshold",
+                                                     &adaptive_settings.error_threshold,
+                                                     0.001f,
+                                                     0.1f,
+                                                     "%.4f",
+                                                     3.f);
+            reset_accumulation |=
+                ImGui::SliderInt("Min Samples", &adaptive_settings.min_samples, 1, 256);
+            refresh_ao |=
+                ImGui::Checkbox("Show Sample Heatmap", &adaptive_settings.show_heatmap);
+            ImGui::Text("Active Texels: %u/%u",
+                        adaptive_bake.num_active,
+                        texel_gbuffer.num_texels);
+            const uint64_t uniform_rays =
+                uint64_t(texel_gbuffer.num_texels) * accumulated_samples;
+            ImGui::Text("Rays Traced: %s (uniform: %s)",
+                        pretty_print_count(adaptive_bake.rays_traced).c_str(),
+                        pretty_print_count(uniform_rays).c_str());
+        }
+        if (ImGui::Checkbox("Denoise", &denoise_settings.enabled)) {
+            if (denoise_settings.enabled) {
+                refresh_ao = true;
+            } else {
+                // The next frame rewrites the covered texels with the noisy AO
+                reset_accumulation = true;
+            }
+        }
+        if (denoise_settings.enabled) {
+            refresh_ao |=
+                ImGui::SliderInt("Denoise Iterations", &denoise_settings.iterations, 1, 8);
+            refresh_ao |=
+                ImGui::SliderFloat("Sigma AO", &denoise_settings.sigma_ao, 0.01f, 4.f);
+            refresh_ao |=
+                ImGui::SliderFloat("Sigma Normal", &denoise_settings.sigma_normal, 1.f, 256.f);
+            refresh_ao |= ImGui::SliderFloat(
+                "Sigma Position", &denoise_settings.sigma_position, 0.1f, 8.f);
+        }
+        if (ImGui::SliderInt("Gutter", &gutter, 0, max_gutter)) {
+            // Clear the previously filled gutter, the next frame rewrites the covered texels
+            clear_ao_image(cmd_ctx, bake_target);
+            reset_accumulation = true;
+        }
+        if (compute_bake && texel_gbuffer.texels.size() != 0) {
+            ImGui::Text("Texel G-buffer: %u texels, built in %.2f ms",
+                        texel_gbuffer.num_texels,
+                        texel_gbuffer.build_ms);
+        }
+        if (accumulate) {
+            ImGui::SliderInt("Samples/Frame", &atlas_params.samples_per_frame, 1, 64);
+            ImGui::Text("Accumulated: %d/%d spp", accumulated_samples, frame_params.n_samples);
+            if (preview.level < preview.levels.size()) {
+                const glm::uvec2 dims = preview.levels[preview.level].ao_image.dims();
+                ImGui::Text("Preview %d/%d: %dx%d, %d/%d spp",
+                            int(preview.level + 1),
+                            int(preview.levels.size()),
+                            dims.x,
+                            dims.y,
+                            preview.accumulated_samples,
+                            preview_level_samples(
+                                preview, preview.level, frame_params.n_samples));
+            }
+        }
+        if (reset_accumulation) {
+            atlas_params.frame_id = 0;
+            accumulated_samples = 0;
+            bake_dirty = true;
+            restart_preview(preview);
+        }
+        if (ImGui::Button("Save AO Map")) {
+            save_image = true;
+        }
+
+        if (ImGui::CollapsingHeader("Atlas")) {
+            ImGui::Text("Resolution: %ux%u", atlas_size.x, atlas_size.y);
+            ImGui::TextWrapped("Bake Cost: %s",
+                               bake_cost_summary(atlas_size,
+                                                 atlas_params.n_samples,
+                                                 bake_bytes_per_texel(options))
+                                   .c_str());
+            ImGui::Text("xatlas Threads: %u", atlas_thread_count());
+            auto &chart = atlas_options.chart_options;
+            auto &pack = atlas_options.pack_options;
+            ImGui::InputFloat("Texels/Unit", &pack.texelsPerUnit);
+            int resolution = pack.resolution;
+            if (ImGui::InputInt("Resolution", &resolution)) {
+                pack.resolution = std::max(resolution, 0);
+            }
+            float budget_mtexels = atlas_options.texel_budget / 1e6f;
+            if (ImGui::InputFloat("Budget (MTexels)", &budget_mtexels)) {
+                atlas_options.texel_budget =
+                    static_cast<uint64_t>(std::max(budget_mtexels, 0.f) * 1e6);
+            }
+            int max_iterations = chart.maxIterations;
+            if (ImGui::SliderInt("Max Iterations", &max_iterations, 1, 8)) {
+                chart.maxIterations = max_iterations;
+            }
+            ImGui::Checkbox("Brute Force Packing", &pack.bruteForce);
+            ImGui::Checkbox("Block Align", &pack.blockAlign);
+            if (ImGui::Button("Fast Preview Settings")) {
+                set_fast_atlas_options(atlas_options);
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Regenerate Atlas")) {
+                regenerate_atlas = true;
+            }
+        }
+        if (ImGui::CollapsingHeader("BVH")) {
+            // Auto isn't offered, the profile is picked directly
+            int profile = static_cast<int>(bvh_profile) - 1;
+            if (ImGui::Combo("Build Profile",
+                             &profile,
+                             bvh_profile_names.data() + 1,
+                             bvh_profile_names.size() - 1)) {
+                bvh_profile = profile + 1;
+                rebuild_bvhs = true;
+            }
+            if (bvh_build_stats.num_build_groups != 0) {
+                ImGui::Text("BLAS Build: %.2f ms, Compaction: %.2f ms",
+                            bvh_build_stats.build_ms,
+                            bvh_build_stats.compaction_ms);
+                ImGui::Text("BLAS Size: %sb, TLAS Build: %.2f ms",
+                            pretty_print_count(bvh_build_stats.compacted_bytes).c_str(),
+                            bvh_tlas_ms);
+            }
+        }
+        if (ImGui::CollapsingHeader("Resource Heaps")) {
+            const char *pool_names[] = {"Buffers", "BVHs", "Textures", "Small Buffers"};
+            for (int i = 0; i < dxr::HeapAllocator::NUM_POOLS; ++i) {
+                const auto pool = static_cast<dxr::HeapAllocator::Pool>(i);
+                ImGui::Text("%s: %s",
+                            pool_names[i],
+                            heap_stats_summary(heap_allocator.stats(pool)).c_str());
+            }
+        }
+        if (ImGui::CollapsingHeader("Memory")) {
+            const dxr::MemoryTrackerStats memory = dxr::memory_tracker().stats();
+            ImGui::Text("Resources: %sb, Peak: %sb",
+                        pretty_print_count(memory.current_bytes).c_str(),
+                        pretty_print_count(memory.peak_bytes).c_str());
+            for (int i = 0; i < dxr::NUM_MEMORY_CATEGORIES; ++i) {
+                const dxr::MemoryCategoryStats &category = memory.categories[i];
+                if (category.peak_bytes == 0) {
+                    continue;
+                }
+                ImGui::Text("%s: %s",
+                            dxr::memory_category_name(dxr::MemoryCategory(i)),
+                            memory_category_summary(category).c_str());
+            }
+            const DXGI_QUERY_VIDEO_MEMORY_INFO vram = dxr::video_memory_info(device.Get());
+            ImGui::Text("VRAM: %sb of %sb budget",
+                        pretty_print_count(vram.CurrentUsage).c_str(),
+                        pretty_print_count(vram.Budget).c_str());
+            ImGui::Text("Host: %sb, Peak: %sb",
+                        pretty_print_count(process_memory()).c_str(),
+                        pretty_print_count(peak_process_memory()).c_str());
+            if (ImGui::Button("Reset Peaks")) {
+                dxr::memory_tracker().reset_peaks();
+            }
+        }
+        if (ImGui::CollapsingHeader("Edit") && !bake_scene.scene_bvh.instances.empty()) {
+            const int n_instances = bake_scene.scene_bvh.instances.size();
+            if (ImGui::SliderInt("Instance", &edit_instance, 0, n_instances - 1)) {
+                // Pick up the offset the selected instance was left at
+                edit_instance = glm::clamp(edit_instance, 0, n_instances - 1);
+                const auto &inst = bake_scene.scene_bvh.instances[edit_instance];
+                const glm::mat4 &loaded = loaded_transforms[edit_instance];
+                edit_offset = glm::vec3(inst.transform[3]) - glm::vec3(loaded[3]);
+            }
+            move_instance |= ImGui::DragFloat3("Offset", &edit_offset.x, 0.05f);
+            if (ImGui::Button("Reset Instance")) {
+                edit_offset = glm::vec3(0.f);
+                move_instance = true;
+            }
+            if (!rebake_tiles.empty()) {
+                ImGui::Text("Re-baking %d tiles, %u texels marked by the last edit",
+                            int(rebake_tiles.size()),
+                            rebake_pipeline.dirty_texels);
+            }
+        }
+        if (ImGui::CollapsingHeader("GPU Profile")) {
+            ImGui::Columns(4, "gpu_profile");
+            ImGui::Text("Region");
+            ImGui::NextColumn();
+            ImGui::Text("Last (ms)");
+            ImGui::NextColumn();
+            ImGui::Text("Avg (ms)");
+            ImGui::NextColumn();
+            ImGui::Text("Max (ms)");
+            ImGui::NextColumn();
+            ImGui::Separator();
+            for (const auto &region : profiler.stats()) {
+                ImGui::Text("%s", region.name.c_str());
+                ImGui::NextColumn();
+                ImGui::Text("%.3f", region.last_ms());
+                ImGui::NextColumn();
+                ImGui::Text("%.3f", region.average_ms());
+                ImGui::NextColumn();
+                ImGui::Text("%.3f", region.max_ms());
+                ImGui::NextColumn();
+            }
+            ImGui::Columns(1);
+            if (ImGui::Button("Export Profile")) {
+                write_gpu_profile(options.profile_output.empty() ? "dxr_ao_bake_profile.json"
+                                                                 : options.profile_output,
+                                  profiler);
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Clear Profile")) {
+                profiler.clear();
+            }
+        }
+        ImGui::Text("%s", bake_scene.scene_info.c_str());
+
+        ImGui::End();
+        ImGui::Render();
+
+        // Presenting is throttled to the display rate and skipped while the window can't be
+        // seen, so the bake runs a frame each iteration without waiting on vsync or sharing
+        // the GPU with presents nobody sees. The display's frame isn't waited on, the next
+        // frame is prepared while it runs. The bake queue waits for it on the GPU before
+        // writing the AO image it reads from, and before resolving the timestamps of its
+        // display region
+        const auto now = std::chrono::steady_clock::now();
+        const bool window_hidden =
+            SDL_GetWindowFlags(window) & (SDL_WINDOW_MINIMIZED | SDL_WINDOW_HIDDEN);
+        if (!window_hidden && now >= next_present && display->can_present()) {
+            next_present = now + display_interval;
+            display->display_native(bake_target.ao_image, &profiler);
+            display->queue_wait_frames(cmd_ctx.queue.Get());
+        }
+        resolve_gpu_profile_async(cmd_ctx, profiler);
+
+        // While idle the loop only runs at the display rate, waking early for input. The
+        // changes made in the UI this frame are picked up without waiting
+        const bool changed = refresh_ao || save_image || regenerate_atlas || rebuild_bvhs ||
+                             move_instance || atlas_params.frame_id == 0;
+        if (converged && !changed) {
+            const auto wait = window_hidden ? display_interval : next_present - now;
+            const auto wait_ms =
+                std::chrono::duration_cast<std::chrono::milliseconds>(wait).count();
+            SDL_WaitEventTimeout(nullptr, std::max(int(wait_ms), 1));
+        }
+    }
+    display->wait_idle();
+    cmd_ctx.sync();
+    ao_readback.flush();
+}
+
+void run_headless_bake(const AppOptions &options)
+{
+#ifdef DXR_AO_EMBREE
+    // Without a D3D12 device or DXR 1.1 support the bake falls back to the CPU
+    ComPtr<ID3D12Device5> device;
+    try {
+        device = dxr::create_device();
+    } catch (const std::runtime_error &) {
+    }
+    if (!device || !dxr::dxr_available(device)) {
+        std::cout << "Warning: DXR 1.1 is not supported, baking on the CPU with Embree\n";
+        run_cpu_headless_bake(options);
+        return;
+    }
+#else
+    ComPtr<ID3D12Device5> device = dxr::create_device();
+    if (!dxr::dxr_available(device)) {
+        std::cout << "DXR 1.1 is required for inline ray tracing, but is not supported\n";
+        throw std::runtime_error("DXR 1.1 is not supported");
+    }
+#endif
+
+    dxr::HeapAllocator heap_allocator(device.Get());
+    if (options.placed_resources) {
+        dxr::set_resource_allocator(&heap_allocator);
+    }
+    std::unique_ptr<dxr::PipelineCache> pipeline_cache =
+        open_pipeline_cache(device.Get(), options);
+    dxr::CommandContext cmd_ctx(device.Get());
+    dxr::GpuProfiler profiler(device.Get(), cmd_ctx.queue.Get(), gpu_profiler_regions);
+
+    const uint32_t bvh_profile = resolve_bvh_profile(options.bvh_profile, options.n_samples);
+    // The multi-GPU bake keeps the unwrapped scene to upload it to the other devices
+    BakeSceneSource scene_source;
+    BakeScene bake_scene = load_bake_scene(options.scene_file,
+                                           options.scene_load,
+                                           options.atlas_options,
+                                           bvh_profile,
+                                           device.Get(),
+                                           cmd_ctx,
+                                           nullptr,
+                                           profiler,
+                                           options.multi_gpu ? &scene_source : nullptr);
+    dxr::AsyncReadback readback(device.Get());
+    HeadlessPipelines pipelines;
+    bake_headless_scene(device.Get(),
+                        cmd_ctx,
+                        profiler,
+                        options,
+                        bake_scene,
+                        scene_source,
+                        options.placed_resources ? &heap_allocator : nullptr,
+                        pipeline_cache.get(),
+                        readback,
+                        pipelines);
+    readback.flush();
+    print_memory_stats(device.Get());
+}
+
+void run_vertex_ao_bake(const AppOptions &options)
+{
+    TRACE_SCOPE("Vertex AO Bake");
+    ComPtr<ID3D12Device5> device = dxr::create_device();
+    if (!dxr::dxr_available(device)) {
+        std::cout << "DXR 1.1 is required for inline ray tracing, but is not supported\n";
+        throw std::runtime_error("DXR 1.1 is not supported");
+    }
+    dxr::CommandContext cmd_ctx(device.Get());
+    dxr::GpuProfiler profiler(device.Get(), cmd_ctx.queue.Get(), gpu_profiler_regions);
+
+    // The textures are loaded for the alpha test, the rest of the materials are unused
+    Scene scene(options.scene_file, options.scene_load.texture_load);
+    GeometrySplitStats split_stats;
+    split_oversized_geometries(scene, options.scene_load.split_limits, split_stats);
+    AlphaTestStats alpha_stats;
+    const std::vector<AlphaTestedGeometry> alpha_geometries =
+        split_alpha_tested_geometry(scene, alpha_stats);
+    std::cout << "Scene '" << options.scene_file << "':\n"
+              << "# Unique Triangles: " << pretty_print_count(scene.unique_tris()) << "\n"
+              << "# Total Triangles: " << pretty_print_count(scene.total_tris()) << "\n"
+              << "# Meshes: " << scene.meshes.size() << "\n"
+              << "# Instances: " << scene.instances.size() << "\n";
+
+    // There's no atlas to unwrap, the scene is only uploaded to build its BVHs. The
+    // occluder proxies aren't built, so the rays trace the full-res geometry
+    BakeScene bake_scene;
+    bake_scene.bvh_profile = resolve_bvh_profile(options.bvh_profile, options.n_samples);
+    compute_scene_bounds(scene, bake_scene);
+    dxr::UploadRing upload_ring(device.Get(), upload_ring_size);
+    const BvhBuildFlags build_flags = bvh_build_flags(bake_scene.bvh_profile);
+    dxr::MeshBuildStats build_stats;
+    build_or_load_blases(device.Get(),
+                         cmd_ctx,
+                         nullptr,
+                         upload_ring,
+                         bake_scene,
+                         &scene.meshes,
+                         bake_scene.meshes,
+                         build_flags.blas,
+                         build_stats,
+                         profiler);
+    print_blas_build_stats(build_stats);
+    upload_alpha_test(
+        device.Get(), cmd_ctx, upload_ring, bake_scene, scene, alpha_geometries);
+    std::vector<dxr::TlasInstance> tlas_instances;
+    tlas_instances.reserve(scene.instances.size());
+    for (const auto &inst : scene.instances) {
+        tlas_instances.emplace_back(inst.transform, inst.mesh_id);
+    }
+    const double tlas_ms = build_scene_tlas(device.Get(),
+                                            cmd_ctx,
+                                            upload_ring,
+                                            bake_scene,
+                                            std::move(tlas_instances),
+                                            build_flags.tlas,
+                                            profiler);
+    std::cout << "TLAS build: " << tlas_ms << "ms\n";
+
+    if (options.sampler_type == SAMPLER_BLUE_NOISE) {
+        std::cout << "Warning: The vertex AO bake has no blue noise sampler, using r2\n";
+    }
+    VertexAOParams params;
+    params.n_samples = options.n_samples;
+    params.samples_per_frame =
+        options.samples_per_frame > 0 ? options.samples_per_frame : options.n_samples;
+    params.ao_length = options.ao_length;
+    params.ray_offset =
+        vertex_ao_ray_offset * glm::length(bake_scene.world_upper - bake_scene.world_lower);
+    params.sampler_type =
+        options.sampler_type == SAMPLER_BLUE_NOISE ? SAMPLER_R2 : options.sampler_type;
+    params.sampler_seed = options.sampler_seed;
+    const uint32_t n_frames =
+        (params.n_samples + params.samples_per_frame - 1) / params.samples_per_frame;
+
+    VertexAOPipeline pipeline = create_vertex_ao_pipeline(device.Get());
+    dxr::Buffer vertex_buf = dxr::Buffer::default(device.Get(),
+                                                  vertex_ao_chunk_size * sizeof(VertexSample),
+                                                  D3D12_RESOURCE_STATE_COPY_DEST);
+    dxr::Buffer accum_buf =
+        dxr::Buffer::default(device.Get(),
+                             vertex_ao_chunk_size * sizeof(glm::vec2),
+                             D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                             D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+
+    // The AO of each instance's vertices is summed into its mesh's vertices, and the sums
+    // are divided by the mesh's instance count once the bake completes
+    VertexAO vertex_ao(scene.meshes.size());
+    std::vector<uint32_t> mesh_instance_count(scene.meshes.size(), 0);
+    for (size_t i = 0; i < scene.meshes.size(); ++i) {
+        for (const auto &geom : scene.meshes[i].geometries) {
+            vertex_ao[i].emplace_back(geom.vertex_data().size(), 0.f);
+        }
+    }
+
+    // Each chunk's vertices and the mesh vertices they're summed into
+    std::vector<VertexSample> chunk;
+    std::vector<float *> chunk_ao;
+    chunk.reserve(vertex_ao_chunk_size);
+    chunk_ao.reserve(vertex_ao_chunk_size);
+    size_t total_vertices = 0;
+    double bake_ms = 0.0;
+    auto bake_chunk = [&]() {
+        if (chunk.empty()) {
+            return;
+        }
+        params.num_vertices = chunk.size();
+        cmd_ctx.begin();
+        upload_ring.upload(
+            cmd_ctx, vertex_buf, chunk.data(), chunk.size() * sizeof(VertexSample));
+        auto b =
+            barrier_transition(vertex_buf, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
+        cmd_ctx.cmd_list->ResourceBarrier(1, &b);
+        upload_ring.submit_and_sync(cmd_ctx);
+
+        const auto start = std::chrono::steady_clock::now();
+        for (uint32_t f = 0; f < n_frames; ++f) {
+            params.frame_id = f;
+            cmd_ctx.begin();
+            auto &cmd_list = cmd_ctx.cmd_list;
+            const uint32_t region = profiler.begin(cmd_list.Get(), "Vertex AO");
+            cmd_list->SetPipelineState(pipeline.pipeline.Get());
+            cmd_list->SetComputeRootSignature(pipeline.signature.get());
+            cmd_list->SetComputeRoot32BitConstants(0, 9, &params, 0);
+            cmd_list->SetComputeRootShaderResourceView(
+                1, bake_scene.scene_bvh->GetGPUVirtualAddress());
+            cmd_list->SetComputeRootShaderResourceView(2, vertex_buf->GetGPUVirtualAddress());
+            cmd_list->SetComputeRootUnorderedAccessView(3, accum_buf->GetGPUVirtualAddress());
+            cmd_list->SetComputeRootShaderResourceView(4, alpha_test_address(bake_scene));
+            cmd_list->Dispatch((params.num_vertices + 63) / 64, 1, 1);
+            b = dxr::barrier_uav(accum_buf);
+            cmd_list->ResourceBarrier(1, &b);
+            profiler.end(cmd_list.Get(), region);
+            cmd_ctx.submit_and_sync();
+        }
+        bake_ms += std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+        const std::vector<uint8_t> accum_data =
+            read_back_buffer(device.Get(), cmd_ctx, accum_buf);
+        const glm::vec2 *accum = reinterpret_cast<const glm::vec2 *>(accum_data.data());
+        for (size_t v = 0; v < chunk.size(); ++v) {
+            *chunk_ao[v] += accum[v].y > 0.f ? accum[v].x / accum[v].y : 1.f;
+        }
+
+        cmd_ctx.begin();
+        b = barrier_transition(vertex_buf, D3D12_RESOURCE_STATE_COPY_DEST);
+        cmd_ctx.cmd_list->ResourceBarrier(1, &b);
+        cmd_ctx.submit_and_sync();
+        params.first_vertex += chunk.size();
+        total_vertices += chunk.size();
+        chunk.clear();
+        chunk_ao.clear();
+    };
+
+    for (const auto &inst : scene.instances) {
+        ++mesh_instance_count[inst.mesh_id];
+        const glm::mat3 normal_transform = glm::transpose(glm::inverse(inst.transform));
+        const auto &geometries = scene.meshes[inst.mesh_id].geometries;
+        for (size_t j = 0; j < geometries.size(); ++j) {
+            const ArrayView<glm::vec3> vertices = geometries[j].vertex_data();
+            const ArrayView<glm::vec3> normals = geometries[j].normal_data();
+            std::vector<float> &geom_ao = vertex_ao[inst.mesh_id][j];
+            for (size_t v = 0; v < vertices.size(); ++v) {
+                VertexSample s;
+                s.position = glm::vec3(inst.transform * glm::vec4(vertices[v], 1.f));
+                s.normal = v < normals.size() ? normal_transform * normals[v] : glm::vec3(0.f);
+                chunk.push_back(s);
+                chunk_ao.push_back(&geom_ao[v]);
+                if (chunk.size() == vertex_ao_chunk_size) {
+                    bake_chunk();
+                }
+            }
+        }
+    }
+    bake_chunk();
+
+    const uint64_t total_rays = uint64_t(total_vertices) * params.n_samples;
+    std::cout << "Vertex AO bake of " << pretty_print_count(total_vertices) << " vertices x "
+              << params.n_samples << " spp took " << bake_ms << "ms, "
+              << total_rays * 1e-3 / std::max(bake_ms, 1e-6) << " Mrays/s\n";
+
+    for (size_t i = 0; i < vertex_ao.size(); ++i) {
+        const float scale = 1.f / std::max(mesh_instance_count[i], 1u);
+        for (auto &geom_ao : vertex_ao[i]) {
+            for (auto &ao : geom_ao) {
+                // Meshes without instances weren't baked and are left unoccluded
+                ao = mesh_instance_count[i] > 0 ? ao * scale : 1.f;
+            }
+        }
+    }
+    if (!write_vertex_ao_gltf(options.vertex_ao_output, scene, vertex_ao)) {
+        std::cout << "Error: Failed to write " << options.vertex_ao_output << "\n";
+        throw std::runtime_error("Failed to write " + options.vertex_ao_output);
+    }
+}
+
+#ifdef DXR_AO_EMBREE
+void run_cpu_headless_bake(const AppOptions &options)
+{
+    TRACE_SCOPE("CPU Headless Bake");
+    if (options.sampler_type == SAMPLER_BLUE_NOISE) {
+        std::cout << "Warning: The CPU bake has no blue noise sampler, using r2\n";
+    }
+
+    Scene scene(options.scene_file, LOAD_NO_TEXTURES);
+    std::cout << "Scene '" << options.scene_file << "':\n"
+              << "# Unique Triangles: " << pretty_print_count(scene.unique_tris()) << "\n"
+              << "# Total Triangles: " << pretty_print_count(scene.total_tris()) << "\n";
+
+    const AtlasResult atlas =
+        unwrap_meshes(scene.meshes, scene.instances, options.atlas_options);
+    if (atlas.size.x == 0 || atlas.size.y == 0) {
+        std::cout << "Error: The unwrap produced an empty atlas\n";
+        throw std::runtime_error("The unwrap produced an empty atlas");
+    }
+    std::cout << "Atlas size: " << atlas.size.x << "x" << atlas.size.y << "\n";
+
+    EmbreeBakeBackend backend;
+    std::cout << "Baking on " << backend.device_name() << "\n";
+    backend.set_scene(scene, atlas);
+    const double build_ms = backend.build_accel();
+    std::cout << "BVH built in " << build_ms << "ms\n";
+
+    BakeSettings settings;
+    settings.n_samples = options.n_samples;
+    settings.ao_length = options.ao_length;
+    settings.samples_per_frame =
+        options.samples_per_frame > 0 ? options.samples_per_frame : options.n_samples;
+    settings.sampler_type =
+        options.sampler_type == SAMPLER_BLUE_NOISE ? SAMPLER_R2 : options.sampler_type;
+    settings.sampler_seed = options.sampler_seed;
+
+    const uint32_t n_frames =
+        (settings.n_samples + settings.samples_per_frame - 1) / settings.samples_per_frame;
+    uint64_t total_rays = 0;
+    float total_ms = 0.f;
+    for (uint32_t frame_id = 0; frame_id < n_frames; ++frame_id) {
+        const BakeTileStats stats =
+            bake_frame(backend, atlas.size, options.tile_size, frame_id, settings);
+        total_rays += stats.rays;
+        total_ms += stats.gpu_ms;
+    }
+    std::cout << "Baked " << settings.n_samples << " samples in " << total_ms << "ms, "
+              << pretty_print_count(total_rays / std::max(total_ms * 1e-3, 1e-6))
+              << "Rays/s\n";
+
+    const std::vector<float> ao = backend.readback();
+    std::vector<uint8_t> pixels(ao.size(), 0);
+    for (size_t i = 0; i < ao.size(); ++i) {
+        pixels[i] = std::round(glm::clamp(ao[i], 0.f, 1.f) * 255.f);
+    }
+    encode_ao_image(pixels, atlas.size, DXGI_FORMAT_R8_UNORM, options.bake_output);
+}
+#endif
+
+RayStats bake_headless_scene(ID3D12Device5 *device,
+                             dxr::CommandContext &cmd_ctx,
+                             dxr::GpuProfiler &profiler,
+                             const AppOptions &options,
+                             BakeScene &bake_scene,
+                             BakeSceneSource &scene_source,
+                             dxr::HeapAllocator *heap_allocator,
+                             dxr::PipelineCache *pipeline_cache,
+                             dxr::AsyncReadback &readback,
+                             HeadlessPipelines &pipelines)
+{
+    TRACE_SCOPE("bake_headless_scene");
+    resolve_gpu_profile(cmd_ctx, profiler);
+    const glm::uvec2 atlas_size = bake_scene.atlas_size;
+    std::cout << "Predicted bake cost: "
+              << bake_cost_summary(
+                     atlas_size, options.n_samples, bake_bytes_per_texel(options))
+              << "\n";
+
+    const uint32_t bake_outputs = requested_bake_outputs(options);
+    std::vector<std::unique_ptr<BakeDevice>> bake_devices;
+    if (options.multi_gpu) {
+        bake_devices = create_bake_devices(
+            device, bake_scene, scene_source, bake_outputs, options.ao_format);
+        scene_source = BakeSceneSource();
+        std::cout << "Multi-GPU bake on " << bake_devices.size() + 1 << " device(s)\n";
+    }
+    if (heap_allocator) {
+        std::cout << "Resource heaps: " << heap_stats_summary(heap_allocator->stats())
+                  << "\n";
+    }
+    BakeTarget bake_target =
+        create_bake_target(device, atlas_size, bake_outputs, options.ao_format);
+
+    auto bake_pipeline_it = pipelines.bake.find(options.ao_format);
+    if (bake_pipeline_it == pipelines.bake.end()) {
+        bake_pipeline_it =
+            pipelines.bake
+                .emplace(options.ao_format, create_bake_pipeline(device, options.ao_format))
+                .first;
+    }
+    BakePipeline &bake_pipeline = bake_pipeline_it->second;
+    if (!pipelines.block_compress.bc4) {
+        pipelines.block_compress = create_block_compress_pipeline(device);
+    }
+    BlockCompressPipeline &bc_pipeline = pipelines.block_compress;
+
+    // The pipelines below hold buffers sized for the scene, so are created for each one
+    dxr::RTPipeline raygen_pipeline;
+    WavefrontPipeline wavefront_pipeline;
+    AdaptiveBake adaptive_bake;
+    DenoisePipeline denoise_pipeline;
+    TexelGBuffer texel_gbuffer;
+    SampleBudgetPipeline sample_budget_pipeline;
+    const bool denoise = options.denoise_settings.enabled;
+    // The dilation and denoiser also need the texel G-buffer
+    const bool compute_passes = options.compute_bake || options.gutter > 0 || denoise;
+    if (compute_passes && !pipelines.compute.bake_pipeline_state) {
+        pipelines.compute = create_compute_bake_pipeline(device);
+        pipelines.dilate = create_dilate_pipeline(device, pipelines.compute);
+    }
+    ComputeBakePipeline &compute_pipeline = pipelines.compute;
+    DilatePipeline &dilate_pipeline = pipelines.dilate;
+    if (compute_passes) {
+        if (denoise) {
+            denoise_pipeline = create_denoise_pipeline(device, compute_pipeline);
+        }
+        if (options.adaptive) {
+            adaptive_bake = create_adaptive_bake(device, compute_pipeline);
+        } else if (options.wavefront) {
+            wavefront_pipeline = create_wavefront_pipeline(device, compute_pipeline);
+        } else if (options.raygen_bake || options.backend_benchmark) {
+            raygen_pipeline =
+                create_raygen_bake_pipeline(device, cmd_ctx, compute_pipeline);
+        }
+        write_compute_bake_output(device, compute_pipeline, bake_target);
+        texel_gbuffer = build_texel_gbuffer(
+            device, cmd_ctx, compute_pipeline, bake_scene, bake_target, true);
+        std::cout << "Texel G-buffer: " << texel_gbuffer.num_texels << " covered texels ("
+                  << 100.f * texel_gbuffer.num_texels / (atlas_size.x * float(atlas_size.y))
+                  << "% of the atlas), built in " << texel_gbuffer.build_ms << "ms\n";
+        if (options.adaptive) {
+            resize_adaptive_lists(device, adaptive_bake, texel_gbuffer);
+        }
+        if (denoise) {
+            resize_denoise_buffers(device, denoise_pipeline, texel_gbuffer, atlas_size);
+        }
+        if (options.ray_budget > 0.0) {
+            sample_budget_pipeline = create_sample_budget_pipeline(device);
+            compute_sample_budget(device,
+                                  cmd_ctx,
+                                  sample_budget_pipeline,
+                                  bake_scene,
+                                  texel_gbuffer,
+                                  options.ray_budget,
+                                  profiler);
+            std::cout << "Sample budget: "
+                      << pretty_print_count(sample_budget_pipeline.total_samples)
+                      << " samples for a budget of "
+                      << pretty_print_count(uint64_t(options.ray_budget)) << " rays, up to "
+                      << sample_budget_pipeline.max_samples << " samples/texel\n";
+        }
+    }
+    save_pipeline_cache(pipeline_cache);
+
+    AtlasParams atlas_params(atlas_size);
+    // Texels stop accumulating once they've taken their budgeted samples
+    const int n_samples = options.ray_budget > 0.0
+                              ? std::max(int(sample_budget_pipeline.max_samples), 1)
+                              : options.n_samples;
+    atlas_params.n_samples = n_samples;
+    atlas_params.ao_length = options.ao_length;
+    atlas_params.samples_per_frame =
+        options.samples_per_frame > 0 ? options.samples_per_frame : n_samples;
+    // The adaptive bake needs multiple rounds to stop tracing the converged texels
+    if (options.adaptive && options.samples_per_frame == 0) {
+        atlas_params.samples_per_frame =
+            std::max(std::min(options.adaptive_settings.min_samples, options.n_samples), 1);
+    }
+    atlas_params.sampler_type = options.sampler_type;
+    atlas_params.sampler_seed = options.sampler_seed;
+    atlas_params.bake_outputs = bake_outputs;
+    atlas_params.near_field_radius = bake_scene.near_field_radius;
+
+    std::cout << "Baking AO with " << atlas_params.n_samples
+              << " samples/texel, AO length: " << atlas_params.ao_length
+              << ", sampler: " << sampler_names[atlas_params.sampler_type] << "\n";
+    if (bake_outputs & BAKE_OUTPUT_DIRECT_LIGHT) {
+        if (bake_scene.num_lights == 0) {
+            std::cout << "Warning: The scene has no lights, the direct lighting is black\n";
+        } else {
+            std::cout << "Baking direct lighting from " << bake_scene.num_lights
+                      << " quad light(s)\n";
+        }
+    }
+
+    // Switched by the backend benchmark to measure each backend
+    bool use_raygen = options.raygen_bake;
+    auto bake_one_frame = [&]() {
+        if (options.adaptive) {
+            bake_frame_adaptive(cmd_ctx,
+                                compute_pipeline,
+                                adaptive_bake,
+                                bake_scene,
+                                bake_target,
+                                texel_gbuffer,
+                                atlas_params,
+                                options.adaptive_settings,
+                                options.tile_size,
+                                profiler);
+        } else if (options.wavefront) {
+            bake_frame_wavefront(cmd_ctx,
+                                 compute_pipeline,
+                                 wavefront_pipeline,
+                                 bake_scene,
+                                 bake_target,
+                                 texel_gbuffer,
+                                 atlas_params,
+                                 options.tile_size,
+                                 profiler);
+        } else if (options.compute_bake) {
+            bake_frame_compute(cmd_ctx,
+                               compute_pipeline,
+                               bake_scene,
+                               bake_target,
+                               texel_gbuffer,
+                               atlas_params,
+                               options.tile_size,
+                               profiler,
+                               use_raygen ? &raygen_pipeline : nullptr);
+        } else {
+            bake_frame(cmd_ctx,
+                       bake_pipeline,
+                       bake_scene,
+                       bake_target,
+                       atlas_params,
+                       options.tile_size,
+                       {},
+                       profiler);
+        }
+    };
+
+    RayStatsQuery ray_stats_query = create_ray_stats_query(device, cmd_ctx);
+    if (!options.bvh_benchmark_output.empty()) {
+        // Each profile bakes a few frames from scratch to measure its trace performance
+        std::vector<BvhBenchmarkResult> results;
+        for (const uint32_t profile : {BVH_PROFILE_FAST_BUILD, BVH_PROFILE_FAST_TRACE}) {
+            BvhBenchmarkResult result;
+            result.profile = profile;
+            // The BVH cache is skipped, the builds are what's measured
+            result.tlas_ms = rebuild_scene_bvhs(device,
+                                                cmd_ctx,
+                                                bake_scene,
+                                                profile,
+                                                false,
+                                                result.blas_stats,
+                                                profiler);
+            atlas_params.frame_id = 0;
+            for (int i = 0; i < bvh_benchmark_frames; ++i) {
+                begin_ray_stats(cmd_ctx, ray_stats_query, bake_target);
+                bake_one_frame();
+                const RayStats frame_stats =
+                    end_ray_stats(cmd_ctx, ray_stats_query, bake_target);
+                ++atlas_params.frame_id;
+                result.bake_stats.rays += frame_stats.rays;
+                result.bake_stats.hits += frame_stats.hits;
+                result.bake_stats.gpu_ms += frame_stats.gpu_ms;
+            }
+            resolve_gpu_profile(cmd_ctx, profiler);
+
+            const auto &b = result.blas_stats;
+            std::cout << "BVH profile " << bvh_profile_names[profile] << ": BLAS build "
+                      << b.build_ms << "ms, compaction " << b.compaction_ms << "ms, "
+                      << pretty_print_count(b.compacted_bytes) << "b, TLAS build "
+                      << result.tlas_ms << "ms, "
+                      << result.bake_stats.rays * 1e-3 /
+                             std::max(result.bake_stats.gpu_ms, 1e-6)
+                      << " Mrays/s\n";
+            results.push_back(result);
+        }
+        write_bvh_benchmark(
+            options.bvh_benchmark_output, dxr::adapter_desc(device), results);
+
+        // Return to the requested profile for the bake
+        dxr::MeshBuildStats build_stats;
+        rebuild_scene_bvhs(
+            device, cmd_ctx, bake_scene, bvh_profile, true, build_stats, profiler);
+        atlas_params.frame_id = 0;
+    }
+    if (options.backend_benchmark) {
+        // Each backend bakes the same frames from scratch on the same BVHs
+        std::array<RayStats, 2> backend_stats;
+        for (int raygen = 0; raygen < 2; ++raygen) {
+            use_raygen = raygen != 0;
+            atlas_params.frame_id = 0;
+            for (int i = 0; i < backend_benchmark_frames; ++i) {
+                begin_ray_stats(cmd_ctx, ray_stats_query, bake_target);
+                bake_one_frame();
+                const RayStats frame_stats =
+                    end_ray_stats(cmd_ctx, ray_stats_query, bake_target);
+                ++atlas_params.frame_id;
+                backend_stats[raygen].rays += frame_stats.rays;
+                backend_stats[raygen].gpu_ms += frame_stats.gpu_ms;
+            }
+            resolve_gpu_profile(cmd_ctx, profiler);
+        }
+        const double inline_mrays =
+            backend_stats[0].rays * 1e-3 / std::max(backend_stats[0].gpu_ms, 1e-6);
+        const double raygen_mrays =
+            backend_stats[1].rays * 1e-3 / std::max(backend_stats[1].gpu_ms, 1e-6);
+        std::cout << "Ray query bake: " << inline_mrays
+                  << " Mrays/s, raygen bake: " << raygen_mrays << " Mrays/s ("
+                  << raygen_mrays / std::max(inline_mrays, 1e-6) << "x)\n";
+
+        use_raygen = options.raygen_bake;
+        atlas_params.frame_id = 0;
+    }
+
+    RayStats total_stats;
+    double bake_ms = 0.0;
+    if (options.multi_gpu) {
+        const auto start = std::chrono::steady_clock::now();
+        total_stats = bake_multi_gpu_tiles(device,
+                                           cmd_ctx,
+                                           bake_pipeline,
+                                           bake_scene,
+                                           bake_target,
+                                           ray_stats_query,
+                                           atlas_params,
+                                           options.tile_size,
+                                           bake_devices,
+                                           profiler);
+        const auto end = std::chrono::steady_clock::now();
+        bake_ms = std::chrono::duration<double, std::milli>(end - start).count();
+    } else if (!options.distribute_dir.empty()) {
+        const auto start = std::chrono::steady_clock::now();
+        total_stats = bake_distributed_tiles(device,
+                                             cmd_ctx,
+                                             bake_pipeline,
+                                             bake_scene,
+                                             bake_target,
+                                             ray_stats_query,
+                                             atlas_params,
+                                             options,
+                                             profiler);
+        const auto end = std::chrono::steady_clock::now();
+        bake_ms = std::chrono::duration<double, std::milli>(end - start).count();
+    } else {
+        // Splitting the samples over multiple submissions bounds the length of each one
+        for (int accumulated = 0; accumulated < atlas_params.n_samples;
+             accumulated += atlas_params.samples_per_frame) {
+            const auto start = std::chrono::steady_clock::now();
+            begin_ray_stats(cmd_ctx, ray_stats_query, bake_target);
+            bake_one_frame();
+            const RayStats frame_stats = end_ray_stats(cmd_ctx, ray_stats_query, bake_target);
+            ++atlas_params.frame_id;
+            const auto end = std::chrono::steady_clock::now();
+            bake_ms += std::chrono::duration<double, std::milli>(end - start).count();
+            total_stats.rays += frame_stats.rays;
+            total_stats.hits += frame_stats.hits;
+            total_stats.gpu_ms += frame_stats.gpu_ms;
+            resolve_gpu_profile(cmd_ctx, profiler);
+
+            // The comparison isn't included in the bake time
+            if (!options.compare_reference.empty()) {
+                const int spp = std::min(accumulated + atlas_params.samples_per_frame,
+                                         atlas_params.n_samples);
+                const std::vector<uint8_t> img = ao_pixels_to_rgba8(
+                    read_back_ao_image(device, cmd_ctx, bake_target.ao_image),
+                    bake_target.ao_image.pixel_format());
+                std::cout << "RMSE at " << spp << " spp: "
+                          << ao_image_rmse(img, atlas_size, options.compare_reference)
+                          << "\n";
+            }
+            if (options.adaptive && adaptive_bake.num_active == 0) {
+                std::cout << "All texels converged after " << atlas_params.frame_id
+                          << " rounds\n";
+                break;
+            }
+        }
+    }
+    std::string bake_path = "Raster";
+    if (options.adaptive) {
+        bake_path = "Adaptive";
+    } else if (options.wavefront) {
+        bake_path = "Wavefront";
+    } else if (options.raygen_bake) {
+        bake_path = "Raygen";
+    } else if (options.compute_bake) {
+        bake_path = "Compute";
+    }
+    std::cout << bake_path << " AO bake took " << bake_ms << "ms (GPU: " << total_stats.gpu_ms
+              << "ms)\n";
+    const double n_rays = double(total_stats.rays);
+    std::cout << "Traced " << pretty_print_count(n_rays) << " rays, "
+              << 100.0 * total_stats.hits / std::max(n_rays, 1.0) << "% hit";
+    if (total_stats.gpu_ms > 0.0) {
+        std::cout << ", " << n_rays * 1e-3 / total_stats.gpu_ms << " Mrays/s";
+    }
+    std::cout << "\n";
+    if (options.compute_bake) {
+        // Without adaptive sampling every covered texel traces all n_samples rays
+        const double uniform_rays = double(texel_gbuffer.num_texels) * atlas_params.n_samples;
+        if (options.adaptive) {
+            std::cout << "Uniform sampling would trace " << pretty_print_count(uniform_rays)
+                      << " rays (" << uniform_rays / std::max(n_rays, 1.0) << "x)\n";
+        }
+    }
+
+    if (denoise) {
+        const auto start = std::chrono::steady_clock::now();
+        denoise_ao_image(cmd_ctx,
+                         compute_pipeline,
+                         denoise_pipeline,
+                         bake_target,
+                         texel_gbuffer,
+                         options.denoise_settings,
+                         profiler);
+        const auto end = std::chrono::steady_clock::now();
+        std::cout << "Denoising took "
+                  << std::chrono::duration<double, std::milli>(end - start).count()
+                  << "ms\n";
+    }
+    if (options.gutter > 0) {
+        dilate_ao_image(cmd_ctx,
+                        compute_pipeline,
+                        dilate_pipeline,
+                        bake_target,
+                        texel_gbuffer,
+                        denoise ? denoise_pipeline.denoised_accum : bake_target.accum_buf,
+                        options.gutter,
+                        profiler);
+    }
+    resolve_gpu_profile(cmd_ctx, profiler);
+    if (!options.profile_output.empty()) {
+        write_gpu_profile(options.profile_output, profiler);
+    }
+    // The AO map is encoded on the readback's worker while the extra maps are read back
+    if (options.compress_ao && get_file_extension(options.bake_output) == "dds") {
+        write_ao_image(device,
+                       cmd_ctx,
+                       bc_pipeline,
+                       bake_target.ao_image,
+                       options.bake_output,
+                       true);
+    } else {
+        write_ao_image_async(cmd_ctx, readback, bake_target.ao_image, options.bake_output);
+    }
+    if (bake_outputs != 0) {
+        write_bake_outputs(
+            device, cmd_ctx, bc_pipeline, bake_target, options, options.ao_length);
+    }
+    // The bake target is released on return, so only the AO map's encoding is left to the
+    // readback's worker
+    cmd_ctx.sync();
+    return total_stats;
+}
+
+bool load_cached_bake_scene(const std::string &scene_cache,
+                            uint64_t key,
+                            const SceneLoadOptions &load_options,
+                            ID3D12Device5 *device,
+                            dxr::CommandContext &cmd_ctx,
+                            dxr::GpuProfiler &profiler,
+                            BakeSceneSource *source,
+                            BakeScene &bake_scene)
+{
+    const auto start = std::chrono::steady_clock::now();
+    CachedScene cached;
+    if (!load_scene_cache(scene_cache, key, cached)) {
+        return false;
+    }
+    bake_scene.load_ms =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+            .count();
+    std::cout << "Loaded scene from cache " << scene_cache << " in " << bake_scene.load_ms
+              << "ms\n";
+    bake_scene.scene_info = cached.scene_info;
+    std::cout << bake_scene.scene_info << "\n";
+    compute_scene_bounds(cached.scene, bake_scene);
+    for (const auto &m : cached.scene.meshes) {
+        bake_scene.mesh_hashes.push_back(hash_mesh_geometry(m));
+    }
+    bake_scene.atlas_size = cached.atlas.size;
+    bake_scene.atlas_cache_key = cached.atlas.cache_key;
+    bake_scene.instance_regions = cached.atlas.instance_regions;
+    MeshProxies proxies = simplify_occluder_proxies(cached.scene, load_options, bake_scene);
+    classify_occluders(cached.scene, load_options, bake_scene);
+    const auto upload_start = std::chrono::steady_clock::now();
+    upload_bake_scene(device,
+                      cmd_ctx,
+                      cached.scene,
+                      cached.alpha_geometries,
+                      proxies,
+                      bake_scene,
+                      profiler);
+    bake_scene.upload_ms = std::chrono::duration<double, std::milli>(
+                               std::chrono::steady_clock::now() - upload_start)
+                               .count();
+    if (source) {
+        source->scene = std::move(cached.scene);
+        source->alpha_geometries = std::move(cached.alpha_geometries);
+        source->occluder_proxies = std::move(proxies);
+    }
+    return true;
+}
+
+BakeScene load_bake_scene(const std::string &scene_file,
+                          const SceneLoadOptions &load_options,
+                          const AtlasOptions &atlas_options,
+                          uint32_t bvh_profile,
+                          ID3D12Device5 *device,
+                          dxr::CommandContext &cmd_ctx,
+                          SDL_Window *window,
+                          dxr::GpuProfiler &profiler,
+                          BakeSceneSource *source)
+{
+    TRACE_SCOPE("load_bake_scene");
+    BakeScene bake_scene;
+    bake_scene.bvh_profile = bvh_profile;
+    bake_scene.cache_dir = atlas_options.cache_dir;
+
+    // The unwrapped scene is cached alongside the atlas, restarting a bake of an unchanged
+    // scene maps it and uploads it directly without loading or unwrapping the scene
+    std::string scene_cache;
+    uint64_t scene_cache_key_value = 0;
+    if (!atlas_options.cache_dir.empty()) {
+        scene_cache_key_value = scene_cache_key(scene_file, load_options, atlas_options);
+        scene_cache = scene_cache_file_name(atlas_options.cache_dir, scene_cache_key_value);
+        if (load_cached_bake_scene(scene_cache,
+                                   scene_cache_key_value,
+                                   load_options,
+                                   device,
+                                   cmd_ctx,
+                                   profiler,
+                                   source,
+                                   bake_scene)) {
+            return bake_scene;
+        }
+    }
+
+    const auto load_start = std::chrono::steady_clock::now();
+    Scene scene(scene_file, load_options.texture_load, load_options.lightmap_uv_set);
+
+    // Split geometries too large to upload or build whole into chunks before anything else
+    // processes them
+    GeometrySplitStats split_stats;
+    split_oversized_geometries(scene, load_options.split_limits, split_stats);
+    if (split_stats.split_geometries > 0) {
+        std::cout << "Split " << split_stats.split_geometries
+                  << " oversized geometries into " << split_stats.chunks << " chunks\n";
+    }
+
+    // The lightmap uvs are checked on the chunks, as the whole geometries may be too large
+    // to upload
+    if (!load_options.lightmap_uv_set.empty()) {
+        const size_t valid = validate_lightmap_uvs(device, cmd_ctx, scene, profiler);
+        std::cout << "Lightmap uvs: " << valid << " of " << scene.meshes.size()
+                  << " meshes valid\n";
+    }
+
+    // Welding before the unwrap gives xatlas fewer vertices to chart and keeps faces sharing
+    // identical vertices in the same chart
+    if (load_options.mesh_optimize & MESH_OPTIMIZE_PRE_UNWRAP) {
+        MeshOptimizeStats stats;
+        optimize_meshes(scene.meshes, true, stats);
+        print_mesh_optimize_stats("Pre-unwrap", stats);
+    }
+
+    // Split the alpha masked triangles before the unwrap, so the fully transparent ones
+    // don't take space in the atlas and the atlas cache key matches the geometry baked
+    AlphaTestStats alpha_stats;
+    std::vector<AlphaTestedGeometry> alpha_geometries =
+        split_alpha_tested_geometry(scene, alpha_stats);
+    compute_scene_bounds(scene, bake_scene);
+    // The proxies only need the positions, so they're simplified before the unwrap releases
+    // the streamed geometry
+    MeshProxies proxies = simplify_occluder_proxies(scene, load_options, bake_scene);
+    classify_occluders(scene, load_options, bake_scene);
+
+    std::stringstream ss;
+    ss << "Scene '" << scene_file << "':\n"
+       << "# Unique Triangles: " << pretty_print_count(scene.unique_tris()) << "\n"
+       << "# Total Triangles: " << pretty_print_count(scene.total_tris()) << "\n"
+       << "# Geometries: " << scene.num_geometries() << "\n"
+       << "# Meshes: " << scene.meshes.size() << "\n"
+       << "# Instances: " << scene.instances.size() << "\n"
+       << "# Materials: " << scene.materials.size() << "\n"
+       << "# Textures: " << scene.textures.size() << "\n"
+       << "# Lights: " << scene.lights.size() << "\n"
+       << "# Cameras: " << scene.cameras.size();
+
+    const size_t alpha_masked_tris =
+        alpha_stats.opaque_tris + alpha_stats.transparent_tris + alpha_stats.alpha_tested_tris;
+    if (alpha_masked_tris > 0) {
+        ss << "\n# Alpha Masked Triangles: "
+           << pretty_print_count(alpha_stats.opaque_tris) << " opaque, "
+           << pretty_print_count(alpha_stats.transparent_tris) << " transparent (removed), "
+           << pretty_print_count(alpha_stats.alpha_tested_tris) << " alpha tested";
+    }
+
+    bake_scene.scene_info = ss.str();
+    std::cout << bake_scene.scene_info << "\n";
+
+    const auto unwrap_start = std::chrono::steady_clock::now();
+    bake_scene.load_ms =
+        std::chrono::duration<double, std::milli>(unwrap_start - load_start).count();
+    std::cout << "Generating atlas using " << atlas_thread_count() << " threads\n";
+    if (window) {
+        SDL_SetWindowTitle(window, "Generating atlas, please wait..");
+    }
+
+    // The progress is reported from the xatlas worker threads, so we run the unwrap
+    // on a separate thread and poll the progress to keep the window responsive
+    std::atomic<int> progress_category(-1);
+    std::atomic<int> progress_value(0);
+    std::atomic<bool> cancel_unwrap(false);
+    AtlasOptions unwrap_options = atlas_options;
+    unwrap_options.layout_name = scene_file;
+    unwrap_options.progress = [&](xatlas::ProgressCategory::Enum category, int progress) {
+        progress_category = category;
+        progress_value = progress;
+        return !cancel_unwrap;
+    };
+    // Unless the unwrapped scene is kept, each mesh is streamed to the GPU and released
+    // as soon as it's unwrapped instead of holding the whole scene until the upload. The
+    // scene cache is written from the meshes before they're streamed
+    std::unique_ptr<MeshStream> stream;
+    if (!source) {
+        stream = std::make_unique<MeshStream>();
+        init_mesh_stream(
+            *stream, device, cmd_ctx, profiler, bvh_profile, atlas_options.cache_dir);
+    }
+    std::unique_ptr<SceneCacheWriter> cache_writer;
+    if (!scene_cache.empty()) {
+        cache_writer = std::make_unique<SceneCacheWriter>(scene_cache, scene_cache_key_value);
+    }
+    // The unwrapped geometry is reordered for the bake's rasterization and BVH builds before
+    // it's hashed, cached or streamed. The meshes are unwrapped in order on one thread
+    const bool post_unwrap_optimize = load_options.mesh_optimize & MESH_OPTIMIZE_POST_UNWRAP;
+    MeshOptimizeStats post_unwrap_stats;
+    bake_scene.mesh_hashes.resize(scene.meshes.size(), 0);
+    unwrap_options.mesh_unwrapped = [&](const AtlasResult &result,
+                                        size_t mesh_id,
+                                        Mesh &mesh) {
+        if (post_unwrap_optimize) {
+            const auto start = std::chrono::steady_clock::now();
+            for (auto &g : mesh.geometries) {
+                optimize_geometry(g, false, !g.alpha_tested, post_unwrap_stats);
+            }
+            post_unwrap_stats.optimize_ms +=
+                std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                          start)
+                    .count();
+        }
+        bake_scene.mesh_hashes[mesh_id] = hash_mesh_geometry(mesh);
+        if (cache_writer) {
+            cache_writer->add_mesh(mesh);
+        }
+        if (stream) {
+            stream_mesh(*stream, result, mesh);
+        }
+    };
+    auto unwrap = std::async(std::launch::async, [&]() {
+        if (trace_enabled()) {
+            trace_set_thread_name("Unwrap");
+        }
+        return unwrap_meshes(scene.meshes, scene.instances, unwrap_options);
+    });
+
+    int prev_category = -1;
+    int prev_progress = -1;
+    while (unwrap.wait_for(std::chrono::milliseconds(50)) != std::future_status::ready) {
+        if (window) {
+            SDL_Event event;
+            while (SDL_PollEvent(&event)) {
+                if (event.type == SDL_QUIT ||
+                    (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)) {
+                    cancel_unwrap = true;
+                }
+            }
+        }
+
+        const int category = progress_category;
+        const int progress = progress_value;
+        if (category == -1 || (category == prev_category && progress == prev_progress)) {
+            continue;
+        }
+        const char *stage =
+            xatlas::StringForEnum(static_cast<xatlas::ProgressCategory::Enum>(category));
+        if (window) {
+            const std::string title = "Generating atlas: " + std::string(stage) + " " +
+                                      std::to_string(progress) + "% (Esc to cancel)";
+            SDL_SetWindowTitle(window, title.c_str());
+        }
+        // Only print every 10% to not flood stdout
+        if (category != prev_category || progress / 10 != prev_progress / 10) {
+            std::cout << "  " << stage << ": " << progress << "%\n";
+        }
+        prev_category = category;
+        prev_progress = progress;
+    }
+
+    const AtlasResult atlas = unwrap.get();
+    if (stream && !atlas.cancelled) {
+        finish_mesh_stream(*stream, bake_scene);
+        stream.reset();
+    }
+    bake_scene.unwrap_ms = std::chrono::duration<double, std::milli>(
+                               std::chrono::steady_clock::now() - unwrap_start)
+                               .count();
+    if (atlas.cancelled) {
+        if (window) {
+            SDL_SetWindowTitle(window, "DXR AO Baking");
+        }
+        bake_scene.cancelled = true;
+        return bake_scene;
+    }
+    std::cout << "Atlas " << (atlas.from_cache ? "loaded" : "generated") << ":\n"
+              << "  # of charts: " << atlas.chart_count << "\n"
+              << "  # of atlases: " << atlas.atlas_count << " (" << atlas.page_grid.x << "x"
+              << atlas.page_grid.y << " grid of " << atlas.page_size.x << "x"
+              << atlas.page_size.y << " pages)\n"
+              << "  # of instanced meshes: " << atlas.instanced_meshes << "\n"
+              << "  Resolution: " << atlas.size.x << "x" << atlas.size.y << "\n";
+    if (post_unwrap_optimize) {
+        print_mesh_optimize_stats("Post-unwrap", post_unwrap_stats);
+    }
+
+    if (atlas.size.x > D3D12_REQ_TEXTURE2D_U_OR_V_DIMENSION ||
+        atlas.size.y > D3D12_REQ_TEXTURE2D_U_OR_V_DIMENSION) {
+        std::cout << "Error: Atlas resolution exceeds the max texture size of "
+                  << D3D12_REQ_TEXTURE2D_U_OR_V_DIMENSION
+                  << ", try lowering the atlas texels per unit\n";
+        throw std::runtime_error("Atlas resolution exceeds max texture size");
+    }
+
+    if (window) {
+        SDL_SetWindowTitle(window, "DXR AO Baking");
+    }
+    if (cache_writer) {
+        cache_writer->finish(scene, alpha_geometries, atlas, bake_scene.scene_info);
+        std::cout << "Wrote scene cache " << scene_cache << "\n";
+    }
+    bake_scene.atlas_size = atlas.size;
+    bake_scene.atlas_cache_key = atlas.cache_key;
+    bake_scene.instance_regions = atlas.instance_regions;
+
+    const auto upload_start = std::chrono::steady_clock::now();
+    upload_bake_scene(device, cmd_ctx, scene, alpha_geometries, proxies, bake_scene, profiler);
+    bake_scene.upload_ms = std::chrono::duration<double, std::milli>(
+                               std::chrono::steady_clock::now() - upload_start)
+                               .count();
+    if (source) {
+        source->scene = std::move(scene);
+        source->alpha_geometries = std::move(alpha_geometries);
+        source->occluder_proxies = std::move(proxies);
+    }
+    return bake_scene;
+}
+
+uint64_t hash_mesh_geometry(const Mesh &mesh)
+{
+    Hasher hasher;
+    for (const auto &g : mesh.geometries) {
+        const ArrayView<glm::vec3> vertices = g.vertex_data();
+        const ArrayView<glm::vec3> normals = g.normal_data();
+        const ArrayView<glm::vec2> uvs = g.uv_data();
+        const ArrayView<glm::uvec3> indices = g.index_data();
+        hasher.add(vertices.size());
+        hasher.add(vertices.data(), vertices.size() * sizeof(glm::vec3));
+        hasher.add(normals.data(), normals.size() * sizeof(glm::vec3));
+        hasher.add(uvs.data(), uvs.size() * sizeof(glm::vec2));
+        hasher.add(indices.size());
+        hasher.add(indices.data(), indices.size() * sizeof(glm::uvec3));
+    }
+    return hasher.h;
+}
+
+bool find_changed_instances(const BakeScene &prev,
+                            const BakeScene &next,
+                            float ao_length,
+                            std::vector<std::array<glm::vec3, 2>> &dirty_bounds)
+{
+    const auto &prev_instances = prev.scene_bvh.instances;
+    const auto &next_instances = next.scene_bvh.instances;
+    if (prev.atlas_size != next.atlas_size ||
+        prev.mesh_hashes.size() != next.mesh_hashes.size() ||
+        prev_instances.size() != next_instances.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < next_instances.size(); ++i) {
+        if (prev_instances[i].mesh_id != next_instances[i].mesh_id) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < next_instances.size(); ++i) {
+        const uint32_t mesh_id = next_instances[i].mesh_id;
+        const auto &prev_region = prev.instance_regions[i];
+        const auto &next_region = next.instance_regions[i];
+        if (prev.mesh_hashes[mesh_id] == next.mesh_hashes[mesh_id] &&
+            prev_instances[i].transform == next_instances[i].transform &&
+            prev_region.uv_offset == next_region.uv_offset &&
+            prev_region.uv_scale == next_region.uv_scale) {
+            continue;
+        }
+        const auto prev_bounds = instance_world_bounds(prev, prev_instances[i]);
+        const auto next_bounds = instance_world_bounds(next, next_instances[i]);
+        for (const auto &b : {prev_bounds, next_bounds}) {
+            if (b[0].x <= b[1].x) {
+                dirty_bounds.push_back(
+                    {b[0] - glm::vec3(ao_length), b[1] + glm::vec3(ao_length)});
+            }
+        }
+    }
+    return true;
+}
+
+void compute_scene_bounds(const Scene &scene, BakeScene &bake_scene)
+{
+    // The world bounds are found by transforming each mesh's bounds by its instances
+    auto &mesh_bounds = bake_scene.mesh_bounds;
+    mesh_bounds.clear();
+    mesh_bounds.resize(scene.meshes.size(),
+                       {glm::vec3(std::numeric_limits<float>::infinity()),
+                        glm::vec3(-std::numeric_limits<float>::infinity())});
+    for (size_t i = 0; i < scene.meshes.size(); ++i) {
+        for (const auto &g : scene.meshes[i].geometries) {
+            for (const auto &v : g.vertex_data()) {
+                mesh_bounds[i][0] = glm::min(mesh_bounds[i][0], v);
+                mesh_bounds[i][1] = glm::max(mesh_bounds[i][1], v);
+            }
+        }
+    }
+    bake_scene.world_lower = glm::vec3(std::numeric_limits<float>::infinity());
+    bake_scene.world_upper = glm::vec3(-std::numeric_limits<float>::infinity());
+    for (const auto &inst : scene.instances) {
+        const auto b =
+            instance_world_bounds(bake_scene, dxr::TlasInstance(inst.transform, inst.mesh_id));
+        bake_scene.world_lower = glm::min(bake_scene.world_lower, b[0]);
+        bake_scene.world_upper = glm::max(bake_scene.world_upper, b[1]);
+    }
+}
+
+LightmapUvCheckPipeline create_lightmap_uv_check_pipeline(ID3D12Device5 *device)
+{
+    LightmapUvCheckPipeline pipeline;
+    pipeline.signature = dxr::RootSignatureBuilder::global(
+                             D3D12_ROOT_SIGNATURE_FLAG_ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT)
+                             .add_constants("check_info", 0, 2, 0)
+                             .add_uav("coverage", 0, 0)
+                             .add_uav("overlaps", 1, 0)
+                             .create(device);
+
+    const D3D12_INPUT_ELEMENT_DESC vertex_layout = {"TEXCOORD",
+                                                    0,
+                                                    DXGI_FORMAT_R32G32_FLOAT,
+                                                    0,
+                                                    0,
+                                                    D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA,
+                                                    0};
+
+    D3D12_GRAPHICS_PIPELINE_STATE_DESC desc = {0};
+    desc.pRootSignature = pipeline.signature.get();
+    desc.VS.pShaderBytecode = lightmap_uv_check_vs_dxil;
+    desc.VS.BytecodeLength = sizeof(lightmap_uv_check_vs_dxil);
+    desc.PS.pShaderBytecode = lightmap_uv_check_fs_dxil;
+    desc.PS.BytecodeLength = sizeof(lightmap_uv_check_fs_dxil);
+
+    // The pass only writes the UAVs, so there's no render target to blend into
+    desc.RasterizerState.FillMode = D3D12_FILL_MODE_SOLID;
+    desc.RasterizerState.CullMode = D3D12_CULL_MODE_NONE;
+    desc.RasterizerState.FrontCounterClockwise = FALSE;
+    desc.RasterizerState.DepthClipEnable = TRUE;
+    desc.RasterizerState.ConservativeRaster = D3D12_CONSERVATIVE_RASTERIZATION_MODE_OFF;
+
+    desc.SampleMask = UINT_MAX;
+    desc.DepthStencilState.DepthEnable = false;
+    desc.DepthStencilState.StencilEnable = false;
+
+    desc.InputLayout.pInputElementDescs = &vertex_layout;
+    desc.InputLayout.NumElements = 1;
+    desc.PrimitiveTopologyType = D3D12_PRIMITIVE_TOPOLOGY_TYPE_TRIANGLE;
+    desc.SampleDesc.Count = 1;
+
+    pipeline.pipeline_state = dxr::create_graphics_pipeline_state(device, desc);
+    return pipeline;
+}
+
+size_t validate_lightmap_uvs(ID3D12Device5 *device,
+                             dxr::CommandContext &cmd_ctx,
+                             Scene &scene,
+                             dxr::GpuProfiler &profiler)
+{
+    TRACE_SCOPE("validate_lightmap_uvs");
+    const auto start = std::chrono::steady_clock::now();
+
+    auto drop_lightmap_uvs = [](Mesh &mesh) {
+        for (auto &g : mesh.geometries) {
+            g.lightmap_uvs = std::vector<glm::vec2>();
+            g.lightmap_uv_view = ArrayView<glm::vec2>();
+        }
+    };
+
+    // The bounds are checked on the CPU, only the meshes passing it are rasterized
+    std::vector<size_t> checked_meshes;
+    size_t uv_bytes = 0;
+    size_t index_bytes = 0;
+    for (size_t i = 0; i < scene.meshes.size(); ++i) {
+        Mesh &mesh = scene.meshes[i];
+        bool has_uvs = !mesh.geometries.empty();
+        bool in_bounds = true;
+        for (const auto &g : mesh.geometries) {
+            const ArrayView<glm::vec2> uvs = g.lightmap_uv_data();
+            has_uvs = has_uvs && !uvs.empty() && uvs.size() == g.vertex_data().size();
+            for (const auto &uv : uvs) {
+                // Written so NaNs fail the check
+                in_bounds = in_bounds && uv.x >= 0.f && uv.x <= 1.f && uv.y >= 0.f &&
+                            uv.y <= 1.f;
+            }
+        }
+        if (!has_uvs) {
+            drop_lightmap_uvs(mesh);
+            continue;
+        }
+        if (!in_bounds) {
+            std::cout << "Warning: the lightmap uvs of mesh " << i
+                      << " are outside [0, 1], charting it with xatlas\n";
+            drop_lightmap_uvs(mesh);
+            continue;
+        }
+        checked_meshes.push_back(i);
+        for (const auto &g : mesh.geometries) {
+            uv_bytes += g.lightmap_uv_data().size() * sizeof(glm::vec2);
+            index_bytes += g.index_data().size() * sizeof(glm::uvec3);
+        }
+    }
+    if (checked_meshes.empty()) {
+        return 0;
+    }
+
+    dxr::Buffer uv_buf =
+        dxr::Buffer::upload(device, align_to(uv_bytes, 16), D3D12_RESOURCE_STATE_GENERIC_READ);
+    dxr::Buffer index_buf = dxr::Buffer::upload(
+        device, align_to(index_bytes, 16), D3D12_RESOURCE_STATE_GENERIC_READ);
+    {
+        uint8_t *uv_ptr = static_cast<uint8_t *>(uv_buf.map());
+        uint8_t *index_ptr = static_cast<uint8_t *>(index_buf.map());
+        for (const auto &i : checked_meshes) {
+            for (const auto &g : scene.meshes[i].geometries) {
+                const ArrayView<glm::vec2> uvs = g.lightmap_uv_data();
+                const ArrayView<glm::uvec3> indices = g.index_data();
+                std::memcpy(uv_ptr, uvs.data(), uvs.size() * sizeof(glm::vec2));
+                std::memcpy(index_ptr, indices.data(), indices.size() * sizeof(glm::uvec3));
+                uv_ptr += uvs.size() * sizeof(glm::vec2);
+                index_ptr += indices.size() * sizeof(glm::uvec3);
+            }
+        }
+        uv_buf.unmap();
+        index_buf.unmap();
+    }
+
+    // Committed resources are zeroed, so every texel starts uncovered
+    const uint32_t res = lightmap_uv_check_resolution;
+    dxr::Buffer coverage = dxr::Buffer::default(device,
+                                                size_t(res) * res * sizeof(uint32_t),
+                                                D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                                D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    dxr::Buffer overlaps =
+        dxr::Buffer::default(device,
+                             align_to(checked_meshes.size() * sizeof(uint32_t), 16),
+                             D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                             D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+
+    LightmapUvCheckPipeline pipeline = create_lightmap_uv_check_pipeline(device);
+
+    D3D12_VIEWPORT viewport = {0};
+    viewport.Width = static_cast<float>(res);
+    viewport.Height = static_cast<float>(res);
+    viewport.MinDepth = D3D12_MIN_DEPTH;
+    viewport.MaxDepth = D3D12_MAX_DEPTH;
+
+    D3D12_RECT scissor = {0};
+    scissor.right = res;
+    scissor.bottom = res;
+
+    cmd_ctx.begin();
+    auto &cmd_list = cmd_ctx.cmd_list;
+    const uint32_t check_region = profiler.begin(cmd_list.Get(), "Lightmap UV Check");
+    cmd_list->SetPipelineState(pipeline.pipeline_state.Get());
+    cmd_list->SetGraphicsRootSignature(pipeline.signature.get());
+    cmd_list->SetGraphicsRootUnorderedAccessView(1, coverage->GetGPUVirtualAddress());
+    cmd_list->SetGraphicsRootUnorderedAccessView(2, overlaps->GetGPUVirtualAddress());
+    cmd_list->RSSetViewports(1, &viewport);
+    cmd_list->RSSetScissorRects(1, &scissor);
+    cmd_list->OMSetRenderTargets(0, nullptr, false, nullptr);
+    cmd_list->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+
+    D3D12_GPU_VIRTUAL_ADDRESS uv_address = uv_buf.gpu_virtual_address();
+    D3D12_GPU_VIRTUAL_ADDRESS index_address = index_buf.gpu_virtual_address();
+    for (size_t c = 0; c < checked_meshes.size(); ++c) {
+        const glm::uvec2 check_info(c, res);
+        cmd_list->SetGraphicsRoot32BitConstants(0, 2, &check_info, 0);
+        for (const auto &g : scene.meshes[checked_meshes[c]].geometries) {
+            const size_t n_uv_bytes = g.lightmap_uv_data().size() * sizeof(glm::vec2);
+            const size_t n_index_bytes = g.index_data().size() * sizeof(glm::uvec3);
+
+            D3D12_VERTEX_BUFFER_VIEW vertex_view = {0};
+            vertex_view.BufferLocation = uv_address;
+            vertex_view.SizeInBytes = n_uv_bytes;
+            vertex_view.StrideInBytes = sizeof(glm::vec2);
+
+            D3D12_INDEX_BUFFER_VIEW index_view = {0};
+            index_view.BufferLocation = index_address;
+            index_view.SizeInBytes = n_index_bytes;
+            index_view.Format = DXGI_FORMAT_R32_UINT;
+
+            cmd_list->IASetVertexBuffers(0, 1, &vertex_view);
+            cmd_list->IASetIndexBuffer(&index_view);
+            cmd_list->DrawIndexedInstanced(g.index_data().size() * 3, 1, 0, 0, 0);
+            uv_address += n_uv_bytes;
+            index_address += n_index_bytes;
+        }
+        // The next mesh's stamps must be ordered after this mesh's
+        const auto b = dxr::barrier_uav(coverage);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    profiler.end(cmd_list.Get(), check_region);
+    cmd_ctx.submit_and_sync();
+
+    const std::vector<uint8_t> overlap_data = read_back_buffer(device, cmd_ctx, overlaps);
+    const uint32_t *overlap_counts = reinterpret_cast<const uint32_t *>(overlap_data.data());
+    size_t valid = 0;
+    for (size_t c = 0; c < checked_meshes.size(); ++c) {
+        if (overlap_counts[c] == 0) {
+            ++valid;
+            continue;
+        }
+        std::cout << "Warning: the lightmap uvs of mesh " << checked_meshes[c]
+                  << " overlap at " << overlap_counts[c]
+                  << " texels, charting it with xatlas\n";
+        drop_lightmap_uvs(scene.meshes[checked_meshes[c]]);
+    }
+
+    const auto end = std::chrono::steady_clock::now();
+    std::cout << "Lightmap uv check took "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+              << "ms\n";
+    return valid;
+}
+
+void upload_bake_scene(ID3D12Device5 *device,
+                       dxr::CommandContext &cmd_ctx,
+                       const Scene &scene,
+                       const std::vector<AlphaTestedGeometry> &alpha_geometries,
+                       const MeshProxies &occluder_proxies,
+                       BakeScene &bake_scene,
+                       dxr::GpuProfiler &profiler)
+{
+    TRACE_SCOPE("upload_bake_scene");
+    auto &meshes = bake_scene.meshes;
+    auto &cmd_list = cmd_ctx.cmd_list;
+
+    // All scene data is staged through one persistently mapped upload ring
+    dxr::UploadRing upload_ring(device, upload_ring_size);
+
+    // Upload the scene geometry and build the bottom level BVHs
+    const BvhBuildFlags build_flags = bvh_build_flags(bake_scene.bvh_profile);
+    std::cout << "BVH profile: " << bvh_profile_names[bake_scene.bvh_profile] << "\n";
+    if (meshes.empty()) {
+        // The geometry is streamed in on a copy queue while the BLASes are built
+        dxr::CommandContext copy_ctx(device, D3D12_COMMAND_LIST_TYPE_COPY);
+        dxr::MeshBuildStats build_stats;
+        if (!build_or_load_blases(device,
+                                  cmd_ctx,
+                                  &copy_ctx,
+                                  upload_ring,
+                                  bake_scene,
+                                  &scene.meshes,
+                                  meshes,
+                                  build_flags.blas,
+                                  build_stats,
+                                  profiler)) {
+            print_blas_build_stats(build_stats);
+        }
+    }
+    if (bake_scene.geometry_uv_bounds.empty()) {
+        for (const auto &m : scene.meshes) {
+            bake_scene.geometry_uv_bounds.push_back(geometry_uv_bounds(m));
+        }
+    }
+
+    // The instances rasterized into the atlas, sorted by mesh so all instances of a mesh
+    // can be drawn with one instanced draw per geometry
+    std::vector<size_t> sorted_instances(scene.instances.size());
+    std::iota(sorted_instances.begin(), sorted_instances.end(), 0);
+    std::stable_sort(
+        sorted_instances.begin(), sorted_instances.end(), [&](size_t a, size_t b) {
+            return scene.instances[a].mesh_id < scene.instances[b].mesh_id;
+        });
+    std::vector<BakeInstance> bake_instances;
+    bake_instances.reserve(sorted_instances.size());
+    bake_scene.bake_instance_index.resize(sorted_instances.size());
+    for (const auto &i : sorted_instances) {
+        bake_scene.bake_instance_index[i] = bake_instances.size();
+        const auto &inst = scene.instances[i];
+        const auto &region = bake_scene.instance_regions[i];
+        if (bake_scene.mesh_instances.empty() ||
+            bake_scene.mesh_instances.back().mesh_id != inst.mesh_id) {
+            MeshInstances batch;
+            batch.mesh_id = inst.mesh_id;
+            batch.first_instance = bake_instances.size();
+            bake_scene.mesh_instances.push_back(batch);
+        }
+        ++bake_scene.mesh_instances.back().num_instances;
+
+        BakeInstance bi;
+        bi.transform = inst.transform;
+        bi.normal_transform = glm::transpose(glm::inverse(inst.transform));
+        bi.uv_offset = region.uv_offset;
+        bi.uv_scale = region.uv_scale;
+        bake_instances.push_back(bi);
+    }
+
+    const size_t bake_instances_size = bake_instances.size() * sizeof(BakeInstance);
+    {
+        dxr::MemoryCategoryScope memory_scope(dxr::MEMORY_INSTANCES);
+        bake_scene.bake_instances =
+            dxr::Buffer::default(device,
+                                 std::max(bake_instances_size, sizeof(BakeInstance)),
+                                 D3D12_RESOURCE_STATE_COPY_DEST);
+    }
+    // The lights are read by the direct lighting bake, which samples them in the pixel shader
+    bake_scene.num_lights = scene.lights.size();
+    const size_t lights_size = scene.lights.size() * sizeof(QuadLight);
+    if (!scene.lights.empty()) {
+        dxr::MemoryCategoryScope memory_scope(dxr::MEMORY_BUFFERS);
+        bake_scene.lights =
+            dxr::Buffer::default(device, lights_size, D3D12_RESOURCE_STATE_COPY_DEST);
+    }
+    cmd_ctx.begin();
+    upload_ring.upload(
+        cmd_ctx, bake_scene.bake_instances, bake_instances.data(), bake_instances_size);
+    {
+        D3D12_RESOURCE_BARRIER b = barrier_transition(
+            bake_scene.bake_instances, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    if (bake_scene.lights.get()) {
+        upload_ring.upload(cmd_ctx, bake_scene.lights, scene.lights.data(), lights_size);
+        D3D12_RESOURCE_BARRIER b = barrier_transition(
+            bake_scene.lights, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    upload_ring.submit_and_sync(cmd_ctx);
+    build_atlas_draws(device, cmd_ctx, upload_ring, bake_scene, bake_instances);
+    upload_alpha_test(device, cmd_ctx, upload_ring, bake_scene, scene, alpha_geometries);
+    build_occluder_proxies(device,
+                           cmd_ctx,
+                           upload_ring,
+                           occluder_proxies,
+                           bake_scene,
+                           build_flags.blas,
+                           profiler);
+
+    // The TLAS keeps a compact copy of the instances, without their material IDs
+    std::vector<dxr::TlasInstance> tlas_instances;
+    tlas_instances.reserve(scene.instances.size());
+    for (const auto &inst : scene.instances) {
+        tlas_instances.emplace_back(inst.transform, inst.mesh_id);
+    }
+    const double tlas_ms = build_scene_tlas(device,
+                                            cmd_ctx,
+                                            upload_ring,
+                                            bake_scene,
+                                            std::move(tlas_instances),
+                                            build_flags.tlas,
+                                            profiler);
+    std::cout << "TLAS build: " << tlas_ms << "ms\n";
+}
+
+MeshStream::~MeshStream()
+{
+    if (worker.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+}
+
+void init_mesh_stream(MeshStream &stream,
+                      ID3D12Device5 *device,
+                      dxr::CommandContext &cmd_ctx,
+                      dxr::GpuProfiler &profiler,
+                      uint32_t bvh_profile,
+                      const std::string &cache_dir)
+{
+    stream.device = device;
+    stream.cmd_ctx = &cmd_ctx;
+    stream.profiler = &profiler;
+    stream.build_flags = bvh_build_flags(bvh_profile).blas;
+    stream.cache_dir = cache_dir;
+}
+
+void stream_mesh(MeshStream &stream, const AtlasResult &atlas, Mesh &mesh)
+{
+    if (!stream.worker.joinable()) {
+        if (!stream.cache_dir.empty()) {
+            stream.cache_file = blas_cache_file(
+                stream.cache_dir, atlas.cache_key, stream.build_flags, stream.cache_key);
+            stream.load_cache = std::ifstream(stream.cache_file.c_str()).good();
+        }
+        stream.copy_ctx =
+            std::make_unique<dxr::CommandContext>(stream.device, D3D12_COMMAND_LIST_TYPE_COPY);
+        stream.upload_ring =
+            std::make_unique<dxr::UploadRing>(stream.device, upload_ring_size);
+        stream.worker = std::thread([&stream]() { mesh_stream_worker(stream); });
+    }
+
+    // Leave empty geometries behind, the alpha test still needs the geometry count
+    stream.uv_bounds.push_back(geometry_uv_bounds(mesh));
+    const size_t mesh_bytes = dxr::mesh_upload_size(mesh);
+    stream.batch.push_back(Mesh());
+    std::swap(stream.batch.back(), mesh);
+    for (const auto &g : stream.batch.back().geometries) {
+        mesh.geometries.push_back(Geometry());
+        mesh.geometries.back().alpha_tested = g.alpha_tested;
+    }
+    stream.batch_bytes += mesh_bytes;
+    if (stream.batch_bytes < stream.upload_ring->capacity()) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(stream.mutex);
+    stream.cv.wait(lock, [&]() {
+        return stream.error || stream.pending.size() < max_stream_batches;
+    });
+    if (stream.error) {
+        std::rethrow_exception(stream.error);
+    }
+    stream.pending.push_back(std::move(stream.batch));
+    lock.unlock();
+    stream.cv.notify_all();
+    stream.batch.clear();
+    stream.batch_bytes = 0;
+}
+
+void mesh_stream_worker(MeshStream &stream)
+{
+    if (trace_enabled()) {
+        trace_set_thread_name("Mesh Stream");
+    }
+    try {
+        while (true) {
+            std::vector<Mesh> batch;
+            {
+                std::unique_lock<std::mutex> lock(stream.mutex);
+                stream.cv.wait(lock, [&]() { return stream.done || !stream.pending.empty(); });
+                if (stream.pending.empty()) {
+                    return;
+                }
+                batch = std::move(stream.pending.front());
+                stream.pending.pop_front();
+            }
+            stream.cv.notify_all();
+
+            std::vector<dxr::BottomLevelBVH> bvhs;
+            dxr::MeshBuildStats stats;
+            if (stream.load_cache) {
+                const auto start = std::chrono::steady_clock::now();
+                bvhs = dxr::upload_mesh_geometry(stream.device,
+                                                 *stream.cmd_ctx,
+                                                 *stream.upload_ring,
+                                                 batch,
+                                                 stream.profiler,
+                                                 stream.build_flags);
+                stats.upload_ms = std::chrono::duration<double, std::milli>(
+                                      std::chrono::steady_clock::now() - start)
+                                      .count();
+            } else {
+                bvhs = dxr::build_mesh_bvhs_async(stream.device,
+                                                  *stream.cmd_ctx,
+                                                  *stream.copy_ctx,
+                                                  *stream.upload_ring,
+                                                  batch,
+                                                  &stats,
+                                                  0,
+                                                  stream.profiler,
+                                                  stream.build_flags);
+            }
+            // The batch's geometry is released here, only its GPU copy is kept
+            batch.clear();
+            std::move(bvhs.begin(), bvhs.end(), std::back_inserter(stream.bvhs));
+            stream.stats.upload_ms += stats.upload_ms;
+            stream.stats.build_ms += stats.build_ms;
+            stream.stats.compaction_ms += stats.compaction_ms;
+            stream.stats.uncompacted_bytes += stats.uncompacted_bytes;
+            stream.stats.compacted_bytes += stats.compacted_bytes;
+            stream.stats.scratch_bytes =
+                std::max(stream.stats.scratch_bytes, stats.scratch_bytes);
+            stream.stats.num_build_groups += stats.num_build_groups;
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(stream.mutex);
+        stream.error = std::current_exception();
+    }
+    stream.cv.notify_all();
+}
+
+void finish_mesh_stream(MeshStream &stream, BakeScene &bake_scene)
+{
+    if (stream.worker.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(stream.mutex);
+            if (!stream.batch.empty()) {
+                stream.pending.push_back(std::move(stream.batch));
+            }
+            stream.done = true;
+        }
+        stream.cv.notify_all();
+        stream.worker.join();
+        if (stream.error) {
+            std::rethrow_exception(stream.error);
+        }
+    }
+
+    std::cout << "Geometry upload: " << stream.stats.upload_ms
+              << "ms, streamed with the unwrap\n";
+    bool from_cache = false;
+    if (stream.load_cache) {
+        const auto start = std::chrono::steady_clock::now();
+        from_cache = load_cached_blases(stream.device,
+                                        *stream.cmd_ctx,
+                                        *stream.upload_ring,
+                                        stream.cache_file,
+                                        stream.cache_key,
+                                        stream.bvhs);
+        if (from_cache) {
+            std::cout << "Loaded BLASes from cache " << stream.cache_file << " in "
+                      << std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - start)
+                             .count()
+                      << "ms\n";
+        } else {
+            dxr::build_bvhs(stream.device,
+                            *stream.cmd_ctx,
+                            stream.bvhs,
+                            &stream.stats,
+                            0,
+                            stream.profiler);
+        }
+    }
+    if (!from_cache) {
+        print_blas_build_stats(stream.stats);
+        if (!stream.cache_file.empty()) {
+            write_cached_blases(stream.device,
+                                *stream.cmd_ctx,
+                                stream.cache_file,
+                                stream.cache_key,
+                                stream.bvhs);
+        }
+    }
+
+    bake_scene.meshes = std::move(stream.bvhs);
+    bake_scene.geometry_uv_bounds = std::move(stream.uv_bounds);
+    stream.upload_ring.reset();
+    stream.copy_ctx.reset();
+}
+
+std::vector<std::array<glm::vec2, 2>> geometry_uv_bounds(const Mesh &mesh)
+{
+    std::vector<std::array<glm::vec2, 2>> bounds;
+    for (const auto &g : mesh.geometries) {
+        std::array<glm::vec2, 2> b = {glm::vec2(std::numeric_limits<float>::infinity()),
+                                      glm::vec2(-std::numeric_limits<float>::infinity())};
+        for (const auto &uv : g.uv_data()) {
+            b[0] = glm::min(b[0], uv);
+            b[1] = glm::max(b[1], uv);
+        }
+        bounds.push_back(b);
+    }
+    return bounds;
+}
+
+std::string blas_cache_file(const std::string &cache_dir,
+                            uint64_t atlas_cache_key,
+                            D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags,
+                            uint64_t &key)
+{
+    Hasher hasher;
+    hasher.add(bvh_cache_version);
+    hasher.add(atlas_cache_key);
+    hasher.add(build_flags);
+    key = hasher.h;
+
+    std::stringstream ss;
+    ss << cache_dir << "/bvh_" << std::hex << std::setw(16) << std::setfill('0') << key
+       << ".bin";
+    return ss.str();
+}
+
+uint32_t resolve_bvh_profile(uint32_t profile, int n_samples)
+{
+    if (profile != BVH_PROFILE_AUTO) {
+        return profile;
+    }
+    return n_samples <= bvh_preview_samples ? BVH_PROFILE_FAST_BUILD : BVH_PROFILE_FAST_TRACE;
+}
+
+BvhBuildFlags bvh_build_flags(uint32_t profile)
+{
+    BvhBuildFlags flags;
+    if (profile == BVH_PROFILE_FAST_BUILD) {
+        flags.blas = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD;
+        flags.tlas = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD;
+    } else {
+        flags.blas = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE |
+                     D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_COMPACTION;
+        flags.tlas = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE;
+    }
+    // The TLAS is refit when instances are moved instead of rebuilt
+    flags.tlas |= D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE;
+    return flags;
+}
+
+void print_blas_build_stats(const dxr::MeshBuildStats &stats)
+{
+    std::cout << "BLAS build: " << stats.build_ms << "ms in " << stats.num_build_groups
+              << " group(s), " << pretty_print_count(stats.scratch_bytes) << "b scratch\n"
+              << "BLAS compaction: " << stats.compaction_ms << "ms ("
+              << pretty_print_count(stats.uncompacted_bytes) << "b -> "
+              << pretty_print_count(stats.compacted_bytes) << "b)\n";
+}
+
+void print_mesh_optimize_stats(const char *stage, const MeshOptimizeStats &stats)
+{
+    MeshOptimizeStats before = stats;
+    before.cache_misses_after = stats.cache_misses_before;
+    std::cout << stage << " mesh optimization: " << stats.optimize_ms << "ms, "
+              << pretty_print_count(stats.vertices_before) << " -> "
+              << pretty_print_count(stats.vertices_after) << " vertices, ACMR "
+              << average_cache_miss_ratio(before) << " -> "
+              << average_cache_miss_ratio(stats) << "\n";
+}
+
+bool build_or_load_blases(ID3D12Device5 *device,
+                          dxr::CommandContext &cmd_ctx,
+                          dxr::CommandContext *copy_ctx,
+                          dxr::UploadRing &upload_ring,
+                          const BakeScene &bake_scene,
+                          const std::vector<Mesh> *scene_meshes,
+                          std::vector<dxr::BottomLevelBVH> &bvhs,
+                          D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags,
+                          dxr::MeshBuildStats &stats,
+                          dxr::GpuProfiler &profiler)
+{
+    auto upload_geometry = [&]() {
+        const auto start = std::chrono::steady_clock::now();
+        bvhs = dxr::upload_mesh_geometry(
+            device, cmd_ctx, upload_ring, *scene_meshes, &profiler, build_flags);
+        std::cout << "Geometry upload: "
+                  << std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - start)
+                         .count()
+                  << "ms\n";
+        scene_meshes = nullptr;
+    };
+
+    std::string cache_file;
+    uint64_t key = 0;
+    if (!bake_scene.cache_dir.empty()) {
+        cache_file = blas_cache_file(
+            bake_scene.cache_dir, bake_scene.atlas_cache_key, build_flags, key);
+
+        // The geometry is needed for the cached BLASes too, so it can't be overlapped with
+        // the builds if there's a cache to try
+        if (scene_meshes && std::ifstream(cache_file.c_str()).good()) {
+            upload_geometry();
+        }
+        const auto start = std::chrono::steady_clock::now();
+        if (!scene_meshes &&
+            load_cached_blases(device, cmd_ctx, upload_ring, cache_file, key, bvhs)) {
+            std::cout << "Loaded BLASes from cache " << cache_file << " in "
+                      << std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - start)
+                             .count()
+                      << "ms\n";
+            return true;
+        }
+    }
+
+    if (scene_meshes && copy_ctx) {
+        bvhs = dxr::build_mesh_bvhs_async(device,
+                                          cmd_ctx,
+                                          *copy_ctx,
+                                          upload_ring,
+                                          *scene_meshes,
+                                          &stats,
+                                          0,
+                                          &profiler,
+                                          build_flags);
+        std::cout << "Geometry upload: " << stats.upload_ms
+                  << "ms, overlapped with the BLAS builds\n";
+    } else {
+        if (scene_meshes) {
+            upload_geometry();
+        }
+        dxr::build_bvhs(device, cmd_ctx, bvhs, &stats, 0, &profiler);
+    }
+    if (!cache_file.empty()) {
+        write_cached_blases(device, cmd_ctx, cache_file, key, bvhs);
+    }
+    return false;
+}
+
+bool load_cached_blases(ID3D12Device5 *device,
+                        dxr::CommandContext &cmd_ctx,
+                        dxr::UploadRing &upload_ring,
+                        const std::string &fname,
+                        uint64_t key,
+                        std::vector<dxr::BottomLevelBVH> &bvhs)
+{
+    if (!std::ifstream(fname.c_str()).good()) {
+        return false;
+    }
+
+    FileMapping mapping(fname);
+    const uint8_t *data = mapping.data();
+    const uint8_t *end = data + mapping.nbytes();
+
+    BvhCacheHeader header;
+    if (mapping.nbytes() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, data, sizeof(header));
+    data += sizeof(header);
+    if (header.magic != bvh_cache_magic || header.version != bvh_cache_version ||
+        header.key != key || header.num_bvhs != bvhs.size()) {
+        return false;
+    }
+
+    std::vector<std::vector<uint8_t>> blobs;
+    for (size_t i = 0; i < bvhs.size(); ++i) {
+        uint64_t size = 0;
+        if (end - data < ptrdiff_t(sizeof(size))) {
+            return false;
+        }
+        std::memcpy(&size, data, sizeof(size));
+        data += sizeof(size);
+        if (uint64_t(end - data) < size) {
+            return false;
+        }
+        blobs.emplace_back(data, data + size);
+        data += size;
+    }
+
+    // The serialized BLASes are tied to the driver that wrote them, a driver update
+    // invalidates the cache and the BLASes are rebuilt
+    if (!dxr::deserialize_bvhs(device, cmd_ctx, upload_ring, bvhs, blobs)) {
+        std::cout << "BVH cache " << fname
+                  << " was written by an incompatible driver, rebuilding\n";
+        return false;
+    }
+    return true;
+}
+
+void write_cached_blases(ID3D12Device5 *device,
+                         dxr::CommandContext &cmd_ctx,
+                         const std::string &fname,
+                         uint64_t key,
+                         std::vector<dxr::BottomLevelBVH> &bvhs)
+{
+    const std::vector<std::vector<uint8_t>> blobs = dxr::serialize_bvhs(device, cmd_ctx, bvhs);
+
+    std::ofstream fout(fname.c_str(), std::ios::binary);
+    if (!fout) {
+        std::cout << "Warning: failed to open BVH cache file " << fname << "\n";
+        return;
+    }
+    BvhCacheHeader header;
+    header.key = key;
+    header.num_bvhs = blobs.size();
+    fout.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (const auto &blob : blobs) {
+        const uint64_t size = blob.size();
+        fout.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        fout.write(reinterpret_cast<const char *>(blob.data()), blob.size());
+    }
+}
+
+double build_scene_tlas(ID3D12Device5 *device,
+                        dxr::CommandContext &cmd_ctx,
+                        dxr::UploadRing &upload_ring,
+                        BakeScene &bake_scene,
+                        std::vector<dxr::TlasInstance> instances,
+                        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags,
+                        dxr::GpuProfiler &profiler)
+{
+    TRACE_SCOPE("build_scene_tlas");
+    const auto start = std::chrono::steady_clock::now();
+    auto &meshes = bake_scene.meshes;
+    auto &cmd_list = cmd_ctx.cmd_list;
+
+    // Scenes with many instances write their descs in blocks across the thread pool
+    std::vector<D3D12_RAYTRACING_INSTANCE_DESC> instance_descs(instances.size());
+    thread_pool().parallel_for(
+        instances.size(), instance_desc_block_size, [&](size_t begin, size_t end) {
+            D3D12_RAYTRACING_INSTANCE_DESC *buf = instance_descs.data();
+            for (size_t i = begin; i < end; ++i) {
+                const auto &inst = instances[i];
+                // The instances of meshes with alpha tested geometry look up its alpha test
+                // data by their ID, the others are forced opaque so never run the test
+                const auto &alpha_offsets = bake_scene.mesh_alpha_test_offset;
+                const uint32_t alpha_offset = inst.mesh_id < alpha_offsets.size()
+                                                  ? alpha_offsets[inst.mesh_id]
+                                                  : uint32_t(-1);
+                buf[i].InstanceID = alpha_offset != uint32_t(-1) ? alpha_offset : 0;
+                // All geometry shares the raygen bake's single hit group
+                buf[i].InstanceContributionToHitGroupIndex = 0;
+                buf[i].Flags = alpha_offset != uint32_t(-1)
+                                   ? D3D12_RAYTRACING_INSTANCE_FLAG_NONE
+                                   : D3D12_RAYTRACING_INSTANCE_FLAG_FORCE_OPAQUE;
+                buf[i].AccelerationStructure = meshes[inst.mesh_id]->GetGPUVirtualAddress();
+                // Meshes with an occluder proxy are only traced at full res in the near field
+                const auto &mesh_proxy = bake_scene.mesh_proxy;
+                const bool has_proxy = inst.mesh_id < mesh_proxy.size() &&
+                                       mesh_proxy[inst.mesh_id] != uint32_t(-1);
+                buf[i].InstanceMask =
+                    has_proxy ? OCCLUDER_MASK_NEAR : OCCLUDER_MASK_NEAR | OCCLUDER_MASK_FAR;
+                // Instances of classes skipping a field are masked out of its rays
+                if (i < bake_scene.instance_occluder_mask.size()) {
+                    buf[i].InstanceMask &= bake_scene.instance_occluder_mask[i];
+                }
+
+                // Note: D3D matrices are row-major
+                std::memset(buf[i].Transform, 0, sizeof(buf[i].Transform));
+                const glm::mat4 m = glm::transpose(inst.transform);
+                for (int r = 0; r < 3; ++r) {
+                    for (int c = 0; c < 4; ++c) {
+                        buf[i].Transform[r][c] = m[r][c];
+                    }
+                }
+            }
+        });
+
+    // Each instance of a mesh with an occluder proxy also instances the proxy after the
+    // scene instances, with the same transform but only traced in the far field
+    auto &proxy_desc = bake_scene.instance_proxy_desc;
+    proxy_desc.assign(instances.size(), uint32_t(-1));
+    for (size_t i = 0; i < instances.size(); ++i) {
+        const uint32_t mesh_id = instances[i].mesh_id;
+        if (mesh_id >= bake_scene.mesh_proxy.size() ||
+            bake_scene.mesh_proxy[mesh_id] == uint32_t(-1)) {
+            continue;
+        }
+        proxy_desc[i] = instance_descs.size();
+        D3D12_RAYTRACING_INSTANCE_DESC desc = instance_descs[i];
+        desc.AccelerationStructure =
+            bake_scene.proxies[bake_scene.mesh_proxy[mesh_id]]->GetGPUVirtualAddress();
+        desc.InstanceMask = OCCLUDER_MASK_FAR;
+        if (i < bake_scene.instance_occluder_mask.size()) {
+            desc.InstanceMask &= bake_scene.instance_occluder_mask[i];
+        }
+        instance_descs.push_back(desc);
+    }
+    const size_t num_proxy_descs = instance_descs.size() - instances.size();
+
+    const size_t instance_descs_size =
+        instance_descs.size() * sizeof(D3D12_RAYTRACING_INSTANCE_DESC);
+    dxr::Buffer instance_buf;
+    {
+        dxr::MemoryCategoryScope memory_scope(dxr::MEMORY_INSTANCES);
+        instance_buf = dxr::Buffer::default(
+            device,
+            align_to(instance_descs_size, D3D12_RAYTRACING_INSTANCE_DESCS_BYTE_ALIGNMENT),
+            D3D12_RESOURCE_STATE_COPY_DEST);
+    }
+
+    cmd_ctx.begin();
+    upload_ring.upload(cmd_ctx, instance_buf, instance_descs.data(), instance_descs_size);
+    {
+        D3D12_RESOURCE_BARRIER b = barrier_transition(
+            instance_buf, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+
+    // Now build the top level acceleration structure on our instance
+    auto &scene_bvh = bake_scene.scene_bvh;
+    scene_bvh =
+        dxr::TopLevelBVH(instance_buf, std::move(instances), build_flags, num_proxy_descs);
+
+    const uint32_t tlas_region = profiler.begin(cmd_list.Get(), "TLAS Build");
+    scene_bvh.enqeue_build(device, cmd_list.Get());
+    profiler.end(cmd_list.Get(), tlas_region);
+    upload_ring.submit_and_sync(cmd_ctx);
+
+    scene_bvh.finalize();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+double rebuild_scene_bvhs(ID3D12Device5 *device,
+                          dxr::CommandContext &cmd_ctx,
+                          BakeScene &bake_scene,
+                          uint32_t bvh_profile,
+                          bool use_cache,
+                          dxr::MeshBuildStats &stats,
+                          dxr::GpuProfiler &profiler)
+{
+    TRACE_SCOPE("rebuild_scene_bvhs");
+    const BvhBuildFlags build_flags = bvh_build_flags(bvh_profile);
+    std::vector<dxr::BottomLevelBVH> bvhs;
+    for (auto &m : bake_scene.meshes) {
+        bvhs.emplace_back(m.geometries, build_flags.blas);
+    }
+    std::vector<dxr::BottomLevelBVH> proxies;
+    for (auto &p : bake_scene.proxies) {
+        proxies.emplace_back(p.geometries, build_flags.blas);
+    }
+    // Release the old BVHs before building the new ones, the geometry buffers are shared
+    bake_scene.meshes.clear();
+    bake_scene.proxies.clear();
+    bake_scene.scene_bvh.bvh = dxr::Buffer();
+
+    dxr::UploadRing upload_ring(device, upload_ring_size);
+    stats = dxr::MeshBuildStats();
+    if (use_cache) {
+        build_or_load_blases(device,
+                             cmd_ctx,
+                             nullptr,
+                             upload_ring,
+                             bake_scene,
+                             nullptr,
+                             bvhs,
+                             build_flags.blas,
+                             stats,
+                             profiler);
+    } else {
+        dxr::build_bvhs(device, cmd_ctx, bvhs, &stats, 0, &profiler);
+    }
+    bake_scene.meshes = std::move(bvhs);
+    bake_scene.bvh_profile = bvh_profile;
+    // The proxies aren't cached and aren't counted in the stats
+    if (!proxies.empty()) {
+        dxr::build_bvhs(device, cmd_ctx, proxies, nullptr, 0, &profiler);
+    }
+    bake_scene.proxies = std::move(proxies);
+
+    // The TLAS instances reference the new BLASes
+    std::vector<dxr::TlasInstance> instances = bake_scene.scene_bvh.instances;
+    return build_scene_tlas(device,
+                            cmd_ctx,
+                            upload_ring,
+                            bake_scene,
+                            std::move(instances),
+                            build_flags.tlas,
+                            profiler);
+}
+
+std::array<glm::vec3, 2> instance_world_bounds(const BakeScene &bake_scene,
+                                               const dxr::TlasInstance &instance)
+{
+    std::array<glm::vec3, 2> bounds = {glm::vec3(std::numeric_limits<float>::infinity()),
+                                       glm::vec3(-std::numeric_limits<float>::infinity())};
+    const auto &b = bake_scene.mesh_bounds[instance.mesh_id];
+    if (b[0].x > b[1].x) {
+        return bounds;
+    }
+    for (int corner = 0; corner < 8; ++corner) {
+        const glm::vec3 p(b[corner & 1].x, b[(corner >> 1) & 1].y, b[corner >> 2].z);
+        const glm::vec3 v = glm::vec3(instance.transform * glm::vec4(p, 1.f));
+        bounds[0] = glm::min(bounds[0], v);
+        bounds[1] = glm::max(bounds[1], v);
+    }
+    return bounds;
+}
+
+void update_instance_transform(ID3D12Device5 *device,
+                               dxr::CommandContext &cmd_ctx,
+                               BakeScene &bake_scene,
+                               size_t instance,
+                               const glm::mat4 &transform,
+                               float ao_length,
+                               std::vector<std::array<glm::vec3, 2>> &dirty_bounds,
+                               dxr::GpuProfiler &profiler)
+{
+    auto &scene_bvh = bake_scene.scene_bvh;
+    auto &cmd_list = cmd_ctx.cmd_list;
+    dxr::TlasInstance &inst = scene_bvh.instances[instance];
+
+    const auto prev_bounds = instance_world_bounds(bake_scene, inst);
+    inst.transform = transform;
+    const auto new_bounds = instance_world_bounds(bake_scene, inst);
+    for (const auto &b : {prev_bounds, new_bounds}) {
+        if (b[0].x <= b[1].x) {
+            dirty_bounds.push_back({b[0] - glm::vec3(ao_length), b[1] + glm::vec3(ao_length)});
+        }
+    }
+    if (new_bounds[0].x <= new_bounds[1].x) {
+        bake_scene.world_lower = glm::min(bake_scene.world_lower, new_bounds[0]);
+        bake_scene.world_upper = glm::max(bake_scene.world_upper, new_bounds[1]);
+    }
+
+    // Note: D3D matrices are row-major. The transform is the first member of the desc
+    float desc_transform[3][4];
+    const glm::mat4 m = glm::transpose(transform);
+    for (int r = 0; r < 3; ++r) {
+        for (int c = 0; c < 4; ++c) {
+            desc_transform[r][c] = m[r][c];
+        }
+    }
+    const auto &region = bake_scene.instance_regions[instance];
+    BakeInstance bi;
+    bi.transform = transform;
+    bi.normal_transform = glm::transpose(glm::inverse(transform));
+    bi.uv_offset = region.uv_offset;
+    bi.uv_scale = region.uv_scale;
+
+    dxr::UploadRing upload_ring(device, 4096);
+    cmd_ctx.begin();
+    {
+        std::array<D3D12_RESOURCE_BARRIER, 2> b = {
+            barrier_transition(scene_bvh.instance_buf, D3D12_RESOURCE_STATE_COPY_DEST),
+            barrier_transition(bake_scene.bake_instances, D3D12_RESOURCE_STATE_COPY_DEST)};
+        cmd_list->ResourceBarrier(b.size(), b.data());
+    }
+    upload_ring.upload(cmd_ctx,
+                       scene_bvh.instance_buf,
+                       desc_transform,
+                       sizeof(desc_transform),
+                       instance * sizeof(D3D12_RAYTRACING_INSTANCE_DESC));
+    // The instance's occluder proxy moves with it
+    const uint32_t proxy_desc = bake_scene.instance_proxy_desc[instance];
+    if (proxy_desc != uint32_t(-1)) {
+        upload_ring.upload(cmd_ctx,
+                           scene_bvh.instance_buf,
+                           desc_transform,
+                           sizeof(desc_transform),
+                           proxy_desc * sizeof(D3D12_RAYTRACING_INSTANCE_DESC));
+    }
+    upload_ring.upload(cmd_ctx,
+                       bake_scene.bake_instances,
+                       &bi,
+                       sizeof(BakeInstance),
+                       bake_scene.bake_instance_index[instance] * sizeof(BakeInstance));
+    {
+        std::array<D3D12_RESOURCE_BARRIER, 2> b = {
+            barrier_transition(scene_bvh.instance_buf,
+                               D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE),
+            barrier_transition(bake_scene.bake_instances,
+                               D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE)};
+        cmd_list->ResourceBarrier(b.size(), b.data());
+    }
+
+    const uint32_t region_id = profiler.begin(cmd_list.Get(), "TLAS Update");
+    scene_bvh.enqueue_update(device, cmd_list.Get());
+    profiler.end(cmd_list.Get(), region_id);
+    upload_ring.submit_and_sync(cmd_ctx);
+}
+
+BakeTarget create_bake_target(ID3D12Device5 *device,
+                              const glm::uvec2 &dims,
+                              uint32_t bake_outputs,
+                              DXGI_FORMAT ao_format)
+{
+    BakeTarget target;
+    target.clear_value.Format = ao_format;
+    std::memset(target.clear_value.Color, 0, sizeof(target.clear_value.Color));
+    target.clear_value.Color[3] = 1.f;
+
+    dxr::MemoryCategoryScope memory_scope(dxr::MEMORY_RENDER_TARGETS);
+    target.ao_image = dxr::Texture2D::default(device,
+                                              dims,
+                                              D3D12_RESOURCE_STATE_RENDER_TARGET,
+                                              ao_format,
+                                              D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET |
+                                                  D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS,
+                                              &target.clear_value);
+
+    target.accum_buf = dxr::Buffer::default(device,
+                                            size_t(dims.x) * dims.y * sizeof(glm::vec2),
+                                            D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                            D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+
+    target.ray_stats = dxr::Buffer::default(device,
+                                            sizeof(RayStatsCounters),
+                                            D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                            D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+
+    if (bake_outputs & BAKE_OUTPUT_AO_EXTRAS) {
+        target.extras_buf = dxr::Buffer::default(device,
+                                                 size_t(dims.x) * dims.y * sizeof(glm::vec4),
+                                                 D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                                 D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    }
+    if (bake_outputs & BAKE_OUTPUT_DIRECT_LIGHT) {
+        target.light_buf = dxr::Buffer::default(device,
+                                                size_t(dims.x) * dims.y * sizeof(glm::vec4),
+                                                D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                                D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    }
+
+    // The blue noise tile is small and read directly from the upload heap
+    const std::vector<glm::vec2> blue_noise = generate_blue_noise(blue_noise_size, 1);
+    target.blue_noise = dxr::Buffer::upload(
+        device, blue_noise.size() * sizeof(glm::vec2), D3D12_RESOURCE_STATE_GENERIC_READ);
+    std::memcpy(target.blue_noise.map(), blue_noise.data(), target.blue_noise.size());
+    target.blue_noise.unmap();
+
+    // Make a descriptor heap
+    D3D12_DESCRIPTOR_HEAP_DESC rtv_heap_desc = {};
+    rtv_heap_desc.NumDescriptors = 1;
+    rtv_heap_desc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_RTV;
+    rtv_heap_desc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_NONE;
+    CHECK_ERR(device->CreateDescriptorHeap(&rtv_heap_desc, IID_PPV_ARGS(&target.rtv_heap)));
+
+    // Create render target descriptors heap for our AO baked
+    target.rtv_handle = target.rtv_heap->GetCPUDescriptorHandleForHeapStart();
+    device->CreateRenderTargetView(target.ao_image.get(), nullptr, target.rtv_handle);
+    return target;
+}
+
+D3D12_GPU_VIRTUAL_ADDRESS extras_address(BakeTarget &bake_target)
+{
+    // The shaders only access the extras if bake_outputs is set, so it can be left unbound
+    if (!bake_target.extras_buf.get()) {
+        return 0;
+    }
+    return bake_target.extras_buf->GetGPUVirtualAddress();
+}
+
+D3D12_GPU_VIRTUAL_ADDRESS light_address(BakeTarget &bake_target)
+{
+    if (!bake_target.light_buf.get()) {
+        return 0;
+    }
+    return bake_target.light_buf->GetGPUVirtualAddress();
+}
+
+void upload_alpha_test(ID3D12Device5 *device,
+                       dxr::CommandContext &cmd_ctx,
+                       dxr::UploadRing &upload_ring,
+                       BakeScene &bake_scene,
+                       const Scene &scene,
+                       const std::vector<AlphaTestedGeometry> &alpha_geometries)
+{
+    auto &mesh_offset = bake_scene.mesh_alpha_test_offset;
+    mesh_offset.clear();
+    mesh_offset.resize(scene.meshes.size(), uint32_t(-1));
+    if (alpha_geometries.empty()) {
+        return;
+    }
+
+    uint32_t num_entries = 0;
+    for (const auto &a : alpha_geometries) {
+        if (mesh_offset[a.mesh_id] == uint32_t(-1)) {
+            mesh_offset[a.mesh_id] = num_entries;
+            num_entries += scene.meshes[a.mesh_id].geometries.size();
+        }
+    }
+    std::vector<AlphaTestGeometry> entries(num_entries);
+    size_t data_size = entries.size() * sizeof(AlphaTestGeometry);
+    for (const auto &a : alpha_geometries) {
+        AlphaTestGeometry &e = entries[mesh_offset[a.mesh_id] + a.geometry];
+        e.uv_offset = data_size;
+        e.cutoff = a.cutoff;
+        data_size += a.uvs.size() * sizeof(glm::vec2);
+    }
+
+    // Each texture and channel used as a mask is stored once, padded to a whole word
+    std::map<std::pair<uint32_t, uint32_t>, uint32_t> mask_offsets;
+    for (const auto &a : alpha_geometries) {
+        const Image &img = scene.textures[a.texture];
+        const auto key = std::make_pair(a.texture, a.channel);
+        if (mask_offsets.find(key) == mask_offsets.end()) {
+            mask_offsets[key] = data_size;
+            data_size += align_to(size_t(img.width) * img.height, 4);
+        }
+        AlphaTestGeometry &e = entries[mesh_offset[a.mesh_id] + a.geometry];
+        e.mask_offset = mask_offsets[key];
+        e.mask_dims = uint32_t(img.width) | (uint32_t(img.height) << 16);
+    }
+    if (data_size > std::numeric_limits<uint32_t>::max()) {
+        std::cout << "Error: Alpha test data exceeds 4GB\n";
+        throw std::runtime_error("Alpha test data exceeds 4GB");
+    }
+
+    std::vector<uint8_t> data(data_size, 0);
+    std::memcpy(data.data(), entries.data(), entries.size() * sizeof(AlphaTestGeometry));
+    for (const auto &a : alpha_geometries) {
+        const AlphaTestGeometry &e = entries[mesh_offset[a.mesh_id] + a.geometry];
+        std::memcpy(&data[e.uv_offset], a.uvs.data(), a.uvs.size() * sizeof(glm::vec2));
+    }
+    for (const auto &m : mask_offsets) {
+        const Image &img = scene.textures[m.first.first];
+        const size_t num_texels = size_t(img.width) * img.height;
+        for (size_t i = 0; i < num_texels; ++i) {
+            data[m.second + i] = img.img[i * img.channels + m.first.second];
+        }
+    }
+
+    bake_scene.alpha_test =
+        dxr::Buffer::default(device, data.size(), D3D12_RESOURCE_STATE_COPY_DEST);
+    cmd_ctx.begin();
+    upload_ring.upload(cmd_ctx, bake_scene.alpha_test, data.data(), data.size());
+    {
+        D3D12_RESOURCE_BARRIER b = barrier_transition(
+            bake_scene.alpha_test, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
+        cmd_ctx.cmd_list->ResourceBarrier(1, &b);
+    }
+    upload_ring.submit_and_sync(cmd_ctx);
+}
+
+D3D12_GPU_VIRTUAL_ADDRESS alpha_test_address(BakeScene &bake_scene)
+{
+    // The shaders only read the alpha test data on non-opaque hits, so an opaque scene can
+    // leave it unbound
+    if (!bake_scene.alpha_test.get()) {
+        return 0;
+    }
+    return bake_scene.alpha_test->GetGPUVirtualAddress();
+}
+
+D3D12_GPU_VIRTUAL_ADDRESS lights_address(BakeScene &bake_scene)
+{
+    // The shaders only read the lights if num_lights is set
+    if (!bake_scene.lights.get()) {
+        return 0;
+    }
+    return bake_scene.lights->GetGPUVirtualAddress();
+}
+
+AtlasRasterPipeline create_atlas_raster_pipeline(ID3D12Device5 *device,
+                                                 dxr::RootSignature &root_signature,
+                                                 D3D12_SHADER_BYTECODE pixel_shader,
+                                                 DXGI_FORMAT render_target_format,
+                                                 uint32_t draw_param,
+                                                 D3D12_SHADER_BYTECODE bindless_vertex_shader)
+{
+    // Create the graphics pipeline state description
+    D3D12_GRAPHICS_PIPELINE_STATE_DESC desc = {0};
+
+    // Specify the vertex data layout
+    std::array<D3D12_INPUT_ELEMENT_DESC, 3> vertex_layout = {
+        D3D12_INPUT_ELEMENT_DESC{"POSITION",
+                                 0,
+                                 DXGI_FORMAT_R32G32B32_FLOAT,
+                                 0,
+                                 0,
+                                 D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA,
+                                 0},
+        D3D12_INPUT_ELEMENT_DESC{"NORMAL",
+                                 0,
+                                 DXGI_FORMAT_R16G16_SNORM,
+                                 1,
+                                 0,
+                                 D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA,
+                                 0},
+        D3D12_INPUT_ELEMENT_DESC{"TEXCOORD",
+                                 0,
+                                 DXGI_FORMAT_R32G32_FLOAT,
+                                 2,
+                                 0,
+                                 D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA,
+                                 0}};
+
+    desc.pRootSignature = root_signature.get();
+
+    desc.VS.pShaderBytecode = render_ao_map_vs_dxil;
+    desc.VS.BytecodeLength = sizeof(render_ao_map_vs_dxil);
+    desc.PS = pixel_shader;
+
+    desc.BlendState.AlphaToCoverageEnable = FALSE;
+    desc.BlendState.IndependentBlendEnable = FALSE;
+    {
+        const D3D12_RENDER_TARGET_BLEND_DESC rt_blend_desc = {
+            false,
+            false,
+            D3D12_BLEND_ONE,
+            D3D12_BLEND_ZERO,
+            D3D12_BLEND_OP_ADD,
+            D3D12_BLEND_ONE,
+            D3D12_BLEND_ZERO,
+            D3D12_BLEND_OP_ADD,
+            D3D12_LOGIC_OP_NOOP,
+            D3D12_COLOR_WRITE_ENABLE_ALL,
+        };
+        for (int i = 0; i < D3D12_SIMULTANEOUS_RENDER_TARGET_COUNT; ++i) {
+            desc.BlendState.RenderTarget[i] = rt_blend_desc;
+        }
+    }
+
+    desc.RasterizerState.FillMode = D3D12_FILL_MODE_SOLID;
+    desc.RasterizerState.CullMode = D3D12_CULL_MODE_NONE;
+    desc.RasterizerState.FrontCounterClockwise = FALSE;
+    desc.RasterizerState.DepthBias = D3D12_DEFAULT_DEPTH_BIAS;
+    desc.RasterizerState.DepthBiasClamp = D3D12_DEFAULT_DEPTH_BIAS_CLAMP;
+    desc.RasterizerState.SlopeScaledDepthBias = D3D12_DEFAULT_SLOPE_SCALED_DEPTH_BIAS;
+    desc.RasterizerState.DepthClipEnable = TRUE;
+    desc.RasterizerState.MultisampleEnable = FALSE;
+    desc.RasterizerState.AntialiasedLineEnable = FALSE;
+    desc.RasterizerState.ForcedSampleCount = 0;
+    desc.RasterizerState.ConservativeRaster = D3D12_CONSERVATIVE_RASTERIZATION_MODE_OFF;
+
+    desc.SampleMask = UINT_MAX;
+    desc.DepthStencilState.DepthEnable = false;
+    desc.DepthStencilState.StencilEnable = false;
+
+    desc.InputLayout.pInputElementDescs = vertex_layout.data();
+    desc.InputLayout.NumElements = vertex_layout.size();
+    desc.PrimitiveTopologyType = D3D12_PRIMITIVE_TOPOLOGY_TYPE_TRIANGLE;
+
+    if (render_target_format != DXGI_FORMAT_UNKNOWN) {
+        desc.NumRenderTargets = 1;
+        desc.RTVFormats[0] = render_target_format;
+    }
+    desc.SampleDesc.Count = 1;
+
+    AtlasRasterPipeline pipeline;
+    pipeline.bindless = bindless_vertex_shader.pShaderBytecode != nullptr;
+    if (pipeline.bindless) {
+        // The vertex shader decodes either position format from the draw's stride
+        desc.VS = bindless_vertex_shader;
+        desc.InputLayout.pInputElementDescs = nullptr;
+        desc.InputLayout.NumElements = 0;
+        pipeline.float_positions = dxr::create_graphics_pipeline_state(device, desc);
+        pipeline.quantized_positions = pipeline.float_positions;
+    } else {
+        // The pipelines only differ in the format of the positions
+        pipeline.float_positions = dxr::create_graphics_pipeline_state(device, desc);
+        vertex_layout[0].Format = DXGI_FORMAT_R16G16B16A16_SNORM;
+        pipeline.quantized_positions = dxr::create_graphics_pipeline_state(device, desc);
+    }
+
+    // Each draw sets its vertex and index buffers and draw ID, matching AtlasDrawArgs
+    std::array<D3D12_INDIRECT_ARGUMENT_DESC, 6> args = {};
+    for (uint32_t i = 0; i < 3; ++i) {
+        args[i].Type = D3D12_INDIRECT_ARGUMENT_TYPE_VERTEX_BUFFER_VIEW;
+        args[i].VertexBuffer.Slot = i;
+    }
+    args[3].Type = D3D12_INDIRECT_ARGUMENT_TYPE_INDEX_BUFFER_VIEW;
+    args[4].Type = D3D12_INDIRECT_ARGUMENT_TYPE_CONSTANT;
+    args[4].Constant.RootParameterIndex = draw_param;
+    args[4].Constant.DestOffsetIn32BitValues = 0;
+    args[4].Constant.Num32BitValuesToSet = 1;
+    args[5].Type = D3D12_INDIRECT_ARGUMENT_TYPE_DRAW_INDEXED;
+    // The bindless draws skip the vertex buffer views, they're read from the same
+    // AtlasDrawArgs starting at the index buffer view, see draw_atlas_geometry
+    const size_t first_arg = pipeline.bindless ? 3 : 0;
+
+    D3D12_COMMAND_SIGNATURE_DESC signature_desc = {0};
+    signature_desc.ByteStride = sizeof(AtlasDrawArgs);
+    signature_desc.NumArgumentDescs = args.size() - first_arg;
+    signature_desc.pArgumentDescs = args.data() + first_arg;
+    CHECK_ERR(device->CreateCommandSignature(&signature_desc,
+                                             root_signature.get(),
+                                             IID_PPV_ARGS(&pipeline.command_signature)));
+    return pipeline;
+}
+
+BakePipeline create_bake_pipeline(ID3D12Device5 *device, DXGI_FORMAT ao_format)
+{
+    BakePipeline pipeline;
+    pipeline.direct_heap_indexing = dxr::bindless_available(device);
+    auto root_signature_builder =
+        dxr::RootSignatureBuilder::global(
+            pipeline.direct_heap_indexing
+                ? D3D12_ROOT_SIGNATURE_FLAG_CBV_SRV_UAV_HEAP_DIRECTLY_INDEXED
+                : D3D12_ROOT_SIGNATURE_FLAG_NONE)
+            .add_constants("atlas_info", 0, 10, 0)
+            .add_constants("draw_info", 2, 1, 0)
+            .add_constants("light_info", 3, 1, 0)
+            .add_srv("scene", 0, 0)
+            .add_uav("accum_buffer", 0, 0)
+            .add_srv("blue_noise", 2, 0)
+            .add_uav("extras_accum", 5, 0)
+            .add_uav("ray_stats", 7, 0)
+            .add_srv("instances", 4, 0)
+            .add_srv("atlas_draws", 5, 0)
+            .add_srv("alpha_test", 0, 1)
+            .add_srv("lights", 6, 0)
+            .add_uav("light_accum", 6, 0);
+    if (pipeline.direct_heap_indexing) {
+        pipeline.root_signature = root_signature_builder.create(device);
+        pipeline.vertex_shader.pShaderBytecode = render_ao_map_bindless_vs_dxil;
+        pipeline.vertex_shader.BytecodeLength = sizeof(render_ao_map_bindless_vs_dxil);
+    } else {
+        // The table's layout doesn't depend on the capacity of the unbounded range, so it's
+        // taken from a heap of one pool. The scenes' heaps are bound to it
+        const dxr::DescriptorHeap layout_heap = geometry_heap_builder(1).create(device);
+        pipeline.root_signature =
+            root_signature_builder.add_desc_heap("geometry_buffers", layout_heap)
+                .create(device);
+        pipeline.vertex_shader.pShaderBytecode = render_ao_map_table_vs_dxil;
+        pipeline.vertex_shader.BytecodeLength = sizeof(render_ao_map_table_vs_dxil);
+    }
+
+    D3D12_SHADER_BYTECODE pixel_shader = {0};
+    pixel_shader.pShaderBytecode = render_ao_map_fs_dxil;
+    pixel_shader.BytecodeLength = sizeof(render_ao_map_fs_dxil);
+    pipeline.raster = create_atlas_raster_pipeline(device,
+                                                   pipeline.root_signature,
+                                                   pixel_shader,
+                                                   ao_format,
+                                                   1,
+                                                   pipeline.vertex_shader);
+    pipeline.device = device;
+    pipeline.ao_format = ao_format;
+    pipeline.permutations.resize(
+        sizeof(render_ao_map_fs_permutations) / sizeof(D3D12_SHADER_BYTECODE));
+
+    create_cull_pipeline(device, pipeline);
+
+    return pipeline;
+}
+
+uint32_t bake_permutation(const AtlasParams &atlas_params, bool alpha_test)
+{
+    // Must match the order of the permutations in CMakeLists.txt
+    const std::array<int, 4> batch_samples = {0, 4, 8, 16};
+    uint32_t batch = 0;
+    for (uint32_t i = 1; i < batch_samples.size(); ++i) {
+        if (atlas_params.samples_per_frame == batch_samples[i] &&
+            atlas_params.n_samples % batch_samples[i] == 0) {
+            batch = i;
+        }
+    }
+    const uint32_t extras = (atlas_params.bake_outputs & BAKE_OUTPUT_AO_EXTRAS) != 0 ? 1 : 0;
+    return ((batch * 4 + atlas_params.sampler_type) * 2 + extras) * 2 + (alpha_test ? 1 : 0);
+}
+
+const AtlasRasterPipeline &bake_raster_pipeline(BakePipeline &pipeline,
+                                                const AtlasParams &atlas_params,
+                                                bool alpha_test)
+{
+    const uint32_t index = bake_permutation(atlas_params, alpha_test);
+    if (index >= pipeline.permutations.size()) {
+        return pipeline.raster;
+    }
+    AtlasRasterPipeline &permutation = pipeline.permutations[index];
+    if (!permutation.float_positions) {
+        permutation = create_atlas_raster_pipeline(pipeline.device.Get(),
+                                                   pipeline.root_signature,
+                                                   render_ao_map_fs_permutations[index],
+                                                   pipeline.ao_format,
+                                                   1,
+                                                   pipeline.vertex_shader);
+    }
+    return permutation;
+}
+
+void record_bake(ID3D12GraphicsCommandList4 *cmd_list,
+                 BakePipeline &pipeline,
+                 BakeScene &bake_scene,
+                 BakeTarget &bake_target,
+                 const AtlasParams &atlas_params,
+                 const D3D12_RECT &tile)
+{
+    D3D12_VIEWPORT viewport = {0};
+    viewport.Width = static_cast<float>(atlas_params.dimensions.x);
+    viewport.Height = static_cast<float>(atlas_params.dimensions.y);
+    viewport.MinDepth = D3D12_MIN_DEPTH;
+    viewport.MaxDepth = D3D12_MAX_DEPTH;
+
+    cull_atlas_draws(
+        cmd_list, pipeline, bake_scene, glm::uvec2(atlas_params.dimensions), tile);
+
+    // The heap must be set before the root signature when it's indexed directly
+    std::array<ID3D12DescriptorHeap *, 1> heaps = {bake_scene.geometry_heap.get()};
+    cmd_list->SetDescriptorHeaps(heaps.size(), heaps.data());
+    cmd_list->SetGraphicsRootSignature(pipeline.root_signature.get());
+    if (!pipeline.direct_heap_indexing) {
+        cmd_list->SetGraphicsRootDescriptorTable(13,
+                                                 bake_scene.geometry_heap.gpu_desc_handle());
+    }
+    cmd_list->SetGraphicsRoot32BitConstants(0, 10, &atlas_params, 0);
+    cmd_list->SetGraphicsRoot32BitConstants(2, 1, &bake_scene.num_lights, 0);
+    cmd_list->SetGraphicsRootShaderResourceView(3,
+                                                bake_scene.scene_bvh->GetGPUVirtualAddress());
+    cmd_list->SetGraphicsRootUnorderedAccessView(
+        4, bake_target.accum_buf->GetGPUVirtualAddress());
+    cmd_list->SetGraphicsRootShaderResourceView(
+        5, bake_target.blue_noise.gpu_virtual_address());
+    cmd_list->SetGraphicsRootUnorderedAccessView(6, extras_address(bake_target));
+    cmd_list->SetGraphicsRootUnorderedAccessView(
+        7, bake_target.ray_stats->GetGPUVirtualAddress());
+    cmd_list->SetGraphicsRootShaderResourceView(
+        8, bake_scene.bake_instances->GetGPUVirtualAddress());
+    cmd_list->SetGraphicsRootShaderResourceView(
+        9, bake_scene.atlas_draws->GetGPUVirtualAddress());
+    cmd_list->SetGraphicsRootShaderResourceView(10, alpha_test_address(bake_scene));
+    cmd_list->SetGraphicsRootShaderResourceView(11, lights_address(bake_scene));
+    cmd_list->SetGraphicsRootUnorderedAccessView(12, light_address(bake_target));
+    cmd_list->RSSetViewports(1, &viewport);
+    cmd_list->RSSetScissorRects(1, &tile);
+    cmd_list->OMSetRenderTargets(1, &bake_target.rtv_handle, false, nullptr);
+
+    cmd_list->ClearRenderTargetView(
+        bake_target.rtv_handle, bake_target.clear_value.Color, 1, &tile);
+    const AtlasRasterPipeline &raster =
+        bake_raster_pipeline(pipeline, atlas_params, bake_scene.alpha_test.get() != nullptr);
+    draw_atlas_geometry(cmd_list, bake_scene, raster, true);
+
+    // Make sure the accumulation writes are done before the next frame reads them
+    auto b = dxr::barrier_uav(bake_target.accum_buf);
+    cmd_list->ResourceBarrier(1, &b);
+    if (atlas_params.bake_outputs & BAKE_OUTPUT_AO_EXTRAS) {
+        b = dxr::barrier_uav(bake_target.extras_buf);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    if (atlas_params.bake_outputs & BAKE_OUTPUT_DIRECT_LIGHT) {
+        b = dxr::barrier_uav(bake_target.light_buf);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+}
+
+void bake_frame(dxr::CommandContext &cmd_ctx,
+                BakePipeline &pipeline,
+                BakeScene &bake_scene,
+                BakeTarget &bake_target,
+                const AtlasParams &atlas_params,
+                uint32_t tile_size,
+                const std::vector<glm::uvec2> &tiles,
+                dxr::GpuProfiler &profiler)
+{
+    const glm::uvec2 dims(atlas_params.dimensions);
+    std::vector<glm::uvec2> all_tiles;
+    if (tiles.empty()) {
+        for (uint32_t y = 0; y < dims.y; y += tile_size) {
+            for (uint32_t x = 0; x < dims.x; x += tile_size) {
+                all_tiles.push_back(glm::uvec2(x, y));
+            }
+        }
+    }
+    const std::vector<glm::uvec2> &bake_tiles = tiles.empty() ? all_tiles : tiles;
+
+    uint32_t region = dxr::GpuProfiler::invalid_region;
+    for (size_t i = 0; i < bake_tiles.size(); ++i) {
+        const glm::uvec2 &origin = bake_tiles[i];
+        D3D12_RECT tile = {0};
+        tile.left = origin.x;
+        tile.top = origin.y;
+        tile.right = std::min(origin.x + tile_size, dims.x);
+        tile.bottom = std::min(origin.y + tile_size, dims.y);
+
+        cmd_ctx.begin();
+        if (i == 0) {
+            region = profiler.begin(cmd_ctx.cmd_list.Get(), "Bake");
+        }
+        record_bake(
+            cmd_ctx.cmd_list.Get(), pipeline, bake_scene, bake_target, atlas_params, tile);
+        if (i + 1 == bake_tiles.size()) {
+            profiler.end(cmd_ctx.cmd_list.Get(), region);
+        }
+        cmd_ctx.submit_and_sync();
+    }
+}
+
+RayStatsQuery create_ray_stats_query(ID3D12Device5 *device, dxr::CommandContext &cmd_ctx)
+{
+    RayStatsQuery query;
+    D3D12_QUERY_HEAP_DESC heap_desc = {0};
+    heap_desc.Type = D3D12_QUERY_HEAP_TYPE_TIMESTAMP;
+    heap_desc.Count = 2;
+    CHECK_ERR(device->CreateQueryHeap(&heap_desc, IID_PPV_ARGS(&query.timestamp_heap)));
+    CHECK_ERR(cmd_ctx.queue->GetTimestampFrequency(&query.timestamp_frequency));
+
+    // Copied to reset the counters each frame. Zeroed explicitly since with placed resources
+    // it may reuse memory freed by an earlier job
+    query.zero_counters = dxr::Buffer::upload(
+        device, sizeof(RayStatsCounters), D3D12_RESOURCE_STATE_GENERIC_READ);
+    std::memset(query.zero_counters.map(), 0, sizeof(RayStatsCounters));
+    query.zero_counters.unmap();
+    query.counters_readback = dxr::Buffer::readback(
+        device, sizeof(RayStatsCounters), D3D12_RESOURCE_STATE_COPY_DEST);
+    query.timestamps_readback =
+        dxr::Buffer::readback(device, 2 * sizeof(uint64_t), D3D12_RESOURCE_STATE_COPY_DEST);
+    return query;
+}
+
+void begin_ray_stats(dxr::CommandContext &cmd_ctx,
+                     RayStatsQuery &query,
+                     BakeTarget &bake_target)
+{
+    cmd_ctx.begin();
+    auto &cmd_list = cmd_ctx.cmd_list;
+    {
+        auto b =
+            dxr::barrier_transition(bake_target.ray_stats, D3D12_RESOURCE_STATE_COPY_DEST);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    dxr::copy_buffer(cmd_list.Get(), bake_target.ray_stats, query.zero_counters);
+    {
+        auto b = dxr::barrier_transition(bake_target.ray_stats,
+                                         D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    cmd_list->EndQuery(query.timestamp_heap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, 0);
+    cmd_ctx.submit_and_sync();
+}
+
+RayStats end_ray_stats(dxr::CommandContext &cmd_ctx,
+                       RayStatsQuery &query,
+                       BakeTarget &bake_target)
+{
+    cmd_ctx.begin();
+    auto &cmd_list = cmd_ctx.cmd_list;
+    cmd_list->EndQuery(query.timestamp_heap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, 1);
+    cmd_list->ResolveQueryData(query.timestamp_heap.Get(),
+                               D3D12_QUERY_TYPE_TIMESTAMP,
+                               0,
+                               2,
+                               query.timestamps_readback.get(),
+                               query.timestamps_readback.offset());
+    {
+        auto b =
+            dxr::barrier_transition(bake_target.ray_stats, D3D12_RESOURCE_STATE_COPY_SOURCE);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    dxr::copy_buffer(cmd_list.Get(), query.counters_readback, bake_target.ray_stats);
+    {
+        auto b = dxr::barrier_transition(bake_target.ray_stats,
+                                         D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    cmd_ctx.submit_and_sync();
+
+    RayStats stats;
+    const RayStatsCounters *counters =
+        static_cast<const RayStatsCounters *>(query.counters_readback.map());
+    stats.rays = counters->rays;
+    stats.hits = counters->hits;
+    stats.active_texels = counters->active_texels;
+    query.counters_readback.unmap();
+
+    const uint64_t *timestamps =
+        static_cast<const uint64_t *>(query.timestamps_readback.map());
+    if (timestamps[1] > timestamps[0]) {
+        stats.gpu_ms =
+            double(timestamps[1] - timestamps[0]) * 1000.0 / query.timestamp_frequency;
+    }
+    query.timestamps_readback.unmap();
+    return stats;
+}
+
+ComPtr<ID3D12PipelineState> create_compute_pipeline(ID3D12Device5 *device,
+                                                   dxr::RootSignature &root_signature,
+                                                   const void *dxil,
+                                                   size_t dxil_size)
+{
+    D3D12_COMPUTE_PIPELINE_STATE_DESC desc = {0};
+    desc.pRootSignature = root_signature.get();
+    desc.CS.pShaderBytecode = dxil;
+    desc.CS.BytecodeLength = dxil_size;
+
+    return dxr::create_compute_pipeline_state(device, desc);
+}
+
+ComputeBakePipeline create_compute_bake_pipeline(ID3D12Device5 *device)
+{
+    ComputeBakePipeline pipeline;
+    pipeline.gbuffer_signature =
+        dxr::RootSignatureBuilder::global(
+            D3D12_ROOT_SIGNATURE_FLAG_ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT)
+            .add_constants("gbuffer_info", 1, 4, 0)
+            .add_constants("draw_info", 2, 1, 0)
+            .add_uav("texel_flags", 2, 0)
+            .add_uav("texels_out", 3, 0)
+            .add_uav("texel_count", 4, 0)
+            .add_srv("instances", 4, 0)
+            .add_srv("atlas_draws", 5, 0)
+            .create(device);
+
+    D3D12_SHADER_BYTECODE pixel_shader = {0};
+    pixel_shader.pShaderBytecode = texel_gbuffer_fs_dxil;
+    pixel_shader.BytecodeLength = sizeof(texel_gbuffer_fs_dxil);
+    // The G-buffer pass only writes through UAVs, so it has no render target
+    pipeline.gbuffer_raster = create_atlas_raster_pipeline(
+        device, pipeline.gbuffer_signature, pixel_shader, DXGI_FORMAT_UNKNOWN, 1);
+
+    pipeline.output_heap =
+        dxr::DescriptorHeapBuilder().add_uav_range(1, 1, 0, "ao_output").create(device);
+
+    pipeline.bake_signature = dxr::RootSignatureBuilder::global()
+                                  .add_constants("atlas_info", 0, 13, 0)
+                                  .add_srv("scene", 0, 0)
+                                  .add_srv("texels", 1, 0)
+                                  .add_uav("accum_buffer", 0, 0)
+                                  .add_desc_heap("output_heap", pipeline.output_heap)
+                                  .add_srv("blue_noise", 2, 0)
+                                  .add_uav("extras_accum", 5, 0)
+                                  .add_uav("ray_stats", 7, 0)
+                                  .add_srv("sample_budget", 3, 0)
+                                  .add_srv("alpha_test", 0, 1)
+                                  .create(device);
+
+    pipeline.bake_pipeline_state = create_compute_pipeline(
+        device, pipeline.bake_signature, texel_bake_cs_dxil, sizeof(texel_bake_cs_dxil));
+
+    return pipeline;
+}
+
+dxr::RTPipeline create_raygen_bake_pipeline(ID3D12Device5 *device,
+                                            dxr::CommandContext &cmd_ctx,
+                                            ComputeBakePipeline &compute_pipeline)
+{
+    dxr::ShaderLibrary shader_library(
+        texel_bake_rt_dxil,
+        sizeof(texel_bake_rt_dxil),
+        {L"bake_raygen", L"ao_miss", L"ao_closest_hit", L"ao_any_hit"});
+
+    // The closest hit shader is only run by the hit distance rays, the occlusion rays skip
+    // it. The any hit shader alpha tests the hits on alpha tested geometry
+    dxr::RTPipeline pipeline =
+        dxr::RTPipelineBuilder()
+            .set_global_root_sig(compute_pipeline.bake_signature)
+            .add_shader_library(shader_library)
+            .set_ray_gen(L"bake_raygen")
+            .add_miss_shader(L"ao_miss")
+            .add_hit_group({L"AOHitGroup",
+                            D3D12_HIT_GROUP_TYPE_TRIANGLES,
+                            L"ao_closest_hit",
+                            L"ao_any_hit"})
+            .configure_shader_payload(shader_library.export_names(),
+                                      sizeof(float),
+                                      sizeof(glm::vec2))
+            .set_max_recursion(1)
+            .create(device);
+
+    cmd_ctx.begin();
+    pipeline.upload_shader_table(cmd_ctx.cmd_list.Get());
+    cmd_ctx.submit_and_sync();
+    return pipeline;
+}
+
+WavefrontPipeline create_wavefront_pipeline(ID3D12Device5 *device,
+                                            ComputeBakePipeline &compute_pipeline)
+{
+    WavefrontPipeline pipeline;
+    pipeline.signature = dxr::RootSignatureBuilder::global()
+                             .add_constants("atlas_info", 0, 21, 0)
+                             .add_srv("scene", 0, 0)
+                             .add_srv("texels", 1, 0)
+                             .add_uav("accum_buffer", 0, 0)
+                             .add_uav("rays", 2, 0)
+                             .add_uav("binned_rays", 3, 0)
+                             .add_uav("bin_counts", 4, 0)
+                             .add_uav("bin_offsets", 5, 0)
+                             .add_uav("texel_occlusion", 6, 0)
+                             .add_desc_heap("output_heap", compute_pipeline.output_heap)
+                             .add_srv("blue_noise", 2, 0)
+                             .add_uav("ray_stats", 7, 0)
+                             .add_srv("alpha_test", 0, 1)
+                             .create(device);
+
+    pipeline.raygen = create_compute_pipeline(device,
+                                              pipeline.signature,
+                                              wavefront_raygen_cs_dxil,
+                                              sizeof(wavefront_raygen_cs_dxil));
+    pipeline.scan = create_compute_pipeline(
+        device, pipeline.signature, wavefront_scan_cs_dxil, sizeof(wavefront_scan_cs_dxil));
+    pipeline.scatter = create_compute_pipeline(device,
+                                               pipeline.signature,
+                                               wavefront_scatter_cs_dxil,
+                                               sizeof(wavefront_scatter_cs_dxil));
+    pipeline.trace = create_compute_pipeline(
+        device, pipeline.signature, wavefront_trace_cs_dxil, sizeof(wavefront_trace_cs_dxil));
+    pipeline.resolve = create_compute_pipeline(device,
+                                               pipeline.signature,
+                                               wavefront_resolve_cs_dxil,
+                                               sizeof(wavefront_resolve_cs_dxil));
+
+    // The bin counts and texel occlusion start zeroed and are reset by the passes
+    // consuming them, so they're ready for the next chunk
+    const size_t ray_size = 2 * sizeof(glm::vec4);
+    pipeline.rays = dxr::Buffer::default(device,
+                                         size_t(wavefront_ray_capacity) * ray_size,
+                                         D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                         D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    pipeline.binned_rays = dxr::Buffer::default(device,
+                                                size_t(wavefront_ray_capacity) * ray_size,
+                                                D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                                D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    pipeline.bin_counts = dxr::Buffer::default(device,
+                                               wavefront_num_bins * sizeof(uint32_t),
+                                               D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                               D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    pipeline.bin_offsets = dxr::Buffer::default(device,
+                                                (wavefront_num_bins + 1) * sizeof(uint32_t),
+                                                D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                                D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    pipeline.texel_occlusion =
+        dxr::Buffer::default(device,
+                             wavefront_ray_capacity * sizeof(uint32_t),
+                             D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                             D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    return pipeline;
+}
+
+void write_compute_bake_output(ID3D12Device5 *device,
+                               ComputeBakePipeline &pipeline,
+                               BakeTarget &bake_target)
+{
+    D3D12_UNORDERED_ACCESS_VIEW_DESC uav_desc = {0};
+    uav_desc.Format = bake_target.ao_image.pixel_format();
+    uav_desc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
+    device->CreateUnorderedAccessView(bake_target.ao_image.get(),
+                                      nullptr,
+                                      &uav_desc,
+                                      pipeline.output_heap.cpu_desc_handle("ao_output"));
+}
+
+TexelGBuffer build_texel_gbuffer(ID3D12Device5 *device,
+                                 dxr::CommandContext &cmd_ctx,
+                                 ComputeBakePipeline &pipeline,
+                                 BakeScene &bake_scene,
+                                 BakeTarget &bake_target,
+                                 bool clear_ao)
+{
+    const auto start = std::chrono::steady_clock::now();
+
+    // The viewer's preview levels are rasterized at a fraction of the atlas size
+    const glm::uvec2 dims = bake_target.ao_image.dims();
+    const size_t n_atlas_texels = size_t(dims.x) * dims.y;
+
+    D3D12_VIEWPORT viewport = {0};
+    viewport.Width = static_cast<float>(dims.x);
+    viewport.Height = static_cast<float>(dims.y);
+    viewport.MinDepth = D3D12_MIN_DEPTH;
+    viewport.MaxDepth = D3D12_MAX_DEPTH;
+
+    D3D12_RECT scissor = {0};
+    scissor.right = dims.x;
+    scissor.bottom = dims.y;
+
+    dxr::Buffer count_readback =
+        dxr::Buffer::readback(device, sizeof(uint32_t), D3D12_RESOURCE_STATE_COPY_DEST);
+
+    // The first pass only counts the covered texels, the second writes them out to the
+    // exactly sized list. Each pass uses new flag and count buffers, as these start zeroed
+    TexelGBuffer gbuffer;
+    GBufferParams params = {dims, 0, 0};
+    for (int pass = 0; pass < 2; ++pass) {
+        dxr::Buffer texel_flags =
+            dxr::Buffer::default(device,
+                                 align_to((n_atlas_texels + 31) / 32 * sizeof(uint32_t), 16),
+                                 D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                 D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+        dxr::Buffer texel_count =
+            dxr::Buffer::default(device,
+                                 sizeof(uint32_t),
+                                 D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                 D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+        // The counting pass doesn't write any texels but still needs a buffer bound
+        gbuffer.texels = dxr::Buffer::default(
+            device,
+            std::max(params.max_texels, uint32_t(1)) * sizeof(TexelData),
+            D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+            D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+
+        cmd_ctx.begin();
+        auto &cmd_list = cmd_ctx.cmd_list;
+        if (pass == 0 && clear_ao) {
+            cmd_list->ClearRenderTargetView(
+                bake_target.rtv_handle, bake_target.clear_value.Color, 0, nullptr);
+        }
+        cmd_list->SetGraphicsRootSignature(pipeline.gbuffer_signature.get());
+        cmd_list->SetGraphicsRoot32BitConstants(0, 4, &params, 0);
+        cmd_list->SetGraphicsRootUnorderedAccessView(2, texel_flags->GetGPUVirtualAddress());
+        cmd_list->SetGraphicsRootUnorderedAccessView(3,
+                                                     gbuffer.texels->GetGPUVirtualAddress());
+        cmd_list->SetGraphicsRootUnorderedAccessView(4, texel_count->GetGPUVirtualAddress());
+        cmd_list->SetGraphicsRootShaderResourceView(
+            5, bake_scene.bake_instances->GetGPUVirtualAddress());
+        cmd_list->SetGraphicsRootShaderResourceView(
+            6, bake_scene.atlas_draws->GetGPUVirtualAddress());
+        cmd_list->RSSetViewports(1, &viewport);
+        cmd_list->RSSetScissorRects(1, &scissor);
+        cmd_list->OMSetRenderTargets(0, nullptr, false, nullptr);
+
+        draw_atlas_geometry(cmd_list.Get(), bake_scene, pipeline.gbuffer_raster, false);
+
+        {
+            std::array<D3D12_RESOURCE_BARRIER, 2> b = {
+                dxr::barrier_transition(texel_count, D3D12_RESOURCE_STATE_COPY_SOURCE),
+                dxr::barrier_transition(gbuffer.texels,
+                                        D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE)};
+            cmd_list->ResourceBarrier(b.size(), b.data());
+        }
+        dxr::copy_buffer(cmd_list.Get(), count_readback, texel_count);
+        cmd_ctx.submit_and_sync();
+
+        const uint32_t *count = static_cast<const uint32_t *>(count_readback.map());
+        params.max_texels = *count;
+        count_readback.unmap();
+
+        params.write_texels = 1;
+        if (pass == 1) {
+            gbuffer.coverage = texel_flags;
+        }
+    }
+    gbuffer.num_texels = params.max_texels;
+
+    const auto end = std::chrono::steady_clock::now();
+    gbuffer.build_ms =
+        std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() * 1.0e-3f;
+    return gbuffer;
+}
+
+void bake_frame_compute(dxr::CommandContext &cmd_ctx,
+                        ComputeBakePipeline &pipeline,
+                        BakeScene &bake_scene,
+                        BakeTarget &bake_target,
+                        TexelGBuffer &texel_gbuffer,
+                        const AtlasParams &atlas_params,
+                        uint32_t tile_size,
+                        dxr::GpuProfiler &profiler,
+                        dxr::RTPipeline *raygen_pipeline)
+{
+    // Dispatches are also limited to 65535 groups of 64 threads
+    const uint32_t chunk_size = static_cast<uint32_t>(
+        std::min(uint64_t(tile_size) * tile_size, uint64_t(65535) * 64));
+
+    ComputeBakeParams params(atlas_params);
+    const bool use_sample_budget = texel_gbuffer.sample_budget.size() != 0;
+    params.use_sample_budget = use_sample_budget ? 1 : 0;
+    uint32_t region = dxr::GpuProfiler::invalid_region;
+    for (uint32_t offset = 0; offset < texel_gbuffer.num_texels; offset += chunk_size) {
+        params.texel_offset = offset;
+        params.num_texels = std::min(chunk_size, texel_gbuffer.num_texels - offset);
+
+        cmd_ctx.begin();
+        auto &cmd_list = cmd_ctx.cmd_list;
+        if (offset == 0) {
+            region = profiler.begin(cmd_list.Get(), "Bake");
+            auto b = dxr::barrier_transition(bake_target.ao_image,
+                                             D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+            cmd_list->ResourceBarrier(1, &b);
+        }
+
+        ID3D12DescriptorHeap *heap = pipeline.output_heap.get();
+        cmd_list->SetDescriptorHeaps(1, &heap);
+        if (raygen_pipeline) {
+            cmd_list->SetPipelineState1(raygen_pipeline->get());
+        } else {
+            cmd_list->SetPipelineState(pipeline.bake_pipeline_state.Get());
+        }
+        cmd_list->SetComputeRootSignature(pipeline.bake_signature.get());
+        cmd_list->SetComputeRoot32BitConstants(0, 13, &params, 0);
+        cmd_list->SetComputeRootShaderResourceView(
+            1, bake_scene.scene_bvh->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootShaderResourceView(
+            2, texel_gbuffer.texels->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootUnorderedAccessView(
+            3, bake_target.accum_buf->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootDescriptorTable(4, pipeline.output_heap.gpu_desc_handle());
+        cmd_list->SetComputeRootShaderResourceView(
+            5, bake_target.blue_noise.gpu_virtual_address());
+        cmd_list->SetComputeRootUnorderedAccessView(6, extras_address(bake_target));
+        cmd_list->SetComputeRootUnorderedAccessView(
+            7, bake_target.ray_stats->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootShaderResourceView(
+            8,
+            use_sample_budget ? texel_gbuffer.sample_budget->GetGPUVirtualAddress() : 0);
+        cmd_list->SetComputeRootShaderResourceView(9, alpha_test_address(bake_scene));
+        if (raygen_pipeline) {
+            // One ray generation invocation per texel in the chunk
+            D3D12_DISPATCH_RAYS_DESC dispatch_rays =
+                raygen_pipeline->dispatch_rays(glm::uvec2(params.num_texels, 1));
+            cmd_list->DispatchRays(&dispatch_rays);
+        } else {
+            cmd_list->Dispatch((params.num_texels + 63) / 64, 1, 1);
+        }
+
+        // Make sure the accumulation writes are done before the next frame reads them
+        {
+            auto b = dxr::barrier_uav(bake_target.accum_buf);
+            cmd_list->ResourceBarrier(1, &b);
+        }
+        if (atlas_params.bake_outputs & BAKE_OUTPUT_AO_EXTRAS) {
+            auto b = dxr::barrier_uav(bake_target.extras_buf);
+            cmd_list->ResourceBarrier(1, &b);
+        }
+        if (offset + params.num_texels >= texel_gbuffer.num_texels) {
+            auto b = dxr::barrier_transition(bake_target.ao_image,
+                                             D3D12_RESOURCE_STATE_RENDER_TARGET);
+            cmd_list->ResourceBarrier(1, &b);
+            profiler.end(cmd_list.Get(), region);
+        }
+        cmd_ctx.submit_and_sync();
+    }
+}
+
+void bake_frame_wavefront(dxr::CommandContext &cmd_ctx,
+                          ComputeBakePipeline &compute_pipeline,
+                          WavefrontPipeline &pipeline,
+                          BakeScene &bake_scene,
+                          BakeTarget &bake_target,
+                          TexelGBuffer &texel_gbuffer,
+                          const AtlasParams &atlas_params,
+                          uint32_t tile_size,
+                          dxr::GpuProfiler &profiler)
+{
+    const uint32_t samples_per_frame = std::max(atlas_params.samples_per_frame, 1);
+    const uint32_t chunk_size = static_cast<uint32_t>(
+        std::min(uint64_t(tile_size) * tile_size, uint64_t(65535) * 64));
+    const uint32_t chunk_texels =
+        std::max(std::min(chunk_size, wavefront_ray_capacity / samples_per_frame), 1u);
+
+    WavefrontParams params(atlas_params);
+    const glm::vec3 extent = bake_scene.world_upper - bake_scene.world_lower;
+    params.scene_lower = bake_scene.world_lower;
+    params.scene_inv_extent = 1.f / glm::max(extent, glm::vec3(1e-6f));
+
+    std::array<D3D12_RESOURCE_BARRIER, 5> pass_barriers = {
+        dxr::barrier_uav(pipeline.rays),
+        dxr::barrier_uav(pipeline.binned_rays),
+        dxr::barrier_uav(pipeline.bin_counts),
+        dxr::barrier_uav(pipeline.bin_offsets),
+        dxr::barrier_uav(pipeline.texel_occlusion)};
+
+    uint32_t region = dxr::GpuProfiler::invalid_region;
+    for (uint32_t offset = 0; offset < texel_gbuffer.num_texels; offset += chunk_texels) {
+        params.bake.texel_offset = offset;
+        params.bake.num_texels = std::min(chunk_texels, texel_gbuffer.num_texels - offset);
+        const uint32_t texel_groups = (params.bake.num_texels + 63) / 64;
+        // Rays past the number actually generated exit early in the trace pass
+        const uint32_t ray_groups = (params.bake.num_texels * samples_per_frame + 63) / 64;
+
+        cmd_ctx.begin();
+        auto &cmd_list = cmd_ctx.cmd_list;
+        if (offset == 0) {
+            region = profiler.begin(cmd_list.Get(), "Bake");
+            auto b = dxr::barrier_transition(bake_target.ao_image,
+                                             D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+            cmd_list->ResourceBarrier(1, &b);
+        }
+
+        ID3D12DescriptorHeap *heap = compute_pipeline.output_heap.get();
+        cmd_list->SetDescriptorHeaps(1, &heap);
+        cmd_list->SetComputeRootSignature(pipeline.signature.get());
+        cmd_list->SetComputeRoot32BitConstants(0, 21, &params, 0);
+        cmd_list->SetComputeRootShaderResourceView(
+            1, bake_scene.scene_bvh->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootShaderResourceView(
+            2, texel_gbuffer.texels->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootUnorderedAccessView(
+            3, bake_target.accum_buf->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootUnorderedAccessView(4, pipeline.rays->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootUnorderedAccessView(
+            5, pipeline.binned_rays->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootUnorderedAccessView(
+            6, pipeline.bin_counts->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootUnorderedAccessView(
+            7, pipeline.bin_offsets->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootUnorderedAccessView(
+            8, pipeline.texel_occlusion->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootDescriptorTable(
+            9, compute_pipeline.output_heap.gpu_desc_handle());
+        cmd_list->SetComputeRootShaderResourceView(
+            10, bake_target.blue_noise.gpu_virtual_address());
+        cmd_list->SetComputeRootUnorderedAccessView(
+            11, bake_target.ray_stats->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootShaderResourceView(12, alpha_test_address(bake_scene));
+
+        cmd_list->SetPipelineState(pipeline.raygen.Get());
+        cmd_list->Dispatch(texel_groups, 1, 1);
+        cmd_list->ResourceBarrier(pass_barriers.size(), pass_barriers.data());
+
+        cmd_list->SetPipelineState(pipeline.scan.Get());
+        cmd_list->Dispatch(1, 1, 1);
+        cmd_list->ResourceBarrier(pass_barriers.size(), pass_barriers.data());
+
+        cmd_list->SetPipelineState(pipeline.scatter.Get());
+        cmd_list->Dispatch(ray_groups, 1, 1);
+        cmd_list->ResourceBarrier(pass_barriers.size(), pass_barriers.data());
+
+        cmd_list->SetPipelineState(pipeline.trace.Get());
+        cmd_list->Dispatch(ray_groups, 1, 1);
+        cmd_list->ResourceBarrier(pass_barriers.size(), pass_barriers.data());
+
+        cmd_list->SetPipelineState(pipeline.resolve.Get());
+        cmd_list->Dispatch(texel_groups, 1, 1);
+
+        // Make sure the accumulation writes are done before the next frame reads them
+        {
+            std::array<D3D12_RESOURCE_BARRIER, 2> b = {
+                dxr::barrier_uav(bake_target.accum_buf),
+                dxr::barrier_uav(pipeline.texel_occlusion)};
+            cmd_list->ResourceBarrier(b.size(), b.data());
+        }
+        if (offset + params.bake.num_texels >= texel_gbuffer.num_texels) {
+            auto b = dxr::barrier_transition(bake_target.ao_image,
+                                             D3D12_RESOURCE_STATE_RENDER_TARGET);
+            cmd_list->ResourceBarrier(1, &b);
+            profiler.end(cmd_list.Get(), region);
+        }
+        cmd_ctx.submit_and_sync();
+    }
+}
+
+AdaptiveBake create_adaptive_bake(ID3D12Device5 *device,
+                                  ComputeBakePipeline &compute_pipeline)
+{
+    AdaptiveBake adaptive;
+    adaptive.signature = dxr::RootSignatureBuilder::global()
+                             .add_constants("atlas_info", 0, 17, 0)
+                             .add_srv("scene", 0, 0)
+                             .add_srv("texels", 1, 0)
+                             .add_srv("blue_noise", 2, 0)
+                             .add_uav("accum_buffer", 0, 0)
+                             .add_uav("next_active_texels", 2, 0)
+                             .add_uav("next_active_count", 3, 0)
+                             .add_uav("active_texels", 4, 0)
+                             .add_desc_heap("output_heap", compute_pipeline.output_heap)
+                             .add_uav("ray_stats", 7, 0)
+                             .add_srv("alpha_test", 0, 1)
+                             .create(device);
+
+    adaptive.bake_pipeline_state = create_compute_pipeline(
+        device, adaptive.signature, adaptive_bake_cs_dxil, sizeof(adaptive_bake_cs_dxil));
+    adaptive.display_pipeline_state =
+        create_compute_pipeline(device,
+                                adaptive.signature,
+                                adaptive_display_cs_dxil,
+                                sizeof(adaptive_display_cs_dxil));
+
+    adaptive.active_count = dxr::Buffer::default(device,
+                                                 sizeof(uint32_t),
+                                                 D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                                 D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    // Copied to reset the count each round. Zeroed explicitly since with placed resources it
+    // may reuse memory freed by an earlier job
+    adaptive.zero_count =
+        dxr::Buffer::upload(device, sizeof(uint32_t), D3D12_RESOURCE_STATE_GENERIC_READ);
+    std::memset(adaptive.zero_count.map(), 0, sizeof(uint32_t));
+    adaptive.zero_count.unmap();
+    adaptive.count_readback =
+        dxr::Buffer::readback(device, sizeof(uint32_t), D3D12_RESOURCE_STATE_COPY_DEST);
+    return adaptive;
+}
+
+void resize_adaptive_lists(ID3D12Device5 *device,
+                           AdaptiveBake &adaptive,
+                           const TexelGBuffer &texel_gbuffer)
+{
+    const size_t list_size = std::max(texel_gbuffer.num_texels, 1u) * sizeof(uint32_t);
+    for (auto &list : adaptive.active_texels) {
+        list = dxr::Buffer::default(device,
+                                    list_size,
+                                    D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                    D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    }
+    adaptive.current_list = 0;
+    adaptive.num_active = 0;
+    adaptive.rays_traced = 0;
+}
+
+void bake_frame_adaptive(dxr::CommandContext &cmd_ctx,
+                         ComputeBakePipeline &compute_pipeline,
+                         AdaptiveBake &adaptive,
+                         BakeScene &bake_scene,
+                         BakeTarget &bake_target,
+                         TexelGBuffer &texel_gbuffer,
+                         const AtlasParams &atlas_params,
+                         const AdaptiveSettings &settings,
+                         uint32_t tile_size,
+                         dxr::GpuProfiler &profiler)
+{
+    const uint32_t chunk_size = static_cast<uint32_t>(
+        std::min(uint64_t(tile_size) * tile_size, uint64_t(65535) * 64));
+
+    AdaptiveParams params(atlas_params, settings);
+    if (atlas_params.frame_id == 0) {
+        adaptive.num_active = texel_gbuffer.num_texels;
+        adaptive.rays_traced = 0;
+    } else {
+        params.use_active_list = 1;
+    }
+
+    auto bind_resources = [&](ID3D12GraphicsCommandList4 *cmd_list) {
+        ID3D12DescriptorHeap *heap = compute_pipeline.output_heap.get();
+        cmd_list->SetDescriptorHeaps(1, &heap);
+        cmd_list->SetComputeRootSignature(adaptive.signature.get());
+        cmd_list->SetComputeRoot32BitConstants(0, 17, &params, 0);
+        cmd_list->SetComputeRootShaderResourceView(
+            1, bake_scene.scene_bvh->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootShaderResourceView(
+            2, texel_gbuffer.texels->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootShaderResourceView(
+            3, bake_target.blue_noise.gpu_virtual_address());
+        cmd_list->SetComputeRootUnorderedAccessView(
+            4, bake_target.accum_buf->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootUnorderedAccessView(
+            5, adaptive.active_texels[1 - adaptive.current_list]->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootUnorderedAccessView(
+            6, adaptive.active_count->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootUnorderedAccessView(
+            7, adaptive.active_texels[adaptive.current_list]->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootDescriptorTable(
+            8, compute_pipeline.output_heap.gpu_desc_handle());
+        cmd_list->SetComputeRootUnorderedAccessView(
+            9, bake_target.ray_stats->GetGPUVirtualAddress());
+        cmd_list->SetComputeRootShaderResourceView(10, alpha_test_address(bake_scene));
+    };
+
+    const uint32_t num_active = adaptive.num_active;
+    uint32_t region = dxr::GpuProfiler::invalid_region;
+    for (uint32_t offset = 0; offset < num_active; offset += chunk_size) {
+        params.bake.texel_offset = offset;
+        params.bake.num_texels = std::min(chunk_size, num_active - offset);
+
+        cmd_ctx.begin();
+        auto &cmd_list = cmd_ctx.cmd_list;
+        if (offset == 0) {
+            region = profiler.begin(cmd_list.Get(), "Bake");
+            auto b = dxr::barrier_transition(adaptive.active_count,
+                                             D3D12_RESOURCE_STATE_COPY_DEST);
+            cmd_list->ResourceBarrier(1, &b);
+            dxr::copy_buffer(cmd_list.Get(), adaptive.active_count, adaptive.zero_count);
+            b = dxr::barrier_transition(adaptive.active_count,
+                                        D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+            cmd_list->ResourceBarrier(1, &b);
+        }
+
+        bind_resources(cmd_list.Get());
+        cmd_list->SetPipelineState(adaptive.bake_pipeline_state.Get());
+        cmd_list->Dispatch((params.bake.num_texels + 63) / 64, 1, 1);
+
+        // Make sure the accumulation and next active list writes are done before they're read
+        std::array<D3D12_RESOURCE_BARRIER, 3> b = {
+            dxr::barrier_uav(bake_target.accum_buf),
+            dxr::barrier_uav(adaptive.active_texels[1 - adaptive.current_list]),
+            dxr::barrier_uav(adaptive.active_count)};
+        cmd_list->ResourceBarrier(b.size(), b.data());
+        cmd_ctx.submit_and_sync();
+    }
+
+    // Write out the AO or heatmap for all texels, including the converged ones
+    cmd_ctx.begin();
+    auto &cmd_list = cmd_ctx.cmd_list;
+    if (num_active == 0) {
+        region = profiler.begin(cmd_list.Get(), "Bake");
+    }
+    {
+        auto b = dxr::barrier_transition(bake_target.ao_image,
+                                         D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    bind_resources(cmd_list.Get());
+    cmd_list->SetPipelineState(adaptive.display_pipeline_state.Get());
+    const uint32_t display_chunk = 65535 * 64;
+    for (uint32_t offset = 0; offset < texel_gbuffer.num_texels; offset += display_chunk) {
+        params.bake.texel_offset = offset;
+        params.bake.num_texels = std::min(display_chunk, texel_gbuffer.num_texels - offset);
+        cmd_list->SetComputeRoot32BitConstants(0, 17, &params, 0);
+        cmd_list->Dispatch((params.bake.num_texels + 63) / 64, 1, 1);
+    }
+    {
+        auto b = dxr::barrier_transition(bake_target.ao_image,
+                                         D3D12_RESOURCE_STATE_RENDER_TARGET);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    if (num_active > 0) {
+        auto b = dxr::barrier_transition(adaptive.active_count,
+                                         D3D12_RESOURCE_STATE_COPY_SOURCE);
+        cmd_list->ResourceBarrier(1, &b);
+        dxr::copy_buffer(cmd_list.Get(), adaptive.count_readback, adaptive.active_count);
+        b = dxr::barrier_transition(adaptive.active_count,
+                                    D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    profiler.end(cmd_list.Get(), region);
+    cmd_ctx.submit_and_sync();
+
+    if (num_active > 0) {
+        const uint32_t *count = static_cast<const uint32_t *>(adaptive.count_readback.map());
+        adaptive.num_active = *count;
+        adaptive.count_readback.unmap();
+
+        adaptive.current_list = 1 - adaptive.current_list;
+        adaptive.rays_traced += uint64_t(num_active) * atlas_params.samples_per_frame;
+    }
+}
+
+DilatePipeline create_dilate_pipeline(ID3D12Device5 *device,
+                                      ComputeBakePipeline &compute_pipeline)
+{
+    DilatePipeline pipeline;
+    pipeline.signature = dxr::RootSignatureBuilder::global()
+                             .add_constants("dilate_info", 0, 14, 0)
+                             .add_uav("accum_buffer", 0, 0)
+                             .add_uav("seeds_a", 2, 0)
+                             .add_uav("seeds_b", 3, 0)
+                             .add_uav("coverage", 4, 0)
+                             .add_desc_heap("output_heap", compute_pipeline.output_heap)
+                             .create(device);
+
+    pipeline.init = create_compute_pipeline(
+        device, pipeline.signature, dilate_init_cs_dxil, sizeof(dilate_init_cs_dxil));
+    pipeline.jump = create_compute_pipeline(
+        device, pipeline.signature, dilate_jump_cs_dxil, sizeof(dilate_jump_cs_dxil));
+    pipeline.resolve = create_compute_pipeline(
+        device, pipeline.signature, dilate_resolve_cs_dxil, sizeof(dilate_resolve_cs_dxil));
+
+    const size_t region_size = dilate_tile_size + 2 * max_gutter;
+    const size_t seeds_size = region_size * region_size * sizeof(uint32_t);
+    pipeline.seeds_a = dxr::Buffer::default(device,
+                                            seeds_size,
+                                            D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                            D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    pipeline.seeds_b = dxr::Buffer::default(device,
+                                            seeds_size,
+                                            D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                            D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    return pipeline;
+}
+
+void dilate_ao_image(dxr::CommandContext &cmd_ctx,
+                     ComputeBakePipeline &compute_pipeline,
+                     DilatePipeline &pipeline,
+                     BakeTarget &bake_target,
+                     TexelGBuffer &texel_gbuffer,
+                     dxr::Buffer &ao_source,
+                     uint32_t gutter,
+                     dxr::GpuProfiler &profiler)
+{
+    gutter = std::min(gutter, max_gutter);
+    if (gutter == 0) {
+        return;
+    }
+    // Jump steps of the largest power of two <= gutter down to 1 reach every texel within
+    // the gutter, followed by an extra step of 1 to fix up most of the JFA's errors
+    std::vector<uint32_t> steps;
+    for (uint32_t step = 1; step <= gutter; step *= 2) {
+        steps.insert(steps.begin(), step);
+    }
+    steps.push_back(1);
+
+    const glm::uvec2 dims = bake_target.ao_image.dims();
+    DilateParams params;
+    params.dimensions = dims;
+    params.gutter = gutter;
+
+    cmd_ctx.begin();
+    auto &cmd_list = cmd_ctx.cmd_list;
+    const uint32_t region = profiler.begin(cmd_list.Get(), "Dilate");
+    {
+        auto b = dxr::barrier_transition(bake_target.ao_image,
+                                         D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    ID3D12DescriptorHeap *heap = compute_pipeline.output_heap.get();
+    cmd_list->SetDescriptorHeaps(1, &heap);
+    cmd_list->SetComputeRootSignature(pipeline.signature.get());
+    cmd_list->SetComputeRootUnorderedAccessView(1, ao_source->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(2, pipeline.seeds_a->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(3, pipeline.seeds_b->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(
+        4, texel_gbuffer.coverage->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootDescriptorTable(5, compute_pipeline.output_heap.gpu_desc_handle());
+
+    std::array<D3D12_RESOURCE_BARRIER, 2> seed_barriers = {
+        dxr::barrier_uav(pipeline.seeds_a), dxr::barrier_uav(pipeline.seeds_b)};
+    for (uint32_t y = 0; y < dims.y; y += dilate_tile_size) {
+        for (uint32_t x = 0; x < dims.x; x += dilate_tile_size) {
+            params.tile_lower = glm::uvec2(x, y);
+            params.tile_upper = glm::min(params.tile_lower + dilate_tile_size, dims);
+            params.region_origin = glm::ivec2(params.tile_lower) - int(gutter);
+            params.region_size = params.tile_upper - params.tile_lower + 2 * gutter;
+            const glm::uvec2 groups = (params.region_size + glm::uvec2(7)) / glm::uvec2(8);
+
+            cmd_list->SetComputeRoot32BitConstants(0, 14, &params, 0);
+            cmd_list->SetPipelineState(pipeline.init.Get());
+            cmd_list->Dispatch(groups.x, groups.y, 1);
+            cmd_list->ResourceBarrier(seed_barriers.size(), seed_barriers.data());
+
+            cmd_list->SetPipelineState(pipeline.jump.Get());
+            params.flip = 0;
+            for (const auto &step : steps) {
+                params.step = step;
+                cmd_list->SetComputeRoot32BitConstants(0, 14, &params, 0);
+                cmd_list->Dispatch(groups.x, groups.y, 1);
+                cmd_list->ResourceBarrier(seed_barriers.size(), seed_barriers.data());
+                params.flip = 1 - params.flip;
+            }
+            // The resolve reads the buffer written by the last jump
+            params.flip = 1 - params.flip;
+            cmd_list->SetComputeRoot32BitConstants(0, 14, &params, 0);
+            cmd_list->SetPipelineState(pipeline.resolve.Get());
+            cmd_list->Dispatch(groups.x, groups.y, 1);
+            // The next tile reuses the seed buffers
+            cmd_list->ResourceBarrier(seed_barriers.size(), seed_barriers.data());
+        }
+    }
+    {
+        auto b = dxr::barrier_transition(bake_target.ao_image,
+                                         D3D12_RESOURCE_STATE_RENDER_TARGET);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    profiler.end(cmd_list.Get(), region);
+    cmd_ctx.submit_and_sync();
+}
+
+DenoisePipeline create_denoise_pipeline(ID3D12Device5 *device,
+                                        ComputeBakePipeline &compute_pipeline)
+{
+    DenoisePipeline pipeline;
+    pipeline.signature = dxr::RootSignatureBuilder::global()
+                             .add_constants("denoise_info", 0, 12, 0)
+                             .add_srv("texels", 0, 0)
+                             .add_uav("accum_buffer", 0, 0)
+                             .add_uav("texel_index_map", 2, 0)
+                             .add_uav("values_a", 3, 0)
+                             .add_uav("values_b", 4, 0)
+                             .add_uav("denoised_accum", 5, 0)
+                             .add_desc_heap("output_heap", compute_pipeline.output_heap)
+                             .create(device);
+
+    pipeline.index = create_compute_pipeline(
+        device, pipeline.signature, denoise_index_cs_dxil, sizeof(denoise_index_cs_dxil));
+    pipeline.atrous = create_compute_pipeline(
+        device, pipeline.signature, denoise_atrous_cs_dxil, sizeof(denoise_atrous_cs_dxil));
+    return pipeline;
+}
+
+void resize_denoise_buffers(ID3D12Device5 *device,
+                            DenoisePipeline &pipeline,
+                            const TexelGBuffer &texel_gbuffer,
+                            const glm::uvec2 &dims)
+{
+    const size_t num_pixels = size_t(dims.x) * dims.y;
+    const size_t values_size = std::max(texel_gbuffer.num_texels, 1u) * sizeof(float);
+    // Committed buffers start zeroed, marking all texels as not covered in the index map
+    pipeline.texel_index_map =
+        dxr::Buffer::default(device,
+                             num_pixels * sizeof(uint32_t),
+                             D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                             D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    pipeline.values_a = dxr::Buffer::default(device,
+                                             values_size,
+                                             D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                             D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    pipeline.values_b = dxr::Buffer::default(device,
+                                             values_size,
+                                             D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                             D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    pipeline.denoised_accum = dxr::Buffer::default(device,
+                                                   num_pixels * sizeof(glm::vec2),
+                                                   D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                                   D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    pipeline.index_built = false;
+}
+
+void denoise_ao_image(dxr::CommandContext &cmd_ctx,
+                      ComputeBakePipeline &compute_pipeline,
+                      DenoisePipeline &pipeline,
+                      BakeTarget &bake_target,
+                      TexelGBuffer &texel_gbuffer,
+                      const DenoiseSettings &settings,
+                      dxr::GpuProfiler &profiler)
+{
+    if (texel_gbuffer.num_texels == 0) {
+        return;
+    }
+    // Dispatches are limited to 65535 groups of 64 threads
+    const uint32_t chunk_size = 65535 * 64;
+
+    DenoiseParams params;
+    params.dimensions = bake_target.ao_image.dims();
+    params.sigma_normal = settings.sigma_normal;
+    params.sigma_position = settings.sigma_position;
+
+    cmd_ctx.begin();
+    auto &cmd_list = cmd_ctx.cmd_list;
+    const uint32_t region = profiler.begin(cmd_list.Get(), "Denoise");
+    {
+        auto b = dxr::barrier_transition(bake_target.ao_image,
+                                         D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    ID3D12DescriptorHeap *heap = compute_pipeline.output_heap.get();
+    cmd_list->SetDescriptorHeaps(1, &heap);
+    cmd_list->SetComputeRootSignature(pipeline.signature.get());
+    cmd_list->SetComputeRootShaderResourceView(1,
+                                               texel_gbuffer.texels->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(2,
+                                                bake_target.accum_buf->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(
+        3, pipeline.texel_index_map->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(4, pipeline.values_a->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(5, pipeline.values_b->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(
+        6, pipeline.denoised_accum->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootDescriptorTable(7, compute_pipeline.output_heap.gpu_desc_handle());
+
+    // The index map only depends on the texel G-buffer
+    if (!pipeline.index_built) {
+        cmd_list->SetPipelineState(pipeline.index.Get());
+        for (uint32_t offset = 0; offset < texel_gbuffer.num_texels; offset += chunk_size) {
+            params.texel_offset = offset;
+            params.num_texels = std::min(chunk_size, texel_gbuffer.num_texels - offset);
+            cmd_list->SetComputeRoot32BitConstants(0, 12, &params, 0);
+            cmd_list->Dispatch((params.num_texels + 63) / 64, 1, 1);
+        }
+        auto b = dxr::barrier_uav(pipeline.texel_index_map);
+        cmd_list->ResourceBarrier(1, &b);
+        pipeline.index_built = true;
+    }
+
+    std::array<D3D12_RESOURCE_BARRIER, 2> value_barriers = {
+        dxr::barrier_uav(pipeline.values_a), dxr::barrier_uav(pipeline.values_b)};
+    cmd_list->SetPipelineState(pipeline.atrous.Get());
+    params.sigma_ao = settings.sigma_ao;
+    for (int i = 0; i < settings.iterations; ++i) {
+        params.step = 1 << i;
+        params.from_accum = i == 0 ? 1 : 0;
+        params.write_output = i + 1 == settings.iterations ? 1 : 0;
+        for (uint32_t offset = 0; offset < texel_gbuffer.num_texels; offset += chunk_size) {
+            params.texel_offset = offset;
+            params.num_texels = std::min(chunk_size, texel_gbuffer.num_texels - offset);
+            cmd_list->SetComputeRoot32BitConstants(0, 12, &params, 0);
+            cmd_list->Dispatch((params.num_texels + 63) / 64, 1, 1);
+        }
+        // Each iteration reads the texels' neighbors written by the previous one
+        cmd_list->ResourceBarrier(value_barriers.size(), value_barriers.data());
+        params.flip = 1 - params.flip;
+        params.sigma_ao *= 0.5f;
+    }
+    {
+        std::array<D3D12_RESOURCE_BARRIER, 2> b = {
+            dxr::barrier_uav(pipeline.denoised_accum),
+            dxr::barrier_transition(bake_target.ao_image, D3D12_RESOURCE_STATE_RENDER_TARGET)};
+        cmd_list->ResourceBarrier(b.size(), b.data());
+    }
+    profiler.end(cmd_list.Get(), region);
+    cmd_ctx.submit_and_sync();
+}
+
+SampleBudgetPipeline create_sample_budget_pipeline(ID3D12Device5 *device)
+{
+    SampleBudgetPipeline pipeline;
+    pipeline.signature = dxr::RootSignatureBuilder::global()
+                             .add_constants("budget_info", 0, 8, 0)
+                             .add_srv("texels", 0, 0)
+                             .add_uav("sample_budget", 0, 0)
+                             .add_uav("budget_totals", 1, 0)
+                             .create(device);
+
+    pipeline.importance = create_compute_pipeline(device,
+                                                  pipeline.signature,
+                                                  sample_budget_importance_cs_dxil,
+                                                  sizeof(sample_budget_importance_cs_dxil));
+    pipeline.assign = create_compute_pipeline(device,
+                                              pipeline.signature,
+                                              sample_budget_assign_cs_dxil,
+                                              sizeof(sample_budget_assign_cs_dxil));
+
+    pipeline.totals_readback = dxr::Buffer::readback(
+        device, sizeof(SampleBudgetTotals), D3D12_RESOURCE_STATE_COPY_DEST);
+    return pipeline;
+}
+
+void compute_sample_budget(ID3D12Device5 *device,
+                           dxr::CommandContext &cmd_ctx,
+                           SampleBudgetPipeline &pipeline,
+                           const BakeScene &bake_scene,
+                           TexelGBuffer &texel_gbuffer,
+                           double ray_budget,
+                           dxr::GpuProfiler &profiler)
+{
+    if (texel_gbuffer.num_texels == 0) {
+        return;
+    }
+    texel_gbuffer.sample_budget =
+        dxr::Buffer::default(device,
+                             size_t(texel_gbuffer.num_texels) * sizeof(uint32_t),
+                             D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                             D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    // Committed resources are zeroed, so the totals are reallocated to reset them
+    pipeline.totals = dxr::Buffer::default(device,
+                                           sizeof(SampleBudgetTotals),
+                                           D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                           D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+
+    const glm::vec3 extent = bake_scene.world_upper - bake_scene.world_lower;
+    const double mean_samples = ray_budget / texel_gbuffer.num_texels;
+    SampleBudgetParams params;
+    params.inv_scene_size = 1.f / std::max(glm::length(extent), 1e-6f);
+    params.curvature_weight = budget_curvature_weight;
+    params.ray_budget = static_cast<float>(ray_budget);
+    params.max_samples =
+        std::max(static_cast<uint32_t>(std::ceil(mean_samples * budget_max_scale)), 1u);
+
+    // Dispatches are limited to 65535 groups of 64 threads
+    const uint32_t chunk_size = 65535 * 64;
+
+    cmd_ctx.begin();
+    auto &cmd_list = cmd_ctx.cmd_list;
+    const uint32_t region = profiler.begin(cmd_list.Get(), "Sample Budget");
+    cmd_list->SetComputeRootSignature(pipeline.signature.get());
+    cmd_list->SetComputeRootShaderResourceView(
+        1, texel_gbuffer.texels->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(
+        2, texel_gbuffer.sample_budget->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(3, pipeline.totals->GetGPUVirtualAddress());
+
+    // The assign pass needs the importance sum over all texels
+    const std::array<D3D12_RESOURCE_BARRIER, 2> pass_barriers = {
+        dxr::barrier_uav(texel_gbuffer.sample_budget), dxr::barrier_uav(pipeline.totals)};
+    for (auto *pass : {pipeline.importance.Get(), pipeline.assign.Get()}) {
+        cmd_list->SetPipelineState(pass);
+        for (uint32_t offset = 0; offset < texel_gbuffer.num_texels; offset += chunk_size) {
+            params.texel_offset = offset;
+            params.num_texels = std::min(chunk_size, texel_gbuffer.num_texels - offset);
+            cmd_list->SetComputeRoot32BitConstants(0, 8, &params, 0);
+            cmd_list->Dispatch((params.num_texels + 63) / 64, 1, 1);
+        }
+        cmd_list->ResourceBarrier(pass_barriers.size(), pass_barriers.data());
+    }
+    {
+        std::array<D3D12_RESOURCE_BARRIER, 2> b = {
+            dxr::barrier_transition(texel_gbuffer.sample_budget,
+                                    D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE),
+            dxr::barrier_transition(pipeline.totals, D3D12_RESOURCE_STATE_COPY_SOURCE)};
+        cmd_list->ResourceBarrier(b.size(), b.data());
+    }
+    dxr::copy_buffer(cmd_list.Get(), pipeline.totals_readback, pipeline.totals);
+    profiler.end(cmd_list.Get(), region);
+    cmd_ctx.submit_and_sync();
+
+    const SampleBudgetTotals *totals =
+        static_cast<const SampleBudgetTotals *>(pipeline.totals_readback.map());
+    pipeline.total_samples = totals->total_samples;
+    pipeline.max_samples = totals->max_samples;
+    pipeline.totals_readback.unmap();
+}
+
+RebakePipeline create_rebake_pipeline(ID3D12Device5 *device)
+{
+    RebakePipeline pipeline;
+    pipeline.signature = dxr::RootSignatureBuilder::global()
+                             .add_constants("rebake_info", 0, 8, 0)
+                             .add_srv("texels", 0, 0)
+                             .add_srv("dirty_bounds", 1, 0)
+                             .add_uav("accum_buffer", 0, 0)
+                             .add_uav("extras_accum", 1, 0)
+                             .add_uav("tile_flags", 2, 0)
+                             .add_uav("dirty_texel_count", 3, 0)
+                             .add_uav("light_accum", 4, 0)
+                             .create(device);
+
+    pipeline.mark = create_compute_pipeline(
+        device, pipeline.signature, rebake_mark_cs_dxil, sizeof(rebake_mark_cs_dxil));
+    return pipeline;
+}
+
+std::vector<glm::uvec2> mark_rebake_texels(
+    ID3D12Device5 *device,
+    dxr::CommandContext &cmd_ctx,
+    RebakePipeline &pipeline,
+    BakeTarget &bake_target,
+    TexelGBuffer &texel_gbuffer,
+    const glm::uvec2 &atlas_size,
+    const std::vector<std::array<glm::vec3, 2>> &dirty_bounds,
+    uint32_t tile_size,
+    dxr::GpuProfiler &profiler)
+{
+    pipeline.dirty_texels = 0;
+    std::vector<glm::uvec2> tiles;
+    if (texel_gbuffer.num_texels == 0 || dirty_bounds.empty()) {
+        return tiles;
+    }
+
+    const glm::uvec2 n_tiles = (atlas_size + glm::uvec2(tile_size - 1)) / tile_size;
+    const uint32_t total_tiles = n_tiles.x * n_tiles.y;
+
+    // The bounds are small and read directly from the upload heap
+    const size_t bounds_size = dirty_bounds.size() * sizeof(std::array<glm::vec3, 2>);
+    dxr::Buffer bounds_buf =
+        dxr::Buffer::upload(device, bounds_size, D3D12_RESOURCE_STATE_GENERIC_READ);
+    std::memcpy(bounds_buf.map(), dirty_bounds.data(), bounds_size);
+    bounds_buf.unmap();
+
+    // Committed resources are zeroed, so the flags and count start cleared
+    dxr::Buffer tile_flags =
+        dxr::Buffer::default(device,
+                             align_to((total_tiles + 31) / 32 * sizeof(uint32_t), 16),
+                             D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                             D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    dxr::Buffer dirty_count = dxr::Buffer::default(device,
+                                                   sizeof(uint32_t),
+                                                   D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                                   D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+
+    RebakeParams params;
+    params.num_bounds = dirty_bounds.size();
+    params.atlas_width = atlas_size.x;
+    params.tile_size = tile_size;
+    params.tiles_x = n_tiles.x;
+    params.has_extras = bake_target.extras_buf.size() != 0 ? 1 : 0;
+    params.has_light = bake_target.light_buf.size() != 0 ? 1 : 0;
+
+    // Dispatches are limited to 65535 groups of 64 threads
+    const uint32_t chunk_size = 65535 * 64;
+
+    cmd_ctx.begin();
+    auto &cmd_list = cmd_ctx.cmd_list;
+    const uint32_t region = profiler.begin(cmd_list.Get(), "Rebake Mark");
+    cmd_list->SetPipelineState(pipeline.mark.Get());
+    cmd_list->SetComputeRootSignature(pipeline.signature.get());
+    cmd_list->SetComputeRootShaderResourceView(
+        1, texel_gbuffer.texels->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootShaderResourceView(2, bounds_buf.gpu_virtual_address());
+    cmd_list->SetComputeRootUnorderedAccessView(
+        3, bake_target.accum_buf->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(4, extras_address(bake_target));
+    cmd_list->SetComputeRootUnorderedAccessView(5, tile_flags->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(6, dirty_count->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(7, light_address(bake_target));
+    for (uint32_t offset = 0; offset < texel_gbuffer.num_texels; offset += chunk_size) {
+        params.texel_offset = offset;
+        params.num_texels = std::min(chunk_size, texel_gbuffer.num_texels - offset);
+        cmd_list->SetComputeRoot32BitConstants(0, 8, &params, 0);
+        cmd_list->Dispatch((params.num_texels + 63) / 64, 1, 1);
+    }
+    // Make sure the reset is done before the next bake frame reads the accumulation
+    auto b = dxr::barrier_uav(bake_target.accum_buf);
+    cmd_list->ResourceBarrier(1, &b);
+    if (params.has_extras) {
+        b = dxr::barrier_uav(bake_target.extras_buf);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    if (params.has_light) {
+        b = dxr::barrier_uav(bake_target.light_buf);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    profiler.end(cmd_list.Get(), region);
+    cmd_ctx.submit_and_sync();
+
+    const std::vector<uint8_t> count = read_back_buffer(device, cmd_ctx, dirty_count);
+    std::memcpy(&pipeline.dirty_texels, count.data(), sizeof(uint32_t));
+
+    const std::vector<uint8_t> flags = read_back_buffer(device, cmd_ctx, tile_flags);
+    const uint32_t *flag_words = reinterpret_cast<const uint32_t *>(flags.data());
+    for (uint32_t i = 0; i < total_tiles; ++i) {
+        if (flag_words[i / 32] & (1u << (i % 32))) {
+            tiles.push_back(glm::uvec2(i % n_tiles.x, i / n_tiles.x) * tile_size);
+        }
+    }
+    return tiles;
+}
+
+void merge_rebake_tiles(std::vector<glm::uvec2> &rebake_tiles,
+                        const std::vector<glm::uvec2> &tiles)
+{
+    // Tiles still re-baking from a previous edit must keep baking
+    rebake_tiles.insert(rebake_tiles.end(), tiles.begin(), tiles.end());
+    std::sort(rebake_tiles.begin(),
+              rebake_tiles.end(),
+              [](const glm::uvec2 &a, const glm::uvec2 &b) {
+                  return a.y < b.y || (a.y == b.y && a.x < b.x);
+              });
+    rebake_tiles.erase(std::unique(rebake_tiles.begin(), rebake_tiles.end()),
+                       rebake_tiles.end());
+    if (rebake_tiles.empty()) {
+        rebake_tiles.push_back(glm::uvec2(0));
+    }
+}
+
+PreviewBake create_preview_bake(ID3D12Device5 *device, ComputeBakePipeline &compute_pipeline)
+{
+    PreviewBake preview;
+    preview.signature = dxr::RootSignatureBuilder::global()
+                            .add_constants("preview_info", 0, 5, 0)
+                            .add_uav("accum_buffer", 0, 0)
+                            .add_uav("coverage", 2, 0)
+                            .add_uav("preview_accum", 3, 0)
+                            .add_uav("preview_coverage", 4, 0)
+                            .add_desc_heap("output_heap", compute_pipeline.output_heap)
+                            .create(device);
+
+    preview.upsample = create_compute_pipeline(device,
+                                               preview.signature,
+                                               preview_upsample_cs_dxil,
+                                               sizeof(preview_upsample_cs_dxil));
+    return preview;
+}
+
+void build_preview_levels(ID3D12Device5 *device,
+                          dxr::CommandContext &cmd_ctx,
+                          ComputeBakePipeline &compute_pipeline,
+                          PreviewBake &preview,
+                          BakeScene &bake_scene,
+                          uint32_t scale)
+{
+    preview.levels.clear();
+    preview.level_gbuffers.clear();
+    for (uint32_t s = scale; s > 1; s /= 2) {
+        const glm::uvec2 dims = glm::max(bake_scene.atlas_size / s, glm::uvec2(1));
+        // The levels only bake the AO, and are read by the upsampling pass from their
+        // accumulation buffer
+        preview.levels.push_back(
+            create_bake_target(device, dims, 0, DXGI_FORMAT_R8G8B8A8_UNORM));
+        preview.level_gbuffers.push_back(build_texel_gbuffer(
+            device, cmd_ctx, compute_pipeline, bake_scene, preview.levels.back(), false));
+    }
+    restart_preview(preview);
+}
+
+void restart_preview(PreviewBake &preview)
+{
+    preview.level = 0;
+    preview.frame_id = 0;
+    preview.accumulated_samples = 0;
+    preview.handoff_samples = 0;
+}
+
+int preview_level_samples(const PreviewBake &preview, size_t level, int n_samples)
+{
+    return std::min(preview.base_samples << level, n_samples);
+}
+
+void bake_preview_frame(dxr::CommandContext &cmd_ctx,
+                        BakePipeline &bake_pipeline,
+                        ComputeBakePipeline &compute_pipeline,
+                        PreviewBake &preview,
+                        BakeScene &bake_scene,
+                        BakeTarget &bake_target,
+                        TexelGBuffer &texel_gbuffer,
+                        const AtlasParams &atlas_params,
+                        uint32_t tile_size,
+                        dxr::GpuProfiler &profiler)
+{
+    BakeTarget &level_target = preview.levels[preview.level];
+    const int level_samples =
+        preview_level_samples(preview, preview.level, atlas_params.n_samples);
+    if (preview.level == 0 && preview.frame_id == 0) {
+        // The upsampling only writes the covered texels, the last bake may have filled
+        // the gutter
+        clear_ao_image(cmd_ctx, bake_target);
+    }
+
+    AtlasParams level_params = atlas_params;
+    level_params.dimensions = glm::ivec2(level_target.ao_image.dims());
+    level_params.n_samples = level_samples;
+    level_params.samples_per_frame = std::min(atlas_params.samples_per_frame, level_samples);
+    level_params.frame_id = preview.frame_id;
+    level_params.bake_outputs = 0;
+    bake_frame(cmd_ctx,
+               bake_pipeline,
+               bake_scene,
+               level_target,
+               level_params,
+               tile_size,
+               {},
+               profiler);
+    upsample_preview(cmd_ctx,
+                     compute_pipeline,
+                     preview,
+                     preview.level,
+                     bake_target,
+                     texel_gbuffer,
+                     0,
+                     profiler);
+
+    ++preview.frame_id;
+    preview.accumulated_samples += level_params.samples_per_frame;
+    if (preview.accumulated_samples >= level_samples) {
+        ++preview.level;
+        preview.frame_id = 0;
+        preview.accumulated_samples = 0;
+        if (preview.level == preview.levels.size()) {
+            preview.handoff_samples = level_samples;
+        }
+    }
+}
+
+void upsample_preview(dxr::CommandContext &cmd_ctx,
+                      ComputeBakePipeline &compute_pipeline,
+                      PreviewBake &preview,
+                      size_t level,
+                      BakeTarget &bake_target,
+                      TexelGBuffer &texel_gbuffer,
+                      uint32_t blend_samples,
+                      dxr::GpuProfiler &profiler)
+{
+    BakeTarget &level_target = preview.levels[level];
+    PreviewParams params;
+    params.dimensions = bake_target.ao_image.dims();
+    params.preview_dimensions = level_target.ao_image.dims();
+    params.blend_samples = blend_samples;
+
+    cmd_ctx.begin();
+    auto &cmd_list = cmd_ctx.cmd_list;
+    const uint32_t region = profiler.begin(cmd_list.Get(), "Upsample Preview");
+    {
+        auto b = dxr::barrier_transition(bake_target.ao_image,
+                                         D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    ID3D12DescriptorHeap *heap = compute_pipeline.output_heap.get();
+    cmd_list->SetDescriptorHeaps(1, &heap);
+    cmd_list->SetComputeRootSignature(preview.signature.get());
+    cmd_list->SetPipelineState(preview.upsample.Get());
+    cmd_list->SetComputeRoot32BitConstants(0, 5, &params, 0);
+    cmd_list->SetComputeRootUnorderedAccessView(
+        1, bake_target.accum_buf->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(
+        2, texel_gbuffer.coverage->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(
+        3, level_target.accum_buf->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(
+        4, preview.level_gbuffers[level].coverage->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootDescriptorTable(5, compute_pipeline.output_heap.gpu_desc_handle());
+    const glm::uvec2 groups = (params.dimensions + glm::uvec2(7)) / glm::uvec2(8);
+    cmd_list->Dispatch(groups.x, groups.y, 1);
+    {
+        auto b = dxr::barrier_transition(bake_target.ao_image,
+                                         D3D12_RESOURCE_STATE_RENDER_TARGET);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    profiler.end(cmd_list.Get(), region);
+    cmd_ctx.submit_and_sync();
+}
+
+VertexAOPipeline create_vertex_ao_pipeline(ID3D12Device5 *device)
+{
+    VertexAOPipeline pipeline;
+    pipeline.signature = dxr::RootSignatureBuilder::global()
+                             .add_constants("vertex_ao_info", 0, 9, 0)
+                             .add_srv("scene", 0, 0)
+                             .add_srv("vertices", 1, 0)
+                             .add_uav("accum_buffer", 0, 0)
+                             .add_srv("alpha_test", 0, 1)
+                             .create(device);
+
+    pipeline.pipeline = create_compute_pipeline(
+        device, pipeline.signature, vertex_ao_cs_dxil, sizeof(vertex_ao_cs_dxil));
+    return pipeline;
+}
+
+void clear_ao_image(dxr::CommandContext &cmd_ctx, BakeTarget &bake_target)
+{
+    cmd_ctx.begin();
+    cmd_ctx.cmd_list->ClearRenderTargetView(
+        bake_target.rtv_handle, bake_target.clear_value.Color, 0, nullptr);
+    cmd_ctx.submit_and_sync();
+}
+
+std::unique_ptr<dxr::PipelineCache> open_pipeline_cache(ID3D12Device5 *device,
+                                                        const AppOptions &options)
+{
+    if (options.pipeline_cache.empty()) {
+        return nullptr;
+    }
+    auto cache = std::make_unique<dxr::PipelineCache>(device, options.pipeline_cache);
+    dxr::set_pipeline_cache(cache.get());
+    return cache;
+}
+
+void save_pipeline_cache(dxr::PipelineCache *cache)
+{
+    if (!cache) {
+        return;
+    }
+    std::cout << "Pipeline cache: " << cache->loaded() << " pipelines loaded, "
+              << cache->compiled() << " compiled\n";
+    cache->save();
+}
+
+std::string heap_stats_summary(const dxr::HeapAllocatorStats &stats)
+{
+    std::stringstream ss;
+    ss << stats.num_allocations << " resources in " << stats.num_heaps << " heaps of "
+       << pretty_print_count(stats.heap_bytes) << "b, "
+       << pretty_print_count(stats.requested_bytes) << "b used, " << std::fixed
+       << std::setprecision(1) << 100.f * stats.waste() << "% waste, "
+       << 100.f * stats.fragmentation() << "% fragmented, " << stats.num_committed
+       << " committed";
+    return ss.str();
+}
+
+std::string memory_category_summary(const dxr::MemoryCategoryStats &stats)
+{
+    std::stringstream ss;
+    ss << pretty_print_count(stats.current_bytes) << "b in " << stats.num_resources
+       << " resources, peak " << pretty_print_count(stats.peak_bytes) << "b, "
+       << pretty_print_count(stats.alignment_waste()) << "b alignment waste";
+    return ss.str();
+}
+
+void print_memory_stats(ID3D12Device *device)
+{
+    const dxr::MemoryTrackerStats stats = dxr::memory_tracker().stats();
+    std::cout << "Resource memory: " << pretty_print_count(stats.current_bytes)
+              << "b, peak " << pretty_print_count(stats.peak_bytes) << "b (default "
+              << pretty_print_count(stats.heap_bytes[0]) << "b, upload "
+              << pretty_print_count(stats.heap_bytes[1]) << "b, readback "
+              << pretty_print_count(stats.heap_bytes[2]) << "b)\n";
+    for (int i = 0; i < dxr::NUM_MEMORY_CATEGORIES; ++i) {
+        const dxr::MemoryCategoryStats &category = stats.categories[i];
+        if (category.peak_bytes == 0) {
+            continue;
+        }
+        std::cout << "    " << dxr::memory_category_name(dxr::MemoryCategory(i)) << ": "
+                  << memory_category_summary(category) << "\n";
+    }
+    const DXGI_QUERY_VIDEO_MEMORY_INFO vram = dxr::video_memory_info(device);
+    std::cout << "Video memory: " << pretty_print_count(vram.CurrentUsage) << "b used of "
+              << pretty_print_count(vram.Budget) << "b budget\n"
+              << "Host memory: " << pretty_print_count(process_memory()) << "b, peak "
+              << pretty_print_count(peak_process_memory()) << "b\n";
+}
+
+void resolve_gpu_profile(dxr::CommandContext &cmd_ctx, dxr::GpuProfiler &profiler)
+{
+    cmd_ctx.begin();
+    // The context signals its current fence value when syncing
+    profiler.resolve(cmd_ctx.cmd_list.Get(), cmd_ctx.fence_value);
+    cmd_ctx.submit_and_sync();
+    profiler.read_back(cmd_ctx.fence->GetCompletedValue());
+}
+
+void resolve_gpu_profile_async(dxr::CommandContext &cmd_ctx, dxr::GpuProfiler &profiler)
+{
+    cmd_ctx.begin();
+    profiler.resolve(cmd_ctx.cmd_list.Get(), cmd_ctx.fence_value);
+    cmd_ctx.submit();
+    profiler.read_back(cmd_ctx.fence->GetCompletedValue());
+}
+
+void write_gpu_profile(const std::string &fname, const dxr::GpuProfiler &profiler)
+{
+    using json = nlohmann::json;
+    json regions = json::array();
+    for (const auto &region : profiler.stats()) {
+        json r;
+        r["name"] = region.name;
+        r["last_ms"] = region.last_ms();
+        r["average_ms"] = region.average_ms();
+        r["max_ms"] = region.max_ms();
+        r["history_ms"] = std::vector<double>(region.history.begin(), region.history.end());
+        regions.push_back(r);
+    }
+    json profile;
+    profile["regions"] = regions;
+
+    std::ofstream fout(fname.c_str());
+    if (!fout) {
+        std::cout << "Failed to write GPU profile to " << fname << "\n";
+        throw std::runtime_error("Failed to write GPU profile to " + fname);
+    }
+    fout << profile.dump(4) << "\n";
+    std::cout << "Wrote GPU profile to " << fname << "\n";
+}
+
+void write_bvh_benchmark(const std::string &fname,
+                         const DXGI_ADAPTER_DESC1 &adapter,
+                         const std::vector<BvhBenchmarkResult> &results)
+{
+    using json = nlohmann::json;
+    json profiles = json::array();
+    for (const auto &r : results) {
+        json p;
+        p["profile"] = bvh_profile_names[r.profile];
+        p["blas_build_ms"] = r.blas_stats.build_ms;
+        p["blas_compaction_ms"] = r.blas_stats.compaction_ms;
+        p["blas_uncompacted_bytes"] = r.blas_stats.uncompacted_bytes;
+        p["blas_compacted_bytes"] = r.blas_stats.compacted_bytes;
+        p["tlas_build_ms"] = r.tlas_ms;
+        p["rays"] = r.bake_stats.rays;
+        p["bake_gpu_ms"] = r.bake_stats.gpu_ms;
+        p["mrays_per_second"] =
+            r.bake_stats.gpu_ms > 0.0 ? r.bake_stats.rays * 1e-3 / r.bake_stats.gpu_ms : 0.0;
+        profiles.push_back(p);
+    }
+    std::wstring_convert<std::codecvt_utf8<wchar_t>> conv;
+    json benchmark;
+    benchmark["gpu"] = conv.to_bytes(adapter.Description);
+    benchmark["vendor_id"] = adapter.VendorId;
+    benchmark["device_id"] = adapter.DeviceId;
+    benchmark["profiles"] = profiles;
+
+    std::ofstream fout(fname.c_str());
+    if (!fout) {
+        std::cout << "Failed to write BVH benchmark to " << fname << "\n";
+        throw std::runtime_error("Failed to write BVH benchmark to " + fname);
+    }
+    fout << benchmark.dump(4) << "\n";
+    std::cout << "Wrote BVH benchmark to " << fname << "\n";
+}
+
+bool run_bake_benchmark(const std::vector<std::string> &args)
+{
+    const std::string results_file = args[1];
+    int n_samples = 64;
+    bool stress_meshes = true;
+    std::vector<std::string> scene_files;
+    for (size_t i = 2; i < args.size(); ++i) {
+        if (args[i] == "--spp") {
+            n_samples = std::max(std::stoi(args[++i]), 1);
+        } else if (args[i] == "--no-stress") {
+            stress_meshes = false;
+        } else if (args[i][0] == '-') {
+            std::cout << "Error: Unrecognized option " << args[i] << "\n";
+            std::exit(1);
+        } else {
+            std::string scene_file = args[i];
+            canonicalize_path(scene_file);
+            scene_files.push_back(scene_file);
+        }
+    }
+    // The stress meshes are written once and reused by later runs
+    if (stress_meshes) {
+        for (const uint32_t grid : stress_mesh_grids) {
+            const std::string fname =
+                "dxr_ao_bake_bench_stress_" + std::to_string(grid) + ".obj";
+            if (GetFileAttributesA(fname.c_str()) == INVALID_FILE_ATTRIBUTES) {
+                write_stress_mesh(fname, grid);
+            }
+            scene_files.push_back(fname);
+        }
+    }
+    if (scene_files.empty()) {
+        std::cout << "Error: No scenes to benchmark\n";
+        return false;
+    }
+
+    ComPtr<ID3D12Device5> device = dxr::create_device();
+    if (!dxr::dxr_available(device)) {
+        std::cout << "DXR 1.1 is required for inline ray tracing, but is not supported\n";
+        return false;
+    }
+
+    // The caches are left disabled so every phase runs, and the atlas resolution is fixed
+    // so scenes of any scale bake the same number of texels
+    AppOptions options;
+    options.n_samples = n_samples;
+    options.sampler_seed = bake_benchmark_seed;
+    options.atlas_options.pack_options.resolution = bake_benchmark_atlas_resolution;
+    const uint32_t bvh_profile = resolve_bvh_profile(options.bvh_profile, n_samples);
+
+    dxr::CommandContext cmd_ctx(device.Get());
+    BakePipeline bake_pipeline = create_bake_pipeline(device.Get(), options.ao_format);
+    RayStatsQuery ray_stats_query = create_ray_stats_query(device.Get(), cmd_ctx);
+
+    std::vector<BakeBenchmarkResult> results;
+    for (const auto &scene_file : scene_files) {
+        BakeBenchmarkResult result;
+        result.scene = scene_file;
+        dxr::GpuProfiler profiler(device.Get(), cmd_ctx.queue.Get(), gpu_profiler_regions);
+        try {
+            BakeScene bake_scene = load_bake_scene(scene_file,
+                                                   options.scene_load,
+                                                   options.atlas_options,
+                                                   bvh_profile,
+                                                   device.Get(),
+                                                   cmd_ctx,
+                                                   nullptr,
+                                                   profiler,
+                                                   nullptr);
+            resolve_gpu_profile(cmd_ctx, profiler);
+            result.atlas_size = bake_scene.atlas_size;
+            result.load_ms = bake_scene.load_ms;
+            result.unwrap_ms = bake_scene.unwrap_ms;
+            result.upload_ms = bake_scene.upload_ms;
+            result.peak_vram_bytes = dxr::video_memory_usage(device.Get());
+
+            // The BVHs built while streaming the meshes overlap the unwrap, so they're
+            // rebuilt on their own to measure the builds
+            auto start = std::chrono::steady_clock::now();
+            result.tlas_ms = rebuild_scene_bvhs(device.Get(),
+                                                cmd_ctx,
+                                                bake_scene,
+                                                bvh_profile,
+                                                false,
+                                                result.blas_stats,
+                                                profiler);
+            result.bvh_build_ms = std::chrono::duration<double, std::milli>(
+                                      std::chrono::steady_clock::now() - start)
+                                      .count();
+            resolve_gpu_profile(cmd_ctx, profiler);
+            result.peak_vram_bytes =
+                std::max(result.peak_vram_bytes, dxr::video_memory_usage(device.Get()));
+
+            BakeTarget bake_target = create_bake_target(
+                device.Get(), bake_scene.atlas_size, 0, options.ao_format);
+            AtlasParams atlas_params(bake_scene.atlas_size);
+            atlas_params.n_samples = n_samples;
+            atlas_params.samples_per_frame = n_samples;
+            atlas_params.ao_length = options.ao_length;
+            atlas_params.sampler_type = options.sampler_type;
+            atlas_params.sampler_seed = options.sampler_seed;
+            atlas_params.near_field_radius = bake_scene.near_field_radius;
+
+            start = std::chrono::steady_clock::now();
+            begin_ray_stats(cmd_ctx, ray_stats_query, bake_target);
+            bake_frame(cmd_ctx,
+                       bake_pipeline,
+                       bake_scene,
+                       bake_target,
+                       atlas_params,
+                       options.tile_size,
+                       {},
+                       profiler);
+            result.bake_stats = end_ray_stats(cmd_ctx, ray_stats_query, bake_target);
+            result.bake_ms = std::chrono::duration<double, std::milli>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+            resolve_gpu_profile(cmd_ctx, profiler);
+            result.peak_vram_bytes =
+                std::max(result.peak_vram_bytes, dxr::video_memory_usage(device.Get()));
+        } catch (const std::exception &e) {
+            std::cout << "Error: Benchmark of " << scene_file << " failed: " << e.what()
+                      << "\n";
+            return false;
+        }
+        result.peak_rss_bytes = peak_process_memory();
+        for (const auto &region : profiler.stats()) {
+            result.gpu_regions.emplace_back(
+                region.name,
+                std::accumulate(region.history.begin(), region.history.end(), 0.0));
+        }
+
+        std::cout << "Benchmark " << scene_file << ": load " << result.load_ms
+                  << "ms, unwrap " << result.unwrap_ms << "ms, BVH build "
+                  << result.bvh_build_ms << "ms, bake " << result.bake_ms << "ms, "
+                  << result.bake_stats.rays * 1e-3 /
+                         std::max(result.bake_stats.gpu_ms, 1e-6)
+                  << " Mrays/s\n";
+        results.push_back(result);
+    }
+    write_bake_benchmark(results_file, device.Get(), n_samples, results);
+    return true;
+}
+
+void write_stress_mesh(const std::string &fname, uint32_t grid)
+{
+    std::ofstream fout(fname.c_str());
+    if (!fout) {
+        std::cout << "Error: Failed to write the stress mesh " << fname << "\n";
+        throw std::runtime_error("Failed to write the stress mesh " + fname);
+    }
+    // The ridges of two interleaved frequencies occlude each other at several scales
+    const float size = 10.f;
+    for (uint32_t y = 0; y <= grid; ++y) {
+        for (uint32_t x = 0; x <= grid; ++x) {
+            const glm::vec2 p = glm::vec2(x, y) / float(grid);
+            const float height = 0.5f * std::sin(p.x * 37.f) * std::cos(p.y * 23.f) +
+                                 0.1f * std::sin((p.x + p.y) * 181.f);
+            fout << "v " << p.x * size << " " << height << " " << p.y * size << "\n";
+        }
+    }
+    // OBJ indices are 1-based
+    const uint32_t row = grid + 1;
+    for (uint32_t y = 0; y < grid; ++y) {
+        for (uint32_t x = 0; x < grid; ++x) {
+            const uint32_t v = y * row + x + 1;
+            fout << "f " << v << " " << v + row << " " << v + 1 << "\n"
+                 << "f " << v + 1 << " " << v + row << " " << v + row + 1 << "\n";
+        }
+    }
+    std::cout << "Wrote stress mesh " << fname << " with "
+              << pretty_print_count(2.0 * grid * grid) << " triangles\n";
+}
+
+uint64_t peak_process_memory()
+{
+    PROCESS_MEMORY_COUNTERS counters = {0};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize;
+}
+
+uint64_t process_memory()
+{
+    PROCESS_MEMORY_COUNTERS counters = {0};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.WorkingSetSize;
+}
+
+void write_bake_benchmark(const std::string &fname,
+                          ID3D12Device *device,
+                          int n_samples,
+                          const std::vector<BakeBenchmarkResult> &results)
+{
+    using json = nlohmann::json;
+    json scenes = json::array();
+    for (const auto &r : results) {
+        json phases;
+        phases["load"]["wall_ms"] = r.load_ms;
+        phases["unwrap"]["wall_ms"] = r.unwrap_ms;
+        phases["upload"]["wall_ms"] = r.upload_ms;
+        phases["bvh_build"]["wall_ms"] = r.bvh_build_ms;
+        phases["bvh_build"]["blas_build_ms"] = r.blas_stats.build_ms;
+        phases["bvh_build"]["blas_compaction_ms"] = r.blas_stats.compaction_ms;
+        phases["bvh_build"]["tlas_build_ms"] = r.tlas_ms;
+        phases["bake"]["wall_ms"] = r.bake_ms;
+        phases["bake"]["gpu_ms"] = r.bake_stats.gpu_ms;
+
+        json regions = json::array();
+        for (const auto &region : r.gpu_regions) {
+            json g;
+            g["name"] = region.first;
+            g["total_ms"] = region.second;
+            regions.push_back(g);
+        }
+
+        json s;
+        s["scene"] = r.scene;
+        s["atlas_size"] = {r.atlas_size.x, r.atlas_size.y};
+        s["phases"] = phases;
+        s["gpu_regions"] = regions;
+        s["rays"] = r.bake_stats.rays;
+        s["hits"] = r.bake_stats.hits;
+        s["mrays_per_second"] =
+            r.bake_stats.gpu_ms > 0.0 ? r.bake_stats.rays * 1e-3 / r.bake_stats.gpu_ms : 0.0;
+        s["blas_uncompacted_bytes"] = r.blas_stats.uncompacted_bytes;
+        s["blas_compacted_bytes"] = r.blas_stats.compacted_bytes;
+        s["peak_vram_bytes"] = r.peak_vram_bytes;
+        s["peak_rss_bytes"] = r.peak_rss_bytes;
+        scenes.push_back(s);
+    }
+    const DXGI_ADAPTER_DESC1 adapter = dxr::adapter_desc(device);
+    std::wstring_convert<std::codecvt_utf8<wchar_t>> conv;
+    json benchmark;
+    benchmark["gpu"] = conv.to_bytes(adapter.Description);
+    benchmark["vendor_id"] = adapter.VendorId;
+    benchmark["device_id"] = adapter.DeviceId;
+    benchmark["driver_version"] = dxr::driver_version(device);
+    benchmark["samples_per_texel"] = n_samples;
+    benchmark["sampler_seed"] = bake_benchmark_seed;
+    benchmark["atlas_resolution"] = bake_benchmark_atlas_resolution;
+    benchmark["scenes"] = scenes;
+
+    std::ofstream fout(fname.c_str());
+    if (!fout) {
+        std::cout << "Failed to write bake benchmark to " << fname << "\n";
+        throw std::runtime_error("Failed to write bake benchmark to " + fname);
+    }
+    fout << benchmark.dump(4) << "\n";
+    std::cout << "Wrote bake benchmark to " << fname << "\n";
+}
+
+std::vector<uint8_t> read_back_ao_image(ID3D12Device5 *device,
+                                        dxr::CommandContext &cmd_ctx,
+                                        dxr::Texture2D &ao_image)
+{
+    const glm::uvec2 dims = ao_image.dims();
+    dxr::Buffer readback_buf = dxr::Buffer::readback(
+        device, ao_image.linear_row_pitch() * dims.y, D3D12_RESOURCE_STATE_COPY_DEST);
+
+    const D3D12_RESOURCE_STATES prev_state = ao_image.state();
+    cmd_ctx.begin();
+    {
+        auto b = dxr::barrier_transition(ao_image, D3D12_RESOURCE_STATE_COPY_SOURCE);
+        cmd_ctx.cmd_list->ResourceBarrier(1, &b);
+    }
+    ao_image.readback(cmd_ctx.cmd_list.Get(), readback_buf);
+    {
+        auto b = dxr::barrier_transition(ao_image, prev_state);
+        cmd_ctx.cmd_list->ResourceBarrier(1, &b);
+    }
+    cmd_ctx.submit_and_sync();
+
+    // Copy the rows out of the pitch-aligned readback buffer
+    const size_t row_size = dims.x * ao_image.pixel_size();
+    std::vector<uint8_t> img(row_size * dims.y, 0);
+    const uint8_t *data = static_cast<const uint8_t *>(readback_buf.map());
+    for (uint32_t y = 0; y < dims.y; ++y) {
+        std::memcpy(
+            img.data() + y * row_size, data + y * ao_image.linear_row_pitch(), row_size);
+    }
+    readback_buf.unmap();
+    return img;
+}
+
+std::vector<uint8_t> ao_pixels_to_rgba8(const std::vector<uint8_t> &pixels,
+                                        DXGI_FORMAT format)
+{
+    if (format == DXGI_FORMAT_R8G8B8A8_UNORM) {
+        return pixels;
+    }
+    const size_t num_pixels = pixels.size() / (format == DXGI_FORMAT_R8_UNORM ? 1 : 2);
+    std::vector<uint8_t> img(num_pixels * 4, 255);
+    for (size_t i = 0; i < num_pixels; ++i) {
+        const float ao = glm::clamp(ao_pixel_value(pixels, format, i), 0.f, 1.f);
+        img[i * 4] = ao * 255.f + 0.5f;
+        img[i * 4 + 1] = img[i * 4];
+        img[i * 4 + 2] = img[i * 4];
+    }
+    return img;
+}
+
+float ao_pixel_value(const std::vector<uint8_t> &pixels, DXGI_FORMAT format, size_t i)
+{
+    const uint16_t *pixels_u16 = reinterpret_cast<const uint16_t *>(pixels.data());
+    switch (format) {
+    case DXGI_FORMAT_R8G8B8A8_UNORM:
+        return pixels[i * 4] / 255.f;
+    case DXGI_FORMAT_R8_UNORM:
+        return pixels[i] / 255.f;
+    case DXGI_FORMAT_R16_UNORM:
+        return pixels_u16[i] / 65535.f;
+    default:
+        return glm::unpackHalf1x16(pixels_u16[i]);
+    }
+}
+
+void write_ao_image(ID3D12Device5 *device,
+                    dxr::CommandContext &cmd_ctx,
+                    BlockCompressPipeline &bc_pipeline,
+                    dxr::Texture2D &ao_image,
+                    const std::string &fname,
+                    bool compress)
+{
+    const glm::uvec2 dims = ao_image.dims();
+    if (compress && get_file_extension(fname) == "dds") {
+        const std::vector<uint8_t> blocks =
+            block_compress(device, cmd_ctx, bc_pipeline, ao_image, DXGI_FORMAT_BC4_UNORM);
+        if (!write_dds(fname, dims, DXGI_FORMAT_BC4_UNORM, blocks)) {
+            std::cout << "Failed to write AO map to " << fname << "\n";
+            throw std::runtime_error("Failed to write AO map to " + fname);
+        }
+        std::cout << "AO map written to " << fname << "\n";
+    } else {
+        encode_ao_image(read_back_ao_image(device, cmd_ctx, ao_image),
+                        dims,
+                        ao_image.pixel_format(),
+                        fname);
+    }
+}
+
+void write_ao_image_async(dxr::CommandContext &cmd_ctx,
+                          dxr::AsyncReadback &readback,
+                          dxr::Texture2D &ao_image,
+                          const std::string &fname)
+{
+    const glm::uvec2 dims = ao_image.dims();
+    const DXGI_FORMAT format = ao_image.pixel_format();
+    readback.read_back(cmd_ctx, ao_image, [=](const std::vector<uint8_t> &pixels) {
+        encode_ao_image(pixels, dims, format, fname);
+    });
+}
+
+void encode_ao_image(const std::vector<uint8_t> &pixels,
+                     const glm::uvec2 &dims,
+                     DXGI_FORMAT format,
+                     const std::string &fname)
+{
+    const std::string ext = get_file_extension(fname);
+    int ok = 0;
+    if (ext == "dds") {
+        ok = write_dds(fname, dims, format, pixels);
+    } else if (ext == "exr") {
+        ok = write_exr(fname, dims, 1, EXR_COMPRESSION_ZIP, [&](uint32_t y, void *row) {
+            uint16_t *out = reinterpret_cast<uint16_t *>(row);
+            const size_t offset = size_t(y) * dims.x;
+            for (uint32_t x = 0; x < dims.x; ++x) {
+                out[x] = glm::packHalf1x16(ao_pixel_value(pixels, format, offset + x));
+            }
+        });
+    } else {
+        ok = write_png(fname, dims, 4, 8, [&](uint32_t y, void *row) {
+            uint8_t *out = reinterpret_cast<uint8_t *>(row);
+            const size_t offset = size_t(y) * dims.x;
+            if (format == DXGI_FORMAT_R8G8B8A8_UNORM) {
+                std::memcpy(out, pixels.data() + offset * 4, dims.x * 4);
+                return;
+            }
+            for (uint32_t x = 0; x < dims.x; ++x) {
+                const float ao = ao_pixel_value(pixels, format, offset + x);
+                out[x * 4] = glm::clamp(ao, 0.f, 1.f) * 255.f + 0.5f;
+                out[x * 4 + 1] = out[x * 4];
+                out[x * 4 + 2] = out[x * 4];
+                out[x * 4 + 3] = 255;
+            }
+        });
+    }
+    if (!ok) {
+        std::cout << "Failed to write AO map to " << fname << "\n";
+        throw std::runtime_error("Failed to write AO map to " + fname);
+    }
+    std::cout << "AO map written to " << fname << "\n";
+}
+
+BlockCompressPipeline create_block_compress_pipeline(ID3D12Device5 *device)
+{
+    BlockCompressPipeline pipeline;
+    pipeline.source_heap =
+        dxr::DescriptorHeapBuilder().add_srv_range(1, 0, 0, "source").create(device);
+    pipeline.signature = dxr::RootSignatureBuilder::global()
+                             .add_constants("block_compress_info", 0, 4, 0)
+                             .add_desc_heap("source_heap", pipeline.source_heap)
+                             .add_uav("blocks", 0, 0)
+                             .create(device);
+
+    pipeline.bc4 = create_compute_pipeline(
+        device, pipeline.signature, bc4_encode_cs_dxil, sizeof(bc4_encode_cs_dxil));
+    pipeline.bc5 = create_compute_pipeline(
+        device, pipeline.signature, bc5_encode_cs_dxil, sizeof(bc5_encode_cs_dxil));
+    return pipeline;
+}
+
+dxr::Texture2D upload_rgba8_image(ID3D12Device5 *device,
+                                  dxr::CommandContext &cmd_ctx,
+                                  const glm::uvec2 &dims,
+                                  const std::vector<uint8_t> &img)
+{
+    dxr::Texture2D texture = dxr::Texture2D::default(
+        device, dims, D3D12_RESOURCE_STATE_COPY_DEST, DXGI_FORMAT_R8G8B8A8_UNORM);
+    dxr::Buffer upload_buf = dxr::Buffer::upload(
+        device, texture.linear_row_pitch() * dims.y, D3D12_RESOURCE_STATE_GENERIC_READ);
+
+    // Copy the rows into the pitch-aligned upload buffer
+    const size_t row_size = dims.x * 4;
+    uint8_t *data = static_cast<uint8_t *>(upload_buf.map());
+    for (uint32_t y = 0; y < dims.y; ++y) {
+        std::memcpy(
+            data + y * texture.linear_row_pitch(), img.data() + y * row_size, row_size);
+    }
+    upload_buf.unmap();
+
+    cmd_ctx.begin();
+    texture.upload(cmd_ctx.cmd_list.Get(), upload_buf);
+    cmd_ctx.submit_and_sync();
+    return texture;
+}
+
+std::vector<uint8_t> block_compress(ID3D12Device5 *device,
+                                    dxr::CommandContext &cmd_ctx,
+                                    BlockCompressPipeline &pipeline,
+                                    dxr::Texture2D &source,
+                                    DXGI_FORMAT format)
+{
+    BlockCompressParams params;
+    params.dimensions = source.dims();
+    params.num_blocks = (params.dimensions + glm::uvec2(3)) / glm::uvec2(4);
+    const size_t blocks_size =
+        size_t(params.num_blocks.x) * params.num_blocks.y * dds_element_size(format);
+
+    dxr::Buffer blocks = dxr::Buffer::default(device,
+                                              blocks_size,
+                                              D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                              D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+
+    D3D12_SHADER_RESOURCE_VIEW_DESC srv_desc = {0};
+    srv_desc.Format = source.pixel_format();
+    srv_desc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+    srv_desc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+    srv_desc.Texture2D.MipLevels = 1;
+    device->CreateShaderResourceView(
+        source.get(), &srv_desc, pipeline.source_heap.cpu_desc_handle("source"));
+
+    const D3D12_RESOURCE_STATES prev_state = source.state();
+    cmd_ctx.begin();
+    auto &cmd_list = cmd_ctx.cmd_list;
+    {
+        auto b =
+            dxr::barrier_transition(source, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    ID3D12DescriptorHeap *heap = pipeline.source_heap.get();
+    cmd_list->SetDescriptorHeaps(1, &heap);
+    cmd_list->SetComputeRootSignature(pipeline.signature.get());
+    cmd_list->SetComputeRoot32BitConstants(0, 4, &params, 0);
+    cmd_list->SetComputeRootDescriptorTable(1, pipeline.source_heap.gpu_desc_handle());
+    cmd_list->SetComputeRootUnorderedAccessView(2, blocks->GetGPUVirtualAddress());
+    cmd_list->SetPipelineState(
+        format == DXGI_FORMAT_BC5_UNORM ? pipeline.bc5.Get() : pipeline.bc4.Get());
+    const glm::uvec2 groups = (params.num_blocks + glm::uvec2(7)) / glm::uvec2(8);
+    cmd_list->Dispatch(groups.x, groups.y, 1);
+    {
+        auto b = dxr::barrier_transition(source, prev_state);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    cmd_ctx.submit_and_sync();
+
+    return read_back_buffer(device, cmd_ctx, blocks);
+}
+
+std::vector<uint8_t> read_back_buffer(ID3D12Device5 *device,
+                                      dxr::CommandContext &cmd_ctx,
+                                      dxr::Buffer &buf)
+{
+    dxr::Buffer readback_buf =
+        dxr::Buffer::readback(device, buf.size(), D3D12_RESOURCE_STATE_COPY_DEST);
+
+    cmd_ctx.begin();
+    {
+        auto b = dxr::barrier_transition(buf, D3D12_RESOURCE_STATE_COPY_SOURCE);
+        cmd_ctx.cmd_list->ResourceBarrier(1, &b);
+    }
+    dxr::copy_buffer(cmd_ctx.cmd_list.Get(), readback_buf, buf);
+    {
+        auto b = dxr::barrier_transition(buf, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+        cmd_ctx.cmd_list->ResourceBarrier(1, &b);
+    }
+    cmd_ctx.submit_and_sync();
+
+    std::vector<uint8_t> data(buf.size(), 0);
+    std::memcpy(data.data(), readback_buf.map(), data.size());
+    readback_buf.unmap();
+    return data;
+}
+
+void upload_buffer(ID3D12Device5 *device,
+                   dxr::CommandContext &cmd_ctx,
+                   dxr::Buffer &buf,
+                   const std::vector<uint8_t> &data)
+{
+    dxr::Buffer upload_buf =
+        dxr::Buffer::upload(device, data.size(), D3D12_RESOURCE_STATE_GENERIC_READ);
+    std::memcpy(upload_buf.map(), data.data(), data.size());
+    upload_buf.unmap();
+
+    cmd_ctx.begin();
+    {
+        auto b = dxr::barrier_transition(buf, D3D12_RESOURCE_STATE_COPY_DEST);
+        cmd_ctx.cmd_list->ResourceBarrier(1, &b);
+    }
+    cmd_ctx.cmd_list->CopyBufferRegion(
+        buf.get(), 0, upload_buf.get(), upload_buf.offset(), data.size());
+    {
+        auto b = dxr::barrier_transition(buf, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+        cmd_ctx.cmd_list->ResourceBarrier(1, &b);
+    }
+    cmd_ctx.submit_and_sync();
+}
+
+void upload_ao_image(ID3D12Device5 *device,
+                     dxr::CommandContext &cmd_ctx,
+                     dxr::Texture2D &ao_image,
+                     const std::vector<uint8_t> &pixels)
+{
+    const glm::uvec2 dims = ao_image.dims();
+    dxr::Buffer upload_buf = dxr::Buffer::upload(
+        device, ao_image.linear_row_pitch() * dims.y, D3D12_RESOURCE_STATE_GENERIC_READ);
+
+    // Copy the rows into the pitch-aligned upload buffer
+    const size_t row_size = dims.x * ao_image.pixel_size();
+    uint8_t *data = static_cast<uint8_t *>(upload_buf.map());
+    for (uint32_t y = 0; y < dims.y; ++y) {
+        std::memcpy(
+            data + y * ao_image.linear_row_pitch(), pixels.data() + y * row_size, row_size);
+    }
+    upload_buf.unmap();
+
+    const D3D12_RESOURCE_STATES prev_state = ao_image.state();
+    cmd_ctx.begin();
+    {
+        auto b = dxr::barrier_transition(ao_image, D3D12_RESOURCE_STATE_COPY_DEST);
+        cmd_ctx.cmd_list->ResourceBarrier(1, &b);
+    }
+    ao_image.upload(cmd_ctx.cmd_list.Get(), upload_buf);
+    {
+        auto b = dxr::barrier_transition(ao_image, prev_state);
+        cmd_ctx.cmd_list->ResourceBarrier(1, &b);
+    }
+    cmd_ctx.submit_and_sync();
+}
+
+void copy_image_tiles(std::vector<uint8_t> &dest,
+                      const std::vector<uint8_t> &src,
+                      const glm::uvec2 &dims,
+                      size_t texel_size,
+                      const std::vector<glm::uvec2> &tiles,
+                      uint32_t tile_size)
+{
+    for (const auto &origin : tiles) {
+        const glm::uvec2 end = glm::min(origin + glm::uvec2(tile_size), dims);
+        const size_t row_size = (end.x - origin.x) * texel_size;
+        for (uint32_t y = origin.y; y < end.y; ++y) {
+            const size_t offset = (size_t(y) * dims.x + origin.x) * texel_size;
+            std::memcpy(dest.data() + offset, src.data() + offset, row_size);
+        }
+    }
+}
+
+void write_float_image(ID3D12Device5 *device,
+                       dxr::CommandContext &cmd_ctx,
+                       BlockCompressPipeline &bc_pipeline,
+                       const std::string &fname,
+                       const glm::uvec2 &dims,
+                       const std::vector<glm::vec4> &img,
+                       DXGI_FORMAT dds_format)
+{
+    const std::string ext = get_file_extension(fname);
+    int ok = 0;
+    if (ext == "hdr") {
+        ok = stbi_write_hdr(
+            fname.c_str(), dims.x, dims.y, 4, reinterpret_cast<const float *>(img.data()));
+    } else if (ext == "exr") {
+        ok = write_exr(fname, dims, 4, EXR_COMPRESSION_ZIP, [&](uint32_t y, void *row) {
+            uint16_t *out = reinterpret_cast<uint16_t *>(row);
+            const glm::vec4 *pixels = img.data() + size_t(y) * dims.x;
+            for (uint32_t x = 0; x < dims.x; ++x) {
+                for (uint32_t c = 0; c < 4; ++c) {
+                    out[x * 4 + c] = glm::packHalf1x16(pixels[x][c]);
+                }
+            }
+        });
+    } else {
+        std::vector<uint8_t> img_u8(img.size() * 4, 0);
+        for (size_t i = 0; i < img.size(); ++i) {
+            for (size_t c = 0; c < 4; ++c) {
+                img_u8[i * 4 + c] = glm::clamp(img[i][c], 0.f, 1.f) * 255.f;
+            }
+        }
+        if (ext == "dds") {
+            dxr::Texture2D source = upload_rgba8_image(device, cmd_ctx, dims, img_u8);
+            const std::vector<uint8_t> blocks =
+                block_compress(device, cmd_ctx, bc_pipeline, source, dds_format);
+            ok = write_dds(fname, dims, dds_format, blocks);
+        } else {
+            ok = write_png(fname, dims, 4, 8, [&](uint32_t y, void *row) {
+                std::memcpy(row, img_u8.data() + size_t(y) * dims.x * 4, dims.x * 4);
+            });
+        }
+    }
+    if (!ok) {
+        std::cout << "Failed to write map to " << fname << "\n";
+        throw std::runtime_error("Failed to write map to " + fname);
+    }
+    std::cout << "Map written to " << fname << "\n";
+}
+
+void write_bake_outputs(ID3D12Device5 *device,
+                        dxr::CommandContext &cmd_ctx,
+                        BlockCompressPipeline &bc_pipeline,
+                        BakeTarget &bake_target,
+                        const AppOptions &options,
+                        float ao_length)
+{
+    const glm::uvec2 dims = bake_target.ao_image.dims();
+    const std::vector<uint8_t> accum_data =
+        read_back_buffer(device, cmd_ctx, bake_target.accum_buf);
+    const glm::vec2 *accum = reinterpret_cast<const glm::vec2 *>(accum_data.data());
+    const size_t num_pixels = size_t(dims.x) * dims.y;
+
+    if (!options.direct_light_output.empty()) {
+        const std::vector<uint8_t> light_data =
+            read_back_buffer(device, cmd_ctx, bake_target.light_buf);
+        const glm::vec4 *light = reinterpret_cast<const glm::vec4 *>(light_data.data());
+        std::vector<glm::vec4> irradiance(num_pixels, glm::vec4(0.f, 0.f, 0.f, 1.f));
+        for (size_t i = 0; i < num_pixels; ++i) {
+            if (accum[i].y != 0.f) {
+                irradiance[i] = glm::vec4(glm::vec3(light[i]) / accum[i].y, 1.f);
+            }
+        }
+        write_float_image(device,
+                          cmd_ctx,
+                          bc_pipeline,
+                          options.direct_light_output,
+                          dims,
+                          irradiance,
+                          DXGI_FORMAT_UNKNOWN);
+    }
+    if (!bake_target.extras_buf.get()) {
+        return;
+    }
+
+    const std::vector<uint8_t> extras_data =
+        read_back_buffer(device, cmd_ctx, bake_target.extras_buf);
+    const glm::vec4 *extras = reinterpret_cast<const glm::vec4 *>(extras_data.data());
+
+    const bool hdr_normals = get_file_extension(options.bent_normal_output) == "hdr";
+    const bool hdr_distance = get_file_extension(options.hit_distance_output) == "hdr";
+    std::vector<glm::vec4> bent_normals(num_pixels, glm::vec4(0.f, 0.f, 0.f, 1.f));
+    std::vector<glm::vec4> hit_distance(num_pixels, glm::vec4(0.f, 0.f, 0.f, 1.f));
+    for (size_t i = 0; i < num_pixels; ++i) {
+        const float n_samples = accum[i].y;
+        if (n_samples == 0.f) {
+            continue;
+        }
+        // Fully occluded texels have no unoccluded directions to average
+        glm::vec3 n = glm::vec3(extras[i]);
+        if (glm::length(n) > 0.f) {
+            n = glm::normalize(n);
+        }
+        if (!hdr_normals) {
+            n = n * 0.5f + glm::vec3(0.5f);
+        }
+        bent_normals[i] = glm::vec4(n, 1.f);
+
+        float distance = extras[i].w / n_samples;
+        if (!hdr_distance) {
+            distance /= ao_length;
+        }
+        hit_distance[i] = glm::vec4(glm::vec3(distance), 1.f);
+    }
+
+    if (!options.bent_normal_output.empty()) {
+        write_float_image(device,
+                          cmd_ctx,
+                          bc_pipeline,
+                          options.bent_normal_output,
+                          dims,
+                          bent_normals,
+                          DXGI_FORMAT_BC5_UNORM);
+    }
+    if (!options.hit_distance_output.empty()) {
+        write_float_image(device,
+                          cmd_ctx,
+                          bc_pipeline,
+                          options.hit_distance_output,
+                          dims,
+                          hit_distance,
+                          DXGI_FORMAT_BC4_UNORM);
+    }
+}
+
+float ao_image_rmse(const std::vector<uint8_t> &img,
+                    const glm::uvec2 &dims,
+                    const std::string &reference_file)
+{
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    uint8_t *reference = stbi_load(reference_file.c_str(), &width, &height, &channels, 4);
+    if (!reference) {
+        std::cout << "Failed to load reference image " << reference_file << "\n";
+        throw std::runtime_error("Failed to load reference image " + reference_file);
+    }
+    if (uint32_t(width) != dims.x || uint32_t(height) != dims.y) {
+        stbi_image_free(reference);
+        std::cout << "Reference image " << reference_file << " is " << width << "x" << height
+                  << ", but the AO map is " << dims.x << "x" << dims.y << "\n";
+        throw std::runtime_error("Reference image size does not match the AO map");
+    }
+
+    // Texels outside the charts keep the clear color of opaque black, while covered texels
+    // store the AO in all channels
+    double sum_sq_err = 0.0;
+    size_t n_covered = 0;
+    for (size_t i = 0; i < size_t(dims.x) * dims.y; ++i) {
+        const uint8_t *ref = reference + i * 4;
+        if (ref[0] == 0 && ref[3] == 255) {
+            continue;
+        }
+        const double err = (double(img[i * 4]) - double(ref[0])) / 255.0;
+        sum_sq_err += err * err;
+        ++n_covered;
+    }
+    stbi_image_free(reference);
+    return n_covered > 0 ? static_cast<float>(std::sqrt(sum_sq_err / n_covered)) : 0.f;
+}
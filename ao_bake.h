@@ -0,0 +1,1646 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <SDL.h>
+#include <windows.h>
+#include <glm/glm.hpp>
+#include "alpha_test.h"
+#include "atlas.h"
+#include "bake_job.h"
+#include "bake_server.h"
+#include "dxr/dx12_utils.h"
+#include "dxr/dxdisplay.h"
+#include "dxr/dxr_utils.h"
+#include "mesh_optimize.h"
+#include "mesh_simplify.h"
+#include "scene.h"
+
+// The window size, set by -img and updated as the app's window is resized
+extern int win_width;
+extern int win_height;
+
+
+// Size of the upload ring used to stage the scene data
+const size_t upload_ring_size = 64 * 1024 * 1024;
+// Max batches of unwrapped meshes waiting to be streamed to the GPU, see MeshStream
+const size_t max_stream_batches = 2;
+// Instance descs written by each task when building the TLAS
+const size_t instance_desc_block_size = 16 * 1024;
+
+// Bump if the BVH cache file layout or the geometry encoding changes to invalidate old caches
+const uint32_t bvh_cache_version = 2;
+const uint32_t bvh_cache_magic = 0x43485642; // BVHC
+
+// Max regions timed by the GPU profiler between each resolve
+const uint32_t gpu_profiler_regions = 64;
+
+// How much the curvature within a texel increases its share of the ray budget
+const float budget_curvature_weight = 4.f;
+// Texels take at most this many times the mean samples per texel of the ray budget
+const double budget_max_scale = 16.0;
+
+// Max vertices baked in each chunk of the vertex AO bake, the chunk's buffers take 32MB
+const uint32_t vertex_ao_chunk_size = 1 << 20;
+// The vertex AO rays start this fraction of the scene's diagonal off the surface
+const float vertex_ao_ray_offset = 1e-4f;
+
+// Max rays generated for each chunk of the wavefront bake, the ray buffers take 64MB each
+const uint32_t wavefront_ray_capacity = 1 << 21;
+// Must match NUM_RAY_BINS in wavefront_bake.hlsl
+const uint32_t wavefront_num_bins = 4096;
+
+// The AO map is dilated in tiles of this size, each with an apron of up to max_gutter texels
+const uint32_t dilate_tile_size = 1024;
+const uint32_t max_gutter = 32;
+// The coarsest preview level the viewer bakes, as a fraction of the atlas resolution
+const uint32_t max_preview_scale = 16;
+
+// The sample generators for the AO rays, must match the SAMPLER_* values in sampler.hlsl
+enum SamplerType : uint32_t {
+    SAMPLER_LCG = 0,
+    SAMPLER_SOBOL = 1,
+    SAMPLER_R2 = 2,
+    SAMPLER_BLUE_NOISE = 3,
+};
+
+const std::array<const char *, 4> sampler_names = {"lcg", "sobol", "r2", "blue-noise"};
+
+// The acceleration structure build profiles. Previews favor fast builds without compaction,
+// final bakes favor fast tracing on compacted BVHs
+enum BvhProfile : uint32_t {
+    BVH_PROFILE_AUTO = 0,
+    BVH_PROFILE_FAST_BUILD = 1,
+    BVH_PROFILE_FAST_TRACE = 2,
+};
+
+const std::array<const char *, 3> bvh_profile_names = {"auto", "fast-build", "fast-trace"};
+
+// Names of the TextureLoad modes, in enum order
+const std::array<const char *, 3> texture_load_names = {"all", "alpha", "none"};
+
+// Names of the combinations of MeshOptimizeStage flags, indexed by the flags
+const std::array<const char *, 4> mesh_optimize_names = {"none", "pre", "post", "both"};
+
+// The auto BVH profile treats bakes of up to this many samples per texel as previews
+const int bvh_preview_samples = 64;
+// Frames baked with each profile by the BVH benchmark
+const int bvh_benchmark_frames = 4;
+// Frames baked with each ray tracing backend by the backend benchmark
+const int backend_benchmark_frames = 4;
+// How long --submit waits for the bake server to accept its connection
+const int server_connect_timeout_ms = 10000;
+// How often the server's loaders recheck the video memory usage while it's over budget
+const int server_vram_poll_ms = 100;
+// The sampler seed and atlas resolution of every scene baked by the bake benchmark
+const uint32_t bake_benchmark_seed = 0;
+const uint32_t bake_benchmark_atlas_resolution = 2048;
+// The grid sizes of the bake benchmark's stress meshes, heightfields of 2 * n^2 triangles
+const std::array<uint32_t, 2> stress_mesh_grids = {512, 1024};
+
+// The extra maps baked along with the AO, must match the BAKE_OUTPUT_* values in trace_ao.hlsl
+enum BakeOutput : uint32_t {
+    BAKE_OUTPUT_BENT_NORMAL = 1,
+    BAKE_OUTPUT_HIT_DISTANCE = 2,
+    BAKE_OUTPUT_DIRECT_LIGHT = 4,
+};
+
+// The outputs summed from the AO rays into the bake target's extras
+const uint32_t BAKE_OUTPUT_AO_EXTRAS = BAKE_OUTPUT_BENT_NORMAL | BAKE_OUTPUT_HIT_DISTANCE;
+
+// The TLAS instance masks of the near and far field AO rays, must match the OCCLUDER_MASK_*
+// values in trace_ao.hlsl
+enum OccluderMask : uint32_t {
+    OCCLUDER_MASK_NEAR = 1,
+    OCCLUDER_MASK_FAR = 2,
+};
+
+// The fields of the AO rays an occluder class can be set to occlude
+const std::array<const char *, 3> occluder_field_names = {"all", "near", "none"};
+const std::array<uint32_t, 3> occluder_fields = {
+    OCCLUDER_MASK_NEAR | OCCLUDER_MASK_FAR, OCCLUDER_MASK_NEAR, 0};
+
+// The AO map formats for the headless bake, bc4 bakes to R8 and block compresses the output
+const std::array<const char *, 5> ao_format_names = {"rgba8", "r8", "r16", "r16f", "bc4"};
+const std::array<DXGI_FORMAT, 5> ao_formats = {DXGI_FORMAT_R8G8B8A8_UNORM,
+                                               DXGI_FORMAT_R8_UNORM,
+                                               DXGI_FORMAT_R16_UNORM,
+                                               DXGI_FORMAT_R16_FLOAT,
+                                               DXGI_FORMAT_R8_UNORM};
+
+// Must match BLUE_NOISE_SIZE in sampler.hlsl
+const uint32_t blue_noise_size = 64;
+
+// The resolution of the grid the lightmap uvs are rasterized over to check for overlaps
+const uint32_t lightmap_uv_check_resolution = 1024;
+
+// The AtlasInfo constants passed to the bake shader
+struct AtlasParams {
+    glm::ivec2 dimensions;
+    // Total number of samples to take per texel
+    int n_samples;
+    float ao_length;
+    // Index of the frame in the accumulation, the accumulation is reset on frame 0
+    uint32_t frame_id;
+    // Number of samples to trace per texel each frame
+    int samples_per_frame;
+    uint32_t sampler_type;
+    uint32_t sampler_seed;
+    // The BakeOutput maps to accumulate along with the AO
+    uint32_t bake_outputs;
+    // The distance the AO rays trace the full-res geometry before the occluder proxies, 0
+    // if the scene has no proxies
+    float near_field_radius;
+
+    AtlasParams(const glm::uvec2 dims)
+        : dimensions(dims.x, dims.y),
+          n_samples(16),
+          ao_length(5.f),
+          frame_id(0),
+          samples_per_frame(16),
+          sampler_type(SAMPLER_SOBOL),
+          sampler_seed(0),
+          bake_outputs(0),
+          near_field_radius(0.f)
+    {
+    }
+};
+
+// Settings for the adaptive bake
+struct AdaptiveSettings {
+    float error_threshold = 0.01f;
+    int min_samples = 16;
+    // Show the samples taken per texel instead of the AO
+    bool show_heatmap = false;
+};
+
+// Settings for the atlas space denoiser
+struct DenoiseSettings {
+    bool enabled = false;
+    // Each iteration doubles the spacing of the filter taps
+    int iterations = 5;
+    // Edge-stopping sigmas of the AO, normal and position weights. sigma_ao is halved each
+    // iteration as the noise is filtered out
+    float sigma_ao = 1.f;
+    float sigma_normal = 64.f;
+    float sigma_position = 1.f;
+};
+
+// Options parsed from the command line
+struct AppOptions {
+    std::string scene_file;
+    // The max rate the UI presents the AO map at
+    float display_fps = 30.f;
+    // The viewer bakes previews from 1/preview_scale of the atlas resolution before the full
+    // atlas, if 0 it bakes the full atlas directly
+    uint32_t preview_scale = 0;
+    int preview_samples = 4;
+    // If set we run a headless bake and write the AO map to this file
+    std::string bake_output;
+    int n_samples = 16;
+    float ao_length = 5.f;
+    // Number of samples to accumulate per frame, if 0 all samples are taken in one frame
+    int samples_per_frame = 0;
+    // The atlas is baked in square tiles of this size to bound each submission
+    uint32_t tile_size = 2048;
+    // Bake using the texel G-buffer and compute shader instead of rasterizing the atlas
+    bool compute_bake = false;
+    // Trace the compute bake's rays in wavefront passes binned by direction and origin
+    bool wavefront = false;
+    // Trace the compute bake's rays with DispatchRays instead of inline ray queries
+    bool raygen_bake = false;
+    // Compare the Mrays/s of the inline and raygen compute bakes before the headless bake
+    bool backend_benchmark = false;
+    // Trace the compute bake in rounds, stopping once each texel has converged
+    bool adaptive = false;
+    AdaptiveSettings adaptive_settings;
+    // Width of the gutter to fill around the charts
+    uint32_t gutter = 4;
+    DenoiseSettings denoise_settings;
+    uint32_t sampler_type = SAMPLER_SOBOL;
+    uint32_t sampler_seed = 0;
+    // Reference AO map to compare the headless bake against
+    std::string compare_reference;
+    DXGI_FORMAT ao_format = DXGI_FORMAT_R8G8B8A8_UNORM;
+    // Write .dds AO maps BC4 compressed
+    bool compress_ao = false;
+    // Files to write the extra maps to, each is only baked if set
+    std::string bent_normal_output;
+    std::string hit_distance_output;
+    std::string direct_light_output;
+    // File to write the GPU profiler timings to
+    std::string profile_output;
+    // File to write the CPU trace merged with the GPU profiler regions to
+    std::string trace_output;
+    // The thread count of the shared thread pool, 0 for one per hardware thread
+    uint32_t thread_count = 0;
+    // Total rays to distribute over the texels by their importance, if 0 every texel takes
+    // n_samples
+    double ray_budget = 0.0;
+    uint32_t bvh_profile = BVH_PROFILE_AUTO;
+    // File to write the BVH profile benchmark results to, the benchmark is skipped if empty
+    std::string bvh_benchmark_output;
+    // Place buffers and textures in shared heaps instead of committing each one
+    bool placed_resources = true;
+    // File to cache the compiled pipeline states in, defaults to the atlas cache directory
+    std::string pipeline_cache;
+    // Bake the headless raster bake's tiles on every GPU supporting DXR 1.1
+    bool multi_gpu = false;
+    // The job directory shared with the workers of the distributed bake, not distributed if
+    // empty
+    std::string distribute_dir;
+    // Run as a worker of the distributed bakes in the job directory given as the scene file
+    bool bake_worker = false;
+    // Seconds a claimed tile's heartbeat can stall before it's requeued
+    float worker_timeout = 60.f;
+    // The glTF file to write the per-vertex AO to, baked without unwrapping the scene
+    std::string vertex_ao_output;
+    // The directory the batch bake writes each scene's maps to, the batch bake is disabled
+    // if empty. The scene file is the manifest or directory listing the scenes
+    std::string batch_output;
+    // The file extension of the batch bake's AO maps
+    std::string batch_format = "png";
+    // The max scenes loaded or loading ahead of the batch bake, each on its own thread
+    uint32_t batch_prefetch = 2;
+    // Run as a bake server on the local pipe named by the scene file
+    bool bake_server = false;
+    // The max jobs the bake server holds at once, each loading job on its own thread
+    uint32_t server_jobs = 2;
+    // The video memory usage in MB below which the server starts loading jobs, the
+    // adapter's budget if 0
+    double server_vram_budget_mb = 0.0;
+    // The pipe of the bake server to send the headless bake to, baked locally if empty
+    std::string submit_pipe;
+    SceneLoadOptions scene_load;
+    AtlasOptions atlas_options;
+    // The budgets the atlas texel density is solved for, in megatexels, MB of bake buffers
+    // and pages of the atlas resolution, each disabled if 0. Resolved to the atlas options'
+    // texel budget by parse_args
+    double atlas_budget_mtexels = 0.0;
+    double atlas_vram_budget_mb = 0.0;
+    uint32_t atlas_max_pages = 0;
+};
+
+using Microsoft::WRL::ComPtr;
+
+// The transform and atlas region of each scene instance, matches BakeInstance in
+// render_ao_map.hlsl
+struct BakeInstance {
+    glm::mat4 transform;
+    glm::mat4 normal_transform;
+    glm::vec2 uv_offset;
+    glm::vec2 uv_scale;
+};
+
+// The alpha test data of a geometry, matches the layout read by alpha_test_hit in
+// trace_ao.hlsl
+struct AlphaTestGeometry {
+    // Byte offsets of the geometry's triangle uvs and its mask in the alpha test buffer
+    uint32_t uv_offset = 0;
+    uint32_t mask_offset = 0;
+    // The mask width and height in the low and high 16 bits
+    uint32_t mask_dims = 0;
+    float cutoff = 0.f;
+};
+
+// The data of an atlas draw, one for each geometry of each mesh, matches AtlasDraw in
+// atlas_draw.hlsl
+struct AtlasDraw {
+    // The position dequantization of the geometry
+    glm::vec3 position_scale;
+    // The BakeInstance of the first instance of the mesh being drawn
+    uint32_t first_instance = 0;
+    glm::vec3 position_offset;
+    // The index of the geometry pool's positions in BakeScene::geometry_heap, followed by
+    // its normals and UVs
+    uint32_t geometry_buffers = 0;
+    // The atlas UV bounds of the geometry over all the instances drawn, as lower xy and
+    // upper zw
+    glm::vec4 uv_bounds;
+    // The size of a position in bytes, telling the vertex shader the position format
+    uint32_t position_stride = 0;
+    uint32_t pad[3] = {0};
+};
+
+/* The indirect arguments of an atlas draw, in the order of the AtlasRasterPipeline command
+ * signature's arguments. Matches AtlasDrawArgs in atlas_draw.hlsl
+ */
+struct AtlasDrawArgs {
+    std::array<D3D12_VERTEX_BUFFER_VIEW, 3> vertex_buffers;
+    D3D12_INDEX_BUFFER_VIEW index_buffer;
+    uint32_t draw_id;
+    D3D12_DRAW_INDEXED_ARGUMENTS draw;
+};
+
+// The instances of a mesh are contiguous in the instance buffer, so they're drawn together
+struct MeshInstances {
+    size_t mesh_id = 0;
+    uint32_t first_instance = 0;
+    uint32_t num_instances = 0;
+};
+
+// The scene acceleration structures and atlas info needed to run the AO bake
+struct BakeScene {
+    std::vector<dxr::BottomLevelBVH> meshes;
+    dxr::TopLevelBVH scene_bvh;
+    // BakeInstance for each scene instance, sorted by mesh, and the instances of each mesh
+    dxr::Buffer bake_instances;
+    std::vector<MeshInstances> mesh_instances;
+    // The AtlasDraws and AtlasDrawArgs drawing each geometry of each mesh's instances. The
+    // float position draws come first, followed by the quantized position draws
+    dxr::Buffer atlas_draws;
+    dxr::Buffer atlas_draw_args;
+    uint32_t num_atlas_draws = 0;
+    uint32_t num_float_draws = 0;
+    // The draws kept by cull_atlas_draws and the number kept for each position format, and
+    // the zeros the count is reset from
+    dxr::Buffer culled_draw_args;
+    dxr::Buffer culled_draw_count;
+    dxr::Buffer draw_count_reset;
+    // Raw SRVs of the positions, normals and UVs of each geometry pool the atlas draws read,
+    // which the bake's vertex shader fetches its vertices from
+    dxr::DescriptorHeap geometry_heap;
+    // Index of each scene instance's BakeInstance in bake_instances
+    std::vector<uint32_t> bake_instance_index;
+    // The object space bounds of each mesh and the atlas region of each scene instance,
+    // kept to update the instances when they're moved
+    std::vector<std::array<glm::vec3, 2>> mesh_bounds;
+    std::vector<InstanceAtlasRegion> instance_regions;
+    // A hash of each mesh's unwrapped geometry, telling which meshes changed when the scene
+    // is unwrapped again
+    std::vector<uint64_t> mesh_hashes;
+    // The bounds of each geometry's atlas uvs before the instances' regions are applied,
+    // kept so the CPU geometry can be released once it's uploaded
+    std::vector<std::vector<std::array<glm::vec2, 2>>> geometry_uv_bounds;
+    // The alpha test data of the alpha tested geometry, see upload_alpha_test, and the index
+    // of each mesh's first AlphaTestGeometry, or -1 if the mesh is opaque
+    dxr::Buffer alpha_test;
+    std::vector<uint32_t> mesh_alpha_test_offset;
+    // The BLASes of the meshes' simplified occluder proxies, the index of each mesh's proxy
+    // or -1 if it has none, and the index of each scene instance's proxy instance desc in
+    // the TLAS instance buffer or -1. The proxy descs follow those of the scene instances
+    std::vector<dxr::BottomLevelBVH> proxies;
+    std::vector<uint32_t> mesh_proxy;
+    std::vector<uint32_t> instance_proxy_desc;
+    // The distance the AO rays trace the full-res meshes before switching to the proxies,
+    // 0 if there are no proxies or near field only occluders
+    float near_field_radius = 0.f;
+    // The OccluderMask of the fields each scene instance occludes by its occluder class,
+    // empty if every class occludes both fields
+    std::vector<uint32_t> instance_occluder_mask;
+    // The scene's QuadLights sampled by the direct lighting bake
+    dxr::Buffer lights;
+    uint32_t num_lights = 0;
+    // The BvhProfile the BVHs were built with
+    uint32_t bvh_profile = BVH_PROFILE_FAST_TRACE;
+    // The directory and atlas cache key the BLASes are cached under, caching is disabled
+    // if the directory is empty
+    std::string cache_dir;
+    uint64_t atlas_cache_key = 0;
+    glm::uvec2 atlas_size;
+    // World space bounds of the scene geometry
+    glm::vec3 world_lower = glm::vec3(0.f);
+    glm::vec3 world_upper = glm::vec3(0.f);
+    std::string scene_info;
+    // The wall time in ms of loading the scene file or scene cache, unwrapping it, which
+    // includes streaming the meshes to the GPU, and uploading the rest of the scene
+    double load_ms = 0.0;
+    double unwrap_ms = 0.0;
+    double upload_ms = 0.0;
+    // Set if the user cancelled the atlas generation, the scene is empty
+    bool cancelled = false;
+};
+
+// The unwrapped scene a bake scene was uploaded from, kept to upload it to more devices
+struct BakeSceneSource {
+    Scene scene;
+    std::vector<AlphaTestedGeometry> alpha_geometries;
+    MeshProxies occluder_proxies;
+};
+
+/* Uploads the meshes and builds their BLASes on a worker thread as the unwrap hands them
+ * over, overlapping the uploads and builds with the remap of the following meshes. The
+ * meshes are gathered into batches of about the upload ring's size, and the geometry of
+ * each batch is released once its BLAS builds are done. The unwrap waits if
+ * max_stream_batches batches are already queued, bounding the CPU geometry held at once
+ */
+struct MeshStream {
+    ID3D12Device5 *device = nullptr;
+    dxr::CommandContext *cmd_ctx = nullptr;
+    dxr::GpuProfiler *profiler = nullptr;
+    std::unique_ptr<dxr::CommandContext> copy_ctx;
+    std::unique_ptr<dxr::UploadRing> upload_ring;
+    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags =
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE;
+    // The BLAS cache, chosen once the atlas cache key is known. If the cache file exists
+    // the batches are only uploaded and the BLASes are loaded once all are in
+    std::string cache_dir;
+    std::string cache_file;
+    uint64_t cache_key = 0;
+    bool load_cache = false;
+
+    // The batch being gathered by the unwrap and an upper bound on its upload size
+    std::vector<Mesh> batch;
+    size_t batch_bytes = 0;
+
+    // The batches waiting on the worker, guarded by the mutex
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::vector<Mesh>> pending;
+    bool done = false;
+    std::exception_ptr error;
+    std::thread worker;
+
+    // The BLASes of the meshes streamed so far and their geometry's uv bounds
+    std::vector<dxr::BottomLevelBVH> bvhs;
+    std::vector<std::vector<std::array<glm::vec2, 2>>> uv_bounds;
+    dxr::MeshBuildStats stats;
+
+    ~MeshStream();
+};
+
+// Header of the BVH cache files, followed by the size and serialized data of each BLAS
+struct BvhCacheHeader {
+    uint32_t magic = bvh_cache_magic;
+    uint32_t version = bvh_cache_version;
+    uint64_t key = 0;
+    uint64_t num_bvhs = 0;
+};
+
+// The build flags for the BLASes and TLAS
+struct BvhBuildFlags {
+    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS blas;
+    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS tlas;
+};
+
+// The render target the AO map is written to and the buffer accumulating the
+// AO samples taken for each texel across frames
+struct BakeTarget {
+    dxr::Texture2D ao_image;
+    // float2 per texel storing the unoccluded sample count and total sample count
+    dxr::Buffer accum_buf;
+    // The blue noise tile used by SAMPLER_BLUE_NOISE
+    dxr::Buffer blue_noise;
+    // float4 per texel storing the sum of the unoccluded directions and hit distances, only
+    // allocated if extra maps are baked
+    dxr::Buffer extras_buf;
+    // float4 per texel storing the sum of the direct lighting irradiance estimates, only
+    // allocated if the direct lighting is baked
+    dxr::Buffer light_buf;
+    // The RayStatsCounters accumulated by the bake shaders
+    dxr::Buffer ray_stats;
+    ComPtr<ID3D12DescriptorHeap> rtv_heap;
+    D3D12_CPU_DESCRIPTOR_HANDLE rtv_handle;
+    D3D12_CLEAR_VALUE clear_value;
+};
+
+/* The pipeline states rasterizing the atlas with a pixel shader, for geometry with float
+ * and 16-bit SNORM quantized positions, and the command signature of the atlas draws
+ */
+struct AtlasRasterPipeline {
+    ComPtr<ID3D12PipelineState> float_positions;
+    ComPtr<ID3D12PipelineState> quantized_positions;
+    ComPtr<ID3D12CommandSignature> command_signature;
+    // Set if the vertex shader fetches the vertices from the geometry heap, the command
+    // signature then skips the vertex buffer views at the start of each AtlasDrawArgs
+    bool bindless = false;
+};
+
+/* The root signature and pipeline states used to rasterize the atlas and bake the AO, and
+ * the compute pipeline culling the atlas draws to the tile being baked. The raster
+ * pipeline reads all bake settings at runtime, the pipelines of the specialized bake
+ * permutations are created on first use
+ */
+struct BakePipeline {
+    dxr::RootSignature root_signature;
+    AtlasRasterPipeline raster;
+    // The vertex shader indexes ResourceDescriptorHeap with the geometry heap bound if the
+    // device supports it, otherwise it reads the heap through a descriptor table
+    bool direct_heap_indexing = false;
+    D3D12_SHADER_BYTECODE vertex_shader = {0};
+
+    ComPtr<ID3D12Device5> device;
+    DXGI_FORMAT ao_format = DXGI_FORMAT_UNKNOWN;
+    // The pipelines of each render_ao_map_fs permutation, indexed by bake_permutation
+    std::vector<AtlasRasterPipeline> permutations;
+
+    dxr::RootSignature cull_signature;
+    ComPtr<ID3D12PipelineState> cull_pipeline_state;
+};
+
+// The bake target's ray counters, matches the RAY_STATS_* offsets in trace_ao.hlsl
+struct RayStatsCounters {
+    uint64_t rays;
+    uint64_t hits;
+    uint32_t active_texels;
+    uint32_t pad[3];
+};
+
+// The rays traced by a bake frame, and the frame's GPU time
+struct RayStats {
+    uint64_t rays = 0;
+    uint64_t hits = 0;
+    uint32_t active_texels = 0;
+    double gpu_ms = 0.0;
+};
+
+// The build and bake performance of a BVH profile, measured by the BVH benchmark
+struct BvhBenchmarkResult {
+    uint32_t profile = BVH_PROFILE_AUTO;
+    dxr::MeshBuildStats blas_stats;
+    double tlas_ms = 0.0;
+    RayStats bake_stats;
+};
+
+// The time of each phase of a scene's bake and the memory it used, measured by the bake
+// benchmark. The times are in ms, the GPU times are those of the profiler regions
+struct BakeBenchmarkResult {
+    std::string scene;
+    glm::uvec2 atlas_size = glm::uvec2(0);
+    double load_ms = 0.0;
+    double unwrap_ms = 0.0;
+    double upload_ms = 0.0;
+    double bvh_build_ms = 0.0;
+    dxr::MeshBuildStats blas_stats;
+    double tlas_ms = 0.0;
+    double bake_ms = 0.0;
+    RayStats bake_stats;
+    // The total GPU time of each profiler region recorded for the scene
+    std::vector<std::pair<std::string, double>> gpu_regions;
+    // The most video memory used at the end of a phase, and the process' peak working set
+    uint64_t peak_vram_bytes = 0;
+    uint64_t peak_rss_bytes = 0;
+};
+
+// The timestamp queries and readback buffers used to collect the RayStats of a bake frame
+struct RayStatsQuery {
+    ComPtr<ID3D12QueryHeap> timestamp_heap;
+    // Zeroed counters copied over the bake target's to reset them
+    dxr::Buffer zero_counters;
+    dxr::Buffer counters_readback;
+    dxr::Buffer timestamps_readback;
+    uint64_t timestamp_frequency = 0;
+};
+
+// A covered texel in the texel G-buffer, matches TexelData in texel_bake.hlsl
+struct TexelData {
+    glm::vec3 position;
+    // The texel x coordinate in the low 16 bits, y in the high 16 bits
+    uint32_t texel;
+    glm::vec3 normal;
+    // Approximate world space size of the texel
+    float texel_size;
+    // Approximate change in the normal across the texel, in radians
+    float curvature;
+};
+
+// The GBufferInfo constants passed to the texel G-buffer pass
+struct GBufferParams {
+    glm::uvec2 dimensions;
+    uint32_t write_texels;
+    uint32_t max_texels;
+};
+
+// The AtlasInfo constants passed to the compute bake shader
+struct ComputeBakeParams {
+    AtlasParams atlas;
+    uint32_t texel_offset;
+    uint32_t num_texels;
+    // Take the number of samples in the texel G-buffer's sample budget instead of n_samples
+    uint32_t use_sample_budget;
+
+    ComputeBakeParams(const AtlasParams &atlas)
+        : atlas(atlas), texel_offset(0), num_texels(0), use_sample_budget(0)
+    {
+        // The direct lighting is only baked by the raster bake
+        this->atlas.bake_outputs &= BAKE_OUTPUT_AO_EXTRAS;
+    }
+};
+
+// The compact list of texels covered by the atlas, with the world space position and normal
+// of each. It only depends on the scene and atlas, so it's built once and reused each frame
+struct TexelGBuffer {
+    dxr::Buffer texels;
+    // One bit per atlas texel, set if the texel is covered by a chart
+    dxr::Buffer coverage;
+    // The number of samples each texel takes, only set when baking with a ray budget
+    dxr::Buffer sample_budget;
+    uint32_t num_texels = 0;
+    float build_ms = 0.f;
+};
+
+/* The pipelines for the compute bake path: the atlas raster pass that builds the texel
+ * G-buffer and the compute shader that bakes the AO for the texels in it
+ */
+struct ComputeBakePipeline {
+    dxr::RootSignature gbuffer_signature;
+    AtlasRasterPipeline gbuffer_raster;
+
+    dxr::RootSignature bake_signature;
+    ComPtr<ID3D12PipelineState> bake_pipeline_state;
+    // Holds the UAV of the bake target's AO image
+    dxr::DescriptorHeap output_heap;
+};
+
+// The AtlasInfo constants passed to the wavefront bake shaders
+struct WavefrontParams {
+    ComputeBakeParams bake;
+    glm::vec3 scene_lower;
+    uint32_t pad1 = 0;
+    glm::vec3 scene_inv_extent;
+    uint32_t pad2 = 0;
+
+    WavefrontParams(const AtlasParams &atlas) : bake(atlas) {}
+};
+
+/* The pipelines and ray buffers for the wavefront bake. Each chunk of the texel list
+ * generates its AO rays, bins them by direction and origin, traces them in the binned order
+ * and resolves the occlusion back into the texels
+ */
+struct WavefrontPipeline {
+    dxr::RootSignature signature;
+    ComPtr<ID3D12PipelineState> raygen, scan, scatter, trace, resolve;
+
+    dxr::Buffer rays, binned_rays, bin_counts, bin_offsets, texel_occlusion;
+};
+
+// The AtlasInfo constants passed to the adaptive bake shaders
+struct AdaptiveParams {
+    ComputeBakeParams bake;
+    float error_threshold;
+    int min_samples;
+    uint32_t show_heatmap;
+    uint32_t use_active_list;
+
+    AdaptiveParams(const AtlasParams &atlas, const AdaptiveSettings &settings)
+        : bake(atlas),
+          error_threshold(settings.error_threshold),
+          min_samples(settings.min_samples),
+          show_heatmap(settings.show_heatmap ? 1 : 0),
+          use_active_list(0)
+    {
+    }
+};
+
+/* The pipelines and active texel lists for the adaptive bake. Each round traces the texels
+ * in the current list and appends those that haven't converged to the other, which becomes
+ * the current list for the next round
+ */
+struct AdaptiveBake {
+    dxr::RootSignature signature;
+    ComPtr<ID3D12PipelineState> bake_pipeline_state;
+    ComPtr<ID3D12PipelineState> display_pipeline_state;
+
+    std::array<dxr::Buffer, 2> active_texels;
+    dxr::Buffer active_count, zero_count, count_readback;
+    uint32_t current_list = 0;
+    uint32_t num_active = 0;
+    // AO rays traced since the accumulation was reset, counting samples_per_frame for each
+    // active texel in each round
+    uint64_t rays_traced = 0;
+};
+
+// The DilateInfo constants passed to the dilation shaders
+struct DilateParams {
+    glm::uvec2 dimensions;
+    glm::ivec2 region_origin;
+    glm::uvec2 region_size;
+    glm::uvec2 tile_lower;
+    glm::uvec2 tile_upper;
+    uint32_t step = 0;
+    uint32_t gutter = 0;
+    uint32_t flip = 0;
+    uint32_t pad = 0;
+};
+
+// The BlockCompressInfo constants passed to the block compression shaders
+struct BlockCompressParams {
+    glm::uvec2 dimensions;
+    glm::uvec2 num_blocks;
+};
+
+// The BC4 and BC5 encoders, reading the source image through the SRV in source_heap
+struct BlockCompressPipeline {
+    dxr::RootSignature signature;
+    ComPtr<ID3D12PipelineState> bc4, bc5;
+    dxr::DescriptorHeap source_heap;
+};
+
+// The jump flood passes and seed buffers used to fill the gutter around the charts
+struct DilatePipeline {
+    dxr::RootSignature signature;
+    ComPtr<ID3D12PipelineState> init, jump, resolve;
+    // The nearest covered texel found for each texel of the tile's region so far
+    dxr::Buffer seeds_a, seeds_b;
+};
+
+// The DenoiseInfo constants passed to the denoiser shaders
+struct DenoiseParams {
+    glm::uvec2 dimensions;
+    uint32_t texel_offset = 0;
+    uint32_t num_texels = 0;
+    uint32_t step = 1;
+    uint32_t flip = 0;
+    uint32_t from_accum = 0;
+    uint32_t write_output = 0;
+    float sigma_ao = 0.f;
+    float sigma_normal = 0.f;
+    float sigma_position = 0.f;
+    uint32_t pad = 0;
+};
+
+/* The a-trous filter passes and their buffers, sized for the texel G-buffer. Neighboring
+ * texels are found through the index map, which is built on first use after resizing
+ */
+struct DenoisePipeline {
+    dxr::RootSignature signature;
+    ComPtr<ID3D12PipelineState> index, atrous;
+    dxr::Buffer texel_index_map;
+    // The ping-pong buffers of the filtered AO for each texel in the texel list
+    dxr::Buffer values_a, values_b;
+    // The denoised AO laid out like the accumulation buffer, to be read by the dilation
+    dxr::Buffer denoised_accum;
+    bool index_built = false;
+};
+
+// The BudgetInfo constants passed to the sample budget passes
+struct SampleBudgetParams {
+    uint32_t texel_offset = 0;
+    uint32_t num_texels = 0;
+    float inv_scene_size = 1.f;
+    float curvature_weight = 0.f;
+    float ray_budget = 0.f;
+    uint32_t min_samples = 1;
+    uint32_t max_samples = 1;
+    uint32_t pad = 0;
+};
+
+// The totals written by the sample budget passes, matches the BUDGET_* offsets in
+// sample_budget.hlsl
+struct SampleBudgetTotals {
+    uint64_t importance_sum;
+    uint64_t total_samples;
+    uint32_t max_samples;
+    uint32_t pad[3];
+};
+
+// The passes distributing a ray budget over the texels of the texel G-buffer
+struct SampleBudgetPipeline {
+    dxr::RootSignature signature;
+    ComPtr<ID3D12PipelineState> importance, assign;
+    dxr::Buffer totals, totals_readback;
+    // The samples assigned by the last budget computed, in total and to the busiest texel
+    uint64_t total_samples = 0;
+    uint32_t max_samples = 0;
+};
+
+// The RebakeInfo constants passed to the rebake pass
+struct RebakeParams {
+    uint32_t texel_offset = 0;
+    uint32_t num_texels = 0;
+    uint32_t num_bounds = 0;
+    uint32_t atlas_width = 0;
+    uint32_t tile_size = 0;
+    uint32_t tiles_x = 0;
+    uint32_t has_extras = 0;
+    uint32_t has_light = 0;
+};
+
+// A vertex's world space position and normal, matches VertexSample in vertex_ao.hlsl
+struct VertexSample {
+    glm::vec3 position;
+    glm::vec3 normal;
+};
+
+// The VertexAOInfo constants passed to the vertex AO pass
+struct VertexAOParams {
+    uint32_t num_vertices = 0;
+    uint32_t first_vertex = 0;
+    int n_samples = 0;
+    int samples_per_frame = 0;
+    float ao_length = 0.f;
+    float ray_offset = 0.f;
+    uint32_t frame_id = 0;
+    uint32_t sampler_type = 0;
+    uint32_t sampler_seed = 0;
+};
+
+// The pass tracing the AO rays of the vertices in the vertex AO bake
+struct VertexAOPipeline {
+    dxr::RootSignature signature;
+    ComPtr<ID3D12PipelineState> pipeline;
+};
+
+// The pass marking the texels to re-bake after instances in the scene are moved
+struct RebakePipeline {
+    dxr::RootSignature signature;
+    ComPtr<ID3D12PipelineState> mark;
+    // The number of texels marked by the last call to mark_rebake_texels
+    uint32_t dirty_texels = 0;
+};
+
+// The PreviewInfo constants passed to the preview upsampling shader
+struct PreviewParams {
+    glm::uvec2 dimensions;
+    glm::uvec2 preview_dimensions;
+    uint32_t blend_samples = 0;
+};
+
+/* The viewer's preview levels, baked at 1/scale, 1/(scale/2) ... 1/2 of the atlas
+ * resolution before the full atlas, and the pass upsampling a level into the AO image
+ */
+struct PreviewBake {
+    dxr::RootSignature signature;
+    ComPtr<ID3D12PipelineState> upsample;
+
+    // The bake targets and coverage of each level, coarsest first
+    std::vector<BakeTarget> levels;
+    std::vector<TexelGBuffer> level_gbuffers;
+    // The samples per texel of the coarsest level, doubling with each level
+    int base_samples = 1;
+    // The level being baked, levels.size() once the full atlas is being baked
+    size_t level = 0;
+    uint32_t frame_id = 0;
+    int accumulated_samples = 0;
+    // The samples of the finest level, which is blended into the full atlas until it has
+    // taken as many. 0 while the levels are baked or once the blend is done
+    int handoff_samples = 0;
+};
+
+// The pass rasterizing the meshes' lightmap uvs to find overlaps, see lightmap_uv_check.hlsl
+struct LightmapUvCheckPipeline {
+    dxr::RootSignature signature;
+    ComPtr<ID3D12PipelineState> pipeline_state;
+};
+
+/* The pipelines of the headless bake that don't depend on the scene, created on first use
+ * by bake_headless_scene and kept by the batch bake and bake server across their scenes so
+ * each scene doesn't recreate them. The bake pipelines are kept for each AO format
+ */
+struct HeadlessPipelines {
+    std::map<DXGI_FORMAT, BakePipeline> bake;
+    BlockCompressPipeline block_compress;
+    // Only created for the bakes using the compute passes
+    ComputeBakePipeline compute;
+    DilatePipeline dilate;
+};
+
+// The BakeOutput maps to bake for the output files set in the options
+uint32_t requested_bake_outputs(const AppOptions &options);
+
+/* The approximate bytes of bake buffers each atlas texel takes with the options: the AO
+ * image, the accumulation and extras buffers and, for the compute bakes, the texel
+ * G-buffer and sample budget. Only counts the GPU memory that scales with the atlas size
+ */
+size_t bake_bytes_per_texel(const AppOptions &options);
+
+// The smallest of the atlas budgets set in the options in texels, 0 if none are set
+uint64_t resolve_texel_budget(const AppOptions &options);
+
+/* Summarize the predicted cost of baking the atlas: the texels, samples and rays traced
+ * and the bake buffer memory. All the atlas texels are counted, the charts only cover part
+ * of them so the actual cost is lower
+ */
+std::string bake_cost_summary(const glm::uvec2 &atlas_size,
+                              int n_samples,
+                              size_t bytes_per_texel);
+
+void run_app(const AppOptions &options, SDL_Window *window, DXDisplay *display);
+
+void run_headless_bake(const AppOptions &options);
+
+/* Bake the AO of each vertex of the scene's meshes without unwrapping it, tracing the AO
+ * rays about the vertex normals with the compute pass in vertex_ao.hlsl, and write the
+ * scene to the glTF output with the AO as the vertices' COLOR_0. The vertices are baked in
+ * world space for each instance, and the AO of meshes with several instances is the mean
+ * over the instances, as they share the vertex colors
+ */
+void run_vertex_ao_bake(const AppOptions &options);
+
+#ifdef DXR_AO_EMBREE
+/* The headless bake on the CPU with the Embree backend, for machines without a DXR 1.1 GPU.
+ * It bakes the default opaque AO of the scene with the bake's sampler and tiles, the alpha
+ * test, occluder proxies, gutter dilation, denoise and extra outputs need the GPU
+ */
+void run_cpu_headless_bake(const AppOptions &options);
+#endif
+
+/* Bake the loaded scene's AO map and extra maps and write them to the outputs set in the
+ * options, returning the rays traced. The AO map is encoded and written on the readback's
+ * worker, which may still be writing it when this returns. The pipelines are created in
+ * the headless pipelines on first use. The scene source is only used by the multi-GPU
+ * bake, the heap allocator's stats are printed if it's set
+ */
+RayStats bake_headless_scene(ID3D12Device5 *device,
+                             dxr::CommandContext &cmd_ctx,
+                             dxr::GpuProfiler &profiler,
+                             const AppOptions &options,
+                             BakeScene &bake_scene,
+                             BakeSceneSource &scene_source,
+                             dxr::HeapAllocator *heap_allocator,
+                             dxr::PipelineCache *pipeline_cache,
+                             dxr::AsyncReadback &readback,
+                             HeadlessPipelines &pipelines);
+
+/* Load the scene, decoding the textures and optimizing the geometry as selected by the
+ * load options, unwrap it with xatlas and build the acceleration structures with the
+ * BvhProfile's build flags, timing the GPU work with the profiler. The window is optional
+ * and is only used to show the progress in the title bar
+ */
+BakeScene load_bake_scene(const std::string &scene_file,
+                          const SceneLoadOptions &load_options,
+                          const AtlasOptions &atlas_options,
+                          uint32_t bvh_profile,
+                          ID3D12Device5 *device,
+                          dxr::CommandContext &cmd_ctx,
+                          SDL_Window *window,
+                          dxr::GpuProfiler &profiler,
+                          BakeSceneSource *source);
+
+/* Map the unwrapped scene from the scene cache file and upload it to the bake scene, whose
+ * BVH profile and cache directory are set by the caller. Returns false if the file isn't a
+ * complete cache for the key
+ */
+bool load_cached_bake_scene(const std::string &scene_cache,
+                            uint64_t key,
+                            const SceneLoadOptions &load_options,
+                            ID3D12Device5 *device,
+                            dxr::CommandContext &cmd_ctx,
+                            dxr::GpuProfiler &profiler,
+                            BakeSceneSource *source,
+                            BakeScene &bake_scene);
+
+// Find the object space bounds of each mesh and the world space bounds of the scene
+void compute_scene_bounds(const Scene &scene, BakeScene &bake_scene);
+
+LightmapUvCheckPipeline create_lightmap_uv_check_pipeline(ID3D12Device5 *device);
+
+/* Check the lightmap uvs of each mesh loaded with them, which are kept if every geometry has
+ * one per vertex within [0, 1] and no texel of the lightmap_uv_check_resolution grid is
+ * covered by more than one of the mesh's triangles. The overlaps are found on the GPU by
+ * rasterizing the uvs. The meshes failing the check drop their lightmap uvs, so only those
+ * are charted by xatlas. Returns the number of meshes keeping their lightmap uvs
+ */
+size_t validate_lightmap_uvs(ID3D12Device5 *device,
+                             dxr::CommandContext &cmd_ctx,
+                             Scene &scene,
+                             dxr::GpuProfiler &profiler);
+
+// Hash the positions, normals, uvs and indices of the mesh's geometries
+uint64_t hash_mesh_geometry(const Mesh &mesh);
+
+/* Find the instances that changed between the bake scenes, appending their bounds in both
+ * scenes expanded by ao_length to dirty_bounds. An instance changed if its mesh's geometry,
+ * its transform or its atlas region did. Returns false if the scenes don't share the same
+ * atlas size, meshes and instances, so the previous bake doesn't carry over at all
+ */
+bool find_changed_instances(const BakeScene &prev,
+                            const BakeScene &next,
+                            float ao_length,
+                            std::vector<std::array<glm::vec3, 2>> &dirty_bounds);
+
+/* Upload the unwrapped scene to the device, building or loading the BLASes, the atlas
+ * draws and the TLAS. The bake scene's BVH profile, cache key and instance regions must
+ * already be set. If the BLASes and geometry uv bounds were already streamed in by a
+ * MeshStream they're kept, and the scene's geometry isn't read. The occluder proxies'
+ * BLASes are built and instanced in the TLAS along with the scene's
+ */
+void upload_bake_scene(ID3D12Device5 *device,
+                       dxr::CommandContext &cmd_ctx,
+                       const Scene &scene,
+                       const std::vector<AlphaTestedGeometry> &alpha_geometries,
+                       const MeshProxies &occluder_proxies,
+                       BakeScene &bake_scene,
+                       dxr::GpuProfiler &profiler);
+
+/* Set up the stream to build the BLASes with the BvhProfile's build flags, caching them in
+ * the cache directory if it's not empty. The worker starts with the first mesh
+ */
+void init_mesh_stream(MeshStream &stream,
+                      ID3D12Device5 *device,
+                      dxr::CommandContext &cmd_ctx,
+                      dxr::GpuProfiler &profiler,
+                      uint32_t bvh_profile,
+                      const std::string &cache_dir);
+
+/* Hand an unwrapped mesh to the stream, called from the unwrap's AtlasMeshFn. The mesh's
+ * geometries are left empty. Rethrows any error hit by the worker
+ */
+void stream_mesh(MeshStream &stream, const AtlasResult &atlas, Mesh &mesh);
+
+// Upload and build the queued batches on the stream's command contexts
+void mesh_stream_worker(MeshStream &stream);
+
+/* Flush the last batch and wait for the worker, then load the BLASes from the cache or
+ * build them if they were only uploaded. The BLASes and uv bounds are moved into the bake
+ * scene and the stream's upload ring and copy context are released
+ */
+void finish_mesh_stream(MeshStream &stream, BakeScene &bake_scene);
+
+// The bounds of the uvs of each of the mesh's geometries, empty geometries have empty bounds
+std::vector<std::array<glm::vec2, 2>> geometry_uv_bounds(const Mesh &mesh);
+
+/* The BLAS cache file in the cache directory for the atlas cache key and build flags, and
+ * the key the BLASes are cached under
+ */
+std::string blas_cache_file(const std::string &cache_dir,
+                            uint64_t atlas_cache_key,
+                            D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags,
+                            uint64_t &key);
+
+// The BvhProfile to build with, picking the auto profile by the samples per texel baked
+uint32_t resolve_bvh_profile(uint32_t profile, int n_samples);
+
+BvhBuildFlags bvh_build_flags(uint32_t profile);
+
+void print_blas_build_stats(const dxr::MeshBuildStats &stats);
+
+void print_mesh_optimize_stats(const char *stage, const MeshOptimizeStats &stats);
+
+/* Build the BLASes, or deserialize them from the BVH cache file next to the atlas cache if
+ * it's enabled. The cache is keyed by the atlas cache key and the BLAS build flags, newly
+ * built BLASes are serialized and written to it. Returns true if the BLASes were loaded
+ * from the cache, in which case the build stats are left zero. If scene_meshes is passed
+ * the BLASes are created from their geometry, which is uploaded up front when there's a
+ * cache file to try, or on the copy context's queue overlapped with the builds otherwise
+ */
+bool build_or_load_blases(ID3D12Device5 *device,
+                          dxr::CommandContext &cmd_ctx,
+                          dxr::CommandContext *copy_ctx,
+                          dxr::UploadRing &upload_ring,
+                          const BakeScene &bake_scene,
+                          const std::vector<Mesh> *scene_meshes,
+                          std::vector<dxr::BottomLevelBVH> &bvhs,
+                          D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags,
+                          dxr::MeshBuildStats &stats,
+                          dxr::GpuProfiler &profiler);
+
+/* Deserialize the BLASes from the cache file. Returns false if the file doesn't exist or
+ * doesn't match the key and BLASes, or if it was written by a driver incompatible with the
+ * device, e.g. before a driver update
+ */
+bool load_cached_blases(ID3D12Device5 *device,
+                        dxr::CommandContext &cmd_ctx,
+                        dxr::UploadRing &upload_ring,
+                        const std::string &fname,
+                        uint64_t key,
+                        std::vector<dxr::BottomLevelBVH> &bvhs);
+
+// Serialize the BLASes and write them to the cache file
+void write_cached_blases(ID3D12Device5 *device,
+                         dxr::CommandContext &cmd_ctx,
+                         const std::string &fname,
+                         uint64_t key,
+                         std::vector<dxr::BottomLevelBVH> &bvhs);
+
+/* Write the instance descs referencing the scene's BLASes in parallel, followed by the
+ * descs of the instances' occluder proxies, and build the TLAS over them, returning the
+ * time taken in ms
+ */
+double build_scene_tlas(ID3D12Device5 *device,
+                        dxr::CommandContext &cmd_ctx,
+                        dxr::UploadRing &upload_ring,
+                        BakeScene &bake_scene,
+                        std::vector<dxr::TlasInstance> instances,
+                        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags,
+                        dxr::GpuProfiler &profiler);
+
+/* Rebuild the scene's BLASes, occluder proxy BLASes and TLAS with the BvhProfile's build
+ * flags, reusing the geometry already on the GPU. If use_cache is set the scene's BLASes
+ * are loaded from the BVH cache when possible. The BLAS build stats are written to stats,
+ * and the TLAS build time in ms is returned
+ */
+double rebuild_scene_bvhs(ID3D12Device5 *device,
+                          dxr::CommandContext &cmd_ctx,
+                          BakeScene &bake_scene,
+                          uint32_t bvh_profile,
+                          bool use_cache,
+                          dxr::MeshBuildStats &stats,
+                          dxr::GpuProfiler &profiler);
+
+/* World space bounds of the instance's mesh transformed by the instance, the lower corner
+ * is above the upper if the mesh is empty
+ */
+std::array<glm::vec3, 2> instance_world_bounds(const BakeScene &bake_scene,
+                                               const dxr::TlasInstance &instance);
+
+/* Move the scene instance to the transform. Its instance desc, the desc of its occluder
+ * proxy if it has one, and its BakeInstance are re-uploaded in place and the TLAS is refit
+ * to the new transform instead of rebuilt. The bounds of the instance before and after the
+ * move are expanded by ao_length and appended to dirty_bounds, as the occlusion of the
+ * texels within them may have changed
+ */
+void update_instance_transform(ID3D12Device5 *device,
+                               dxr::CommandContext &cmd_ctx,
+                               BakeScene &bake_scene,
+                               size_t instance,
+                               const glm::mat4 &transform,
+                               float ao_length,
+                               std::vector<std::array<glm::vec3, 2>> &dirty_bounds,
+                               dxr::GpuProfiler &profiler);
+
+// Write the BVH benchmark results along with the adapter they were measured on to a JSON file
+void write_bvh_benchmark(const std::string &fname,
+                         const DXGI_ADAPTER_DESC1 &adapter,
+                         const std::vector<BvhBenchmarkResult> &results);
+
+/* Run the bake benchmark with the dxr_ao_bake_bench arguments, see bake_bench.cpp. Each scene
+ * is baked with the same fixed settings on a fresh profiler, without the caches, and the
+ * results are written to a JSON file. Returns false if a scene failed
+ */
+bool run_bake_benchmark(const std::vector<std::string> &args);
+
+// Write a heightfield grid of 2 * grid^2 triangles with interleaved ridges to an OBJ file
+void write_stress_mesh(const std::string &fname, uint32_t grid);
+
+// The peak working set of the process in bytes, 0 if it can't be queried
+uint64_t peak_process_memory();
+
+// The current working set of the process in bytes, 0 if it can't be queried
+uint64_t process_memory();
+
+// Write the bake benchmark results along with the adapter they were measured on to a file
+void write_bake_benchmark(const std::string &fname,
+                          ID3D12Device *device,
+                          int n_samples,
+                          const std::vector<BakeBenchmarkResult> &results);
+
+/* Resolve the profiler regions recorded since the last call in a small submission and
+ * read back the timings of those the GPU has finished
+ */
+void resolve_gpu_profile(dxr::CommandContext &cmd_ctx, dxr::GpuProfiler &profiler);
+
+/* Resolve the GPU profiler's regions without waiting on the submission, they're read back
+ * by a later call once the fence has passed it
+ */
+void resolve_gpu_profile_async(dxr::CommandContext &cmd_ctx, dxr::GpuProfiler &profiler);
+
+// Summarize the memory used and lost to rounding and fragmentation by the heap allocator
+std::string heap_stats_summary(const dxr::HeapAllocatorStats &stats);
+
+// Summarize the current and peak memory of a memory tracker category
+std::string memory_category_summary(const dxr::MemoryCategoryStats &stats);
+
+/* Print the tracked GPU and host resource memory by category, the video memory budget and
+ * usage of the device's adapter, and the process' working set
+ */
+void print_memory_stats(ID3D12Device *device);
+
+/* Open the pipeline cache file set in the options and make it the current pipeline cache,
+ * returns null if caching is disabled
+ */
+std::unique_ptr<dxr::PipelineCache> open_pipeline_cache(ID3D12Device5 *device,
+                                                        const AppOptions &options);
+
+// Write the pipelines compiled since the cache was opened back to its file, if any
+void save_pipeline_cache(dxr::PipelineCache *cache);
+
+// Write the rolling timings of each profiler region to a JSON file
+void write_gpu_profile(const std::string &fname, const dxr::GpuProfiler &profiler);
+
+/* Create the bake target with the AO image in ao_format, which must be usable as a render
+ * target and typed UAV. The extras and direct lighting buffers are only allocated if their
+ * bake_outputs are set
+ */
+BakeTarget create_bake_target(ID3D12Device5 *device,
+                              const glm::uvec2 &dims,
+                              uint32_t bake_outputs,
+                              DXGI_FORMAT ao_format);
+
+// Address of the bake target's extras buffer to bind, or null if it's not used
+D3D12_GPU_VIRTUAL_ADDRESS extras_address(BakeTarget &bake_target);
+
+// Address of the bake target's direct lighting buffer to bind, or null if it's not used
+D3D12_GPU_VIRTUAL_ADDRESS light_address(BakeTarget &bake_target);
+
+// Address of the bake scene's lights to bind, or null if it has none
+D3D12_GPU_VIRTUAL_ADDRESS lights_address(BakeScene &bake_scene);
+
+/* Pack the uvs and alpha masks of the scene's alpha tested geometry into the bake scene's
+ * alpha test buffer and upload it. Each mesh with alpha tested geometry gets an
+ * AlphaTestGeometry for each of its geometries, the instances of the mesh set their
+ * InstanceID to the first so the shaders can find the entry of a hit geometry. The masks
+ * are stored once for each texture and channel used, with one byte per texel
+ */
+void upload_alpha_test(ID3D12Device5 *device,
+                       dxr::CommandContext &cmd_ctx,
+                       dxr::UploadRing &upload_ring,
+                       BakeScene &bake_scene,
+                       const Scene &scene,
+                       const std::vector<AlphaTestedGeometry> &alpha_geometries);
+
+// Address of the bake scene's alpha test buffer to bind, or null if the scene is opaque
+D3D12_GPU_VIRTUAL_ADDRESS alpha_test_address(BakeScene &bake_scene);
+
+/* Create the pipelines rasterizing the scene geometry into the atlas with the pixel shader.
+ * If render_target_format is DXGI_FORMAT_UNKNOWN the pixel shader only writes through UAVs.
+ * The draw ID of the atlas draws is set at root parameter draw_param. If a bindless vertex
+ * shader is passed it replaces the input assembler, fetching the vertices from the scene's
+ * geometry heap
+ */
+AtlasRasterPipeline create_atlas_raster_pipeline(
+    ID3D12Device5 *device,
+    dxr::RootSignature &root_signature,
+    D3D12_SHADER_BYTECODE pixel_shader,
+    DXGI_FORMAT render_target_format,
+    uint32_t draw_param,
+    D3D12_SHADER_BYTECODE bindless_vertex_shader = D3D12_SHADER_BYTECODE{});
+
+// The pipeline renders to AO images in ao_format
+BakePipeline create_bake_pipeline(ID3D12Device5 *device, DXGI_FORMAT ao_format);
+
+/* Index of the render_ao_map_fs permutation specialized for the bake settings and scene, see
+ * CMakeLists.txt. A fixed sample batch is only picked if each frame takes one batch and
+ * n_samples is a multiple of it
+ */
+uint32_t bake_permutation(const AtlasParams &atlas_params, bool alpha_test);
+
+// Get the raster pipeline of the bake permutation, creating it if it's the first use
+const AtlasRasterPipeline &bake_raster_pipeline(BakePipeline &pipeline,
+                                                const AtlasParams &atlas_params,
+                                                bool alpha_test);
+
+/* Record the commands to bake a frame of the AO map for the tile of the bake target.
+ * This traces another atlas_params.samples_per_frame samples per texel in the tile and
+ * accumulates them, the command list is not submitted
+ */
+void record_bake(ID3D12GraphicsCommandList4 *cmd_list,
+                 BakePipeline &pipeline,
+                 BakeScene &bake_scene,
+                 BakeTarget &bake_target,
+                 const AtlasParams &atlas_params,
+                 const D3D12_RECT &tile);
+
+/* Bake a frame of the AO map over the whole atlas, tile by tile. Each tile is recorded and
+ * submitted separately, bounding the GPU time of each submission for large atlases. If
+ * tiles is not empty only the tiles with those origins are baked
+ */
+void bake_frame(dxr::CommandContext &cmd_ctx,
+                BakePipeline &pipeline,
+                BakeScene &bake_scene,
+                BakeTarget &bake_target,
+                const AtlasParams &atlas_params,
+                uint32_t tile_size,
+                const std::vector<glm::uvec2> &tiles,
+                dxr::GpuProfiler &profiler);
+
+RayStatsQuery create_ray_stats_query(ID3D12Device5 *device, dxr::CommandContext &cmd_ctx);
+
+/* Reset the bake target's ray counters and write the start timestamp of the bake frame.
+ * Call before recording any bake frame, bake_frame_compute, etc.
+ */
+void begin_ray_stats(dxr::CommandContext &cmd_ctx,
+                     RayStatsQuery &query,
+                     BakeTarget &bake_target);
+
+/* Write the end timestamp of the bake frame and read back the rays traced, hits and active
+ * texels counted since begin_ray_stats, along with the GPU time between the timestamps
+ */
+RayStats end_ray_stats(dxr::CommandContext &cmd_ctx,
+                       RayStatsQuery &query,
+                       BakeTarget &bake_target);
+
+ComPtr<ID3D12PipelineState> create_compute_pipeline(ID3D12Device5 *device,
+                                                   dxr::RootSignature &root_signature,
+                                                   const void *dxil,
+                                                   size_t dxil_size);
+
+ComputeBakePipeline create_compute_bake_pipeline(ID3D12Device5 *device);
+
+/* Create the DXR 1.0 pipeline baking the texel G-buffer with DispatchRays. It uses the
+ * compute bake's root signature as its global root signature, so it's bound the same way.
+ * The shader table is uploaded before returning
+ */
+dxr::RTPipeline create_raygen_bake_pipeline(ID3D12Device5 *device,
+                                            dxr::CommandContext &cmd_ctx,
+                                            ComputeBakePipeline &compute_pipeline);
+
+// The wavefront bake writes the AO image through the compute pipeline's output heap
+WavefrontPipeline create_wavefront_pipeline(ID3D12Device5 *device,
+                                            ComputeBakePipeline &compute_pipeline);
+
+// Write the UAV for the bake target's AO image into the compute bake descriptor heap
+void write_compute_bake_output(ID3D12Device5 *device,
+                               ComputeBakePipeline &pipeline,
+                               BakeTarget &bake_target);
+
+/* Rasterize the atlas at the bake target's resolution to build the list of covered texels.
+ * The texels are counted in a first pass to size the list, which is filled in a second
+ * pass. The AO image is also
+ * cleared if clear_ao is set, as the compute bake only writes the covered texels
+ */
+TexelGBuffer build_texel_gbuffer(ID3D12Device5 *device,
+                                 dxr::CommandContext &cmd_ctx,
+                                 ComputeBakePipeline &pipeline,
+                                 BakeScene &bake_scene,
+                                 BakeTarget &bake_target,
+                                 bool clear_ao);
+
+/* Bake a frame of the AO map with the compute shader over the texel G-buffer. The texels
+ * are dispatched in chunks of tile_size * tile_size, each submitted separately. If
+ * raygen_pipeline is set the chunks are traced with DispatchRays through it instead
+ */
+void bake_frame_compute(dxr::CommandContext &cmd_ctx,
+                        ComputeBakePipeline &pipeline,
+                        BakeScene &bake_scene,
+                        BakeTarget &bake_target,
+                        TexelGBuffer &texel_gbuffer,
+                        const AtlasParams &atlas_params,
+                        uint32_t tile_size,
+                        dxr::GpuProfiler &profiler,
+                        dxr::RTPipeline *raygen_pipeline);
+
+/* Bake a frame of the AO map with the wavefront passes over the texel G-buffer. The chunks
+ * are limited to tile_size * tile_size texels and to the ray capacity of the pipeline
+ */
+void bake_frame_wavefront(dxr::CommandContext &cmd_ctx,
+                          ComputeBakePipeline &compute_pipeline,
+                          WavefrontPipeline &pipeline,
+                          BakeScene &bake_scene,
+                          BakeTarget &bake_target,
+                          TexelGBuffer &texel_gbuffer,
+                          const AtlasParams &atlas_params,
+                          uint32_t tile_size,
+                          dxr::GpuProfiler &profiler);
+
+// The adaptive bake writes the AO image through the compute pipeline's output heap
+AdaptiveBake create_adaptive_bake(ID3D12Device5 *device,
+                                  ComputeBakePipeline &compute_pipeline);
+
+// Size the active lists of the adaptive bake to hold all the texels in the texel G-buffer
+void resize_adaptive_lists(ID3D12Device5 *device,
+                           AdaptiveBake &adaptive,
+                           const TexelGBuffer &texel_gbuffer);
+
+/* Bake a round of the adaptive bake, tracing samples_per_frame samples for each texel in
+ * the active list in chunks of tile_size * tile_size. A round with frame_id 0 traces all
+ * texels. The AO image is then written for all texels, or the heatmap if enabled
+ */
+void bake_frame_adaptive(dxr::CommandContext &cmd_ctx,
+                         ComputeBakePipeline &compute_pipeline,
+                         AdaptiveBake &adaptive,
+                         BakeScene &bake_scene,
+                         BakeTarget &bake_target,
+                         TexelGBuffer &texel_gbuffer,
+                         const AtlasParams &atlas_params,
+                         const AdaptiveSettings &settings,
+                         uint32_t tile_size,
+                         dxr::GpuProfiler &profiler);
+
+// The dilation writes the AO image through the compute pipeline's output heap
+DilatePipeline create_dilate_pipeline(ID3D12Device5 *device,
+                                      ComputeBakePipeline &compute_pipeline);
+
+/* Fill the gutter texels around the charts in the AO image with the AO of the nearest
+ * covered texel, using the coverage mask of the texel G-buffer. The AO is read from
+ * ao_source, the bake target's accumulation buffer or the denoiser's denoised_accum
+ */
+void dilate_ao_image(dxr::CommandContext &cmd_ctx,
+                     ComputeBakePipeline &compute_pipeline,
+                     DilatePipeline &pipeline,
+                     BakeTarget &bake_target,
+                     TexelGBuffer &texel_gbuffer,
+                     dxr::Buffer &ao_source,
+                     uint32_t gutter,
+                     dxr::GpuProfiler &profiler);
+
+// The denoiser writes the AO image through the compute pipeline's output heap
+DenoisePipeline create_denoise_pipeline(ID3D12Device5 *device,
+                                        ComputeBakePipeline &compute_pipeline);
+
+// Size the denoiser's buffers for the texel G-buffer and atlas
+void resize_denoise_buffers(ID3D12Device5 *device,
+                            DenoisePipeline &pipeline,
+                            const TexelGBuffer &texel_gbuffer,
+                            const glm::uvec2 &dims);
+
+/* Filter the accumulated AO of the covered texels with the a-trous filter, writing the
+ * result to the AO image and the pipeline's denoised_accum. The accumulation buffer isn't
+ * modified, so baking can continue to accumulate samples
+ */
+void denoise_ao_image(dxr::CommandContext &cmd_ctx,
+                      ComputeBakePipeline &compute_pipeline,
+                      DenoisePipeline &pipeline,
+                      BakeTarget &bake_target,
+                      TexelGBuffer &texel_gbuffer,
+                      const DenoiseSettings &settings,
+                      dxr::GpuProfiler &profiler);
+
+SampleBudgetPipeline create_sample_budget_pipeline(ID3D12Device5 *device);
+
+/* Distribute the ray budget over the texels of the texel G-buffer in proportion to their
+ * world space size and curvature, writing the samples each takes to its sample_budget.
+ * Each texel takes at least one sample, and at most budget_max_scale times the mean
+ */
+void compute_sample_budget(ID3D12Device5 *device,
+                           dxr::CommandContext &cmd_ctx,
+                           SampleBudgetPipeline &pipeline,
+                           const BakeScene &bake_scene,
+                           TexelGBuffer &texel_gbuffer,
+                           double ray_budget,
+                           dxr::GpuProfiler &profiler);
+
+VertexAOPipeline create_vertex_ao_pipeline(ID3D12Device5 *device);
+
+RebakePipeline create_rebake_pipeline(ID3D12Device5 *device);
+
+/* Reset the accumulated samples of the texels in the texel G-buffer within any of the
+ * dirty bounds, so the bake traces them again, and return the origins of the bake tiles
+ * containing them. Only these tiles need to be baked until the texels have converged
+ */
+std::vector<glm::uvec2> mark_rebake_texels(
+    ID3D12Device5 *device,
+    dxr::CommandContext &cmd_ctx,
+    RebakePipeline &pipeline,
+    BakeTarget &bake_target,
+    TexelGBuffer &texel_gbuffer,
+    const glm::uvec2 &atlas_size,
+    const std::vector<std::array<glm::vec3, 2>> &dirty_bounds,
+    uint32_t tile_size,
+    dxr::GpuProfiler &profiler);
+
+/* Merge the tiles marked by mark_rebake_texels into the tiles still re-baking from the
+ * previous edits. If none are left the list holds a single tile, so it isn't taken to mean
+ * the whole atlas
+ */
+void merge_rebake_tiles(std::vector<glm::uvec2> &rebake_tiles,
+                        const std::vector<glm::uvec2> &tiles);
+
+PreviewBake create_preview_bake(ID3D12Device5 *device, ComputeBakePipeline &compute_pipeline);
+
+/* Create the preview levels of the bake scene's atlas from 1/scale of its resolution and
+ * build their coverage, then restart the preview. No levels are made if scale is below 2
+ */
+void build_preview_levels(ID3D12Device5 *device,
+                          dxr::CommandContext &cmd_ctx,
+                          ComputeBakePipeline &compute_pipeline,
+                          PreviewBake &preview,
+                          BakeScene &bake_scene,
+                          uint32_t scale);
+
+// Restart the preview from its coarsest level, e.g. after the bake settings changed
+void restart_preview(PreviewBake &preview);
+
+// The samples per texel of the preview level, at most n_samples
+int preview_level_samples(const PreviewBake &preview, size_t level, int n_samples);
+
+/* Bake a frame of the current preview level with the raster bake and upsample it into the
+ * bake target's AO image. Once the level has taken its samples the preview moves on to the
+ * next, and after the last the full atlas is baked from its first frame as usual
+ */
+void bake_preview_frame(dxr::CommandContext &cmd_ctx,
+                        BakePipeline &bake_pipeline,
+                        ComputeBakePipeline &compute_pipeline,
+                        PreviewBake &preview,
+                        BakeScene &bake_scene,
+                        BakeTarget &bake_target,
+                        TexelGBuffer &texel_gbuffer,
+                        const AtlasParams &atlas_params,
+                        uint32_t tile_size,
+                        dxr::GpuProfiler &profiler);
+
+/* Upsample the preview level into the AO image texels covered in the texel G-buffer. If
+ * blend_samples is set the preview is blended with the texels' accumulated samples, so the
+ * AO image fades from the preview to the full atlas' bake as it accumulates
+ */
+void upsample_preview(dxr::CommandContext &cmd_ctx,
+                      ComputeBakePipeline &compute_pipeline,
+                      PreviewBake &preview,
+                      size_t level,
+                      BakeTarget &bake_target,
+                      TexelGBuffer &texel_gbuffer,
+                      uint32_t blend_samples,
+                      dxr::GpuProfiler &profiler);
+
+// Clear the bake target's AO image to the clear color
+void clear_ao_image(dxr::CommandContext &cmd_ctx, BakeTarget &bake_target);
+
+// Read back the baked AO map as tightly packed rows of pixels in the image's format
+std::vector<uint8_t> read_back_ao_image(ID3D12Device5 *device,
+                                        dxr::CommandContext &cmd_ctx,
+                                        dxr::Texture2D &ao_image);
+
+/* Convert the AO map pixels read back in the format to RGBA8. Single channel AO is written
+ * to RGB with an opaque alpha
+ */
+std::vector<uint8_t> ao_pixels_to_rgba8(const std::vector<uint8_t> &pixels,
+                                        DXGI_FORMAT format);
+
+// The AO of pixel i of the pixels read back in the format, the red channel of RGBA8 pixels
+float ao_pixel_value(const std::vector<uint8_t> &pixels, DXGI_FORMAT format, size_t i);
+
+/* Compute the RMSE of the AO map against the reference image over the texels covered by
+ * the charts. The reference must be the same size as the AO map
+ */
+float ao_image_rmse(const std::vector<uint8_t> &img,
+                    const glm::uvec2 &dims,
+                    const std::string &reference_file);
+
+/* Read back the baked AO map and write it out to the image file. .dds files keep the AO
+ * image's format, or are BC4 compressed on the GPU if compress is set, .exr files are
+ * written as half float and other files as 8-bit PNGs
+ */
+void write_ao_image(ID3D12Device5 *device,
+                    dxr::CommandContext &cmd_ctx,
+                    BlockCompressPipeline &bc_pipeline,
+                    dxr::Texture2D &ao_image,
+                    const std::string &fname,
+                    bool compress);
+
+/* Read back the AO map through the async readback and write it out like write_ao_image on
+ * its worker thread, so the encode overlaps whatever the caller does next. .dds files keep
+ * the AO image's format, the BC4 compression needs the GPU so isn't offered
+ */
+void write_ao_image_async(dxr::CommandContext &cmd_ctx,
+                          dxr::AsyncReadback &readback,
+                          dxr::Texture2D &ao_image,
+                          const std::string &fname);
+
+/* Write the tightly packed AO map pixels read back in the format to the file, as a .dds in
+ * the format, a single channel half float .exr or an 8-bit PNG otherwise. The images are
+ * converted row by row as they're compressed across the thread pool, without a full-size
+ * copy of the pixels
+ */
+void encode_ao_image(const std::vector<uint8_t> &pixels,
+                     const glm::uvec2 &dims,
+                     DXGI_FORMAT format,
+                     const std::string &fname);
+
+BlockCompressPipeline create_block_compress_pipeline(ID3D12Device5 *device);
+
+// Upload the tightly packed RGBA8 image to a texture for the block compression to read
+dxr::Texture2D upload_rgba8_image(ID3D12Device5 *device,
+                                  dxr::CommandContext &cmd_ctx,
+                                  const glm::uvec2 &dims,
+                                  const std::vector<uint8_t> &img);
+
+/* Encode the source image to the block compressed format, BC4 from the red channel or BC5
+ * from red and green, returning the tightly packed blocks
+ */
+std::vector<uint8_t> block_compress(ID3D12Device5 *device,
+                                    dxr::CommandContext &cmd_ctx,
+                                    BlockCompressPipeline &pipeline,
+                                    dxr::Texture2D &source,
+                                    DXGI_FORMAT format);
+
+// Read back the contents of the buffer, which must be in the UAV state
+std::vector<uint8_t> read_back_buffer(ID3D12Device5 *device,
+                                      dxr::CommandContext &cmd_ctx,
+                                      dxr::Buffer &buf);
+
+// Upload the data over the buffer's contents, which must be in the UAV state
+void upload_buffer(ID3D12Device5 *device,
+                   dxr::CommandContext &cmd_ctx,
+                   dxr::Buffer &buf,
+                   const std::vector<uint8_t> &data);
+
+// Upload the tightly packed pixels in the AO image's format over its contents
+void upload_ao_image(ID3D12Device5 *device,
+                     dxr::CommandContext &cmd_ctx,
+                     dxr::Texture2D &ao_image,
+                     const std::vector<uint8_t> &pixels);
+
+/* Copy the texels of the tiles from the source to the dest image, both tightly packed
+ * images of the dimensions with texel_size bytes per texel
+ */
+void copy_image_tiles(std::vector<uint8_t> &dest,
+                      const std::vector<uint8_t> &src,
+                      const glm::uvec2 &dims,
+                      size_t texel_size,
+                      const std::vector<glm::uvec2> &tiles,
+                      uint32_t tile_size);
+
+/* Write the RGBA float image as an HDR image if the file is .hdr, a half float RGBA image if
+ * it's .exr, as a .dds block compressed to dds_format on the GPU, otherwise as an 8-bit PNG
+ */
+void write_float_image(ID3D12Device5 *device,
+                       dxr::CommandContext &cmd_ctx,
+                       BlockCompressPipeline &bc_pipeline,
+                       const std::string &fname,
+                       const glm::uvec2 &dims,
+                       const std::vector<glm::vec4> &img,
+                       DXGI_FORMAT dds_format);
+
+/* Read back the accumulated extras and direct lighting and write out the bent normal, hit
+ * distance and direct lighting maps set in the options. Each map is written as an 8-bit
+ * PNG, a float HDR or half float EXR image or a BC5 (bent normals) or BC4 (hit distance)
+ * DDS depending on its file extension. The direct lighting is the mean irradiance, clamped
+ * to [0, 1] in PNGs.
+ * Texels outside the charts are written as opaque black
+ */
+void write_bake_outputs(ID3D12Device5 *device,
+                        dxr::CommandContext &cmd_ctx,
+                        BlockCompressPipeline &bc_pipeline,
+                        BakeTarget &bake_target,
+                        const AppOptions &options,
+                        float ao_length);
@@ -0,0 +1,31 @@
+#ifndef ATLAS_DRAW_HLSL
+#define ATLAS_DRAW_HLSL
+
+// The data of an atlas draw, one for each geometry of each mesh, matches AtlasDraw in
+// ao_bake.h
+struct AtlasDraw {
+    // The position dequantization of the geometry
+    float3 position_scale;
+    // The BakeInstance of the first instance of the mesh being drawn
+    uint first_instance;
+    float3 position_offset;
+    // The index of the geometry pool's positions in the bake's geometry heap, followed by
+    // its normals and UVs, for the vertex shader fetching its vertices from the heap
+    uint geometry_buffers;
+    // The atlas UV bounds of the geometry over all the instances drawn, as lower xy and
+    // upper zw
+    float4 uv_bounds;
+    // The byte stride of the positions, 8 if they're quantized to 16-bit SNORM
+    uint position_stride;
+    uint3 pad;
+};
+
+// The indirect arguments of an atlas draw, matches AtlasDrawArgs in ao_bake.h. They're only
+// copied by the shaders, so they're kept as words
+#define ATLAS_DRAW_ARGS_WORDS 22
+
+struct AtlasDrawArgs {
+    uint words[ATLAS_DRAW_ARGS_WORDS];
+};
+
+#endif
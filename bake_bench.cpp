@@ -0,0 +1,28 @@
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "ao_bake.h"
+
+const std::string BENCH_USAGE =
+    "Usage: dxr_ao_bake_bench <results.json> [obj/gltf files] [options]\n"
+    "Load, unwrap, build the BVHs of and bake each scene from scratch, followed by synthetic\n"
+    "stress meshes, at a fixed sample count, seed and atlas resolution. The wall and GPU\n"
+    "time of each phase, Mrays/s, BVH sizes and peak memory use are written to the file\n"
+    "Options:\n"
+    "  --spp <n>             Samples per texel of each bake (default 64)\n"
+    "  --no-stress           Skip the synthetic stress meshes\n";
+
+int main(int argc, const char **argv)
+{
+    const std::vector<std::string> args(argv, argv + argc);
+    auto fnd_help = std::find_if(args.begin(), args.end(), [](const std::string &a) {
+        return a == "-h" || a == "--help";
+    });
+
+    if (argc < 2 || fnd_help != args.end()) {
+        std::cout << BENCH_USAGE;
+        return 1;
+    }
+    return run_bake_benchmark(args) ? 0 : 1;
+}
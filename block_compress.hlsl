@@ -0,0 +1,89 @@
+// GPU BC4 and BC5 encoders for writing the baked maps directly to block compressed DDS
+// files. Each thread encodes one 4x4 block, picking the block's min and max as the
+// endpoints of the 8 value palette and the closest palette entry for each texel
+
+Texture2D<float4> source : register(t0);
+
+// The encoded blocks in row major order, 8 bytes each for BC4 and 16 for BC5
+RWByteAddressBuffer blocks : register(u0);
+
+cbuffer BlockCompressInfo : register(b0) {
+    uint2 dimensions;
+    uint2 num_blocks;
+}
+
+// Load the channel of the texels in the block, clamping to the edge of the image
+void load_block(uint2 block, uint channel, out float values[16])
+{
+    for (uint i = 0; i < 16; ++i) {
+        const uint2 texel = min(block * 4 + uint2(i % 4, i / 4), dimensions - 1);
+        values[i] = saturate(source[texel][channel]);
+    }
+}
+
+uint2 encode_bc4_block(float values[16])
+{
+    float lo = 1.f;
+    float hi = 0.f;
+    for (uint i = 0; i < 16; ++i) {
+        lo = min(lo, values[i]);
+        hi = max(hi, values[i]);
+    }
+    // red_0 > red_1 selects the 8 value palette interpolating between them
+    const uint red_0 = uint(round(hi * 255.f));
+    const uint red_1 = uint(round(lo * 255.f));
+    uint2 bits = uint2(red_0 | (red_1 << 8), 0);
+    if (red_0 == red_1) {
+        return bits;
+    }
+
+    const float range = float(red_0 - red_1);
+    for (uint j = 0; j < 16; ++j) {
+        // Palette level 0 is red_1 and level 7 is red_0, the levels between are stored in
+        // reverse order after the endpoints
+        const float level_f = round((values[j] * 255.f - red_1) / range * 7.f);
+        const uint level = uint(clamp(level_f, 0.f, 7.f));
+        uint index = 8 - level;
+        if (level == 7) {
+            index = 0;
+        } else if (level == 0) {
+            index = 1;
+        }
+
+        // The 3 bit indices are packed after the endpoints, one may straddle the two words
+        const uint shift = 16 + 3 * j;
+        if (shift < 32) {
+            bits.x |= index << shift;
+        }
+        if (shift + 3 > 32) {
+            bits.y |= shift >= 32 ? index << (shift - 32) : index >> (32 - shift);
+        }
+    }
+    return bits;
+}
+
+[numthreads(8, 8, 1)]
+void bc4_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    if (any(thread_id.xy >= num_blocks)) {
+        return;
+    }
+    float values[16];
+    load_block(thread_id.xy, 0, values);
+    const uint block_id = thread_id.y * num_blocks.x + thread_id.x;
+    blocks.Store2(block_id * 8, encode_bc4_block(values));
+}
+
+[numthreads(8, 8, 1)]
+void bc5_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    if (any(thread_id.xy >= num_blocks)) {
+        return;
+    }
+    float red[16];
+    float green[16];
+    load_block(thread_id.xy, 0, red);
+    load_block(thread_id.xy, 1, green);
+    const uint block_id = thread_id.y * num_blocks.x + thread_id.x;
+    blocks.Store4(block_id * 16, uint4(encode_bc4_block(red), encode_bc4_block(green)));
+}
@@ -0,0 +1,43 @@
+#include "atlas_draw.hlsl"
+
+// Culls the atlas draws to those overlapping the tile being baked. The kept draws of each
+// position format are compacted into the culled arguments at the same offset as the
+// format's draws in the draw list, with the draw count of each format in culled_count
+
+StructuredBuffer<AtlasDraw> draws : register(t0);
+StructuredBuffer<AtlasDrawArgs> draw_args : register(t1);
+
+RWStructuredBuffer<AtlasDrawArgs> culled_args : register(u0);
+RWByteAddressBuffer culled_count : register(u1);
+
+cbuffer CullInfo : register(b0) {
+    // The left, top, right and bottom pixel of the tile
+    uint4 tile_rect;
+    uint2 atlas_dims;
+    uint num_draws;
+    // The float position draws come first, followed by the quantized position draws
+    uint num_float_draws;
+}
+
+[numthreads(64, 1, 1)]
+void csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    const uint id = thread_id.x;
+    if (id >= num_draws) {
+        return;
+    }
+    // The viewport flips the UV y axis, the bounds are padded by a pixel so triangles
+    // covering a texel center at the bounds' edge are kept
+    const float4 b = draws[id].uv_bounds;
+    const float2 lower = float2(b.x, 1.f - b.w) * float2(atlas_dims) - 1.f;
+    const float2 upper = float2(b.z, 1.f - b.y) * float2(atlas_dims) + 1.f;
+    if (upper.x < float(tile_rect.x) || lower.x > float(tile_rect.z) ||
+        upper.y < float(tile_rect.y) || lower.y > float(tile_rect.w)) {
+        return;
+    }
+
+    const uint group = id < num_float_draws ? 0 : 1;
+    uint slot = 0;
+    culled_count.InterlockedAdd(group * 4, 1, slot);
+    culled_args[(group == 0 ? 0 : num_float_draws) + slot] = draw_args[id];
+}
@@ -0,0 +1,122 @@
+#include "texel_data.hlsl"
+
+// Edge-avoiding a-trous wavelet denoiser (Dammertz et al. 2010) run over the texel list in
+// atlas space. The filter taps are weighted by the world space position and normal of the
+// texels, so it doesn't blur across geometric edges or between texels on unrelated charts
+// that happen to be next to each other in the atlas
+
+StructuredBuffer<TexelData> texels : register(t0);
+
+RWStructuredBuffer<float2> accum_buffer : register(u0);
+RWTexture2D<float4> ao_output : register(u1);
+// Index of each atlas texel in the texel list plus one, 0 for texels outside the charts
+RWStructuredBuffer<uint> texel_index_map : register(u2);
+RWStructuredBuffer<float> values_a : register(u3);
+RWStructuredBuffer<float> values_b : register(u4);
+// The denoised AO of each atlas texel as (ao, 1), laid out like the accumulation buffer
+RWStructuredBuffer<float2> denoised_accum : register(u5);
+
+cbuffer DenoiseInfo : register(b0) {
+    uint2 dimensions;
+    // The range of the texel list to filter in this dispatch
+    uint texel_offset;
+    uint num_texels;
+    // Spacing of the filter taps in texels
+    uint step;
+    // If set the pass reads values_b and writes values_a
+    uint flip;
+    // The first pass reads the AO from the accumulation buffer
+    uint from_accum;
+    // The last pass writes the AO image and denoised_accum
+    uint write_output;
+    float sigma_ao;
+    float sigma_normal;
+    float sigma_position;
+    uint pad;
+}
+
+float texel_ao(uint index, uint pixel_id, RWStructuredBuffer<float> src)
+{
+    if (from_accum) {
+        const float2 accum = accum_buffer[pixel_id];
+        return accum.x / max(accum.y, 1.f);
+    }
+    return src[index];
+}
+
+float atrous_filter(RWStructuredBuffer<float> src, uint index)
+{
+    const float kernel_weights[3] = {3.f / 8.f, 1.f / 4.f, 1.f / 16.f};
+
+    const TexelData t = texels[index];
+    const int2 texel = int2(texel_coords(t));
+    const float ao = texel_ao(index, texel.y * dimensions.x + texel.x, src);
+
+    float sum = 0.f;
+    float sum_weights = 0.f;
+    for (int y = -2; y <= 2; ++y) {
+        for (int x = -2; x <= 2; ++x) {
+            const int2 q = texel + int2(x, y) * int(step);
+            if (any(q < 0) || any(q >= int2(dimensions))) {
+                continue;
+            }
+            const uint q_pixel = q.y * dimensions.x + q.x;
+            const uint q_index = texel_index_map[q_pixel];
+            if (q_index == 0) {
+                continue;
+            }
+            const TexelData tq = texels[q_index - 1];
+            const float ao_q = texel_ao(q_index - 1, q_pixel, src);
+
+            // Texels on the same surface are about their distance in the atlas apart, those
+            // on unrelated charts or across a crease are much further
+            const float expected_dist = length(float2(x, y)) * step * t.texel_size;
+            const float dist = length(tq.position - t.position);
+            const float w_position = exp(-max(dist - expected_dist, 0.f)
+                                         / max(sigma_position * expected_dist, 1e-6f));
+            const float w_normal = pow(saturate(dot(t.normal, tq.normal)), sigma_normal);
+            const float w_ao = exp(-abs(ao - ao_q) / sigma_ao);
+
+            const float w = kernel_weights[abs(x)] * kernel_weights[abs(y)] * w_position
+                            * w_normal * w_ao;
+            sum += w * ao_q;
+            sum_weights += w;
+        }
+    }
+    // The center tap always has a weight of at least kernel_weights[0]^2
+    return sum / sum_weights;
+}
+
+[numthreads(64, 1, 1)]
+void index_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    if (thread_id.x >= num_texels) {
+        return;
+    }
+    const uint index = texel_offset + thread_id.x;
+    const uint2 texel = texel_coords(texels[index]);
+    texel_index_map[texel.y * dimensions.x + texel.x] = index + 1;
+}
+
+[numthreads(64, 1, 1)]
+void atrous_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    if (thread_id.x >= num_texels) {
+        return;
+    }
+    const uint index = texel_offset + thread_id.x;
+    float ao = 0.f;
+    if (flip) {
+        ao = atrous_filter(values_b, index);
+        values_a[index] = ao;
+    } else {
+        ao = atrous_filter(values_a, index);
+        values_b[index] = ao;
+    }
+
+    if (write_output) {
+        const uint2 texel = texel_coords(texels[index]);
+        ao_output[texel] = ao;
+        denoised_accum[texel.y * dimensions.x + texel.x] = float2(ao, 1.f);
+    }
+}
@@ -0,0 +1,126 @@
+// Gutter dilation of the AO map with the jump flood algorithm. Texels outside the charts
+// within gutter texels of a chart are filled with the AO of the nearest covered texel, so
+// bilinear and mip sampling don't pull in the clear color at the chart borders. The atlas
+// is processed in tiles, each with an apron of gutter texels
+
+#define INVALID_SEED 0xffffffff
+
+RWStructuredBuffer<float2> accum_buffer : register(u0);
+RWTexture2D<float4> ao_output : register(u1);
+RWStructuredBuffer<uint> seeds_a : register(u2);
+RWStructuredBuffer<uint> seeds_b : register(u3);
+// One bit per atlas texel, set if the texel is covered by a chart
+RWByteAddressBuffer coverage : register(u4);
+
+cbuffer DilateInfo : register(b0) {
+    uint2 dimensions;
+    // The area processed for this tile, including the apron
+    int2 region_origin;
+    uint2 region_size;
+    // The texels of the tile to fill
+    uint2 tile_lower;
+    uint2 tile_upper;
+    uint step;
+    uint gutter;
+    // If set the jump pass reads seeds_b and writes seeds_a
+    uint flip;
+    uint pad;
+}
+
+uint pack_seed(uint2 texel)
+{
+    return texel.x | (texel.y << 16);
+}
+
+uint2 unpack_seed(uint seed)
+{
+    return uint2(seed & 0xffff, seed >> 16);
+}
+
+bool texel_covered(uint2 texel)
+{
+    const uint pixel_id = texel.y * dimensions.x + texel.x;
+    return (coverage.Load((pixel_id / 32) * 4) & (1u << (pixel_id % 32))) != 0;
+}
+
+bool region_texel(int2 local, out uint2 texel)
+{
+    const int2 global = region_origin + local;
+    texel = uint2(global);
+    return all(local >= 0) && all(local < int2(region_size)) && all(global >= 0)
+        && all(global < int2(dimensions));
+}
+
+[numthreads(8, 8, 1)]
+void init_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    uint2 texel;
+    if (!region_texel(int2(thread_id.xy), texel)) {
+        return;
+    }
+    const uint index = thread_id.y * region_size.x + thread_id.x;
+    seeds_a[index] = texel_covered(texel) ? pack_seed(texel) : INVALID_SEED;
+}
+
+void jump(RWStructuredBuffer<uint> src, RWStructuredBuffer<uint> dst, uint2 id)
+{
+    uint2 texel;
+    if (!region_texel(int2(id), texel)) {
+        return;
+    }
+    uint best_seed = INVALID_SEED;
+    float best_dist = 1e20f;
+    for (int y = -1; y <= 1; ++y) {
+        for (int x = -1; x <= 1; ++x) {
+            const int2 p = int2(id) + int2(x, y) * int(step);
+            uint2 neighbor;
+            if (!region_texel(p, neighbor)) {
+                continue;
+            }
+            const uint seed = src[p.y * region_size.x + p.x];
+            if (seed == INVALID_SEED) {
+                continue;
+            }
+            const float2 d = float2(unpack_seed(seed)) - float2(texel);
+            const float dist = dot(d, d);
+            if (dist < best_dist) {
+                best_dist = dist;
+                best_seed = seed;
+            }
+        }
+    }
+    dst[id.y * region_size.x + id.x] = best_seed;
+}
+
+[numthreads(8, 8, 1)]
+void jump_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    if (flip) {
+        jump(seeds_b, seeds_a, thread_id.xy);
+    } else {
+        jump(seeds_a, seeds_b, thread_id.xy);
+    }
+}
+
+[numthreads(8, 8, 1)]
+void resolve_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    uint2 texel;
+    if (!region_texel(int2(thread_id.xy), texel) || any(texel < tile_lower)
+        || any(texel >= tile_upper) || texel_covered(texel)) {
+        return;
+    }
+    // The result of the last jump pass is in seeds_a if it was flipped
+    const uint index = thread_id.y * region_size.x + thread_id.x;
+    const uint seed = flip ? seeds_a[index] : seeds_b[index];
+    if (seed == INVALID_SEED) {
+        return;
+    }
+    const uint2 src = unpack_seed(seed);
+    const uint2 d = max(src, texel) - min(src, texel);
+    if (max(d.x, d.y) > gutter) {
+        return;
+    }
+    const float2 accum = accum_buffer[src.y * dimensions.x + src.x];
+    ao_output[texel] = accum.x / max(accum.y, 1.f);
+}
@@ -0,0 +1,114 @@
+#ifndef DIRECT_LIGHT_HLSL
+#define DIRECT_LIGHT_HLSL
+
+#include "util.hlsl"
+#include "sampler.hlsl"
+#include "trace_ao.hlsl"
+
+// The number of candidate lights each direct lighting sample resamples from
+#define DIRECT_LIGHT_CANDIDATES 8
+
+// An emissive quad spanning position + u.x * width * v_x + u.y * height * v_y for u in
+// [0, 1]^2, emitting on the normal's side. Matches QuadLight in util/lights.h
+struct QuadLight {
+    float4 emission;
+    float4 position;
+    float4 normal;
+    float3 v_x;
+    float width;
+    float3 v_y;
+    float height;
+};
+
+// A point sampled on a light and its unshadowed irradiance at the shading point
+struct LightSample {
+    float3 direction;
+    float distance;
+    float3 irradiance;
+};
+
+/* Sample a uniformly distributed point on the light and return its unshadowed irradiance
+ * at the position divided by the pdf of the point, 1 / area
+ */
+LightSample sample_quad_light(QuadLight light, float3 position, float3 normal, float2 u)
+{
+    const float3 p = light.position.xyz + u.x * light.width * light.v_x
+                     + u.y * light.height * light.v_y;
+    const float3 to_light = p - position;
+    const float dist2 = dot(to_light, to_light);
+
+    LightSample ls;
+    ls.distance = sqrt(dist2);
+    ls.direction = to_light / max(ls.distance, 1e-6f);
+    ls.irradiance = float3(0.f, 0.f, 0.f);
+    const float cos_x = dot(normal, ls.direction);
+    const float cos_y = -dot(light.normal.xyz, ls.direction);
+    if (cos_x > 0.f && cos_y > 0.f && dist2 > 0.f) {
+        const float area = light.width * light.height;
+        ls.irradiance = light.emission.rgb * cos_x * cos_y * area / dist2;
+    }
+    return ls;
+}
+
+/* Take n_samples direct lighting samples of the quad lights and return the sum of their
+ * irradiance estimates. Each sample picks a light by resampled importance sampling:
+ * DIRECT_LIGHT_CANDIDATES points are drawn uniformly over the lights and one is kept
+ * in a weighted reservoir by its unshadowed irradiance, so many lights only cost one
+ * shadow ray per sample. The shadow rays are traced like the AO rays, through the full-res
+ * geometry within near_field_radius and the occluder proxies beyond it
+ */
+float3 sample_direct_light(RaytracingAccelerationStructure scene,
+                           StructuredBuffer<QuadLight> lights,
+                           uint num_lights,
+                           float3 position,
+                           float3 normal,
+                           float near_field_radius,
+                           int n_samples,
+                           inout SampleGenerator sg)
+{
+    const float3 n = normalize(normal);
+    float3 irradiance = float3(0.f, 0.f, 0.f);
+    if (num_lights == 0) {
+        return irradiance;
+    }
+    const uint n_candidates = min(num_lights, uint(DIRECT_LIGHT_CANDIDATES));
+    for (int i = 0; i < n_samples; ++i) {
+        LightSample selected;
+        selected.direction = n;
+        selected.distance = 0.f;
+        selected.irradiance = float3(0.f, 0.f, 0.f);
+        float selected_weight = 0.f;
+        float weight_sum = 0.f;
+        for (uint c = 0; c < n_candidates; ++c) {
+            const float2 u = next_sample2d(sg);
+            // The light is picked by the first dimension, rescaled to place the point
+            const float l = u.x * num_lights;
+            const uint light_id = min(uint(l), num_lights - 1);
+            const LightSample ls =
+                sample_quad_light(lights[light_id], position, n, float2(frac(l), u.y));
+            // The candidate's weight is its target, the irradiance's luminance, over its
+            // pdf, which is 1 / (num_lights * area) and already folded into the irradiance
+            const float weight = luminance(ls.irradiance) * num_lights;
+            weight_sum += weight;
+            if (weight > 0.f && lcg_randomf(sg.rng) * weight_sum < weight) {
+                selected = ls;
+                selected_weight = weight;
+            }
+        }
+        if (selected_weight == 0.f
+            || trace_ao_ray(scene,
+                            position,
+                            selected.direction,
+                            selected.distance * 0.999f,
+                            near_field_radius)) {
+            continue;
+        }
+        // The RIS estimate f / target * weight_sum / n_candidates, where f / target is the
+        // selected candidate's irradiance * num_lights / weight
+        irradiance += selected.irradiance * num_lights * weight_sum
+                      / (selected_weight * n_candidates);
+    }
+    return irradiance;
+}
+
+#endif
@@ -0,0 +1,60 @@
+// Draws the visible region of the displayed image to the framebuffer with a fullscreen
+// triangle. The image is read from the mip level closest to one texel per pixel, either the
+// image itself or a level of the pyramid built by display_mips.hlsl, and each pixel box
+// filters the level texels its footprint covers with a grid of up to
+// MAX_BLIT_TAPS x MAX_BLIT_TAPS loads. Seeing the whole of a large atlas reads a bounded
+// number of texels per pixel, and zooming in only reads the texels on screen
+
+#include "display_pyramid.hlsl"
+
+// Must match max_blit_taps in dxdisplay.cpp
+#define MAX_BLIT_TAPS 4
+
+Texture2D<float4> image : register(t0);
+Texture2D<uint> pyramid : register(t1);
+
+cbuffer BlitInfo : register(b0) {
+    // The level texel position of the framebuffer's top left corner
+    float2 view_origin;
+    // The level texels covered by each framebuffer pixel along each axis
+    float texels_per_pixel;
+    // The loads along each axis of a pixel's footprint
+    uint taps;
+    uint2 level_dims;
+    // The position of the level in the pyramid, unused if the level is the image
+    uint2 level_origin;
+    uint level;
+}
+
+float4 vsmain(uint vid : SV_VertexID) : SV_POSITION
+{
+    const float2 p = float2((vid << 1) & 2, vid & 2);
+    return float4(p.x * 2.f - 1.f, 1.f - p.y * 2.f, 0.f, 1.f);
+}
+
+float3 load_level(uint2 texel)
+{
+    if (level == 0) {
+        return image.Load(int3(texel, 0)).rgb;
+    }
+    return unpack_texel(pyramid.Load(int3(level_origin + texel, 0))).rgb;
+}
+
+float4 fsmain(float4 pos : SV_POSITION) : SV_TARGET
+{
+    // The footprint of the pixel in the level, from its top left corner
+    const float2 footprint = view_origin + floor(pos.xy) * texels_per_pixel;
+    if (any(footprint < 0.f) || any(footprint >= float2(level_dims))) {
+        return float4(0.f, 0.f, 0.f, 1.f);
+    }
+    const float step = texels_per_pixel / taps;
+    float3 sum = 0.f;
+    for (uint y = 0; y < taps; ++y) {
+        for (uint x = 0; x < taps; ++x) {
+            const uint2 texel =
+                min(uint2(footprint + (float2(x, y) + 0.5f) * step), level_dims - 1);
+            sum += load_level(texel);
+        }
+    }
+    return float4(sum / (taps * taps), 1.f);
+}
@@ -0,0 +1,43 @@
+// Builds a level of the displayed image's mip pyramid by box filtering the level above it.
+// The pyramid packs levels 1 and up into one R32_UINT texture holding RGBA8 texels, so the
+// level above can be read back through the same UAV it was written through. Only the
+// region of the level covering the visible part of the image is written
+
+#include "display_pyramid.hlsl"
+
+Texture2D<float4> image : register(t0);
+RWTexture2D<uint> pyramid : register(u0);
+
+cbuffer MipInfo : register(b0) {
+    // The pyramid position of the level being written and of the level above it
+    uint2 dst_origin;
+    uint2 src_origin;
+    uint2 src_dims;
+    // The texels of the level to write, in the level's coordinates
+    uint2 region_lower;
+    uint2 region_dims;
+    // Set if the level above is the image itself
+    uint from_image;
+}
+
+float4 load_source(uint2 texel)
+{
+    texel = min(texel, src_dims - 1);
+    if (from_image) {
+        return image.Load(int3(texel, 0));
+    }
+    return unpack_texel(pyramid[src_origin + texel]);
+}
+
+[numthreads(8, 8, 1)]
+void mip_csmain(uint3 tid : SV_DispatchThreadID)
+{
+    if (any(tid.xy >= region_dims)) {
+        return;
+    }
+    const uint2 texel = region_lower + tid.xy;
+    const uint2 src = texel * 2;
+    const float4 sum = load_source(src) + load_source(src + uint2(1, 0)) +
+                       load_source(src + uint2(0, 1)) + load_source(src + uint2(1, 1));
+    pyramid[dst_origin + texel] = pack_texel(sum * 0.25f);
+}
@@ -0,0 +1,17 @@
+#ifndef DISPLAY_PYRAMID_HLSL
+#define DISPLAY_PYRAMID_HLSL
+
+// The display's mip pyramid stores RGBA8 texels packed in a uint, R in the low byte
+
+uint pack_texel(float4 c)
+{
+    const uint4 v = uint4(saturate(c) * 255.f + 0.5f);
+    return v.r | (v.g << 8) | (v.b << 16) | (v.a << 24);
+}
+
+float4 unpack_texel(uint v)
+{
+    return float4(v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, v >> 24) / 255.f;
+}
+
+#endif
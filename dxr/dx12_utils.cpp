@@ -1,5 +1,14 @@
 #include "dx12_utils.h"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <set>
+#include "trace.h"
 #include "util.h"
 
 namespace dxr {
@@ -30,6 +39,124 @@ const D3D12_HEAP_PROPERTIES READBACK_HEAP_PROPS = {
     0,
 };
 
+// Enable debugging for D3D12 in debug builds
+static void enable_debug_layer()
+{
+#ifdef _DEBUG
+    ComPtr<ID3D12Debug> debug_controller;
+    auto err = D3D12GetDebugInterface(IID_PPV_ARGS(&debug_controller));
+    if (FAILED(err)) {
+        std::cout << "Failed to enable debug layer!\n";
+        throw std::runtime_error("get debug failed");
+    }
+    debug_controller->EnableDebugLayer();
+#endif
+}
+
+ComPtr<ID3D12Device5> create_device()
+{
+    std::vector<ComPtr<ID3D12Device5>> devices = create_devices();
+    if (devices.empty()) {
+        std::cout << "Failed to make D3D12 device\n";
+        throw std::runtime_error("failed to make d3d12 device\n");
+    }
+    for (auto &device : devices) {
+        D3D12_FEATURE_DATA_D3D12_OPTIONS5 feature_data = {0};
+        if (SUCCEEDED(device->CheckFeatureSupport(
+                D3D12_FEATURE_D3D12_OPTIONS5, &feature_data, sizeof(feature_data))) &&
+            feature_data.RaytracingTier >= D3D12_RAYTRACING_TIER_1_1) {
+            return device;
+        }
+    }
+    // Without a ray tracing adapter the default one is returned, for the callers to check
+    // dxr_available and fall back
+    return devices[0];
+}
+
+std::vector<ComPtr<ID3D12Device5>> create_devices()
+{
+    enable_debug_layer();
+
+    ComPtr<IDXGIFactory4> factory;
+    if (FAILED(CreateDXGIFactory2(0, IID_PPV_ARGS(&factory)))) {
+        std::cout << "Failed to make DXGI factory\n";
+        throw std::runtime_error("failed to make dxgi factory\n");
+    }
+
+    std::vector<ComPtr<ID3D12Device5>> devices;
+    ComPtr<IDXGIAdapter1> adapter;
+    for (UINT i = 0; factory->EnumAdapters1(i, &adapter) != DXGI_ERROR_NOT_FOUND; ++i) {
+        DXGI_ADAPTER_DESC1 desc;
+        adapter->GetDesc1(&desc);
+        if (desc.Flags & DXGI_ADAPTER_FLAG_SOFTWARE) {
+            continue;
+        }
+        ComPtr<ID3D12Device5> device;
+        if (SUCCEEDED(D3D12CreateDevice(
+                adapter.Get(), D3D_FEATURE_LEVEL_12_1, IID_PPV_ARGS(&device)))) {
+            devices.push_back(device);
+        }
+    }
+    return devices;
+}
+
+DXGI_QUERY_VIDEO_MEMORY_INFO video_memory_info(ID3D12Device *device)
+{
+    DXGI_QUERY_VIDEO_MEMORY_INFO info = {0};
+    ComPtr<IDXGIFactory4> factory;
+    ComPtr<IDXGIAdapter3> adapter;
+    if (FAILED(CreateDXGIFactory2(0, IID_PPV_ARGS(&factory))) ||
+        FAILED(factory->EnumAdapterByLuid(device->GetAdapterLuid(), IID_PPV_ARGS(&adapter)))) {
+        return info;
+    }
+    if (FAILED(adapter->QueryVideoMemoryInfo(0, DXGI_MEMORY_SEGMENT_GROUP_LOCAL, &info))) {
+        info = DXGI_QUERY_VIDEO_MEMORY_INFO{0};
+    }
+    return info;
+}
+
+uint64_t available_video_memory(ID3D12Device *device)
+{
+    const DXGI_QUERY_VIDEO_MEMORY_INFO info = video_memory_info(device);
+    if (info.Budget == 0) {
+        return std::numeric_limits<uint64_t>::max();
+    }
+    return info.Budget > info.CurrentUsage ? info.Budget - info.CurrentUsage : 0;
+}
+
+uint64_t video_memory_usage(ID3D12Device *device)
+{
+    return video_memory_info(device).CurrentUsage;
+}
+
+DXGI_ADAPTER_DESC1 adapter_desc(ID3D12Device *device)
+{
+    DXGI_ADAPTER_DESC1 desc = {0};
+    ComPtr<IDXGIFactory4> factory;
+    ComPtr<IDXGIAdapter1> adapter;
+    if (FAILED(CreateDXGIFactory2(0, IID_PPV_ARGS(&factory))) ||
+        FAILED(factory->EnumAdapterByLuid(device->GetAdapterLuid(), IID_PPV_ARGS(&adapter))) ||
+        FAILED(adapter->GetDesc1(&desc))) {
+        return DXGI_ADAPTER_DESC1{0};
+    }
+    return desc;
+}
+
+std::string driver_version(ID3D12Device *device)
+{
+    ComPtr<IDXGIFactory4> factory;
+    ComPtr<IDXGIAdapter1> adapter;
+    LARGE_INTEGER version = {0};
+    if (FAILED(CreateDXGIFactory2(0, IID_PPV_ARGS(&factory))) ||
+        FAILED(factory->EnumAdapterByLuid(device->GetAdapterLuid(), IID_PPV_ARGS(&adapter))) ||
+        FAILED(adapter->CheckInterfaceSupport(__uuidof(IDXGIDevice), &version))) {
+        return "";
+    }
+    const uint64_t v = version.QuadPart;
+    return std::to_string(v >> 48) + "." + std::to_string((v >> 32) & 0xffff) + "." +
+           std::to_string((v >> 16) & 0xffff) + "." + std::to_string(v & 0xffff);
+}
+
 D3D12_RESOURCE_BARRIER barrier_transition(ID3D12Resource *res,
                                           D3D12_RESOURCE_STATES before,
                                           D3D12_RESOURCE_STATES after)
@@ -133,8 +260,33 @@ Buffer Buffer::create(ID3D12Device *device,
     b.buf_size = nbytes;
     b.rheap = props.Type;
     b.rstate = state;
-    CHECK_ERR(device->CreateCommittedResource(
-        &props, D3D12_HEAP_FLAG_NONE, &desc, state, nullptr, IID_PPV_ARGS(&b.res)));
+
+    HeapAllocator *allocator = resource_allocator();
+    if (allocator) {
+        b.suballocation = allocator->suballocate(device, props, desc, state, b.res);
+    }
+    if (b.suballocation) {
+        b.buf_offset = b.suballocation->offset;
+        b.tracking = memory_tracker().track(
+            desc, props.Type, state, nbytes, b.suballocation->nbytes);
+        return b;
+    }
+
+    b.tracking = memory_tracker().track(device, desc, props.Type, state, nbytes);
+
+    const bool is_bvh = state == D3D12_RESOURCE_STATE_RAYTRACING_ACCELERATION_STRUCTURE;
+    // UAV buffers are written and accumulated into by the bake assuming they start zeroed,
+    // which only committed resources guarantee
+    const bool needs_zeroing = props.Type == D3D12_HEAP_TYPE_DEFAULT && !is_bvh &&
+                               (desc.Flags & D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    if (allocator && !needs_zeroing) {
+        const auto pool = is_bvh ? HeapAllocator::POOL_BVHS : HeapAllocator::POOL_BUFFERS;
+        b.placement =
+            allocator->create_resource(device, pool, props, desc, state, nullptr, b.res);
+    } else {
+        CHECK_ERR(device->CreateCommittedResource(
+            &props, D3D12_HEAP_FLAG_NONE, &desc, state, nullptr, IID_PPV_ARGS(&b.res)));
+    }
     return b;
 }
 
@@ -166,26 +318,35 @@ void *Buffer::map()
     void *mapping = nullptr;
     D3D12_RANGE range = {0};
     // Explicitly note we want the whole range to silence debug layer warnings
-    range.End = buf_size;
+    range.Begin = buf_offset;
+    range.End = buf_offset + buf_size;
     CHECK_ERR(res->Map(0, &range, &mapping));
-    return mapping;
+    // Map returns the start of the resource, which a suballocated buffer is offset into
+    return static_cast<uint8_t *>(mapping) + buf_offset;
 }
 
 void *Buffer::map(D3D12_RANGE read)
 {
     assert(rheap != D3D12_HEAP_TYPE_DEFAULT);
     void *mapping = nullptr;
+    read.Begin += buf_offset;
+    read.End += buf_offset;
     CHECK_ERR(res->Map(0, &read, &mapping));
-    return mapping;
+    return static_cast<uint8_t *>(mapping) + buf_offset;
 }
 
 void Buffer::unmap()
 {
-    res->Unmap(0, nullptr);
+    D3D12_RANGE written = {0};
+    written.Begin = buf_offset;
+    written.End = buf_offset + buf_size;
+    res->Unmap(0, &written);
 }
 
 void Buffer::unmap(D3D12_RANGE written)
 {
+    written.Begin += buf_offset;
+    written.End += buf_offset;
     res->Unmap(0, &written);
 }
 
@@ -194,6 +355,22 @@ size_t Buffer::size() const
     return buf_size;
 }
 
+uint64_t Buffer::offset() const
+{
+    return buf_offset;
+}
+
+D3D12_GPU_VIRTUAL_ADDRESS Buffer::gpu_virtual_address() const
+{
+    return res->GetGPUVirtualAddress() + buf_offset;
+}
+
+void copy_buffer(ID3D12GraphicsCommandList *cmd_list, Buffer &dst, Buffer &src)
+{
+    assert(dst.size() >= src.size());
+    cmd_list->CopyBufferRegion(dst.get(), dst.offset(), src.get(), src.offset(), src.size());
+}
+
 Texture2D Texture2D::default(ID3D12Device *device,
                              glm::uvec2 dims,
                              D3D12_RESOURCE_STATES state,
@@ -218,13 +395,32 @@ Texture2D Texture2D::default(ID3D12Device *device,
     t.rstate = state;
     t.rheap = D3D12_HEAP_TYPE_DEFAULT;
     t.format = img_format;
+    // Sized from the desc so tracking works for any format, not just those pixel_size knows
+    const D3D12_RESOURCE_ALLOCATION_INFO alloc_info =
+        device->GetResourceAllocationInfo(0, 1, &desc);
+    t.tracking = memory_tracker().track(
+        device, desc, D3D12_HEAP_TYPE_DEFAULT, state, alloc_info.SizeInBytes);
 
-    CHECK_ERR(device->CreateCommittedResource(&DEFAULT_HEAP_PROPS,
-                                              D3D12_HEAP_FLAG_NONE,
-                                              &desc,
-                                              state,
-                                              clear_value,
-                                              IID_PPV_ARGS(&t.res)));
+    HeapAllocator *allocator = resource_allocator();
+    const D3D12_RESOURCE_FLAGS committed_flags = D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET |
+                                                 D3D12_RESOURCE_FLAG_ALLOW_DEPTH_STENCIL |
+                                                 D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
+    if (allocator && !(flags & committed_flags)) {
+        t.placement = allocator->create_resource(device,
+                                                 HeapAllocator::POOL_TEXTURES,
+                                                 DEFAULT_HEAP_PROPS,
+                                                 desc,
+                                                 state,
+                                                 clear_value,
+                                                 t.res);
+    } else {
+        CHECK_ERR(device->CreateCommittedResource(&DEFAULT_HEAP_PROPS,
+                                                  D3D12_HEAP_FLAG_NONE,
+                                                  &desc,
+                                                  state,
+                                                  clear_value,
+                                                  IID_PPV_ARGS(&t.res)));
+    }
     return t;
 }
 
@@ -233,7 +429,7 @@ void Texture2D::readback(ID3D12GraphicsCommandList4 *cmd_list, Buffer &buf)
     D3D12_TEXTURE_COPY_LOCATION dst_desc = {0};
     dst_desc.pResource = buf.get();
     dst_desc.Type = D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT;
-    dst_desc.PlacedFootprint.Offset = 0;
+    dst_desc.PlacedFootprint.Offset = buf.offset();
     dst_desc.PlacedFootprint.Footprint.Format = format;
     dst_desc.PlacedFootprint.Footprint.Width = tdims.x;
     dst_desc.PlacedFootprint.Footprint.Height = tdims.y;
@@ -265,7 +461,7 @@ void Texture2D::upload(ID3D12GraphicsCommandList4 *cmd_list, Buffer &buf)
     D3D12_TEXTURE_COPY_LOCATION src_desc = {0};
     src_desc.pResource = buf.get();
     src_desc.Type = D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT;
-    src_desc.PlacedFootprint.Offset = 0;
+    src_desc.PlacedFootprint.Offset = buf.offset();
     src_desc.PlacedFootprint.Footprint.Format = format;
     src_desc.PlacedFootprint.Footprint.Width = tdims.x;
     src_desc.PlacedFootprint.Footprint.Height = tdims.y;
@@ -296,8 +492,15 @@ size_t Texture2D::pixel_size() const
         return 4;
     case DXGI_FORMAT_R32G32B32A32_FLOAT:
         return 16;
+    case DXGI_FORMAT_R32_UINT:
+    case DXGI_FORMAT_R32_FLOAT:
+        return 4;
     case DXGI_FORMAT_R16_UINT:
+    case DXGI_FORMAT_R16_UNORM:
+    case DXGI_FORMAT_R16_FLOAT:
         return 2;
+    case DXGI_FORMAT_R8_UNORM:
+        return 1;
     default:
         throw std::runtime_error("Unhandled format in pixel_size!");
         return -1;
@@ -314,4 +517,1129 @@ glm::uvec2 Texture2D::dims() const
     return tdims;
 }
 
+CommandContext::CommandContext(ID3D12Device5 *device,
+                               D3D12_COMMAND_LIST_TYPE type,
+                               uint32_t num_allocators)
+    : allocators(std::max(num_allocators, uint32_t(1))),
+      allocator_fence_values(allocators.size(), 0)
+{
+    CHECK_ERR(device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&fence)));
+    fence_evt = CreateEvent(nullptr, false, false, nullptr);
+
+    D3D12_COMMAND_QUEUE_DESC queue_desc = {};
+    queue_desc.Flags = D3D12_COMMAND_QUEUE_FLAG_NONE;
+    queue_desc.Type = type;
+    CHECK_ERR(device->CreateCommandQueue(&queue_desc, IID_PPV_ARGS(&queue)));
+    for (auto &allocator : allocators) {
+        CHECK_ERR(device->CreateCommandAllocator(type, IID_PPV_ARGS(&allocator)));
+    }
+
+    CHECK_ERR(device->CreateCommandList(
+        0, type, allocators[0].Get(), nullptr, IID_PPV_ARGS(&cmd_list)));
+    CHECK_ERR(cmd_list->Close());
+}
+
+CommandContext::~CommandContext()
+{
+    if (fence_evt) {
+        CloseHandle(fence_evt);
+    }
+}
+
+void CommandContext::begin(ID3D12PipelineState *pipeline_state)
+{
+    current_allocator = (current_allocator + 1) % allocators.size();
+    wait(allocator_fence_values[current_allocator]);
+
+    auto &allocator = allocators[current_allocator];
+    CHECK_ERR(allocator->Reset());
+    CHECK_ERR(cmd_list->Reset(allocator.Get(), pipeline_state));
+}
+
+void CommandContext::submit_and_sync()
+{
+    CHECK_ERR(cmd_list->Close());
+    ID3D12CommandList *cmd_lists = cmd_list.Get();
+    queue->ExecuteCommandLists(1, &cmd_lists);
+    sync();
+}
+
+uint64_t CommandContext::submit()
+{
+    CHECK_ERR(cmd_list->Close());
+    ID3D12CommandList *cmd_lists = cmd_list.Get();
+    queue->ExecuteCommandLists(1, &cmd_lists);
+
+    const uint64_t signal_val = fence_value++;
+    CHECK_ERR(queue->Signal(fence.Get(), signal_val));
+    allocator_fence_values[current_allocator] = signal_val;
+    return signal_val;
+}
+
+void CommandContext::sync()
+{
+    const uint64_t signal_val = fence_value++;
+    CHECK_ERR(queue->Signal(fence.Get(), signal_val));
+    wait(signal_val);
+}
+
+void CommandContext::wait(uint64_t value)
+{
+    if (fence->GetCompletedValue() < value) {
+        CHECK_ERR(fence->SetEventOnCompletion(value, fence_evt));
+        WaitForSingleObject(fence_evt, INFINITE);
+    }
+}
+
+void CommandContext::queue_wait(const CommandContext &other, uint64_t value)
+{
+    CHECK_ERR(queue->Wait(other.fence.Get(), value));
+}
+
+uint64_t HeapAllocatorStats::free_bytes() const
+{
+    return heap_bytes - allocated_bytes;
+}
+
+float HeapAllocatorStats::fragmentation() const
+{
+    const uint64_t free = free_bytes();
+    return free == 0 ? 0.f : 1.f - float(largest_free_block) / float(free);
+}
+
+float HeapAllocatorStats::waste() const
+{
+    return allocated_bytes == 0 ? 0.f
+                                : float(allocated_bytes - requested_bytes) / allocated_bytes;
+}
+
+struct HeapAllocator::Block {
+    ComPtr<ID3D12Heap> heap;
+    uint32_t max_order = 0;
+    // The offsets of the free blocks of each order, blocks of order k are 64KB << k bytes
+    std::vector<std::set<uint64_t>> free_lists;
+    uint64_t allocated_bytes = 0;
+    uint64_t requested_bytes = 0;
+    size_t num_allocations = 0;
+    std::mutex mutex;
+
+    static uint64_t order_size(uint32_t order);
+
+    Block(ID3D12Heap *heap, uint32_t max_order);
+
+    // Returns false if no free block of the order is left
+    bool allocate(uint32_t order, uint64_t requested, uint64_t &offset);
+
+    void release(uint64_t offset, uint32_t order, uint64_t requested);
+
+    uint64_t largest_free_block() const;
+};
+
+uint64_t HeapAllocator::Block::order_size(uint32_t order)
+{
+    return uint64_t(D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT) << order;
+}
+
+HeapAllocator::Block::Block(ID3D12Heap *heap, uint32_t max_order)
+    : heap(heap), max_order(max_order), free_lists(max_order + 1)
+{
+    free_lists[max_order].insert(0);
+}
+
+bool HeapAllocator::Block::allocate(uint32_t order, uint64_t requested, uint64_t &offset)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    uint32_t k = order;
+    while (k <= max_order && free_lists[k].empty()) {
+        ++k;
+    }
+    if (k > max_order) {
+        return false;
+    }
+    offset = *free_lists[k].begin();
+    free_lists[k].erase(free_lists[k].begin());
+    // Split the free block down to the order requested, freeing the upper halves
+    while (k > order) {
+        --k;
+        free_lists[k].insert(offset + order_size(k));
+    }
+    allocated_bytes += order_size(order);
+    requested_bytes += requested;
+    ++num_allocations;
+    return true;
+}
+
+void HeapAllocator::Block::release(uint64_t offset, uint32_t order, uint64_t requested)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    allocated_bytes -= order_size(order);
+    requested_bytes -= requested;
+    --num_allocations;
+    // Merge with the buddy block for as long as it's free as well
+    for (; order < max_order; ++order) {
+        auto buddy = free_lists[order].find(offset ^ order_size(order));
+        if (buddy == free_lists[order].end()) {
+            break;
+        }
+        free_lists[order].erase(buddy);
+        offset &= ~order_size(order);
+    }
+    free_lists[order].insert(offset);
+}
+
+uint64_t HeapAllocator::Block::largest_free_block() const
+{
+    for (int k = max_order; k >= 0; --k) {
+        if (!free_lists[k].empty()) {
+            return order_size(k);
+        }
+    }
+    return 0;
+}
+
+struct HeapAllocation {
+    std::shared_ptr<HeapAllocator::Block> block;
+    uint64_t offset = 0;
+    uint64_t requested = 0;
+    uint32_t order = 0;
+
+    ~HeapAllocation()
+    {
+        block->release(offset, order, requested);
+    }
+};
+
+struct HeapAllocator::Page {
+    ComPtr<ID3D12Resource> resource;
+    // The free ranges of the page by their offset, merged with their neighbors when released
+    std::map<uint64_t, uint64_t> free_ranges;
+    uint64_t allocated_bytes = 0;
+    uint64_t requested_bytes = 0;
+    size_t num_allocations = 0;
+    std::mutex mutex;
+
+    // Suballocations are aligned for placed texture footprints, which also covers the
+    // alignment of constant buffers
+    static const uint64_t alignment = D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT;
+
+    Page(ID3D12Resource *resource, uint64_t size);
+
+    // Take the first free range that fits, returns false if none is left
+    bool allocate(uint64_t nbytes, uint64_t requested, uint64_t &offset);
+
+    void release(uint64_t offset, uint64_t nbytes, uint64_t requested);
+
+    uint64_t largest_free_range() const;
+};
+
+HeapAllocator::Page::Page(ID3D12Resource *resource, uint64_t size) : resource(resource)
+{
+    free_ranges[0] = size;
+}
+
+bool HeapAllocator::Page::allocate(uint64_t nbytes, uint64_t requested, uint64_t &offset)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto fit = std::find_if(free_ranges.begin(),
+                            free_ranges.end(),
+                            [&](const std::pair<const uint64_t, uint64_t> &range) {
+                                return range.second >= nbytes;
+                            });
+    if (fit == free_ranges.end()) {
+        return false;
+    }
+    offset = fit->first;
+    const uint64_t remaining = fit->second - nbytes;
+    free_ranges.erase(fit);
+    if (remaining != 0) {
+        free_ranges[offset + nbytes] = remaining;
+    }
+    allocated_bytes += nbytes;
+    requested_bytes += requested;
+    ++num_allocations;
+    return true;
+}
+
+void HeapAllocator::Page::release(uint64_t offset, uint64_t nbytes, uint64_t requested)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    allocated_bytes -= nbytes;
+    requested_bytes -= requested;
+    --num_allocations;
+    auto next = free_ranges.lower_bound(offset);
+    if (next != free_ranges.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+            offset = prev->first;
+            nbytes += prev->second;
+            free_ranges.erase(prev);
+        }
+    }
+    if (next != free_ranges.end() && offset + nbytes == next->first) {
+        nbytes += next->second;
+        free_ranges.erase(next);
+    }
+    free_ranges[offset] = nbytes;
+}
+
+uint64_t HeapAllocator::Page::largest_free_range() const
+{
+    uint64_t largest = 0;
+    for (const auto &range : free_ranges) {
+        largest = std::max(largest, range.second);
+    }
+    return largest;
+}
+
+struct BufferSuballocation {
+    std::shared_ptr<HeapAllocator::Page> page;
+    uint64_t offset = 0;
+    uint64_t nbytes = 0;
+    uint64_t requested = 0;
+
+    ~BufferSuballocation()
+    {
+        page->release(offset, nbytes, requested);
+    }
+};
+
+static size_t heap_type_index(D3D12_HEAP_TYPE type)
+{
+    switch (type) {
+    case D3D12_HEAP_TYPE_DEFAULT:
+        return 0;
+    case D3D12_HEAP_TYPE_UPLOAD:
+        return 1;
+    case D3D12_HEAP_TYPE_READBACK:
+        return 2;
+    default:
+        throw std::runtime_error("Error: Unsupported heap type for the heap allocator");
+    }
+}
+
+static HeapAllocator *current_allocator = nullptr;
+
+void set_resource_allocator(HeapAllocator *allocator)
+{
+    current_allocator = allocator;
+}
+
+HeapAllocator *resource_allocator()
+{
+    return current_allocator;
+}
+
+const char *memory_category_name(MemoryCategory category)
+{
+    switch (category) {
+    case MEMORY_GEOMETRY:
+        return "Geometry";
+    case MEMORY_BLAS:
+        return "BLAS";
+    case MEMORY_BLAS_COMPACTED:
+        return "Compacted BLAS";
+    case MEMORY_TLAS:
+        return "TLAS";
+    case MEMORY_SCRATCH:
+        return "Scratch";
+    case MEMORY_INSTANCES:
+        return "Instances";
+    case MEMORY_RENDER_TARGETS:
+        return "Render Targets";
+    case MEMORY_TEXTURES:
+        return "Textures";
+    case MEMORY_BUFFERS:
+        return "Buffers";
+    case MEMORY_UPLOAD:
+        return "Upload";
+    case MEMORY_READBACK:
+        return "Readback";
+    default:
+        return "Unknown";
+    }
+}
+
+uint64_t MemoryCategoryStats::alignment_waste() const
+{
+    return current_bytes > requested_bytes ? current_bytes - requested_bytes : 0;
+}
+
+// The category of the innermost MemoryCategoryScope on the thread, -1 if there is none
+static thread_local int current_memory_category = -1;
+
+MemoryCategoryScope::MemoryCategoryScope(MemoryCategory category)
+    : prev(current_memory_category)
+{
+    current_memory_category = category;
+}
+
+MemoryCategoryScope::~MemoryCategoryScope()
+{
+    current_memory_category = prev;
+}
+
+struct TrackedAllocation {
+    MemoryTracker *tracker;
+    MemoryCategory category;
+    size_t heap;
+    uint64_t nbytes;
+    uint64_t requested;
+
+    TrackedAllocation(MemoryTracker *tracker,
+                      MemoryCategory category,
+                      size_t heap,
+                      uint64_t nbytes,
+                      uint64_t requested)
+        : tracker(tracker),
+          category(category),
+          heap(heap),
+          nbytes(nbytes),
+          requested(requested)
+    {
+    }
+
+    ~TrackedAllocation()
+    {
+        tracker->release(category, heap, nbytes, requested);
+    }
+};
+
+static MemoryCategory infer_memory_category(const D3D12_RESOURCE_DESC &desc,
+                                            D3D12_HEAP_TYPE heap_type,
+                                            D3D12_RESOURCE_STATES state)
+{
+    if (heap_type == D3D12_HEAP_TYPE_UPLOAD) {
+        return MEMORY_UPLOAD;
+    }
+    if (heap_type == D3D12_HEAP_TYPE_READBACK) {
+        return MEMORY_READBACK;
+    }
+    if (state == D3D12_RESOURCE_STATE_RAYTRACING_ACCELERATION_STRUCTURE) {
+        return MEMORY_BLAS;
+    }
+    if (desc.Dimension != D3D12_RESOURCE_DIMENSION_BUFFER) {
+        const D3D12_RESOURCE_FLAGS target_flags = D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET |
+                                                  D3D12_RESOURCE_FLAG_ALLOW_DEPTH_STENCIL |
+                                                  D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
+        return desc.Flags & target_flags ? MEMORY_RENDER_TARGETS : MEMORY_TEXTURES;
+    }
+    return MEMORY_BUFFERS;
+}
+
+std::shared_ptr<TrackedAllocation> MemoryTracker::track(ID3D12Device *device,
+                                                        const D3D12_RESOURCE_DESC &desc,
+                                                        D3D12_HEAP_TYPE heap_type,
+                                                        D3D12_RESOURCE_STATES state,
+                                                        uint64_t requested)
+{
+    const D3D12_RESOURCE_ALLOCATION_INFO info = device->GetResourceAllocationInfo(0, 1, &desc);
+    // The info reports UINT64_MAX if the desc is invalid, the creation will fail on its own
+    const uint64_t nbytes = info.SizeInBytes == UINT64_MAX ? requested : info.SizeInBytes;
+    return track(desc, heap_type, state, requested, nbytes);
+}
+
+std::shared_ptr<TrackedAllocation> MemoryTracker::track(const D3D12_RESOURCE_DESC &desc,
+                                                        D3D12_HEAP_TYPE heap_type,
+                                                        D3D12_RESOURCE_STATES state,
+                                                        uint64_t requested,
+                                                        uint64_t nbytes)
+{
+    // Staging memory is tagged by its heap regardless of the scope it's created in
+    const bool staging = heap_type != D3D12_HEAP_TYPE_DEFAULT;
+    const MemoryCategory category = current_memory_category >= 0 && !staging
+                                        ? MemoryCategory(current_memory_category)
+                                        : infer_memory_category(desc, heap_type, state);
+    const size_t heap = heap_type_index(heap_type);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    Totals &totals = categories[category];
+    totals.current += nbytes;
+    totals.peak = std::max(totals.peak, totals.current);
+    totals.requested += requested;
+    ++totals.count;
+    heap_bytes[heap] += nbytes;
+    total.current += nbytes;
+    total.peak = std::max(total.peak, total.current);
+    total.requested += requested;
+    ++total.count;
+    return std::make_shared<TrackedAllocation>(this, category, heap, nbytes, requested);
+}
+
+void MemoryTracker::release(MemoryCategory category,
+                            size_t heap,
+                            uint64_t nbytes,
+                            uint64_t requested)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Totals &totals = categories[category];
+    totals.current -= nbytes;
+    totals.requested -= requested;
+    --totals.count;
+    heap_bytes[heap] -= nbytes;
+    total.current -= nbytes;
+    total.requested -= requested;
+    --total.count;
+}
+
+MemoryTrackerStats MemoryTracker::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    MemoryTrackerStats stats;
+    for (size_t i = 0; i < NUM_MEMORY_CATEGORIES; ++i) {
+        stats.categories[i].current_bytes = categories[i].current;
+        stats.categories[i].peak_bytes = categories[i].peak;
+        stats.categories[i].requested_bytes = categories[i].requested;
+        stats.categories[i].num_resources = categories[i].count;
+    }
+    std::copy(heap_bytes, heap_bytes + 3, stats.heap_bytes);
+    stats.current_bytes = total.current;
+    stats.peak_bytes = total.peak;
+    return stats;
+}
+
+void MemoryTracker::reset_peaks()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &totals : categories) {
+        totals.peak = totals.current;
+    }
+    total.peak = total.current;
+}
+
+MemoryTracker &memory_tracker()
+{
+    static MemoryTracker tracker;
+    return tracker;
+}
+
+HeapAllocator::HeapAllocator(ID3D12Device *device, uint64_t size) : device(device)
+{
+    block_size = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT;
+    while (block_size < size) {
+        block_size *= 2;
+    }
+}
+
+HeapAllocator::~HeapAllocator()
+{
+    // Blocks are shared with their allocations so resources outliving the allocator keep
+    // their memory, the allocator just can't be used to create new ones
+    if (resource_allocator() == this) {
+        set_resource_allocator(nullptr);
+    }
+}
+
+std::shared_ptr<HeapAllocation> HeapAllocator::allocate(Pool pool,
+                                                        D3D12_HEAP_TYPE heap_type,
+                                                        uint64_t nbytes)
+{
+    uint32_t order = 0;
+    while (Block::order_size(order) < nbytes) {
+        ++order;
+    }
+    if (Block::order_size(order) > block_size / 4) {
+        return nullptr;
+    }
+
+    auto alloc = std::make_shared<HeapAllocation>();
+    alloc->requested = nbytes;
+    alloc->order = order;
+
+    auto &pool_blocks = blocks[pool][heap_type_index(heap_type)];
+    for (auto &b : pool_blocks) {
+        if (b->allocate(order, nbytes, alloc->offset)) {
+            alloc->block = b;
+            return alloc;
+        }
+    }
+
+    D3D12_HEAP_DESC desc = {0};
+    desc.SizeInBytes = block_size;
+    desc.Properties.Type = heap_type;
+    desc.Alignment = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT;
+    // Keep each pool to one resource category, as required on resource heap tier 1
+    desc.Flags = pool == POOL_TEXTURES ? D3D12_HEAP_FLAG_ALLOW_ONLY_NON_RT_DS_TEXTURES
+                                       : D3D12_HEAP_FLAG_ALLOW_ONLY_BUFFERS;
+    ComPtr<ID3D12Heap> heap;
+    CHECK_ERR(device->CreateHeap(&desc, IID_PPV_ARGS(&heap)));
+
+    uint32_t max_order = 0;
+    while (Block::order_size(max_order) < block_size) {
+        ++max_order;
+    }
+    pool_blocks.push_back(std::make_shared<Block>(heap.Get(), max_order));
+    pool_blocks.back()->allocate(order, nbytes, alloc->offset);
+    alloc->block = pool_blocks.back();
+    return alloc;
+}
+
+std::shared_ptr<HeapAllocation> HeapAllocator::create_resource(
+    ID3D12Device *dev,
+    Pool pool,
+    const D3D12_HEAP_PROPERTIES &props,
+    const D3D12_RESOURCE_DESC &desc,
+    D3D12_RESOURCE_STATES state,
+    const D3D12_CLEAR_VALUE *clear_value,
+    ComPtr<ID3D12Resource> &resource)
+{
+    std::shared_ptr<HeapAllocation> alloc;
+    if (dev == device.Get()) {
+        const D3D12_RESOURCE_ALLOCATION_INFO info =
+            device->GetResourceAllocationInfo(0, 1, &desc);
+        std::lock_guard<std::mutex> lock(mutex);
+        alloc = allocate(pool, props.Type, info.SizeInBytes);
+    }
+    if (!alloc) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++num_committed[pool];
+        }
+        CHECK_ERR(dev->CreateCommittedResource(&props,
+                                               D3D12_HEAP_FLAG_NONE,
+                                               &desc,
+                                               state,
+                                               clear_value,
+                                               IID_PPV_ARGS(&resource)));
+        return nullptr;
+    }
+    CHECK_ERR(device->CreatePlacedResource(alloc->block->heap.Get(),
+                                           alloc->offset,
+                                           &desc,
+                                           state,
+                                           clear_value,
+                                           IID_PPV_ARGS(&resource)));
+    return alloc;
+}
+
+std::shared_ptr<BufferSuballocation> HeapAllocator::suballocate(
+    ID3D12Device *dev,
+    const D3D12_HEAP_PROPERTIES &props,
+    const D3D12_RESOURCE_DESC &desc,
+    D3D12_RESOURCE_STATES state,
+    ComPtr<ID3D12Resource> &resource)
+{
+    // Pages are created in the only state upload and readback resources can be in
+    const bool is_upload =
+        props.Type == D3D12_HEAP_TYPE_UPLOAD && state == D3D12_RESOURCE_STATE_GENERIC_READ;
+    const bool is_readback =
+        props.Type == D3D12_HEAP_TYPE_READBACK && state == D3D12_RESOURCE_STATE_COPY_DEST;
+    if (dev != device.Get() || !(is_upload || is_readback) ||
+        desc.Dimension != D3D12_RESOURCE_DIMENSION_BUFFER ||
+        desc.Flags != D3D12_RESOURCE_FLAG_NONE || desc.Width > max_suballocation_size) {
+        return nullptr;
+    }
+
+    auto alloc = std::make_shared<BufferSuballocation>();
+    alloc->requested = desc.Width;
+    alloc->nbytes = align_to(desc.Width, Page::alignment);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &heap_pages = pages[is_upload ? 0 : 1];
+    for (auto &p : heap_pages) {
+        if (p->allocate(alloc->nbytes, alloc->requested, alloc->offset)) {
+            alloc->page = p;
+            resource = p->resource;
+            return alloc;
+        }
+    }
+
+    D3D12_RESOURCE_DESC page_desc = desc;
+    page_desc.Width = page_size;
+    ComPtr<ID3D12Resource> page_resource;
+    CHECK_ERR(device->CreateCommittedResource(&props,
+                                              D3D12_HEAP_FLAG_NONE,
+                                              &page_desc,
+                                              state,
+                                              nullptr,
+                                              IID_PPV_ARGS(&page_resource)));
+    heap_pages.push_back(std::make_shared<Page>(page_resource.Get(), page_size));
+    heap_pages.back()->allocate(alloc->nbytes, alloc->requested, alloc->offset);
+    alloc->page = heap_pages.back();
+    resource = page_resource;
+    return alloc;
+}
+
+HeapAllocatorStats HeapAllocator::stats(Pool pool) const
+{
+    std::lock_guard<std::mutex> allocator_lock(mutex);
+    HeapAllocatorStats stats;
+    if (pool == POOL_SMALL_BUFFERS) {
+        for (const auto &heap_pages : pages) {
+            for (const auto &p : heap_pages) {
+                std::lock_guard<std::mutex> lock(p->mutex);
+                stats.heap_bytes += page_size;
+                stats.allocated_bytes += p->allocated_bytes;
+                stats.requested_bytes += p->requested_bytes;
+                stats.largest_free_block =
+                    std::max(stats.largest_free_block, p->largest_free_range());
+                stats.num_allocations += p->num_allocations;
+                ++stats.num_heaps;
+            }
+        }
+        return stats;
+    }
+    stats.num_committed = num_committed[pool];
+    for (const auto &heap_blocks : blocks[pool]) {
+        for (const auto &b : heap_blocks) {
+            std::lock_guard<std::mutex> lock(b->mutex);
+            stats.heap_bytes += block_size;
+            stats.allocated_bytes += b->allocated_bytes;
+            stats.requested_bytes += b->requested_bytes;
+            stats.largest_free_block =
+                std::max(stats.largest_free_block, b->largest_free_block());
+            stats.num_allocations += b->num_allocations;
+            ++stats.num_heaps;
+        }
+    }
+    return stats;
+}
+
+HeapAllocatorStats HeapAllocator::stats() const
+{
+    HeapAllocatorStats total;
+    for (int i = 0; i < NUM_POOLS; ++i) {
+        const HeapAllocatorStats s = stats(Pool(i));
+        total.heap_bytes += s.heap_bytes;
+        total.allocated_bytes += s.allocated_bytes;
+        total.requested_bytes += s.requested_bytes;
+        total.largest_free_block = std::max(total.largest_free_block, s.largest_free_block);
+        total.num_heaps += s.num_heaps;
+        total.num_allocations += s.num_allocations;
+        total.num_committed += s.num_committed;
+    }
+    return total;
+}
+
+UploadRing::UploadRing(ID3D12Device *device, size_t capacity)
+    : buf(Buffer::upload(device, capacity, D3D12_RESOURCE_STATE_GENERIC_READ))
+{
+    // Upload heaps can stay mapped for their lifetime, we never read back from it
+    D3D12_RANGE read_range = {0};
+    mapping = static_cast<uint8_t *>(buf.map(read_range));
+}
+
+bool UploadRing::try_allocate(size_t size, size_t alignment, Allocation &alloc)
+{
+    const size_t cap = capacity();
+    if (size == 0 || size > cap || used == cap) {
+        return false;
+    }
+    if (used == 0) {
+        head = 0;
+        tail = 0;
+    }
+
+    // The free space is [head, cap) and [0, tail) when head is ahead of tail,
+    // otherwise it's just [head, tail)
+    size_t offset = align_to(head, alignment);
+    if (head >= tail) {
+        if (offset + size > cap) {
+            // Wrap around to the beginning, the skipped space at the end is counted as used
+            if (size > tail) {
+                return false;
+            }
+            offset = 0;
+        }
+    } else if (offset + size > tail) {
+        return false;
+    }
+
+    const size_t allocated = offset >= head ? offset + size - head : cap - head + size;
+    head = offset + size;
+    if (head == cap) {
+        head = 0;
+    }
+    used += allocated;
+    pending += allocated;
+
+    alloc.resource = buf.get();
+    alloc.offset = buf.offset() + offset;
+    alloc.data = mapping + offset;
+    alloc.gpu_address = buf.gpu_virtual_address() + offset;
+    return true;
+}
+
+UploadRing::Allocation UploadRing::allocate(CommandContext &ctx,
+                                            size_t size,
+                                            size_t alignment)
+{
+    Allocation alloc;
+    if (try_allocate(size, alignment, alloc)) {
+        return alloc;
+    }
+
+    submit_and_sync(ctx);
+    ctx.begin();
+    if (!try_allocate(size, alignment, alloc)) {
+        std::cout << "Upload of " << size << "b does not fit in the upload ring of "
+                  << capacity() << "b\n";
+        throw std::runtime_error("Upload does not fit in upload ring");
+    }
+    return alloc;
+}
+
+void UploadRing::upload(
+    CommandContext &ctx, Buffer &dst, const void *data, size_t size, size_t dst_offset)
+{
+    // Use chunks of at most half the ring so one chunk can be written while another
+    // is still pending
+    const size_t chunk_size = std::max(capacity() / 2, size_t(1));
+    const uint8_t *src = static_cast<const uint8_t *>(data);
+    for (size_t copied = 0; copied < size;) {
+        const size_t n = std::min(chunk_size, size - copied);
+        Allocation alloc = allocate(ctx, n);
+        std::memcpy(alloc.data, src + copied, n);
+        ctx.cmd_list->CopyBufferRegion(
+            dst.get(), dst_offset + copied, alloc.resource, alloc.offset, n);
+        copied += n;
+    }
+}
+
+void UploadRing::retire(uint64_t fence_value)
+{
+    if (pending != 0) {
+        in_flight.emplace_back(fence_value, pending);
+        pending = 0;
+    }
+}
+
+void UploadRing::reclaim(uint64_t completed_fence_value)
+{
+    const size_t cap = capacity();
+    while (!in_flight.empty() && in_flight.front().first <= completed_fence_value) {
+        tail = (tail + in_flight.front().second) % cap;
+        used -= in_flight.front().second;
+        in_flight.pop_front();
+    }
+}
+
+void UploadRing::submit_and_sync(CommandContext &ctx)
+{
+    // The context signals its current fence value when syncing
+    retire(ctx.fence_value);
+    ctx.submit_and_sync();
+    reclaim(ctx.fence->GetCompletedValue());
+}
+
+size_t UploadRing::capacity() const
+{
+    return buf.size();
+}
+
+AsyncReadback::AsyncReadback(ID3D12Device *device, uint32_t num_slots)
+    : device(device), slots(std::max(num_slots, uint32_t(1)))
+{
+    worker = std::thread([this]() { run_worker(); });
+}
+
+AsyncReadback::~AsyncReadback()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return pending == 0; });
+        stop = true;
+    }
+    cv.notify_all();
+    worker.join();
+}
+
+void AsyncReadback::read_back(CommandContext &ctx, Texture2D &tex, Callback callback)
+{
+    const glm::uvec2 dims = tex.dims();
+    const size_t readback_size = tex.linear_row_pitch() * dims.y;
+
+    size_t slot_id = 0;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() {
+            return std::any_of(
+                slots.begin(), slots.end(), [](const Slot &s) { return !s.busy; });
+        });
+        slot_id = std::distance(
+            slots.begin(),
+            std::find_if(slots.begin(), slots.end(), [](const Slot &s) { return !s.busy; }));
+        slots[slot_id].busy = true;
+    }
+
+    // The worker doesn't touch a slot while it's free, so it can be grown without the lock
+    Slot &slot = slots[slot_id];
+    if (slot.buf.size() < readback_size) {
+        if (slot.mapping) {
+            slot.buf.unmap();
+        }
+        slot.buf = Buffer::readback(device, readback_size, D3D12_RESOURCE_STATE_COPY_DEST);
+        slot.mapping = static_cast<const uint8_t *>(slot.buf.map());
+    }
+
+    const D3D12_RESOURCE_STATES prev_state = tex.state();
+    ctx.begin();
+    {
+        auto b = barrier_transition(tex, D3D12_RESOURCE_STATE_COPY_SOURCE);
+        ctx.cmd_list->ResourceBarrier(1, &b);
+    }
+    tex.readback(ctx.cmd_list.Get(), slot.buf);
+    {
+        auto b = barrier_transition(tex, prev_state);
+        ctx.cmd_list->ResourceBarrier(1, &b);
+    }
+
+    Job job;
+    job.slot = slot_id;
+    job.fence = ctx.fence;
+    job.fence_value = ctx.submit();
+    job.dims = dims;
+    job.row_pitch = tex.linear_row_pitch();
+    job.row_size = dims.x * tex.pixel_size();
+    job.callback = std::move(callback);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+        ++pending;
+    }
+    cv.notify_all();
+}
+
+void AsyncReadback::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&]() { return pending == 0; });
+    if (error) {
+        std::exception_ptr e = error;
+        error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+double AsyncReadback::busy_ms()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return worker_ms;
+}
+
+void AsyncReadback::run_worker()
+{
+    HANDLE fence_evt = CreateEvent(nullptr, false, false, nullptr);
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return stop || !jobs.empty(); });
+            if (jobs.empty()) {
+                break;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        if (job.fence->GetCompletedValue() < job.fence_value) {
+            job.fence->SetEventOnCompletion(job.fence_value, fence_evt);
+            WaitForSingleObject(fence_evt, INFINITE);
+        }
+        const auto start = std::chrono::steady_clock::now();
+
+        // Copy the rows out of the pitch-aligned readback buffer and free up the slot before
+        // running the callback, so the next readback can be copied while it runs
+        std::vector<uint8_t> pixels(job.row_size * job.dims.y, 0);
+        const uint8_t *data = slots[job.slot].mapping;
+        for (uint32_t y = 0; y < job.dims.y; ++y) {
+            std::memcpy(
+                pixels.data() + y * job.row_size, data + y * job.row_pitch, job.row_size);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            slots[job.slot].busy = false;
+        }
+        cv.notify_all();
+
+        std::exception_ptr callback_error;
+        try {
+            job.callback(pixels);
+        } catch (...) {
+            callback_error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (callback_error && !error) {
+                error = callback_error;
+            }
+            worker_ms += std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+            --pending;
+        }
+        cv.notify_all();
+    }
+    CloseHandle(fence_evt);
+}
+
+const uint32_t GpuProfiler::invalid_region;
+const size_t GpuProfiler::history_size;
+
+double GpuProfiler::RegionStats::last_ms() const
+{
+    return history.empty() ? 0.0 : history.back();
+}
+
+double GpuProfiler::RegionStats::average_ms() const
+{
+    if (history.empty()) {
+        return 0.0;
+    }
+    return std::accumulate(history.begin(), history.end(), 0.0) / history.size();
+}
+
+double GpuProfiler::RegionStats::max_ms() const
+{
+    if (history.empty()) {
+        return 0.0;
+    }
+    return *std::max_element(history.begin(), history.end());
+}
+
+GpuProfiler::GpuProfiler(ID3D12Device *device,
+                         ID3D12CommandQueue *queue,
+                         uint32_t max_regions,
+                         uint32_t num_slots,
+                         const std::string &trace_name)
+    : queue(queue), max_regions(max_regions), trace_name(trace_name), slots(num_slots)
+{
+    // Each region has a start and end timestamp
+    const uint32_t num_queries = 2 * max_regions * num_slots;
+    D3D12_QUERY_HEAP_DESC heap_desc = {0};
+    heap_desc.Type = D3D12_QUERY_HEAP_TYPE_TIMESTAMP;
+    heap_desc.Count = num_queries;
+    CHECK_ERR(device->CreateQueryHeap(&heap_desc, IID_PPV_ARGS(&query_heap)));
+
+    readback = Buffer::readback(
+        device, num_queries * sizeof(uint64_t), D3D12_RESOURCE_STATE_COPY_DEST);
+
+    uint64_t frequency = 0;
+    CHECK_ERR(queue->GetTimestampFrequency(&frequency));
+    ms_per_tick = 1000.0 / frequency;
+}
+
+uint32_t GpuProfiler::begin(ID3D12GraphicsCommandList *cmd_list, const std::string &name)
+{
+    if (!query_heap) {
+        return invalid_region;
+    }
+    Slot &slot = slots[current];
+    if (slot.resolved || slot.names.size() == max_regions) {
+        return invalid_region;
+    }
+    const uint32_t region = current * max_regions + slot.names.size();
+    slot.names.push_back(name);
+    cmd_list->EndQuery(query_heap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, 2 * region);
+    return region;
+}
+
+void GpuProfiler::end(ID3D12GraphicsCommandList *cmd_list, uint32_t region)
+{
+    if (region == invalid_region) {
+        return;
+    }
+    cmd_list->EndQuery(query_heap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, 2 * region + 1);
+}
+
+void GpuProfiler::resolve(ID3D12GraphicsCommandList *cmd_list, uint64_t fence_value)
+{
+    if (!query_heap) {
+        return;
+    }
+    Slot &slot = slots[current];
+    if (slot.resolved || slot.names.empty()) {
+        return;
+    }
+    const uint32_t first_query = 2 * current * max_regions;
+    cmd_list->ResolveQueryData(query_heap.Get(),
+                               D3D12_QUERY_TYPE_TIMESTAMP,
+                               first_query,
+                               2 * slot.names.size(),
+                               readback.get(),
+                               readback.offset() + first_query * sizeof(uint64_t));
+    slot.fence_value = fence_value;
+    slot.resolved = true;
+    current = (current + 1) % slots.size();
+}
+
+void GpuProfiler::read_back(uint64_t completed_fence_value)
+{
+    // The trace time of the GPU timestamp calibrated against, from the QPC value the
+    // calibration returns and how long ago it was taken
+    uint64_t calibration_ticks = 0;
+    double calibration_us = 0.0;
+    const bool tracing = query_heap && trace_enabled();
+    if (tracing) {
+        uint64_t cpu_ticks = 0;
+        CHECK_ERR(queue->GetClockCalibration(&calibration_ticks, &cpu_ticks));
+        LARGE_INTEGER now, frequency;
+        QueryPerformanceCounter(&now);
+        QueryPerformanceFrequency(&frequency);
+        calibration_us = trace_now_us() - double(int64_t(now.QuadPart - cpu_ticks)) * 1e6 /
+                                              frequency.QuadPart;
+        if (trace_track == 0xffffffff) {
+            trace_track = trace_add_track(trace_name);
+        }
+    }
+
+    // Go from the oldest slot to the newest so the history stays in order
+    for (size_t i = 1; i <= slots.size(); ++i) {
+        const size_t s = (current + i) % slots.size();
+        Slot &slot = slots[s];
+        if (!slot.resolved || slot.fence_value > completed_fence_value) {
+            continue;
+        }
+
+        const size_t first_query = 2 * s * max_regions;
+        D3D12_RANGE read_range = {0};
+        read_range.Begin = first_query * sizeof(uint64_t);
+        read_range.End = read_range.Begin + 2 * slot.names.size() * sizeof(uint64_t);
+        const uint64_t *timestamps = static_cast<const uint64_t *>(readback.map(read_range));
+        for (size_t j = 0; j < slot.names.size(); ++j) {
+            const uint64_t start = timestamps[first_query + 2 * j];
+            const uint64_t end = timestamps[first_query + 2 * j + 1];
+            record_time(slot.names[j], end > start ? (end - start) * ms_per_tick : 0.0);
+            if (tracing) {
+                const double start_us =
+                    calibration_us +
+                    double(int64_t(start - calibration_ticks)) * 1e3 * ms_per_tick;
+                const double end_us =
+                    start_us + double(end > start ? end - start : 0) * 1e3 * ms_per_tick;
+                trace_record_track(trace_track, slot.names[j], start_us, end_us);
+            }
+        }
+        D3D12_RANGE written = {0};
+        readback.unmap(written);
+
+        slot.names.clear();
+        slot.resolved = false;
+    }
+}
+
+const std::vector<GpuProfiler::RegionStats> &GpuProfiler::stats() const
+{
+    return region_stats;
+}
+
+void GpuProfiler::clear()
+{
+    region_stats.clear();
+}
+
+void GpuProfiler::record_time(const std::string &name, double ms)
+{
+    auto fnd = std::find_if(region_stats.begin(),
+                            region_stats.end(),
+                            [&](const RegionStats &r) { return r.name == name; });
+    if (fnd == region_stats.end()) {
+        region_stats.push_back(RegionStats());
+        fnd = region_stats.end() - 1;
+        fnd->name = name;
+    }
+    fnd->history.push_back(ms);
+    if (fnd->history.size() > history_size) {
+        fnd->history.pop_front();
+    }
+}
+
 }
@@ -1,6 +1,17 @@
 #pragma once
 
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 #include <d3d12.h>
 #include <dxgi1_4.h>
 #include <wrl.h>
@@ -24,6 +35,32 @@ extern const D3D12_HEAP_PROPERTIES UPLOAD_HEAP_PROPS;
 extern const D3D12_HEAP_PROPERTIES DEFAULT_HEAP_PROPS;
 extern const D3D12_HEAP_PROPERTIES READBACK_HEAP_PROPS;
 
+// Create a D3D12 device on the first hardware adapter supporting DXR 1.1, or the default
+// adapter if none do, enabling the debug layer in debug builds. Throws if no device could be
+// created
+Microsoft::WRL::ComPtr<ID3D12Device5> create_device();
+
+// Create a D3D12 device on each hardware adapter that supports it, in the adapter order
+// DXGI enumerates them, so the first is the default adapter's
+std::vector<Microsoft::WRL::ComPtr<ID3D12Device5>> create_devices();
+
+// Query the OS provided video memory budget and the process' usage on the device's adapter,
+// zeroed if they can't be queried
+DXGI_QUERY_VIDEO_MEMORY_INFO video_memory_info(ID3D12Device *device);
+
+// Query the video memory the process can still allocate on the device's adapter before
+// exceeding the OS provided budget. Returns UINT64_MAX if the budget can't be queried
+uint64_t available_video_memory(ID3D12Device *device);
+
+// Query the video memory the process is using on the device's adapter, 0 if it can't be
+uint64_t video_memory_usage(ID3D12Device *device);
+
+// Get the description of the device's adapter, zeroed if it can't be queried
+DXGI_ADAPTER_DESC1 adapter_desc(ID3D12Device *device);
+
+// Get the adapter's user mode driver version as "a.b.c.d", empty if it can't be queried
+std::string driver_version(ID3D12Device *device);
+
 // Convenience for making resource transition barriers
 D3D12_RESOURCE_BARRIER barrier_transition(ID3D12Resource *res,
                                           D3D12_RESOURCE_STATES before,
@@ -36,8 +73,17 @@ D3D12_RESOURCE_BARRIER barrier_transition(Microsoft::WRL::ComPtr<ID3D12Resource>
 D3D12_RESOURCE_BARRIER barrier_uav(ID3D12Resource *res);
 D3D12_RESOURCE_BARRIER barrier_uav(Microsoft::WRL::ComPtr<ID3D12Resource> &res);
 
+struct HeapAllocation;
+struct BufferSuballocation;
+struct TrackedAllocation;
+
 class Resource {
 protected:
+    // The heap memory of a placed resource, declared before res so the resource is released
+    // before its memory is returned to the heap. Null for committed resources
+    std::shared_ptr<HeapAllocation> placement;
+    // The resource's entry in the memory tracker, removed when the last copy is released
+    std::shared_ptr<TrackedAllocation> tracking;
     Microsoft::WRL::ComPtr<ID3D12Resource> res = nullptr;
     D3D12_HEAP_TYPE rheap;
     D3D12_RESOURCE_STATES rstate;
@@ -61,6 +107,10 @@ D3D12_RESOURCE_BARRIER barrier_uav(Resource &res);
 
 class Buffer : public Resource {
     size_t buf_size = 0;
+    // The range of a shared page buffer the buffer occupies if it was suballocated, null if
+    // the buffer is a resource of its own
+    std::shared_ptr<BufferSuballocation> suballocation;
+    uint64_t buf_offset = 0;
 
     static D3D12_RESOURCE_DESC res_desc(size_t nbytes, D3D12_RESOURCE_FLAGS flags);
 
@@ -98,8 +148,16 @@ public:
     void unmap(D3D12_RANGE written);
 
     size_t size() const;
+    // The offset of the buffer in its resource, non-zero if it was suballocated from a
+    // shared page buffer. Copies and placed footprints must start at this offset
+    uint64_t offset() const;
+    D3D12_GPU_VIRTUAL_ADDRESS gpu_virtual_address() const;
 };
 
+// Copy the source buffer to the start of the destination buffer, which must be at least as
+// large. Use this instead of CopyResource, which can't copy suballocated buffers
+void copy_buffer(ID3D12GraphicsCommandList *cmd_list, Buffer &dst, Buffer &src);
+
 class Texture2D : public Resource {
     glm::uvec2 tdims = glm::uvec2(0);
     DXGI_FORMAT format;
@@ -127,4 +185,464 @@ public:
     glm::uvec2 dims() const;
 };
 
+struct HeapAllocatorStats {
+    // Total size of the heaps created
+    uint64_t heap_bytes = 0;
+    // Bytes handed out to resources, after rounding up to the allocator's block sizes
+    uint64_t allocated_bytes = 0;
+    // Bytes the resources actually required
+    uint64_t requested_bytes = 0;
+    // The largest allocation which could still be placed without creating a new heap
+    uint64_t largest_free_block = 0;
+    size_t num_heaps = 0;
+    size_t num_allocations = 0;
+    // Resources too large to place in the heaps which were committed instead
+    size_t num_committed = 0;
+
+    uint64_t free_bytes() const;
+    // The fraction of the free memory outside the largest free block
+    float fragmentation() const;
+    // The fraction of the allocated memory lost to rounding up allocations
+    float waste() const;
+};
+
+/* Places resources in large ID3D12Heap blocks instead of creating a committed resource,
+ * and with it an implicit heap, for each one. Resources are placed in one of a few pools,
+ * each holding one kind of resource and keeping separate blocks per heap type. Each block
+ * is split up with a buddy allocator at the 64KB placement alignment. BVHs get a pool of
+ * their own, so they're packed together rather than interleaved with the scratch and
+ * staging buffers created and released around them. Resources larger than a quarter of a
+ * block are still committed. Upload and readback buffers of up to 256KB aren't resources of
+ * their own, they're suballocated as 512 byte aligned ranges of 4MB page buffers in the
+ * small buffer pool, since even a placed resource takes at least 64KB. Default heap buffers
+ * can't share resources as they're transitioned on their own. Resources can be created
+ * from multiple threads.
+ */
+class HeapAllocator {
+public:
+    enum Pool { POOL_BUFFERS, POOL_BVHS, POOL_TEXTURES, POOL_SMALL_BUFFERS, NUM_POOLS };
+
+    static const uint64_t default_block_size = 64 * 1024 * 1024;
+    static const uint64_t page_size = 4 * 1024 * 1024;
+    static const uint64_t max_suballocation_size = 256 * 1024;
+
+    struct Block;
+    struct Page;
+
+private:
+    Microsoft::WRL::ComPtr<ID3D12Device> device;
+    uint64_t block_size = 0;
+    // The blocks of each pool, for the default, upload and readback heap types. The small
+    // buffer pool has no blocks, just pages
+    std::vector<std::shared_ptr<Block>> blocks[NUM_POOLS][3];
+    // The page buffers of the small buffer pool, for the upload and readback heap types
+    std::vector<std::shared_ptr<Page>> pages[2];
+    size_t num_committed[NUM_POOLS] = {0};
+    // Guards the pools' block lists and counts, each block guards its own allocations
+    mutable std::mutex mutex;
+
+    std::shared_ptr<HeapAllocation> allocate(Pool pool,
+                                             D3D12_HEAP_TYPE heap_type,
+                                             uint64_t nbytes);
+
+public:
+    // The block size is rounded up to a power of two multiple of 64KB
+    HeapAllocator(ID3D12Device *device, uint64_t block_size = default_block_size);
+    ~HeapAllocator();
+
+    HeapAllocator(const HeapAllocator &) = delete;
+    HeapAllocator &operator=(const HeapAllocator &) = delete;
+
+    /* Create the resource as a placed resource in the pool, or as a committed resource if
+     * it's too large or for a different device. Returns the allocation the resource must
+     * keep alive to hold on to its memory, or null if the resource was committed
+     */
+    std::shared_ptr<HeapAllocation> create_resource(
+        ID3D12Device *device,
+        Pool pool,
+        const D3D12_HEAP_PROPERTIES &props,
+        const D3D12_RESOURCE_DESC &desc,
+        D3D12_RESOURCE_STATES state,
+        const D3D12_CLEAR_VALUE *clear_value,
+        Microsoft::WRL::ComPtr<ID3D12Resource> &resource);
+
+    /* Suballocate the buffer from a page buffer of the small buffer pool, if it's an upload
+     * buffer in the generic read state or a readback buffer in the copy dest state of at
+     * most max_suballocation_size, without flags and for the allocator's device. The page
+     * is returned in resource, the buffer starting at the allocation's offset. Returns null
+     * if the buffer can't be suballocated
+     */
+    std::shared_ptr<BufferSuballocation> suballocate(
+        ID3D12Device *device,
+        const D3D12_HEAP_PROPERTIES &props,
+        const D3D12_RESOURCE_DESC &desc,
+        D3D12_RESOURCE_STATES state,
+        Microsoft::WRL::ComPtr<ID3D12Resource> &resource);
+
+    HeapAllocatorStats stats(Pool pool) const;
+    // The stats combined over all pools
+    HeapAllocatorStats stats() const;
+};
+
+/* Set the allocator Buffer and Texture2D create their resources through, or null to
+ * create committed resources. Default heap buffers with unordered access, other than BVHs,
+ * and render target or unordered access textures are always committed, since the bake
+ * relies on them starting out zeroed or they must be cleared before use when placed.
+ * The allocator unregisters itself when destroyed
+ */
+void set_resource_allocator(HeapAllocator *allocator);
+HeapAllocator *resource_allocator();
+
+enum MemoryCategory {
+    MEMORY_GEOMETRY,
+    MEMORY_BLAS,
+    MEMORY_BLAS_COMPACTED,
+    MEMORY_TLAS,
+    MEMORY_SCRATCH,
+    MEMORY_INSTANCES,
+    MEMORY_RENDER_TARGETS,
+    MEMORY_TEXTURES,
+    MEMORY_BUFFERS,
+    MEMORY_UPLOAD,
+    MEMORY_READBACK,
+    NUM_MEMORY_CATEGORIES
+};
+
+const char *memory_category_name(MemoryCategory category);
+
+struct MemoryCategoryStats {
+    // Bytes the live resources occupy, as reported by GetResourceAllocationInfo
+    uint64_t current_bytes = 0;
+    uint64_t peak_bytes = 0;
+    // Bytes the live resources were asked to hold
+    uint64_t requested_bytes = 0;
+    size_t num_resources = 0;
+
+    // The bytes lost to the resources' size and placement alignment
+    uint64_t alignment_waste() const;
+};
+
+struct MemoryTrackerStats {
+    std::array<MemoryCategoryStats, NUM_MEMORY_CATEGORIES> categories;
+    // The current bytes in the default, upload and readback heaps
+    uint64_t heap_bytes[3] = {0};
+    uint64_t current_bytes = 0;
+    // The peak of the total over all categories, which can be lower than the sum of the
+    // categories' peaks since they're not all reached at once
+    uint64_t peak_bytes = 0;
+};
+
+/* Accounts for the memory of every resource Buffer and Texture2D create, tagged with the
+ * category of the MemoryCategoryScope active on the creating thread. Without a scope the
+ * category is inferred from the state and flags of the resource, upload and readback heap
+ * resources are always tagged by their heap. The totals are kept over all devices.
+ * Resources can be tracked and released from multiple threads
+ */
+class MemoryTracker {
+    struct Totals {
+        uint64_t current = 0;
+        uint64_t peak = 0;
+        uint64_t requested = 0;
+        size_t count = 0;
+    };
+
+    Totals categories[NUM_MEMORY_CATEGORIES];
+    uint64_t heap_bytes[3] = {0};
+    Totals total;
+    mutable std::mutex mutex;
+
+    friend struct TrackedAllocation;
+
+    void release(MemoryCategory category, size_t heap, uint64_t nbytes, uint64_t requested);
+
+public:
+    std::shared_ptr<TrackedAllocation> track(ID3D12Device *device,
+                                             const D3D12_RESOURCE_DESC &desc,
+                                             D3D12_HEAP_TYPE heap_type,
+                                             D3D12_RESOURCE_STATES state,
+                                             uint64_t requested);
+    // Track a resource occupying nbytes, for buffers suballocated from a shared resource
+    std::shared_ptr<TrackedAllocation> track(const D3D12_RESOURCE_DESC &desc,
+                                             D3D12_HEAP_TYPE heap_type,
+                                             D3D12_RESOURCE_STATES state,
+                                             uint64_t requested,
+                                             uint64_t nbytes);
+
+    MemoryTrackerStats stats() const;
+    // Restart the peaks from the current usage, to measure the peak of a following phase
+    void reset_peaks();
+};
+
+MemoryTracker &memory_tracker();
+
+/* Tag the resources created on this thread while the scope is alive with the category.
+ * Scopes nest, restoring the enclosing scope's category when they end
+ */
+class MemoryCategoryScope {
+    int prev;
+
+public:
+    MemoryCategoryScope(MemoryCategory category);
+    ~MemoryCategoryScope();
+
+    MemoryCategoryScope(const MemoryCategoryScope &) = delete;
+    MemoryCategoryScope &operator=(const MemoryCategoryScope &) = delete;
+};
+
+/* A command queue with a command list, a small ring of command allocators and a fence to
+ * synchronize the CPU with the work submitted to the queue. Each begin moves on to the next
+ * allocator, so work submitted without waiting can still be in flight while the next
+ * command list is recorded
+ */
+struct CommandContext {
+    Microsoft::WRL::ComPtr<ID3D12CommandQueue> queue;
+    std::vector<Microsoft::WRL::ComPtr<ID3D12CommandAllocator>> allocators;
+    Microsoft::WRL::ComPtr<ID3D12GraphicsCommandList4> cmd_list;
+
+    Microsoft::WRL::ComPtr<ID3D12Fence> fence;
+    uint64_t fence_value = 1;
+    HANDLE fence_evt = nullptr;
+    // The allocator being recorded to and the fence value of the last submission of each
+    size_t current_allocator = 0;
+    std::vector<uint64_t> allocator_fence_values;
+
+    CommandContext(ID3D12Device5 *device,
+                   D3D12_COMMAND_LIST_TYPE type = D3D12_COMMAND_LIST_TYPE_DIRECT,
+                   uint32_t num_allocators = 2);
+
+    ~CommandContext();
+
+    CommandContext(const CommandContext &) = delete;
+    CommandContext &operator=(const CommandContext &) = delete;
+
+    /* Reset the next command allocator and the list to begin recording new commands,
+     * waiting for the last submission recorded with that allocator if it's still in flight
+     */
+    void begin(ID3D12PipelineState *pipeline_state = nullptr);
+
+    // Close the command list, submit it and wait for it to complete
+    void submit_and_sync();
+
+    /* Close the command list and submit it without waiting, returning the fence value
+     * signaled once it completes
+     */
+    uint64_t submit();
+
+    // Wait for all work submitted to the queue to complete
+    void sync();
+
+    // Wait on the CPU for the fence to reach the value
+    void wait(uint64_t value);
+
+    /* Make the work submitted to the queue after this call wait on the GPU for the other
+     * context's fence to reach the value, without blocking the CPU
+     */
+    void queue_wait(const CommandContext &other, uint64_t value);
+};
+
+/* A persistently mapped upload heap buffer which is sub-allocated from as a ring.
+ * Allocations made between calls to retire are tracked against the fence value of the
+ * submission using them, and their space is reclaimed once the fence has passed it.
+ */
+class UploadRing {
+    Buffer buf;
+    uint8_t *mapping = nullptr;
+    size_t head = 0;
+    size_t tail = 0;
+    size_t used = 0;
+    // Bytes allocated since the last call to retire
+    size_t pending = 0;
+    // The fence value and bytes allocated for each submission in flight
+    std::deque<std::pair<uint64_t, size_t>> in_flight;
+
+public:
+    struct Allocation {
+        ID3D12Resource *resource = nullptr;
+        uint64_t offset = 0;
+        uint8_t *data = nullptr;
+        D3D12_GPU_VIRTUAL_ADDRESS gpu_address = 0;
+    };
+
+    UploadRing() = default;
+    UploadRing(ID3D12Device *device, size_t capacity);
+
+    UploadRing(const UploadRing &) = delete;
+    UploadRing &operator=(const UploadRing &) = delete;
+
+    // Sub-allocate from the ring, returns false if there isn't enough free space
+    bool try_allocate(size_t size, size_t alignment, Allocation &alloc);
+
+    /* Sub-allocate from the ring. If the ring is full the work recorded in the context is
+     * submitted and waited on to free up space, and recording is restarted
+     */
+    Allocation allocate(CommandContext &ctx, size_t size, size_t alignment = 16);
+
+    /* Copy the data into the destination buffer through the ring, splitting the copy
+     * into chunks if it's larger than the ring
+     */
+    void upload(CommandContext &ctx,
+                Buffer &dst,
+                const void *data,
+                size_t size,
+                size_t dst_offset = 0);
+
+    // Mark the allocations since the last call as used by the submission signaling fence_value
+    void retire(uint64_t fence_value);
+
+    // Release the space used by submissions which the completed fence value has passed
+    void reclaim(uint64_t completed_fence_value);
+
+    // Submit the work in the context and reclaim the space used by it once it completes
+    void submit_and_sync(CommandContext &ctx);
+
+    size_t capacity() const;
+};
+
+/* Reads back textures without stalling the submitting thread on the copy or on using the
+ * pixels. Each readback copies the texture into a persistently mapped slot of a ring of
+ * readback buffers and submits the copy. A worker thread waits on the fence for the copy,
+ * strips the pitch alignment from the rows and passes the tightly packed pixels to the
+ * readback's callback, e.g. to encode and write out the image, while the GPU and the
+ * submitting thread carry on. Callbacks run in order on the worker thread
+ */
+class AsyncReadback {
+public:
+    using Callback = std::function<void(const std::vector<uint8_t> &pixels)>;
+
+private:
+    struct Slot {
+        Buffer buf;
+        const uint8_t *mapping = nullptr;
+        bool busy = false;
+    };
+
+    struct Job {
+        size_t slot = 0;
+        Microsoft::WRL::ComPtr<ID3D12Fence> fence;
+        uint64_t fence_value = 0;
+        glm::uvec2 dims = glm::uvec2(0);
+        size_t row_pitch = 0;
+        size_t row_size = 0;
+        Callback callback;
+    };
+
+    ID3D12Device *device = nullptr;
+    std::vector<Slot> slots;
+    std::deque<Job> jobs;
+    // Jobs submitted which haven't finished their callbacks yet
+    size_t pending = 0;
+    bool stop = false;
+    // The first exception thrown by a callback, rethrown by flush
+    std::exception_ptr error;
+    // Time the worker spent copying out the pixels and running the callbacks
+    double worker_ms = 0.0;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread worker;
+
+    void run_worker();
+
+public:
+    AsyncReadback(ID3D12Device *device, uint32_t num_slots = 2);
+    // Waits for the pending readbacks to finish, dropping any errors
+    ~AsyncReadback();
+
+    AsyncReadback(const AsyncReadback &) = delete;
+    AsyncReadback &operator=(const AsyncReadback &) = delete;
+
+    /* Record and submit the copy of the texture into a free slot, growing it if needed. The
+     * texture is transitioned back to its current state after the copy. Blocks while all
+     * slots are in use
+     */
+    void read_back(CommandContext &ctx, Texture2D &tex, Callback callback);
+
+    // Wait for all readbacks and their callbacks to finish, rethrowing any callback error
+    void flush();
+
+    // The time in ms the worker has spent busy on the readbacks so far
+    double busy_ms();
+};
+
+/* Times regions of the work submitted to a queue with timestamp queries. A region can span
+ * multiple command lists submitted to the same queue. The regions recorded between calls to
+ * resolve are resolved into their own slot of a readback ring, which is only read once the
+ * fence has passed the submission resolving it, so collecting the timings never stalls the
+ * queue. The timings of each region are kept by name over a rolling window.
+ */
+class GpuProfiler {
+public:
+    static const uint32_t invalid_region = 0xffffffff;
+    static const size_t history_size = 120;
+
+    struct RegionStats {
+        std::string name;
+        // The GPU time in ms of the last history_size times the region was recorded
+        std::deque<double> history;
+
+        double last_ms() const;
+        double average_ms() const;
+        double max_ms() const;
+    };
+
+private:
+    struct Slot {
+        std::vector<std::string> names;
+        uint64_t fence_value = 0;
+        bool resolved = false;
+    };
+
+    Microsoft::WRL::ComPtr<ID3D12QueryHeap> query_heap;
+    Microsoft::WRL::ComPtr<ID3D12CommandQueue> queue;
+    Buffer readback;
+    uint32_t max_regions = 0;
+    double ms_per_tick = 0.0;
+    // The name and id of the profiler's track in the CPU trace, added on the first read back
+    // while tracing
+    std::string trace_name;
+    uint32_t trace_track = 0xffffffff;
+    std::vector<Slot> slots;
+    size_t current = 0;
+    std::vector<RegionStats> region_stats;
+
+    void record_time(const std::string &name, double ms);
+
+public:
+    GpuProfiler() = default;
+    /* Each slot holds up to max_regions regions, the ring has num_slots slots. While the
+     * CPU trace is enabled the regions read back are also added to it on a track of their
+     * own, with the queue's timestamps calibrated to the CPU clock
+     */
+    GpuProfiler(ID3D12Device *device,
+                ID3D12CommandQueue *queue,
+                uint32_t max_regions,
+                uint32_t num_slots = 3,
+                const std::string &trace_name = "GPU Queue");
+
+    GpuProfiler(const GpuProfiler &) = delete;
+    GpuProfiler &operator=(const GpuProfiler &) = delete;
+
+    /* Write the start timestamp of a region. Returns invalid_region, which end ignores, if
+     * the current slot is full or still waiting to be read back
+     */
+    uint32_t begin(ID3D12GraphicsCommandList *cmd_list, const std::string &name);
+
+    // Write the end timestamp of a region, before the next call to resolve
+    void end(ID3D12GraphicsCommandList *cmd_list, uint32_t region);
+
+    /* Resolve the regions recorded since the last call into the current slot and move on to
+     * the next one. fence_value is the value signaled by the submission of cmd_list
+     */
+    void resolve(ID3D12GraphicsCommandList *cmd_list, uint64_t fence_value);
+
+    // Read back the timings of the resolved slots which the completed fence value has passed
+    void read_back(uint64_t completed_fence_value);
+
+    // The timings of each region name, in the order they were first recorded
+    const std::vector<RegionStats> &stats() const;
+
+    // Clear the timing history of all regions
+    void clear();
+};
+
 }
@@ -1,13 +1,134 @@
 #include "dxdisplay.h"
+#include <algorithm>
+#include <cmath>
 #include <codecvt>
 #include <locale>
 #include <SDL_syswm.h>
 #include "display/imgui_impl_sdl.h"
+#include "display_blit_fs_embedded_dxil.h"
+#include "display_blit_vs_embedded_dxil.h"
+#include "display_mips_cs_embedded_dxil.h"
+#include "dxr_utils.h"
 #include "imgui_impl_dx12.h"
 #include "util.h"
 
 using Microsoft::WRL::ComPtr;
 
+const uint32_t DXDisplay::frame_count;
+
+// Must match MAX_BLIT_TAPS in display_blit.hlsl
+const uint32_t max_blit_taps = 4;
+
+// The image SRV, pyramid SRV and pyramid UAV of each back buffer
+const uint32_t frame_descriptors = 3;
+
+// The view can shrink the image to a quarter of its fitted size, and magnify it until a
+// texel covers 64 pixels
+const float min_view_zoom = 0.25f;
+const float max_view_scale = 64.f;
+
+// The BlitInfo constants of the display blit
+struct BlitInfo {
+    glm::vec2 view_origin;
+    float texels_per_pixel;
+    uint32_t taps;
+    glm::uvec2 level_dims;
+    glm::uvec2 level_origin;
+    uint32_t level;
+};
+
+// The MipInfo constants of the pyramid's mip pass
+struct MipInfo {
+    glm::uvec2 dst_origin;
+    glm::uvec2 src_origin;
+    glm::uvec2 src_dims;
+    glm::uvec2 region_lower;
+    glm::uvec2 region_dims;
+    uint32_t from_image;
+};
+
+namespace {
+
+ComPtr<ID3D12RootSignature> create_root_signature(
+    ID3D12Device *device, const std::vector<D3D12_ROOT_PARAMETER> &params)
+{
+    D3D12_ROOT_SIGNATURE_DESC desc = {0};
+    desc.NumParameters = params.size();
+    desc.pParameters = params.data();
+    desc.Flags = D3D12_ROOT_SIGNATURE_FLAG_NONE;
+
+    ComPtr<ID3DBlob> signature_blob;
+    ComPtr<ID3DBlob> err_blob;
+    CHECK_ERR(D3D12SerializeRootSignature(
+        &desc, D3D_ROOT_SIGNATURE_VERSION_1, &signature_blob, &err_blob));
+    ComPtr<ID3D12RootSignature> signature;
+    CHECK_ERR(device->CreateRootSignature(0,
+                                          signature_blob->GetBufferPointer(),
+                                          signature_blob->GetBufferSize(),
+                                          IID_PPV_ARGS(&signature)));
+    return signature;
+}
+
+// A descriptor table parameter followed by num_constants root constants at b0
+std::vector<D3D12_ROOT_PARAMETER> table_and_constants(
+    const std::vector<D3D12_DESCRIPTOR_RANGE> &ranges,
+    const uint32_t num_constants,
+    const D3D12_SHADER_VISIBILITY visibility)
+{
+    std::vector<D3D12_ROOT_PARAMETER> params(2);
+    params[0].ParameterType = D3D12_ROOT_PARAMETER_TYPE_DESCRIPTOR_TABLE;
+    params[0].DescriptorTable.NumDescriptorRanges = ranges.size();
+    params[0].DescriptorTable.pDescriptorRanges = ranges.data();
+    params[0].ShaderVisibility = visibility;
+    params[1].ParameterType = D3D12_ROOT_PARAMETER_TYPE_32BIT_CONSTANTS;
+    params[1].Constants.ShaderRegister = 0;
+    params[1].Constants.RegisterSpace = 0;
+    params[1].Constants.Num32BitValues = num_constants;
+    params[1].ShaderVisibility = visibility;
+    return params;
+}
+
+D3D12_DESCRIPTOR_RANGE descriptor_range(const D3D12_DESCRIPTOR_RANGE_TYPE type,
+                                        const uint32_t num_descriptors,
+                                        const uint32_t table_offset)
+{
+    D3D12_DESCRIPTOR_RANGE range = {0};
+    range.RangeType = type;
+    range.NumDescriptors = num_descriptors;
+    range.BaseShaderRegister = 0;
+    range.RegisterSpace = 0;
+    range.OffsetInDescriptorsFromTableStart = table_offset;
+    return range;
+}
+
+/* The mip levels of the image, halving each level's size down to 1x1, and the size of the
+ * texture packing levels 1 and up. Level 1 is at the top left of the texture and each
+ * smaller level is placed below the last to its right
+ */
+std::vector<DisplayMipLevel> pyramid_layout(const glm::uvec2 &image_dims,
+                                            glm::uvec2 &pyramid_dims)
+{
+    std::vector<DisplayMipLevel> levels(1);
+    levels[0].dims = image_dims;
+    pyramid_dims = glm::uvec2(1);
+    glm::uvec2 next_origin(0);
+    while (glm::any(glm::greaterThan(levels.back().dims, glm::uvec2(1)))) {
+        DisplayMipLevel l;
+        l.dims = glm::max(levels.back().dims / 2u, glm::uvec2(1));
+        l.origin = next_origin;
+        if (levels.size() == 1) {
+            next_origin = glm::uvec2(l.dims.x, 0);
+        } else {
+            next_origin.y += l.dims.y;
+        }
+        pyramid_dims = glm::max(pyramid_dims, l.origin + l.dims);
+        levels.push_back(l);
+    }
+    return levels;
+}
+
+}
+
 DXDisplay::DXDisplay(SDL_Window *window)
 {
     SDL_SysWMinfo wm_info;
@@ -15,19 +136,6 @@ DXDisplay::DXDisplay(SDL_Window *window)
     SDL_GetWindowWMInfo(window, &wm_info);
     win_handle = wm_info.info.win.window;
 
-    // Enable debugging for D3D12
-#ifdef _DEBUG
-    {
-        ComPtr<ID3D12Debug> debug_controller;
-        auto err = D3D12GetDebugInterface(IID_PPV_ARGS(&debug_controller));
-        if (FAILED(err)) {
-            std::cout << "Failed to enable debug layer!\n";
-            throw std::runtime_error("get debug failed");
-        }
-        debug_controller->EnableDebugLayer();
-    }
-#endif
-
 #ifdef _DEBUG
     uint32_t factory_flags = DXGI_CREATE_FACTORY_DEBUG;
 #else
@@ -35,35 +143,28 @@ DXDisplay::DXDisplay(SDL_Window *window)
 #endif
     CHECK_ERR(CreateDXGIFactory2(factory_flags, IID_PPV_ARGS(&factory)));
 
-    // TODO: we should enumerate the devices and find the first one supporting RTX
-
-    auto err = D3D12CreateDevice(nullptr, D3D_FEATURE_LEVEL_12_1, IID_PPV_ARGS(&device));
-    if (FAILED(err)) {
-        std::cout << "Failed to make D3D12 device\n";
-        throw std::runtime_error("failed to make d3d12 device\n");
-    }
+    device = dxr::create_device();
 
     device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&fence));
     fence_evt = CreateEvent(nullptr, false, false, nullptr);
 
-    // Create the command queue and command allocator
+    // Create the command queue and a command allocator for each frame in flight
     D3D12_COMMAND_QUEUE_DESC queue_desc = {0};
     queue_desc.Flags = D3D12_COMMAND_QUEUE_FLAG_NONE;
     queue_desc.Type = D3D12_COMMAND_LIST_TYPE_DIRECT;
     CHECK_ERR(device->CreateCommandQueue(&queue_desc, IID_PPV_ARGS(&cmd_queue)));
-    CHECK_ERR(device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT,
-                                             IID_PPV_ARGS(&cmd_allocator)));
+    for (auto &allocator : cmd_allocators) {
+        CHECK_ERR(device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT,
+                                                 IID_PPV_ARGS(&allocator)));
+    }
 
     CHECK_ERR(device->CreateCommandList(0,
                                         D3D12_COMMAND_LIST_TYPE_DIRECT,
-                                        cmd_allocator.Get(),
+                                        cmd_allocators[0].Get(),
                                         nullptr,
                                         IID_PPV_ARGS(&cmd_list)));
 
     CHECK_ERR(cmd_list->Close());
-
-    device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&fence));
-    fence_evt = CreateEvent(nullptr, false, false, nullptr);
     {
         D3D12_DESCRIPTOR_HEAP_DESC desc = {0};
         desc.NumDescriptors = render_targets.size();
@@ -73,24 +174,72 @@ DXDisplay::DXDisplay(SDL_Window *window)
     }
     {
         D3D12_DESCRIPTOR_HEAP_DESC desc = {0};
-        desc.NumDescriptors = 1;
+        desc.NumDescriptors = 1 + frame_count * frame_descriptors;
         desc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
         desc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
-        CHECK_ERR(device->CreateDescriptorHeap(&desc, IID_PPV_ARGS(&imgui_desc_heap)));
+        CHECK_ERR(device->CreateDescriptorHeap(&desc, IID_PPV_ARGS(&srv_desc_heap)));
+    }
+
+    // The blit reads the frame's image and pyramid SRVs from a table and takes the BlitInfo
+    // as constants. The mip pass shares the table, reading the image SRV and pyramid UAV
+    {
+        const std::vector<D3D12_DESCRIPTOR_RANGE> ranges = {
+            descriptor_range(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 2, 0)};
+        blit_signature = create_root_signature(
+            device.Get(),
+            table_and_constants(
+                ranges, sizeof(BlitInfo) / sizeof(uint32_t), D3D12_SHADER_VISIBILITY_PIXEL));
+    }
+    {
+        const std::vector<D3D12_DESCRIPTOR_RANGE> ranges = {
+            descriptor_range(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 0),
+            descriptor_range(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 2)};
+        mip_signature = create_root_signature(
+            device.Get(),
+            table_and_constants(
+                ranges, sizeof(MipInfo) / sizeof(uint32_t), D3D12_SHADER_VISIBILITY_ALL));
+
+        D3D12_COMPUTE_PIPELINE_STATE_DESC desc = {0};
+        desc.pRootSignature = mip_signature.Get();
+        desc.CS.pShaderBytecode = display_mips_cs_dxil;
+        desc.CS.BytecodeLength = sizeof(display_mips_cs_dxil);
+        mip_pipeline = dxr::create_compute_pipeline_state(device.Get(), desc);
+    }
+    {
+        D3D12_GRAPHICS_PIPELINE_STATE_DESC desc = {0};
+        desc.pRootSignature = blit_signature.Get();
+        desc.VS.pShaderBytecode = display_blit_vs_dxil;
+        desc.VS.BytecodeLength = sizeof(display_blit_vs_dxil);
+        desc.PS.pShaderBytecode = display_blit_fs_dxil;
+        desc.PS.BytecodeLength = sizeof(display_blit_fs_dxil);
+        desc.BlendState.RenderTarget[0].RenderTargetWriteMask = D3D12_COLOR_WRITE_ENABLE_ALL;
+        desc.RasterizerState.FillMode = D3D12_FILL_MODE_SOLID;
+        desc.RasterizerState.CullMode = D3D12_CULL_MODE_NONE;
+        desc.RasterizerState.DepthClipEnable = TRUE;
+        desc.SampleMask = UINT_MAX;
+        desc.DepthStencilState.DepthEnable = false;
+        desc.DepthStencilState.StencilEnable = false;
+        desc.PrimitiveTopologyType = D3D12_PRIMITIVE_TOPOLOGY_TYPE_TRIANGLE;
+        desc.NumRenderTargets = 1;
+        desc.RTVFormats[0] = DXGI_FORMAT_R8G8B8A8_UNORM;
+        desc.SampleDesc.Count = 1;
+        blit_pipeline = dxr::create_graphics_pipeline_state(device.Get(), desc);
     }
 
     ImGui_ImplSDL2_InitForD3D(window);
     ImGui_ImplDX12_Init(device.Get(),
-                        1,
+                        frame_count,
                         DXGI_FORMAT_R8G8B8A8_UNORM,
-                        imgui_desc_heap.Get(),
-                        imgui_desc_heap->GetCPUDescriptorHandleForHeapStart(),
-                        imgui_desc_heap->GetGPUDescriptorHandleForHeapStart());
+                        srv_desc_heap.Get(),
+                        srv_desc_heap->GetCPUDescriptorHandleForHeapStart(),
+                        srv_desc_heap->GetGPUDescriptorHandleForHeapStart());
 }
 
 DXDisplay::~DXDisplay()
 {
+    wait_idle();
     ImGui_ImplDX12_Shutdown();
+    CloseHandle(fence_evt);
 }
 
 std::string DXDisplay::gpu_brand()
@@ -110,6 +259,8 @@ std::string DXDisplay::name()
 
 void DXDisplay::resize(const int fb_width, const int fb_height)
 {
+    // The back buffers can't be resized while frames using them are in flight
+    wait_idle();
     fb_dims = glm::uvec2(fb_width, fb_height);
 
     upload_texture = dxr::Buffer::upload(
@@ -118,7 +269,7 @@ void DXDisplay::resize(const int fb_width, const int fb_height)
     if (!swap_chain) {
         // Describe and create the swap chain.
         DXGI_SWAP_CHAIN_DESC1 swap_chain_desc = {0};
-        swap_chain_desc.BufferCount = 2;
+        swap_chain_desc.BufferCount = frame_count;
         swap_chain_desc.Width = fb_dims.x;
         swap_chain_desc.Height = fb_dims.y;
         swap_chain_desc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
@@ -133,8 +284,8 @@ void DXDisplay::resize(const int fb_width, const int fb_height)
         CHECK_ERR(sc.As(&swap_chain));
     } else {
         // If the swap chain already exists, resize it
-        CHECK_ERR(
-            swap_chain->ResizeBuffers(2, fb_dims.x, fb_dims.y, DXGI_FORMAT_R8G8B8A8_UNORM, 0));
+        CHECK_ERR(swap_chain->ResizeBuffers(
+            frame_count, fb_dims.x, fb_dims.y, DXGI_FORMAT_R8G8B8A8_UNORM, 0));
     }
 
     const uint32_t rtv_descriptor_size =
@@ -158,6 +309,8 @@ void DXDisplay::new_frame()
 
 void DXDisplay::display(const std::vector<uint32_t> &img)
 {
+    // The upload texture is shared by all frames, so the previous ones must be done with it
+    wait_idle();
     // TODO: A utility for uploading these strided buffers for texture copies
     if (fb_linear_row_pitch() == img.size() * sizeof(uint32_t)) {
         std::memcpy(upload_texture.map(), img.data(), upload_texture.size());
@@ -171,10 +324,7 @@ void DXDisplay::display(const std::vector<uint32_t> &img)
     }
     upload_texture.unmap();
 
-    CHECK_ERR(cmd_allocator->Reset());
-    CHECK_ERR(cmd_list->Reset(cmd_allocator.Get(), nullptr));
-
-    const uint32_t back_buffer_idx = swap_chain->GetCurrentBackBufferIndex();
+    const uint32_t back_buffer_idx = begin_frame();
     ComPtr<ID3D12Resource> back_buffer;
     CHECK_ERR(swap_chain->GetBuffer(back_buffer_idx, IID_PPV_ARGS(&back_buffer)));
 
@@ -190,7 +340,7 @@ void DXDisplay::display(const std::vector<uint32_t> &img)
     D3D12_TEXTURE_COPY_LOCATION src_desc = {0};
     src_desc.pResource = upload_texture.get();
     src_desc.Type = D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT;
-    src_desc.PlacedFootprint.Offset = 0;
+    src_desc.PlacedFootprint.Offset = upload_texture.offset();
     src_desc.PlacedFootprint.Footprint.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
     src_desc.PlacedFootprint.Footprint.Width = fb_dims.x;
     src_desc.PlacedFootprint.Footprint.Height = fb_dims.y;
@@ -212,7 +362,7 @@ void DXDisplay::display(const std::vector<uint32_t> &img)
 
     // Render ImGui to the framebuffer
     cmd_list->OMSetRenderTargets(1, &render_targets[back_buffer_idx], false, nullptr);
-    ID3D12DescriptorHeap *desc_heap = imgui_desc_heap.Get();
+    ID3D12DescriptorHeap *desc_heap = srv_desc_heap.Get();
     cmd_list->SetDescriptorHeaps(1, &desc_heap);
     ImGui_ImplDX12_RenderDrawData(ImGui::GetDrawData(), cmd_list.Get());
 
@@ -220,77 +370,288 @@ void DXDisplay::display(const std::vector<uint32_t> &img)
         back_buffer.Get(), D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_PRESENT);
     cmd_list->ResourceBarrier(1, &b);
 
-    CHECK_ERR(cmd_list->Close());
-
-    // Execute the command list and present
-    ID3D12CommandList *cmd_lists = cmd_list.Get();
-    cmd_queue->ExecuteCommandLists(1, &cmd_lists);
-    CHECK_ERR(swap_chain->Present(1, 0));
-
-    // Sync with the fence to wait for the frame to be presented
-    const uint64_t signal_val = fence_value++;
-    CHECK_ERR(cmd_queue->Signal(fence.Get(), signal_val));
-
-    if (fence->GetCompletedValue() < signal_val) {
-        CHECK_ERR(fence->SetEventOnCompletion(signal_val, fence_evt));
-        WaitForSingleObject(fence_evt, INFINITE);
-    }
+    end_frame(back_buffer_idx);
 }
 
-void DXDisplay::display_native(dxr::Texture2D &img)
+void DXDisplay::display_native(dxr::Texture2D &img, dxr::GpuProfiler *profiler)
 {
-    CHECK_ERR(cmd_allocator->Reset());
-    CHECK_ERR(cmd_list->Reset(cmd_allocator.Get(), nullptr));
+    update_pyramid(img);
+    const uint32_t back_buffer_idx = begin_frame();
+    frame_images[back_buffer_idx] = img.get();
 
-    const uint32_t back_buffer_idx = swap_chain->GetCurrentBackBufferIndex();
     ComPtr<ID3D12Resource> back_buffer;
     CHECK_ERR(swap_chain->GetBuffer(back_buffer_idx, IID_PPV_ARGS(&back_buffer)));
 
+    // The back buffer's descriptors were last read by the frame begin_frame waited on
+    const uint32_t srv_descriptor_size =
+        device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+    const uint32_t first_descriptor = 1 + back_buffer_idx * frame_descriptors;
+    D3D12_CPU_DESCRIPTOR_HANDLE desc_cpu = srv_desc_heap->GetCPUDescriptorHandleForHeapStart();
+    desc_cpu.ptr += first_descriptor * srv_descriptor_size;
+    D3D12_GPU_DESCRIPTOR_HANDLE desc_gpu = srv_desc_heap->GetGPUDescriptorHandleForHeapStart();
+    desc_gpu.ptr += first_descriptor * srv_descriptor_size;
     {
-        const std::array<D3D12_RESOURCE_BARRIER, 2> b = {
-            dxr::barrier_transition(back_buffer.Get(),
-                                    D3D12_RESOURCE_STATE_PRESENT,
-                                    D3D12_RESOURCE_STATE_COPY_DEST),
-            dxr::barrier_transition(img, D3D12_RESOURCE_STATE_COPY_SOURCE)};
-
-        cmd_list->ResourceBarrier(b.size(), b.data());
+        D3D12_SHADER_RESOURCE_VIEW_DESC srv_desc = {0};
+        srv_desc.Format = img.pixel_format();
+        srv_desc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+        srv_desc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+        srv_desc.Texture2D.MipLevels = 1;
+        device->CreateShaderResourceView(img.get(), &srv_desc, desc_cpu);
+        desc_cpu.ptr += srv_descriptor_size;
+
+        srv_desc.Format = pyramid.pixel_format();
+        device->CreateShaderResourceView(pyramid.get(), &srv_desc, desc_cpu);
+        desc_cpu.ptr += srv_descriptor_size;
+
+        D3D12_UNORDERED_ACCESS_VIEW_DESC uav_desc = {0};
+        uav_desc.Format = pyramid.pixel_format();
+        uav_desc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
+        device->CreateUnorderedAccessView(pyramid.get(), nullptr, &uav_desc, desc_cpu);
     }
 
-    cmd_list->CopyResource(back_buffer.Get(), img.get());
+    /* Pick the level with closest to, but at least, one texel per pixel, unless the view
+     * magnifies the image. Seeing the whole image then filters a few level texels per pixel
+     * and zooming in samples the image's texels directly
+     */
+    const glm::vec2 image_dims(pyramid_levels[0].dims);
+    BlitInfo info;
+    info.texels_per_pixel = 1.f / view_scale();
+    info.view_origin =
+        view_center * image_dims - glm::vec2(fb_dims) * 0.5f * info.texels_per_pixel;
+    info.level = 0;
+    while (info.level + 1 < pyramid_levels.size() && info.texels_per_pixel >= 2.f) {
+        ++info.level;
+        info.texels_per_pixel *= 0.5f;
+        info.view_origin *= 0.5f;
+    }
+    info.taps = glm::clamp(uint32_t(std::ceil(info.texels_per_pixel)), 1u, max_blit_taps);
+    info.level_dims = pyramid_levels[info.level].dims;
+    info.level_origin = pyramid_levels[info.level].origin;
+
+    /* The region of each level down to the blit's which is needed to filter the visible
+     * texels. Each level reads the 2x2 texels of the level above, so the regions are found
+     * from the blit's level up. The view can be entirely off the image, leaving them empty
+     */
+    std::vector<glm::uvec2> region_lower(info.level + 1, glm::uvec2(0));
+    std::vector<glm::uvec2> region_upper(info.level + 1, glm::uvec2(0));
+    {
+        const glm::vec2 view_lower = glm::max(info.view_origin, glm::vec2(0.f));
+        const glm::vec2 view_upper = glm::min(
+            info.view_origin + glm::vec2(fb_dims) * info.texels_per_pixel + 1.f,
+            glm::vec2(info.level_dims));
+        if (glm::all(glm::lessThan(view_lower, view_upper))) {
+            region_lower[info.level] = glm::uvec2(glm::floor(view_lower));
+            region_upper[info.level] = glm::uvec2(glm::ceil(view_upper));
+        }
+        for (uint32_t l = info.level; l > 0; --l) {
+            region_lower[l - 1] = region_lower[l] * 2u;
+            region_upper[l - 1] = glm::min(region_upper[l] * 2u, pyramid_levels[l - 1].dims);
+        }
+    }
+    const bool build_mips = info.level > 0 && region_upper[info.level].x != 0;
 
     {
-        const std::array<D3D12_RESOURCE_BARRIER, 2> b = {
+        std::vector<D3D12_RESOURCE_BARRIER> b = {
             dxr::barrier_transition(back_buffer.Get(),
-                                    D3D12_RESOURCE_STATE_COPY_DEST,
+                                    D3D12_RESOURCE_STATE_PRESENT,
                                     D3D12_RESOURCE_STATE_RENDER_TARGET),
-            dxr::barrier_transition(img, D3D12_RESOURCE_STATE_RENDER_TARGET)};
-
+            dxr::barrier_transition(img,
+                                    D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE |
+                                        D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE)};
+        if (build_mips) {
+            b.push_back(
+                dxr::barrier_transition(pyramid, D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
+        }
         cmd_list->ResourceBarrier(b.size(), b.data());
     }
 
-    // Render ImGui to the framebuffer
-    cmd_list->OMSetRenderTargets(1, &render_targets[back_buffer_idx], false, nullptr);
-    ID3D12DescriptorHeap *desc_heap = imgui_desc_heap.Get();
+    ID3D12DescriptorHeap *desc_heap = srv_desc_heap.Get();
     cmd_list->SetDescriptorHeaps(1, &desc_heap);
+
+    if (build_mips) {
+        uint32_t region = dxr::GpuProfiler::invalid_region;
+        if (profiler) {
+            region = profiler->begin(cmd_list.Get(), "Display Mips");
+        }
+        cmd_list->SetPipelineState(mip_pipeline.Get());
+        cmd_list->SetComputeRootSignature(mip_signature.Get());
+        cmd_list->SetComputeRootDescriptorTable(0, desc_gpu);
+        for (uint32_t l = 1; l <= info.level; ++l) {
+            MipInfo mip;
+            mip.dst_origin = pyramid_levels[l].origin;
+            mip.src_origin = pyramid_levels[l - 1].origin;
+            mip.src_dims = pyramid_levels[l - 1].dims;
+            mip.region_lower = region_lower[l];
+            mip.region_dims = region_upper[l] - region_lower[l];
+            mip.from_image = l == 1 ? 1 : 0;
+            cmd_list->SetComputeRoot32BitConstants(
+                1, sizeof(MipInfo) / sizeof(uint32_t), &mip, 0);
+            cmd_list->Dispatch((mip.region_dims.x + 7) / 8, (mip.region_dims.y + 7) / 8, 1);
+
+            auto b = dxr::barrier_uav(pyramid);
+            cmd_list->ResourceBarrier(1, &b);
+        }
+        auto b = dxr::barrier_transition(pyramid, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE);
+        cmd_list->ResourceBarrier(1, &b);
+        if (profiler) {
+            profiler->end(cmd_list.Get(), region);
+        }
+    }
+
+    uint32_t region = dxr::GpuProfiler::invalid_region;
+    if (profiler) {
+        region = profiler->begin(cmd_list.Get(), "Display");
+    }
+
+    D3D12_VIEWPORT viewport = {0};
+    viewport.Width = static_cast<float>(fb_dims.x);
+    viewport.Height = static_cast<float>(fb_dims.y);
+    viewport.MinDepth = D3D12_MIN_DEPTH;
+    viewport.MaxDepth = D3D12_MAX_DEPTH;
+
+    D3D12_RECT scissor = {0};
+    scissor.right = fb_dims.x;
+    scissor.bottom = fb_dims.y;
+
+    // The blit writes every pixel, so the back buffer doesn't need clearing
+    cmd_list->SetPipelineState(blit_pipeline.Get());
+    cmd_list->SetGraphicsRootSignature(blit_signature.Get());
+    cmd_list->SetGraphicsRootDescriptorTable(0, desc_gpu);
+    cmd_list->SetGraphicsRoot32BitConstants(
+        1, sizeof(BlitInfo) / sizeof(uint32_t), &info, 0);
+    cmd_list->RSSetViewports(1, &viewport);
+    cmd_list->RSSetScissorRects(1, &scissor);
+    cmd_list->OMSetRenderTargets(1, &render_targets[back_buffer_idx], false, nullptr);
+    cmd_list->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    cmd_list->DrawInstanced(3, 1, 0, 0);
+
+    {
+        auto b = dxr::barrier_transition(img, D3D12_RESOURCE_STATE_RENDER_TARGET);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    if (profiler) {
+        profiler->end(cmd_list.Get(), region);
+    }
+
+    // Render ImGui to the framebuffer
     ImGui_ImplDX12_RenderDrawData(ImGui::GetDrawData(), cmd_list.Get());
 
     auto b = dxr::barrier_transition(
         back_buffer.Get(), D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_PRESENT);
     cmd_list->ResourceBarrier(1, &b);
 
+    end_frame(back_buffer_idx);
+}
+
+bool DXDisplay::can_present()
+{
+    if (occluded && swap_chain) {
+        occluded = swap_chain->Present(0, DXGI_PRESENT_TEST) == DXGI_STATUS_OCCLUDED;
+    }
+    return !occluded;
+}
+
+void DXDisplay::pan_view(const glm::vec2 &offset)
+{
+    if (pyramid_levels.empty()) {
+        return;
+    }
+    const glm::vec2 image_dims = glm::max(glm::vec2(pyramid_levels[0].dims), glm::vec2(1.f));
+    view_center = glm::clamp(
+        view_center - offset / (view_scale() * image_dims), glm::vec2(0.f), glm::vec2(1.f));
+}
+
+void DXDisplay::zoom_view(const float factor, const glm::vec2 &pixel)
+{
+    if (pyramid_levels.empty()) {
+        return;
+    }
+    const glm::vec2 image_dims = glm::max(glm::vec2(pyramid_levels[0].dims), glm::vec2(1.f));
+    const float fit_scale = view_scale() / view_zoom;
+    // The image uv under the pixel is kept there after zooming
+    const glm::vec2 offset = pixel - glm::vec2(fb_dims) * 0.5f;
+    const glm::vec2 uv = view_center + offset / (view_scale() * image_dims);
+    view_zoom = glm::clamp(
+        view_zoom * factor, min_view_zoom, std::max(max_view_scale / fit_scale, 1.f));
+    view_center = glm::clamp(
+        uv - offset / (view_scale() * image_dims), glm::vec2(0.f), glm::vec2(1.f));
+}
+
+void DXDisplay::reset_view()
+{
+    view_center = glm::vec2(0.5f);
+    view_zoom = 1.f;
+}
+
+void DXDisplay::queue_wait_frames(ID3D12CommandQueue *queue)
+{
+    CHECK_ERR(queue->Wait(fence.Get(), fence_value - 1));
+}
+
+void DXDisplay::wait_idle()
+{
+    wait(fence_value - 1);
+    frame_images.fill(nullptr);
+}
+
+float DXDisplay::view_scale() const
+{
+    if (pyramid_levels.empty()) {
+        return view_zoom;
+    }
+    const glm::vec2 image_dims = glm::max(glm::vec2(pyramid_levels[0].dims), glm::vec2(1.f));
+    return std::min(fb_dims.x / image_dims.x, fb_dims.y / image_dims.y) * view_zoom;
+}
+
+void DXDisplay::update_pyramid(const dxr::Texture2D &img)
+{
+    if (!pyramid_levels.empty() && pyramid_levels[0].dims == img.dims()) {
+        return;
+    }
+    // The frames in flight may still be reading the old pyramid
+    wait_idle();
+    glm::uvec2 pyramid_dims;
+    pyramid_levels = pyramid_layout(img.dims(), pyramid_dims);
+    pyramid = dxr::Texture2D::default(device.Get(),
+                                      pyramid_dims,
+                                      D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE,
+                                      DXGI_FORMAT_R32_UINT,
+                                      D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+}
+
+uint32_t DXDisplay::begin_frame()
+{
+    const uint32_t back_buffer_idx = swap_chain->GetCurrentBackBufferIndex();
+    wait(frame_fence_values[back_buffer_idx]);
+    frame_images[back_buffer_idx] = nullptr;
+
+    auto &allocator = cmd_allocators[back_buffer_idx];
+    CHECK_ERR(allocator->Reset());
+    CHECK_ERR(cmd_list->Reset(allocator.Get(), nullptr));
+    return back_buffer_idx;
+}
+
+void DXDisplay::end_frame(uint32_t back_buffer_idx)
+{
     CHECK_ERR(cmd_list->Close());
 
     // Execute the command list and present
     ID3D12CommandList *cmd_lists = cmd_list.Get();
     cmd_queue->ExecuteCommandLists(1, &cmd_lists);
-    CHECK_ERR(swap_chain->Present(1, 0));
+    const HRESULT present_result = swap_chain->Present(1, 0);
+    CHECK_ERR(present_result);
+    occluded = present_result == DXGI_STATUS_OCCLUDED;
 
-    // Sync with the fence to wait for the frame to be presented
+    // The frame is only waited on once its back buffer is rendered to again
     const uint64_t signal_val = fence_value++;
     CHECK_ERR(cmd_queue->Signal(fence.Get(), signal_val));
+    frame_fence_values[back_buffer_idx] = signal_val;
+}
 
-    if (fence->GetCompletedValue() < signal_val) {
-        CHECK_ERR(fence->SetEventOnCompletion(signal_val, fence_evt));
+void DXDisplay::wait(uint64_t value)
+{
+    if (fence->GetCompletedValue() < value) {
+        CHECK_ERR(fence->SetEventOnCompletion(value, fence_evt));
         WaitForSingleObject(fence_evt, INFINITE);
     }
 }
@@ -11,17 +11,53 @@
 #include "dx12_utils.h"
 #include <glm/glm.hpp>
 
+// A level of the displayed image's mip pyramid, level 0 is the image itself
+struct DisplayMipLevel {
+    // The position of the level in the pyramid texture
+    glm::uvec2 origin = glm::uvec2(0);
+    glm::uvec2 dims = glm::uvec2(0);
+};
+
+/* Frames are N-buffered to match the swap chain: each back buffer has its own command
+ * allocator and the fence value of the last frame which rendered to it. Presenting a frame
+ * doesn't wait on it, recording the next frame only waits for the frame which last used
+ * that back buffer, so the CPU can prepare frame N+1 while the GPU runs frame N
+ */
 struct DXDisplay : Display {
+    static const uint32_t frame_count = 2;
+
     HWND win_handle;
 
     Microsoft::WRL::ComPtr<ID3D12Device5> device;
     Microsoft::WRL::ComPtr<IDXGIFactory2> factory;
     Microsoft::WRL::ComPtr<ID3D12CommandQueue> cmd_queue;
-    Microsoft::WRL::ComPtr<ID3D12CommandAllocator> cmd_allocator;
+    std::array<Microsoft::WRL::ComPtr<ID3D12CommandAllocator>, frame_count> cmd_allocators;
     Microsoft::WRL::ComPtr<ID3D12GraphicsCommandList4> cmd_list;
 
-    Microsoft::WRL::ComPtr<ID3D12DescriptorHeap> render_target_desc_heap, imgui_desc_heap;
-    std::array<D3D12_CPU_DESCRIPTOR_HANDLE, 2> render_targets;
+    // The shader visible heap holds ImGui's font texture followed by the descriptors of each
+    // back buffer: the SRVs of the image it shows and of the pyramid, and the pyramid's UAV
+    Microsoft::WRL::ComPtr<ID3D12DescriptorHeap> render_target_desc_heap, srv_desc_heap;
+    std::array<D3D12_CPU_DESCRIPTOR_HANDLE, frame_count> render_targets;
+
+    // The pass scaling the image shown by display_native to the framebuffer
+    Microsoft::WRL::ComPtr<ID3D12RootSignature> blit_signature;
+    Microsoft::WRL::ComPtr<ID3D12PipelineState> blit_pipeline;
+    // The pass building the mip levels of the visible region of the image
+    Microsoft::WRL::ComPtr<ID3D12RootSignature> mip_signature;
+    Microsoft::WRL::ComPtr<ID3D12PipelineState> mip_pipeline;
+
+    /* Mip levels 1 and up of the displayed image, packed into one texture with level 1 at the
+     * top left and the smaller levels stacked to its right. It's recreated when the image
+     * size changes, and shared by the frames in flight as they run in order on the queue.
+     * Outside the mip pass it's kept in the pixel shader resource state
+     */
+    dxr::Texture2D pyramid;
+    std::vector<DisplayMipLevel> pyramid_levels;
+
+    // The image uv shown at the center of the framebuffer, and the zoom relative to fitting
+    // the whole image in the framebuffer
+    glm::vec2 view_center = glm::vec2(0.5f);
+    float view_zoom = 1.f;
 
     glm::uvec2 fb_dims;
     dxr::Buffer upload_texture;
@@ -30,6 +66,12 @@ struct DXDisplay : Display {
     uint64_t fence_value = 1;
     Microsoft::WRL::ComPtr<ID3D12Fence> fence;
     HANDLE fence_evt;
+    // The fence value signaled by the last frame rendered to each back buffer
+    std::array<uint64_t, frame_count> frame_fence_values = {0};
+    // The image shown by each frame in flight, kept alive until the frame completes
+    std::array<Microsoft::WRL::ComPtr<ID3D12Resource>, frame_count> frame_images;
+    // Set if the last frame presented wasn't visible, e.g. the window is covered
+    bool occluded = false;
 
     DXDisplay(SDL_Window *window);
 
@@ -45,8 +87,52 @@ struct DXDisplay : Display {
 
     void display(const std::vector<uint32_t> &img) override;
 
-    void display_native(dxr::Texture2D &img);
+    /* Display the view of the image without a CPU round trip. The mip levels of the visible
+     * region are built down to the level closest to one texel per pixel, which is sampled
+     * to the framebuffer, so the image doesn't need to match the framebuffer size and only
+     * the texels on screen are read. The image must be in the render target state. If a
+     * profiler is passed the passes are timed, and are resolved by its next resolve call
+     */
+    void display_native(dxr::Texture2D &img, dxr::GpuProfiler *profiler = nullptr);
+
+    /* Check if a presented frame would be visible. Once a frame is presented to an occluded
+     * window, presenting is tested until the window is visible again
+     */
+    bool can_present();
+
+    // Pan the view by a framebuffer pixel offset, e.g. the mouse motion while dragging
+    void pan_view(const glm::vec2 &offset);
+
+    // Scale the zoom by the factor, keeping the image point under the framebuffer pixel fixed
+    void zoom_view(const float factor, const glm::vec2 &pixel);
+
+    // Fit the whole image in the framebuffer again
+    void reset_view();
+
+    /* Make work submitted to the queue after this call wait on the GPU for the frames
+     * presented so far, e.g. before writing to an image they display
+     */
+    void queue_wait_frames(ID3D12CommandQueue *queue);
+
+    // Wait on the CPU for all frames in flight to complete
+    void wait_idle();
 
 private:
     size_t fb_linear_row_pitch() const;
+
+    // The framebuffer pixels per image texel of the view
+    float view_scale() const;
+
+    // Recreate the pyramid for the image's size if it changed
+    void update_pyramid(const dxr::Texture2D &img);
+
+    /* Wait for the frame which last rendered to the current back buffer and reset its
+     * allocator to record the next frame, returning the back buffer index
+     */
+    uint32_t begin_frame();
+
+    // Submit and present the frame recorded to the back buffer, without waiting on it
+    void end_frame(uint32_t back_buffer_idx);
+
+    void wait(uint64_t value);
 };
@@ -1,9 +1,19 @@
 #include "dxr_utils.h"
 #include <algorithm>
 #include <array>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
 #include <limits>
 #include <numeric>
+#include <sstream>
+#include <glm/gtc/type_precision.hpp>
 #include "mesh.h"
+#include "trace.h"
 #include "util.h"
 
 namespace dxr {
@@ -19,6 +29,21 @@ bool dxr_available(ComPtr<ID3D12Device5> &device)
     return feature_data.RaytracingTier >= D3D12_RAYTRACING_TIER_1_1;
 }
 
+bool bindless_available(ID3D12Device *device)
+{
+    // Runtimes that don't know SM 6.6 fail the query instead of reporting a lower model
+    D3D12_FEATURE_DATA_SHADER_MODEL shader_model = {D3D_SHADER_MODEL_6_6};
+    if (FAILED(device->CheckFeatureSupport(
+            D3D12_FEATURE_SHADER_MODEL, &shader_model, sizeof(shader_model)))) {
+        return false;
+    }
+    D3D12_FEATURE_DATA_D3D12_OPTIONS options = {};
+    CHECK_ERR(device->CheckFeatureSupport(
+        D3D12_FEATURE_D3D12_OPTIONS, &options, sizeof(options)));
+    return shader_model.HighestShaderModel >= D3D_SHADER_MODEL_6_6 &&
+           options.ResourceBindingTier >= D3D12_RESOURCE_BINDING_TIER_3;
+}
+
 RootParam::RootParam(D3D12_ROOT_PARAMETER param, const std::string &name)
     : param(param), name(name)
 {
@@ -26,11 +51,29 @@ RootParam::RootParam(D3D12_ROOT_PARAMETER param, const std::string &name)
 
 DescriptorHeap::DescriptorHeap(D3D12_DESCRIPTOR_HEAP_DESC desc,
                                std::vector<D3D12_DESCRIPTOR_RANGE> ranges,
+                               std::vector<std::string> range_names,
+                               std::vector<uint32_t> range_sizes,
+                               uint32_t increment_size,
                                Microsoft::WRL::ComPtr<ID3D12DescriptorHeap> heap)
-    : desc(desc), ranges(ranges), heap(heap)
+    : desc(desc),
+      ranges(ranges),
+      range_names(range_names),
+      range_sizes(range_sizes),
+      increment_size(increment_size),
+      heap(heap)
 {
 }
 
+size_t DescriptorHeap::find_range(const std::string &name) const
+{
+    auto fnd = std::find(range_names.begin(), range_names.end(), name);
+    if (name.empty() || fnd == range_names.end()) {
+        throw std::runtime_error("Request for descriptor range " + name +
+                                 " which is not in the heap");
+    }
+    return std::distance(range_names.begin(), fnd);
+}
+
 D3D12_ROOT_PARAMETER DescriptorHeap::root_param() const
 {
     D3D12_ROOT_PARAMETER param = {0};
@@ -51,6 +94,32 @@ D3D12_CPU_DESCRIPTOR_HANDLE DescriptorHeap::cpu_desc_handle()
     return heap->GetCPUDescriptorHandleForHeapStart();
 }
 
+D3D12_GPU_DESCRIPTOR_HANDLE DescriptorHeap::gpu_desc_handle(const std::string &range,
+                                                            uint32_t index)
+{
+    D3D12_GPU_DESCRIPTOR_HANDLE handle = gpu_desc_handle();
+    handle.ptr += uint64_t(range_offset(range) + index) * increment_size;
+    return handle;
+}
+
+D3D12_CPU_DESCRIPTOR_HANDLE DescriptorHeap::cpu_desc_handle(const std::string &range,
+                                                            uint32_t index)
+{
+    D3D12_CPU_DESCRIPTOR_HANDLE handle = cpu_desc_handle();
+    handle.ptr += size_t(range_offset(range) + index) * increment_size;
+    return handle;
+}
+
+uint32_t DescriptorHeap::range_offset(const std::string &range) const
+{
+    return ranges[find_range(range)].OffsetInDescriptorsFromTableStart;
+}
+
+uint32_t DescriptorHeap::range_size(const std::string &range) const
+{
+    return range_sizes[find_range(range)];
+}
+
 ID3D12DescriptorHeap *DescriptorHeap::operator->()
 {
     return heap.Get();
@@ -64,15 +133,24 @@ ID3D12DescriptorHeap *DescriptorHeap::get()
 void DescriptorHeapBuilder::add_range(D3D12_DESCRIPTOR_RANGE_TYPE type,
                                       uint32_t size,
                                       uint32_t base_register,
-                                      uint32_t space)
+                                      uint32_t space,
+                                      const std::string &name,
+                                      bool unbounded)
 {
+    if (!name.empty() &&
+        std::find(range_names.begin(), range_names.end(), name) != range_names.end()) {
+        throw std::runtime_error("Error: Descriptor range " + name + " was already added");
+    }
     D3D12_DESCRIPTOR_RANGE r = {0};
     r.RangeType = type;
-    r.NumDescriptors = size;
+    r.NumDescriptors = unbounded ? std::numeric_limits<uint32_t>::max() : size;
     r.BaseShaderRegister = base_register;
     r.RegisterSpace = space;
+    // The offsets are explicit, as the ranges after an unbounded one can't be appended
     r.OffsetInDescriptorsFromTableStart = num_descriptors();
     ranges.push_back(r);
+    range_names.push_back(name);
+    range_sizes.push_back(size);
 }
 
 bool DescriptorHeapBuilder::contains_range_type(D3D12_DESCRIPTOR_RANGE_TYPE type)
@@ -84,40 +162,48 @@ bool DescriptorHeapBuilder::contains_range_type(D3D12_DESCRIPTOR_RANGE_TYPE type
 
 uint32_t DescriptorHeapBuilder::num_descriptors()
 {
-    return std::accumulate(ranges.begin(),
-                           ranges.end(),
-                           0,
-                           [](const uint32_t &n, const D3D12_DESCRIPTOR_RANGE &r) {
-                               return n + r.NumDescriptors;
-                           });
+    return std::accumulate(range_sizes.begin(), range_sizes.end(), uint32_t(0));
 }
 
 DescriptorHeapBuilder &DescriptorHeapBuilder::add_srv_range(uint32_t size,
                                                             uint32_t base_register,
-                                                            uint32_t space)
+                                                            uint32_t space,
+                                                            const std::string &name)
 {
-    add_range(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, size, base_register, space);
+    add_range(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, size, base_register, space, name, false);
     return *this;
 }
 DescriptorHeapBuilder &DescriptorHeapBuilder::add_uav_range(uint32_t size,
                                                             uint32_t base_register,
-                                                            uint32_t space)
+                                                            uint32_t space,
+                                                            const std::string &name)
 {
-    add_range(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, size, base_register, space);
+    add_range(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, size, base_register, space, name, false);
     return *this;
 }
 DescriptorHeapBuilder &DescriptorHeapBuilder::add_cbv_range(uint32_t size,
                                                             uint32_t base_register,
-                                                            uint32_t space)
+                                                            uint32_t space,
+                                                            const std::string &name)
 {
-    add_range(D3D12_DESCRIPTOR_RANGE_TYPE_CBV, size, base_register, space);
+    add_range(D3D12_DESCRIPTOR_RANGE_TYPE_CBV, size, base_register, space, name, false);
     return *this;
 }
 DescriptorHeapBuilder &DescriptorHeapBuilder::add_sampler_range(uint32_t size,
                                                                 uint32_t base_register,
-                                                                uint32_t space)
+                                                                uint32_t space,
+                                                                const std::string &name)
+{
+    add_range(D3D12_DESCRIPTOR_RANGE_TYPE_SAMPLER, size, base_register, space, name, false);
+    return *this;
+}
+
+DescriptorHeapBuilder &DescriptorHeapBuilder::add_srv_array(const std::string &name,
+                                                            uint32_t capacity,
+                                                            uint32_t base_register,
+                                                            uint32_t space)
 {
-    add_range(D3D12_DESCRIPTOR_RANGE_TYPE_SAMPLER, size, base_register, space);
+    add_range(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, capacity, base_register, space, name, true);
     return *this;
 }
 
@@ -138,7 +224,12 @@ DescriptorHeap DescriptorHeapBuilder::create(ID3D12Device *device)
                                           : D3D12_DESCRIPTOR_HEAP_TYPE_SAMPLER;
     heap_desc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
     CHECK_ERR(device->CreateDescriptorHeap(&heap_desc, IID_PPV_ARGS(&heap)));
-    return DescriptorHeap(heap_desc, ranges, heap);
+    return DescriptorHeap(heap_desc,
+                          ranges,
+                          range_names,
+                          range_sizes,
+                          device->GetDescriptorHandleIncrementSize(heap_desc.Type),
+                          heap);
 }
 
 RootSignature::RootSignature(D3D12_ROOT_SIGNATURE_FLAGS flags,
@@ -479,6 +570,7 @@ RTPipelineBuilder &RTPipelineBuilder::set_global_root_sig(const RootSignature &s
 
 RTPipeline RTPipelineBuilder::create(ID3D12Device5 *device)
 {
+    TRACE_SCOPE("Create RT Pipeline");
     if (ray_gen.empty()) {
         throw std::runtime_error("No ray generation shader set!");
     }
@@ -776,7 +868,7 @@ void RTPipeline::upload_shader_table(ID3D12GraphicsCommandList4 *cmd_list)
     auto b = barrier_transition(shader_table, D3D12_RESOURCE_STATE_COPY_DEST);
     cmd_list->ResourceBarrier(1, &b);
 
-    cmd_list->CopyResource(shader_table.get(), cpu_shader_table.get());
+    copy_buffer(cmd_list, shader_table, cpu_shader_table);
 
     b = barrier_transition(shader_table, D3D12_RESOURCE_STATE_GENERIC_READ);
     cmd_list->ResourceBarrier(1, &b);
@@ -853,23 +945,271 @@ size_t RTPipeline::compute_shader_record_size(const std::wstring &shader) const
     return align_to(shader_size, D3D12_RAYTRACING_SHADER_RECORD_BYTE_ALIGNMENT);
 }
 
-Geometry::Geometry(Buffer verts,
-                   Buffer indices,
-                   Buffer normals,
-                   Buffer uvs,
+static void hash_bytecode(Hasher &hasher, const D3D12_SHADER_BYTECODE &bytecode)
+{
+    hasher.add(bytecode.BytecodeLength);
+    if (bytecode.pShaderBytecode) {
+        hasher.add(bytecode.pShaderBytecode, bytecode.BytecodeLength);
+    }
+}
+
+// The name a pipeline is stored under in the library, a hash of its desc
+static std::wstring pipeline_name(const wchar_t *type, const Hasher &hasher)
+{
+    std::wstringstream ss;
+    ss << type << L"_" << std::hex << std::setw(16) << std::setfill(L'0') << hasher.h;
+    return ss.str();
+}
+
+PipelineCache::PipelineCache(ID3D12Device1 *device, const std::string &file)
+    : library_device(device), file(file)
+{
+    std::ifstream fin(file.c_str(), std::ios::binary);
+    if (fin) {
+        uint32_t header[2] = {0};
+        uint64_t size = 0;
+        fin.read(reinterpret_cast<char *>(header), sizeof(header));
+        fin.read(reinterpret_cast<char *>(&size), sizeof(size));
+        if (fin && header[0] == magic && header[1] == version) {
+            blob.resize(size);
+            fin.read(reinterpret_cast<char *>(blob.data()), size);
+            if (!fin) {
+                blob.clear();
+            }
+        }
+    }
+    if (!blob.empty()) {
+        const HRESULT err =
+            device->CreatePipelineLibrary(blob.data(), blob.size(), IID_PPV_ARGS(&library));
+        if (SUCCEEDED(err)) {
+            return;
+        }
+        // A library written by another adapter or driver version is rebuilt from scratch
+        if (err == D3D12_ERROR_DRIVER_VERSION_MISMATCH ||
+            err == D3D12_ERROR_ADAPTER_NOT_FOUND) {
+            std::cout << "Pipeline cache " << file
+                      << " was written by an incompatible driver, recompiling\n";
+        } else {
+            std::cout << "Warning: pipeline cache " << file << " is invalid, recompiling\n";
+        }
+        blob.clear();
+        modified = true;
+    }
+    reset(device);
+}
+
+PipelineCache::~PipelineCache()
+{
+    if (pipeline_cache() == this) {
+        set_pipeline_cache(nullptr);
+    }
+}
+
+void PipelineCache::reset(ID3D12Device1 *device)
+{
+    library = nullptr;
+    CHECK_ERR(device->CreatePipelineLibrary(nullptr, 0, IID_PPV_ARGS(&library)));
+}
+
+void PipelineCache::store(ID3D12Device1 *device,
+                          const std::wstring &name,
+                          ID3D12PipelineState *pso)
+{
+    modified = true;
+    ++num_compiled;
+    if (SUCCEEDED(library->StorePipeline(name.c_str(), pso))) {
+        return;
+    }
+    // The name is only taken if the stored pipeline's desc no longer matches, e.g. as the
+    // root signature changed. The stale library is dropped and rebuilt as pipelines are
+    // created, those already loaded from it stay valid
+    reset(device);
+    CHECK_ERR(library->StorePipeline(name.c_str(), pso));
+}
+
+ComPtr<ID3D12PipelineState> PipelineCache::create_compute(
+    ID3D12Device1 *device, const D3D12_COMPUTE_PIPELINE_STATE_DESC &desc)
+{
+    Hasher hasher;
+    hash_bytecode(hasher, desc.CS);
+    hasher.add(desc.NodeMask);
+    hasher.add(desc.Flags);
+    const std::wstring name = pipeline_name(L"cs", hasher);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ComPtr<ID3D12PipelineState> pso;
+    if (SUCCEEDED(library->LoadComputePipeline(name.c_str(), &desc, IID_PPV_ARGS(&pso)))) {
+        ++num_loaded;
+        return pso;
+    }
+    CHECK_ERR(device->CreateComputePipelineState(&desc, IID_PPV_ARGS(&pso)));
+    store(device, name, pso.Get());
+    return pso;
+}
+
+ComPtr<ID3D12PipelineState> PipelineCache::create_graphics(
+    ID3D12Device1 *device, const D3D12_GRAPHICS_PIPELINE_STATE_DESC &desc)
+{
+    Hasher hasher;
+    for (const auto &shader : {desc.VS, desc.PS, desc.DS, desc.HS, desc.GS}) {
+        hash_bytecode(hasher, shader);
+    }
+    hasher.add(desc.BlendState);
+    hasher.add(desc.SampleMask);
+    hasher.add(desc.RasterizerState);
+    hasher.add(desc.DepthStencilState);
+    for (uint32_t i = 0; i < desc.InputLayout.NumElements; ++i) {
+        const D3D12_INPUT_ELEMENT_DESC &e = desc.InputLayout.pInputElementDescs[i];
+        hasher.add(e.SemanticName, std::strlen(e.SemanticName));
+        hasher.add(e.SemanticIndex);
+        hasher.add(e.Format);
+        hasher.add(e.InputSlot);
+        hasher.add(e.AlignedByteOffset);
+        hasher.add(e.InputSlotClass);
+        hasher.add(e.InstanceDataStepRate);
+    }
+    hasher.add(desc.IBStripCutValue);
+    hasher.add(desc.PrimitiveTopologyType);
+    hasher.add(desc.NumRenderTargets);
+    hasher.add(desc.RTVFormats);
+    hasher.add(desc.DSVFormat);
+    hasher.add(desc.SampleDesc);
+    hasher.add(desc.NodeMask);
+    hasher.add(desc.Flags);
+    const std::wstring name = pipeline_name(L"gfx", hasher);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ComPtr<ID3D12PipelineState> pso;
+    if (SUCCEEDED(library->LoadGraphicsPipeline(name.c_str(), &desc, IID_PPV_ARGS(&pso)))) {
+        ++num_loaded;
+        return pso;
+    }
+    CHECK_ERR(device->CreateGraphicsPipelineState(&desc, IID_PPV_ARGS(&pso)));
+    store(device, name, pso.Get());
+    return pso;
+}
+
+void PipelineCache::save()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!modified) {
+        return;
+    }
+    std::vector<uint8_t> data(library->GetSerializedSize(), 0);
+    CHECK_ERR(library->Serialize(data.data(), data.size()));
+
+    std::ofstream fout(file.c_str(), std::ios::binary);
+    if (!fout) {
+        std::cout << "Warning: failed to open pipeline cache file " << file << "\n";
+        return;
+    }
+    const uint32_t header[2] = {magic, version};
+    const uint64_t size = data.size();
+    fout.write(reinterpret_cast<const char *>(header), sizeof(header));
+    fout.write(reinterpret_cast<const char *>(&size), sizeof(size));
+    fout.write(reinterpret_cast<const char *>(data.data()), data.size());
+    modified = false;
+}
+
+size_t PipelineCache::loaded() const
+{
+    return num_loaded;
+}
+
+size_t PipelineCache::compiled() const
+{
+    return num_compiled;
+}
+
+bool PipelineCache::matches(ID3D12Device *device) const
+{
+    return library_device == device;
+}
+
+static PipelineCache *current_pipeline_cache = nullptr;
+
+void set_pipeline_cache(PipelineCache *cache)
+{
+    current_pipeline_cache = cache;
+}
+
+PipelineCache *pipeline_cache()
+{
+    return current_pipeline_cache;
+}
+
+ComPtr<ID3D12PipelineState> create_compute_pipeline_state(
+    ID3D12Device5 *device, const D3D12_COMPUTE_PIPELINE_STATE_DESC &desc)
+{
+    TRACE_SCOPE("Create Compute PSO");
+    if (current_pipeline_cache && current_pipeline_cache->matches(device)) {
+        return current_pipeline_cache->create_compute(device, desc);
+    }
+    ComPtr<ID3D12PipelineState> pso;
+    CHECK_ERR(device->CreateComputePipelineState(&desc, IID_PPV_ARGS(&pso)));
+    return pso;
+}
+
+ComPtr<ID3D12PipelineState> create_graphics_pipeline_state(
+    ID3D12Device5 *device, const D3D12_GRAPHICS_PIPELINE_STATE_DESC &desc)
+{
+    TRACE_SCOPE("Create Graphics PSO");
+    if (current_pipeline_cache && current_pipeline_cache->matches(device)) {
+        return current_pipeline_cache->create_graphics(device, desc);
+    }
+    ComPtr<ID3D12PipelineState> pso;
+    CHECK_ERR(device->CreateGraphicsPipelineState(&desc, IID_PPV_ARGS(&pso)));
+    return pso;
+}
+
+bool GeometryEncoding::quantized_positions() const
+{
+    return vertex_format != DXGI_FORMAT_R32G32B32_FLOAT;
+}
+
+uint32_t GeometryEncoding::vertex_stride() const
+{
+    return quantized_positions() ? sizeof(int16_t) * 4 : sizeof(float) * 3;
+}
+
+uint32_t GeometryEncoding::index_stride() const
+{
+    return index_format == DXGI_FORMAT_R16_UINT ? sizeof(uint16_t) : sizeof(uint32_t);
+}
+
+Geometry::Geometry(const std::shared_ptr<GeometryPool> &pool,
+                   const GeometryEncoding &encoding,
+                   uint32_t base_vertex,
+                   uint32_t vertex_count,
+                   uint32_t first_index,
+                   uint32_t index_count,
+                   uint64_t transform_offset,
                    D3D12_RAYTRACING_GEOMETRY_FLAGS geom_flags)
-    : vertex_buf(verts), index_buf(indices), normal_buf(normals), uv_buf(uvs)
+    : pool(pool),
+      encoding(encoding),
+      base_vertex(base_vertex),
+      vertex_count(vertex_count),
+      first_index(first_index),
+      index_count(index_count),
+      transform_offset(transform_offset)
 {
     desc.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES;
-    desc.Triangles.VertexBuffer.StartAddress = vertex_buf->GetGPUVirtualAddress();
-    desc.Triangles.VertexBuffer.StrideInBytes = sizeof(float) * 3;
-    desc.Triangles.VertexCount = vertex_buf.size() / desc.Triangles.VertexBuffer.StrideInBytes;
-    desc.Triangles.VertexFormat = DXGI_FORMAT_R32G32B32_FLOAT;
-
-    desc.Triangles.IndexBuffer = index_buf->GetGPUVirtualAddress();
-    desc.Triangles.IndexFormat = DXGI_FORMAT_R32_UINT;
-    desc.Triangles.IndexCount = index_buf.size() / sizeof(uint32_t);
+    desc.Triangles.VertexBuffer.StrideInBytes = encoding.vertex_stride();
+    desc.Triangles.VertexBuffer.StartAddress =
+        pool->positions->GetGPUVirtualAddress() +
+        uint64_t(base_vertex) * desc.Triangles.VertexBuffer.StrideInBytes;
+    desc.Triangles.VertexCount = vertex_count;
+    desc.Triangles.VertexFormat = encoding.vertex_format;
+
+    desc.Triangles.IndexBuffer = pool->indices->GetGPUVirtualAddress() +
+                                 uint64_t(first_index) * encoding.index_stride();
+    desc.Triangles.IndexFormat = encoding.index_format;
+    desc.Triangles.IndexCount = index_count;
     desc.Triangles.Transform3x4 = 0;
+    if (encoding.quantized_positions()) {
+        desc.Triangles.Transform3x4 =
+            pool->transforms->GetGPUVirtualAddress() + transform_offset;
+    }
     desc.Flags = geom_flags;
 }
 
@@ -896,88 +1236,205 @@ void BottomLevelBVH::enqeue_build(ID3D12Device5 *device, ID3D12GraphicsCommandLi
     post_build_info_desc.InfoType =
         D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_COMPACTED_SIZE;
 
-    // Determine bound of much memory the accel builder may need and allocate it
-    D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS bvh_inputs = {0};
-    bvh_inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
-    bvh_inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
-    bvh_inputs.NumDescs = geom_descs.size();
-    bvh_inputs.pGeometryDescs = geom_descs.data();
-    bvh_inputs.Flags = build_flags;
+    const auto sizes = prebuild_info(device);
+    {
+        MemoryCategoryScope memory_scope(MEMORY_SCRATCH);
+        scratch = Buffer::default(device,
+                                  sizes.ScratchDataSizeInBytes,
+                                  D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                  D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    }
 
-    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO prebuild_info = {0};
-    device->GetRaytracingAccelerationStructurePrebuildInfo(&bvh_inputs, &prebuild_info);
+    // The compacted size can only be queried for BVHs allowing compaction
+    record_build(device,
+                 cmd_list,
+                 scratch->GetGPUVirtualAddress(),
+                 allows_compaction() ? &post_build_info_desc : nullptr);
+
+    // Insert a barrier to wait for the build to complete, and transition the post build
+    // info write buffer to copy source so we can read it back
+    std::array<D3D12_RESOURCE_BARRIER, 2> barriers = {
+        barrier_uav(bvh),
+        barrier_transition(post_build_info, D3D12_RESOURCE_STATE_COPY_SOURCE)};
+    cmd_list->ResourceBarrier(barriers.size(), barriers.data());
+
+    // Enqueue a copy of the post-build info to CPU visible memory
+    copy_buffer(cmd_list, post_build_info_readback, post_build_info);
+}
+
+void BottomLevelBVH::enqeue_batched_build(ID3D12Device5 *device,
+                                          ID3D12GraphicsCommandList4 *cmd_list,
+                                          D3D12_GPU_VIRTUAL_ADDRESS scratch_address,
+                                          D3D12_GPU_VIRTUAL_ADDRESS post_build_info_dest)
+{
+    post_build_info_desc.DestBuffer = post_build_info_dest;
+    post_build_info_desc.InfoType =
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_COMPACTED_SIZE;
+
+    record_build(device,
+                 cmd_list,
+                 scratch_address,
+                 allows_compaction() ? &post_build_info_desc : nullptr);
+}
+
+D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO BottomLevelBVH::prebuild_info(
+    ID3D12Device5 *device)
+{
+    if (prebuild.ResultDataMaxSizeInBytes != 0) {
+        return prebuild;
+    }
+
+    // Determine bound of much memory the accel builder may need
+    const auto bvh_inputs = build_inputs();
+    device->GetRaytracingAccelerationStructurePrebuildInfo(&bvh_inputs, &prebuild);
 
     // The buffer sizes must be aligned to 256 bytes
-    prebuild_info.ResultDataMaxSizeInBytes =
-        align_to(prebuild_info.ResultDataMaxSizeInBytes,
+    prebuild.ResultDataMaxSizeInBytes =
+        align_to(prebuild.ResultDataMaxSizeInBytes,
                  D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT);
-    prebuild_info.ScratchDataSizeInBytes =
-        align_to(prebuild_info.ScratchDataSizeInBytes,
+    prebuild.ScratchDataSizeInBytes = align_to(
+        prebuild.ScratchDataSizeInBytes, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT);
+    prebuild.UpdateScratchDataSizeInBytes =
+        align_to(prebuild.UpdateScratchDataSizeInBytes,
                  D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT);
 
 #if 0
 	std::cout << "TriangleMesh BVH will use at most "
-		<< pretty_print_count(prebuild_info.ResultDataMaxSizeInBytes) << "b, and scratch of: "
-		<< pretty_print_count(prebuild_info.ScratchDataSizeInBytes) << "b\n";
+		<< pretty_print_count(prebuild.ResultDataMaxSizeInBytes) << "b, and scratch of: "
+		<< pretty_print_count(prebuild.ScratchDataSizeInBytes) << "b\n";
 #endif
+    return prebuild;
+}
 
+D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS BottomLevelBVH::build_inputs() const
+{
+    D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS bvh_inputs = {0};
+    bvh_inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+    bvh_inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+    bvh_inputs.NumDescs = geom_descs.size();
+    bvh_inputs.pGeometryDescs = geom_descs.data();
+    bvh_inputs.Flags = build_flags;
+    return bvh_inputs;
+}
+
+void BottomLevelBVH::record_build(
+    ID3D12Device5 *device,
+    ID3D12GraphicsCommandList4 *cmd_list,
+    D3D12_GPU_VIRTUAL_ADDRESS scratch_address,
+    const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_DESC *post_build_info)
+{
     bvh = Buffer::default(device,
-                          prebuild_info.ResultDataMaxSizeInBytes,
+                          prebuild_info(device).ResultDataMaxSizeInBytes,
                           D3D12_RESOURCE_STATE_RAYTRACING_ACCELERATION_STRUCTURE,
                           D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
-    scratch = Buffer::default(device,
-                              prebuild_info.ScratchDataSizeInBytes,
-                              D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
-                              D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
 
     D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC build_desc = {0};
-    build_desc.Inputs = bvh_inputs;
+    build_desc.Inputs = build_inputs();
     build_desc.DestAccelerationStructureData = bvh->GetGPUVirtualAddress();
-    build_desc.ScratchAccelerationStructureData = scratch->GetGPUVirtualAddress();
-    cmd_list->BuildRaytracingAccelerationStructure(&build_desc, 1, &post_build_info_desc);
-
-    // Insert a barrier to wait for the build to complete, and transition the post build
-    // info write buffer to copy source so we can read it back
-    std::array<D3D12_RESOURCE_BARRIER, 2> barriers = {
-        barrier_uav(bvh),
-        barrier_transition(post_build_info, D3D12_RESOURCE_STATE_COPY_SOURCE)};
-    cmd_list->ResourceBarrier(barriers.size(), barriers.data());
-
-    // Enqueue a copy of the post-build info to CPU visible memory
-    cmd_list->CopyResource(post_build_info_readback.get(), post_build_info.get());
+    build_desc.ScratchAccelerationStructureData = scratch_address;
+    cmd_list->BuildRaytracingAccelerationStructure(
+        &build_desc, post_build_info ? 1 : 0, post_build_info);
 }
 
 void BottomLevelBVH::enqueue_compaction(ID3D12Device5 *device,
                                         ID3D12GraphicsCommandList4 *cmd_list)
 {
     uint64_t *map = static_cast<uint64_t *>(post_build_info_readback.map());
-    const uint64_t compacted_size =
-        align_to(*map, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT);
+    const uint64_t compacted_size = *map;
+    post_build_info_readback.unmap();
+
+    if (allows_compaction()) {
+        enqueue_compaction(device, cmd_list, compacted_size);
+
+        D3D12_RESOURCE_BARRIER barrier = barrier_uav(scratch);
+        cmd_list->ResourceBarrier(1, &barrier);
+    }
+}
+
+void BottomLevelBVH::enqueue_compaction(ID3D12Device5 *device,
+                                        ID3D12GraphicsCommandList4 *cmd_list,
+                                        uint64_t compacted_size)
+{
+    if (!allows_compaction()) {
+        return;
+    }
+    compacted_size =
+        align_to(compacted_size, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT);
 #if 0
 	std::cout << "Bottom level AS compacted size will be: " << pretty_print_count(compacted_size) << "b\n";
 #endif
+    MemoryCategoryScope memory_scope(MEMORY_BLAS_COMPACTED);
+    scratch = Buffer::default(device,
+                              compacted_size,
+                              D3D12_RESOURCE_STATE_RAYTRACING_ACCELERATION_STRUCTURE,
+                              D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
 
-    post_build_info_readback.unmap();
+    cmd_list->CopyRaytracingAccelerationStructure(
+        scratch->GetGPUVirtualAddress(),
+        bvh->GetGPUVirtualAddress(),
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_COMPACT);
+}
 
-    if (build_flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_COMPACTION) {
-        scratch = Buffer::default(device,
-                                  compacted_size,
-                                  D3D12_RESOURCE_STATE_RAYTRACING_ACCELERATION_STRUCTURE,
-                                  D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+void BottomLevelBVH::enqueue_update(ID3D12Device5 *device,
+                                    ID3D12GraphicsCommandList4 *cmd_list)
+{
+    if (!allows_update()) {
+        std::cout << "Error: BottomLevelBVH was not built with ALLOW_UPDATE\n";
+        throw std::runtime_error("BottomLevelBVH does not allow updates");
+    }
+    if (update_scratch.size() == 0) {
+        const uint64_t scratch_size =
+            std::max(prebuild_info(device).UpdateScratchDataSizeInBytes,
+                     uint64_t(D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT));
+        MemoryCategoryScope memory_scope(MEMORY_SCRATCH);
+        update_scratch = Buffer::default(device,
+                                         scratch_size,
+                                         D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                         D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    }
 
-        cmd_list->CopyRaytracingAccelerationStructure(
-            scratch->GetGPUVirtualAddress(),
-            bvh->GetGPUVirtualAddress(),
-            D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_COMPACT);
+    // The update refits the existing BVH in place, reading the new vertex positions
+    D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC build_desc = {0};
+    build_desc.Inputs = build_inputs();
+    build_desc.Inputs.Flags |=
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
+    build_desc.SourceAccelerationStructureData = bvh->GetGPUVirtualAddress();
+    build_desc.DestAccelerationStructureData = bvh->GetGPUVirtualAddress();
+    build_desc.ScratchAccelerationStructureData = update_scratch->GetGPUVirtualAddress();
+    cmd_list->BuildRaytracingAccelerationStructure(&build_desc, 0, nullptr);
 
-        D3D12_RESOURCE_BARRIER barrier = barrier_uav(scratch);
-        cmd_list->ResourceBarrier(1, &barrier);
-    }
+    D3D12_RESOURCE_BARRIER barrier = barrier_uav(bvh);
+    cmd_list->ResourceBarrier(1, &barrier);
+}
+
+void BottomLevelBVH::enqueue_serialize(ID3D12GraphicsCommandList4 *cmd_list,
+                                       D3D12_GPU_VIRTUAL_ADDRESS dest)
+{
+    cmd_list->CopyRaytracingAccelerationStructure(
+        dest,
+        bvh->GetGPUVirtualAddress(),
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_SERIALIZE);
+}
+
+void BottomLevelBVH::enqueue_deserialize(ID3D12Device5 *device,
+                                         ID3D12GraphicsCommandList4 *cmd_list,
+                                         D3D12_GPU_VIRTUAL_ADDRESS src,
+                                         uint64_t deserialized_size)
+{
+    bvh = Buffer::default(
+        device,
+        align_to(deserialized_size, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT),
+        D3D12_RESOURCE_STATE_RAYTRACING_ACCELERATION_STRUCTURE,
+        D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    cmd_list->CopyRaytracingAccelerationStructure(
+        bvh->GetGPUVirtualAddress(),
+        src,
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_DESERIALIZE);
 }
 
 void BottomLevelBVH::finalize()
 {
-    if (build_flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_COMPACTION) {
+    if (allows_compaction()) {
         bvh = scratch;
     }
     // Release the buffers we don't need anymore
@@ -986,6 +1443,16 @@ void BottomLevelBVH::finalize()
     post_build_info_readback = Buffer();
 }
 
+bool BottomLevelBVH::allows_compaction() const
+{
+    return build_flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_COMPACTION;
+}
+
+bool BottomLevelBVH::allows_update() const
+{
+    return build_flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE;
+}
+
 ID3D12Resource *BottomLevelBVH::operator->()
 {
     return get();
@@ -995,32 +1462,898 @@ ID3D12Resource *BottomLevelBVH::get()
     return bvh.get();
 }
 
+static double elapsed_ms(const std::chrono::steady_clock::time_point &start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+// Octahedral encode the unit vector, mapping it to [-1, 1]^2
+static glm::vec2 octahedral_encode(const glm::vec3 &n)
+{
+    const glm::vec3 v = n / std::max(std::abs(n.x) + std::abs(n.y) + std::abs(n.z), 1e-20f);
+    if (v.z >= 0.f) {
+        return glm::vec2(v.x, v.y);
+    }
+    return glm::vec2((1.f - std::abs(v.y)) * (v.x >= 0.f ? 1.f : -1.f),
+                     (1.f - std::abs(v.x)) * (v.y >= 0.f ? 1.f : -1.f));
+}
+
+static int16_t snorm16(float x)
+{
+    return static_cast<int16_t>(std::round(glm::clamp(x, -1.f, 1.f) * 32767.f));
+}
+
+// Max quantization error of the positions relative to the mean edge length of the geometry
+// for the positions to be stored as 16-bit SNORM
+const float position_quantization_tolerance = 0.01f;
+
+/* Pick the GeometryEncoding for the geometry allowed by the GeometryCompression flags.
+ * Positions are quantized over the geometry's bounds if the half step error is within the
+ * tolerance of its mean edge length, and indices are 16-bit if it has at most 64k vertices
+ */
+static GeometryEncoding select_encoding(const ::Geometry &geom, uint32_t compression)
+{
+    const ArrayView<glm::vec3> vertices = geom.vertex_data();
+    const ArrayView<glm::uvec3> indices = geom.index_data();
+    GeometryEncoding encoding;
+    if ((compression & GEOMETRY_COMPRESS_INDICES) &&
+        vertices.size() <= std::numeric_limits<uint16_t>::max() + size_t(1)) {
+        encoding.index_format = DXGI_FORMAT_R16_UINT;
+    }
+    if (!(compression & GEOMETRY_COMPRESS_POSITIONS) || vertices.empty() || indices.empty()) {
+        return encoding;
+    }
+
+    glm::vec3 lower = vertices[0];
+    glm::vec3 upper = vertices[0];
+    for (const auto &v : vertices) {
+        lower = glm::min(lower, v);
+        upper = glm::max(upper, v);
+    }
+    double edge_length = 0.0;
+    for (const auto &tri : indices) {
+        const glm::vec3 &a = vertices[tri.x];
+        const glm::vec3 &b = vertices[tri.y];
+        const glm::vec3 &c = vertices[tri.z];
+        edge_length += glm::length(b - a) + glm::length(c - b) + glm::length(a - c);
+    }
+    edge_length /= 3.0 * indices.size();
+
+    const glm::vec3 scale = glm::max(
+        (upper - lower) * 0.5f, glm::vec3(std::numeric_limits<float>::min()));
+    const float max_error = 0.5f * std::max(scale.x, std::max(scale.y, scale.z)) / 32767.f;
+    if (max_error <= position_quantization_tolerance * edge_length) {
+        encoding.vertex_format = DXGI_FORMAT_R16G16B16A16_SNORM;
+        encoding.position_scale = scale;
+        encoding.position_offset = (upper + lower) * 0.5f;
+    }
+    return encoding;
+}
+
+/* Enqueue the upload of the array into the buffer at the offset through the ring. Arrays
+ * viewing a mapped file are copied straight from the mapping into the ring
+ */
+template <typename T>
+static void enqueue_array_upload(CommandContext &cmd_ctx,
+                                 UploadRing &upload_ring,
+                                 Buffer &dst,
+                                 const ArrayView<T> &data,
+                                 uint64_t dst_offset)
+{
+    if (!data.empty()) {
+        upload_ring.upload(cmd_ctx, dst, data.data(), data.size() * sizeof(T), dst_offset);
+    }
+}
+
+template <typename T>
+static void enqueue_array_upload(CommandContext &cmd_ctx,
+                                 UploadRing &upload_ring,
+                                 Buffer &dst,
+                                 const std::vector<T> &data,
+                                 uint64_t dst_offset)
+{
+    enqueue_array_upload(cmd_ctx, upload_ring, dst, ArrayView<T>(data), dst_offset);
+}
+
+// The state the geometry pools are read in, by the BVH builds and as vertex and index buffers
+const D3D12_RESOURCE_STATES geometry_read_state =
+    D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE |
+    D3D12_RESOURCE_STATE_VERTEX_AND_CONSTANT_BUFFER | D3D12_RESOURCE_STATE_INDEX_BUFFER;
+
+// Max size of each buffer of a GeometryPool, within the 32-bit size of the vertex and index
+// buffer views drawing from it
+const uint64_t max_geometry_pool_bytes = uint64_t(1) << 31;
+
+// The size of a vertex position in the pool, quantized positions are 16-bit SNORM
+static uint64_t position_stride(bool quantized)
+{
+    return quantized ? sizeof(glm::i16vec4) : sizeof(glm::vec3);
+}
+
+/* Enqueue the uploads of the meshes' geometry and set up their BVHs with the build flags,
+ * without building them. Each geometry is encoded with the formats the compression flags
+ * allow and packed into the GeometryPool for its position format. The pools are created in
+ * the state and appended to pools
+ */
+static std::vector<BottomLevelBVH> enqueue_geometry_upload(
+    ID3D12Device5 *device,
+    CommandContext &cmd_ctx,
+    UploadRing &upload_ring,
+    const ::Mesh *meshes,
+    size_t num_meshes,
+    D3D12_RESOURCE_STATES state,
+    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags,
+    uint32_t compression,
+    std::vector<std::shared_ptr<GeometryPool>> &pools)
+{
+    // Refitting re-uploads float positions, so BVHs that allow updates keep them
+    if (build_flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE) {
+        compression &= ~GEOMETRY_COMPRESS_POSITIONS;
+    }
+
+    // Lay out the geometries in the float and quantized position pools
+    struct GeometryLayout {
+        GeometryEncoding encoding;
+        size_t pool = 0;
+        uint32_t base_vertex = 0;
+        uint64_t index_offset = 0;
+        uint64_t transform_offset = 0;
+    };
+    struct PoolLayout {
+        bool quantized = false;
+        uint64_t num_vertices = 0;
+        uint64_t index_bytes = 0;
+        std::vector<float> transforms;
+    };
+    // A new pool is started for a position format once its current one would exceed the
+    // size limit, to keep the vertex and index buffer views' 32-bit sizes in range
+    std::vector<PoolLayout> pool_layouts;
+    std::array<size_t, 2> current_pool = {size_t(-1), size_t(-1)};
+    std::vector<GeometryLayout> layouts;
+    for (size_t m = 0; m < num_meshes; ++m) {
+        for (const auto &geom : meshes[m].geometries) {
+            GeometryLayout l;
+            l.encoding = select_encoding(geom, compression);
+            const size_t format = l.encoding.quantized_positions() ? 1 : 0;
+            const uint64_t vertex_bytes = geom.vertex_data().size() * position_stride(format);
+            const uint64_t index_bytes =
+                align_to(geom.index_data().size() * 3 * l.encoding.index_stride(), 4);
+            if (std::max(vertex_bytes, index_bytes) > max_geometry_pool_bytes) {
+                std::cout << "Error: geometry with " << geom.index_data().size()
+                          << " triangles exceeds the geometry buffer size limit, split it "
+                             "into smaller geometries\n";
+                throw std::runtime_error("Geometry exceeds the geometry buffer size limit");
+            }
+            if (current_pool[format] == size_t(-1) ||
+                pool_layouts[current_pool[format]].num_vertices * position_stride(format) +
+                        vertex_bytes >
+                    max_geometry_pool_bytes ||
+                pool_layouts[current_pool[format]].index_bytes + index_bytes >
+                    max_geometry_pool_bytes) {
+                current_pool[format] = pool_layouts.size();
+                pool_layouts.emplace_back();
+                pool_layouts.back().quantized = format == 1;
+            }
+            l.pool = current_pool[format];
+            PoolLayout &p = pool_layouts[l.pool];
+            l.base_vertex = static_cast<uint32_t>(p.num_vertices);
+            l.index_offset = p.index_bytes;
+            p.num_vertices += geom.vertex_data().size();
+            p.index_bytes += index_bytes;
+            if (l.encoding.quantized_positions()) {
+                const GeometryEncoding &e = l.encoding;
+                l.transform_offset = p.transforms.size() * sizeof(float);
+                const float transform[12] = {e.position_scale.x,
+                                             0.f,
+                                             0.f,
+                                             e.position_offset.x,
+                                             0.f,
+                                             e.position_scale.y,
+                                             0.f,
+                                             e.position_offset.y,
+                                             0.f,
+                                             0.f,
+                                             e.position_scale.z,
+                                             e.position_offset.z};
+                p.transforms.insert(p.transforms.end(), transform, transform + 12);
+            }
+            layouts.push_back(l);
+        }
+    }
+
+    std::vector<std::shared_ptr<GeometryPool>> batch_pools(pool_layouts.size());
+    for (size_t i = 0; i < batch_pools.size(); ++i) {
+        const PoolLayout &p = pool_layouts[i];
+        if (p.num_vertices == 0) {
+            continue;
+        }
+        auto pool = std::make_shared<GeometryPool>();
+        MemoryCategoryScope memory_scope(MEMORY_GEOMETRY);
+        pool->positions =
+            Buffer::default(device, p.num_vertices * position_stride(p.quantized), state);
+        pool->normals = Buffer::default(device, p.num_vertices * sizeof(glm::i16vec2), state);
+        pool->uvs = Buffer::default(device, p.num_vertices * sizeof(glm::vec2), state);
+        pool->indices = Buffer::default(device, std::max(p.index_bytes, uint64_t(4)), state);
+        if (!p.transforms.empty()) {
+            pool->transforms =
+                Buffer::default(device, p.transforms.size() * sizeof(float), state);
+            enqueue_array_upload(cmd_ctx, upload_ring, pool->transforms, p.transforms, 0);
+        }
+        batch_pools[i] = pool;
+        pools.push_back(pool);
+    }
+
+    std::vector<BottomLevelBVH> bvhs;
+    size_t next_layout = 0;
+    for (size_t m = 0; m < num_meshes; ++m) {
+        std::vector<Geometry> geometries;
+        for (const auto &geom : meshes[m].geometries) {
+            const GeometryLayout &l = layouts[next_layout++];
+            const GeometryEncoding &encoding = l.encoding;
+            GeometryPool &pool = *batch_pools[l.pool];
+            const ArrayView<glm::vec3> vertices = geom.vertex_data();
+            const ArrayView<glm::vec3> geom_normals = geom.normal_data();
+            const ArrayView<glm::vec2> geom_uvs = geom.uv_data();
+            const ArrayView<glm::uvec3> geom_indices = geom.index_data();
+
+            if (encoding.quantized_positions()) {
+                std::vector<glm::i16vec4> positions;
+                positions.reserve(vertices.size());
+                for (const auto &v : vertices) {
+                    const glm::vec3 p =
+                        (v - encoding.position_offset) / encoding.position_scale;
+                    positions.emplace_back(snorm16(p.x), snorm16(p.y), snorm16(p.z), 0);
+                }
+                enqueue_array_upload(cmd_ctx,
+                                     upload_ring,
+                                     pool.positions,
+                                     positions,
+                                     l.base_vertex * sizeof(glm::i16vec4));
+            } else {
+                enqueue_array_upload(cmd_ctx,
+                                     upload_ring,
+                                     pool.positions,
+                                     vertices,
+                                     l.base_vertex * sizeof(glm::vec3));
+            }
+
+            if (encoding.index_format == DXGI_FORMAT_R16_UINT) {
+                std::vector<glm::u16vec3> indices(geom_indices.begin(), geom_indices.end());
+                enqueue_array_upload(
+                    cmd_ctx, upload_ring, pool.indices, indices, l.index_offset);
+            } else {
+                enqueue_array_upload(
+                    cmd_ctx, upload_ring, pool.indices, geom_indices, l.index_offset);
+            }
+
+            // Missing normals and UVs are zero filled, since all the attributes are indexed
+            // by the same base vertex
+            std::vector<glm::i16vec2> normals(vertices.size(), glm::i16vec2(0));
+            for (size_t i = 0; i < geom_normals.size() && i < normals.size(); ++i) {
+                const glm::vec2 e = octahedral_encode(geom_normals[i]);
+                normals[i] = glm::i16vec2(snorm16(e.x), snorm16(e.y));
+            }
+            enqueue_array_upload(cmd_ctx,
+                                 upload_ring,
+                                 pool.normals,
+                                 normals,
+                                 l.base_vertex * sizeof(glm::i16vec2));
+            if (geom_uvs.size() == vertices.size()) {
+                enqueue_array_upload(cmd_ctx,
+                                     upload_ring,
+                                     pool.uvs,
+                                     geom_uvs,
+                                     l.base_vertex * sizeof(glm::vec2));
+            } else {
+                const std::vector<glm::vec2> uvs(vertices.size(), glm::vec2(0.f));
+                enqueue_array_upload(
+                    cmd_ctx, upload_ring, pool.uvs, uvs, l.base_vertex * sizeof(glm::vec2));
+            }
+
+            geometries.emplace_back(
+                batch_pools[l.pool],
+                encoding,
+                l.base_vertex,
+                static_cast<uint32_t>(vertices.size()),
+                static_cast<uint32_t>(l.index_offset / encoding.index_stride()),
+                static_cast<uint32_t>(geom_indices.size() * 3),
+                l.transform_offset,
+                geom.alpha_tested ? D3D12_RAYTRACING_GEOMETRY_FLAG_NONE
+                                  : D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE);
+        }
+        bvhs.emplace_back(geometries, build_flags);
+    }
+    return bvhs;
+}
+
+// Transition the buffers of the geometry pools to be read by the builds and shaders
+static void transition_pools(std::vector<std::shared_ptr<GeometryPool>> &pools,
+                             std::vector<D3D12_RESOURCE_BARRIER> &barriers)
+{
+    auto transition = [&](Buffer &b) {
+        if (b.size() != 0) {
+            barriers.push_back(barrier_transition(b, geometry_read_state));
+        }
+    };
+    for (auto &p : pools) {
+        transition(p->positions);
+        transition(p->normals);
+        transition(p->uvs);
+        transition(p->indices);
+        transition(p->transforms);
+    }
+}
+
+size_t mesh_upload_size(const ::Mesh &mesh)
+{
+    size_t size = 0;
+    for (const auto &geom : mesh.geometries) {
+        size += 12 * sizeof(float) +
+                geom.vertex_data().size() * (2 * sizeof(glm::vec3) + sizeof(glm::vec2)) +
+                geom.index_data().size() * sizeof(glm::uvec3) + 4;
+    }
+    return size;
+}
+
+std::vector<BottomLevelBVH> upload_mesh_geometry(
+    ID3D12Device5 *device,
+    CommandContext &cmd_ctx,
+    UploadRing &upload_ring,
+    const std::vector<::Mesh> &meshes,
+    GpuProfiler *profiler,
+    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags,
+    uint32_t compression)
+{
+    TRACE_SCOPE("Geometry Upload");
+    ID3D12GraphicsCommandList4 *cmd_list = cmd_ctx.cmd_list.Get();
+
+    // Upload all the geometry through the ring, this is one submission unless the ring
+    // fills up and must be flushed
+    std::vector<std::shared_ptr<GeometryPool>> pools;
+    cmd_ctx.begin();
+    const uint32_t upload_region = profiler ? profiler->begin(cmd_list, "Geometry Upload")
+                                            : GpuProfiler::invalid_region;
+    std::vector<BottomLevelBVH> bvhs = enqueue_geometry_upload(device,
+                                                               cmd_ctx,
+                                                               upload_ring,
+                                                               meshes.data(),
+                                                               meshes.size(),
+                                                               D3D12_RESOURCE_STATE_COPY_DEST,
+                                                               build_flags,
+                                                               compression,
+                                                               pools);
+    std::vector<D3D12_RESOURCE_BARRIER> barriers;
+    transition_pools(pools, barriers);
+    if (!barriers.empty()) {
+        cmd_list->ResourceBarrier(barriers.size(), barriers.data());
+    }
+    if (profiler) {
+        profiler->end(cmd_list, upload_region);
+    }
+    upload_ring.submit_and_sync(cmd_ctx);
+    return bvhs;
+}
+
+std::vector<BottomLevelBVH> build_mesh_bvhs(
+    ID3D12Device5 *device,
+    CommandContext &cmd_ctx,
+    UploadRing &upload_ring,
+    const std::vector<::Mesh> &meshes,
+    MeshBuildStats *stats,
+    uint64_t memory_budget,
+    GpuProfiler *profiler,
+    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags,
+    uint32_t compression)
+{
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<BottomLevelBVH> bvhs =
+        upload_mesh_geometry(
+            device, cmd_ctx, upload_ring, meshes, profiler, build_flags, compression);
+    const double upload_ms = elapsed_ms(start);
+
+    build_bvhs(device, cmd_ctx, bvhs, stats, memory_budget, profiler);
+    if (stats) {
+        stats->upload_ms = upload_ms;
+    }
+    return bvhs;
+}
+
+std::vector<BottomLevelBVH> build_mesh_bvhs_async(
+    ID3D12Device5 *device,
+    CommandContext &cmd_ctx,
+    CommandContext &copy_ctx,
+    UploadRing &upload_ring,
+    const std::vector<::Mesh> &meshes,
+    MeshBuildStats *stats,
+    uint64_t memory_budget,
+    GpuProfiler *profiler,
+    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags,
+    uint32_t compression)
+{
+    TRACE_SCOPE("Build Mesh BVHs Async");
+    std::vector<BottomLevelBVH> bvhs;
+    if (meshes.empty()) {
+        return bvhs;
+    }
+
+    // Batch the meshes by upload size so the next batch can be staged in the ring while
+    // the previous one is still being copied
+    const size_t batch_size = upload_ring.capacity() / 2;
+    std::vector<size_t> batch_starts;
+    size_t current_size = 0;
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        const size_t mesh_size = mesh_upload_size(meshes[i]);
+        if (i == 0 || current_size + mesh_size > batch_size) {
+            batch_starts.push_back(i);
+            current_size = 0;
+        }
+        current_size += mesh_size;
+    }
+    batch_starts.push_back(meshes.size());
+    const size_t num_batches = batch_starts.size() - 1;
+
+    double upload_ms = 0.0;
+    // Record the uploads of the batch on the copy queue, returning the fence value signaled
+    // once they're done. Buffers accessed by the copy queue decay to the common state after
+    // the copies, so they're created in it to keep their tracked state correct
+    auto upload_batch = [&](size_t b,
+                            std::vector<BottomLevelBVH> &batch,
+                            std::vector<std::shared_ptr<GeometryPool>> &pools) {
+        const auto start = std::chrono::steady_clock::now();
+        upload_ring.reclaim(copy_ctx.fence->GetCompletedValue());
+        copy_ctx.begin();
+        batch = enqueue_geometry_upload(device,
+                                        copy_ctx,
+                                        upload_ring,
+                                        meshes.data() + batch_starts[b],
+                                        batch_starts[b + 1] - batch_starts[b],
+                                        D3D12_RESOURCE_STATE_COMMON,
+                                        build_flags,
+                                        compression,
+                                        pools);
+        upload_ring.retire(copy_ctx.fence_value);
+        const uint64_t fence_value = copy_ctx.submit();
+        upload_ms += elapsed_ms(start);
+        return fence_value;
+    };
+
+    MeshBuildStats build_stats;
+    std::vector<BottomLevelBVH> next_batch;
+    std::vector<std::shared_ptr<GeometryPool>> next_pools;
+    uint64_t next_fence_value = upload_batch(0, next_batch, next_pools);
+    for (size_t b = 0; b < num_batches; ++b) {
+        std::vector<BottomLevelBVH> batch = std::move(next_batch);
+        std::vector<std::shared_ptr<GeometryPool>> pools = std::move(next_pools);
+        const uint64_t batch_fence_value = next_fence_value;
+        next_batch.clear();
+        next_pools.clear();
+
+        // The direct queue waits on the copies of this batch on the GPU before transitioning
+        // its geometry for the builds
+        cmd_ctx.queue_wait(copy_ctx, batch_fence_value);
+        cmd_ctx.begin();
+        std::vector<D3D12_RESOURCE_BARRIER> barriers;
+        transition_pools(pools, barriers);
+        if (!barriers.empty()) {
+            cmd_ctx.cmd_list->ResourceBarrier(barriers.size(), barriers.data());
+        }
+        const uint64_t transition_fence_value = cmd_ctx.submit();
+
+        // Stage and copy the next batch while this one is built
+        if (b + 1 < num_batches) {
+            next_fence_value = upload_batch(b + 1, next_batch, next_pools);
+        }
+
+        cmd_ctx.wait(transition_fence_value);
+        MeshBuildStats batch_stats;
+        build_bvhs(device, cmd_ctx, batch, &batch_stats, memory_budget, profiler);
+        build_stats.build_ms += batch_stats.build_ms;
+        build_stats.compaction_ms += batch_stats.compaction_ms;
+        build_stats.uncompacted_bytes += batch_stats.uncompacted_bytes;
+        build_stats.compacted_bytes += batch_stats.compacted_bytes;
+        build_stats.scratch_bytes =
+            std::max(build_stats.scratch_bytes, batch_stats.scratch_bytes);
+        build_stats.num_build_groups += batch_stats.num_build_groups;
+
+        std::move(batch.begin(), batch.end(), std::back_inserter(bvhs));
+    }
+    // Leave the ring idle, as the callers expect after a synchronous upload
+    copy_ctx.sync();
+    upload_ring.reclaim(copy_ctx.fence->GetCompletedValue());
+
+    build_stats.upload_ms = upload_ms;
+    if (stats) {
+        *stats = build_stats;
+    }
+    return bvhs;
+}
+
+std::vector<std::vector<uint8_t>> serialize_bvhs(ID3D12Device5 *device,
+                                                 CommandContext &cmd_ctx,
+                                                 std::vector<BottomLevelBVH> &bvhs)
+{
+    std::vector<std::vector<uint8_t>> blobs;
+    if (bvhs.empty()) {
+        return blobs;
+    }
+    ID3D12GraphicsCommandList4 *cmd_list = cmd_ctx.cmd_list.Get();
+
+    // Query the serialized size of all the BVHs in one post build info write
+    using SerializationDesc =
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_SERIALIZATION_DESC;
+    const size_t info_size = bvhs.size() * sizeof(SerializationDesc);
+    Buffer info = Buffer::default(device,
+                                  info_size,
+                                  D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                  D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    Buffer info_readback = Buffer::readback(device, info_size, D3D12_RESOURCE_STATE_COPY_DEST);
+
+    std::vector<D3D12_GPU_VIRTUAL_ADDRESS> bvh_addresses;
+    for (auto &b : bvhs) {
+        bvh_addresses.push_back(b->GetGPUVirtualAddress());
+    }
+    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_DESC info_desc = {0};
+    info_desc.DestBuffer = info->GetGPUVirtualAddress();
+    info_desc.InfoType = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_SERIALIZATION;
+
+    cmd_ctx.begin();
+    cmd_list->EmitRaytracingAccelerationStructurePostbuildInfo(
+        &info_desc, bvh_addresses.size(), bvh_addresses.data());
+    {
+        D3D12_RESOURCE_BARRIER b = barrier_transition(info, D3D12_RESOURCE_STATE_COPY_SOURCE);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    copy_buffer(cmd_list, info_readback, info);
+    cmd_ctx.submit_and_sync();
+
+    std::vector<uint64_t> sizes, offsets;
+    uint64_t total_size = 0;
+    {
+        const SerializationDesc *descs =
+            static_cast<const SerializationDesc *>(info_readback.map());
+        for (size_t i = 0; i < bvhs.size(); ++i) {
+            sizes.push_back(descs[i].SerializedSizeInBytes);
+            offsets.push_back(total_size);
+            total_size += align_to(descs[i].SerializedSizeInBytes,
+                                   D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT);
+        }
+        info_readback.unmap();
+    }
+
+    // Serialize all the BVHs into one buffer and read it back
+    Buffer serialized = Buffer::default(device,
+                                        total_size,
+                                        D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                        D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    Buffer serialized_readback =
+        Buffer::readback(device, total_size, D3D12_RESOURCE_STATE_COPY_DEST);
+    cmd_ctx.begin();
+    for (size_t i = 0; i < bvhs.size(); ++i) {
+        bvhs[i].enqueue_serialize(cmd_list, serialized->GetGPUVirtualAddress() + offsets[i]);
+    }
+    {
+        D3D12_RESOURCE_BARRIER b =
+            barrier_transition(serialized, D3D12_RESOURCE_STATE_COPY_SOURCE);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+    copy_buffer(cmd_list, serialized_readback, serialized);
+    cmd_ctx.submit_and_sync();
+
+    const uint8_t *data = static_cast<const uint8_t *>(serialized_readback.map());
+    for (size_t i = 0; i < bvhs.size(); ++i) {
+        blobs.emplace_back(data + offsets[i], data + offsets[i] + sizes[i]);
+    }
+    serialized_readback.unmap();
+    return blobs;
+}
+
+bool serialized_bvh_compatible(ID3D12Device5 *device, const std::vector<uint8_t> &blob)
+{
+    D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER header;
+    if (blob.size() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, blob.data(), sizeof(header));
+    if (header.SerializedSizeInBytesIncludingHeader > blob.size()) {
+        return false;
+    }
+    return device->CheckDriverMatchingIdentifier(
+               D3D12_SERIALIZED_DATA_RAYTRACING_ACCELERATION_STRUCTURE,
+               &header.DriverMatchingIdentifier) ==
+           D3D12_DRIVER_MATCHING_IDENTIFIER_COMPATIBLE_WITH_DEVICE;
+}
+
+bool deserialize_bvhs(ID3D12Device5 *device,
+                      CommandContext &cmd_ctx,
+                      UploadRing &upload_ring,
+                      std::vector<BottomLevelBVH> &bvhs,
+                      const std::vector<std::vector<uint8_t>> &blobs)
+{
+    TRACE_SCOPE("Deserialize BVHs");
+    if (blobs.size() != bvhs.size()) {
+        return false;
+    }
+    std::vector<uint64_t> offsets;
+    uint64_t total_size = 0;
+    for (const auto &blob : blobs) {
+        if (!serialized_bvh_compatible(device, blob)) {
+            return false;
+        }
+        // The serialized data must be aligned like the BVHs
+        offsets.push_back(total_size);
+        total_size +=
+            align_to(blob.size(), D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT);
+    }
+    if (bvhs.empty()) {
+        return true;
+    }
+    ID3D12GraphicsCommandList4 *cmd_list = cmd_ctx.cmd_list.Get();
+
+    Buffer serialized = Buffer::default(device, total_size, D3D12_RESOURCE_STATE_COPY_DEST);
+    cmd_ctx.begin();
+    for (size_t i = 0; i < blobs.size(); ++i) {
+        upload_ring.upload(cmd_ctx, serialized, blobs[i].data(), blobs[i].size(), offsets[i]);
+    }
+    {
+        D3D12_RESOURCE_BARRIER b =
+            barrier_transition(serialized, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+
+    std::vector<D3D12_RESOURCE_BARRIER> barriers;
+    for (size_t i = 0; i < bvhs.size(); ++i) {
+        D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER header;
+        std::memcpy(&header, blobs[i].data(), sizeof(header));
+        bvhs[i].enqueue_deserialize(device,
+                                    cmd_list,
+                                    serialized->GetGPUVirtualAddress() + offsets[i],
+                                    header.DeserializedSizeInBytes);
+        barriers.push_back(barrier_uav(bvhs[i].bvh));
+    }
+    cmd_list->ResourceBarrier(barriers.size(), barriers.data());
+    upload_ring.submit_and_sync(cmd_ctx);
+    return true;
+}
+
+void update_mesh_bvh(ID3D12Device5 *device,
+                     CommandContext &cmd_ctx,
+                     UploadRing &upload_ring,
+                     BottomLevelBVH &bvh,
+                     const ::Mesh &mesh)
+{
+    if (mesh.geometries.size() != bvh.geometries.size()) {
+        std::cout << "Error: update_mesh_bvh mesh has " << mesh.geometries.size()
+                  << " geometries but the BVH was built with " << bvh.geometries.size()
+                  << "\n";
+        throw std::runtime_error("update_mesh_bvh geometry count mismatch");
+    }
+    // The geometries' positions may share pools, which are each transitioned once
+    std::vector<GeometryPool *> pools;
+    for (size_t i = 0; i < mesh.geometries.size(); ++i) {
+        const Geometry &g = bvh.geometries[i];
+        if (g.encoding.quantized_positions()) {
+            std::cout << "Error: update_mesh_bvh geometry " << i
+                      << " has quantized positions, which can't be refit\n";
+            throw std::runtime_error("update_mesh_bvh quantized positions");
+        }
+        if (mesh.geometries[i].vertex_data().size() != g.vertex_count) {
+            std::cout << "Error: update_mesh_bvh geometry " << i
+                      << " vertex count changed since the BVH was built\n";
+            throw std::runtime_error("update_mesh_bvh vertex count mismatch");
+        }
+        if (std::find(pools.begin(), pools.end(), g.pool.get()) == pools.end()) {
+            pools.push_back(g.pool.get());
+        }
+    }
+    ID3D12GraphicsCommandList4 *cmd_list = cmd_ctx.cmd_list.Get();
+
+    cmd_ctx.begin();
+    std::vector<D3D12_RESOURCE_BARRIER> barriers;
+    for (auto *p : pools) {
+        barriers.push_back(barrier_transition(p->positions, D3D12_RESOURCE_STATE_COPY_DEST));
+    }
+    cmd_list->ResourceBarrier(barriers.size(), barriers.data());
+
+    for (size_t i = 0; i < mesh.geometries.size(); ++i) {
+        const ArrayView<glm::vec3> verts = mesh.geometries[i].vertex_data();
+        Geometry &g = bvh.geometries[i];
+        upload_ring.upload(cmd_ctx,
+                           g.pool->positions,
+                           verts.data(),
+                           verts.size() * sizeof(glm::vec3),
+                           g.base_vertex * sizeof(glm::vec3));
+    }
+
+    barriers.clear();
+    for (auto *p : pools) {
+        barriers.push_back(barrier_transition(p->positions, geometry_read_state));
+    }
+    cmd_list->ResourceBarrier(barriers.size(), barriers.data());
+
+    bvh.enqueue_update(device, cmd_list);
+    upload_ring.submit_and_sync(cmd_ctx);
+}
+
+void build_bvhs(ID3D12Device5 *device,
+                CommandContext &cmd_ctx,
+                std::vector<BottomLevelBVH> &bvhs,
+                MeshBuildStats *stats,
+                uint64_t memory_budget,
+                GpuProfiler *profiler)
+{
+    TRACE_SCOPE("Build BVHs");
+    MeshBuildStats build_stats;
+    ID3D12GraphicsCommandList4 *cmd_list = cmd_ctx.cmd_list.Get();
+    auto begin_region = [&](const std::string &name) {
+        return profiler ? profiler->begin(cmd_list, name) : GpuProfiler::invalid_region;
+    };
+    auto end_region = [&](uint32_t region) {
+        if (profiler) {
+            profiler->end(cmd_list, region);
+        }
+    };
+
+    // The compacted sizes of each group are written to a single buffer which is read
+    // back once all builds in the group are done
+    const size_t post_build_info_size = std::max(bvhs.size(), size_t(1)) * sizeof(uint64_t);
+    Buffer post_build_info = Buffer::default(device,
+                                             post_build_info_size,
+                                             D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                             D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    Buffer post_build_info_readback =
+        Buffer::readback(device, post_build_info.size(), D3D12_RESOURCE_STATE_COPY_DEST);
+
+    // The scratch space shared by all groups, grown as needed for the largest group
+    Buffer scratch;
+    size_t group_start = 0;
+    while (group_start < bvhs.size()) {
+        TRACE_SCOPE("BLAS Group");
+        auto start = std::chrono::steady_clock::now();
+
+        // Our own scratch buffer is counted in the current usage but will be reused
+        const uint64_t budget =
+            memory_budget != 0 ? memory_budget
+                               : available_video_memory(device) + scratch.size();
+
+        // Group builds until the uncompacted BVHs and scratch space would exceed the
+        // budget, always taking at least one build so we make progress
+        std::vector<uint64_t> scratch_offsets;
+        uint64_t group_scratch = 0;
+        uint64_t group_bvh = 0;
+        size_t group_end = group_start;
+        for (; group_end < bvhs.size(); ++group_end) {
+            const auto sizes = bvhs[group_end].prebuild_info(device);
+            if (group_end != group_start &&
+                group_scratch + group_bvh + sizes.ScratchDataSizeInBytes +
+                        sizes.ResultDataMaxSizeInBytes >
+                    budget) {
+                break;
+            }
+            scratch_offsets.push_back(group_scratch);
+            group_scratch += sizes.ScratchDataSizeInBytes;
+            group_bvh += sizes.ResultDataMaxSizeInBytes;
+        }
+        if (group_scratch + group_bvh > budget) {
+            std::cout << "Warning: BLAS build needs "
+                      << pretty_print_count(group_scratch + group_bvh) << "b, exceeding the video memory budget of "
+                      << pretty_print_count(budget) << "b\n";
+        }
+
+        if (scratch.size() < group_scratch) {
+            // Release the old scratch space before allocating the larger one
+            scratch = Buffer();
+            MemoryCategoryScope memory_scope(MEMORY_SCRATCH);
+            scratch = Buffer::default(device,
+                                      group_scratch,
+                                      D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                      D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+        }
+
+        const std::string group_name =
+            " (group " + std::to_string(build_stats.num_build_groups) + ")";
+        cmd_ctx.begin();
+        const uint32_t build_region = begin_region("BLAS Build" + group_name);
+        if (group_start != 0) {
+            D3D12_RESOURCE_BARRIER b =
+                barrier_transition(post_build_info, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+            cmd_list->ResourceBarrier(1, &b);
+        }
+        for (size_t i = group_start; i < group_end; ++i) {
+            bvhs[i].enqeue_batched_build(
+                device,
+                cmd_list,
+                scratch->GetGPUVirtualAddress() + scratch_offsets[i - group_start],
+                post_build_info->GetGPUVirtualAddress() + i * sizeof(uint64_t));
+        }
+        {
+            // A null UAV barrier waits on all the builds at once
+            std::array<D3D12_RESOURCE_BARRIER, 2> barriers = {
+                barrier_uav(nullptr),
+                barrier_transition(post_build_info, D3D12_RESOURCE_STATE_COPY_SOURCE)};
+            cmd_list->ResourceBarrier(barriers.size(), barriers.data());
+        }
+        end_region(build_region);
+        cmd_list->CopyBufferRegion(post_build_info_readback.get(),
+                                   post_build_info_readback.offset() +
+                                       group_start * sizeof(uint64_t),
+                                   post_build_info.get(),
+                                   group_start * sizeof(uint64_t),
+                                   (group_end - group_start) * sizeof(uint64_t));
+        cmd_ctx.submit_and_sync();
+        build_stats.build_ms += elapsed_ms(start);
+
+        // Compact the group and release the uncompacted BVHs before building the next
+        start = std::chrono::steady_clock::now();
+        for (size_t i = group_start; i < group_end; ++i) {
+            build_stats.uncompacted_bytes += bvhs[i].bvh.size();
+        }
+        const bool compact =
+            std::any_of(bvhs.begin() + group_start,
+                        bvhs.begin() + group_end,
+                        [](const BottomLevelBVH &b) { return b.allows_compaction(); });
+        if (compact) {
+            TRACE_SCOPE("BLAS Compaction");
+            const uint64_t *compacted_sizes =
+                static_cast<const uint64_t *>(post_build_info_readback.map());
+            cmd_ctx.begin();
+            const uint32_t compaction_region = begin_region("BLAS Compaction" + group_name);
+            for (size_t i = group_start; i < group_end; ++i) {
+                bvhs[i].enqueue_compaction(device, cmd_list, compacted_sizes[i]);
+            }
+            end_region(compaction_region);
+            post_build_info_readback.unmap();
+            cmd_ctx.submit_and_sync();
+        }
+
+        for (size_t i = group_start; i < group_end; ++i) {
+            bvhs[i].finalize();
+            build_stats.compacted_bytes += bvhs[i].bvh.size();
+        }
+        build_stats.compaction_ms += elapsed_ms(start);
+
+        ++build_stats.num_build_groups;
+        group_start = group_end;
+    }
+    build_stats.scratch_bytes = scratch.size();
+
+    if (stats) {
+        *stats = build_stats;
+    }
+}
+
+TlasInstance::TlasInstance(const glm::mat4 &transform, uint32_t mesh_id)
+    : transform(transform), mesh_id(mesh_id)
+{
+}
+
 TopLevelBVH::TopLevelBVH(Buffer instance_buf,
-                         const std::vector<Instance> &instances,
-                         D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags)
-    : instances(instances), instance_buf(instance_buf), build_flags(build_flags)
+                         std::vector<TlasInstance> instances,
+                         D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags,
+                         size_t num_extra_descs)
+    : build_flags(build_flags),
+      num_extra_descs(num_extra_descs),
+      instances(std::move(instances)),
+      instance_buf(instance_buf)
 {
 }
 
 void TopLevelBVH::enqeue_build(ID3D12Device5 *device, ID3D12GraphicsCommandList4 *cmd_list)
 {
+    TRACE_SCOPE("TLAS Record");
     // Determine bound of much memory the accel builder may need and allocate it
-    D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS bvh_inputs = {0};
-    bvh_inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
-    bvh_inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
-    bvh_inputs.NumDescs = instances.size();
-    bvh_inputs.InstanceDescs = instance_buf->GetGPUVirtualAddress();
-    bvh_inputs.Flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE;
-
+    const auto bvh_inputs = build_inputs();
     D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO prebuild_info = {0};
     device->GetRaytracingAccelerationStructurePrebuildInfo(&bvh_inputs, &prebuild_info);
 
-    // The buffer sizes must be aligned to 256 bytes
+    // The buffer sizes must be aligned to 256 bytes. BVHs allowing updates keep the
+    // scratch space around for the updates, so size it for both
     prebuild_info.ResultDataMaxSizeInBytes =
         align_to(prebuild_info.ResultDataMaxSizeInBytes,
                  D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT);
     prebuild_info.ScratchDataSizeInBytes =
-        align_to(prebuild_info.ScratchDataSizeInBytes,
+        align_to(std::max(prebuild_info.ScratchDataSizeInBytes,
+                          prebuild_info.UpdateScratchDataSizeInBytes),
                  D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT);
 #if 0
 	std::cout << "TopLevelBVH will use at most "
@@ -1028,14 +2361,20 @@ void TopLevelBVH::enqeue_build(ID3D12Device5 *device, ID3D12GraphicsCommandList4
 		<< pretty_print_count(prebuild_info.ScratchDataSizeInBytes) << "b\n";
 #endif
 
-    bvh = Buffer::default(device,
-                          prebuild_info.ResultDataMaxSizeInBytes,
-                          D3D12_RESOURCE_STATE_RAYTRACING_ACCELERATION_STRUCTURE,
-                          D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
-    scratch = Buffer::default(device,
-                              prebuild_info.ScratchDataSizeInBytes,
-                              D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+    {
+        MemoryCategoryScope memory_scope(MEMORY_TLAS);
+        bvh = Buffer::default(device,
+                              prebuild_info.ResultDataMaxSizeInBytes,
+                              D3D12_RESOURCE_STATE_RAYTRACING_ACCELERATION_STRUCTURE,
                               D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    }
+    {
+        MemoryCategoryScope memory_scope(MEMORY_SCRATCH);
+        scratch = Buffer::default(device,
+                                  prebuild_info.ScratchDataSizeInBytes,
+                                  D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                  D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    }
 
     D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC build_desc = {0};
     build_desc.Inputs = bvh_inputs;
@@ -1048,10 +2387,46 @@ void TopLevelBVH::enqeue_build(ID3D12Device5 *device, ID3D12GraphicsCommandList4
     cmd_list->ResourceBarrier(1, &barrier);
 }
 
+void TopLevelBVH::enqueue_update(ID3D12Device5 *device,
+                                 ID3D12GraphicsCommandList4 *cmd_list)
+{
+    if (!allows_update()) {
+        std::cout << "Error: TopLevelBVH was not built with ALLOW_UPDATE\n";
+        throw std::runtime_error("TopLevelBVH does not allow updates");
+    }
+    if (scratch.size() == 0) {
+        const auto bvh_inputs = build_inputs();
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO prebuild_info = {0};
+        device->GetRaytracingAccelerationStructurePrebuildInfo(&bvh_inputs, &prebuild_info);
+        const uint64_t scratch_size =
+            align_to(std::max(prebuild_info.UpdateScratchDataSizeInBytes, uint64_t(1)),
+                     D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT);
+        MemoryCategoryScope memory_scope(MEMORY_SCRATCH);
+        scratch = Buffer::default(device,
+                                  scratch_size,
+                                  D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                  D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    }
+
+    D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC build_desc = {0};
+    build_desc.Inputs = build_inputs();
+    build_desc.Inputs.Flags |=
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
+    build_desc.SourceAccelerationStructureData = bvh->GetGPUVirtualAddress();
+    build_desc.DestAccelerationStructureData = bvh->GetGPUVirtualAddress();
+    build_desc.ScratchAccelerationStructureData = scratch->GetGPUVirtualAddress();
+    cmd_list->BuildRaytracingAccelerationStructure(&build_desc, 0, nullptr);
+
+    D3D12_RESOURCE_BARRIER barrier = barrier_uav(bvh);
+    cmd_list->ResourceBarrier(1, &barrier);
+}
+
 void TopLevelBVH::finalize()
 {
     // Release the buffers we don't need anymore
-    scratch = Buffer();
+    if (!allows_update()) {
+        scratch = Buffer();
+    }
 }
 
 size_t TopLevelBVH::num_instances() const
@@ -1059,6 +2434,11 @@ size_t TopLevelBVH::num_instances() const
     return instances.size();
 }
 
+bool TopLevelBVH::allows_update() const
+{
+    return build_flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE;
+}
+
 ID3D12Resource *TopLevelBVH::operator->()
 {
     return get();
@@ -1069,4 +2449,15 @@ ID3D12Resource *TopLevelBVH::get()
     return bvh.get();
 }
 
+D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS TopLevelBVH::build_inputs() const
+{
+    D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS bvh_inputs = {0};
+    bvh_inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
+    bvh_inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+    bvh_inputs.NumDescs = instances.size() + num_extra_descs;
+    bvh_inputs.InstanceDescs = instance_buf->GetGPUVirtualAddress();
+    bvh_inputs.Flags = build_flags;
+    return bvh_inputs;
+}
+
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -10,6 +11,12 @@ namespace dxr {
 
 bool dxr_available(Microsoft::WRL::ComPtr<ID3D12Device5> &device);
 
+/* Check if the device can index the bound CBV/SRV/UAV heap directly with SM 6.6
+ * ResourceDescriptorHeap, from root signatures created with
+ * D3D12_ROOT_SIGNATURE_FLAG_CBV_SRV_UAV_HEAP_DIRECTLY_INDEXED
+ */
+bool bindless_available(ID3D12Device *device);
+
 class RootSignatureBuilder;
 class DescriptorHeapBuilder;
 
@@ -26,14 +33,25 @@ struct RootParam {
 class DescriptorHeap : RootParam {
     D3D12_DESCRIPTOR_HEAP_DESC desc = {0};
     std::vector<D3D12_DESCRIPTOR_RANGE> ranges;
+    // The name of each range, empty if it wasn't named, and the descriptors it takes in the
+    // heap, which for unbounded ranges is their capacity
+    std::vector<std::string> range_names;
+    std::vector<uint32_t> range_sizes;
+    uint32_t increment_size = 0;
     Microsoft::WRL::ComPtr<ID3D12DescriptorHeap> heap = nullptr;
 
     friend class DescriptorHeapBuilder;
 
     DescriptorHeap(D3D12_DESCRIPTOR_HEAP_DESC desc,
                    std::vector<D3D12_DESCRIPTOR_RANGE> ranges,
+                   std::vector<std::string> range_names,
+                   std::vector<uint32_t> range_sizes,
+                   uint32_t increment_size,
                    Microsoft::WRL::ComPtr<ID3D12DescriptorHeap> heap);
 
+    // Throws if there's no such range
+    size_t find_range(const std::string &name) const;
+
 public:
     DescriptorHeap() = default;
 
@@ -41,37 +59,70 @@ public:
     D3D12_GPU_DESCRIPTOR_HANDLE gpu_desc_handle();
     D3D12_CPU_DESCRIPTOR_HANDLE cpu_desc_handle();
 
+    // The handles of the index'th descriptor of the named range
+    D3D12_GPU_DESCRIPTOR_HANDLE gpu_desc_handle(const std::string &range, uint32_t index = 0);
+    D3D12_CPU_DESCRIPTOR_HANDLE cpu_desc_handle(const std::string &range, uint32_t index = 0);
+
+    /* The offset of the named range's first descriptor from the start of the heap, which
+     * is also its index in ResourceDescriptorHeap when the heap is directly indexed
+     */
+    uint32_t range_offset(const std::string &range) const;
+
+    // The number of descriptors in the named range, for unbounded ranges their capacity
+    uint32_t range_size(const std::string &range) const;
+
     ID3D12DescriptorHeap *operator->();
     ID3D12DescriptorHeap *get();
 };
 
+/* Builds a shader visible descriptor heap and the descriptor table referencing it. The
+ * ranges are laid out in the heap in the order they're added, so each range's offset from
+ * the table start is computed from the ranges before it. Named ranges can be looked up in
+ * the created heap to write their descriptors
+ */
 class DescriptorHeapBuilder {
     std::vector<D3D12_DESCRIPTOR_RANGE> ranges;
+    std::vector<std::string> range_names;
+    std::vector<uint32_t> range_sizes;
 
     void add_range(D3D12_DESCRIPTOR_RANGE_TYPE type,
                    uint32_t size,
                    uint32_t base_register,
-                   uint32_t space);
+                   uint32_t space,
+                   const std::string &name,
+                   bool unbounded);
 
     bool contains_range_type(D3D12_DESCRIPTOR_RANGE_TYPE type);
     uint32_t num_descriptors();
 
 public:
-    // TODO: We can autocompute the table offsets based on the order that add_* is called if we
-    // use the root sig to also guide the desc. heap write
-    // TODO: Each range can be assigned a name
     DescriptorHeapBuilder &add_srv_range(uint32_t size,
                                          uint32_t base_register,
-                                         uint32_t space);
+                                         uint32_t space,
+                                         const std::string &name = "");
     DescriptorHeapBuilder &add_uav_range(uint32_t size,
                                          uint32_t base_register,
-                                         uint32_t space);
+                                         uint32_t space,
+                                         const std::string &name = "");
     DescriptorHeapBuilder &add_cbv_range(uint32_t size,
                                          uint32_t base_register,
-                                         uint32_t space);
+                                         uint32_t space,
+                                         const std::string &name = "");
     DescriptorHeapBuilder &add_sampler_range(uint32_t size,
                                              uint32_t base_register,
-                                             uint32_t space);
+                                             uint32_t space,
+                                             const std::string &name = "");
+
+    /* Add an unbounded SRV range, declared in the shader as an unsized array, e.g.
+     * ByteAddressBuffer buffers[] : register(t0, space2), and reserve capacity descriptors
+     * for it in the heap. The shaders pick the descriptor by an index, e.g. from a per-draw
+     * root constant, so draws switch resources without rebinding descriptors. Each
+     * unbounded range must be in a register space of its own
+     */
+    DescriptorHeapBuilder &add_srv_array(const std::string &name,
+                                         uint32_t capacity,
+                                         uint32_t base_register,
+                                         uint32_t space);
 
     DescriptorHeap create(ID3D12Device *device);
 };
@@ -303,24 +354,144 @@ private:
     size_t compute_shader_record_size(const std::wstring &shader) const;
 };
 
+/* A cache of compiled pipeline states built on an ID3D12PipelineLibrary1 and persisted to
+ * a file, so later runs load the driver's compiled pipelines instead of compiling them from
+ * DXIL again. Pipelines are keyed by a hash of their shader bytecode and the rest of their
+ * desc. The library blob is tied to the adapter and driver that wrote it, if it doesn't
+ * match the device the cache starts out empty and the file is rewritten on save. DXR state
+ * objects can't be stored in a pipeline library, so they're always compiled
+ */
+class PipelineCache {
+    Microsoft::WRL::ComPtr<ID3D12PipelineLibrary1> library;
+    // The device the library was created on, its pipelines can't be loaded on others
+    ID3D12Device1 *library_device = nullptr;
+    std::string file;
+    // The serialized library loaded from the file, which must outlive the library
+    std::vector<uint8_t> blob;
+    std::mutex mutex;
+    size_t num_loaded = 0;
+    size_t num_compiled = 0;
+    bool modified = false;
+
+    void reset(ID3D12Device1 *device);
+
+    // Store the pipeline under the name, starting a new library if the name is taken
+    void store(ID3D12Device1 *device, const std::wstring &name, ID3D12PipelineState *pso);
+
+public:
+    static const uint32_t magic = 0x43505844;
+    static const uint32_t version = 1;
+
+    // Load the cache from the file if it exists and was written for this device and driver
+    PipelineCache(ID3D12Device1 *device, const std::string &file);
+    // The cache unregisters itself if it's the current pipeline cache
+    ~PipelineCache();
+
+    PipelineCache(const PipelineCache &) = delete;
+    PipelineCache &operator=(const PipelineCache &) = delete;
+
+    Microsoft::WRL::ComPtr<ID3D12PipelineState> create_compute(
+        ID3D12Device1 *device, const D3D12_COMPUTE_PIPELINE_STATE_DESC &desc);
+
+    Microsoft::WRL::ComPtr<ID3D12PipelineState> create_graphics(
+        ID3D12Device1 *device, const D3D12_GRAPHICS_PIPELINE_STATE_DESC &desc);
+
+    // Write the library to the file if pipelines were added since it was loaded
+    void save();
+
+    // The number of pipelines loaded from the cache and compiled since it was created
+    size_t loaded() const;
+    size_t compiled() const;
+
+    // Check if the cache's library was created on the device
+    bool matches(ID3D12Device *device) const;
+};
+
+/* Set the cache compute and graphics pipelines are created through, or null to always
+ * compile them
+ */
+void set_pipeline_cache(PipelineCache *cache);
+PipelineCache *pipeline_cache();
+
+/* Create the pipeline state through the pipeline cache if one is set and was created on
+ * the device, otherwise the pipeline is compiled
+ */
+Microsoft::WRL::ComPtr<ID3D12PipelineState> create_compute_pipeline_state(
+    ID3D12Device5 *device, const D3D12_COMPUTE_PIPELINE_STATE_DESC &desc);
+Microsoft::WRL::ComPtr<ID3D12PipelineState> create_graphics_pipeline_state(
+    ID3D12Device5 *device, const D3D12_GRAPHICS_PIPELINE_STATE_DESC &desc);
+
+/* The formats the geometry's buffers are stored in. Positions are full floats or 16-bit
+ * SNORM, quantized over the geometry's bounds and mapped back to object space by
+ * position * position_scale + position_offset. Indices are 32 or 16-bit. The normals are
+ * only read when rasterizing the atlas, so they're always octahedral encoded in 16-bit SNORM
+ * pairs
+ */
+struct GeometryEncoding {
+    DXGI_FORMAT vertex_format = DXGI_FORMAT_R32G32B32_FLOAT;
+    DXGI_FORMAT index_format = DXGI_FORMAT_R32_UINT;
+    glm::vec3 position_scale = glm::vec3(1.f);
+    glm::vec3 position_offset = glm::vec3(0.f);
+
+    bool quantized_positions() const;
+
+    uint32_t vertex_stride() const;
+    uint32_t index_stride() const;
+};
+
+// The compressed formats the mesh uploads may pick for each geometry, combined as flags
+enum GeometryCompression {
+    GEOMETRY_COMPRESS_NONE = 0,
+    // Quantize the positions to 16-bit SNORM where the error is within 1% of the geometry's
+    // mean edge length. Positions are kept as floats if the BVHs allow updates
+    GEOMETRY_COMPRESS_POSITIONS = 1,
+    // Use 16-bit indices for geometries with at most 64k vertices
+    GEOMETRY_COMPRESS_INDICES = 2,
+    GEOMETRY_COMPRESS_ALL = 3,
+};
+
+/* The buffers shared by geometries uploaded together with the same position format. Each
+ * attribute is packed into one buffer, with the positions, normals and UVs of a geometry
+ * starting at the same base vertex so one set of vertex buffer views draws all of them.
+ * Indices of both formats are packed into one buffer, with each geometry's range 4-byte
+ * aligned
+ */
+struct GeometryPool {
+    Buffer positions, normals, uvs, indices;
+    // The quantization transforms of the geometries, if the positions are quantized
+    Buffer transforms;
+};
+
 struct Geometry {
-    Buffer vertex_buf, index_buf, normal_buf, uv_buf;
+    std::shared_ptr<GeometryPool> pool;
+    GeometryEncoding encoding;
+    // The geometry's first vertex in the pool's vertex buffers, and its first index in the
+    // pool's index buffer in units of its index format
+    uint32_t base_vertex = 0;
+    uint32_t vertex_count = 0;
+    uint32_t first_index = 0;
+    uint32_t index_count = 0;
+    // Offset of the 3x4 row major transform mapping the quantized positions to object space
+    // for the BVH build in the pool's transforms. Unused if the positions are floats
+    uint64_t transform_offset = 0;
     D3D12_RAYTRACING_GEOMETRY_DESC desc = {0};
 
-    // TODO: Allow other vertex and index formats? Right now this
-    // assumes vec3f verts and uint3 indices
     Geometry(
-        Buffer vertex_buf,
-        Buffer index_buf,
-        Buffer normal_buf,
-        Buffer uv_buf,
+        const std::shared_ptr<GeometryPool> &pool,
+        const GeometryEncoding &encoding,
+        uint32_t base_vertex,
+        uint32_t vertex_count,
+        uint32_t first_index,
+        uint32_t index_count,
+        uint64_t transform_offset,
         D3D12_RAYTRACING_GEOMETRY_FLAGS geom_flags = D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE);
 };
 
 class BottomLevelBVH {
     D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags;
     D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_DESC post_build_info_desc = {0};
-    Buffer scratch, post_build_info, post_build_info_readback;
+    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO prebuild = {0};
+    Buffer scratch, post_build_info, post_build_info_readback, update_scratch;
 
     std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> geom_descs;
 
@@ -341,37 +512,234 @@ public:
      */
     void enqeue_build(ID3D12Device5 *device, ID3D12GraphicsCommandList4 *cmd_list);
 
+    /* Enqueue the build without a barrier after it, using scratch space provided by the
+     * caller and writing the compacted size post build info to the provided GPU address
+     * instead of buffers owned by the BVH. This lets many builds share scratch memory and
+     * run in parallel, the caller is responsible for the UAV barrier before the BVHs
+     * are used and for reading back the post build info.
+     */
+    void enqeue_batched_build(ID3D12Device5 *device,
+                              ID3D12GraphicsCommandList4 *cmd_list,
+                              D3D12_GPU_VIRTUAL_ADDRESS scratch_address,
+                              D3D12_GPU_VIRTUAL_ADDRESS post_build_info_dest);
+
     /* Enqueue the BVH compaction copy if the BVH was built with compaction enabled.
      * The BVH build must have been enqueued and completed so that the post build info is
      * available
      */
     void enqueue_compaction(ID3D12Device5 *device, ID3D12GraphicsCommandList4 *cmd_list);
 
+    /* Enqueue the compaction copy using a compacted size read back by the caller, for
+     * BVHs built with enqeue_batched_build. No barrier is inserted after the copy.
+     */
+    void enqueue_compaction(ID3D12Device5 *device,
+                            ID3D12GraphicsCommandList4 *cmd_list,
+                            uint64_t compacted_size);
+
+    /* Refit the BVH in place to the current contents of its geometries' vertex buffers,
+     * which must keep the same vertex and index counts. The BVH must have been built with
+     * ALLOW_UPDATE and finalized. A UAV barrier is inserted after the update. The update
+     * scratch space is kept for later updates
+     */
+    void enqueue_update(ID3D12Device5 *device, ID3D12GraphicsCommandList4 *cmd_list);
+
+    /* Enqueue a copy of the BVH in the driver's serialized format to the GPU address, which
+     * must have room for the serialized size reported by the SERIALIZATION post build info.
+     * The BVH must have been finalized. No barrier is inserted after the copy.
+     */
+    void enqueue_serialize(ID3D12GraphicsCommandList4 *cmd_list,
+                           D3D12_GPU_VIRTUAL_ADDRESS dest);
+
+    /* Allocate the BVH and enqueue its deserialization from the serialized data at the GPU
+     * address, in place of building it. The deserialized size is read by the caller from
+     * the serialized data's header. No barrier is inserted after the copy.
+     */
+    void enqueue_deserialize(ID3D12Device5 *device,
+                             ID3D12GraphicsCommandList4 *cmd_list,
+                             D3D12_GPU_VIRTUAL_ADDRESS src,
+                             uint64_t deserialized_size);
+
     /* Finalize the BVH build structures to release any scratch space.
      * Must call after enqueue compaction if performing compaction, otherwise
      * this can be called after the work from enqueue build has been finished
      */
     void finalize();
 
+    bool allows_compaction() const;
+
+    bool allows_update() const;
+
+    // Get the 256b aligned upper bounds on the BVH and build scratch space sizes
+    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO prebuild_info(ID3D12Device5 *device);
+
     ID3D12Resource *operator->();
     ID3D12Resource *get();
+
+private:
+    D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS build_inputs() const;
+
+    // Allocate the BVH and record the build, without any barriers
+    void record_build(ID3D12Device5 *device,
+                      ID3D12GraphicsCommandList4 *cmd_list,
+                      D3D12_GPU_VIRTUAL_ADDRESS scratch_address,
+                      const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_DESC
+                          *post_build_info);
+};
+
+// Timings and sizes from building the bottom level BVHs for a scene
+struct MeshBuildStats {
+    double upload_ms = 0.0;
+    double build_ms = 0.0;
+    double compaction_ms = 0.0;
+    size_t uncompacted_bytes = 0;
+    size_t compacted_bytes = 0;
+    size_t scratch_bytes = 0;
+    size_t num_build_groups = 0;
+};
+
+/* Build and compact the BVHs, grouping the builds so that the uncompacted BVHs and their
+ * scratch space fit within the video memory budget. Each group is built in one submission
+ * with a single post build info readback and compacted in a second before moving on to the
+ * next group, BVHs built without ALLOW_COMPACTION skip the compaction. The groups share one
+ * scratch buffer, sized to the largest group. If memory_budget is 0 the budget is queried
+ * from the adapter before each group. Each group's build and compaction are timed if a
+ * profiler is passed. The BVHs are finalized and ready to use
+ */
+void build_bvhs(ID3D12Device5 *device,
+                CommandContext &cmd_ctx,
+                std::vector<BottomLevelBVH> &bvhs,
+                MeshBuildStats *stats = nullptr,
+                uint64_t memory_budget = 0,
+                GpuProfiler *profiler = nullptr);
+
+// An upper bound on the bytes uploaded for the mesh, the compressed encodings are smaller
+size_t mesh_upload_size(const ::Mesh &mesh);
+
+/* Upload the geometry of all the meshes and set up their bottom level BVHs with the build
+ * flags, without building them. All uploads are staged through the upload ring and
+ * recorded in one submission, which is timed if a profiler is passed. The geometry is packed
+ * into a GeometryPool for each position format, and each geometry is stored in the smallest
+ * GeometryEncoding the GeometryCompression flags allow
+ */
+std::vector<BottomLevelBVH> upload_mesh_geometry(
+    ID3D12Device5 *device,
+    CommandContext &cmd_ctx,
+    UploadRing &upload_ring,
+    const std::vector<::Mesh> &meshes,
+    GpuProfiler *profiler = nullptr,
+    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags =
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE |
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_COMPACTION,
+    uint32_t compression = GEOMETRY_COMPRESS_ALL);
+
+/* Upload the geometry of all the meshes and build and compact their bottom level BVHs
+ * with the build flags. Rather than round tripping to the GPU for each geometry, all
+ * uploads are staged through the upload ring and recorded in one submission, the BVHs are
+ * then built by build_bvhs. The upload is timed if a profiler is passed
+ */
+std::vector<BottomLevelBVH> build_mesh_bvhs(
+    ID3D12Device5 *device,
+    CommandContext &cmd_ctx,
+    UploadRing &upload_ring,
+    const std::vector<::Mesh> &meshes,
+    MeshBuildStats *stats = nullptr,
+    uint64_t memory_budget = 0,
+    GpuProfiler *profiler = nullptr,
+    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags =
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE |
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_COMPACTION,
+    uint32_t compression = GEOMETRY_COMPRESS_ALL);
+
+/* Upload the geometry of the meshes on the copy context's queue and build and compact their
+ * bottom level BVHs on the direct queue, overlapping the copies with the builds. The meshes
+ * are split into batches of up to half the upload ring, and each batch is staged and copied
+ * while the previous batch is built by build_bvhs. Each batch is packed into its own
+ * GeometryPools. The direct queue waits on the copies of each batch with a cross-queue
+ * fence rather than a CPU sync. upload_ms is the CPU time spent staging the uploads and
+ * waiting on the copy queue. The upload ring must not have uploads from other contexts in
+ * flight, and is left idle
+ */
+std::vector<BottomLevelBVH> build_mesh_bvhs_async(
+    ID3D12Device5 *device,
+    CommandContext &cmd_ctx,
+    CommandContext &copy_ctx,
+    UploadRing &upload_ring,
+    const std::vector<::Mesh> &meshes,
+    MeshBuildStats *stats = nullptr,
+    uint64_t memory_budget = 0,
+    GpuProfiler *profiler = nullptr,
+    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags =
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE |
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_COMPACTION,
+    uint32_t compression = GEOMETRY_COMPRESS_ALL);
+
+/* Serialize the finalized BVHs, returning a blob for each in the driver's serialized format
+ * starting with its D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER. The
+ * serialized sizes are queried in one submission, the BVHs are copied out and read back in
+ * a second
+ */
+std::vector<std::vector<uint8_t>> serialize_bvhs(ID3D12Device5 *device,
+                                                 CommandContext &cmd_ctx,
+                                                 std::vector<BottomLevelBVH> &bvhs);
+
+/* Check that the serialized BVH was written by a driver compatible with the device, using
+ * the driver matching identifier in its header. The serialized format is specific to the
+ * GPU and driver version that wrote it
+ */
+bool serialized_bvh_compatible(ID3D12Device5 *device, const std::vector<uint8_t> &blob);
+
+/* Deserialize the BVHs from their serialized blobs in place of building them, uploading
+ * the blobs through the ring in one submission. Returns false without modifying the BVHs
+ * if there isn't a blob for each BVH or any is incompatible with the device. The BVHs are
+ * ready to use
+ */
+bool deserialize_bvhs(ID3D12Device5 *device,
+                      CommandContext &cmd_ctx,
+                      UploadRing &upload_ring,
+                      std::vector<BottomLevelBVH> &bvhs,
+                      const std::vector<std::vector<uint8_t>> &blobs);
+
+/* Re-upload the vertices of the mesh into the BVH's vertex buffers and refit the BVH, for
+ * deformable meshes whose BVH was built with ALLOW_UPDATE. The mesh must have the same
+ * geometries and vertex counts as when the BVH was built. The work is recorded and
+ * submitted through the upload ring
+ */
+void update_mesh_bvh(ID3D12Device5 *device,
+                     CommandContext &cmd_ctx,
+                     UploadRing &upload_ring,
+                     BottomLevelBVH &bvh,
+                     const ::Mesh &mesh);
+
+// The transform and mesh of a TLAS instance, a compact copy of a scene Instance without its
+// material IDs
+struct TlasInstance {
+    glm::mat4 transform;
+    uint32_t mesh_id = 0;
+
+    TlasInstance(const glm::mat4 &transform, uint32_t mesh_id);
+
+    TlasInstance() = default;
 };
 
 class TopLevelBVH {
     D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags =
         D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE;
     Buffer scratch;
+    // Descs in the instance buffer after those of the instances, built into the BVH
+    // without a TlasInstance
+    size_t num_extra_descs = 0;
 
 public:
-    std::vector<Instance> instances;
+    std::vector<TlasInstance> instances;
     Buffer instance_buf, bvh;
 
     TopLevelBVH() = default;
 
     TopLevelBVH(Buffer instance_buf,
-                const std::vector<Instance> &instances,
+                std::vector<TlasInstance> instances,
                 D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags =
-                    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE);
+                    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE,
+                size_t num_extra_descs = 0);
 
     /* After calling build the commands are placed in the command list, with a
      * UAV barrier to wait on the completion of the build before other commands are
@@ -379,13 +747,24 @@ public:
      */
     void enqeue_build(ID3D12Device5 *device, ID3D12GraphicsCommandList4 *cmd_list);
 
-    // Free the BVH build scratch space
+    /* Refit the BVH in place to the instances currently in instance_buf, the number of
+     * instances must be unchanged. The BVH must have been built with ALLOW_UPDATE. A UAV
+     * barrier is inserted after the update
+     */
+    void enqueue_update(ID3D12Device5 *device, ID3D12GraphicsCommandList4 *cmd_list);
+
+    // Free the BVH build scratch space, BVHs allowing updates keep it for the updates
     void finalize();
 
     size_t num_instances() const;
 
+    bool allows_update() const;
+
     ID3D12Resource *operator->();
     ID3D12Resource *get();
+
+private:
+    D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS build_inputs() const;
 };
 
 }
@@ -0,0 +1,142 @@
+#ifndef SAMPLER_HLSL
+#define SAMPLER_HLSL
+
+#include "lcg_rng.hlsl"
+
+// The sample generators selectable for the AO rays, must match SamplerType in ao_bake.h
+#define SAMPLER_LCG 0
+#define SAMPLER_SOBOL 1
+#define SAMPLER_R2 2
+#define SAMPLER_BLUE_NOISE 3
+
+// The blue noise tile is BLUE_NOISE_SIZE^2 texels and is repeated over the atlas
+#define BLUE_NOISE_SIZE 64
+
+struct SampleGenerator {
+    uint type;
+    // Index of the next sample in the texel's sequence, across all frames
+    uint sample_index;
+    // Per texel seed for the Owen scrambling
+    uint seed;
+    // Per texel Cranley-Patterson rotation for R2 and blue noise
+    float2 rotation;
+    LCGRand rng;
+};
+
+float uint_to_unit_float(uint x)
+{
+    // Take the top 24 bits so the result is never rounded up to 1
+    return (x >> 8) * (1.f / 16777216.f);
+}
+
+uint hash_combine(uint seed, uint v)
+{
+    return seed ^ (v + (seed << 6) + (seed >> 2));
+}
+
+// Hash based Owen scrambling from Burley, "Practical Hash-based Owen Scrambling", 2020
+uint laine_karras_permutation(uint x, uint seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+uint nested_uniform_scramble(uint x, uint seed)
+{
+    x = reversebits(x);
+    x = laine_karras_permutation(x, seed);
+    return reversebits(x);
+}
+
+// The second Sobol dimension, the first is just reversebits(index)
+uint sobol_dim1(uint index)
+{
+    uint result = 0;
+    uint v = 0x80000000u;
+    for (; index != 0; index >>= 1) {
+        if (index & 1) {
+            result ^= v;
+        }
+        v ^= v >> 1;
+    }
+    return result;
+}
+
+float2 owen_scrambled_sobol2d(uint index, uint seed)
+{
+    // Shuffling the index decorrelates the sequences of each texel
+    index = nested_uniform_scramble(index, seed);
+    const uint x = nested_uniform_scramble(reversebits(index), hash_combine(seed, 0));
+    const uint y = nested_uniform_scramble(sobol_dim1(index), hash_combine(seed, 1));
+    return float2(uint_to_unit_float(x), uint_to_unit_float(y));
+}
+
+float2 r2_sequence(uint index, float2 rotation)
+{
+    // The R2 increments 1/g and 1/g^2 for the plastic number g, in 0.32 fixed point so
+    // the sequence doesn't lose precision for large indices
+    const uint2 alpha = uint2(3242174889u, 2447445413u);
+    const uint2 offset = uint2(rotation * 4294967296.f);
+    const uint2 x = offset + index * alpha;
+    return float2(uint_to_unit_float(x.x), uint_to_unit_float(x.y));
+}
+
+/* Make the sample generator for the texel. first_sample is the number of samples the texel
+ * has already taken, so the low discrepancy sequences continue across frames. blue_noise is
+ * the texel's value from the blue noise tile and is only used by SAMPLER_BLUE_NOISE
+ */
+SampleGenerator make_sample_generator(uint type,
+                                      uint pixel_id,
+                                      uint first_sample,
+                                      uint frame_id,
+                                      uint sampler_seed,
+                                      float2 blue_noise)
+{
+    SampleGenerator sg;
+    sg.type = type;
+    sg.sample_index = first_sample;
+    sg.seed = murmur_hash3_finalize(murmur_hash3_mix(murmur_hash3_mix(0, pixel_id),
+                                                     sampler_seed));
+    // With the default seed the LCG sequence matches the original per frame seeding
+    sg.rng = get_rng(pixel_id, frame_id);
+    if (sampler_seed != 0) {
+        sg.rng.state = murmur_hash3_mix(sg.rng.state, sampler_seed);
+    }
+
+    if (type == SAMPLER_BLUE_NOISE) {
+        sg.rotation = blue_noise;
+    } else {
+        LCGRand rotation_rng = get_rng(sg.seed, 0);
+        sg.rotation.x = lcg_randomf(rotation_rng);
+        sg.rotation.y = lcg_randomf(rotation_rng);
+    }
+    return sg;
+}
+
+// Look up the texel's value in the tiled blue noise texture
+float2 blue_noise_value(StructuredBuffer<float2> blue_noise, uint2 texel)
+{
+    const uint2 p = texel % BLUE_NOISE_SIZE;
+    return blue_noise[p.y * BLUE_NOISE_SIZE + p.x];
+}
+
+float2 next_sample2d(inout SampleGenerator sg)
+{
+    float2 s;
+    if (sg.type == SAMPLER_SOBOL) {
+        s = owen_scrambled_sobol2d(sg.sample_index, sg.seed);
+    } else if (sg.type == SAMPLER_R2 || sg.type == SAMPLER_BLUE_NOISE) {
+        s = r2_sequence(sg.sample_index, sg.rotation);
+    } else {
+        s.x = lcg_randomf(sg.rng);
+        s.y = lcg_randomf(sg.rng);
+    }
+    ++sg.sample_index;
+    return s;
+}
+
+#endif
@@ -56,5 +56,25 @@ float pow2(float x) {
 	return x * x;
 }
 
+// Decode the unit vector from its octahedral encoding in [-1, 1]^2
+float3 octahedral_decode(float2 e) {
+	float3 n = float3(e.x, e.y, 1.f - abs(e.x) - abs(e.y));
+	if (n.z < 0.f) {
+		const float2 s = float2(n.x >= 0.f ? 1.f : -1.f, n.y >= 0.f ? 1.f : -1.f);
+		n.xy = (1.f - abs(n.yx)) * s;
+	}
+	return normalize(n);
+}
+
+// Add the value to the 64-bit counter at the offset, stored as the low then high word,
+// carrying into the high word
+void interlocked_add64(RWByteAddressBuffer buf, uint offset, uint value) {
+	uint prev = 0;
+	buf.InterlockedAdd(offset, value, prev);
+	if (prev + value < prev) {
+		buf.InterlockedAdd(offset + 4, 1);
+	}
+}
+
 #endif
 
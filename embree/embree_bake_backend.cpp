@@ -0,0 +1,401 @@
+#include "embree_bake_backend.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include "ao_sampler.h"
+#include "trace.h"
+#include "util.h"
+#include <glm/gtc/type_precision.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+namespace {
+
+// The number of rays traced together by rtcOccluded16
+const uint32_t packet_size = 16;
+// The texels each bake task traces, the tasks are taken by the threads in turn
+const size_t texels_per_task = 256;
+
+// The atlas vertices are snapped to the 8 bits of subpixel precision of the GPU rasterizer,
+// so the coverage is tested exactly in fixed point
+const int64_t subpixel_scale = 256;
+
+void embree_error(void *, RTCError code, const char *msg)
+{
+    std::cout << "Embree error " << code << ": " << msg << "\n";
+}
+
+int64_t edge_function(const glm::i64vec2 &a, const glm::i64vec2 &b, const glm::i64vec2 &p)
+{
+    return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+}
+
+// With the triangle oriented to a positive area, the top edges are horizontal with the
+// triangle below them and the left edges go up the screen
+bool is_top_left(const glm::i64vec2 &a, const glm::i64vec2 &b)
+{
+    const glm::i64vec2 d = b - a;
+    return (d.y == 0 && d.x > 0) || d.y < 0;
+}
+
+}
+
+EmbreeBakeBackend::EmbreeBakeBackend() : device(rtcNewDevice(nullptr))
+{
+    if (!device) {
+        std::cout << "Error: Failed to create the Embree device\n";
+        throw std::runtime_error("Failed to create the Embree device");
+    }
+    rtcSetDeviceErrorFunction(device, embree_error, nullptr);
+}
+
+EmbreeBakeBackend::~EmbreeBakeBackend()
+{
+    release_scene();
+    rtcReleaseDevice(device);
+}
+
+std::string EmbreeBakeBackend::name()
+{
+    return "Embree CPU";
+}
+
+std::string EmbreeBakeBackend::device_name()
+{
+    return "CPU (" + std::to_string(loader_thread_count()) + " threads)";
+}
+
+void EmbreeBakeBackend::set_scene(const Scene &scene, const AtlasResult &atlas)
+{
+    TRACE_SCOPE("Embree Set Scene");
+    release_scene();
+
+    meshes.clear();
+    for (const auto &mesh : scene.meshes) {
+        std::vector<MeshGeometry> geometries;
+        for (const auto &geom : mesh.geometries) {
+            const auto verts = geom.vertex_data();
+            const auto tris = geom.index_data();
+            MeshGeometry g;
+            g.vertices.assign(verts.begin(), verts.end());
+            g.indices.assign(tris.begin(), tris.end());
+            geometries.push_back(std::move(g));
+        }
+        meshes.push_back(std::move(geometries));
+    }
+    instance_transforms.clear();
+    instance_meshes.clear();
+    for (const auto &inst : scene.instances) {
+        instance_transforms.push_back(inst.transform);
+        instance_meshes.push_back(inst.mesh_id);
+    }
+
+    atlas_size = atlas.size;
+    accum.assign(size_t(atlas_size.x) * atlas_size.y, glm::vec2(0.f));
+    rasterize_atlas(scene, atlas);
+    std::cout << "Embree bake covers " << pretty_print_count(texels.size()) << " texels\n";
+}
+
+double EmbreeBakeBackend::build_accel()
+{
+    TRACE_SCOPE("Embree Build Accel");
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+    release_scene();
+
+    // Each mesh is a scene of its own, instanced by the top level scene
+    for (const auto &geometries : meshes) {
+        RTCScene mesh_scene = rtcNewScene(device);
+        for (const auto &g : geometries) {
+            RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
+            void *verts = rtcSetNewGeometryBuffer(geom,
+                                                  RTC_BUFFER_TYPE_VERTEX,
+                                                  0,
+                                                  RTC_FORMAT_FLOAT3,
+                                                  sizeof(glm::vec3),
+                                                  g.vertices.size());
+            std::copy(g.vertices.begin(),
+                      g.vertices.end(),
+                      reinterpret_cast<glm::vec3 *>(verts));
+            void *indices = rtcSetNewGeometryBuffer(geom,
+                                                    RTC_BUFFER_TYPE_INDEX,
+                                                    0,
+                                                    RTC_FORMAT_UINT3,
+                                                    sizeof(glm::uvec3),
+                                                    g.indices.size());
+            std::copy(
+                g.indices.begin(), g.indices.end(), reinterpret_cast<glm::uvec3 *>(indices));
+            rtcCommitGeometry(geom);
+            rtcAttachGeometry(mesh_scene, geom);
+            rtcReleaseGeometry(geom);
+        }
+        rtcCommitScene(mesh_scene);
+        mesh_scenes.push_back(mesh_scene);
+    }
+
+    scene = rtcNewScene(device);
+    for (size_t i = 0; i < instance_meshes.size(); ++i) {
+        RTCGeometry inst = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_INSTANCE);
+        rtcSetGeometryInstancedScene(inst, mesh_scenes[instance_meshes[i]]);
+        rtcSetGeometryTransform(inst,
+                                0,
+                                RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR,
+                                glm::value_ptr(instance_transforms[i]));
+        rtcCommitGeometry(inst);
+        rtcAttachGeometry(scene, inst);
+        rtcReleaseGeometry(inst);
+    }
+    rtcCommitScene(scene);
+
+    return duration_cast<duration<double, std::milli>>(steady_clock::now() - start).count();
+}
+
+BakeTileStats EmbreeBakeBackend::bake_tile(const glm::uvec2 &origin,
+                                           const glm::uvec2 &size,
+                                           uint32_t frame_id,
+                                           const BakeSettings &settings)
+{
+    TRACE_SCOPE("Embree Bake Tile");
+    if (!scene) {
+        throw std::runtime_error("build_accel must be called before baking");
+    }
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+
+    // Split the tile's texels into tasks, each row of the tile is a range of the texel list
+    std::vector<std::pair<size_t, size_t>> tasks;
+    const auto pixel_less = [](const Texel &t, uint32_t pixel) { return t.pixel_id < pixel; };
+    for (uint32_t y = origin.y; y < std::min(origin.y + size.y, atlas_size.y); ++y) {
+        const uint32_t row_start = y * atlas_size.x + origin.x;
+        const uint32_t row_end = y * atlas_size.x + std::min(origin.x + size.x, atlas_size.x);
+        const size_t first =
+            std::lower_bound(texels.begin(), texels.end(), row_start, pixel_less) -
+            texels.begin();
+        const size_t last =
+            std::lower_bound(texels.begin() + first, texels.end(), row_end, pixel_less) -
+            texels.begin();
+        for (size_t i = first; i < last; i += texels_per_task) {
+            tasks.emplace_back(i, std::min(i + texels_per_task, last));
+        }
+    }
+
+    std::atomic<uint64_t> total_rays(0);
+    std::atomic<uint64_t> total_hits(0);
+    std::atomic<uint32_t> total_active(0);
+    parallel_tasks(tasks.size(), [&](size_t task) {
+        RTCIntersectContext context;
+        rtcInitIntersectContext(&context);
+
+        alignas(64) RTCRay16 packet;
+        alignas(64) int valid[packet_size];
+        // The task's texel each lane's ray belongs to
+        size_t lane_texel[packet_size];
+        uint32_t num_lanes = 0;
+
+        const size_t first = tasks[task].first;
+        const size_t last = tasks[task].second;
+        std::vector<uint32_t> n_occluded(last - first, 0);
+        uint64_t rays = 0;
+        uint64_t hits = 0;
+        uint32_t active = 0;
+
+        const auto trace_packet = [&]() {
+            for (uint32_t i = 0; i < packet_size; ++i) {
+                valid[i] = i < num_lanes ? -1 : 0;
+            }
+            rtcOccluded16(valid, scene, &context, &packet);
+            for (uint32_t i = 0; i < num_lanes; ++i) {
+                if (packet.tfar[i] == -std::numeric_limits<float>::infinity()) {
+                    ++n_occluded[lane_texel[i]];
+                }
+            }
+            num_lanes = 0;
+        };
+
+        for (size_t t = first; t < last; ++t) {
+            const Texel &texel = texels[t];
+            const glm::vec2 texel_accum =
+                frame_id == 0 ? glm::vec2(0.f) : accum[texel.pixel_id];
+            const int batch_samples =
+                std::min(settings.samples_per_frame,
+                         std::max(settings.n_samples - int(texel_accum.y), 0));
+            if (batch_samples <= 0) {
+                continue;
+            }
+            ++active;
+            rays += batch_samples;
+
+            AOSampleGenerator sg(AOSamplerType(settings.sampler_type),
+                                 texel.pixel_id,
+                                 uint32_t(texel_accum.y),
+                                 frame_id,
+                                 settings.sampler_seed);
+            const glm::vec3 v_z = glm::normalize(texel.normal);
+            glm::vec3 v_x, v_y;
+            ortho_basis(v_x, v_y, v_z);
+            for (int s = 0; s < batch_samples; ++s) {
+                const glm::vec3 dir = sample_ao_direction(v_x, v_y, v_z, sg.next_sample2d());
+                const uint32_t i = num_lanes++;
+                packet.org_x[i] = texel.position.x;
+                packet.org_y[i] = texel.position.y;
+                packet.org_z[i] = texel.position.z;
+                packet.dir_x[i] = dir.x;
+                packet.dir_y[i] = dir.y;
+                packet.dir_z[i] = dir.z;
+                packet.tnear[i] = 0.001f;
+                packet.tfar[i] = settings.ao_length;
+                packet.time[i] = 0.f;
+                packet.mask[i] = 0xffffffff;
+                packet.id[i] = i;
+                packet.flags[i] = 0;
+                lane_texel[i] = t - first;
+                if (num_lanes == packet_size) {
+                    trace_packet();
+                }
+            }
+        }
+        if (num_lanes > 0) {
+            trace_packet();
+        }
+
+        // Each texel is only in one task, so the accumulation is written without locking
+        for (size_t t = first; t < last; ++t) {
+            const Texel &texel = texels[t];
+            glm::vec2 &texel_accum = accum[texel.pixel_id];
+            if (frame_id == 0) {
+                texel_accum = glm::vec2(0.f);
+            }
+            const int batch_samples =
+                std::min(settings.samples_per_frame,
+                         std::max(settings.n_samples - int(texel_accum.y), 0));
+            const float occluded = n_occluded[t - first];
+            texel_accum += glm::vec2(batch_samples - occluded, batch_samples);
+            hits += n_occluded[t - first];
+        }
+        total_rays += rays;
+        total_hits += hits;
+        total_active += active;
+    });
+
+    BakeTileStats stats;
+    stats.rays = total_rays;
+    stats.hits = total_hits;
+    stats.active_texels = total_active;
+    stats.gpu_ms =
+        duration_cast<duration<double, std::milli>>(steady_clock::now() - start).count();
+    return stats;
+}
+
+std::vector<float> EmbreeBakeBackend::readback()
+{
+    std::vector<float> ao(accum.size(), 0.f);
+    for (size_t i = 0; i < accum.size(); ++i) {
+        ao[i] = accum[i].x / std::max(accum[i].y, 1.f);
+    }
+    return ao;
+}
+
+void EmbreeBakeBackend::release_scene()
+{
+    if (scene) {
+        rtcReleaseScene(scene);
+        scene = nullptr;
+    }
+    for (auto &s : mesh_scenes) {
+        rtcReleaseScene(s);
+    }
+    mesh_scenes.clear();
+}
+
+void EmbreeBakeBackend::rasterize_atlas(const Scene &scene, const AtlasResult &atlas)
+{
+    TRACE_SCOPE("Rasterize Atlas");
+    const uint32_t no_texel = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> pixel_texel(size_t(atlas_size.x) * atlas_size.y, no_texel);
+    texels.clear();
+
+    for (size_t i = 0; i < scene.instances.size(); ++i) {
+        const auto &inst = scene.instances[i];
+        const InstanceAtlasRegion region = i < atlas.instance_regions.size()
+                                               ? atlas.instance_regions[i]
+                                               : InstanceAtlasRegion();
+        const glm::mat4 normal_transform = glm::transpose(glm::inverse(inst.transform));
+        for (const auto &geom : scene.meshes[inst.mesh_id].geometries) {
+            const auto verts = geom.vertex_data();
+            const auto normals = geom.normal_data();
+            const auto uvs = geom.uv_data();
+            for (const auto &tri : geom.index_data()) {
+                // The GPU bakes map uv y = 0 to the bottom row of the atlas
+                std::array<glm::i64vec2, 3> p;
+                for (int j = 0; j < 3; ++j) {
+                    const glm::vec2 uv = uvs[tri[j]] * region.uv_scale + region.uv_offset;
+                    const glm::dvec2 pos(double(uv.x) * atlas_size.x,
+                                         (1.0 - double(uv.y)) * atlas_size.y);
+                    p[j] = glm::i64vec2(std::llround(pos.x * subpixel_scale),
+                                        std::llround(pos.y * subpixel_scale));
+                }
+                glm::uvec3 idx = tri;
+                int64_t area = edge_function(p[0], p[1], p[2]);
+                if (area == 0) {
+                    continue;
+                }
+                if (area < 0) {
+                    std::swap(p[1], p[2]);
+                    std::swap(idx[1], idx[2]);
+                    area = -area;
+                }
+
+                const glm::i64vec2 lo = glm::min(p[0], glm::min(p[1], p[2]));
+                const glm::i64vec2 hi = glm::max(p[0], glm::max(p[1], p[2]));
+                const int64_t x0 = std::max<int64_t>(lo.x / subpixel_scale, 0);
+                const int64_t y0 = std::max<int64_t>(lo.y / subpixel_scale, 0);
+                const int64_t x1 = std::min<int64_t>(hi.x / subpixel_scale, atlas_size.x - 1);
+                const int64_t y1 = std::min<int64_t>(hi.y / subpixel_scale, atlas_size.y - 1);
+                const std::array<bool, 3> top_left = {is_top_left(p[1], p[2]),
+                                                      is_top_left(p[2], p[0]),
+                                                      is_top_left(p[0], p[1])};
+                for (int64_t y = y0; y <= y1; ++y) {
+                    for (int64_t x = x0; x <= x1; ++x) {
+                        const glm::i64vec2 c(x * subpixel_scale + subpixel_scale / 2,
+                                             y * subpixel_scale + subpixel_scale / 2);
+                        const std::array<int64_t, 3> w = {edge_function(p[1], p[2], c),
+                                                          edge_function(p[2], p[0], c),
+                                                          edge_function(p[0], p[1], c)};
+                        bool inside = true;
+                        for (int j = 0; j < 3; ++j) {
+                            inside = inside && (w[j] > 0 || (w[j] == 0 && top_left[j]));
+                        }
+                        if (!inside) {
+                            continue;
+                        }
+
+                        const glm::vec3 b = glm::vec3(w[0], w[1], w[2]) / float(area);
+                        const glm::vec3 position = b.x * verts[idx.x] + b.y * verts[idx.y] +
+                                                   b.z * verts[idx.z];
+                        const glm::vec3 normal = b.x * normals[idx.x] +
+                                                 b.y * normals[idx.y] + b.z * normals[idx.z];
+                        Texel texel;
+                        texel.pixel_id = y * atlas_size.x + x;
+                        texel.position = glm::vec3(inst.transform * glm::vec4(position, 1.f));
+                        texel.normal = glm::vec3(normal_transform * glm::vec4(normal, 0.f));
+
+                        uint32_t &t = pixel_texel[texel.pixel_id];
+                        if (t == no_texel) {
+                            t = texels.size();
+                            texels.push_back(texel);
+                        } else {
+                            texels[t] = texel;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    std::sort(texels.begin(), texels.end(), [](const Texel &a, const Texel &b) {
+        return a.pixel_id < b.pixel_id;
+    });
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <vector>
+#include <embree3/rtcore.h>
+#include "bake_backend.h"
+
+/* The CPU bake backend for machines without a ray tracing GPU, tracing the AO rays with
+ * Embree. The atlas is rasterized in software into a list of the texels covered, and each
+ * bake tile traces its texels' rays in packets of 16 across all cores. The texels take the
+ * same samples as the GPU bakes, so the maps converge to the same result
+ */
+class EmbreeBakeBackend : public BakeBackend {
+    // A texel covered by the atlas, with its interpolated world space position and normal
+    struct Texel {
+        uint32_t pixel_id;
+        glm::vec3 position;
+        glm::vec3 normal;
+    };
+
+    struct MeshGeometry {
+        std::vector<glm::vec3> vertices;
+        std::vector<glm::uvec3> indices;
+    };
+
+    RTCDevice device = nullptr;
+    RTCScene scene = nullptr;
+    std::vector<RTCScene> mesh_scenes;
+
+    std::vector<std::vector<MeshGeometry>> meshes;
+    std::vector<glm::mat4> instance_transforms;
+    std::vector<uint32_t> instance_meshes;
+
+    glm::uvec2 atlas_size = glm::uvec2(0);
+    // The covered texels, sorted by pixel so each row of a tile is a contiguous range
+    std::vector<Texel> texels;
+    std::vector<glm::vec2> accum;
+
+public:
+    EmbreeBakeBackend();
+    ~EmbreeBakeBackend() override;
+
+    EmbreeBakeBackend(const EmbreeBakeBackend &) = delete;
+    EmbreeBakeBackend &operator=(const EmbreeBakeBackend &) = delete;
+
+    std::string name() override;
+
+    std::string device_name() override;
+
+    void set_scene(const Scene &scene, const AtlasResult &atlas) override;
+
+    double build_accel() override;
+
+    BakeTileStats bake_tile(const glm::uvec2 &origin,
+                            const glm::uvec2 &size,
+                            uint32_t frame_id,
+                            const BakeSettings &settings) override;
+
+    std::vector<float> readback() override;
+
+private:
+    void release_scene();
+
+    /* Rasterize the instances' triangles into the atlas with the GPU's rules: a texel is
+     * covered if its center is inside the triangle or on a top or left edge, and later
+     * triangles overwrite earlier ones like the draws do
+     */
+    void rasterize_atlas(const Scene &scene, const AtlasResult &atlas);
+};
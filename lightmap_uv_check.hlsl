@@ -0,0 +1,44 @@
+// Checks the lightmap uvs of the meshes for overlaps by rasterizing each mesh's uvs over
+// the coverage grid and counting the texels covered by more than one of its triangles.
+// Triangles sharing an edge never both cover a texel center, so only overlapping ones do.
+// The meshes are drawn in order with a UAV barrier in between, and each marks the texels
+// it covers with its stamp, so the grid doesn't need clearing between them
+
+// The stamp of the last mesh to cover each texel: 2 * mesh + 1 once it's covered and
+// 2 * mesh + 2 once it's covered twice
+RWStructuredBuffer<uint> coverage : register(u0);
+// The overlapping texels of each mesh
+RWStructuredBuffer<uint> overlaps : register(u1);
+
+cbuffer CheckInfo : register(b0) {
+    uint mesh_index;
+    uint resolution;
+}
+
+struct VertexOutput {
+    float4 pos : SV_POSITION;
+};
+
+VertexOutput vsmain(float2 uv : TEXCOORD)
+{
+    VertexOutput vout;
+    vout.pos = float4(uv.x * 2.f - 1.f, 1.f - uv.y * 2.f, 0.f, 1.f);
+    return vout;
+}
+
+void fsmain(VertexOutput vin)
+{
+    const uint2 texel = uint2(vin.pos.xy);
+    const uint texel_id = texel.y * resolution + texel.x;
+    const uint covered = 2 * mesh_index + 1;
+    uint prev = 0;
+    InterlockedMax(coverage[texel_id], covered, prev);
+    if (prev < covered) {
+        return;
+    }
+    // Only the second triangle covering the texel counts it
+    InterlockedMax(coverage[texel_id], covered + 1, prev);
+    if (prev == covered) {
+        InterlockedAdd(overlaps[mesh_index], 1);
+    }
+}
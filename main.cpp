@@ -1,57 +1,180 @@
 #include <algorithm>
-#include <array>
+#include <cstdlib>
 #include <iostream>
-#include <memory>
-#include <numeric>
-#include <sstream>
+#include <string>
 #include <vector>
 #include <SDL.h>
-#include "arcball_camera.h"
-#include "dxr/dx12_utils.h"
-#include "dxr/dxdisplay.h"
-#include "dxr/dxr_utils.h"
+#include "ao_bake.h"
+#include "batch_bake.h"
+#include "distributed_bake.h"
 #include "imgui.h"
-#include "scene.h"
-#include "stb_image_write.h"
-#include "tiny_obj_loader.h"
+#include "server_bake.h"
+#include "thread_pool.h"
+#include "trace.h"
 #include "util.h"
-#include "util/display/display.h"
-#include "util/display/gldisplay.h"
 #include "util/display/imgui_impl_sdl.h"
-#include "util/xatlas.h"
 
-#include "render_ao_map_fs_embedded_dxil.h"
-#include "render_ao_map_vs_embedded_dxil.h"
-
-const std::string USAGE = "Usage: <obj/gltf_file>\n";
-
-int win_width = 512;
-int win_height = 512;
-
-struct AtlasParams {
-    glm::ivec2 dimensions;
-    int n_samples;
-    float ao_length;
-
-    AtlasParams(const glm::uvec2 dims)
-        : dimensions(dims.x, dims.y), n_samples(16), ao_length(5.f)
-    {
-    }
-};
-
-using Microsoft::WRL::ComPtr;
-
-void run_app(const std::vector<std::string> &args, SDL_Window *window, DXDisplay *display);
-
-void sync_gpu(ComPtr<ID3D12CommandQueue> &cmd_queue,
-              ComPtr<ID3D12Fence> &fence,
-              uint64_t &fence_value,
-              HANDLE &fence_evt);
-
-glm::vec2 transform_mouse(glm::vec2 in)
-{
-    return glm::vec2(in.x * 2.f / win_width - 1.f, 1.f - 2.f * in.y / win_height);
-}
+const std::string USAGE =
+    "Usage: <obj/gltf_file> [options]\n"
+    "Options:\n"
+    "  -img <w> <h>          Set the initial window size\n"
+    "  --display-fps <f>     Max rate the UI presents the AO map at, the bake runs\n"
+    "                        independently of it (default 30)\n"
+    "  --preview <n>         Start each bake in the viewer with previews at 1/n of the atlas\n"
+    "                        resolution, doubling it each level until the full atlas is\n"
+    "                        baked. n is a power of two up to 16, 0 disables it (default 0)\n"
+    "  --preview-samples <n> Samples per texel of the coarsest preview, doubling with each\n"
+    "                        level (default 4)\n"
+    "  --bake <out.png>      Bake the AO map without opening a window, write it to the\n"
+    "                        output file and exit\n"
+    "  --batch <out dir>     Bake each scene listed in the scene argument, a manifest with\n"
+    "                        one scene file per line or a directory of scene files, without\n"
+    "                        opening a window and write its maps to the output directory.\n"
+    "                        Upcoming scenes are loaded and unwrapped while the current one\n"
+    "                        bakes\n"
+    "  --batch-format <ext>  The file type of the batch bake's AO maps, png, dds or half\n"
+    "                        float exr (default png)\n"
+    "  --batch-prefetch <n>  Load up to n scenes ahead of the batch bake, each on its own\n"
+    "                        loader thread (default 2)\n"
+    "  --samples <n>         Number of AO samples to take per texel (default 16)\n"
+    "  --ao-length <l>       Max length of the AO rays (default 5)\n"
+    "  --samples-per-frame <n>\n"
+    "                        Accumulate the samples progressively, tracing n samples per\n"
+    "                        texel each frame. By default the interactive view traces 16\n"
+    "                        per frame and the headless bake traces all in one pass\n"
+    "  --atlas-cache <dir>   Cache the xatlas unwrap and the serialized BLASes in the\n"
+    "                        directory and reuse them when the geometry, atlas options,\n"
+    "                        BVH profile and GPU driver are unchanged\n"
+    "  --atlas-texels-per-unit <t>\n"
+    "                        Set the xatlas world to texel scale\n"
+    "  --atlas-resolution <n>\n"
+    "                        Set the xatlas target atlas resolution\n"
+    "  --atlas-max-iterations <n>\n"
+    "                        Set the xatlas chart growing iterations (default 1)\n"
+    "  --atlas-brute-force   Use the slower brute force xatlas chart packing\n"
+    "  --atlas-fast          Use cheap chart and pack settings for quick previews\n"
+    "  --atlas-budget <m>    Solve for the texel density filling an atlas of m megatexels\n"
+    "  --atlas-vram-budget <mb>\n"
+    "                        Solve for the texel density whose bake buffers take about mb\n"
+    "                        MB of VRAM\n"
+    "  --atlas-max-pages <n> Solve for the texel density filling n pages of the\n"
+    "                        --atlas-resolution. The budgets are only used if\n"
+    "                        --atlas-texels-per-unit isn't set, the smallest one is used\n"
+    "  --atlas-incremental   Chart each mesh on its own and cache its charts, so unwrapping\n"
+    "                        an edited scene only re-charts the changed meshes and keeps\n"
+    "                        the others in place. Requires --atlas-cache\n"
+    "  --tile-size <n>       Bake the atlas in tiles of n x n texels, each in its own\n"
+    "                        submission (default 2048)\n"
+    "  --compute-bake        Bake with a compute shader over a precomputed list of the\n"
+    "                        covered texels instead of rasterizing the atlas each frame\n"
+    "  --wavefront           Use the compute bake, generating the AO rays into a buffer\n"
+    "                        and tracing them binned by direction and origin\n"
+    "  --adaptive            Use the compute bake, tracing samples in rounds until each\n"
+    "                        texel's AO is converged or has taken all samples\n"
+    "  --adaptive-error <e>  Standard error at which a texel is converged (default 0.01)\n"
+    "  --adaptive-min-samples <n>\n"
+    "                        Samples each texel takes before it can converge (default 16)\n"
+    "  --gutter <n>          Fill n texels of gutter around the charts with the nearest\n"
+    "                        chart texel's AO, up to 32. 0 disables it (default 4)\n"
+    "  --denoise             Filter the AO map with an a-trous filter guided by the texels'\n"
+    "                        world position and normal after baking\n"
+    "  --denoise-iterations <n>\n"
+    "                        Number of a-trous filter iterations (default 5)\n"
+    "  --sampler <s>         Set the AO ray sampler: lcg, sobol (default), r2 or blue-noise\n"
+    "  --sampler-seed <n>    Seed the sampler, to decorrelate separate bakes\n"
+    "  --ao-format <f>       Set the format of the headless bake's AO map: rgba8 (default),\n"
+    "                        r8, r16, r16f, or bc4 to bake to r8 and write .dds files\n"
+    "                        BC4 compressed. .dds outputs keep the format, .png are 8-bit\n"
+    "                        and .exr are half float\n"
+    "  --bent-normals <file> Also bake the average unoccluded direction of the AO rays and\n"
+    "                        write it to the file, as .png, linear .hdr or .exr or BC5\n"
+    "                        .dds\n"
+    "  --hit-distance <file> Also bake the mean AO ray hit distance and write it to the\n"
+    "                        file, as .png or BC4 .dds normalized by the AO length or .hdr\n"
+    "                        or .exr in world units\n"
+    "  --direct-light <file> Also bake the direct irradiance from the scene's quad lights\n"
+    "                        with a shadow ray per AO sample and write it to the file, as\n"
+    "                        a clamped .png or linear .hdr or .exr. Raster bake only\n"
+    "  --ray-budget <n>      Use the compute bake, distributing n rays in total over the\n"
+    "                        texels by their world space size and curvature instead of\n"
+    "                        taking the same number of samples in each texel\n"
+    "  --compare <ref.png>   Print the RMSE of the headless bake against a reference AO map\n"
+    "                        after each frame, e.g. one baked with 16k samples\n"
+    "  --profile <out.json>  Write the GPU time of each load and bake phase to a JSON file,\n"
+    "                        at exit for the headless bake or from the UI\n"
+    "  --trace <out.json>    Write a Chrome trace of the CPU load and build phases with the\n"
+    "                        GPU profiler regions at exit, for chrome://tracing or Perfetto\n"
+    "  --threads <n>         Run the scene loading, mesh processing and export tasks on n\n"
+    "                        threads (default one per hardware thread)\n"
+    "  --bvh-profile <p>     Set the acceleration structure build flags: fast-build for\n"
+    "                        quick builds without compaction, fast-trace for compacted\n"
+    "                        BVHs tuned for tracing, or auto (default) to use fast-build\n"
+    "                        for bakes of up to 64 samples per texel\n"
+    "  --bvh-benchmark <out.json>\n"
+    "                        Before the headless bake, build the BVHs with each profile\n"
+    "                        and bake a few frames, writing the build time, BVH size and\n"
+    "                        Mrays/s of each to the file\n"
+    "  --raygen              Use the compute bake, tracing the texels' AO rays with\n"
+    "                        DispatchRays through a DXR 1.0 pipeline instead of inline\n"
+    "                        ray queries\n"
+    "  --backend-benchmark   Before the headless bake, bake a few frames with the inline\n"
+    "                        ray query and raygen compute bakes and print the Mrays/s of\n"
+    "                        each\n"
+    "  --committed-resources Create each buffer and texture as its own committed resource\n"
+    "                        instead of placing them in shared heaps\n"
+    "  --pipeline-cache <file>\n"
+    "                        Cache the compiled pipeline states in the file and load them\n"
+    "                        on later runs with the same GPU driver. Defaults to\n"
+    "                        pipelines.bin in the --atlas-cache directory, if set\n"
+    "  --multi-gpu           Split the headless raster bake's tiles across all GPUs\n"
+    "                        supporting DXR 1.1, each with its own copy of the scene\n"
+    "  --distribute <dir>    Coordinate a headless raster bake distributed across the\n"
+    "                        workers sharing the job directory, e.g. a network share. The\n"
+    "                        scene cache is written to the directory for the workers, and\n"
+    "                        the coordinator bakes tiles alongside them while merging theirs\n"
+    "  --worker              Bake the tiles of the distributed bakes coordinated in the job\n"
+    "                        directory passed in place of the scene file, until stopped\n"
+    "  --worker-timeout <s>  Requeue a worker's tile if its bake makes no progress for s\n"
+    "                        seconds (default 60)\n"
+    "  --vertex-ao <file>    Bake the AO of each mesh vertex instead of an atlas, skipping\n"
+    "                        the unwrap, and write the scene to the .gltf or .glb file with\n"
+    "                        the AO as each vertex's COLOR_0\n"
+    "  --serve               Run as a bake server on the local pipe named in place of the\n"
+    "                        scene file, keeping the device and pipelines alive across the\n"
+    "                        headless bakes sent to it with --submit, until stopped\n"
+    "  --server-jobs <n>     Max jobs the server holds loaded, loading or baking at once\n"
+    "                        (default 2)\n"
+    "  --server-vram-budget <mb>\n"
+    "                        Only start loading a job while the device's video memory usage\n"
+    "                        is below mb (default the adapter's budget)\n"
+    "  --submit <name>       Send the headless bake to the bake server on the named pipe and\n"
+    "                        wait for its reply instead of baking it. The bake settings not\n"
+    "                        left at their defaults replace the server's\n"
+    "  --textures <t>        Which scene textures to decode: alpha (default) for only the\n"
+    "                        alpha masks, all, or none to skip decoding and alpha testing\n"
+    "  --lightmap-uvs <set>  Bake into the glTF uv set, e.g. TEXCOORD_1, of the meshes where\n"
+    "                        it's within [0, 1] without overlaps instead of charting them\n"
+    "  --max-geometry-size <n>\n"
+    "                        Split geometries with more than n triangles or vertices into\n"
+    "                        spatially coherent chunks (default 4194304)\n"
+    "  --mesh-optimize <m>   Optimize the scene geometry: none (default), pre to weld the\n"
+    "                        vertices before the unwrap, post to reorder the unwrapped\n"
+    "                        geometry for the vertex cache and fetch, or both\n"
+    "  --occluder-proxy <r>  Trace the far field AO rays against proxies of the meshes\n"
+    "                        simplified to the fraction r of their triangles, 0 to trace\n"
+    "                        the full-res meshes (default)\n"
+    "  --occluder-near-field <d>\n"
+    "                        The distance the AO rays trace the full-res meshes before\n"
+    "                        switching to the occluder proxies (default 1)\n"
+    "  --occluder-class <class>=<fields>\n"
+    "                        Set which fields of the AO rays the instances of the occluder\n"
+    "                        class occlude: all (default), near, only within the near field\n"
+    "                        distance, or none. The classes are hero, large, small and tiny\n"
+    "  --occluder-sizes <small>,<tiny>\n"
+    "                        Class untagged instances whose bounds' diagonal is below the\n"
+    "                        fractions of the scene's as small and tiny (default 0.05,0.01)\n";
+
+AppOptions parse_args(const std::vector<std::string> &args);
 
 int main(int argc, const char **argv)
 {
@@ -65,21 +188,57 @@ int main(int argc, const char **argv)
         return 1;
     }
 
+    const AppOptions options = parse_args(args);
+    set_thread_count(options.thread_count);
+    if (!options.trace_output.empty()) {
+#ifndef DXR_AO_TRACE
+        std::cout << "Warning: built without DXR_AO_TRACE, the trace will only have the GPU "
+                     "profiler regions\n";
+#endif
+        trace_enable();
+        trace_set_thread_name("Main");
+    }
+
+    if (!options.submit_pipe.empty()) {
+        return submit_bake(options) ? 0 : 1;
+    }
+    if (options.bake_server) {
+        run_bake_server(options);
+        return 0;
+    }
+    // In batch mode we don't need SDL, a window, a swap chain or ImGui
+    if (!options.batch_output.empty()) {
+        const bool success = run_batch_bake(options);
+        if (!options.trace_output.empty()) {
+            write_trace(options.trace_output);
+        }
+        return success ? 0 : 1;
+    }
+    if (!options.bake_output.empty()) {
+        run_headless_bake(options);
+        if (!options.trace_output.empty()) {
+            write_trace(options.trace_output);
+        }
+        return 0;
+    }
+    if (options.bake_worker) {
+        run_bake_worker(options);
+        return 0;
+    }
+    if (!options.vertex_ao_output.empty()) {
+        run_vertex_ao_bake(options);
+        if (!options.trace_output.empty()) {
+            write_trace(options.trace_output);
+        }
+        return 0;
+    }
+
     if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
         std::cerr << "Failed to init SDL: " << SDL_GetError() << "\n";
         return -1;
     }
 
-    // Determine which display frontend we should use
     uint32_t window_flags = SDL_WINDOW_RESIZABLE;
-    for (size_t i = 0; i < args.size(); ++i) {
-        if (args[i] == "-img") {
-            win_width = std::stoi(args[++i]);
-            win_height = std::stoi(args[++i]);
-            continue;
-        }
-    }
-
     SDL_Window *window = SDL_CreateWindow("DXR AO Baking",
                                           SDL_WINDOWPOS_CENTERED,
                                           SDL_WINDOWPOS_CENTERED,
@@ -92,7 +251,10 @@ int main(int argc, const char **argv)
     {
         std::unique_ptr<DXDisplay> display = std::make_unique<DXDisplay>(window);
 
-        run_app(args, window, display.get());
+        run_app(options, window, display.get());
+    }
+    if (!options.trace_output.empty()) {
+        write_trace(options.trace_output);
     }
 
     ImGui_ImplSDL2_Shutdown();
@@ -104,608 +266,324 @@ int main(int argc, const char **argv)
     return 0;
 }
 
-void run_app(const std::vector<std::string> &args, SDL_Window *window, DXDisplay *display)
+AppOptions parse_args(const std::vector<std::string> &args)
 {
-    ImGuiIO &io = ImGui::GetIO();
-
-    std::string scene_file = args[1];
-    canonicalize_path(scene_file);
-
-    if (scene_file.empty()) {
-        std::cout << "Error: No model file specified\n" << USAGE;
-        std::exit(1);
-    }
-
-    display->resize(win_width, win_height);
-    auto &device = display->device;
-
-    ComPtr<ID3D12Fence> fence;
-    uint64_t fence_value = 1;
-    device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&fence));
-    HANDLE fence_evt = CreateEvent(nullptr, false, false, nullptr);
-
-    // Create the command queue and command allocator
-    ComPtr<ID3D12CommandQueue> cmd_queue;
-    ComPtr<ID3D12CommandAllocator> cmd_allocator;
-    D3D12_COMMAND_QUEUE_DESC queue_desc = {};
-    queue_desc.Flags = D3D12_COMMAND_QUEUE_FLAG_NONE;
-    queue_desc.Type = D3D12_COMMAND_LIST_TYPE_DIRECT;
-    CHECK_ERR(device->CreateCommandQueue(&queue_desc, IID_PPV_ARGS(&cmd_queue)));
-    CHECK_ERR(device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT,
-                                             IID_PPV_ARGS(&cmd_allocator)));
-
-    // Make the command lists
-    ComPtr<ID3D12GraphicsCommandList4> cmd_list;
-    CHECK_ERR(device->CreateCommandList(0,
-                                        D3D12_COMMAND_LIST_TYPE_DIRECT,
-                                        cmd_allocator.Get(),
-                                        nullptr,
-                                        IID_PPV_ARGS(&cmd_list)));
-    cmd_list->Close();
-
-    std::vector<dxr::BottomLevelBVH> meshes;
-    dxr::TopLevelBVH scene_bvh;
-
-    glm::uvec2 atlas_size;
-    std::string scene_info;
-    {
-        Scene scene(scene_file);
-
-        std::stringstream ss;
-        ss << "Scene '" << scene_file << "':\n"
-           << "# Unique Triangles: " << pretty_print_count(scene.unique_tris()) << "\n"
-           << "# Total Triangles: " << pretty_print_count(scene.total_tris()) << "\n"
-           << "# Geometries: " << scene.num_geometries() << "\n"
-           << "# Meshes: " << scene.meshes.size() << "\n"
-           << "# Instances: " << scene.instances.size() << "\n"
-           << "# Materials: " << scene.materials.size() << "\n"
-           << "# Textures: " << scene.textures.size() << "\n"
-           << "# Lights: " << scene.lights.size() << "\n"
-           << "# Cameras: " << scene.cameras.size();
-
-        scene_info = ss.str();
-        std::cout << scene_info << "\n";
-
-        SDL_SetWindowTitle(window, "Generating atlas, please wait..");
-
-        auto *atlas = xatlas::Create();
-        const size_t total_geometries = scene.num_geometries();
-        for (const auto &m : scene.meshes) {
-            for (const auto &g : m.geometries) {
-                xatlas::MeshDecl mesh;
-                mesh.vertexCount = g.vertices.size();
-                mesh.vertexPositionData = g.vertices.data();
-                mesh.vertexPositionStride = sizeof(glm::vec3);
-
-                mesh.indexCount = g.indices.size() * 3;
-                mesh.indexData = g.indices.data();
-                mesh.indexFormat = xatlas::IndexFormat::UInt32;
+    AppOptions options;
+    options.scene_file = args[1];
+    canonicalize_path(options.scene_file);
 
-                if (!g.uvs.empty()) {
-                    mesh.vertexUvData = g.uvs.data();
-                    mesh.vertexUvStride = sizeof(glm::vec2);
-                }
-
-                if (!g.normals.empty()) {
-                    mesh.vertexNormalData = g.normals.data();
-                    mesh.vertexNormalStride = sizeof(glm::vec3);
-                } else {
-                    std::cout << "Normals are required on all objects\n";
-                    throw std::runtime_error("Normals are required on all objects");
-                }
-
-                auto err = xatlas::AddMesh(atlas, mesh, total_geometries);
-                if (err != xatlas::AddMeshError::Success) {
-                    xatlas::Destroy(atlas);
-                    std::cout << "Error adding geometry to atlas: "
-                              << xatlas::StringForEnum(err) << "\n";
-                    throw std::runtime_error("Error adding geometry to atlas");
-                }
+    for (size_t i = 2; i < args.size(); ++i) {
+        if (args[i] == "-img") {
+            win_width = std::stoi(args[++i]);
+            win_height = std::stoi(args[++i]);
+        } else if (args[i] == "--display-fps") {
+            options.display_fps = std::stof(args[++i]);
+        } else if (args[i] == "--preview") {
+            options.preview_scale = std::max(std::stoi(args[++i]), 0);
+        } else if (args[i] == "--preview-samples") {
+            options.preview_samples = std::max(std::stoi(args[++i]), 1);
+        } else if (args[i] == "--bake") {
+            options.bake_output = args[++i];
+        } else if (args[i] == "--batch") {
+            options.batch_output = args[++i];
+            canonicalize_path(options.batch_output);
+        } else if (args[i] == "--batch-format") {
+            options.batch_format = args[++i];
+        } else if (args[i] == "--batch-prefetch") {
+            options.batch_prefetch = std::max(std::stoi(args[++i]), 1);
+        } else if (args[i] == "--samples") {
+            options.n_samples = std::stoi(args[++i]);
+        } else if (args[i] == "--ao-length") {
+            options.ao_length = std::stof(args[++i]);
+        } else if (args[i] == "--samples-per-frame") {
+            options.samples_per_frame = std::stoi(args[++i]);
+        } else if (args[i] == "--atlas-cache") {
+            options.atlas_options.cache_dir = args[++i];
+        } else if (args[i] == "--atlas-texels-per-unit") {
+            options.atlas_options.pack_options.texelsPerUnit = std::stof(args[++i]);
+        } else if (args[i] == "--atlas-resolution") {
+            options.atlas_options.pack_options.resolution = std::stoi(args[++i]);
+        } else if (args[i] == "--atlas-max-iterations") {
+            options.atlas_options.chart_options.maxIterations = std::stoi(args[++i]);
+        } else if (args[i] == "--atlas-brute-force") {
+            options.atlas_options.pack_options.bruteForce = true;
+        } else if (args[i] == "--atlas-fast") {
+            set_fast_atlas_options(options.atlas_options);
+        } else if (args[i] == "--atlas-budget") {
+            options.atlas_budget_mtexels = std::stod(args[++i]);
+        } else if (args[i] == "--atlas-vram-budget") {
+            options.atlas_vram_budget_mb = std::stod(args[++i]);
+        } else if (args[i] == "--atlas-max-pages") {
+            options.atlas_max_pages = std::max(std::stoi(args[++i]), 0);
+        } else if (args[i] == "--atlas-incremental") {
+            options.atlas_options.incremental = true;
+        } else if (args[i] == "--tile-size") {
+            options.tile_size = std::max(std::stoi(args[++i]), 1);
+        } else if (args[i] == "--compute-bake") {
+            options.compute_bake = true;
+        } else if (args[i] == "--adaptive") {
+            options.compute_bake = true;
+            options.adaptive = true;
+        } else if (args[i] == "--adaptive-error") {
+            options.adaptive_settings.error_threshold = std::stof(args[++i]);
+        } else if (args[i] == "--adaptive-min-samples") {
+            options.adaptive_settings.min_samples = std::stoi(args[++i]);
+        } else if (args[i] == "--gutter") {
+            options.gutter = std::min(uint32_t(std::max(std::stoi(args[++i]), 0)), max_gutter);
+        } else if (args[i] == "--denoise") {
+            options.denoise_settings.enabled = true;
+        } else if (args[i] == "--denoise-iterations") {
+            options.denoise_settings.iterations = std::max(std::stoi(args[++i]), 1);
+        } else if (args[i] == "--sampler") {
+            const std::string name = args[++i];
+            auto fnd = std::find(sampler_names.begin(), sampler_names.end(), name);
+            if (fnd == sampler_names.end()) {
+                std::cout << "Unrecognized sampler " << name << "\n" << USAGE;
+                std::exit(1);
             }
-        }
-
-        std::cout << "Generating atlas\n";
-        xatlas::Generate(atlas);
-        std::cout << "Atlas generated:\n"
-                  << "  # of charts: " << atlas->chartCount << "\n"
-                  << "  # of atlases: " << atlas->atlasCount << "\n"
-                  << "  Resolution: " << atlas->width << "x" << atlas->height << "\n";
-
-        SDL_SetWindowTitle(window, "DXR AO Baking");
-        atlas_size = glm::uvec2(atlas->width, atlas->height);
-
-        // Replace the mesh data with the atlas mesh data
-        size_t mesh_id = 0;
-        for (auto &m : scene.meshes) {
-            for (auto &g : m.geometries) {
-                const auto &mesh = atlas->meshes[mesh_id++];
-                std::vector<glm::vec3> atlas_verts;
-                std::vector<glm::vec2> atlas_uvs;
-                atlas_verts.reserve(mesh.vertexCount);
-                atlas_uvs.reserve(mesh.vertexCount);
-
-                std::vector<glm::vec3> atlas_normals;
-                if (!g.normals.empty()) {
-                    atlas_normals.reserve(mesh.vertexCount);
-                }
-                for (size_t i = 0; i < mesh.vertexCount; ++i) {
-                    const auto &vert_indices = mesh.vertexArray[i];
-                    atlas_verts.push_back(g.vertices[vert_indices.xref]);
-
-                    if (!g.normals.empty()) {
-                        atlas_normals.push_back(g.normals[vert_indices.xref]);
-                    }
-                    atlas_uvs.push_back(glm::vec2(vert_indices.uv[0] / atlas_size.x,
-                                                  vert_indices.uv[1] / atlas_size.y));
-                }
-
-                std::vector<glm::uvec3> atlas_indices;
-                atlas_indices.reserve(mesh.indexCount / 3);
-                for (size_t i = 0; i < mesh.indexCount / 3; ++i) {
-                    atlas_indices.push_back(glm::uvec3(mesh.indexArray[i * 3],
-                                                       mesh.indexArray[i * 3 + 1],
-                                                       mesh.indexArray[i * 3 + 2]));
-                }
-
-                g.vertices = atlas_verts;
-                g.normals = atlas_normals;
-                g.uvs = atlas_uvs;
-                g.indices = atlas_indices;
+            options.sampler_type = std::distance(sampler_names.begin(), fnd);
+        } else if (args[i] == "--sampler-seed") {
+            options.sampler_seed = std::stoul(args[++i]);
+        } else if (args[i] == "--compare") {
+            options.compare_reference = args[++i];
+        } else if (args[i] == "--ao-format") {
+            const std::string name = args[++i];
+            auto fnd = std::find(ao_format_names.begin(), ao_format_names.end(), name);
+            if (fnd == ao_format_names.end()) {
+                std::cout << "Unrecognized AO format " << name << "\n" << USAGE;
+                std::exit(1);
             }
-        }
-        xatlas::Destroy(atlas);
-
-        // Upload the scene geometry
-        for (const auto &mesh : scene.meshes) {
-            std::vector<dxr::Geometry> geometries;
-            for (const auto &geom : mesh.geometries) {
-                // Upload the mesh to the vertex buffer, build accel structures
-                // Place the data in an upload heap first, then do a GPU-side copy
-                // into a default heap (resident in VRAM)
-                dxr::Buffer upload_verts =
-                    dxr::Buffer::upload(device.Get(),
-                                        geom.vertices.size() * sizeof(glm::vec3),
-                                        D3D12_RESOURCE_STATE_GENERIC_READ);
-                dxr::Buffer upload_indices =
-                    dxr::Buffer::upload(device.Get(),
-                                        geom.indices.size() * sizeof(glm::uvec3),
-                                        D3D12_RESOURCE_STATE_GENERIC_READ);
-
-                // Copy vertex and index data into the upload buffers
-                std::memcpy(upload_verts.map(), geom.vertices.data(), upload_verts.size());
-                std::memcpy(upload_indices.map(), geom.indices.data(), upload_indices.size());
-                upload_verts.unmap();
-                upload_indices.unmap();
-
-                dxr::Buffer upload_uvs;
-                if (!geom.uvs.empty()) {
-                    upload_uvs = dxr::Buffer::upload(device.Get(),
-                                                     geom.uvs.size() * sizeof(glm::vec2),
-                                                     D3D12_RESOURCE_STATE_GENERIC_READ);
-                    std::memcpy(upload_uvs.map(), geom.uvs.data(), upload_uvs.size());
-                    upload_uvs.unmap();
-                }
-
-                dxr::Buffer upload_normals;
-                if (!geom.normals.empty()) {
-                    upload_normals =
-                        dxr::Buffer::upload(device.Get(),
-                                            geom.normals.size() * sizeof(glm::vec3),
-                                            D3D12_RESOURCE_STATE_GENERIC_READ);
-                    std::memcpy(
-                        upload_normals.map(), geom.normals.data(), upload_normals.size());
-                    upload_normals.unmap();
-                }
-
-                // Allocate GPU side buffers for the data so we can have it resident in VRAM
-                dxr::Buffer vertex_buf = dxr::Buffer::default(
-                    device.Get(), upload_verts.size(), D3D12_RESOURCE_STATE_COPY_DEST);
-                dxr::Buffer index_buf = dxr::Buffer::default(
-                    device.Get(), upload_indices.size(), D3D12_RESOURCE_STATE_COPY_DEST);
-
-                CHECK_ERR(cmd_list->Reset(cmd_allocator.Get(), nullptr));
-
-                // Enqueue the copy into GPU memory
-                cmd_list->CopyResource(vertex_buf.get(), upload_verts.get());
-                cmd_list->CopyResource(index_buf.get(), upload_indices.get());
-
-                dxr::Buffer uv_buf;
-                if (!geom.uvs.empty()) {
-                    uv_buf = dxr::Buffer::default(
-                        device.Get(), upload_uvs.size(), D3D12_RESOURCE_STATE_COPY_DEST);
-                    cmd_list->CopyResource(uv_buf.get(), upload_uvs.get());
-                }
-
-                dxr::Buffer normal_buf;
-                if (!geom.normals.empty()) {
-                    normal_buf = dxr::Buffer::default(
-                        device.Get(), upload_normals.size(), D3D12_RESOURCE_STATE_COPY_DEST);
-                    cmd_list->CopyResource(normal_buf.get(), upload_normals.get());
-                }
-
-                // Barriers to wait for the copies to finish before building the accel. structs
-                {
-                    std::vector<D3D12_RESOURCE_BARRIER> b;
-                    b.push_back(barrier_transition(
-                        vertex_buf, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE));
-                    b.push_back(barrier_transition(
-                        index_buf, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE));
-                    if (!geom.uvs.empty()) {
-                        b.push_back(barrier_transition(
-                            uv_buf, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE));
-                    };
-                    if (!geom.normals.empty()) {
-                        b.push_back(barrier_transition(
-                            normal_buf, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE));
-                    };
-                    cmd_list->ResourceBarrier(b.size(), b.data());
-                }
-
-                geometries.emplace_back(vertex_buf, index_buf, normal_buf, uv_buf);
-
-                // TODO: Some possible perf improvements: We can run all the upload of
-                // index data in parallel, and the BVH building in parallel for all the
-                // geometries. This should help for some large scenes, though with the
-                // assumption that the entire build space for all the bottom level stuff can
-                // fit on the GPU. For large scenes it would be best to monitor the available
-                // space needed for the queued builds vs. the available GPU memory and then run
-                // stuff and compact when we start getting full.
-                CHECK_ERR(cmd_list->Close());
-                ID3D12CommandList *cmd_lists = cmd_list.Get();
-                cmd_queue->ExecuteCommandLists(1, &cmd_lists);
-                sync_gpu(cmd_queue, fence, fence_value, fence_evt);
+            options.ao_format = ao_formats[std::distance(ao_format_names.begin(), fnd)];
+            options.compress_ao = name == "bc4";
+        } else if (args[i] == "--bent-normals") {
+            options.bent_normal_output = args[++i];
+        } else if (args[i] == "--hit-distance") {
+            options.hit_distance_output = args[++i];
+        } else if (args[i] == "--direct-light") {
+            options.direct_light_output = args[++i];
+        } else if (args[i] == "--profile") {
+            options.profile_output = args[++i];
+        } else if (args[i] == "--trace") {
+            options.trace_output = args[++i];
+        } else if (args[i] == "--threads") {
+            options.thread_count = std::max(std::stoi(args[++i]), 0);
+        } else if (args[i] == "--bvh-profile") {
+            const std::string name = args[++i];
+            auto fnd = std::find(bvh_profile_names.begin(), bvh_profile_names.end(), name);
+            if (fnd == bvh_profile_names.end()) {
+                std::cout << "Unrecognized BVH profile " << name << "\n" << USAGE;
+                std::exit(1);
             }
-
-            meshes.emplace_back(geometries);
-
-            CHECK_ERR(cmd_list->Reset(cmd_allocator.Get(), nullptr));
-            meshes.back().enqeue_build(device.Get(), cmd_list.Get());
-            CHECK_ERR(cmd_list->Close());
-            ID3D12CommandList *cmd_lists = cmd_list.Get();
-            cmd_queue->ExecuteCommandLists(1, &cmd_lists);
-            sync_gpu(cmd_queue, fence, fence_value, fence_evt);
-
-            CHECK_ERR(cmd_list->Reset(cmd_allocator.Get(), nullptr));
-
-            meshes.back().enqueue_compaction(device.Get(), cmd_list.Get());
-            CHECK_ERR(cmd_list->Close());
-            cmd_queue->ExecuteCommandLists(1, &cmd_lists);
-            sync_gpu(cmd_queue, fence, fence_value, fence_evt);
-
-            meshes.back().finalize();
-        }
-
-        auto instance_buf = dxr::Buffer::upload(
-            device.Get(),
-            align_to(scene.instances.size() * sizeof(D3D12_RAYTRACING_INSTANCE_DESC),
-                     D3D12_RAYTRACING_INSTANCE_DESCS_BYTE_ALIGNMENT),
-            D3D12_RESOURCE_STATE_GENERIC_READ);
-
-        {
-            // TODO: We want to keep some of the instance to BLAS mapping info for setting up
-            // the hitgroups/sbt so the toplevel bvh can become something a bit higher-level to
-            // manage this and filling out the instance buffers Write the data about our
-            // instance
-            D3D12_RAYTRACING_INSTANCE_DESC *buf =
-                static_cast<D3D12_RAYTRACING_INSTANCE_DESC *>(instance_buf.map());
-
-            size_t instance_hitgroup_offset = 0;
-            for (size_t i = 0; i < scene.instances.size(); ++i) {
-                const auto &inst = scene.instances[i];
-                buf[i].InstanceID = i;
-                buf[i].InstanceContributionToHitGroupIndex = instance_hitgroup_offset;
-                buf[i].Flags = D3D12_RAYTRACING_INSTANCE_FLAG_FORCE_OPAQUE;
-                buf[i].AccelerationStructure = meshes[inst.mesh_id]->GetGPUVirtualAddress();
-                buf[i].InstanceMask = 0xff;
-
-                // Note: D3D matrices are row-major
-                std::memset(buf[i].Transform, 0, sizeof(buf[i].Transform));
-                const glm::mat4 m = glm::transpose(inst.transform);
-                for (int r = 0; r < 3; ++r) {
-                    for (int c = 0; c < 4; ++c) {
-                        buf[i].Transform[r][c] = m[r][c];
-                    }
-                }
-
-                instance_hitgroup_offset += meshes[inst.mesh_id].geometries.size();
+            options.bvh_profile = std::distance(bvh_profile_names.begin(), fnd);
+        } else if (args[i] == "--textures") {
+            const std::string name = args[++i];
+            auto fnd = std::find(texture_load_names.begin(), texture_load_names.end(), name);
+            if (fnd == texture_load_names.end()) {
+                std::cout << "Unrecognized texture load mode " << name << "\n" << USAGE;
+                std::exit(1);
+            }
+            options.scene_load.texture_load = static_cast<TextureLoad>(
+                std::distance(texture_load_names.begin(), fnd));
+        } else if (args[i] == "--lightmap-uvs") {
+            options.scene_load.lightmap_uv_set = args[++i];
+        } else if (args[i] == "--max-geometry-size") {
+            const size_t n = std::max(std::stoull(args[++i]), 1ull);
+            options.scene_load.split_limits.max_triangles = n;
+            options.scene_load.split_limits.max_vertices = n;
+        } else if (args[i] == "--mesh-optimize") {
+            const std::string name = args[++i];
+            auto fnd = std::find(mesh_optimize_names.begin(), mesh_optimize_names.end(), name);
+            if (fnd == mesh_optimize_names.end()) {
+                std::cout << "Unrecognized mesh optimization " << name << "\n" << USAGE;
+                std::exit(1);
+            }
+            options.scene_load.mesh_optimize = std::distance(mesh_optimize_names.begin(), fnd);
+        } else if (args[i] == "--occluder-proxy") {
+            options.scene_load.occluder_proxy_ratio = std::stof(args[++i]);
+        } else if (args[i] == "--occluder-near-field") {
+            options.scene_load.occluder_near_field = std::max(std::stof(args[++i]), 0.f);
+        } else if (args[i] == "--occluder-class") {
+            const std::string arg = args[++i];
+            const size_t eq = arg.find('=');
+            const uint32_t occluder_class = parse_occluder_class(arg.substr(0, eq));
+            const std::string fields = eq != std::string::npos ? arg.substr(eq + 1) : "";
+            auto fnd = std::find(
+                occluder_field_names.begin(), occluder_field_names.end(), fields);
+            if (occluder_class == OCCLUDER_CLASS_UNTAGGED ||
+                fnd == occluder_field_names.end()) {
+                std::cout << "Unrecognized occluder class setting " << arg << "\n" << USAGE;
+                std::exit(1);
             }
-            instance_buf.unmap();
+            options.scene_load.occluder_class_fields[occluder_class] =
+                occluder_fields[std::distance(occluder_field_names.begin(), fnd)];
+        } else if (args[i] == "--occluder-sizes") {
+            const std::string arg = args[++i];
+            const size_t comma = arg.find(',');
+            if (comma == std::string::npos) {
+                std::cout << "Error: --occluder-sizes takes the small and tiny sizes\n";
+                std::exit(1);
+            }
+            options.scene_load.occluder_small_size = std::stof(arg.substr(0, comma));
+            options.scene_load.occluder_tiny_size = std::stof(arg.substr(comma + 1));
+        } else if (args[i] == "--bvh-benchmark") {
+            options.bvh_benchmark_output = args[++i];
+        } else if (args[i] == "--ray-budget") {
+            options.compute_bake = true;
+            options.ray_budget = std::stod(args[++i]);
+        } else if (args[i] == "--wavefront") {
+            options.compute_bake = true;
+            options.wavefront = true;
+        } else if (args[i] == "--raygen") {
+            options.compute_bake = true;
+            options.raygen_bake = true;
+        } else if (args[i] == "--backend-benchmark") {
+            options.compute_bake = true;
+            options.backend_benchmark = true;
+        } else if (args[i] == "--committed-resources") {
+            options.placed_resources = false;
+        } else if (args[i] == "--pipeline-cache") {
+            options.pipeline_cache = args[++i];
+        } else if (args[i] == "--multi-gpu") {
+            options.multi_gpu = true;
+        } else if (args[i] == "--distribute") {
+            options.distribute_dir = args[++i];
+            canonicalize_path(options.distribute_dir);
+        } else if (args[i] == "--worker") {
+            options.bake_worker = true;
+        } else if (args[i] == "--worker-timeout") {
+            options.worker_timeout = std::max(std::stof(args[++i]), 1.f);
+        } else if (args[i] == "--vertex-ao") {
+            options.vertex_ao_output = args[++i];
+        } else if (args[i] == "--serve") {
+            options.bake_server = true;
+        } else if (args[i] == "--server-jobs") {
+            options.server_jobs = std::max(std::stoi(args[++i]), 1);
+        } else if (args[i] == "--server-vram-budget") {
+            options.server_vram_budget_mb = std::stod(args[++i]);
+        } else if (args[i] == "--submit") {
+            options.submit_pipe = args[++i];
+        } else {
+            std::cout << "Unrecognized argument " << args[i] << "\n" << USAGE;
+            std::exit(1);
         }
-
-        // Now build the top level acceleration structure on our instance
-        scene_bvh = dxr::TopLevelBVH(instance_buf, scene.instances);
-
-        CHECK_ERR(cmd_list->Reset(cmd_allocator.Get(), nullptr));
-        scene_bvh.enqeue_build(device.Get(), cmd_list.Get());
-        CHECK_ERR(cmd_list->Close());
-
-        ID3D12CommandList *cmd_lists = cmd_list.Get();
-        cmd_queue->ExecuteCommandLists(1, &cmd_lists);
-        sync_gpu(cmd_queue, fence, fence_value, fence_evt);
-
-        scene_bvh.finalize();
     }
 
-    // TODO LATER: 2D panning controls for the atlas so we don't need the window dims to match
-    // it
-    win_width = atlas_size.x;
-    win_height = atlas_size.y;
-    SDL_SetWindowSize(window, win_width, win_height);
-
-    display->resize(win_width, win_height);
-
-    D3D12_CLEAR_VALUE clear_value;
-    clear_value.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
-    std::memset(clear_value.Color, 0, sizeof(clear_value.Color));
-    clear_value.Color[3] = 1.f;
-
-    auto ao_image = dxr::Texture2D::default(display->device.Get(),
-                                            atlas_size,
-                                            D3D12_RESOURCE_STATE_RENDER_TARGET,
-                                            DXGI_FORMAT_R8G8B8A8_UNORM,
-                                            D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET,
-                                            &clear_value);
-
-    // Make a descriptor heap
-    ComPtr<ID3D12DescriptorHeap> rtv_heap;
-    D3D12_DESCRIPTOR_HEAP_DESC rtv_heap_desc = {};
-    rtv_heap_desc.NumDescriptors = 1;
-    rtv_heap_desc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_RTV;
-    rtv_heap_desc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_NONE;
-    CHECK_ERR(device->CreateDescriptorHeap(&rtv_heap_desc, IID_PPV_ARGS(&rtv_heap)));
-
-    // Create render target descriptors heap for our AO baked
-    D3D12_CPU_DESCRIPTOR_HANDLE rtv_handle = rtv_heap->GetCPUDescriptorHandleForHeapStart();
-    device->CreateRenderTargetView(ao_image.get(), nullptr, rtv_handle);
-
-    // Make an empty root signature
-    // TODO: This will take the TLAS later
-    dxr::RootSignature root_signature =
-        dxr::RootSignatureBuilder::global(
-            D3D12_ROOT_SIGNATURE_FLAG_ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT)
-            .add_constants("atlas_info", 0, 4, 0)
-            .add_srv("scene", 0, 0)
-            .create(display->device.Get());
-
-    ComPtr<ID3D12PipelineState> pipeline_state;
-    {
-        // Create the graphics pipeline state description
-        D3D12_GRAPHICS_PIPELINE_STATE_DESC desc = {0};
-
-        // Specify the vertex data layout
-        std::array<D3D12_INPUT_ELEMENT_DESC, 3> vertex_layout = {
-            D3D12_INPUT_ELEMENT_DESC{"POSITION",
-                                     0,
-                                     DXGI_FORMAT_R32G32B32_FLOAT,
-                                     0,
-                                     0,
-                                     D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA,
-                                     0},
-            D3D12_INPUT_ELEMENT_DESC{"NORMAL",
-                                     0,
-                                     DXGI_FORMAT_R32G32B32_FLOAT,
-                                     1,
-                                     0,
-                                     D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA,
-                                     0},
-            D3D12_INPUT_ELEMENT_DESC{"TEXCOORD",
-                                     0,
-                                     DXGI_FORMAT_R32G32_FLOAT,
-                                     2,
-                                     0,
-                                     D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA,
-                                     0}};
-
-        desc.pRootSignature = root_signature.get();
-
-        desc.VS.pShaderBytecode = render_ao_map_vs_dxil;
-        desc.VS.BytecodeLength = sizeof(render_ao_map_vs_dxil);
-        desc.PS.pShaderBytecode = render_ao_map_fs_dxil;
-        desc.PS.BytecodeLength = sizeof(render_ao_map_fs_dxil);
-
-        desc.BlendState.AlphaToCoverageEnable = FALSE;
-        desc.BlendState.IndependentBlendEnable = FALSE;
-        {
-            const D3D12_RENDER_TARGET_BLEND_DESC rt_blend_desc = {
-                false,
-                false,
-                D3D12_BLEND_ONE,
-                D3D12_BLEND_ZERO,
-                D3D12_BLEND_OP_ADD,
-                D3D12_BLEND_ONE,
-                D3D12_BLEND_ZERO,
-                D3D12_BLEND_OP_ADD,
-                D3D12_LOGIC_OP_NOOP,
-                D3D12_COLOR_WRITE_ENABLE_ALL,
-            };
-            for (int i = 0; i < D3D12_SIMULTANEOUS_RENDER_TARGET_COUNT; ++i) {
-                desc.BlendState.RenderTarget[i] = rt_blend_desc;
-            }
+    if (options.scene_file.empty()) {
+        std::cout << "Error: No model file specified\n" << USAGE;
+        std::exit(1);
+    }
+    if (options.preview_scale > max_preview_scale ||
+        (options.preview_scale & (options.preview_scale - 1)) != 0) {
+        std::cout << "Error: The preview scale must be a power of two up to "
+                  << max_preview_scale << "\n";
+        std::exit(1);
+    }
+    if (options.pipeline_cache.empty() && !options.atlas_options.cache_dir.empty()) {
+        options.pipeline_cache = options.atlas_options.cache_dir + "/pipelines.bin";
+    }
+    if (requested_bake_outputs(options) != 0 && (options.wavefront || options.adaptive)) {
+        std::cout << "Error: --bent-normals, --hit-distance and --direct-light are only "
+                     "supported by the raster and compute bakes\n";
+        std::exit(1);
+    }
+    if (!options.direct_light_output.empty()) {
+        const std::string ext = get_file_extension(options.direct_light_output);
+        if (options.compute_bake) {
+            std::cout << "Error: --direct-light is only supported by the raster bake\n";
+            std::exit(1);
+        }
+        if (ext != "png" && ext != "hdr" && ext != "exr") {
+            std::cout
+                << "Error: --direct-light must be written to a .png, .hdr or .exr file\n";
+            std::exit(1);
         }
-
-        desc.RasterizerState.FillMode = D3D12_FILL_MODE_SOLID;
-        desc.RasterizerState.CullMode = D3D12_CULL_MODE_NONE;
-        desc.RasterizerState.FrontCounterClockwise = FALSE;
-        desc.RasterizerState.DepthBias = D3D12_DEFAULT_DEPTH_BIAS;
-        desc.RasterizerState.DepthBiasClamp = D3D12_DEFAULT_DEPTH_BIAS_CLAMP;
-        desc.RasterizerState.SlopeScaledDepthBias = D3D12_DEFAULT_SLOPE_SCALED_DEPTH_BIAS;
-        desc.RasterizerState.DepthClipEnable = TRUE;
-        desc.RasterizerState.MultisampleEnable = FALSE;
-        desc.RasterizerState.AntialiasedLineEnable = FALSE;
-        desc.RasterizerState.ForcedSampleCount = 0;
-        desc.RasterizerState.ConservativeRaster = D3D12_CONSERVATIVE_RASTERIZATION_MODE_OFF;
-
-        desc.SampleMask = UINT_MAX;
-        desc.DepthStencilState.DepthEnable = false;
-        desc.DepthStencilState.StencilEnable = false;
-
-        desc.InputLayout.pInputElementDescs = vertex_layout.data();
-        desc.InputLayout.NumElements = vertex_layout.size();
-        desc.PrimitiveTopologyType = D3D12_PRIMITIVE_TOPOLOGY_TYPE_TRIANGLE;
-
-        desc.NumRenderTargets = 1;
-        desc.RTVFormats[0] = DXGI_FORMAT_R8G8B8A8_UNORM;
-        desc.SampleDesc.Count = 1;
-
-        CHECK_ERR(device->CreateGraphicsPipelineState(&desc, IID_PPV_ARGS(&pipeline_state)));
     }
-
-    D3D12_RECT screen_bounds = {0};
-    screen_bounds.right = win_width;
-    screen_bounds.bottom = win_height;
-
-    D3D12_VIEWPORT viewport = {0};
-    viewport.Width = static_cast<float>(win_width);
-    viewport.Height = static_cast<float>(win_height);
-    viewport.MinDepth = D3D12_MIN_DEPTH;
-    viewport.MaxDepth = D3D12_MAX_DEPTH;
-
-    const std::string rt_backend = "DirectX Ray Tracing";
-    const std::string cpu_brand = get_cpu_brand();
-    const std::string gpu_brand = display->gpu_brand();
-    const std::string image_output = "dxr_ao_bake.png";
-    const std::string display_frontend = display->name();
-
-    AtlasParams atlas_params(atlas_size);
-
-    size_t frame_id = 0;
-    float render_time = 0.f;
-    float rays_per_second = 0.f;
-    glm::vec2 prev_mouse(-2.f);
-    bool done = false;
-    while (!done) {
-        SDL_Event event;
-        while (SDL_PollEvent(&event)) {
-            ImGui_ImplSDL2_ProcessEvent(&event);
-            if (event.type == SDL_QUIT) {
-                done = true;
-            }
-            if (!io.WantCaptureKeyboard && event.type == SDL_KEYDOWN) {
-                if (event.key.keysym.sym == SDLK_ESCAPE) {
-                    done = true;
-                }
-            }
-            if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE &&
-                event.window.windowID == SDL_GetWindowID(window)) {
-                done = true;
-            }
-            if (!io.WantCaptureMouse) {
-                if (event.type == SDL_MOUSEMOTION) {
-                    const glm::vec2 cur_mouse =
-                        transform_mouse(glm::vec2(event.motion.x, event.motion.y));
-                    if (prev_mouse != glm::vec2(-2.f)) {
-                        if (event.motion.state & SDL_BUTTON_LMASK) {
-                            // camera.rotate(prev_mouse, cur_mouse);
-                        } else if (event.motion.state & SDL_BUTTON_RMASK) {
-                            // camera.pan(cur_mouse - prev_mouse);
-                        }
-                    }
-                    prev_mouse = cur_mouse;
-                } else if (event.type == SDL_MOUSEWHEEL) {
-                    // camera.zoom(event.wheel.y * 0.1);
-                }
-            }
-            if (event.type == SDL_WINDOWEVENT &&
-                event.window.event == SDL_WINDOWEVENT_RESIZED) {
-                frame_id = 0;
-                win_width = event.window.data1;
-                win_height = event.window.data2;
-                io.DisplaySize.x = win_width;
-                io.DisplaySize.y = win_height;
-
-                display->resize(win_width, win_height);
-            }
+    if (options.ray_budget > 0.0 && (options.wavefront || options.adaptive)) {
+        std::cout << "Error: --ray-budget is only supported by the compute bake\n";
+        std::exit(1);
+    }
+    if ((options.raygen_bake || options.backend_benchmark) &&
+        (options.wavefront || options.adaptive)) {
+        std::cout << "Error: --raygen and --backend-benchmark are only supported by the "
+                     "compute bake\n";
+        std::exit(1);
+    }
+    if (options.multi_gpu &&
+        (options.bake_output.empty() || options.compute_bake || options.adaptive ||
+         !options.compare_reference.empty())) {
+        std::cout << "Error: --multi-gpu is only supported by the headless raster bake "
+                     "without --compare\n";
+        std::exit(1);
+    }
+    if (!options.distribute_dir.empty() &&
+        (options.bake_output.empty() || options.multi_gpu || options.compute_bake ||
+         options.adaptive || !options.compare_reference.empty() ||
+         requested_bake_outputs(options) != 0)) {
+        std::cout << "Error: --distribute is only supported by the headless raster bake of "
+                     "the AO map without --multi-gpu or --compare\n";
+        std::exit(1);
+    }
+    if (options.bake_worker &&
+        (!options.bake_output.empty() || !options.distribute_dir.empty() ||
+         !options.batch_output.empty())) {
+        std::cout
+            << "Error: --worker can't be combined with --bake, --distribute or --batch\n";
+        std::exit(1);
+    }
+    if (!options.vertex_ao_output.empty()) {
+        const std::string ext = get_file_extension(options.vertex_ao_output);
+        if (!options.bake_output.empty() || !options.batch_output.empty() ||
+            !options.distribute_dir.empty() || options.bake_worker ||
+            requested_bake_outputs(options) != 0) {
+            std::cout << "Error: --vertex-ao can't be combined with --bake, --batch, "
+                         "--distribute, --worker or the extra maps\n";
+            std::exit(1);
         }
-
-        CHECK_ERR(cmd_allocator->Reset());
-        CHECK_ERR(cmd_list->Reset(cmd_allocator.Get(), pipeline_state.Get()));
-
-        cmd_list->SetGraphicsRootSignature(root_signature.get());
-        cmd_list->SetGraphicsRoot32BitConstants(0, 4, &atlas_params, 0);
-        cmd_list->SetGraphicsRootShaderResourceView(1, scene_bvh->GetGPUVirtualAddress());
-        cmd_list->RSSetViewports(1, &viewport);
-        cmd_list->RSSetScissorRects(1, &screen_bounds);
-        D3D12_CPU_DESCRIPTOR_HANDLE render_target =
-            rtv_heap->GetCPUDescriptorHandleForHeapStart();
-        cmd_list->OMSetRenderTargets(1, &render_target, false, nullptr);
-
-        cmd_list->ClearRenderTargetView(render_target, clear_value.Color, 0, nullptr);
-        cmd_list->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-        // Note: The AO baking doesn't support actually having multiple instances of the same
-        // mesh
-        for (auto &m : meshes) {
-            for (auto &g : m.geometries) {
-                std::array<D3D12_VERTEX_BUFFER_VIEW, 3> vbo_views = {
-                    D3D12_VERTEX_BUFFER_VIEW{
-                        g.vertex_buf->GetGPUVirtualAddress(),
-                        static_cast<uint32_t>(g.vertex_buf.size()),
-                        sizeof(glm::vec3),
-                    },
-                    D3D12_VERTEX_BUFFER_VIEW{
-                        g.normal_buf->GetGPUVirtualAddress(),
-                        static_cast<uint32_t>(g.normal_buf.size()),
-                        sizeof(glm::vec3),
-                    },
-                    D3D12_VERTEX_BUFFER_VIEW{
-                        g.uv_buf->GetGPUVirtualAddress(),
-                        static_cast<uint32_t>(g.uv_buf.size()),
-                        sizeof(glm::vec2),
-                    },
-                };
-                D3D12_INDEX_BUFFER_VIEW indices_view;
-                indices_view.BufferLocation = g.index_buf->GetGPUVirtualAddress();
-                indices_view.Format = DXGI_FORMAT_R32_UINT;
-                indices_view.SizeInBytes = g.index_buf.size();
-
-                cmd_list->IASetVertexBuffers(0, vbo_views.size(), vbo_views.data());
-                cmd_list->IASetIndexBuffer(&indices_view);
-                cmd_list->DrawIndexedInstanced(
-                    g.index_buf.size() / sizeof(uint32_t), 1, 0, 0, 0);
-            }
+        if (ext != "gltf" && ext != "glb") {
+            std::cout << "Error: --vertex-ao must be written to a .gltf or .glb file\n";
+            std::exit(1);
         }
-        CHECK_ERR(cmd_list->Close());
-
-        // Execute the command list and present
-        std::array<ID3D12CommandList *, 1> cmd_lists = {cmd_list.Get()};
-        cmd_queue->ExecuteCommandLists(cmd_lists.size(), cmd_lists.data());
-
-        sync_gpu(cmd_queue, fence, fence_value, fence_evt);
-
-        ++frame_id;
-
-        display->new_frame();
-
-        ImGui_ImplSDL2_NewFrame(window);
-        ImGui::NewFrame();
-
-        ImGui::Begin("Render Info");
-        ImGui::Text("Total Application Time: %.3f ms/frame (%.1f FPS)",
-                    1000.0f / ImGui::GetIO().Framerate,
-                    ImGui::GetIO().Framerate);
-        ImGui::Text("RT Backend: %s", rt_backend.c_str());
-        ImGui::Text("CPU: %s", cpu_brand.c_str());
-        ImGui::Text("GPU: %s", gpu_brand.c_str());
-        ImGui::SliderInt("AO Samples", &atlas_params.n_samples, 1, 1024);
-        ImGui::SliderFloat("AO Length", &atlas_params.ao_length, 0.1, 10.f);
-        ImGui::Text("%s", scene_info.c_str());
-
-        ImGui::End();
-        ImGui::Render();
-
-        display->display_native(ao_image);
     }
-}
-
-void sync_gpu(ComPtr<ID3D12CommandQueue> &cmd_queue,
-              ComPtr<ID3D12Fence> &fence,
-              uint64_t &fence_value,
-              HANDLE &fence_evt)
-{
-    const uint64_t signal_val = fence_value++;
-    CHECK_ERR(cmd_queue->Signal(fence.Get(), signal_val));
-
-    if (fence->GetCompletedValue() < signal_val) {
-        CHECK_ERR(fence->SetEventOnCompletion(signal_val, fence_evt));
-        WaitForSingleObject(fence_evt, INFINITE);
+    if (options.bake_server &&
+        (!options.bake_output.empty() || !options.batch_output.empty() ||
+         !options.distribute_dir.empty() || options.bake_worker ||
+         !options.vertex_ao_output.empty() || options.multi_gpu ||
+         !options.compare_reference.empty() || !options.profile_output.empty() ||
+         !options.bvh_benchmark_output.empty() || options.backend_benchmark ||
+         requested_bake_outputs(options) != 0)) {
+        std::cout << "Error: --serve can't be combined with --bake, --batch, --distribute, "
+                     "--worker, --vertex-ao, --multi-gpu, --compare, --profile, the "
+                     "benchmarks or the extra maps\n";
+        std::exit(1);
+    }
+    if (!options.submit_pipe.empty() &&
+        (options.bake_output.empty() || options.bake_server || options.multi_gpu ||
+         !options.distribute_dir.empty() || !options.compare_reference.empty())) {
+        std::cout << "Error: --submit requires --bake, and can't be combined with --serve, "
+                     "--multi-gpu, --distribute or --compare\n";
+        std::exit(1);
+    }
+    // The workers map the unwrapped scene from the scene cache in the job directory
+    if (!options.distribute_dir.empty()) {
+        options.atlas_options.cache_dir = options.distribute_dir;
+    }
+    if (!options.batch_output.empty() &&
+        (!options.bake_output.empty() || options.multi_gpu ||
+         !options.compare_reference.empty() || !options.profile_output.empty() ||
+         !options.bvh_benchmark_output.empty() || options.backend_benchmark)) {
+        std::cout << "Error: --batch can't be combined with --bake, --multi-gpu, --compare, "
+                     "--profile or the benchmarks\n";
+        std::exit(1);
+    }
+    if (options.batch_format != "png" && options.batch_format != "dds" &&
+        options.batch_format != "exr") {
+        std::cout << "Error: Unsupported --batch-format " << options.batch_format << "\n";
+        std::exit(1);
+    }
+    if (options.atlas_max_pages > 0 && options.atlas_options.pack_options.resolution == 0) {
+        std::cout << "Error: --atlas-max-pages requires --atlas-resolution\n";
+        std::exit(1);
     }
+    options.atlas_options.texel_budget = resolve_texel_budget(options);
+    return options;
 }
@@ -0,0 +1,93 @@
+// Upsamples a preview level of the AO map, baked at a reduced atlas resolution, into the
+// texels covered by the full resolution atlas. Only the preview's covered texels are
+// filtered, so the clear color outside its charts doesn't bleed into the texels along the
+// chart borders. While the full atlas takes its first samples the preview is blended in as
+// if it were blend_samples of the texel's samples, fading out as the texel's own accumulate
+
+RWStructuredBuffer<float2> accum_buffer : register(u0);
+RWTexture2D<float4> ao_output : register(u1);
+// One bit per texel of the atlas and of the preview, set if the texel is covered by a chart
+RWByteAddressBuffer coverage : register(u2);
+RWStructuredBuffer<float2> preview_accum : register(u3);
+RWByteAddressBuffer preview_coverage : register(u4);
+
+cbuffer PreviewInfo : register(b0) {
+    uint2 dimensions;
+    uint2 preview_dimensions;
+    // The samples the preview counts as against the texel's own, 0 to write the preview alone
+    uint blend_samples;
+}
+
+bool texel_covered(RWByteAddressBuffer mask, uint width, uint2 texel)
+{
+    const uint pixel_id = texel.y * width + texel.x;
+    return (mask.Load((pixel_id / 32) * 4) & (1u << (pixel_id % 32))) != 0;
+}
+
+float preview_ao(int2 texel)
+{
+    const float2 accum = preview_accum[texel.y * preview_dimensions.x + texel.x];
+    return accum.x / max(accum.y, 1.f);
+}
+
+[numthreads(8, 8, 1)]
+void upsample_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    const uint2 texel = thread_id.xy;
+    if (any(texel >= dimensions) || !texel_covered(coverage, dimensions.x, texel)) {
+        return;
+    }
+
+    // Bilinearly filter the covered preview texels around the texel's center
+    const float2 p =
+        (float2(texel) + 0.5f) * float2(preview_dimensions) / float2(dimensions) - 0.5f;
+    const int2 base = int2(floor(p));
+    const float2 f = p - float2(base);
+    const int2 upper = int2(preview_dimensions) - 1;
+    float ao = 0.f;
+    float weight = 0.f;
+    for (int y = 0; y < 2; ++y) {
+        for (int x = 0; x < 2; ++x) {
+            const int2 q = clamp(base + int2(x, y), int2(0, 0), upper);
+            if (!texel_covered(preview_coverage, preview_dimensions.x, uint2(q))) {
+                continue;
+            }
+            const float w = (x == 0 ? 1.f - f.x : f.x) * (y == 0 ? 1.f - f.y : f.y);
+            ao += w * preview_ao(q);
+            weight += w;
+        }
+    }
+    if (weight > 0.f) {
+        ao /= weight;
+    } else {
+        // Thin parts of the charts can fall between the preview's texels, these take the
+        // nearest covered preview texel around them instead
+        float best_dist = 1e20f;
+        const int2 center = clamp(int2(round(p)), int2(0, 0), upper);
+        for (int y = -1; y <= 1; ++y) {
+            for (int x = -1; x <= 1; ++x) {
+                const int2 q = center + int2(x, y);
+                if (any(q < 0) || any(q > upper) ||
+                    !texel_covered(preview_coverage, preview_dimensions.x, uint2(q))) {
+                    continue;
+                }
+                const float2 d = float2(q) - p;
+                if (dot(d, d) < best_dist) {
+                    best_dist = dot(d, d);
+                    ao = preview_ao(q);
+                    weight = 1.f;
+                }
+            }
+        }
+    }
+    if (weight == 0.f) {
+        return;
+    }
+
+    if (blend_samples != 0) {
+        const float2 accum = accum_buffer[texel.y * dimensions.x + texel.x];
+        const float w = max(float(blend_samples) - accum.y, 0.f);
+        ao = (accum.x + w * ao) / max(accum.y + w, 1.f);
+    }
+    ao_output[texel] = ao;
+}
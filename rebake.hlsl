@@ -0,0 +1,64 @@
+#include "texel_data.hlsl"
+
+// Marks the texels to re-bake after instances in the scene are moved. A texel is re-baked
+// if it lies within any of the dirty bounds, which cover the edited instances before and
+// after the edit expanded by the AO length. Its accumulated samples are reset so the bake
+// traces it again, and the bake tile containing it is flagged so only the dirty tiles of
+// the atlas need to be rasterized
+
+StructuredBuffer<TexelData> texels : register(t0);
+// The lower and upper corner of each of the dirty bounds
+StructuredBuffer<float3> dirty_bounds : register(t1);
+
+RWStructuredBuffer<float2> accum_buffer : register(u0);
+// Only bound if has_extras is set
+RWStructuredBuffer<float4> extras_accum : register(u1);
+// One bit per bake tile, set if any texel in the tile is re-baked
+RWByteAddressBuffer tile_flags : register(u2);
+RWByteAddressBuffer dirty_texel_count : register(u3);
+// Only bound if has_light is set
+RWStructuredBuffer<float4> light_accum : register(u4);
+
+cbuffer RebakeInfo : register(b0) {
+    // The range of the texel list to process in this dispatch
+    uint texel_offset;
+    uint num_texels;
+    uint num_bounds;
+    uint atlas_width;
+    uint tile_size;
+    uint tiles_x;
+    uint has_extras;
+    uint has_light;
+}
+
+[numthreads(64, 1, 1)]
+void mark_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    if (thread_id.x >= num_texels) {
+        return;
+    }
+    const TexelData t = texels[texel_offset + thread_id.x];
+    bool dirty = false;
+    for (uint i = 0; i < num_bounds && !dirty; ++i) {
+        dirty = all(t.position >= dirty_bounds[2 * i]) &&
+                all(t.position <= dirty_bounds[2 * i + 1]);
+    }
+    if (!dirty) {
+        return;
+    }
+
+    const uint2 texel = texel_coords(t);
+    const uint pixel_id = texel.y * atlas_width + texel.x;
+    accum_buffer[pixel_id] = float2(0.f, 0.f);
+    if (has_extras != 0) {
+        extras_accum[pixel_id] = float4(0.f, 0.f, 0.f, 0.f);
+    }
+    if (has_light != 0) {
+        light_accum[pixel_id] = float4(0.f, 0.f, 0.f, 0.f);
+    }
+
+    const uint2 tile = texel / tile_size;
+    const uint tile_id = tile.y * tiles_x + tile.x;
+    tile_flags.InterlockedOr((tile_id / 32) * 4, 1u << (tile_id % 32));
+    dirty_texel_count.InterlockedAdd(0, 1);
+}
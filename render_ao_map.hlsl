@@ -1,9 +1,39 @@
 #include "util.hlsl"
-#include "lcg_rng.hlsl"
+#include "sampler.hlsl"
+#include "trace_ao.hlsl"
+#include "direct_light.hlsl"
+#include "atlas_draw.hlsl"
 
+/* The bake permutations built in CMakeLists.txt replace the runtime settings with
+ * constants: BAKE_BATCH_SAMPLES traces a fixed batch of samples each frame, BAKE_SAMPLER
+ * fixes the SAMPLER_* sample generator and BAKE_EXTRAS selects whether the extra outputs
+ * are accumulated. The defaults read all of them from the AtlasInfo constants. The direct
+ * lighting is always selected at runtime
+ */
+#ifndef BAKE_BATCH_SAMPLES
+#define BAKE_BATCH_SAMPLES 0
+#endif
+#ifndef BAKE_SAMPLER
+#define BAKE_SAMPLER -1
+#endif
+#ifndef BAKE_EXTRAS
+#define BAKE_EXTRAS -1
+#endif
+
+/* bindless_vsmain fetches the draw's vertices from the geometry heap instead of the input
+ * assembler, so each indirect draw only sets its index buffer and draw ID. It's built for
+ * SM 6.6 with DIRECT_HEAP_INDEXING set, indexing ResourceDescriptorHeap, and for SM 6.5
+ * reading the same heap through the unbounded geometry_buffers table
+ */
+#ifndef DIRECT_HEAP_INDEXING
+#define DIRECT_HEAP_INDEXING 0
+#endif
+
+// The positions are floats or quantized SNORM values mapped back to object space by the
+// draw's dequantization, the normals are octahedral encoded
 struct VSInput {
     float3 position: POSITION0;
-    float3 normal: NORMAL0;
+    float2 normal: NORMAL0;
     float2 uv: TEXCOORD0;
 };
 
@@ -13,59 +43,229 @@ struct FSInput {
     float3 normal: NORMAL0;
 };
 
+// The transform and atlas region of each instance, matches BakeInstance in ao_bake.h
+struct BakeInstance {
+    float4x4 transform;
+    float4x4 normal_transform;
+    float2 uv_offset;
+    float2 uv_scale;
+};
+
 RaytracingAccelerationStructure scene : register(t0);
+StructuredBuffer<float2> blue_noise : register(t2);
+StructuredBuffer<BakeInstance> instances : register(t4);
+StructuredBuffer<AtlasDraw> draws : register(t5);
+// The scene's quad lights, only bound if the direct lighting is baked
+StructuredBuffer<QuadLight> lights : register(t6);
+
+// The positions, normals and UVs of each geometry pool, indexed by the draw's
+// geometry_buffers. Only bound if the heap isn't indexed directly
+#if DIRECT_HEAP_INDEXING
+#define GEOMETRY_BUFFER(i) ResourceDescriptorHeap[i]
+#else
+ByteAddressBuffer geometry_buffers[] : register(t0, space2);
+#define GEOMETRY_BUFFER(i) geometry_buffers[i]
+#endif
+
+// Running sum of the unoccluded samples (x) and total samples (y) taken for each texel
+RWStructuredBuffer<float2> accum_buffer : register(u0);
+// Running sum of the unoccluded directions (xyz) and hit distances (w) for each texel, only
+// bound if bake_outputs is set
+RWStructuredBuffer<float4> extras_accum : register(u5);
+// Running sum of the direct lighting irradiance estimates (rgb) for each texel, only bound
+// if bake_outputs has BAKE_OUTPUT_DIRECT_LIGHT
+RWStructuredBuffer<float4> light_accum : register(u6);
+// The RAY_STATS_* counters, reset before each bake frame
+RWByteAddressBuffer ray_stats : register(u7);
 
 cbuffer AtlasInfo : register(b0) {
     int2 dimensions; 
     int n_samples;
     float ao_length;
+    // The accumulation is reset when frame_id is 0
+    uint frame_id;
+    int samples_per_frame;
+    // The SAMPLER_* sample generator to use and the seed to decorrelate separate bakes
+    uint sampler_type;
+    uint sampler_seed;
+    // The BAKE_OUTPUT_* maps to accumulate into extras_accum and light_accum along with
+    // the AO
+    uint bake_outputs;
+    // The AO rays trace the full-res geometry within near_field_radius and the occluder
+    // proxies beyond it, 0 if the scene has no proxies
+    float near_field_radius;
 }
 
-FSInput vsmain(VSInput input)
+// The atlas draw being drawn, set by the indirect draw arguments
+cbuffer DrawInfo : register(b2) {
+    uint draw_id;
+}
+
+// The number of quad lights in lights. Kept out of AtlasInfo, which the compute bakes share
+cbuffer LightInfo : register(b3) {
+    uint num_lights;
+}
+
+FSInput transform_vertex(AtlasDraw draw, VSInput input, uint instance_id)
 {
+    // SV_InstanceID doesn't include the start instance, so it's offset by the draw's
+    const BakeInstance inst = instances[draw.first_instance + instance_id];
+    const float2 uv = input.uv * inst.uv_scale + inst.uv_offset;
+    const float3 position = input.position * draw.position_scale + draw.position_offset;
+
     FSInput result;
-    result.uv_position = float4(input.uv.x * 2.f - 1.f, input.uv.y * 2.f - 1.f, 0.f, 1.f);
-    result.world_position = input.position;
-    result.normal = input.normal;
+    result.uv_position = float4(uv.x * 2.f - 1.f, uv.y * 2.f - 1.f, 0.f, 1.f);
+    result.world_position = mul(inst.transform, float4(position, 1.f)).xyz;
+    result.normal =
+        mul(inst.normal_transform, float4(octahedral_decode(input.normal), 0.f)).xyz;
 
     return result;
 }
 
-float4 fsmain(FSInput input) : SV_TARGET0
+FSInput vsmain(VSInput input, uint instance_id : SV_InstanceID)
+{
+    return transform_vertex(draws[draw_id], input, instance_id);
+}
+
+// Decode the low (x) and high (y) 16-bit SNORM values of each word
+float2 snorm16x2_decode(uint v)
 {
-    float3 v_z = normalize(input.normal);
-    float3 v_x, v_y;
-    ortho_basis(v_x, v_y, v_z);
+    const int2 i = int2(int(v << 16) >> 16, int(v) >> 16);
+    return max(float2(i) / 32767.f, -1.f);
+}
 
-    int pixel_id = (input.uv_position.x + input.uv_position.y * dimensions.y) * dimensions.x;
-    LCGRand rng = get_rng(pixel_id, 0);
+// SV_VertexID includes the draw's base vertex, so it indexes the pool's vertices directly
+FSInput bindless_vsmain(uint vertex_id : SV_VertexID, uint instance_id : SV_InstanceID)
+{
+    const AtlasDraw draw = draws[draw_id];
+    ByteAddressBuffer positions = GEOMETRY_BUFFER(draw.geometry_buffers);
+    ByteAddressBuffer normals = GEOMETRY_BUFFER(draw.geometry_buffers + 1);
+    ByteAddressBuffer uvs = GEOMETRY_BUFFER(draw.geometry_buffers + 2);
 
-    RayQuery<RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH
-             | RAY_FLAG_CULL_NON_OPAQUE 
-             | RAY_FLAG_SKIP_PROCEDURAL_PRIMITIVES> query;
-    RayDesc ray;
-    ray.Origin = input.world_position;
-    ray.TMin = 0.001f;
-    ray.TMax = ao_length;
+    VSInput input;
+    if (draw.position_stride == 8) {
+        const uint2 p = positions.Load2(vertex_id * 8);
+        input.position = float3(snorm16x2_decode(p.x), snorm16x2_decode(p.y).x);
+    } else {
+        input.position = asfloat(positions.Load3(vertex_id * draw.position_stride));
+    }
+    input.normal = snorm16x2_decode(normals.Load(vertex_id * 4));
+    input.uv = asfloat(uvs.Load2(vertex_id * 8));
+    return transform_vertex(draw, input, instance_id);
+}
 
-    float n_occluded = 0;
-    for (int i = 0; i < n_samples; ++i) {
-        const float theta = sqrt(lcg_randomf(rng));
-        const float phi = 2.f * M_PI * lcg_randomf(rng);
+float4 fsmain(FSInput input) : SV_TARGET0
+{
+    const uint2 texel = uint2(input.uv_position.xy);
+    const uint pixel_id = texel.y * dimensions.x + texel.x;
 
-        const float x = cos(phi) * theta;
-        const float y = sin(phi) * theta;
-        const float z = sqrt(1.f - theta * theta);
+    float2 accum = frame_id == 0 ? float2(0.f, 0.f) : accum_buffer[pixel_id];
+    // Stop tracing once the texel has taken all n_samples
+#if BAKE_BATCH_SAMPLES > 0
+    // The permutation is only used if n_samples is a multiple of the batch and each frame
+    // takes one batch, so texels take full batches until they're done
+    const int batch_samples = int(accum.y) < n_samples ? BAKE_BATCH_SAMPLES : 0;
+#else
+    const int batch_samples = min(samples_per_frame, max(n_samples - int(accum.y), 0));
+#endif
 
-        ray.Direction = normalize(x * v_x + y * v_y + z * v_z);
+#if BAKE_SAMPLER >= 0
+    const uint bake_sampler = BAKE_SAMPLER;
+#else
+    const uint bake_sampler = sampler_type;
+#endif
+#if BAKE_EXTRAS >= 0
+    const bool bake_extras = BAKE_EXTRAS != 0;
+#else
+    const bool bake_extras = (bake_outputs & BAKE_OUTPUT_AO_EXTRAS) != 0;
+#endif
 
-        query.TraceRayInline(scene, 0, 0xff, ray);
-        query.Proceed();
+    SampleGenerator sg = make_sample_generator(bake_sampler,
+                                               pixel_id,
+                                               uint(accum.y),
+                                               frame_id,
+                                               sampler_seed,
+                                               blue_noise_value(blue_noise, texel));
+    float n_occluded = 0.f;
+    if (bake_extras) {
+        float4 extras = float4(0.f, 0.f, 0.f, 0.f);
+#if BAKE_BATCH_SAMPLES > 0
+        if (batch_samples > 0) {
+            n_occluded = trace_ao_rays_extras(scene,
+                                              input.world_position,
+                                              input.normal,
+                                              ao_length,
+                                              near_field_radius,
+                                              BAKE_BATCH_SAMPLES,
+                                              bake_outputs,
+                                              sg,
+                                              extras);
+        }
+#else
+        n_occluded = trace_ao_rays_extras(scene,
+                                          input.world_position,
+                                          input.normal,
+                                          ao_length,
+                                          near_field_radius,
+                                          batch_samples,
+                                          bake_outputs,
+                                          sg,
+                                          extras);
+#endif
+        if (frame_id != 0) {
+            extras += extras_accum[pixel_id];
+        }
+        extras_accum[pixel_id] = extras;
+    } else {
+#if BAKE_BATCH_SAMPLES > 0
+        if (batch_samples > 0) {
+            n_occluded = trace_ao_rays(scene,
+                                       input.world_position,
+                                       input.normal,
+                                       ao_length,
+                                       near_field_radius,
+                                       BAKE_BATCH_SAMPLES,
+                                       sg);
+        }
+#else
+        n_occluded = trace_ao_rays(scene,
+                                   input.world_position,
+                                   input.normal,
+                                   ao_length,
+                                   near_field_radius,
+                                   batch_samples,
+                                   sg);
+#endif
+    }
 
-        if (query.CommittedStatus() == COMMITTED_TRIANGLE_HIT) {
-            n_occluded += 1.f;
+    // The direct lighting takes one shadow ray per AO sample, from its own sequence so the
+    // AO rays are the same with or without it
+    if (bake_outputs & BAKE_OUTPUT_DIRECT_LIGHT) {
+        SampleGenerator light_sg = make_sample_generator(SAMPLER_LCG,
+                                                         pixel_id,
+                                                         uint(accum.y),
+                                                         frame_id,
+                                                         hash_combine(sampler_seed, 1),
+                                                         float2(0.f, 0.f));
+        float4 light = float4(sample_direct_light(scene,
+                                                  lights,
+                                                  num_lights,
+                                                  input.world_position,
+                                                  input.normal,
+                                                  near_field_radius,
+                                                  batch_samples,
+                                                  light_sg),
+                              0.f);
+        if (frame_id != 0) {
+            light += light_accum[pixel_id];
         }
+        light_accum[pixel_id] = light;
     }
-    return 1.f - n_occluded / n_samples;
+
+    accum += float2(batch_samples - n_occluded, batch_samples);
+    accum_buffer[pixel_id] = accum;
+    record_ray_stats(ray_stats, batch_samples, uint(n_occluded), batch_samples > 0);
+
+    return accum.x / max(accum.y, 1.f);
 }
 
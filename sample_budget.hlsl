@@ -0,0 +1,69 @@
+#include "util.hlsl"
+#include "texel_data.hlsl"
+
+// Distributes a total ray budget over the texel list. Each texel's share is proportional to
+// its importance: the world space size of the texel, scaled up where the surface curves
+// within it. Texels covering more of the scene, or curved geometry where the AO changes
+// quickly, take more samples than tiny texels on flat surfaces
+
+// Byte offsets of the totals, must match SampleBudgetTotals in main.cpp. The importance
+// sum and total samples are 64-bit, stored as the low then high word
+#define BUDGET_IMPORTANCE_SUM 0
+#define BUDGET_TOTAL_SAMPLES 8
+#define BUDGET_MAX_SAMPLES 16
+
+// Fixed point scale of the importance, a texel spanning the whole scene has importance 1
+#define IMPORTANCE_SCALE 268435456.f
+
+StructuredBuffer<TexelData> texels : register(t0);
+
+// The fixed point importance written by the importance pass, replaced with the sample
+// count of each texel by the assign pass
+RWStructuredBuffer<uint> sample_budget : register(u0);
+RWByteAddressBuffer budget_totals : register(u1);
+
+cbuffer BudgetInfo : register(b0) {
+    // The range of the texel list to process in this dispatch
+    uint texel_offset;
+    uint num_texels;
+    float inv_scene_size;
+    // How much the curvature within a texel increases its importance
+    float curvature_weight;
+    // The total number of samples to distribute over the texels
+    float ray_budget;
+    uint min_samples;
+    uint max_samples;
+    uint pad;
+}
+
+[numthreads(64, 1, 1)]
+void importance_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    if (thread_id.x >= num_texels) {
+        return;
+    }
+    const TexelData t = texels[texel_offset + thread_id.x];
+    const float importance = t.texel_size * inv_scene_size *
+                             (1.f + curvature_weight * min(t.curvature, 2.f));
+    const uint fixed_importance = uint(clamp(importance * IMPORTANCE_SCALE, 1.f, 4.0e9f));
+    sample_budget[texel_offset + thread_id.x] = fixed_importance;
+    interlocked_add64(budget_totals, BUDGET_IMPORTANCE_SUM, fixed_importance);
+}
+
+[numthreads(64, 1, 1)]
+void assign_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    if (thread_id.x >= num_texels) {
+        return;
+    }
+    const uint2 sum_words = budget_totals.Load2(BUDGET_IMPORTANCE_SUM);
+    const float importance_sum = float(sum_words.x) + float(sum_words.y) * 4294967296.f;
+
+    const uint i = texel_offset + thread_id.x;
+    const float share = float(sample_budget[i]) / max(importance_sum, 1.f);
+    const uint samples =
+        uint(clamp(round(ray_budget * share), float(min_samples), float(max_samples)));
+    sample_budget[i] = samples;
+    interlocked_add64(budget_totals, BUDGET_TOTAL_SAMPLES, samples);
+    budget_totals.InterlockedMax(BUDGET_MAX_SAMPLES, samples);
+}
@@ -0,0 +1,113 @@
+#include "util.hlsl"
+#include "sampler.hlsl"
+#include "trace_ao.hlsl"
+#include "texel_data.hlsl"
+#include "texel_bake_resources.hlsl"
+
+// The compute bake path. The atlas is rasterized once to build a compact list of the
+// covered texels with their world space position and normal, the AO bake then runs
+// as a compute shader over just the covered texels
+
+struct FSInput {
+    float4 uv_position: SV_POSITION;
+    float3 world_position: TEXCOORD0;
+    float3 normal: NORMAL0;
+};
+
+// Texel G-buffer pass resources
+
+// One bit per atlas texel, set once the texel has been added to the list
+RWByteAddressBuffer texel_flags : register(u2);
+RWStructuredBuffer<TexelData> texels_out : register(u3);
+RWByteAddressBuffer texel_count : register(u4);
+
+cbuffer GBufferInfo : register(b1) {
+    uint2 gbuffer_dimensions;
+    // If 0 only the covered texels are counted, to size the texel list
+    uint write_texels;
+    uint max_texels;
+}
+
+void gbuffer_fsmain(FSInput input)
+{
+    const uint2 texel = uint2(input.uv_position.xy);
+    const uint pixel_id = texel.y * gbuffer_dimensions.x + texel.x;
+    // The derivatives must be taken before any lanes exit
+    const float texel_size =
+        max(length(ddx(input.world_position)), length(ddy(input.world_position)));
+    const float3 normal = normalize(input.normal);
+    const float curvature = max(length(ddx(normal)), length(ddy(normal)));
+
+    // Texels touched by multiple triangles are only added once, by the first to claim it
+    const uint bit = 1u << (pixel_id % 32);
+    uint prev_flags = 0;
+    texel_flags.InterlockedOr((pixel_id / 32) * 4, bit, prev_flags);
+    if (prev_flags & bit) {
+        return;
+    }
+
+    uint index = 0;
+    texel_count.InterlockedAdd(0, 1, index);
+    if (write_texels == 0 || index >= max_texels) {
+        return;
+    }
+
+    TexelData t;
+    t.position = input.world_position;
+    t.texel = texel.x | (texel.y << 16);
+    t.normal = normal;
+    t.texel_size = texel_size;
+    t.curvature = curvature;
+    texels_out[index] = t;
+}
+
+[numthreads(64, 1, 1)]
+void bake_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    if (thread_id.x >= num_texels) {
+        return;
+    }
+    const TexelData t = texels[texel_offset + thread_id.x];
+    const uint2 texel = texel_coords(t);
+    const uint pixel_id = texel.y * dimensions.x + texel.x;
+
+    float2 accum = frame_id == 0 ? float2(0.f, 0.f) : accum_buffer[pixel_id];
+    // Stop tracing once the texel has taken all its samples
+    const int texel_samples =
+        use_sample_budget != 0 ? int(sample_budget[texel_offset + thread_id.x]) : n_samples;
+    const int batch_samples = min(samples_per_frame, max(texel_samples - int(accum.y), 0));
+
+    SampleGenerator sg = make_sample_generator(sampler_type,
+                                               pixel_id,
+                                               uint(accum.y),
+                                               frame_id,
+                                               sampler_seed,
+                                               blue_noise_value(blue_noise, texel));
+    float n_occluded = 0.f;
+    if (bake_outputs != 0) {
+        float4 extras;
+        n_occluded = trace_ao_rays_extras(scene,
+                                          t.position,
+                                          t.normal,
+                                          ao_length,
+                                          near_field_radius,
+                                          batch_samples,
+                                          bake_outputs,
+                                          sg,
+                                          extras);
+        if (frame_id != 0) {
+            extras += extras_accum[pixel_id];
+        }
+        extras_accum[pixel_id] = extras;
+    } else {
+        n_occluded = trace_ao_rays(
+            scene, t.position, t.normal, ao_length, near_field_radius, batch_samples, sg);
+    }
+
+    accum += float2(batch_samples - n_occluded, batch_samples);
+    accum_buffer[pixel_id] = accum;
+    record_ray_stats(ray_stats, batch_samples, uint(n_occluded), batch_samples > 0);
+
+    ao_output[texel] = accum.x / max(accum.y, 1.f);
+}
+
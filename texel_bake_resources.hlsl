@@ -0,0 +1,45 @@
+#ifndef TEXEL_BAKE_RESOURCES_HLSL
+#define TEXEL_BAKE_RESOURCES_HLSL
+
+#include "texel_data.hlsl"
+
+// The resources of the texel G-buffer bake, shared by the compute shader in texel_bake.hlsl
+// and the ray generation shader in texel_bake_rt.hlsl as both use the same root signature
+
+RaytracingAccelerationStructure scene : register(t0);
+StructuredBuffer<TexelData> texels : register(t1);
+StructuredBuffer<float2> blue_noise : register(t2);
+// The number of samples each texel in the texel list takes, only bound if use_sample_budget
+// is set. Otherwise every texel takes n_samples
+StructuredBuffer<uint> sample_budget : register(t3);
+
+RWStructuredBuffer<float2> accum_buffer : register(u0);
+// Running sum of the unoccluded directions (xyz) and hit distances (w) for each texel, only
+// bound if bake_outputs is set
+RWStructuredBuffer<float4> extras_accum : register(u5);
+// The RAY_STATS_* counters, reset before each bake frame
+RWByteAddressBuffer ray_stats : register(u7);
+RWTexture2D<float4> ao_output : register(u1);
+
+cbuffer AtlasInfo : register(b0) {
+    int2 dimensions; 
+    int n_samples;
+    float ao_length;
+    // The accumulation is reset when frame_id is 0
+    uint frame_id;
+    int samples_per_frame;
+    // The SAMPLER_* sample generator to use and the seed to decorrelate separate bakes
+    uint sampler_type;
+    uint sampler_seed;
+    // The BAKE_OUTPUT_* maps to accumulate into extras_accum along with the AO
+    uint bake_outputs;
+    // The AO rays trace the full-res geometry within near_field_radius and the occluder
+    // proxies beyond it, 0 if the scene has no proxies
+    float near_field_radius;
+    // The range of the texel list to bake in this dispatch
+    uint texel_offset;
+    uint num_texels;
+    uint use_sample_budget;
+}
+
+#endif
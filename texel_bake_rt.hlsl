@@ -0,0 +1,171 @@
+#include "util.hlsl"
+#include "sampler.hlsl"
+#include "trace_ao.hlsl"
+#include "texel_data.hlsl"
+#include "texel_bake_resources.hlsl"
+
+// The DXR 1.0 bake path. It bakes the same texel G-buffer as bake_csmain, but launches a ray
+// generation shader for each texel with DispatchRays and traces the AO rays with TraceRay,
+// leaving the scheduling of the rays to the driver. The occlusion rays accept the first hit
+// and skip the closest hit shader, so they only run the miss shader. The closest hit shader
+// is only run by the hit distance rays, which need the closest hit. The any hit shader is
+// only run on alpha tested geometry
+
+struct AOPayload {
+    // The distance to the closest hit, or the ray's TMax if it missed. Rays skipping the
+    // closest hit shader leave it at 0 if they hit
+    float hit_t;
+};
+
+// Trace the segment [t_min, t_max] of the AO ray against the instances in the mask and
+// return the hit distance, or t_max if it's unoccluded. The distance is only exact if
+// closest_hit is set, otherwise it's 0 on a hit
+float trace_ao_segment_dispatch(float3 position,
+                                float3 direction,
+                                float t_min,
+                                float t_max,
+                                uint mask,
+                                bool closest_hit)
+{
+    RayDesc ray;
+    ray.Origin = position;
+    ray.Direction = direction;
+    ray.TMin = t_min;
+    ray.TMax = t_max;
+
+    AOPayload payload;
+    payload.hit_t = 0.f;
+    // All geometry shares the single hit group, as the geometry multiplier is 0 and the
+    // instances don't offset into the hit group table
+    if (closest_hit) {
+        TraceRay(scene,
+                 RAY_FLAG_SKIP_PROCEDURAL_PRIMITIVES,
+                 mask,
+                 0,
+                 0,
+                 0,
+                 ray,
+                 payload);
+    } else {
+        TraceRay(scene,
+                 RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH | RAY_FLAG_SKIP_CLOSEST_HIT_SHADER
+                     | RAY_FLAG_SKIP_PROCEDURAL_PRIMITIVES,
+                 mask,
+                 0,
+                 0,
+                 0,
+                 ray,
+                 payload);
+    }
+    return payload.hit_t;
+}
+
+/* Trace a single AO ray split into the near and far field like trace_ao_ray and return the
+ * hit distance within ao_length, or ao_length if it's unoccluded. The distance is only
+ * exact if closest_hit is set, otherwise it's 0 on a hit
+ */
+float trace_ao_ray_dispatch(float3 position, float3 direction, bool closest_hit)
+{
+    const float near_t = min(max(near_field_radius, 0.001f), ao_length);
+    if (near_t > 0.001f) {
+        const float t = trace_ao_segment_dispatch(
+            position, direction, 0.001f, near_t, OCCLUDER_MASK_NEAR, closest_hit);
+        if (t < near_t) {
+            return t;
+        }
+    }
+    if (near_t < ao_length) {
+        return trace_ao_segment_dispatch(
+            position, direction, near_t, ao_length, OCCLUDER_MASK_FAR, closest_hit);
+    }
+    return ao_length;
+}
+
+/* Trace the same AO rays as trace_ao_rays_extras and return the number occluded. The
+ * extras are only summed if bake_outputs is set, and the rays only find the closest hit if
+ * the hit distance is baked
+ */
+float trace_ao_rays_dispatch(float3 position,
+                             float3 normal,
+                             int n_samples,
+                             inout SampleGenerator sg,
+                             out float4 extras)
+{
+    float3 v_z = normalize(normal);
+    float3 v_x, v_y;
+    ortho_basis(v_x, v_y, v_z);
+
+    const bool closest_hit = (bake_outputs & BAKE_OUTPUT_HIT_DISTANCE) != 0;
+    extras = float4(0.f, 0.f, 0.f, 0.f);
+    float n_occluded = 0;
+    for (int i = 0; i < n_samples; ++i) {
+        const float3 dir = sample_ao_direction(v_x, v_y, v_z, next_sample2d(sg));
+        const float t = trace_ao_ray_dispatch(position, dir, closest_hit);
+        extras.w += t;
+        if (t < ao_length) {
+            n_occluded += 1.f;
+        } else {
+            extras.xyz += dir;
+        }
+    }
+    return n_occluded;
+}
+
+// Launched with one ray per texel in the range of the texel list being baked
+[shader("raygeneration")]
+void bake_raygen()
+{
+    const uint i = texel_offset + DispatchRaysIndex().x;
+    const TexelData t = texels[i];
+    const uint2 texel = texel_coords(t);
+    const uint pixel_id = texel.y * dimensions.x + texel.x;
+
+    float2 accum = frame_id == 0 ? float2(0.f, 0.f) : accum_buffer[pixel_id];
+    // Stop tracing once the texel has taken all its samples
+    const int texel_samples = use_sample_budget != 0 ? int(sample_budget[i]) : n_samples;
+    const int batch_samples = min(samples_per_frame, max(texel_samples - int(accum.y), 0));
+
+    SampleGenerator sg = make_sample_generator(sampler_type,
+                                               pixel_id,
+                                               uint(accum.y),
+                                               frame_id,
+                                               sampler_seed,
+                                               blue_noise_value(blue_noise, texel));
+    float4 extras;
+    const float n_occluded =
+        trace_ao_rays_dispatch(t.position, t.normal, batch_samples, sg, extras);
+    if (bake_outputs != 0) {
+        if (frame_id != 0) {
+            extras += extras_accum[pixel_id];
+        }
+        extras_accum[pixel_id] = extras;
+    }
+
+    accum += float2(batch_samples - n_occluded, batch_samples);
+    accum_buffer[pixel_id] = accum;
+    record_ray_stats(ray_stats, batch_samples, uint(n_occluded), batch_samples > 0);
+
+    ao_output[texel] = accum.x / max(accum.y, 1.f);
+}
+
+[shader("miss")]
+void ao_miss(inout AOPayload payload)
+{
+    // In the miss shader the current T is the ray's TMax
+    payload.hit_t = RayTCurrent();
+}
+
+[shader("closesthit")]
+void ao_closest_hit(inout AOPayload payload, BuiltInTriangleIntersectionAttributes attrib)
+{
+    payload.hit_t = RayTCurrent();
+}
+
+[shader("anyhit")]
+void ao_any_hit(inout AOPayload payload, BuiltInTriangleIntersectionAttributes attrib)
+{
+    if (!alpha_test_hit(
+            InstanceID() + GeometryIndex(), PrimitiveIndex(), attrib.barycentrics)) {
+        IgnoreHit();
+    }
+}
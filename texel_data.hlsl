@@ -0,0 +1,21 @@
+#ifndef TEXEL_DATA_HLSL
+#define TEXEL_DATA_HLSL
+
+// A covered texel in the texel G-buffer
+struct TexelData {
+    float3 position;
+    // The texel x coordinate in the low 16 bits, y in the high 16 bits
+    uint texel;
+    float3 normal;
+    // Approximate world space size of the texel
+    float texel_size;
+    // Approximate change in the normal across the texel, in radians
+    float curvature;
+};
+
+uint2 texel_coords(TexelData t)
+{
+    return uint2(t.texel & 0xffff, t.texel >> 16);
+}
+
+#endif
@@ -0,0 +1,286 @@
+#ifndef TRACE_AO_HLSL
+#define TRACE_AO_HLSL
+
+#include "util.hlsl"
+#include "sampler.hlsl"
+
+// The extra maps the bake can accumulate along with the AO, must match BakeOutput in
+// ao_bake.h. The bent normal and hit distance are summed from the AO rays into the extras
+#define BAKE_OUTPUT_BENT_NORMAL 1
+#define BAKE_OUTPUT_HIT_DISTANCE 2
+#define BAKE_OUTPUT_DIRECT_LIGHT 4
+#define BAKE_OUTPUT_AO_EXTRAS (BAKE_OUTPUT_BENT_NORMAL | BAKE_OUTPUT_HIT_DISTANCE)
+
+// Byte offsets of the ray statistics counters, must match RayStatsCounters in ao_bake.h. The
+// ray and hit counts are 64-bit, stored as the low then high word
+#define RAY_STATS_RAYS 0
+#define RAY_STATS_HITS 8
+#define RAY_STATS_ACTIVE_TEXELS 16
+
+// Shaders specialized for scenes without alpha tested geometry set ALPHA_TEST to 0, making
+// the ray queries treat all geometry as opaque so the candidate loops compile away
+#ifndef ALPHA_TEST
+#define ALPHA_TEST 1
+#endif
+
+#if ALPHA_TEST
+#define AO_QUERY_FLAGS RAY_FLAG_SKIP_PROCEDURAL_PRIMITIVES
+#else
+#define AO_QUERY_FLAGS (RAY_FLAG_SKIP_PROCEDURAL_PRIMITIVES | RAY_FLAG_FORCE_OPAQUE)
+#endif
+
+// Shaders specialized for a fixed batch of samples set BAKE_BATCH_SAMPLES, unrolling the
+// sample loops they call with that constant count
+#if defined(BAKE_BATCH_SAMPLES) && BAKE_BATCH_SAMPLES > 0
+#define AO_SAMPLE_LOOP [unroll]
+#else
+#define AO_SAMPLE_LOOP
+#endif
+
+/* The alpha test data of the scene's alpha tested geometry, see upload_alpha_test in
+ * ao_bake.h. It starts with an AlphaTestGeometry of 4 words for each geometry of the meshes
+ * with alpha tested geometry, indexed by the instance ID plus the geometry index: the byte
+ * offsets of the geometry's triangle uvs and its mask texels, the mask width and height in
+ * the low and high 16 bits, and the cutoff. The uvs are 3 float2 per triangle and the masks
+ * are 8-bit, packed 4 texels to a word. Only bound if the scene has alpha tested geometry
+ */
+ByteAddressBuffer alpha_test : register(t0, space1);
+
+/* Test the alpha cutout of a candidate hit on an alpha tested triangle, returning true if
+ * the hit is on the opaque part. The mask is sampled at the nearest texel, with wrapping
+ */
+bool alpha_test_hit(uint alpha_geometry, uint primitive, float2 barycentrics)
+{
+    const uint4 geom = alpha_test.Load4(alpha_geometry * 16);
+    const uint uv_offset = geom.x + primitive * 24;
+    const float2 uv0 = asfloat(alpha_test.Load2(uv_offset));
+    const float2 uv1 = asfloat(alpha_test.Load2(uv_offset + 8));
+    const float2 uv2 = asfloat(alpha_test.Load2(uv_offset + 16));
+    const float2 uv = uv0 * (1.f - barycentrics.x - barycentrics.y) + uv1 * barycentrics.x
+                      + uv2 * barycentrics.y;
+
+    const uint2 dims = uint2(geom.z & 0xffff, geom.z >> 16);
+    const uint2 texel = min(uint2(frac(uv) * dims), dims - 1);
+    const uint byte_offset = geom.y + texel.y * dims.x + texel.x;
+    const uint alpha = (alpha_test.Load(byte_offset & ~3) >> ((byte_offset & 3) * 8)) & 0xff;
+    return float(alpha) >= asfloat(geom.w) * 255.f;
+}
+
+// Map the 2D sample u to a cosine distributed direction about v_z in the basis v_x, v_y, v_z
+float3 sample_ao_direction(float3 v_x, float3 v_y, float3 v_z, float2 u)
+{
+    const float theta = sqrt(u.x);
+    const float phi = 2.f * M_PI * u.y;
+
+    const float x = cos(phi) * theta;
+    const float y = sin(phi) * theta;
+    const float z = sqrt(1.f - theta * theta);
+
+    return normalize(x * v_x + y * v_y + z * v_z);
+}
+
+/* The instance masks splitting the geometry between the near and far field rays, must match
+ * OccluderMask in ao_bake.h. Meshes with an occluder proxy are only traced by the near field
+ * rays at full resolution and by the far field rays through their proxy, the others are in
+ * both fields
+ */
+#define OCCLUDER_MASK_NEAR 1
+#define OCCLUDER_MASK_FAR 2
+
+// Trace the segment [t_min, t_max] of the AO ray against the instances in the mask and
+// return true if it's occluded
+bool trace_ao_segment(RaytracingAccelerationStructure scene,
+                      float3 position,
+                      float3 direction,
+                      float t_min,
+                      float t_max,
+                      uint mask)
+{
+    RayQuery<RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH | AO_QUERY_FLAGS> query;
+    RayDesc ray;
+    ray.Origin = position;
+    ray.Direction = direction;
+    ray.TMin = t_min;
+    ray.TMax = t_max;
+
+    query.TraceRayInline(scene, 0, mask, ray);
+    // Opaque hits end the search themselves, only alpha tested candidates are returned
+#if ALPHA_TEST
+    while (query.Proceed()) {
+        if (alpha_test_hit(query.CandidateInstanceID() + query.CandidateGeometryIndex(),
+                           query.CandidatePrimitiveIndex(),
+                           query.CandidateTriangleBarycentrics())) {
+            query.CommitNonOpaqueTriangleHit();
+        }
+    }
+#else
+    query.Proceed();
+#endif
+
+    return query.CommittedStatus() == COMMITTED_TRIANGLE_HIT;
+}
+
+/* Trace a single AO ray and return true if it's occluded within ao_length. The ray is
+ * traced against the full-res geometry up to near_field_radius and the occluder proxies
+ * beyond it, if the radius is 0 the whole ray is traced in the far field
+ */
+bool trace_ao_ray(RaytracingAccelerationStructure scene,
+                  float3 position,
+                  float3 direction,
+                  float ao_length,
+                  float near_field_radius)
+{
+    const float near_t = min(max(near_field_radius, 0.001f), ao_length);
+    if (near_t > 0.001f
+        && trace_ao_segment(scene, position, direction, 0.001f, near_t, OCCLUDER_MASK_NEAR)) {
+        return true;
+    }
+    return near_t < ao_length
+           && trace_ao_segment(
+               scene, position, direction, near_t, ao_length, OCCLUDER_MASK_FAR);
+}
+
+// Trace n_samples cosine distributed AO rays about the normal and return the number
+// of rays which were occluded within ao_length
+float trace_ao_rays(RaytracingAccelerationStructure scene,
+                    float3 position,
+                    float3 normal,
+                    float ao_length,
+                    float near_field_radius,
+                    int n_samples,
+                    inout SampleGenerator sg)
+{
+    float3 v_z = normalize(normal);
+    float3 v_x, v_y;
+    ortho_basis(v_x, v_y, v_z);
+
+    float n_occluded = 0;
+    AO_SAMPLE_LOOP
+    for (int i = 0; i < n_samples; ++i) {
+        const float3 dir = sample_ao_direction(v_x, v_y, v_z, next_sample2d(sg));
+        if (trace_ao_ray(scene, position, dir, ao_length, near_field_radius)) {
+            n_occluded += 1.f;
+        }
+    }
+    return n_occluded;
+}
+
+// Trace the segment [t_min, t_max] of the AO ray against the instances in the mask and
+// return the distance to the closest hit, or t_max if it's unoccluded
+float trace_ao_segment_distance(RaytracingAccelerationStructure scene,
+                                float3 position,
+                                float3 direction,
+                                float t_min,
+                                float t_max,
+                                uint mask)
+{
+    RayQuery<AO_QUERY_FLAGS> query;
+    RayDesc ray;
+    ray.Origin = position;
+    ray.Direction = direction;
+    ray.TMin = t_min;
+    ray.TMax = t_max;
+
+    query.TraceRayInline(scene, 0, mask, ray);
+    // The traversal commits the opaque hits itself, only alpha tested candidates closer
+    // than the committed hit are returned
+#if ALPHA_TEST
+    while (query.Proceed()) {
+        if (alpha_test_hit(query.CandidateInstanceID() + query.CandidateGeometryIndex(),
+                           query.CandidatePrimitiveIndex(),
+                           query.CandidateTriangleBarycentrics())) {
+            query.CommitNonOpaqueTriangleHit();
+        }
+    }
+#else
+    query.Proceed();
+#endif
+
+    if (query.CommittedStatus() == COMMITTED_TRIANGLE_HIT) {
+        return query.CommittedRayT();
+    }
+    return t_max;
+}
+
+// Trace a single AO ray split into the near and far field like trace_ao_ray and return the
+// distance to the closest hit within ao_length, or ao_length if it's unoccluded
+float trace_ao_ray_distance(RaytracingAccelerationStructure scene,
+                            float3 position,
+                            float3 direction,
+                            float ao_length,
+                            float near_field_radius)
+{
+    const float near_t = min(max(near_field_radius, 0.001f), ao_length);
+    if (near_t > 0.001f) {
+        const float t = trace_ao_segment_distance(
+            scene, position, direction, 0.001f, near_t, OCCLUDER_MASK_NEAR);
+        if (t < near_t) {
+            return t;
+        }
+    }
+    if (near_t < ao_length) {
+        return trace_ao_segment_distance(
+            scene, position, direction, near_t, ao_length, OCCLUDER_MASK_FAR);
+    }
+    return ao_length;
+}
+
+/* Trace the same AO rays as trace_ao_rays and return the number occluded, also summing
+ * the extra outputs set in bake_outputs into extras: the unoccluded directions in xyz for
+ * the bent normal and the hit distances in w, with unoccluded rays counting as ao_length.
+ * The hit distance needs the closest hit, so those rays can't stop at the first hit found
+ */
+float trace_ao_rays_extras(RaytracingAccelerationStructure scene,
+                           float3 position,
+                           float3 normal,
+                           float ao_length,
+                           float near_field_radius,
+                           int n_samples,
+                           uint bake_outputs,
+                           inout SampleGenerator sg,
+                           out float4 extras)
+{
+    float3 v_z = normalize(normal);
+    float3 v_x, v_y;
+    ortho_basis(v_x, v_y, v_z);
+
+    extras = float4(0.f, 0.f, 0.f, 0.f);
+    float n_occluded = 0;
+    AO_SAMPLE_LOOP
+    for (int i = 0; i < n_samples; ++i) {
+        const float3 dir = sample_ao_direction(v_x, v_y, v_z, next_sample2d(sg));
+        bool occluded = false;
+        if (bake_outputs & BAKE_OUTPUT_HIT_DISTANCE) {
+            const float t =
+                trace_ao_ray_distance(scene, position, dir, ao_length, near_field_radius);
+            occluded = t < ao_length;
+            extras.w += t;
+        } else {
+            occluded = trace_ao_ray(scene, position, dir, ao_length, near_field_radius);
+        }
+        if (occluded) {
+            n_occluded += 1.f;
+        } else {
+            extras.xyz += dir;
+        }
+    }
+    return n_occluded;
+}
+
+/* Add the lane's rays traced, hits and if it's a texel that traced rays to the ray
+ * statistics. The counts are summed over the wave first, so only one lane per wave
+ * updates the counters
+ */
+void record_ray_stats(RWByteAddressBuffer ray_stats, uint n_rays, uint n_hits, bool active)
+{
+    const uint wave_rays = WaveActiveSum(n_rays);
+    const uint wave_hits = WaveActiveSum(n_hits);
+    const uint wave_active = WaveActiveCountBits(active);
+    if (WaveIsFirstLane()) {
+        interlocked_add64(ray_stats, RAY_STATS_RAYS, wave_rays);
+        interlocked_add64(ray_stats, RAY_STATS_HITS, wave_hits);
+        ray_stats.InterlockedAdd(RAY_STATS_ACTIVE_TEXELS, wave_active);
+    }
+}
+
+#endif
@@ -0,0 +1,210 @@
+#include "alpha_test.h"
+#include <algorithm>
+#include <cmath>
+#include "trace.h"
+
+namespace {
+
+enum TriangleClass { TRIANGLE_OPAQUE, TRIANGLE_TRANSPARENT, TRIANGLE_ALPHA_TESTED };
+
+// Triangles covering more mask texels than this are alpha tested without being classified
+const int64_t max_classified_texels = 1 << 20;
+
+/* Classify the triangle by the min and max of the mask over the texels its uvs cover.
+ * The alpha test samples the nearest texel with wrapping, so the bounds of the uvs padded
+ * by a texel for rounding conservatively cover every texel it can read
+ */
+TriangleClass classify_triangle(const Image &img,
+                                const AlphaMask &mask,
+                                const glm::vec2 &a,
+                                const glm::vec2 &b,
+                                const glm::vec2 &c)
+{
+    const glm::vec2 dims(img.width, img.height);
+    const glm::vec2 uv_lower = glm::min(a, glm::min(b, c)) * dims;
+    const glm::vec2 uv_upper = glm::max(a, glm::max(b, c)) * dims;
+    if (!std::isfinite(uv_lower.x + uv_lower.y + uv_upper.x + uv_upper.y)) {
+        return TRIANGLE_ALPHA_TESTED;
+    }
+    const glm::ivec2 lower = glm::ivec2(glm::floor(uv_lower)) - glm::ivec2(1);
+    // Bounds wrapping around the texture cover all of it
+    const glm::ivec2 upper = glm::min(glm::ivec2(glm::floor(uv_upper)) + glm::ivec2(1),
+                                      lower + glm::ivec2(img.width, img.height) - 1);
+    const glm::ivec2 extent = upper - lower + 1;
+    if (int64_t(extent.x) * extent.y > max_classified_texels) {
+        return TRIANGLE_ALPHA_TESTED;
+    }
+
+    const uint8_t cutoff = static_cast<uint8_t>(glm::clamp(
+        std::ceil(mask.cutoff * 255.f), 0.f, 255.f));
+    bool any_opaque = false;
+    bool any_transparent = false;
+    for (int y = lower.y; y <= upper.y; ++y) {
+        const int ty = ((y % img.height) + img.height) % img.height;
+        for (int x = lower.x; x <= upper.x; ++x) {
+            const int tx = ((x % img.width) + img.width) % img.width;
+            const uint8_t alpha =
+                img.img[(size_t(ty) * img.width + tx) * img.channels + mask.channel];
+            if (alpha >= cutoff) {
+                any_opaque = true;
+            } else {
+                any_transparent = true;
+            }
+            if (any_opaque && any_transparent) {
+                return TRIANGLE_ALPHA_TESTED;
+            }
+        }
+    }
+    return any_transparent ? TRIANGLE_TRANSPARENT : TRIANGLE_OPAQUE;
+}
+
+// Build a geometry from the triangles of g, keeping only the vertices they reference
+Geometry extract_triangles(const Geometry &g, const std::vector<uint32_t> &tris)
+{
+    const ArrayView<glm::vec3> vertices = g.vertex_data();
+    const ArrayView<glm::vec3> normals = g.normal_data();
+    const ArrayView<glm::vec2> uvs = g.uv_data();
+    const ArrayView<glm::vec2> lightmap_uvs = g.lightmap_uv_data();
+    const ArrayView<glm::uvec3> indices = g.index_data();
+    Geometry out;
+    std::vector<uint32_t> vertex_remap(vertices.size(), uint32_t(-1));
+    for (const auto &t : tris) {
+        glm::uvec3 tri;
+        for (int i = 0; i < 3; ++i) {
+            const uint32_t v = indices[t][i];
+            if (vertex_remap[v] == uint32_t(-1)) {
+                vertex_remap[v] = out.vertices.size();
+                out.vertices.push_back(vertices[v]);
+                if (!normals.empty()) {
+                    out.normals.push_back(normals[v]);
+                }
+                if (!uvs.empty()) {
+                    out.uvs.push_back(uvs[v]);
+                }
+                if (!lightmap_uvs.empty()) {
+                    out.lightmap_uvs.push_back(lightmap_uvs[v]);
+                }
+            }
+            tri[i] = vertex_remap[v];
+        }
+        out.indices.push_back(tri);
+    }
+    return out;
+}
+
+}
+
+std::vector<AlphaTestedGeometry> split_alpha_tested_geometry(Scene &scene,
+                                                             AlphaTestStats &stats)
+{
+    TRACE_SCOPE("split_alpha_tested_geometry");
+    std::vector<AlphaTestedGeometry> alpha_tested;
+    for (size_t mesh_id = 0; mesh_id < scene.meshes.size(); ++mesh_id) {
+        auto inst = std::find_if(
+            scene.instances.begin(), scene.instances.end(), [&](const Instance &i) {
+                return i.mesh_id == mesh_id;
+            });
+        if (inst == scene.instances.end()) {
+            continue;
+        }
+
+        Mesh &mesh = scene.meshes[mesh_id];
+        // The geometries replacing the mesh's, and the original geometry each came from
+        std::vector<Geometry> geometries;
+        std::vector<size_t> source_geometry;
+        std::vector<Geometry> tested_geometries;
+        std::vector<size_t> tested_source;
+        std::vector<AlphaTestedGeometry> mesh_alpha_tested;
+        bool has_alpha_mask = false;
+        for (size_t i = 0; i < mesh.geometries.size(); ++i) {
+            const Geometry &g = mesh.geometries[i];
+            const uint32_t material_id =
+                i < inst->material_ids.size() ? inst->material_ids[i] : uint32_t(-1);
+            const AlphaMask mask = material_id < scene.alpha_masks.size()
+                                       ? scene.alpha_masks[material_id]
+                                       : AlphaMask();
+            if (!mask.enabled() || g.uv_data().empty() ||
+                int(mask.channel) >= scene.textures[mask.texture].channels) {
+                geometries.push_back(g);
+                source_geometry.push_back(i);
+                continue;
+            }
+            has_alpha_mask = true;
+
+            const Image &img = scene.textures[mask.texture];
+            const ArrayView<glm::vec2> uvs = g.uv_data();
+            const ArrayView<glm::uvec3> indices = g.index_data();
+            std::vector<uint32_t> opaque_tris, tested_tris;
+            for (size_t t = 0; t < indices.size(); ++t) {
+                const glm::uvec3 &tri = indices[t];
+                switch (classify_triangle(img, mask, uvs[tri.x], uvs[tri.y], uvs[tri.z])) {
+                case TRIANGLE_OPAQUE:
+                    opaque_tris.push_back(t);
+                    break;
+                case TRIANGLE_TRANSPARENT:
+                    ++stats.transparent_tris;
+                    break;
+                default:
+                    tested_tris.push_back(t);
+                    break;
+                }
+            }
+            stats.opaque_tris += opaque_tris.size();
+            stats.alpha_tested_tris += tested_tris.size();
+
+            if (!opaque_tris.empty()) {
+                geometries.push_back(extract_triangles(g, opaque_tris));
+                source_geometry.push_back(i);
+            }
+            if (!tested_tris.empty()) {
+                Geometry tested = extract_triangles(g, tested_tris);
+                tested.alpha_tested = true;
+
+                AlphaTestedGeometry a;
+                a.mesh_id = mesh_id;
+                a.texture = mask.texture;
+                a.channel = mask.channel;
+                a.cutoff = mask.cutoff;
+                a.uvs.reserve(tested.indices.size() * 3);
+                for (const auto &tri : tested.indices) {
+                    for (int j = 0; j < 3; ++j) {
+                        a.uvs.push_back(tested.uvs[tri[j]]);
+                    }
+                }
+                tested_geometries.push_back(std::move(tested));
+                tested_source.push_back(i);
+                mesh_alpha_tested.push_back(std::move(a));
+            }
+        }
+        if (!has_alpha_mask) {
+            continue;
+        }
+
+        // The alpha tested geometries go after the opaque ones. A mesh left empty by
+        // transparent triangles keeps its original geometry, so it still has a BLAS
+        for (size_t i = 0; i < tested_geometries.size(); ++i) {
+            mesh_alpha_tested[i].geometry = geometries.size();
+            geometries.push_back(std::move(tested_geometries[i]));
+            source_geometry.push_back(tested_source[i]);
+        }
+        if (geometries.empty()) {
+            continue;
+        }
+        for (auto &i : scene.instances) {
+            if (i.mesh_id != mesh_id) {
+                continue;
+            }
+            std::vector<uint32_t> material_ids;
+            for (const auto &s : source_geometry) {
+                material_ids.push_back(s < i.material_ids.size() ? i.material_ids[s]
+                                                                 : uint32_t(-1));
+            }
+            i.material_ids = material_ids;
+        }
+        mesh.geometries = std::move(geometries);
+        alpha_tested.insert(alpha_tested.end(),
+                            std::make_move_iterator(mesh_alpha_tested.begin()),
+                            std::make_move_iterator(mesh_alpha_tested.end()));
+    }
+    return alpha_tested;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "scene.h"
+
+// A geometry split out of a mesh holding the triangles whose alpha cutout must be tested
+struct AlphaTestedGeometry {
+    size_t mesh_id = 0;
+    size_t geometry = 0;
+    // The texture channel and cutoff of the alpha mask, see AlphaMask
+    uint32_t texture = 0;
+    uint32_t channel = 3;
+    float cutoff = 0.5f;
+    // The material uvs of each triangle's vertices. The unwrap replaces the geometry's uvs
+    // with the atlas uvs but keeps the triangle order, so these are kept for the alpha test
+    std::vector<glm::vec2> uvs;
+};
+
+struct AlphaTestStats {
+    size_t opaque_tris = 0;
+    size_t transparent_tris = 0;
+    size_t alpha_tested_tris = 0;
+};
+
+/* Classify the triangles of each geometry with an alpha masked material by the texels of
+ * the mask their uvs cover: fully opaque triangles stay in the geometry, fully transparent
+ * ones are removed and those covering both are moved to a new alpha tested geometry
+ * appended to the mesh. The instances' material IDs are updated to match. A mesh's alpha
+ * masks are taken from the materials of its first instance. Returns the alpha tested
+ * geometries, if any
+ */
+std::vector<AlphaTestedGeometry> split_alpha_tested_geometry(Scene &scene,
+                                                             AlphaTestStats &stats);
@@ -0,0 +1,177 @@
+#include "ao_sampler.h"
+#include <cmath>
+#include <glm/gtc/constants.hpp>
+
+namespace {
+
+// The hashes and LCG of dxr/lcg_rng.hlsl
+uint32_t murmur_hash3_mix(uint32_t hash, uint32_t k)
+{
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+    const uint32_t r1 = 15;
+    const uint32_t r2 = 13;
+    const uint32_t m = 5;
+    const uint32_t n = 0xe6546b64;
+
+    k *= c1;
+    k = (k << r1) | (k >> (32 - r1));
+    k *= c2;
+
+    hash ^= k;
+    hash = ((hash << r2) | (hash >> (32 - r2))) * m + n;
+
+    return hash;
+}
+
+uint32_t murmur_hash3_finalize(uint32_t hash)
+{
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+uint32_t lcg_random(uint32_t &state)
+{
+    const uint32_t m = 1664525;
+    const uint32_t n = 1013904223;
+    state = state * m + n;
+    return state;
+}
+
+float lcg_randomf(uint32_t &state)
+{
+    return std::ldexp(float(lcg_random(state)), -32);
+}
+
+uint32_t get_rng(uint32_t pixel_id, uint32_t frame_id)
+{
+    uint32_t state = murmur_hash3_mix(0, pixel_id);
+    state = murmur_hash3_mix(state, frame_id);
+    return murmur_hash3_finalize(state);
+}
+
+uint32_t reverse_bits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+float uint_to_unit_float(uint32_t x)
+{
+    return (x >> 8) * (1.f / 16777216.f);
+}
+
+uint32_t hash_combine(uint32_t seed, uint32_t v)
+{
+    return seed ^ (v + (seed << 6) + (seed >> 2));
+}
+
+uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+    x = reverse_bits(x);
+    x = laine_karras_permutation(x, seed);
+    return reverse_bits(x);
+}
+
+uint32_t sobol_dim1(uint32_t index)
+{
+    uint32_t result = 0;
+    uint32_t v = 0x80000000u;
+    for (; index != 0; index >>= 1) {
+        if (index & 1) {
+            result ^= v;
+        }
+        v ^= v >> 1;
+    }
+    return result;
+}
+
+glm::vec2 owen_scrambled_sobol2d(uint32_t index, uint32_t seed)
+{
+    index = nested_uniform_scramble(index, seed);
+    const uint32_t x = nested_uniform_scramble(reverse_bits(index), hash_combine(seed, 0));
+    const uint32_t y = nested_uniform_scramble(sobol_dim1(index), hash_combine(seed, 1));
+    return glm::vec2(uint_to_unit_float(x), uint_to_unit_float(y));
+}
+
+glm::vec2 r2_sequence(uint32_t index, const glm::vec2 &rotation)
+{
+    const glm::uvec2 alpha(3242174889u, 2447445413u);
+    const glm::uvec2 offset(rotation * 4294967296.f);
+    const glm::uvec2 x = offset + index * alpha;
+    return glm::vec2(uint_to_unit_float(x.x), uint_to_unit_float(x.y));
+}
+
+}
+
+AOSampleGenerator::AOSampleGenerator(uint32_t type,
+                                     uint32_t pixel_id,
+                                     uint32_t first_sample,
+                                     uint32_t frame_id,
+                                     uint32_t sampler_seed,
+                                     const glm::vec2 &blue_noise)
+    : type(type), sample_index(first_sample)
+{
+    seed = murmur_hash3_finalize(
+        murmur_hash3_mix(murmur_hash3_mix(0, pixel_id), sampler_seed));
+    rng_state = get_rng(pixel_id, frame_id);
+    if (sampler_seed != 0) {
+        rng_state = murmur_hash3_mix(rng_state, sampler_seed);
+    }
+
+    if (type == AO_SAMPLER_BLUE_NOISE) {
+        rotation = blue_noise;
+    } else {
+        uint32_t rotation_rng = get_rng(seed, 0);
+        rotation.x = lcg_randomf(rotation_rng);
+        rotation.y = lcg_randomf(rotation_rng);
+    }
+}
+
+glm::vec2 AOSampleGenerator::next_sample2d()
+{
+    glm::vec2 s;
+    if (type == AO_SAMPLER_SOBOL) {
+        s = owen_scrambled_sobol2d(sample_index, seed);
+    } else if (type == AO_SAMPLER_R2 || type == AO_SAMPLER_BLUE_NOISE) {
+        s = r2_sequence(sample_index, rotation);
+    } else {
+        s.x = lcg_randomf(rng_state);
+        s.y = lcg_randomf(rng_state);
+    }
+    ++sample_index;
+    return s;
+}
+
+glm::vec3 sample_ao_direction(const glm::vec3 &v_x,
+                              const glm::vec3 &v_y,
+                              const glm::vec3 &v_z,
+                              const glm::vec2 &u)
+{
+    const float theta = std::sqrt(u.x);
+    const float phi = 2.f * glm::pi<float>() * u.y;
+
+    const float x = std::cos(phi) * theta;
+    const float y = std::sin(phi) * theta;
+    const float z = std::sqrt(1.f - theta * theta);
+
+    return glm::normalize(x * v_x + y * v_y + z * v_z);
+}
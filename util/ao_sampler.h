@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/glm.hpp>
+
+/* A CPU port of the AO sample generators in dxr/sampler.hlsl and the direction sampling in
+ * trace_ao.hlsl, producing the same sample sequence for each texel so CPU bakes match the
+ * GPU's samples. The types must match the SAMPLER_* defines
+ */
+enum AOSamplerType {
+    AO_SAMPLER_LCG = 0,
+    AO_SAMPLER_SOBOL = 1,
+    AO_SAMPLER_R2 = 2,
+    AO_SAMPLER_BLUE_NOISE = 3,
+};
+
+struct AOSampleGenerator {
+    uint32_t type = AO_SAMPLER_SOBOL;
+    // Index of the next sample in the texel's sequence, across all frames
+    uint32_t sample_index = 0;
+    // Per texel seed for the Owen scrambling
+    uint32_t seed = 0;
+    // Per texel Cranley-Patterson rotation for R2 and blue noise
+    glm::vec2 rotation = glm::vec2(0.f);
+    uint32_t rng_state = 0;
+
+    /* Make the sample generator for the texel, as make_sample_generator does. first_sample
+     * is the number of samples the texel has already taken and blue_noise is the texel's
+     * blue noise value, only used by AO_SAMPLER_BLUE_NOISE
+     */
+    AOSampleGenerator(uint32_t type,
+                      uint32_t pixel_id,
+                      uint32_t first_sample,
+                      uint32_t frame_id,
+                      uint32_t sampler_seed,
+                      const glm::vec2 &blue_noise = glm::vec2(0.f));
+
+    glm::vec2 next_sample2d();
+};
+
+// Map the 2D sample u to a cosine distributed direction about v_z in the basis v_x, v_y, v_z
+glm::vec3 sample_ao_direction(const glm::vec3 &v_x,
+                              const glm::vec3 &v_y,
+                              const glm::vec3 &v_z,
+                              const glm::vec2 &u);
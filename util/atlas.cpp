@@ -0,0 +1,1313 @@
+#include "atlas.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include "file_mapping.h"
+#include "trace.h"
+#include "util.h"
+
+namespace {
+
+// Bump if the unwrap or the cache file layout changes to invalidate old caches
+const uint32_t ATLAS_CACHE_VERSION = 4;
+const uint32_t ATLAS_CACHE_MAGIC = 0x43544158; // XATC
+// Meshes remapped by each loader thread before the remapped meshes are passed on in order
+const size_t remap_batch_meshes = 4;
+
+struct AtlasCacheHeader {
+    uint32_t magic = ATLAS_CACHE_MAGIC;
+    uint32_t version = ATLAS_CACHE_VERSION;
+    uint64_t key = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t page_width = 0;
+    uint32_t page_height = 0;
+    uint32_t page_grid_x = 0;
+    uint32_t page_grid_y = 0;
+    uint32_t chart_count = 0;
+    uint32_t atlas_count = 0;
+    uint32_t num_geometries = 0;
+    uint32_t num_instances = 0;
+    uint32_t instanced_meshes = 0;
+    uint32_t pad = 0;
+};
+
+// Per geometry header, followed by the vertex xrefs, vertex uvs and indices. The instance
+// regions follow the last geometry
+struct AtlasCacheGeometry {
+    uint32_t vertex_count = 0;
+    uint32_t index_count = 0;
+};
+
+// Hash the array like Hasher::add does a vector, so viewed and copied geometry match
+template <typename T>
+void hash_array(Hasher &hasher, const ArrayView<T> &v)
+{
+    hasher.add(v.size());
+    if (!v.empty()) {
+        hasher.add(v.data(), v.size() * sizeof(T));
+    }
+}
+
+std::string cache_file_name(const std::string &cache_dir, const char *prefix, uint64_t key)
+{
+    std::stringstream ss;
+    ss << cache_dir << "/" << prefix << std::hex << std::setw(16) << std::setfill('0') << key
+       << ".bin";
+    return ss.str();
+}
+
+// The unwrapped vertices of a geometry, referencing the original vertices by xref
+struct GeometryRemap {
+    std::vector<uint32_t> xrefs;
+    std::vector<glm::vec2> uvs;
+    std::vector<uint32_t> indices;
+};
+
+struct AtlasDeleter {
+    void operator()(xatlas::Atlas *atlas) const
+    {
+        xatlas::Destroy(atlas);
+    }
+};
+using AtlasPtr = std::unique_ptr<xatlas::Atlas, AtlasDeleter>;
+
+/* Replace the geometry with the atlas geometry, which is always held in its vectors. The
+ * arrays are sized from the remap up front and filled in place, and the remap's uvs are
+ * moved into the geometry
+ */
+void remap_geometry(Geometry &g, GeometryRemap &remap)
+{
+    const ArrayView<glm::vec3> verts = g.vertex_data();
+    const ArrayView<glm::vec3> normals = g.normal_data();
+    const size_t n_verts = remap.xrefs.size();
+    std::vector<glm::vec3> atlas_verts(n_verts);
+    std::vector<glm::vec3> atlas_normals(normals.empty() ? 0 : n_verts);
+    for (size_t i = 0; i < n_verts; ++i) {
+        atlas_verts[i] = verts[remap.xrefs[i]];
+    }
+    for (size_t i = 0; i < atlas_normals.size(); ++i) {
+        atlas_normals[i] = normals[remap.xrefs[i]];
+    }
+
+    // The index triples are tightly packed, matching the uvec3 layout
+    std::vector<glm::uvec3> atlas_indices(remap.indices.size() / 3);
+    if (!atlas_indices.empty()) {
+        std::memcpy(atlas_indices.data(),
+                    remap.indices.data(),
+                    atlas_indices.size() * sizeof(glm::uvec3));
+    }
+
+    g.vertices = std::move(atlas_verts);
+    g.normals = std::move(atlas_normals);
+    g.uvs = std::move(remap.uvs);
+    g.lightmap_uvs.clear();
+    g.indices = std::move(atlas_indices);
+    g.clear_views();
+}
+
+/* Read the remaps, each an AtlasCacheGeometry followed by its arrays, advancing data past
+ * them. Returns false if the data ends before the last remap
+ */
+bool read_remaps(const uint8_t *&data, const uint8_t *end, std::vector<GeometryRemap> &remaps)
+{
+    for (auto &remap : remaps) {
+        AtlasCacheGeometry gh;
+        if (end - data < ptrdiff_t(sizeof(gh))) {
+            return false;
+        }
+        std::memcpy(&gh, data, sizeof(gh));
+        data += sizeof(gh);
+
+        const size_t nbytes = gh.vertex_count * (sizeof(uint32_t) + sizeof(glm::vec2)) +
+                              gh.index_count * sizeof(uint32_t);
+        if (end - data < ptrdiff_t(nbytes)) {
+            return false;
+        }
+        remap.xrefs.resize(gh.vertex_count);
+        remap.uvs.resize(gh.vertex_count);
+        remap.indices.resize(gh.index_count);
+        std::memcpy(remap.xrefs.data(), data, remap.xrefs.size() * sizeof(uint32_t));
+        data += remap.xrefs.size() * sizeof(uint32_t);
+        std::memcpy(remap.uvs.data(), data, remap.uvs.size() * sizeof(glm::vec2));
+        data += remap.uvs.size() * sizeof(glm::vec2);
+        std::memcpy(remap.indices.data(), data, remap.indices.size() * sizeof(uint32_t));
+        data += remap.indices.size() * sizeof(uint32_t);
+    }
+    return true;
+}
+
+void write_remaps(std::ofstream &fout, const std::vector<GeometryRemap> &remaps)
+{
+    for (const auto &remap : remaps) {
+        AtlasCacheGeometry gh;
+        gh.vertex_count = remap.xrefs.size();
+        gh.index_count = remap.indices.size();
+        fout.write(reinterpret_cast<const char *>(&gh), sizeof(gh));
+        fout.write(reinterpret_cast<const char *>(remap.xrefs.data()),
+                   remap.xrefs.size() * sizeof(uint32_t));
+        fout.write(reinterpret_cast<const char *>(remap.uvs.data()),
+                   remap.uvs.size() * sizeof(glm::vec2));
+        fout.write(reinterpret_cast<const char *>(remap.indices.data()),
+                   remap.indices.size() * sizeof(uint32_t));
+    }
+}
+
+bool load_cached_unwrap(const std::string &fname,
+                        uint64_t key,
+                        const std::vector<Mesh> &meshes,
+                        size_t num_instances,
+                        AtlasResult &result,
+                        std::vector<GeometryRemap> &remaps)
+{
+    if (!std::ifstream(fname.c_str()).good()) {
+        return false;
+    }
+
+    FileMapping mapping(fname);
+    const uint8_t *data = mapping.data();
+    const uint8_t *end = data + mapping.nbytes();
+
+    AtlasCacheHeader header;
+    if (mapping.nbytes() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, data, sizeof(header));
+    data += sizeof(header);
+
+    size_t num_geometries = 0;
+    for (const auto &m : meshes) {
+        num_geometries += m.geometries.size();
+    }
+    if (header.magic != ATLAS_CACHE_MAGIC || header.version != ATLAS_CACHE_VERSION ||
+        header.key != key || header.num_geometries != num_geometries ||
+        header.num_instances != num_instances) {
+        return false;
+    }
+
+    // Validate and copy out the whole file before modifying any geometry, copying out of
+    // the mapping also keeps the arrays aligned
+    remaps.resize(num_geometries);
+    if (!read_remaps(data, end, remaps)) {
+        return false;
+    }
+    std::vector<InstanceAtlasRegion> regions(num_instances);
+    if (end - data < ptrdiff_t(regions.size() * sizeof(InstanceAtlasRegion))) {
+        return false;
+    }
+    std::memcpy(regions.data(), data, regions.size() * sizeof(InstanceAtlasRegion));
+
+    result.size = glm::uvec2(header.width, header.height);
+    result.page_size = glm::uvec2(header.page_width, header.page_height);
+    result.page_grid = glm::uvec2(header.page_grid_x, header.page_grid_y);
+    result.chart_count = header.chart_count;
+    result.atlas_count = header.atlas_count;
+    result.instanced_meshes = header.instanced_meshes;
+    result.instance_regions = std::move(regions);
+    result.from_cache = true;
+    return true;
+}
+
+void write_cached_unwrap(const std::string &fname,
+                         uint64_t key,
+                         const AtlasResult &result,
+                         const std::vector<GeometryRemap> &remaps)
+{
+    std::ofstream fout(fname.c_str(), std::ios::binary);
+    if (!fout) {
+        std::cout << "Warning: failed to open atlas cache file " << fname << "\n";
+        return;
+    }
+
+    AtlasCacheHeader header;
+    header.key = key;
+    header.width = result.size.x;
+    header.height = result.size.y;
+    header.page_width = result.page_size.x;
+    header.page_height = result.page_size.y;
+    header.page_grid_x = result.page_grid.x;
+    header.page_grid_y = result.page_grid.y;
+    header.chart_count = result.chart_count;
+    header.atlas_count = result.atlas_count;
+    header.num_geometries = remaps.size();
+    header.num_instances = result.instance_regions.size();
+    header.instanced_meshes = result.instanced_meshes;
+    fout.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    write_remaps(fout, remaps);
+    fout.write(reinterpret_cast<const char *>(result.instance_regions.data()),
+               result.instance_regions.size() * sizeof(InstanceAtlasRegion));
+    if (!fout) {
+        std::cout << "Warning: failed to write atlas cache file " << fname << "\n";
+    }
+}
+
+/* Replace the geometry of each mesh with its remap, releasing the remaps as they're
+ * applied, and pass the mesh to the callback if there is one. The meshes are remapped in
+ * parallel in batches, and the callback is called for each batch's meshes in order, so the
+ * meshes are still streamed out in order and released batch by batch
+ */
+void apply_remaps(std::vector<Mesh> &meshes,
+                  std::vector<GeometryRemap> &remaps,
+                  const AtlasResult &result,
+                  const AtlasMeshFn &mesh_unwrapped)
+{
+    std::vector<size_t> first_geom(meshes.size() + 1, 0);
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        first_geom[i + 1] = first_geom[i] + meshes[i].geometries.size();
+    }
+    const size_t batch_size = size_t(loader_thread_count()) * remap_batch_meshes;
+    for (size_t begin = 0; begin < meshes.size(); begin += batch_size) {
+        const size_t end = std::min(begin + batch_size, meshes.size());
+        parallel_tasks(end - begin, [&](size_t m) {
+            const size_t i = begin + m;
+            auto &geometries = meshes[i].geometries;
+            for (size_t j = 0; j < geometries.size(); ++j) {
+                remap_geometry(geometries[j], remaps[first_geom[i] + j]);
+                remaps[first_geom[i] + j] = GeometryRemap();
+            }
+        });
+        if (mesh_unwrapped) {
+            for (size_t i = begin; i < end; ++i) {
+                mesh_unwrapped(result, i, meshes[i]);
+            }
+        }
+    }
+}
+
+// The fraction of the atlas texels the charts are expected to cover when solving for the
+// texel density filling a texel budget
+const double expected_utilization = 0.7;
+// The density is solved for with at most this many packs, stopping once a pack fills at
+// least budget_fill of the budget
+const int max_budget_packs = 4;
+const double budget_fill = 0.9;
+
+double geometry_surface_area(const Geometry &g)
+{
+    const ArrayView<glm::vec3> verts = g.vertex_data();
+    double area = 0.0;
+    for (const auto &t : g.index_data()) {
+        const glm::vec3 a = verts[t.x];
+        area += 0.5 * glm::length(glm::cross(verts[t.y] - a, verts[t.z] - a));
+    }
+    return area;
+}
+
+double mesh_surface_area(const Mesh &mesh)
+{
+    double area = 0.0;
+    for (const auto &g : mesh.geometries) {
+        area += geometry_surface_area(g);
+    }
+    return area;
+}
+
+// The texel density expected to fill the texel budget with charts of the surface area
+float budget_texels_per_unit(uint64_t texel_budget, double area)
+{
+    if (area <= 0.0) {
+        return 1.f;
+    }
+    return static_cast<float>(std::sqrt(texel_budget * expected_utilization / area));
+}
+
+/* Pack the charts at the texel density filling the texel budget. The atlas texels grow
+ * with the square of the density, so starting from the density expected to fill the
+ * budget each pack rescales it by the square root of the budget over the texels the last
+ * pack took. The densest pack within the budget is kept. Returns false if cancelled
+ */
+bool pack_to_budget(xatlas::Atlas *atlas,
+                    xatlas::PackOptions pack_options,
+                    uint64_t texel_budget,
+                    double area,
+                    const std::atomic<bool> &cancelled)
+{
+    float texels_per_unit = budget_texels_per_unit(texel_budget, area);
+    float best_texels_per_unit = 0.f;
+    float packed_texels_per_unit = 0.f;
+    for (int i = 0; i < max_budget_packs; ++i) {
+        pack_options.texelsPerUnit = texels_per_unit;
+        xatlas::PackCharts(atlas, pack_options);
+        if (cancelled) {
+            return false;
+        }
+        packed_texels_per_unit = texels_per_unit;
+        const double texels =
+            double(atlas->width) * atlas->height * std::max(atlas->atlasCount, 1u);
+        if (texels <= texel_budget) {
+            best_texels_per_unit = std::max(best_texels_per_unit, texels_per_unit);
+            if (texels >= texel_budget * budget_fill) {
+                break;
+            }
+        }
+        // Aim slightly under the budget when shrinking, so the next pack is likely to fit
+        const double scale = std::sqrt(texel_budget / std::max(texels, 1.0));
+        texels_per_unit *= static_cast<float>(texels > texel_budget ? scale * 0.98 : scale);
+    }
+    if (best_texels_per_unit == 0.f) {
+        std::cout << "Warning: the atlas charts don't fit in the budget of " << texel_budget
+                  << " texels, using " << packed_texels_per_unit << " texels/unit\n";
+    } else if (best_texels_per_unit != packed_texels_per_unit) {
+        pack_options.texelsPerUnit = best_texels_per_unit;
+        xatlas::PackCharts(atlas, pack_options);
+    }
+    return !cancelled;
+}
+
+/* Run xatlas on the geometries, returning null if the progress callback cancelled it.
+ * If the texel budget is set and the pack options don't set the texel density, the
+ * charts are packed at the density filling the budget. The progress is reported for each
+ * run separately
+ */
+AtlasPtr generate_atlas(const std::vector<const Geometry *> &geometries,
+                        const AtlasOptions &options,
+                        const xatlas::PackOptions &pack_options,
+                        uint64_t texel_budget = 0)
+{
+    AtlasPtr atlas(xatlas::Create());
+
+    // Track if the callback cancelled the unwrap, xatlas just returns early
+    struct ProgressState {
+        const AtlasProgressFn *fn = nullptr;
+        std::atomic<bool> cancelled;
+    };
+    ProgressState progress_state;
+    progress_state.fn = &options.progress;
+    progress_state.cancelled = false;
+    if (options.progress) {
+        xatlas::SetProgressCallback(
+            atlas.get(),
+            [](xatlas::ProgressCategory::Enum category, int progress, void *user_data) {
+                ProgressState *state = static_cast<ProgressState *>(user_data);
+                if (!(*state->fn)(category, progress)) {
+                    state->cancelled = true;
+                }
+                return !state->cancelled;
+            },
+            &progress_state);
+    }
+
+    TRACE_SCOPE("xatlas Generate");
+    for (const auto *g : geometries) {
+        TRACE_SCOPE("xatlas AddMesh");
+        xatlas::MeshDecl mesh;
+        mesh.vertexCount = g->vertex_data().size();
+        mesh.vertexPositionData = g->vertex_data().data();
+        mesh.vertexPositionStride = sizeof(glm::vec3);
+
+        mesh.indexCount = g->index_data().size() * 3;
+        mesh.indexData = g->index_data().data();
+        mesh.indexFormat = xatlas::IndexFormat::UInt32;
+
+        if (!g->uv_data().empty()) {
+            mesh.vertexUvData = g->uv_data().data();
+            mesh.vertexUvStride = sizeof(glm::vec2);
+        }
+
+        mesh.vertexNormalData = g->normal_data().data();
+        mesh.vertexNormalStride = sizeof(glm::vec3);
+
+        auto err = xatlas::AddMesh(atlas.get(), mesh, geometries.size());
+        if (err != xatlas::AddMeshError::Success) {
+            std::cout << "Error adding geometry to atlas: " << xatlas::StringForEnum(err)
+                      << "\n";
+            throw std::runtime_error("Error adding geometry to atlas");
+        }
+    }
+
+    {
+        TRACE_SCOPE("xatlas ComputeCharts");
+        xatlas::ComputeCharts(atlas.get(), options.chart_options);
+    }
+    {
+        TRACE_SCOPE("xatlas ParameterizeCharts");
+        xatlas::ParameterizeCharts(atlas.get());
+    }
+    if (texel_budget == 0 || pack_options.texelsPerUnit > 0.f) {
+        TRACE_SCOPE("xatlas PackCharts");
+        xatlas::PackCharts(atlas.get(), pack_options);
+    } else if (!progress_state.cancelled) {
+        TRACE_SCOPE("xatlas PackCharts");
+        double area = 0.0;
+        for (const auto *g : geometries) {
+            area += geometry_surface_area(*g);
+        }
+        pack_to_budget(
+            atlas.get(), pack_options, texel_budget, area, progress_state.cancelled);
+    }
+    if (progress_state.cancelled) {
+        return nullptr;
+    }
+    return atlas;
+}
+
+/* Read back the xatlas output mesh, transforming its uvs from texels in the unwrap to the
+ * normalized uvs: (uv + origin) / size. The origin of each page is added to the uvs
+ */
+GeometryRemap read_atlas_mesh(const xatlas::Mesh &mesh,
+                              const AtlasResult &pages,
+                              const glm::vec2 &origin,
+                              const glm::vec2 &size)
+{
+    GeometryRemap remap;
+    remap.xrefs.resize(mesh.vertexCount);
+    remap.uvs.resize(mesh.vertexCount);
+    for (uint32_t i = 0; i < mesh.vertexCount; ++i) {
+        const auto &vert_indices = mesh.vertexArray[i];
+        const uint32_t page = std::max(vert_indices.atlasIndex, 0);
+        const glm::vec2 page_origin((page % pages.page_grid.x) * pages.page_size.x,
+                                    (page / pages.page_grid.x) * pages.page_size.y);
+        remap.xrefs[i] = vert_indices.xref;
+        remap.uvs[i] =
+            (glm::vec2(vert_indices.uv[0], vert_indices.uv[1]) + page_origin + origin) /
+            size;
+    }
+    remap.indices = std::vector<uint32_t>(mesh.indexArray, mesh.indexArray + mesh.indexCount);
+    return remap;
+}
+
+/* Pack the rectangles into rows of roughly square total size, tallest first, leaving
+ * padding texels between them. Returns the size of the packed area
+ */
+glm::uvec2 pack_rects(const std::vector<glm::uvec2> &sizes,
+                      uint32_t padding,
+                      std::vector<glm::uvec2> &origins)
+{
+    uint64_t area = 0;
+    uint32_t max_width = 0;
+    for (const auto &s : sizes) {
+        area += uint64_t(s.x + padding) * (s.y + padding);
+        max_width = std::max(max_width, s.x);
+    }
+    const uint32_t row_width =
+        std::max(max_width, static_cast<uint32_t>(std::ceil(std::sqrt(double(area)))));
+
+    std::vector<size_t> order(sizes.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](const size_t a, const size_t b) {
+        return sizes[a].y > sizes[b].y;
+    });
+
+    origins.resize(sizes.size());
+    glm::uvec2 cursor(0);
+    glm::uvec2 packed_size(0);
+    uint32_t row_height = 0;
+    for (const auto &i : order) {
+        if (cursor.x > 0 && cursor.x + sizes[i].x > row_width) {
+            cursor.x = 0;
+            cursor.y += row_height + padding;
+            row_height = 0;
+        }
+        origins[i] = cursor;
+        cursor.x += sizes[i].x + padding;
+        row_height = std::max(row_height, sizes[i].y);
+        packed_size = glm::max(packed_size, origins[i] + sizes[i]);
+    }
+    return packed_size;
+}
+
+// The per-mesh chart files and the layout file of the incremental unwrap
+const uint32_t CHART_CACHE_MAGIC = 0x54524843; // CHRT
+const uint32_t LAYOUT_CACHE_MAGIC = 0x5459414c; // LAYT
+
+// The resolution the texel density is estimated for by the unwraps not leaving it to
+// xatlas, if neither the density, budget or resolution are set
+const uint32_t default_estimate_resolution = 1024;
+
+// Followed by the geometries like the atlas cache
+struct ChartCacheHeader {
+    uint32_t magic = CHART_CACHE_MAGIC;
+    uint32_t version = ATLAS_CACHE_VERSION;
+    uint64_t key = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t chart_count = 0;
+    uint32_t num_geometries = 0;
+};
+
+// The charts of a mesh unwrapped on its own, with the uvs normalized to its unwrap
+struct MeshCharts {
+    glm::uvec2 size = glm::uvec2(0);
+    uint32_t chart_count = 0;
+    std::vector<GeometryRemap> remaps;
+};
+
+// The largest unwrap a mesh's lightmap uvs are given, the max D3D12 texture size
+const uint32_t max_lightmap_uv_size = 16384;
+
+// Meshes with lightmap uvs on all their geometry use them instead of being charted
+bool has_lightmap_uvs(const Mesh &mesh)
+{
+    for (const auto &g : mesh.geometries) {
+        if (g.lightmap_uv_data().empty() ||
+            g.lightmap_uv_data().size() != g.vertex_data().size()) {
+            return false;
+        }
+    }
+    return !mesh.geometries.empty();
+}
+
+/* The unwrap of a mesh with lightmap uvs, which are kept as they are. Its size gives the
+ * mesh's surface about texels_per_unit, accounting for the fraction of the uv square its
+ * triangles cover
+ */
+MeshCharts lightmap_uv_charts(const Mesh &mesh, float texels_per_unit)
+{
+    MeshCharts charts;
+    double uv_area = 0.0;
+    for (const auto &g : mesh.geometries) {
+        const ArrayView<glm::vec2> uvs = g.lightmap_uv_data();
+        GeometryRemap remap;
+        remap.xrefs.resize(uvs.size());
+        std::iota(remap.xrefs.begin(), remap.xrefs.end(), 0);
+        remap.uvs.assign(uvs.begin(), uvs.end());
+        remap.indices.reserve(g.index_data().size() * 3);
+        for (const auto &t : g.index_data()) {
+            const glm::vec2 a = uvs[t.y] - uvs[t.x];
+            const glm::vec2 b = uvs[t.z] - uvs[t.x];
+            uv_area += 0.5 * std::abs(a.x * b.y - a.y * b.x);
+            remap.indices.insert(remap.indices.end(), {t.x, t.y, t.z});
+        }
+        charts.remaps.push_back(std::move(remap));
+    }
+    const double side =
+        texels_per_unit * std::sqrt(mesh_surface_area(mesh) / std::max(uv_area, 1e-12));
+    charts.size = glm::uvec2(
+        static_cast<uint32_t>(glm::clamp(std::ceil(side), 1.0, double(max_lightmap_uv_size))));
+    return charts;
+}
+
+// Followed by the LayoutRects
+struct LayoutCacheHeader {
+    uint32_t magic = LAYOUT_CACHE_MAGIC;
+    uint32_t version = ATLAS_CACHE_VERSION;
+    uint64_t key = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t num_rects = 0;
+    uint32_t pad = 0;
+};
+
+// Where an instance's copy of its mesh's charts is placed in the incremental layout, the
+// copies of the same charts are told apart by their occurrence in the instance order
+struct LayoutRect {
+    uint64_t chart_key = 0;
+    uint32_t occurrence = 0;
+    uint32_t pad = 0;
+    glm::uvec2 origin = glm::uvec2(0);
+    glm::uvec2 size = glm::uvec2(0);
+};
+
+/* The texel density estimated to fit the instances' surface area in the texel budget or
+ * target resolution, for unwraps that don't leave it to xatlas
+ */
+double estimate_texels_per_unit(const std::vector<Mesh> &meshes,
+                                const std::vector<Instance> &instances,
+                                const AtlasOptions &options)
+{
+    std::vector<double> mesh_area;
+    for (const auto &m : meshes) {
+        mesh_area.push_back(mesh_surface_area(m));
+    }
+    double area = 0.0;
+    for (const auto &inst : instances) {
+        area += mesh_area[inst.mesh_id];
+    }
+    if (area <= 0.0) {
+        return 1.0;
+    }
+    double texels_per_unit = 0.0;
+    if (options.texel_budget > 0) {
+        texels_per_unit = budget_texels_per_unit(options.texel_budget, area);
+    } else {
+        const double resolution = options.pack_options.resolution > 0
+                                      ? options.pack_options.resolution
+                                      : default_estimate_resolution;
+        texels_per_unit = resolution / std::sqrt(area);
+    }
+    return texels_per_unit;
+}
+
+/* The texel density of the incremental unwrap. Unless it's set it's estimated, rounded
+ * down to a quarter octave so editing a few meshes rarely changes it and re-charts the
+ * whole scene
+ */
+float incremental_texels_per_unit(const std::vector<Mesh> &meshes,
+                                  const std::vector<Instance> &instances,
+                                  const AtlasOptions &options)
+{
+    if (options.pack_options.texelsPerUnit > 0.f) {
+        return options.pack_options.texelsPerUnit;
+    }
+    const double texels_per_unit = estimate_texels_per_unit(meshes, instances, options);
+    return static_cast<float>(std::exp2(std::floor(std::log2(texels_per_unit) * 4.0) / 4.0));
+}
+
+// Hash the mesh's geometry and the options it's charted with for its chart cache key
+uint64_t mesh_chart_key(const Mesh &mesh, const AtlasOptions &options, float texels_per_unit)
+{
+    Hasher hasher;
+    hasher.add(ATLAS_CACHE_VERSION);
+    hasher.add(CHART_CACHE_MAGIC);
+    hasher.add(mesh.geometries.size());
+    for (const auto &g : mesh.geometries) {
+        hash_array(hasher, g.vertex_data());
+        hash_array(hasher, g.normal_data());
+        hash_array(hasher, g.uv_data());
+        hash_array(hasher, g.lightmap_uv_data());
+        hash_array(hasher, g.index_data());
+    }
+    AtlasOptions chart_options;
+    chart_options.chart_options = options.chart_options;
+    chart_options.pack_options = options.pack_options;
+    chart_options.pack_options.resolution = 0;
+    chart_options.pack_options.texelsPerUnit = texels_per_unit;
+    hash_atlas_options(hasher, chart_options);
+    return hasher.h;
+}
+
+bool load_mesh_charts(const std::string &fname,
+                      uint64_t key,
+                      size_t num_geometries,
+                      MeshCharts &charts)
+{
+    if (!std::ifstream(fname.c_str()).good()) {
+        return false;
+    }
+    FileMapping mapping(fname);
+    const uint8_t *data = mapping.data();
+    const uint8_t *end = data + mapping.nbytes();
+
+    ChartCacheHeader header;
+    if (mapping.nbytes() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, data, sizeof(header));
+    data += sizeof(header);
+    if (header.magic != CHART_CACHE_MAGIC || header.version != ATLAS_CACHE_VERSION ||
+        header.key != key || header.num_geometries != num_geometries) {
+        return false;
+    }
+    charts.remaps.resize(num_geometries);
+    if (!read_remaps(data, end, charts.remaps)) {
+        charts.remaps.clear();
+        return false;
+    }
+    charts.size = glm::uvec2(header.width, header.height);
+    charts.chart_count = header.chart_count;
+    return true;
+}
+
+void write_mesh_charts(const std::string &fname, uint64_t key, const MeshCharts &charts)
+{
+    std::ofstream fout(fname.c_str(), std::ios::binary);
+    ChartCacheHeader header;
+    header.key = key;
+    header.width = charts.size.x;
+    header.height = charts.size.y;
+    header.chart_count = charts.chart_count;
+    header.num_geometries = charts.remaps.size();
+    fout.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    write_remaps(fout, charts.remaps);
+    if (!fout) {
+        std::cout << "Warning: failed to write chart cache file " << fname << "\n";
+    }
+}
+
+bool load_layout(const std::string &fname,
+                 uint64_t key,
+                 glm::uvec2 &size,
+                 std::vector<LayoutRect> &rects)
+{
+    if (!std::ifstream(fname.c_str()).good()) {
+        return false;
+    }
+    FileMapping mapping(fname);
+    LayoutCacheHeader header;
+    if (mapping.nbytes() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, mapping.data(), sizeof(header));
+    if (header.magic != LAYOUT_CACHE_MAGIC || header.version != ATLAS_CACHE_VERSION ||
+        header.key != key ||
+        mapping.nbytes() < sizeof(header) + header.num_rects * sizeof(LayoutRect)) {
+        return false;
+    }
+    rects.resize(header.num_rects);
+    std::memcpy(
+        rects.data(), mapping.data() + sizeof(header), rects.size() * sizeof(LayoutRect));
+    size = glm::uvec2(header.width, header.height);
+    return true;
+}
+
+void write_layout(const std::string &fname,
+                  uint64_t key,
+                  const glm::uvec2 &size,
+                  const std::vector<LayoutRect> &rects)
+{
+    std::ofstream fout(fname.c_str(), std::ios::binary);
+    LayoutCacheHeader header;
+    header.key = key;
+    header.width = size.x;
+    header.height = size.y;
+    header.num_rects = rects.size();
+    fout.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    fout.write(reinterpret_cast<const char *>(rects.data()),
+               rects.size() * sizeof(LayoutRect));
+    if (!fout) {
+        std::cout << "Warning: failed to write atlas layout file " << fname << "\n";
+    }
+}
+
+/* Place the changed rects into the free rects left by the previous layout, best fit and
+ * largest first, splitting the free rect each is placed in into the space to its right and
+ * below. The rects that don't fit are packed together into a block placed past the
+ * bounds along their shorter side. Returns the bounds of the layout
+ */
+glm::uvec2 place_changed_rects(std::vector<LayoutRect> &rects,
+                               std::vector<size_t> changed,
+                               std::vector<LayoutRect> free_rects,
+                               uint32_t padding,
+                               glm::uvec2 bounds)
+{
+    std::stable_sort(changed.begin(), changed.end(), [&](const size_t a, const size_t b) {
+        return uint64_t(rects[a].size.x) * rects[a].size.y >
+               uint64_t(rects[b].size.x) * rects[b].size.y;
+    });
+    std::vector<size_t> unplaced;
+    for (const auto &i : changed) {
+        LayoutRect &r = rects[i];
+        auto best = free_rects.end();
+        for (auto f = free_rects.begin(); f != free_rects.end(); ++f) {
+            if (f->size.x >= r.size.x && f->size.y >= r.size.y &&
+                (best == free_rects.end() ||
+                 uint64_t(f->size.x) * f->size.y < uint64_t(best->size.x) * best->size.y)) {
+                best = f;
+            }
+        }
+        if (best == free_rects.end()) {
+            unplaced.push_back(i);
+            continue;
+        }
+        r.origin = best->origin;
+        const LayoutRect f = *best;
+        free_rects.erase(best);
+        if (f.size.x > r.size.x + padding) {
+            LayoutRect right;
+            right.origin = glm::uvec2(f.origin.x + r.size.x + padding, f.origin.y);
+            right.size = glm::uvec2(f.size.x - r.size.x - padding, r.size.y);
+            free_rects.push_back(right);
+        }
+        if (f.size.y > r.size.y + padding) {
+            LayoutRect below;
+            below.origin = glm::uvec2(f.origin.x, f.origin.y + r.size.y + padding);
+            below.size = glm::uvec2(f.size.x, f.size.y - r.size.y - padding);
+            free_rects.push_back(below);
+        }
+        bounds = glm::max(bounds, r.origin + r.size);
+    }
+    if (unplaced.empty()) {
+        return bounds;
+    }
+
+    std::vector<glm::uvec2> sizes;
+    for (const auto &i : unplaced) {
+        sizes.push_back(rects[i].size);
+    }
+    std::vector<glm::uvec2> origins;
+    const glm::uvec2 block_size = pack_rects(sizes, padding, origins);
+    const glm::uvec2 block_origin = bounds.x >= bounds.y
+                                        ? glm::uvec2(0, bounds.y + padding)
+                                        : glm::uvec2(bounds.x + padding, 0);
+    for (size_t j = 0; j < unplaced.size(); ++j) {
+        rects[unplaced[j]].origin = block_origin + origins[j];
+    }
+    return glm::max(bounds, block_origin + block_size);
+}
+
+/* Unwrap each mesh on its own at a fixed texel density, loading the charts of the meshes
+ * that are unchanged since they were last charted from the chart cache. Each instance
+ * keeps its region of the previous layout if its charts are unchanged, and the changed
+ * ones are placed in the free space, so the atlas only grows. The unwrap is written to
+ * the cache file and applied to the meshes
+ */
+AtlasResult unwrap_incremental(std::vector<Mesh> &meshes,
+                               const std::vector<Instance> &instances,
+                               const AtlasOptions &options,
+                               uint64_t key,
+                               const std::string &cache_file)
+{
+    AtlasResult result;
+    result.cache_key = key;
+    const float texels_per_unit = incremental_texels_per_unit(meshes, instances, options);
+    xatlas::PackOptions pack_options = options.pack_options;
+    pack_options.resolution = 0;
+    pack_options.texelsPerUnit = texels_per_unit;
+
+    std::cout << "Generating atlas incrementally at " << texels_per_unit
+              << " texels/unit\n";
+    std::vector<uint64_t> chart_keys(meshes.size());
+    std::vector<MeshCharts> charts(meshes.size());
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        chart_keys[i] = mesh_chart_key(meshes[i], options, texels_per_unit);
+        if (has_lightmap_uvs(meshes[i])) {
+            charts[i] = lightmap_uv_charts(meshes[i], texels_per_unit);
+            continue;
+        }
+        const std::string chart_file =
+            cache_file_name(options.cache_dir, "charts_", chart_keys[i]);
+        if (meshes[i].geometries.empty() ||
+            load_mesh_charts(
+                chart_file, chart_keys[i], meshes[i].geometries.size(), charts[i])) {
+            continue;
+        }
+
+        std::vector<const Geometry *> geometries;
+        for (const auto &g : meshes[i].geometries) {
+            geometries.push_back(&g);
+        }
+        AtlasPtr atlas = generate_atlas(geometries, options, pack_options);
+        if (!atlas) {
+            std::cout << "Atlas generation cancelled\n";
+            result.cancelled = true;
+            return result;
+        }
+        MeshCharts &c = charts[i];
+        c.size = glm::uvec2(atlas->width, atlas->height);
+        c.chart_count = atlas->chartCount;
+        // Charted at a fixed density the unwrap has a single page
+        AtlasResult unwrap_pages;
+        unwrap_pages.page_size = c.size;
+        for (uint32_t j = 0; j < atlas->meshCount; ++j) {
+            c.remaps.push_back(read_atlas_mesh(
+                atlas->meshes[j], unwrap_pages, glm::vec2(0.f), glm::vec2(c.size)));
+        }
+        write_mesh_charts(chart_file, chart_keys[i], c);
+        ++result.recharted_meshes;
+    }
+
+    // The layout is kept per layout name and options
+    Hasher layout_hasher;
+    layout_hasher.add(LAYOUT_CACHE_MAGIC);
+    layout_hasher.add(options.layout_name.data(), options.layout_name.size());
+    hash_atlas_options(layout_hasher, options);
+    const std::string layout_file =
+        cache_file_name(options.cache_dir, "layout_", layout_hasher.h);
+    glm::uvec2 prev_size(0);
+    std::vector<LayoutRect> prev_rects;
+    load_layout(layout_file, layout_hasher.h, prev_size, prev_rects);
+    std::map<std::pair<uint64_t, uint32_t>, size_t> prev_rect_index;
+    for (size_t i = 0; i < prev_rects.size(); ++i) {
+        prev_rect_index[std::make_pair(prev_rects[i].chart_key, prev_rects[i].occurrence)] = i;
+    }
+
+    // Each instance's rect keeps its previous origin if the same copy of the same charts
+    // was placed before, the rects of the previous layout that aren't kept are free space
+    std::vector<LayoutRect> rects(instances.size());
+    std::vector<bool> prev_kept(prev_rects.size(), false);
+    std::vector<size_t> changed;
+    std::map<uint64_t, uint32_t> occurrences;
+    std::vector<size_t> mesh_instance_count(meshes.size(), 0);
+    for (size_t i = 0; i < instances.size(); ++i) {
+        const size_t mesh_id = instances[i].mesh_id;
+        ++mesh_instance_count[mesh_id];
+        LayoutRect &r = rects[i];
+        r.chart_key = chart_keys[mesh_id];
+        r.occurrence = occurrences[r.chart_key]++;
+        r.size = charts[mesh_id].size;
+        result.chart_count += charts[mesh_id].chart_count;
+        auto prev = prev_rect_index.find(std::make_pair(r.chart_key, r.occurrence));
+        if (prev != prev_rect_index.end() && prev_rects[prev->second].size == r.size) {
+            r.origin = prev_rects[prev->second].origin;
+            prev_kept[prev->second] = true;
+        } else if (r.size.x > 0 && r.size.y > 0) {
+            changed.push_back(i);
+        }
+    }
+    const size_t kept = instances.size() - changed.size();
+    if (kept == 0) {
+        // Nothing to keep in place, so the whole layout is repacked
+        std::vector<glm::uvec2> sizes, origins;
+        for (const auto &r : rects) {
+            sizes.push_back(r.size);
+        }
+        result.size = pack_rects(sizes, options.pack_options.padding, origins);
+        for (size_t i = 0; i < rects.size(); ++i) {
+            rects[i].origin = origins[i];
+        }
+    } else {
+        std::vector<LayoutRect> free_rects;
+        for (size_t i = 0; i < prev_rects.size(); ++i) {
+            if (!prev_kept[i]) {
+                free_rects.push_back(prev_rects[i]);
+            }
+        }
+        result.size = place_changed_rects(
+            rects, changed, free_rects, options.pack_options.padding, prev_size);
+    }
+    result.size = glm::max(result.size, glm::uvec2(1));
+    result.page_size = result.size;
+    result.atlas_count = 1;
+    result.instanced_meshes = std::count_if(mesh_instance_count.begin(),
+                                            mesh_instance_count.end(),
+                                            [](const size_t n) { return n > 1; });
+
+    result.instance_regions.resize(instances.size());
+    for (size_t i = 0; i < instances.size(); ++i) {
+        auto &region = result.instance_regions[i];
+        region.uv_offset = glm::vec2(rects[i].origin) / glm::vec2(result.size);
+        region.uv_scale = glm::vec2(rects[i].size) / glm::vec2(result.size);
+    }
+    std::cout << "Incremental atlas: re-charted " << result.recharted_meshes << " of "
+              << meshes.size() << " meshes, kept " << kept << " of " << instances.size()
+              << " instance regions\n";
+
+    std::vector<GeometryRemap> remaps;
+    for (auto &c : charts) {
+        std::move(c.remaps.begin(), c.remaps.end(), std::back_inserter(remaps));
+    }
+    charts.clear();
+    write_layout(layout_file, layout_hasher.h, result.size, rects);
+    if (!cache_file.empty()) {
+        write_cached_unwrap(cache_file, key, result, remaps);
+    }
+    apply_remaps(meshes, remaps, result, options.mesh_unwrapped);
+    return result;
+}
+
+}
+
+void set_fast_atlas_options(AtlasOptions &options)
+{
+    options.chart_options.maxIterations = 1;
+    options.pack_options.bruteForce = false;
+    options.pack_options.blockAlign = true;
+}
+
+uint32_t atlas_thread_count()
+{
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+uint64_t atlas_cache_key(const std::vector<Mesh> &meshes,
+                         const std::vector<Instance> &instances,
+                         const AtlasOptions &options)
+{
+    Hasher hasher;
+    hasher.add(ATLAS_CACHE_VERSION);
+    for (const auto &m : meshes) {
+        hasher.add(m.geometries.size());
+        for (const auto &g : m.geometries) {
+            hash_array(hasher, g.vertex_data());
+            hash_array(hasher, g.normal_data());
+            hash_array(hasher, g.uv_data());
+            hash_array(hasher, g.lightmap_uv_data());
+            hash_array(hasher, g.index_data());
+        }
+    }
+    // Only the mesh each instance uses changes the unwrap, not its transform
+    hasher.add(instances.size());
+    for (const auto &inst : instances) {
+        hasher.add(uint64_t(inst.mesh_id));
+    }
+    hash_atlas_options(hasher, options);
+    return hasher.h;
+}
+
+void hash_atlas_options(Hasher &hasher, const AtlasOptions &options)
+{
+    // Hash the options field by field to avoid hashing struct padding
+    const auto &c = options.chart_options;
+    hasher.add(c.maxChartArea);
+    hasher.add(c.maxBoundaryLength);
+    hasher.add(c.normalDeviationWeight);
+    hasher.add(c.roundnessWeight);
+    hasher.add(c.straightnessWeight);
+    hasher.add(c.normalSeamWeight);
+    hasher.add(c.textureSeamWeight);
+    hasher.add(c.maxCost);
+    hasher.add(c.maxIterations);
+
+    const auto &p = options.pack_options;
+    hasher.add(p.bilinear);
+    hasher.add(p.blockAlign);
+    hasher.add(p.bruteForce);
+    hasher.add(p.maxChartSize);
+    hasher.add(p.padding);
+    hasher.add(p.texelsPerUnit);
+    hasher.add(p.resolution);
+    hasher.add(options.incremental);
+    hasher.add(options.texel_budget);
+}
+
+AtlasResult unwrap_meshes(std::vector<Mesh> &meshes,
+                          const std::vector<Instance> &instances,
+                          const AtlasOptions &options)
+{
+    TRACE_SCOPE("Unwrap Meshes");
+    for (const auto &m : meshes) {
+        for (const auto &g : m.geometries) {
+            if (g.normal_data().empty()) {
+                std::cout << "Normals are required on all objects\n";
+                throw std::runtime_error("Normals are required on all objects");
+            }
+        }
+    }
+
+    AtlasResult result;
+    uint64_t key = 0;
+    std::string cache_file;
+    if (!options.cache_dir.empty()) {
+        key = atlas_cache_key(meshes, instances, options);
+        result.cache_key = key;
+        cache_file = cache_file_name(options.cache_dir, "xatlas_", key);
+        std::vector<GeometryRemap> remaps;
+        if (load_cached_unwrap(cache_file, key, meshes, instances.size(), result, remaps)) {
+            std::cout << "Loaded atlas from cache " << cache_file << "\n";
+            apply_remaps(meshes, remaps, result, options.mesh_unwrapped);
+            return result;
+        }
+    }
+
+    if (options.incremental) {
+        if (!options.cache_dir.empty()) {
+            return unwrap_incremental(meshes, instances, options, key, cache_file);
+        }
+        std::cout << "Warning: the incremental unwrap needs an atlas cache directory, "
+                  << "generating the whole atlas\n";
+    }
+
+    // Meshes used by a single instance are unwrapped together in place, the rest get an
+    // unwrap of their own that's copied for each instance. Meshes with lightmap uvs keep
+    // them as their own unwrap and are placed like the instanced meshes
+    std::vector<std::vector<size_t>> mesh_instances(meshes.size());
+    for (size_t i = 0; i < instances.size(); ++i) {
+        mesh_instances[instances[i].mesh_id].push_back(i);
+    }
+    std::vector<const Geometry *> shared_geometries;
+    std::vector<size_t> instanced_meshes;
+    std::vector<bool> lightmap_uv_meshes(meshes.size(), false);
+    size_t num_lightmap_uv_meshes = 0;
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        if (has_lightmap_uvs(meshes[i])) {
+            lightmap_uv_meshes[i] = true;
+            ++num_lightmap_uv_meshes;
+        } else if (mesh_instances[i].size() > 1) {
+            instanced_meshes.push_back(i);
+        } else {
+            for (const auto &g : meshes[i].geometries) {
+                shared_geometries.push_back(&g);
+            }
+        }
+    }
+
+    if (num_lightmap_uv_meshes > 0) {
+        std::cout << "Using the lightmap uvs of " << num_lightmap_uv_meshes << " of "
+                  << meshes.size() << " meshes\n";
+    }
+    std::cout << "Generating atlas\n";
+    float texels_per_unit = options.pack_options.texelsPerUnit;
+    // The shared atlas gets the share of the texel budget of its fraction of the instances'
+    // surface area, the instanced meshes are unwrapped at the same density
+    uint64_t shared_budget = 0;
+    if (options.texel_budget > 0 && texels_per_unit <= 0.f) {
+        double shared_area = 0.0;
+        double total_area = 0.0;
+        for (size_t i = 0; i < meshes.size(); ++i) {
+            const double area = mesh_surface_area(meshes[i]) * mesh_instances[i].size();
+            total_area += area;
+            if (mesh_instances[i].size() <= 1 && !lightmap_uv_meshes[i]) {
+                shared_area += area;
+            }
+        }
+        if (shared_geometries.empty()) {
+            texels_per_unit = budget_texels_per_unit(options.texel_budget, total_area);
+        } else {
+            shared_budget = std::max(
+                uint64_t(options.texel_budget * (shared_area / std::max(total_area, 1e-20))),
+                uint64_t(1));
+        }
+    }
+    AtlasPtr shared_atlas;
+    if (!shared_geometries.empty()) {
+        shared_atlas = generate_atlas(
+            shared_geometries, options, options.pack_options, shared_budget);
+        if (!shared_atlas) {
+            std::cout << "Atlas generation cancelled\n";
+            result.cancelled = true;
+            return result;
+        }
+        // Lay out multiple pages in a roughly square grid so they don't overlap
+        result.chart_count = shared_atlas->chartCount;
+        result.atlas_count = std::max(shared_atlas->atlasCount, 1u);
+        result.page_size = glm::uvec2(shared_atlas->width, shared_atlas->height);
+        result.page_grid.x = static_cast<uint32_t>(
+            std::ceil(std::sqrt(static_cast<float>(result.atlas_count))));
+        result.page_grid.y =
+            (result.atlas_count + result.page_grid.x - 1) / result.page_grid.x;
+        texels_per_unit = shared_atlas->texelsPerUnit;
+    }
+
+    // Each instanced mesh is unwrapped to a single page at the same texel density as the
+    // shared atlas, its copies are packed around the shared pages below
+    std::vector<AtlasPtr> instanced_atlases;
+    for (const auto &mesh_id : instanced_meshes) {
+        std::vector<const Geometry *> geometries;
+        for (const auto &g : meshes[mesh_id].geometries) {
+            geometries.push_back(&g);
+        }
+        xatlas::PackOptions pack_options = options.pack_options;
+        pack_options.resolution = 0;
+        pack_options.texelsPerUnit = texels_per_unit;
+        AtlasPtr atlas = generate_atlas(geometries, options, pack_options);
+        if (!atlas) {
+            std::cout << "Atlas generation cancelled\n";
+            result.cancelled = true;
+            return result;
+        }
+        if (texels_per_unit <= 0.f) {
+            texels_per_unit = atlas->texelsPerUnit;
+        }
+        result.chart_count += atlas->chartCount * mesh_instances[mesh_id].size();
+        instanced_atlases.push_back(std::move(atlas));
+    }
+    result.instanced_meshes = instanced_meshes.size();
+
+    // The lightmap uvs are sized for the same density, estimated if nothing was charted
+    std::vector<MeshCharts> lightmap_charts(meshes.size());
+    if (num_lightmap_uv_meshes > 0 && texels_per_unit <= 0.f) {
+        texels_per_unit =
+            static_cast<float>(estimate_texels_per_unit(meshes, instances, options));
+    }
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        if (lightmap_uv_meshes[i]) {
+            lightmap_charts[i] = lightmap_uv_charts(meshes[i], texels_per_unit);
+        }
+    }
+
+    // The shared pages are packed as a single block, followed by each instance's region
+    const glm::uvec2 shared_size = result.page_size * result.page_grid;
+    std::vector<glm::uvec2> rect_sizes;
+    if (shared_atlas) {
+        rect_sizes.push_back(shared_size);
+    }
+    for (size_t i = 0; i < instanced_meshes.size(); ++i) {
+        const glm::uvec2 size(instanced_atlases[i]->width, instanced_atlases[i]->height);
+        rect_sizes.insert(rect_sizes.end(), mesh_instances[instanced_meshes[i]].size(), size);
+    }
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        if (lightmap_uv_meshes[i]) {
+            rect_sizes.insert(
+                rect_sizes.end(), mesh_instances[i].size(), lightmap_charts[i].size);
+        }
+    }
+    std::vector<glm::uvec2> rect_origins;
+    if (instanced_meshes.empty() && num_lightmap_uv_meshes == 0) {
+        result.size = shared_size;
+        rect_origins.push_back(glm::uvec2(0));
+    } else {
+        result.size = pack_rects(rect_sizes, options.pack_options.padding, rect_origins);
+    }
+    if (!shared_atlas) {
+        result.atlas_count = 1;
+        result.page_size = result.size;
+    }
+
+    result.instance_regions.resize(instances.size());
+    size_t rect_id = shared_atlas ? 1 : 0;
+    for (size_t i = 0; i < instanced_meshes.size(); ++i) {
+        const glm::vec2 unwrap_size(instanced_atlases[i]->width, instanced_atlases[i]->height);
+        for (const auto &inst : mesh_instances[instanced_meshes[i]]) {
+            auto &region = result.instance_regions[inst];
+            region.uv_offset = glm::vec2(rect_origins[rect_id++]) / glm::vec2(result.size);
+            region.uv_scale = unwrap_size / glm::vec2(result.size);
+        }
+    }
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        if (!lightmap_uv_meshes[i]) {
+            continue;
+        }
+        for (const auto &inst : mesh_instances[i]) {
+            auto &region = result.instance_regions[inst];
+            region.uv_offset = glm::vec2(rect_origins[rect_id++]) / glm::vec2(result.size);
+            region.uv_scale = glm::vec2(lightmap_charts[i].size) / glm::vec2(result.size);
+        }
+    }
+
+    // Replace the mesh data with the atlas mesh data. The shared geometry is placed in the
+    // shared block, the instanced geometry's uvs are normalized to its own unwrap
+    TRACE_SCOPE("Atlas Remap");
+    // The xatlas meshes to read back into each remap, which are read in parallel
+    struct AtlasMeshRead {
+        size_t remap;
+        const xatlas::Mesh *mesh;
+        const AtlasResult *pages;
+        glm::vec2 origin;
+        glm::vec2 size;
+    };
+    std::vector<GeometryRemap> remaps;
+    std::vector<AtlasMeshRead> reads;
+    // The single page of each instanced mesh's unwrap, a deque keeps them in place
+    std::deque<AtlasResult> unwrap_pages;
+    size_t shared_id = 0;
+    size_t instanced_id = 0;
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        if (lightmap_uv_meshes[i]) {
+            std::move(lightmap_charts[i].remaps.begin(),
+                      lightmap_charts[i].remaps.end(),
+                      std::back_inserter(remaps));
+        } else if (mesh_instances[i].size() > 1) {
+            const auto &atlas = instanced_atlases[instanced_id++];
+            unwrap_pages.emplace_back();
+            unwrap_pages.back().page_size = glm::uvec2(atlas->width, atlas->height);
+            AtlasMeshRead read;
+            read.pages = &unwrap_pages.back();
+            read.origin = glm::vec2(0.f);
+            read.size = glm::vec2(unwrap_pages.back().page_size);
+            for (uint32_t j = 0; j < atlas->meshCount; ++j) {
+                read.remap = remaps.size();
+                read.mesh = &atlas->meshes[j];
+                reads.push_back(read);
+                remaps.emplace_back();
+            }
+        } else {
+            AtlasMeshRead read;
+            read.pages = &result;
+            read.origin = glm::vec2(rect_origins[0]);
+            read.size = glm::vec2(result.size);
+            for (size_t j = 0; j < meshes[i].geometries.size(); ++j) {
+                read.remap = remaps.size();
+                read.mesh = &shared_atlas->meshes[shared_id++];
+                reads.push_back(read);
+                remaps.emplace_back();
+            }
+        }
+    }
+    parallel_tasks(reads.size(), [&](size_t r) {
+        const AtlasMeshRead &read = reads[r];
+        remaps[read.remap] = read_atlas_mesh(*read.mesh, *read.pages, read.origin, read.size);
+    });
+    // The xatlas output isn't needed once it's been read back
+    shared_atlas.reset();
+    instanced_atlases.clear();
+
+    // The cache is written before the remaps are applied and released
+    if (!cache_file.empty()) {
+        write_cached_unwrap(cache_file, key, result, remaps);
+    }
+    apply_remaps(meshes, remaps, result, options.mesh_unwrapped);
+    return result;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "mesh.h"
+#include "util.h"
+#include "xatlas.h"
+
+/* Called with the xatlas stage being run and its progress in [0, 100]. May be called
+ * from any of the xatlas worker threads. Return false to cancel the unwrap
+ */
+using AtlasProgressFn =
+    std::function<bool(xatlas::ProgressCategory::Enum category, int progress)>;
+
+struct AtlasResult;
+
+/* Called with the finished atlas and each mesh once its geometry has been replaced with the
+ * atlas geometry, in mesh order on the thread running the unwrap. The mesh's geometry may
+ * be moved out, e.g. to upload it while the next meshes are remapped
+ */
+using AtlasMeshFn =
+    std::function<void(const AtlasResult &result, size_t mesh_id, Mesh &mesh)>;
+
+// Options passed to xatlas when generating the atlas
+struct AtlasOptions {
+    xatlas::ChartOptions chart_options;
+    xatlas::PackOptions pack_options;
+    /* The total atlas texels the texel density is solved for if the pack options don't set
+     * it, disabled if 0. The charts are repacked at the density filling the budget, with
+     * a resolution set a budget of n pages of it gives about n pages
+     */
+    uint64_t texel_budget = 0;
+    // Directory to cache unwrap results in, caching is disabled if empty
+    std::string cache_dir;
+    /* Chart each mesh on its own and cache its charts by the mesh's content, so unwrapping
+     * again after a few meshes are edited only re-charts those. The other meshes keep their
+     * place in the previous layout, and the edited ones are packed into the free space
+     * around them. Requires the cache directory
+     */
+    bool incremental = false;
+    // Names the layout the incremental unwrap keeps stable, e.g. the scene file. Not part
+    // of the cache key
+    std::string layout_name;
+    // Optional progress callback, not part of the cache key
+    AtlasProgressFn progress;
+    // Optional callback taking each unwrapped mesh, not part of the cache key
+    AtlasMeshFn mesh_unwrapped;
+};
+
+/* Where an instance's copy of its mesh's unwrap is placed in the atlas, the atlas uv of
+ * each vertex is uv * uv_scale + uv_offset
+ */
+struct InstanceAtlasRegion {
+    glm::vec2 uv_offset = glm::vec2(0.f);
+    glm::vec2 uv_scale = glm::vec2(1.f);
+};
+
+/* When xatlas produces multiple pages (atlas_count > 1) the pages are laid out in a grid
+ * in the atlas, the uvs are normalized to the full atlas size
+ */
+struct AtlasResult {
+    glm::uvec2 size = glm::uvec2(0);
+    // Size of each page and the number of pages along x and y in the atlas
+    glm::uvec2 page_size = glm::uvec2(0);
+    glm::uvec2 page_grid = glm::uvec2(1);
+    uint32_t chart_count = 0;
+    uint32_t atlas_count = 0;
+    // The number of meshes used by multiple instances, which are unwrapped once on their own
+    // and get a copy of that unwrap for each instance
+    uint32_t instanced_meshes = 0;
+    // The atlas region of each instance, meshes used by a single instance are unwrapped
+    // in place and have the identity region
+    std::vector<InstanceAtlasRegion> instance_regions;
+    // The number of meshes charted by xatlas, the incremental unwrap loads the charts of
+    // unchanged meshes from the cache instead
+    uint32_t recharted_meshes = 0;
+    // The key the unwrap is cached under, 0 if caching is disabled
+    uint64_t cache_key = 0;
+    // If the unwrap was loaded from the cache instead of running xatlas
+    bool from_cache = false;
+    // If the unwrap was cancelled by the progress callback, the meshes are left unchanged
+    bool cancelled = false;
+};
+
+/* Unwrap the meshes with xatlas, replacing their geometry with the atlas geometry. The
+ * uvs are replaced with the normalized atlas coordinates. Meshes used by multiple instances,
+ * or all meshes in an incremental unwrap, are unwrapped on their own instead, with their
+ * uvs normalized to their unwrap, and each instance gets its own region of the atlas to
+ * place a copy of the unwrap in. Meshes with lightmap uvs on all their geometries keep them
+ * as their unwrap, sized for the atlas density, without being charted. All geometries must
+ * have normals. If a cache directory is
+ * set and it contains an unwrap for the same geometry and options it is loaded instead of
+ * running xatlas, otherwise the results are written to the cache. The mesh_unwrapped
+ * callback is run on each mesh as it's remapped, the remap of each mesh is released as soon
+ * as it's applied
+ */
+AtlasResult unwrap_meshes(std::vector<Mesh> &meshes,
+                          const std::vector<Instance> &instances,
+                          const AtlasOptions &options);
+
+/* Set cheap chart and pack options for quick preview unwraps: a single chart growing
+ * iteration, random chart placement and block aligned packing
+ */
+void set_fast_atlas_options(AtlasOptions &options);
+
+// The number of threads xatlas runs its tasks on, xatlas always uses all hardware threads
+uint32_t atlas_thread_count();
+
+// Add the chart and pack options to the hash, the callbacks aren't hashed
+void hash_atlas_options(Hasher &hasher, const AtlasOptions &options);
+
+// Hash the geometry data and atlas options to build the key for the unwrap cache
+uint64_t atlas_cache_key(const std::vector<Mesh> &meshes,
+                         const std::vector<Instance> &instances,
+                         const AtlasOptions &options);
@@ -0,0 +1,269 @@
+#include "atlas_draws.h"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <limits>
+#include "dxr/dx12_utils.h"
+#include "dxr/dxr_utils.h"
+
+#include "cull_draws_cs_embedded_dxil.h"
+
+dxr::DescriptorHeapBuilder geometry_heap_builder(uint32_t num_pools)
+{
+    // Each pool's positions, normals and UVs are consecutive
+    return dxr::DescriptorHeapBuilder().add_srv_array("geometry", 3 * num_pools, 0, 2);
+}
+
+void create_cull_pipeline(ID3D12Device5 *device, BakePipeline &pipeline)
+{
+    pipeline.cull_signature = dxr::RootSignatureBuilder::global()
+                                  .add_constants("cull_info", 0, 8, 0)
+                                  .add_srv("atlas_draws", 0, 0)
+                                  .add_srv("atlas_draw_args", 1, 0)
+                                  .add_uav("culled_args", 0, 0)
+                                  .add_uav("culled_count", 1, 0)
+                                  .create(device);
+    pipeline.cull_pipeline_state = create_compute_pipeline(
+        device, pipeline.cull_signature, cull_draws_cs_dxil, sizeof(cull_draws_cs_dxil));
+}
+
+void build_atlas_draws(ID3D12Device5 *device,
+                       dxr::CommandContext &cmd_ctx,
+                       dxr::UploadRing &upload_ring,
+                       BakeScene &bake_scene,
+                       const std::vector<BakeInstance> &bake_instances)
+{
+    // The draws are grouped by position format since each format has its own pipeline
+    std::array<std::vector<AtlasDraw>, 2> draws;
+    std::array<std::vector<AtlasDrawArgs>, 2> draw_args;
+    // The geometry pools the draws read, in the order of their SRVs in the geometry heap
+    std::vector<dxr::GeometryPool *> pools;
+    for (const auto &batch : bake_scene.mesh_instances) {
+        const auto &geometries = bake_scene.meshes[batch.mesh_id].geometries;
+        for (size_t i = 0; i < geometries.size(); ++i) {
+            const dxr::Geometry &g = geometries[i];
+            const dxr::GeometryPool &pool = *g.pool;
+            const auto &uv_bounds = bake_scene.geometry_uv_bounds[batch.mesh_id][i];
+            const glm::vec2 &uv_lower = uv_bounds[0];
+            const glm::vec2 &uv_upper = uv_bounds[1];
+
+            AtlasDraw draw;
+            draw.position_scale = g.encoding.position_scale;
+            draw.position_offset = g.encoding.position_offset;
+            draw.first_instance = batch.first_instance;
+            auto pool_index = std::find(pools.begin(), pools.end(), g.pool.get());
+            if (pool_index == pools.end()) {
+                pool_index = pools.insert(pools.end(), g.pool.get());
+            }
+            draw.geometry_buffers = 3 * static_cast<uint32_t>(pool_index - pools.begin());
+            draw.position_stride = g.encoding.vertex_stride();
+            glm::vec2 atlas_lower(std::numeric_limits<float>::infinity());
+            glm::vec2 atlas_upper(-std::numeric_limits<float>::infinity());
+            const bool has_uvs = uv_lower.x <= uv_upper.x;
+            for (uint32_t j = 0; j < batch.num_instances && has_uvs; ++j) {
+                const BakeInstance &bi = bake_instances[batch.first_instance + j];
+                const glm::vec2 a = uv_lower * bi.uv_scale + bi.uv_offset;
+                const glm::vec2 b = uv_upper * bi.uv_scale + bi.uv_offset;
+                atlas_lower = glm::min(atlas_lower, glm::min(a, b));
+                atlas_upper = glm::max(atlas_upper, glm::max(a, b));
+            }
+            draw.uv_bounds = glm::vec4(atlas_lower, atlas_upper);
+
+            AtlasDrawArgs args = {};
+            args.vertex_buffers = {
+                D3D12_VERTEX_BUFFER_VIEW{
+                    pool.positions->GetGPUVirtualAddress(),
+                    static_cast<uint32_t>(pool.positions.size()),
+                    g.encoding.vertex_stride(),
+                },
+                D3D12_VERTEX_BUFFER_VIEW{
+                    pool.normals->GetGPUVirtualAddress(),
+                    static_cast<uint32_t>(pool.normals.size()),
+                    sizeof(int16_t) * 2,
+                },
+                D3D12_VERTEX_BUFFER_VIEW{
+                    pool.uvs->GetGPUVirtualAddress(),
+                    static_cast<uint32_t>(pool.uvs.size()),
+                    sizeof(glm::vec2),
+                },
+            };
+            args.index_buffer.BufferLocation = pool.indices->GetGPUVirtualAddress();
+            args.index_buffer.SizeInBytes = pool.indices.size();
+            args.index_buffer.Format = g.encoding.index_format;
+            args.draw.IndexCountPerInstance = g.index_count;
+            args.draw.InstanceCount = batch.num_instances;
+            args.draw.StartIndexLocation = g.first_index;
+            args.draw.BaseVertexLocation = g.base_vertex;
+            args.draw.StartInstanceLocation = 0;
+
+            const size_t group = g.encoding.quantized_positions() ? 1 : 0;
+            draws[group].push_back(draw);
+            draw_args[group].push_back(args);
+        }
+    }
+    bake_scene.num_float_draws = draws[0].size();
+    draws[0].insert(draws[0].end(), draws[1].begin(), draws[1].end());
+    draw_args[0].insert(draw_args[0].end(), draw_args[1].begin(), draw_args[1].end());
+    bake_scene.num_atlas_draws = draws[0].size();
+    for (uint32_t i = 0; i < bake_scene.num_atlas_draws; ++i) {
+        draw_args[0][i].draw_id = i;
+    }
+
+    const size_t draws_size = std::max(draws[0].size(), size_t(1)) * sizeof(AtlasDraw);
+    const size_t args_size = std::max(draw_args[0].size(), size_t(1)) * sizeof(AtlasDrawArgs);
+    dxr::MemoryCategoryScope memory_scope(dxr::MEMORY_INSTANCES);
+    bake_scene.atlas_draws =
+        dxr::Buffer::default(device, draws_size, D3D12_RESOURCE_STATE_COPY_DEST);
+    bake_scene.atlas_draw_args =
+        dxr::Buffer::default(device, args_size, D3D12_RESOURCE_STATE_COPY_DEST);
+    bake_scene.culled_draw_args =
+        dxr::Buffer::default(device,
+                             args_size,
+                             D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT,
+                             D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    bake_scene.culled_draw_count =
+        dxr::Buffer::default(device,
+                             2 * sizeof(uint32_t),
+                             D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT,
+                             D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+    bake_scene.draw_count_reset =
+        dxr::Buffer::default(device, 2 * sizeof(uint32_t), D3D12_RESOURCE_STATE_COPY_DEST);
+
+    bake_scene.geometry_heap =
+        geometry_heap_builder(std::max(pools.size(), size_t(1))).create(device);
+    for (size_t i = 0; i < pools.size(); ++i) {
+        const std::array<dxr::Buffer *, 3> buffers = {
+            &pools[i]->positions, &pools[i]->normals, &pools[i]->uvs};
+        for (size_t j = 0; j < buffers.size(); ++j) {
+            D3D12_SHADER_RESOURCE_VIEW_DESC srv_desc = {0};
+            srv_desc.Format = DXGI_FORMAT_R32_TYPELESS;
+            srv_desc.ViewDimension = D3D12_SRV_DIMENSION_BUFFER;
+            srv_desc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+            srv_desc.Buffer.NumElements = buffers[j]->size() / sizeof(uint32_t);
+            srv_desc.Buffer.Flags = D3D12_BUFFER_SRV_FLAG_RAW;
+            device->CreateShaderResourceView(
+                buffers[j]->get(),
+                &srv_desc,
+                bake_scene.geometry_heap.cpu_desc_handle("geometry", 3 * i + j));
+        }
+    }
+
+    const std::array<uint32_t, 2> zeros = {0, 0};
+    cmd_ctx.begin();
+    upload_ring.upload(cmd_ctx,
+                       bake_scene.atlas_draws,
+                       draws[0].data(),
+                       draws[0].size() * sizeof(AtlasDraw));
+    upload_ring.upload(cmd_ctx,
+                       bake_scene.atlas_draw_args,
+                       draw_args[0].data(),
+                       draw_args[0].size() * sizeof(AtlasDrawArgs));
+    upload_ring.upload(
+        cmd_ctx, bake_scene.draw_count_reset, zeros.data(), zeros.size() * sizeof(uint32_t));
+    {
+        // The arguments are read by the cull pass and ExecuteIndirect
+        std::array<D3D12_RESOURCE_BARRIER, 3> b = {
+            barrier_transition(bake_scene.atlas_draws,
+                               D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE),
+            barrier_transition(bake_scene.atlas_draw_args,
+                               D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE |
+                                   D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT),
+            barrier_transition(bake_scene.draw_count_reset, D3D12_RESOURCE_STATE_COPY_SOURCE)};
+        cmd_ctx.cmd_list->ResourceBarrier(b.size(), b.data());
+    }
+    upload_ring.submit_and_sync(cmd_ctx);
+}
+
+void cull_atlas_draws(ID3D12GraphicsCommandList4 *cmd_list,
+                      BakePipeline &pipeline,
+                      BakeScene &bake_scene,
+                      const glm::uvec2 &atlas_dims,
+                      const D3D12_RECT &tile)
+{
+    if (bake_scene.num_atlas_draws == 0) {
+        return;
+    }
+    {
+        std::array<D3D12_RESOURCE_BARRIER, 2> b = {
+            barrier_transition(bake_scene.culled_draw_args,
+                               D3D12_RESOURCE_STATE_UNORDERED_ACCESS),
+            barrier_transition(bake_scene.culled_draw_count, D3D12_RESOURCE_STATE_COPY_DEST)};
+        cmd_list->ResourceBarrier(b.size(), b.data());
+    }
+    cmd_list->CopyBufferRegion(bake_scene.culled_draw_count.get(),
+                               0,
+                               bake_scene.draw_count_reset.get(),
+                               0,
+                               bake_scene.culled_draw_count.size());
+    {
+        D3D12_RESOURCE_BARRIER b = barrier_transition(bake_scene.culled_draw_count,
+                                                      D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+        cmd_list->ResourceBarrier(1, &b);
+    }
+
+    const std::array<uint32_t, 8> cull_info = {uint32_t(tile.left),
+                                               uint32_t(tile.top),
+                                               uint32_t(tile.right),
+                                               uint32_t(tile.bottom),
+                                               atlas_dims.x,
+                                               atlas_dims.y,
+                                               bake_scene.num_atlas_draws,
+                                               bake_scene.num_float_draws};
+    cmd_list->SetPipelineState(pipeline.cull_pipeline_state.Get());
+    cmd_list->SetComputeRootSignature(pipeline.cull_signature.get());
+    cmd_list->SetComputeRoot32BitConstants(0, cull_info.size(), cull_info.data(), 0);
+    cmd_list->SetComputeRootShaderResourceView(
+        1, bake_scene.atlas_draws->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootShaderResourceView(
+        2, bake_scene.atlas_draw_args->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(
+        3, bake_scene.culled_draw_args->GetGPUVirtualAddress());
+    cmd_list->SetComputeRootUnorderedAccessView(
+        4, bake_scene.culled_draw_count->GetGPUVirtualAddress());
+    cmd_list->Dispatch((bake_scene.num_atlas_draws + 63) / 64, 1, 1);
+
+    std::array<D3D12_RESOURCE_BARRIER, 2> b = {
+        barrier_transition(bake_scene.culled_draw_args,
+                           D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT),
+        barrier_transition(bake_scene.culled_draw_count,
+                           D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT)};
+    cmd_list->ResourceBarrier(b.size(), b.data());
+}
+
+void draw_atlas_geometry(ID3D12GraphicsCommandList4 *cmd_list,
+                         BakeScene &bake_scene,
+                         const AtlasRasterPipeline &pipeline,
+                         bool culled)
+{
+    cmd_list->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    const std::array<ID3D12PipelineState *, 2> pipelines = {
+        pipeline.float_positions.Get(), pipeline.quantized_positions.Get()};
+    const std::array<uint32_t, 3> group_starts = {
+        0, bake_scene.num_float_draws, bake_scene.num_atlas_draws};
+    for (size_t i = 0; i < pipelines.size(); ++i) {
+        const uint32_t num_draws = group_starts[i + 1] - group_starts[i];
+        if (num_draws == 0) {
+            continue;
+        }
+        // The bindless command signature starts at each draw's index buffer view
+        const uint64_t args_offset = group_starts[i] * sizeof(AtlasDrawArgs) +
+                                     (pipeline.bindless ? offsetof(AtlasDrawArgs, index_buffer)
+                                                        : 0);
+        cmd_list->SetPipelineState(pipelines[i]);
+        if (culled) {
+            cmd_list->ExecuteIndirect(pipeline.command_signature.Get(),
+                                      num_draws,
+                                      bake_scene.culled_draw_args.get(),
+                                      args_offset,
+                                      bake_scene.culled_draw_count.get(),
+                                      i * sizeof(uint32_t));
+        } else {
+            cmd_list->ExecuteIndirect(pipeline.command_signature.Get(),
+                                      num_draws,
+                                      bake_scene.atlas_draw_args.get(),
+                                      args_offset,
+                                      nullptr,
+                                      0);
+        }
+    }
+}
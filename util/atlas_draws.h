@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include "ao_bake.h"
+
+// The descriptor heap layout with the raw SRVs of the geometry pools' vertex buffers
+dxr::DescriptorHeapBuilder geometry_heap_builder(uint32_t num_pools);
+
+// Create the bake pipeline's compute pipeline culling the atlas draws to a tile
+void create_cull_pipeline(ID3D12Device5 *device, BakePipeline &pipeline);
+
+/* Build the atlas draws of the bake scene's mesh instances and upload them, along with the
+ * buffers cull_atlas_draws compacts the draws into. The geometry's atlas UV bounds are
+ * taken from the scene meshes, which must be the meshes the bake scene was built from
+ */
+void build_atlas_draws(ID3D12Device5 *device,
+                       dxr::CommandContext &cmd_ctx,
+                       dxr::UploadRing &upload_ring,
+                       BakeScene &bake_scene,
+                       const std::vector<BakeInstance> &bake_instances);
+
+/* Record a compute pass culling the atlas draws to those overlapping the tile, for a
+ * following draw_atlas_geometry with culled set
+ */
+void cull_atlas_draws(ID3D12GraphicsCommandList4 *cmd_list,
+                      BakePipeline &pipeline,
+                      BakeScene &bake_scene,
+                      const glm::uvec2 &atlas_dims,
+                      const D3D12_RECT &tile);
+
+/* Draw all the scene geometry into the atlas, with one instanced draw for each geometry
+ * of each mesh. The draws of each position format are submitted with a single
+ * ExecuteIndirect. If culled is set only the draws kept by cull_atlas_draws are drawn. The
+ * caller binds the instances and atlas draws SRVs
+ */
+void draw_atlas_geometry(ID3D12GraphicsCommandList4 *cmd_list,
+                         BakeScene &bake_scene,
+                         const AtlasRasterPipeline &pipeline,
+                         bool culled);
@@ -0,0 +1,25 @@
+#include "bake_backend.h"
+#include <algorithm>
+#include "trace.h"
+
+BakeTileStats bake_frame(BakeBackend &backend,
+                         const glm::uvec2 &atlas_size,
+                         uint32_t tile_size,
+                         uint32_t frame_id,
+                         const BakeSettings &settings)
+{
+    TRACE_SCOPE("Bake Frame");
+    BakeTileStats frame_stats;
+    for (uint32_t y = 0; y < atlas_size.y; y += tile_size) {
+        for (uint32_t x = 0; x < atlas_size.x; x += tile_size) {
+            const glm::uvec2 origin(x, y);
+            const glm::uvec2 size = glm::min(glm::uvec2(tile_size), atlas_size - origin);
+            const BakeTileStats stats = backend.bake_tile(origin, size, frame_id, settings);
+            frame_stats.rays += stats.rays;
+            frame_stats.hits += stats.hits;
+            frame_stats.active_texels += stats.active_texels;
+            frame_stats.gpu_ms += stats.gpu_ms;
+        }
+    }
+    return frame_stats;
+}
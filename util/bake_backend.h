@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "atlas.h"
+#include "scene.h"
+#include <glm/glm.hpp>
+
+// The AO settings of a bake, shared by the bake tiles of the atlas
+struct BakeSettings {
+    int n_samples = 16;
+    int samples_per_frame = 1;
+    float ao_length = 5.f;
+    /* The SAMPLER_* sample generator of the AO rays, see ao_sampler.h. The backends have no
+     * blue noise tile, so only the LCG, Sobol and R2 samplers are supported
+     */
+    uint32_t sampler_type = 1;
+    // Decorrelates the sample sequences of separate bakes, 0 is the default sequence
+    uint32_t sampler_seed = 0;
+};
+
+struct BakeTileStats {
+    uint64_t rays = 0;
+    uint64_t hits = 0;
+    // The texels which still took samples in the tile
+    uint32_t active_texels = 0;
+    float gpu_ms = 0.f;
+};
+
+/* A backend baking the scene's AO map, the atlas is rasterized and each texel traces
+ * its AO rays with inline ray queries. The bake runs a frame of samples over each tile of
+ * the atlas until all texels have taken n_samples, and the AO is read back once done
+ */
+struct BakeBackend {
+    virtual ~BakeBackend() {}
+
+    virtual std::string name() = 0;
+
+    // The GPU the backend bakes on
+    virtual std::string device_name() = 0;
+
+    /* Upload the unwrapped scene, the meshes' uvs are the atlas uvs and each instance is
+     * placed in the atlas by its region. Resets the accumulated AO
+     */
+    virtual void set_scene(const Scene &scene, const AtlasResult &atlas) = 0;
+
+    // Build the acceleration structures of the scene set, returning the build time in ms
+    virtual double build_accel() = 0;
+
+    /* Bake a frame of samples for the texels in the tile of the atlas, frame_id counts the
+     * frames baked in the tile and the tile's accumulation is reset when it's 0
+     */
+    virtual BakeTileStats bake_tile(const glm::uvec2 &origin,
+                                    const glm::uvec2 &size,
+                                    uint32_t frame_id,
+                                    const BakeSettings &settings) = 0;
+
+    // Read back the AO of each texel of the atlas in [0, 1], row by row
+    virtual std::vector<float> readback() = 0;
+};
+
+/* Bake a frame of samples over each tile of the atlas, each tile's frame_id is the frame's
+ * so the tiles reset together. Returns the stats summed over the tiles
+ */
+BakeTileStats bake_frame(BakeBackend &backend,
+                         const glm::uvec2 &atlas_size,
+                         uint32_t tile_size,
+                         uint32_t frame_id,
+                         const BakeSettings &settings);
@@ -0,0 +1,337 @@
+#include "bake_job.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include "json.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+using json = nlohmann::json;
+
+namespace {
+
+const uint32_t BAKE_TILE_RESULT_MAGIC = 0x52544B42; // BKTR
+
+struct BakeTileResultHeader {
+    uint32_t magic = BAKE_TILE_RESULT_MAGIC;
+    uint32_t tile_id = 0;
+    uint64_t job_id = 0;
+    uint32_t origin_x = 0;
+    uint32_t origin_y = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t ao_pixel_size = 0;
+    uint32_t pad = 0;
+    uint64_t rays = 0;
+    uint64_t hits = 0;
+    double gpu_ms = 0.0;
+};
+
+bool file_exists(const std::string &fname)
+{
+    std::ifstream fin(fname.c_str(), std::ios::binary);
+    return fin.good();
+}
+
+// Create the file with the contents, failing if it already exists
+bool create_file_exclusive(const std::string &fname, const std::string &contents)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(fname.c_str(),
+                              GENERIC_WRITE,
+                              FILE_SHARE_READ,
+                              nullptr,
+                              CREATE_NEW,
+                              FILE_ATTRIBUTE_NORMAL,
+                              nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    DWORD written = 0;
+    WriteFile(file, contents.data(), DWORD(contents.size()), &written, nullptr);
+    CloseHandle(file);
+#else
+    const int file = open(fname.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (file == -1) {
+        return false;
+    }
+    const ssize_t written = write(file, contents.data(), contents.size());
+    (void)written;
+    close(file);
+#endif
+    return true;
+}
+
+std::string read_file(const std::string &fname)
+{
+    std::ifstream fin(fname.c_str(), std::ios::binary);
+    if (!fin) {
+        return "";
+    }
+    std::stringstream ss;
+    ss << fin.rdbuf();
+    return ss.str();
+}
+
+/* Write the file through a temporary and rename it in place, replacing any existing file. The
+ * temporary is named by the writer, so separate processes writing the file don't collide
+ */
+void write_file_replace(const std::string &fname, const std::string &contents)
+{
+    const std::string tmp = fname + "." + bake_worker_name() + ".tmp";
+    {
+        std::ofstream fout(tmp.c_str(), std::ios::binary);
+        fout.write(contents.data(), contents.size());
+        if (!fout) {
+            throw std::runtime_error("Failed to write " + tmp);
+        }
+    }
+#ifdef _WIN32
+    const bool ok = MoveFileExA(tmp.c_str(), fname.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    const bool ok = std::rename(tmp.c_str(), fname.c_str()) == 0;
+#endif
+    if (!ok) {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("Failed to write " + fname);
+    }
+}
+
+}
+
+std::vector<glm::uvec2> BakeJob::tiles() const
+{
+    std::vector<glm::uvec2> origins;
+    for (uint32_t y = 0; y < atlas_size.y; y += tile_size) {
+        for (uint32_t x = 0; x < atlas_size.x; x += tile_size) {
+            origins.push_back(glm::uvec2(x, y));
+        }
+    }
+    return origins;
+}
+
+BakeJobQueue::BakeJobQueue(const std::string &dir) : dir(dir) {}
+
+std::string BakeJobQueue::job_file() const
+{
+    return dir + "/job.json";
+}
+
+std::string BakeJobQueue::tile_file(uint64_t job_id,
+                                    uint32_t tile_id,
+                                    const std::string &ext) const
+{
+    std::stringstream ss;
+    ss << dir << "/" << std::hex << std::setw(16) << std::setfill('0') << job_id << "_tile"
+       << std::dec << tile_id << "." << ext;
+    return ss.str();
+}
+
+std::string BakeJobQueue::done_file(uint64_t job_id) const
+{
+    std::stringstream ss;
+    ss << dir << "/" << std::hex << std::setw(16) << std::setfill('0') << job_id << ".done";
+    return ss.str();
+}
+
+const std::string &BakeJobQueue::directory() const
+{
+    return dir;
+}
+
+void BakeJobQueue::publish(const BakeJob &job)
+{
+    json j;
+    j["job_id"] = job.job_id;
+    j["scene_cache_key"] = job.scene_cache_key;
+    j["occluder_proxy_ratio"] = job.occluder_proxy_ratio;
+    j["occluder_near_field"] = job.occluder_near_field;
+    j["occluder_class_fields"] = job.occluder_class_fields;
+    j["occluder_small_size"] = job.occluder_small_size;
+    j["occluder_tiny_size"] = job.occluder_tiny_size;
+    j["atlas_size"] = {job.atlas_size.x, job.atlas_size.y};
+    j["tile_size"] = job.tile_size;
+    j["n_samples"] = job.n_samples;
+    j["samples_per_frame"] = job.samples_per_frame;
+    j["ao_length"] = job.ao_length;
+    j["sampler_type"] = job.sampler_type;
+    j["sampler_seed"] = job.sampler_seed;
+    j["ao_format"] = job.ao_format;
+    write_file_replace(job_file(), j.dump(4));
+}
+
+bool BakeJobQueue::read_job(BakeJob &job) const
+{
+    const std::string contents = read_file(job_file());
+    if (contents.empty()) {
+        return false;
+    }
+    try {
+        const json j = json::parse(contents);
+        job.job_id = j.at("job_id").get<uint64_t>();
+        job.scene_cache_key = j.at("scene_cache_key").get<uint64_t>();
+        job.occluder_proxy_ratio = j.at("occluder_proxy_ratio").get<float>();
+        job.occluder_near_field = j.at("occluder_near_field").get<float>();
+        job.occluder_class_fields =
+            j.at("occluder_class_fields").get<std::array<uint32_t, 4>>();
+        job.occluder_small_size = j.at("occluder_small_size").get<float>();
+        job.occluder_tiny_size = j.at("occluder_tiny_size").get<float>();
+        job.atlas_size = glm::uvec2(j.at("atlas_size")[0].get<uint32_t>(),
+                                    j.at("atlas_size")[1].get<uint32_t>());
+        job.tile_size = j.at("tile_size").get<uint32_t>();
+        job.n_samples = j.at("n_samples").get<int>();
+        job.samples_per_frame = j.at("samples_per_frame").get<int>();
+        job.ao_length = j.at("ao_length").get<float>();
+        job.sampler_type = j.at("sampler_type").get<uint32_t>();
+        job.sampler_seed = j.at("sampler_seed").get<uint32_t>();
+        job.ao_format = j.at("ao_format").get<uint32_t>();
+    } catch (const json::exception &) {
+        return false;
+    }
+    return true;
+}
+
+bool BakeJobQueue::claim_tile(const BakeJob &job, uint32_t tile_id, const std::string &worker)
+{
+    if (has_result(job, tile_id)) {
+        return false;
+    }
+    return create_file_exclusive(tile_file(job.job_id, tile_id, "claim"), worker + " 0");
+}
+
+bool BakeJobQueue::heartbeat(const BakeJob &job,
+                             uint32_t tile_id,
+                             const std::string &worker,
+                             uint32_t beat)
+{
+    const std::string claim = read_claim(job, tile_id);
+    if (claim.compare(0, worker.size() + 1, worker + " ") != 0) {
+        return false;
+    }
+    // The claim is rewritten in place, replacing it could briefly release it
+    std::fstream fout(tile_file(job.job_id, tile_id, "claim").c_str(),
+                      std::ios::in | std::ios::out | std::ios::binary);
+    const std::string contents = worker + " " + std::to_string(beat);
+    fout.write(contents.data(), contents.size());
+    return bool(fout);
+}
+
+std::string BakeJobQueue::read_claim(const BakeJob &job, uint32_t tile_id) const
+{
+    return read_file(tile_file(job.job_id, tile_id, "claim"));
+}
+
+void BakeJobQueue::release_claim(const BakeJob &job, uint32_t tile_id)
+{
+    std::remove(tile_file(job.job_id, tile_id, "claim").c_str());
+}
+
+bool BakeJobQueue::has_result(const BakeJob &job, uint32_t tile_id) const
+{
+    return file_exists(tile_file(job.job_id, tile_id, "result"));
+}
+
+void BakeJobQueue::write_result(const BakeJob &job, const BakeTileResult &result)
+{
+    if (has_result(job, result.tile_id)) {
+        return;
+    }
+    BakeTileResultHeader header;
+    header.tile_id = result.tile_id;
+    header.job_id = job.job_id;
+    header.origin_x = result.origin.x;
+    header.origin_y = result.origin.y;
+    header.width = result.size.x;
+    header.height = result.size.y;
+    header.ao_pixel_size = result.ao_pixel_size;
+    header.rays = result.rays;
+    header.hits = result.hits;
+    header.gpu_ms = result.gpu_ms;
+
+    const size_t accum_bytes = result.accum.size() * sizeof(glm::vec2);
+    std::string contents(sizeof(header) + result.ao_pixels.size() + accum_bytes, '\0');
+    std::memcpy(&contents[0], &header, sizeof(header));
+    std::memcpy(&contents[sizeof(header)], result.ao_pixels.data(), result.ao_pixels.size());
+    std::memcpy(&contents[sizeof(header) + result.ao_pixels.size()],
+                result.accum.data(),
+                accum_bytes);
+    // Tiles baked twice after a requeue have the same result, so either can be kept
+    write_file_replace(tile_file(job.job_id, result.tile_id, "result"), contents);
+}
+
+bool BakeJobQueue::read_result(const BakeJob &job,
+                               uint32_t tile_id,
+                               BakeTileResult &result) const
+{
+    const std::string contents = read_file(tile_file(job.job_id, tile_id, "result"));
+    BakeTileResultHeader header;
+    if (contents.size() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, contents.data(), sizeof(header));
+    const size_t num_texels = size_t(header.width) * header.height;
+    const size_t ao_bytes = num_texels * header.ao_pixel_size;
+    if (header.magic != BAKE_TILE_RESULT_MAGIC || header.job_id != job.job_id ||
+        header.tile_id != tile_id ||
+        contents.size() != sizeof(header) + ao_bytes + num_texels * sizeof(glm::vec2)) {
+        return false;
+    }
+
+    result.tile_id = tile_id;
+    result.origin = glm::uvec2(header.origin_x, header.origin_y);
+    result.size = glm::uvec2(header.width, header.height);
+    result.ao_pixel_size = header.ao_pixel_size;
+    result.rays = header.rays;
+    result.hits = header.hits;
+    result.gpu_ms = header.gpu_ms;
+    result.ao_pixels.resize(ao_bytes);
+    std::memcpy(result.ao_pixels.data(), contents.data() + sizeof(header), ao_bytes);
+    result.accum.resize(num_texels);
+    std::memcpy(result.accum.data(),
+                contents.data() + sizeof(header) + ao_bytes,
+                num_texels * sizeof(glm::vec2));
+    return true;
+}
+
+void BakeJobQueue::finish(const BakeJob &job)
+{
+    write_file_replace(done_file(job.job_id), "");
+    const size_t num_tiles = job.tiles().size();
+    for (uint32_t i = 0; i < num_tiles; ++i) {
+        std::remove(tile_file(job.job_id, i, "claim").c_str());
+        std::remove(tile_file(job.job_id, i, "result").c_str());
+    }
+}
+
+bool BakeJobQueue::finished(const BakeJob &job) const
+{
+    return file_exists(done_file(job.job_id));
+}
+
+std::string bake_worker_name()
+{
+#ifdef _WIN32
+    char host[MAX_COMPUTERNAME_LENGTH + 1] = {0};
+    DWORD host_size = sizeof(host);
+    if (!GetComputerNameA(host, &host_size)) {
+        std::strcpy(host, "unknown");
+    }
+    return std::string(host) + "-" + std::to_string(GetCurrentProcessId());
+#else
+    char host[256] = {0};
+    if (gethostname(host, sizeof(host) - 1) != 0) {
+        std::strcpy(host, "unknown");
+    }
+    return std::string(host) + "-" + std::to_string(getpid());
+#endif
+}
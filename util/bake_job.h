@@ -0,0 +1,112 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+/* A bake distributed across multiple machines sharing a job directory, e.g. a network
+ * share. The coordinator writes the unwrapped scene cache and the job to the directory,
+ * and the workers map the cache, claim tiles one at a time and write back each tile's
+ * result for the coordinator to merge. The texels take their samples by their atlas
+ * coordinates and each tile is baked from frame 0, so a tile's result doesn't depend on
+ * the node which baked it and the merged map matches a single machine's tiled bake
+ */
+struct BakeJob {
+    // Unique to each bake, prefixes the job's tile files so stale files are never read
+    uint64_t job_id = 0;
+    // The key of the scene cache in the job directory
+    uint64_t scene_cache_key = 0;
+    // The occluder proxies are simplified when the cache is loaded, so aren't in the cache
+    float occluder_proxy_ratio = 0.f;
+    float occluder_near_field = 1.f;
+    // The occluder classes are assigned when the cache is loaded, like the proxies
+    std::array<uint32_t, 4> occluder_class_fields = {{3, 3, 3, 3}};
+    float occluder_small_size = 0.05f;
+    float occluder_tiny_size = 0.01f;
+    glm::uvec2 atlas_size = glm::uvec2(0);
+    uint32_t tile_size = 0;
+    int n_samples = 0;
+    int samples_per_frame = 0;
+    float ao_length = 0.f;
+    uint32_t sampler_type = 0;
+    uint32_t sampler_seed = 0;
+    // The DXGI_FORMAT of the AO image
+    uint32_t ao_format = 0;
+
+    // The origins of the job's tiles, the tile IDs index them
+    std::vector<glm::uvec2> tiles() const;
+};
+
+// The baked AO and accumulation of a tile, tightly packed in the tile's rows
+struct BakeTileResult {
+    uint32_t tile_id = 0;
+    glm::uvec2 origin = glm::uvec2(0);
+    glm::uvec2 size = glm::uvec2(0);
+    uint32_t ao_pixel_size = 0;
+    std::vector<uint8_t> ao_pixels;
+    std::vector<glm::vec2> accum;
+    uint64_t rays = 0;
+    uint64_t hits = 0;
+    double gpu_ms = 0.0;
+};
+
+/* The job directory's files: the job description, each tile's claim and result, and the
+ * marker written once the job completes. A tile is claimed by exclusively creating its
+ * claim file, and the claim's owner bumps the heartbeat in it while baking so the
+ * coordinator can requeue the tiles of lost workers by releasing their claims. Results
+ * are written to a temporary file and renamed in place, so a partial result is never read
+ */
+class BakeJobQueue {
+    std::string dir;
+
+    std::string job_file() const;
+
+    std::string tile_file(uint64_t job_id, uint32_t tile_id, const std::string &ext) const;
+
+    std::string done_file(uint64_t job_id) const;
+
+public:
+    explicit BakeJobQueue(const std::string &dir);
+
+    const std::string &directory() const;
+
+    // Write the job description, making the job visible to the workers
+    void publish(const BakeJob &job);
+
+    // Read the current job description, returns false if there's none
+    bool read_job(BakeJob &job) const;
+
+    // Try to claim the tile for the worker, returns false if it's already claimed
+    bool claim_tile(const BakeJob &job, uint32_t tile_id, const std::string &worker);
+
+    /* Bump the heartbeat of the worker's claim on the tile, returns false if the claim was
+     * released or taken over by another worker
+     */
+    bool heartbeat(const BakeJob &job,
+                   uint32_t tile_id,
+                   const std::string &worker,
+                   uint32_t beat);
+
+    // The contents of the tile's claim, empty if it's unclaimed
+    std::string read_claim(const BakeJob &job, uint32_t tile_id) const;
+
+    // Release the claim on the tile so another worker can take it
+    void release_claim(const BakeJob &job, uint32_t tile_id);
+
+    bool has_result(const BakeJob &job, uint32_t tile_id) const;
+
+    // Write the tile's result, if another worker already finished the tile it's kept
+    void write_result(const BakeJob &job, const BakeTileResult &result);
+
+    // Read the tile's result, returns false if there's no complete result for the job
+    bool read_result(const BakeJob &job, uint32_t tile_id, BakeTileResult &result) const;
+
+    // Mark the job complete for the workers to exit, and remove its tile files
+    void finish(const BakeJob &job);
+
+    bool finished(const BakeJob &job) const;
+};
+
+// A name for this process unique among the job's workers, from its host name and PID
+std::string bake_worker_name();
@@ -0,0 +1,423 @@
+#include "bake_server.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+#include "json.hpp"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using json = nlohmann::json;
+
+namespace {
+
+// Requests and replies are small, larger lengths mean a client isn't speaking the protocol
+const uint32_t max_message_size = 1024 * 1024;
+
+bool is_absolute_path(const std::string &path)
+{
+#ifdef _WIN32
+    return path.size() >= 2 && (path[1] == ':' || (path[0] == '/' && path[1] == '/'));
+#else
+    return !path.empty() && path[0] == '/';
+#endif
+}
+
+std::string absolute_path(const std::string &path)
+{
+    if (path.empty() || is_absolute_path(path)) {
+        return path;
+    }
+#ifdef _WIN32
+    char full[MAX_PATH] = {0};
+    if (!_fullpath(full, path.c_str(), MAX_PATH)) {
+        return path;
+    }
+    std::string result = full;
+    std::replace(result.begin(), result.end(), '\\', '/');
+    return result;
+#else
+    char cwd[4096] = {0};
+    if (!getcwd(cwd, sizeof(cwd))) {
+        return path;
+    }
+    return std::string(cwd) + "/" + path;
+#endif
+}
+
+#ifndef _WIN32
+std::string socket_path(const std::string &name)
+{
+    const char *tmp = std::getenv("TMPDIR");
+    return std::string(tmp && *tmp ? tmp : "/tmp") + "/" + name + ".sock";
+}
+
+bool fill_socket_address(const std::string &path, sockaddr_un &addr)
+{
+    addr = sockaddr_un();
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    path.copy(addr.sun_path, path.size());
+    return true;
+}
+#endif
+
+}
+
+std::string encode_bake_request(const BakeRequest &request)
+{
+    json j;
+    j["scene"] = request.scene_file;
+    j["output"] = request.bake_output;
+    if (!request.bent_normal_output.empty()) {
+        j["bent_normals"] = request.bent_normal_output;
+    }
+    if (!request.hit_distance_output.empty()) {
+        j["hit_distance"] = request.hit_distance_output;
+    }
+    if (!request.direct_light_output.empty()) {
+        j["direct_light"] = request.direct_light_output;
+    }
+    if (request.n_samples >= 0) {
+        j["samples"] = request.n_samples;
+    }
+    if (request.samples_per_frame >= 0) {
+        j["samples_per_frame"] = request.samples_per_frame;
+    }
+    if (request.ao_length >= 0.f) {
+        j["ao_length"] = request.ao_length;
+    }
+    if (!request.sampler.empty()) {
+        j["sampler"] = request.sampler;
+    }
+    if (request.sampler_seed >= 0) {
+        j["sampler_seed"] = request.sampler_seed;
+    }
+    if (!request.ao_format.empty()) {
+        j["ao_format"] = request.ao_format;
+    }
+    if (request.gutter >= 0) {
+        j["gutter"] = request.gutter;
+    }
+    return j.dump();
+}
+
+BakeRequest decode_bake_request(const std::string &message)
+{
+    BakeRequest request;
+    try {
+        const json j = json::parse(message);
+        request.scene_file = j.at("scene").get<std::string>();
+        request.bake_output = j.at("output").get<std::string>();
+        request.bent_normal_output = j.value("bent_normals", std::string());
+        request.hit_distance_output = j.value("hit_distance", std::string());
+        request.direct_light_output = j.value("direct_light", std::string());
+        request.n_samples = j.value("samples", -1);
+        request.samples_per_frame = j.value("samples_per_frame", -1);
+        request.ao_length = j.value("ao_length", -1.f);
+        request.sampler = j.value("sampler", std::string());
+        request.sampler_seed = j.value("sampler_seed", int64_t(-1));
+        request.ao_format = j.value("ao_format", std::string());
+        request.gutter = j.value("gutter", -1);
+    } catch (const json::exception &e) {
+        throw std::runtime_error(std::string("Invalid bake request: ") + e.what());
+    }
+    if (request.scene_file.empty() || request.bake_output.empty()) {
+        throw std::runtime_error("Invalid bake request: no scene or output file");
+    }
+    return request;
+}
+
+std::string encode_bake_reply(const BakeReply &reply)
+{
+    json j;
+    j["ok"] = reply.ok;
+    if (!reply.error.empty()) {
+        j["error"] = reply.error;
+    }
+    j["outputs"] = reply.outputs;
+    j["atlas_size"] = {reply.atlas_size.x, reply.atlas_size.y};
+    j["rays"] = reply.rays;
+    j["hits"] = reply.hits;
+    j["gpu_ms"] = reply.gpu_ms;
+    j["queue_ms"] = reply.queue_ms;
+    j["load_ms"] = reply.load_ms;
+    j["bake_ms"] = reply.bake_ms;
+    return j.dump();
+}
+
+BakeReply decode_bake_reply(const std::string &message)
+{
+    BakeReply reply;
+    try {
+        const json j = json::parse(message);
+        reply.ok = j.at("ok").get<bool>();
+        reply.error = j.value("error", std::string());
+        reply.outputs = j.value("outputs", std::vector<std::string>());
+        if (j.count("atlas_size")) {
+            reply.atlas_size = glm::uvec2(j["atlas_size"][0].get<uint32_t>(),
+                                          j["atlas_size"][1].get<uint32_t>());
+        }
+        reply.rays = j.value("rays", uint64_t(0));
+        reply.hits = j.value("hits", uint64_t(0));
+        reply.gpu_ms = j.value("gpu_ms", 0.0);
+        reply.queue_ms = j.value("queue_ms", 0.0);
+        reply.load_ms = j.value("load_ms", 0.0);
+        reply.bake_ms = j.value("bake_ms", 0.0);
+    } catch (const json::exception &e) {
+        throw std::runtime_error(std::string("Invalid bake reply: ") + e.what());
+    }
+    return reply;
+}
+
+void make_request_paths_absolute(BakeRequest &request)
+{
+    for (std::string *path : {&request.scene_file,
+                              &request.bake_output,
+                              &request.bent_normal_output,
+                              &request.hit_distance_output,
+                              &request.direct_light_output}) {
+        *path = absolute_path(*path);
+    }
+}
+
+#ifdef _WIN32
+BakeConnection::BakeConnection(HANDLE pipe) : pipe(pipe) {}
+
+BakeConnection::~BakeConnection()
+{
+    // Wait for the other end to read what was written before closing the pipe on it
+    FlushFileBuffers(pipe);
+    CloseHandle(pipe);
+}
+
+bool BakeConnection::read_message(std::string &message)
+{
+    auto read_all = [&](void *data, DWORD size) {
+        uint8_t *bytes = reinterpret_cast<uint8_t *>(data);
+        while (size > 0) {
+            DWORD n = 0;
+            if (!ReadFile(pipe, bytes, size, &n, nullptr) || n == 0) {
+                return false;
+            }
+            bytes += n;
+            size -= n;
+        }
+        return true;
+    };
+    uint32_t size = 0;
+    if (!read_all(&size, sizeof(size)) || size > max_message_size) {
+        return false;
+    }
+    message.resize(size);
+    return size == 0 || read_all(&message[0], size);
+}
+
+bool BakeConnection::write_message(const std::string &message)
+{
+    const uint32_t size = message.size();
+    std::string data(reinterpret_cast<const char *>(&size), sizeof(size));
+    data += message;
+    DWORD written = 0;
+    return WriteFile(pipe, data.data(), DWORD(data.size()), &written, nullptr) &&
+           written == data.size();
+}
+
+namespace {
+
+HANDLE create_pipe_instance(const std::string &path, bool first)
+{
+    return CreateNamedPipeA(path.c_str(),
+                            PIPE_ACCESS_DUPLEX | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+                            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT |
+                                PIPE_REJECT_REMOTE_CLIENTS,
+                            PIPE_UNLIMITED_INSTANCES,
+                            64 * 1024,
+                            64 * 1024,
+                            0,
+                            nullptr);
+}
+
+}
+
+BakeServerPipe::BakeServerPipe(const std::string &name) : pipe_path("\\\\.\\pipe\\" + name)
+{
+    instance = create_pipe_instance(pipe_path, true);
+    if (instance == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("Failed to create the pipe " + pipe_path +
+                                 ", is another server running?");
+    }
+}
+
+BakeServerPipe::~BakeServerPipe()
+{
+    if (instance != INVALID_HANDLE_VALUE) {
+        CloseHandle(instance);
+    }
+}
+
+std::unique_ptr<BakeConnection> BakeServerPipe::accept()
+{
+    if (instance == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+    // Clients connecting between the instance's creation and this call are already connected
+    if (!ConnectNamedPipe(instance, nullptr) && GetLastError() != ERROR_PIPE_CONNECTED) {
+        return nullptr;
+    }
+    auto connection = std::make_unique<BakeConnection>(instance);
+    // The next instance is waiting before this client is served, so clients rarely find none
+    instance = create_pipe_instance(pipe_path, false);
+    return connection;
+}
+
+std::unique_ptr<BakeConnection> connect_bake_server(const std::string &name, int timeout_ms)
+{
+    const std::string path = "\\\\.\\pipe\\" + name;
+    const auto start = std::chrono::steady_clock::now();
+    while (true) {
+        HANDLE pipe = CreateFileA(path.c_str(),
+                                  GENERIC_READ | GENERIC_WRITE,
+                                  0,
+                                  nullptr,
+                                  OPEN_EXISTING,
+                                  0,
+                                  nullptr);
+        if (pipe != INVALID_HANDLE_VALUE) {
+            return std::make_unique<BakeConnection>(pipe);
+        }
+        const int elapsed_ms = int(std::chrono::duration<double, std::milli>(
+                                       std::chrono::steady_clock::now() - start)
+                                       .count());
+        if (elapsed_ms >= timeout_ms) {
+            return nullptr;
+        }
+        // All instances are busy, or the server is between instances
+        if (GetLastError() == ERROR_PIPE_BUSY) {
+            WaitNamedPipeA(path.c_str(), DWORD(timeout_ms - elapsed_ms));
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    }
+}
+#else
+BakeConnection::BakeConnection(int sock) : sock(sock) {}
+
+BakeConnection::~BakeConnection()
+{
+    close(sock);
+}
+
+bool BakeConnection::read_message(std::string &message)
+{
+    auto read_all = [&](void *data, size_t size) {
+        uint8_t *bytes = reinterpret_cast<uint8_t *>(data);
+        while (size > 0) {
+            const ssize_t n = recv(sock, bytes, size, 0);
+            if (n <= 0) {
+                return false;
+            }
+            bytes += n;
+            size -= n;
+        }
+        return true;
+    };
+    uint32_t size = 0;
+    if (!read_all(&size, sizeof(size)) || size > max_message_size) {
+        return false;
+    }
+    message.resize(size);
+    return size == 0 || read_all(&message[0], size);
+}
+
+bool BakeConnection::write_message(const std::string &message)
+{
+    const uint32_t size = message.size();
+    std::string data(reinterpret_cast<const char *>(&size), sizeof(size));
+    data += message;
+    size_t sent = 0;
+    while (sent < data.size()) {
+        const ssize_t n = send(sock, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+BakeServerPipe::BakeServerPipe(const std::string &name) : pipe_path(socket_path(name))
+{
+    sockaddr_un addr;
+    if (!fill_socket_address(pipe_path, addr)) {
+        throw std::runtime_error("The socket path " + pipe_path + " is too long");
+    }
+    // A socket file left by a server that's gone is replaced, a live server's is kept
+    if (connect_bake_server(name, 0)) {
+        throw std::runtime_error("Another server is serving " + pipe_path);
+    }
+    unlink(pipe_path.c_str());
+    listen_sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_sock == -1 ||
+        bind(listen_sock, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        listen(listen_sock, SOMAXCONN) != 0) {
+        if (listen_sock != -1) {
+            close(listen_sock);
+        }
+        throw std::runtime_error("Failed to create the socket " + pipe_path);
+    }
+}
+
+BakeServerPipe::~BakeServerPipe()
+{
+    close(listen_sock);
+    unlink(pipe_path.c_str());
+}
+
+std::unique_ptr<BakeConnection> BakeServerPipe::accept()
+{
+    const int sock = ::accept(listen_sock, nullptr, nullptr);
+    if (sock == -1) {
+        return nullptr;
+    }
+    return std::make_unique<BakeConnection>(sock);
+}
+
+std::unique_ptr<BakeConnection> connect_bake_server(const std::string &name, int timeout_ms)
+{
+    sockaddr_un addr;
+    if (!fill_socket_address(socket_path(name), addr)) {
+        return nullptr;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    while (true) {
+        const int sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock == -1) {
+            return nullptr;
+        }
+        if (connect(sock, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == 0) {
+            return std::make_unique<BakeConnection>(sock);
+        }
+        close(sock);
+        const double elapsed_ms = std::chrono::duration<double, std::milli>(
+                                      std::chrono::steady_clock::now() - start)
+                                      .count();
+        if (elapsed_ms >= timeout_ms) {
+            return nullptr;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+}
+#endif
+
+const std::string &BakeServerPipe::path() const
+{
+    return pipe_path;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+/* A bake job sent to the bake server: the scene, the files to write its maps to and the
+ * bake settings. Settings left negative or empty keep the server's, which also sets how
+ * the scenes are loaded and unwrapped. The paths are opened by the server, so should be
+ * absolute if the client runs in another directory
+ */
+struct BakeRequest {
+    std::string scene_file;
+    std::string bake_output;
+    // The extra maps are only baked if their file is set
+    std::string bent_normal_output;
+    std::string hit_distance_output;
+    std::string direct_light_output;
+    int n_samples = -1;
+    int samples_per_frame = -1;
+    float ao_length = -1.f;
+    // The sampler and AO format by their command line names
+    std::string sampler;
+    int64_t sampler_seed = -1;
+    std::string ao_format;
+    int gutter = -1;
+};
+
+// The server's reply once the job's maps are written, or it failed
+struct BakeReply {
+    bool ok = false;
+    // Why the job failed, empty if it succeeded
+    std::string error;
+    std::vector<std::string> outputs;
+    glm::uvec2 atlas_size = glm::uvec2(0);
+    uint64_t rays = 0;
+    uint64_t hits = 0;
+    double gpu_ms = 0.0;
+    // The wall time in ms the job waited to be loaded, and took to load and to bake and write
+    double queue_ms = 0.0;
+    double load_ms = 0.0;
+    double bake_ms = 0.0;
+};
+
+std::string encode_bake_request(const BakeRequest &request);
+
+// Decode the request's JSON, throws if it's malformed or doesn't name a scene and output
+BakeRequest decode_bake_request(const std::string &message);
+
+std::string encode_bake_reply(const BakeReply &reply);
+
+// Decode the reply's JSON, throws if it's malformed
+BakeReply decode_bake_reply(const std::string &message);
+
+// Resolve the request's relative paths against the working directory
+void make_request_paths_absolute(BakeRequest &request);
+
+/* A client of the bake server, connected by the server pipe. The messages are sent with
+ * a 32-bit length prefix, so each one is read whole
+ */
+class BakeConnection {
+#ifdef _WIN32
+    HANDLE pipe;
+#else
+    int sock;
+#endif
+
+public:
+#ifdef _WIN32
+    explicit BakeConnection(HANDLE pipe);
+#else
+    explicit BakeConnection(int sock);
+#endif
+
+    ~BakeConnection();
+
+    BakeConnection(const BakeConnection &) = delete;
+
+    BakeConnection &operator=(const BakeConnection &) = delete;
+
+    // Read the next message, returns false if the connection closed or failed
+    bool read_message(std::string &message);
+
+    // Write the message, returns false if the connection closed or failed
+    bool write_message(const std::string &message);
+};
+
+/* The bake server's end of its local pipe: the named pipe \\.\pipe\<name> on Windows or the
+ * Unix domain socket <name>.sock in the temp directory elsewhere. Each client connects,
+ * sends one request and waits on the connection for the reply
+ */
+class BakeServerPipe {
+    std::string pipe_path;
+#ifdef _WIN32
+    // The pipe instance the next client connects to
+    HANDLE instance;
+#else
+    int listen_sock;
+#endif
+
+public:
+    // Open the pipe, throws if it can't be created or is already served
+    explicit BakeServerPipe(const std::string &name);
+
+    ~BakeServerPipe();
+
+    BakeServerPipe(const BakeServerPipe &) = delete;
+
+    BakeServerPipe &operator=(const BakeServerPipe &) = delete;
+
+    const std::string &path() const;
+
+    // Wait for the next client to connect, returns null if the pipe failed
+    std::unique_ptr<BakeConnection> accept();
+};
+
+/* Connect to the bake server serving the pipe, waiting up to timeout_ms for it to accept
+ * the connection. Returns null if there's no server
+ */
+std::unique_ptr<BakeConnection> connect_bake_server(const std::string &name, int timeout_ms);
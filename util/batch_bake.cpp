@@ -0,0 +1,276 @@
+#include "batch_bake.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+#include "dxr/dx12_utils.h"
+#include "dxr/dxr_utils.h"
+#include "trace.h"
+#include "util.h"
+
+std::vector<std::string> batch_scene_files(const std::string &batch)
+{
+    std::vector<std::string> scene_files;
+    const DWORD attribs = GetFileAttributesA(batch.c_str());
+    if (attribs != INVALID_FILE_ATTRIBUTES && (attribs & FILE_ATTRIBUTE_DIRECTORY)) {
+        WIN32_FIND_DATAA find_data;
+        HANDLE fnd = FindFirstFileA((batch + "/*").c_str(), &find_data);
+        if (fnd != INVALID_HANDLE_VALUE) {
+            do {
+                if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                    continue;
+                }
+                const std::string name = find_data.cFileName;
+                std::string ext = get_file_extension(name);
+                std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) {
+                    return char(std::tolower(c));
+                });
+                if (ext == "gltf" || ext == "glb" || ext == "obj" || ext == "crts") {
+                    scene_files.push_back(batch + "/" + name);
+                }
+            } while (FindNextFileA(fnd, &find_data));
+            FindClose(fnd);
+        }
+        std::sort(scene_files.begin(), scene_files.end());
+        return scene_files;
+    }
+
+    std::ifstream fin(batch.c_str());
+    if (!fin) {
+        std::cout << "Error: Failed to open the batch manifest " << batch << "\n";
+        throw std::runtime_error("Failed to open the batch manifest " + batch);
+    }
+    std::string line;
+    while (std::getline(fin, line)) {
+        const size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#') {
+            continue;
+        }
+        line = line.substr(first, line.find_last_not_of(" \t\r") + 1 - first);
+        canonicalize_path(line);
+        scene_files.push_back(line);
+    }
+    return scene_files;
+}
+
+void run_batch_loader(BatchQueue &queue,
+                      const AppOptions &options,
+                      ID3D12Device5 *device,
+                      double &busy_ms)
+{
+    if (trace_enabled()) {
+        trace_set_thread_name("Batch Loader");
+    }
+    dxr::CommandContext cmd_ctx(device);
+    dxr::GpuProfiler profiler(
+        device, cmd_ctx.queue.Get(), gpu_profiler_regions, 3, "Batch Loader Queue");
+    const uint32_t bvh_profile = resolve_bvh_profile(options.bvh_profile, options.n_samples);
+    while (true) {
+        BatchJob job;
+        {
+            std::unique_lock<std::mutex> lock(queue.mutex);
+            queue.cv.wait(lock, [&]() {
+                return queue.stop || queue.next_scene == queue.scene_files.size() ||
+                       queue.loaded.size() + queue.loading < queue.prefetch;
+            });
+            if (queue.stop || queue.next_scene == queue.scene_files.size()) {
+                return;
+            }
+            job.index = queue.next_scene++;
+            ++queue.loading;
+        }
+
+        // A scene failing to load only skips that scene, the rest of the batch carries on
+        const auto start = std::chrono::steady_clock::now();
+        try {
+            job.bake_scene = load_bake_scene(queue.scene_files[job.index],
+                                             options.scene_load,
+                                             options.atlas_options,
+                                             bvh_profile,
+                                             device,
+                                             cmd_ctx,
+                                             nullptr,
+                                             profiler,
+                                             nullptr);
+            resolve_gpu_profile(cmd_ctx, profiler);
+        } catch (const std::exception &e) {
+            job.error = e.what();
+        }
+        job.load_ms =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                .count();
+        busy_ms += job.load_ms;
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            --queue.loading;
+            queue.loaded.push_back(std::move(job));
+        }
+        queue.cv.notify_all();
+    }
+}
+
+bool run_batch_bake(const AppOptions &options)
+{
+    BatchQueue queue;
+    queue.scene_files = batch_scene_files(options.scene_file);
+    queue.prefetch = std::min(size_t(options.batch_prefetch), queue.scene_files.size());
+    if (queue.scene_files.empty()) {
+        std::cout << "Error: No scenes found in the batch " << options.scene_file << "\n";
+        return false;
+    }
+
+    // Each scene's maps are named after its file, scenes with the same name are numbered
+    std::vector<std::string> output_names;
+    std::map<std::string, size_t> name_counts;
+    for (const auto &f : queue.scene_files) {
+        const size_t name_start = f.find_last_of('/') + 1;
+        std::string name = f.substr(name_start, f.find_last_of('.') - name_start);
+        const size_t count = name_counts[name]++;
+        if (count > 0) {
+            name += "_" + std::to_string(count);
+        }
+        output_names.push_back(options.batch_output + "/" + name);
+    }
+
+    ComPtr<ID3D12Device5> device = dxr::create_device();
+    if (!dxr::dxr_available(device)) {
+        std::cout << "DXR 1.1 is required for inline ray tracing, but is not supported\n";
+        throw std::runtime_error("DXR 1.1 is not supported");
+    }
+
+    dxr::HeapAllocator heap_allocator(device.Get());
+    if (options.placed_resources) {
+        dxr::set_resource_allocator(&heap_allocator);
+    }
+    std::unique_ptr<dxr::PipelineCache> pipeline_cache =
+        open_pipeline_cache(device.Get(), options);
+    dxr::CommandContext cmd_ctx(device.Get());
+    dxr::GpuProfiler profiler(device.Get(), cmd_ctx.queue.Get(), gpu_profiler_regions);
+    dxr::AsyncReadback readback(device.Get());
+    // The pipelines are shared by the scenes, so are only created for the first
+    HeadlessPipelines pipelines;
+
+    std::cout << "Batch bake of " << queue.scene_files.size() << " scenes to "
+              << options.batch_output << ", loading up to " << queue.prefetch
+              << " ahead\n";
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<double> loader_busy_ms(queue.prefetch, 0.0);
+    std::vector<std::thread> loaders;
+    for (size_t i = 0; i < queue.prefetch; ++i) {
+        loaders.emplace_back([&, i]() {
+            run_batch_loader(queue, options, device.Get(), loader_busy_ms[i]);
+        });
+    }
+
+    size_t failed = 0;
+    double bake_ms = 0.0;
+    double wait_ms = 0.0;
+    std::exception_ptr error;
+    try {
+        for (size_t n = 0; n < queue.scene_files.size(); ++n) {
+            BatchJob job;
+            {
+                const auto wait_start = std::chrono::steady_clock::now();
+                std::unique_lock<std::mutex> lock(queue.mutex);
+                queue.cv.wait(lock, [&]() { return !queue.loaded.empty(); });
+                job = std::move(queue.loaded.front());
+                queue.loaded.pop_front();
+                wait_ms += std::chrono::duration<double, std::milli>(
+                               std::chrono::steady_clock::now() - wait_start)
+                               .count();
+            }
+            queue.cv.notify_all();
+
+            const std::string &scene_file = queue.scene_files[job.index];
+            std::cout << "Batch scene " << n + 1 << "/" << queue.scene_files.size() << ": "
+                      << scene_file << " (loaded in " << job.load_ms << "ms)\n";
+            if (!job.error.empty()) {
+                std::cout << "Error: Failed to load " << scene_file << ": " << job.error
+                          << "\n";
+                ++failed;
+                continue;
+            }
+
+            AppOptions scene_options = options;
+            const std::string &output_name = output_names[job.index];
+            scene_options.scene_file = scene_file;
+            scene_options.bake_output = output_name + "_ao." + options.batch_format;
+            if (!options.bent_normal_output.empty()) {
+                scene_options.bent_normal_output =
+                    output_name + "_bent_normals." +
+                    get_file_extension(options.bent_normal_output);
+            }
+            if (!options.hit_distance_output.empty()) {
+                scene_options.hit_distance_output =
+                    output_name + "_hit_distance." +
+                    get_file_extension(options.hit_distance_output);
+            }
+            if (!options.direct_light_output.empty()) {
+                scene_options.direct_light_output =
+                    output_name + "_direct_light." +
+                    get_file_extension(options.direct_light_output);
+            }
+
+            const auto bake_start = std::chrono::steady_clock::now();
+            try {
+                BakeSceneSource scene_source;
+                bake_headless_scene(device.Get(),
+                                    cmd_ctx,
+                                    profiler,
+                                    scene_options,
+                                    job.bake_scene,
+                                    scene_source,
+                                    nullptr,
+                                    pipeline_cache.get(),
+                                    readback,
+                                    pipelines);
+            } catch (const std::exception &e) {
+                std::cout << "Error: Failed to bake " << scene_file << ": " << e.what()
+                          << "\n";
+                ++failed;
+            }
+            bake_ms += std::chrono::duration<double, std::milli>(
+                           std::chrono::steady_clock::now() - bake_start)
+                           .count();
+        }
+        readback.flush();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.stop = true;
+    }
+    queue.cv.notify_all();
+    for (auto &t : loaders) {
+        t.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    const double total_ms =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+            .count();
+    const double load_ms =
+        std::accumulate(loader_busy_ms.begin(), loader_busy_ms.end(), 0.0);
+    std::cout << "Batch bake of " << queue.scene_files.size() << " scenes took "
+              << total_ms * 1e-3 << "s, " << queue.scene_files.size() * 60e3 / total_ms
+              << " scenes/min, " << failed << " failed\n"
+              << "Stage utilization: load " << 100.0 * load_ms / (total_ms * queue.prefetch)
+              << "% (" << queue.prefetch << " threads), bake " << 100.0 * bake_ms / total_ms
+              << "%, write " << 100.0 * readback.busy_ms() / total_ms << "%. The bake waited "
+              << wait_ms << "ms on loads\n";
+    if (options.placed_resources) {
+        std::cout << "Resource heaps: " << heap_stats_summary(heap_allocator.stats())
+                  << "\n";
+    }
+    print_memory_stats(device.Get());
+    return failed == 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "ao_bake.h"
+
+// A scene of the batch bake, loaded on a loader thread and handed over to the bake
+struct BatchJob {
+    size_t index = 0;
+    BakeScene bake_scene;
+    double load_ms = 0.0;
+    // Set if the scene failed to load, it's skipped by the bake
+    std::string error;
+};
+
+/* The scenes of the batch bake and those loaded ahead of the bake. A loader only takes the
+ * next scene while fewer than prefetch scenes are loaded or loading, bounding the scenes
+ * held at once. The loaded scenes are baked in the order they finish loading
+ */
+struct BatchQueue {
+    std::vector<std::string> scene_files;
+    size_t prefetch = 0;
+
+    // The queue state below is guarded by the mutex
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<BatchJob> loaded;
+    size_t next_scene = 0;
+    size_t loading = 0;
+    // Set if the bake stopped early, so the loaders stop taking scenes
+    bool stop = false;
+};
+
+/* The scene files of the batch bake: the lines of a manifest file, skipping blank lines and
+ * # comments, or the scene files in a directory sorted by name
+ */
+std::vector<std::string> batch_scene_files(const std::string &batch);
+
+/* Load the queue's scenes on the calling thread, with its own command context and profiler,
+ * until all have been taken or the queue is stopped. The time spent loading is added to
+ * busy_ms
+ */
+void run_batch_loader(BatchQueue &queue,
+                      const AppOptions &options,
+                      ID3D12Device5 *device,
+                      double &busy_ms);
+
+/* Bake each scene of the batch like the headless bake, loading and unwrapping the upcoming
+ * scenes on the loader threads while the GPU bakes the current one and the readback's
+ * worker encodes the previous one's AO map. The throughput and utilization of each stage
+ * are printed once all are done. Returns false if any scene failed
+ */
+bool run_batch_bake(const AppOptions &options);
@@ -0,0 +1,123 @@
+#include "blue_noise.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+
+namespace {
+
+// Generate one channel of blue noise, returning the rank of each pixel
+std::vector<uint32_t> void_and_cluster(uint32_t size, std::mt19937 &rng)
+{
+    const uint32_t n = size * size;
+    // Gaussian energy filter over the toroidal distance between pixels
+    const float sigma = 1.5f;
+    std::vector<float> kernel(n, 0.f);
+    for (uint32_t y = 0; y < size; ++y) {
+        for (uint32_t x = 0; x < size; ++x) {
+            const float dx = std::min(x, size - x);
+            const float dy = std::min(y, size - y);
+            kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2.f * sigma * sigma));
+        }
+    }
+
+    std::vector<uint8_t> pattern(n, 0);
+    std::vector<float> energy(n, 0.f);
+    auto splat = [&](std::vector<float> &e, uint32_t p, float sign) {
+        const uint32_t px = p % size;
+        const uint32_t py = p / size;
+        for (uint32_t y = 0; y < size; ++y) {
+            const uint32_t ky = (y + size - py) % size;
+            for (uint32_t x = 0; x < size; ++x) {
+                const uint32_t kx = (x + size - px) % size;
+                e[y * size + x] += sign * kernel[ky * size + kx];
+            }
+        }
+    };
+    // Find the set pixel with the most energy, or the unset one with the least
+    auto tightest_cluster = [&](const std::vector<uint8_t> &pat, const std::vector<float> &e) {
+        uint32_t best = 0;
+        float best_energy = -1.f;
+        for (uint32_t i = 0; i < n; ++i) {
+            if (pat[i] && e[i] > best_energy) {
+                best = i;
+                best_energy = e[i];
+            }
+        }
+        return best;
+    };
+    auto largest_void = [&](const std::vector<uint8_t> &pat, const std::vector<float> &e) {
+        uint32_t best = 0;
+        float best_energy = std::numeric_limits<float>::infinity();
+        for (uint32_t i = 0; i < n; ++i) {
+            if (!pat[i] && e[i] < best_energy) {
+                best = i;
+                best_energy = e[i];
+            }
+        }
+        return best;
+    };
+
+    // Start from a random pattern covering 10% of the pixels and swap pixels from the
+    // tightest clusters to the largest voids until it's evenly distributed
+    const uint32_t n_initial = std::max(n / 10, 1u);
+    std::uniform_int_distribution<uint32_t> pixel_distrib(0, n - 1);
+    for (uint32_t placed = 0; placed < n_initial;) {
+        const uint32_t p = pixel_distrib(rng);
+        if (!pattern[p]) {
+            pattern[p] = 1;
+            splat(energy, p, 1.f);
+            ++placed;
+        }
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        const uint32_t cluster = tightest_cluster(pattern, energy);
+        pattern[cluster] = 0;
+        splat(energy, cluster, -1.f);
+
+        const uint32_t gap = largest_void(pattern, energy);
+        pattern[gap] = 1;
+        splat(energy, gap, 1.f);
+        if (gap == cluster) {
+            break;
+        }
+    }
+
+    std::vector<uint32_t> ranks(n, 0);
+    {
+        // Rank the initial pattern by removing the tightest clusters first
+        std::vector<uint8_t> pat = pattern;
+        std::vector<float> e = energy;
+        for (uint32_t rank = n_initial; rank > 0; --rank) {
+            const uint32_t cluster = tightest_cluster(pat, e);
+            pat[cluster] = 0;
+            splat(e, cluster, -1.f);
+            ranks[cluster] = rank - 1;
+        }
+    }
+    // Then fill the largest voids until the pattern is full. Past half full this is
+    // equivalent to removing the tightest clusters of the unset pixels
+    for (uint32_t rank = n_initial; rank < n; ++rank) {
+        const uint32_t gap = largest_void(pattern, energy);
+        pattern[gap] = 1;
+        splat(energy, gap, 1.f);
+        ranks[gap] = rank;
+    }
+    return ranks;
+}
+
+}
+
+std::vector<glm::vec2> generate_blue_noise(uint32_t size, uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    const std::vector<uint32_t> x_ranks = void_and_cluster(size, rng);
+    const std::vector<uint32_t> y_ranks = void_and_cluster(size, rng);
+
+    const float n = static_cast<float>(size) * size;
+    std::vector<glm::vec2> noise(x_ranks.size());
+    for (size_t i = 0; i < noise.size(); ++i) {
+        noise[i] = glm::vec2((x_ranks[i] + 0.5f) / n, (y_ranks[i] + 0.5f) / n);
+    }
+    return noise;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+/* Generate a size x size tileable blue noise texture with the void and cluster method
+ * (Ulichney, 1993). Each channel is an independent pattern with values uniformly
+ * distributed in (0, 1)
+ */
+std::vector<glm::vec2> generate_blue_noise(uint32_t size, uint32_t seed);
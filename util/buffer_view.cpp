@@ -1,5 +1,240 @@
 #include "buffer_view.h"
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BUFFER_VIEW_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+template <typename T>
+float decode_component(const uint8_t *src, float scale, bool normalized)
+{
+    T v;
+    std::memcpy(&v, src, sizeof(T));
+    const float f = float(v) * scale;
+    // Signed normalized values have two encodings of -1
+    return normalized ? std::max(f, -1.f) : f;
+}
+
+float decode_component(const uint8_t *src, int component_type, float scale, bool normalized)
+{
+    switch (component_type) {
+    case TINYGLTF_COMPONENT_TYPE_BYTE:
+        return decode_component<int8_t>(src, scale, normalized);
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+        return decode_component<uint8_t>(src, scale, normalized);
+    case TINYGLTF_COMPONENT_TYPE_SHORT:
+        return decode_component<int16_t>(src, scale, normalized);
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+        return decode_component<uint16_t>(src, scale, normalized);
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+        return decode_component<uint32_t>(src, scale, normalized);
+    default:
+        return decode_component<float>(src, scale, normalized);
+    }
+}
+
+// The scale mapping the normalized integer component type to [0, 1] or [-1, 1]
+float normalized_scale(int component_type)
+{
+    switch (component_type) {
+    case TINYGLTF_COMPONENT_TYPE_BYTE:
+        return 1.f / 127.f;
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+        return 1.f / 255.f;
+    case TINYGLTF_COMPONENT_TYPE_SHORT:
+        return 1.f / 32767.f;
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+        return 1.f / 65535.f;
+    default:
+        return 1.f;
+    }
+}
+
+#ifdef BUFFER_VIEW_SSE2
+// Convert, scale and store 4 32-bit integers
+void store_decoded(__m128i v, __m128 scale, bool normalized, float *out)
+{
+    __m128 f = _mm_mul_ps(_mm_cvtepi32_ps(v), scale);
+    if (normalized) {
+        f = _mm_max_ps(f, _mm_set1_ps(-1.f));
+    }
+    _mm_storeu_ps(out, f);
+}
+
+/* Decode the packed run of 8 or 16 bit integer components 16 at a time, returning the
+ * number decoded. The rest are left for the scalar loop
+ */
+size_t decode_packed_sse2(const uint8_t *src,
+                          size_t n,
+                          int component_type,
+                          float scale,
+                          bool normalized,
+                          float *out)
+{
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i lo16, hi16;
+        switch (component_type) {
+        case TINYGLTF_COMPONENT_TYPE_BYTE:
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE: {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+            if (component_type == TINYGLTF_COMPONENT_TYPE_BYTE) {
+                // Place each byte in the high half of a 16-bit lane to sign extend it
+                lo16 = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+                hi16 = _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+            } else {
+                lo16 = _mm_unpacklo_epi8(v, zero);
+                hi16 = _mm_unpackhi_epi8(v, zero);
+            }
+            break;
+        }
+        default: {
+            const __m128i *p = reinterpret_cast<const __m128i *>(src + i * 2);
+            lo16 = _mm_loadu_si128(p);
+            hi16 = _mm_loadu_si128(p + 1);
+            break;
+        }
+        }
+        const bool is_signed = component_type == TINYGLTF_COMPONENT_TYPE_BYTE ||
+                               component_type == TINYGLTF_COMPONENT_TYPE_SHORT;
+        const __m128i halves[2] = {lo16, hi16};
+        for (int h = 0; h < 2; ++h) {
+            __m128i lo32, hi32;
+            if (is_signed) {
+                lo32 = _mm_srai_epi32(_mm_unpacklo_epi16(halves[h], halves[h]), 16);
+                hi32 = _mm_srai_epi32(_mm_unpackhi_epi16(halves[h], halves[h]), 16);
+            } else {
+                lo32 = _mm_unpacklo_epi16(halves[h], zero);
+                hi32 = _mm_unpackhi_epi16(halves[h], zero);
+            }
+            store_decoded(lo32, vscale, normalized, out + i + h * 8);
+            store_decoded(hi32, vscale, normalized, out + i + h * 8 + 4);
+        }
+    }
+    return i;
+}
+
+/* Decode the first n of up to 4 8 or 16 bit integer components of each strided element,
+ * returning the number of elements decoded. Each element is loaded whole as 4 or 8 bytes,
+ * which stays within its stride, except for the last where it could read past the end of
+ * the buffer, so it's left for the scalar loop. The lanes past the n components are
+ * zeroed, and any stored past the element's n_components are rewritten by the next element
+ */
+template <typename T>
+size_t decode_strided_sse2(const BufferView &view,
+                           size_t count,
+                           size_t n,
+                           size_t n_components,
+                           float scale,
+                           bool normalized,
+                           float *out)
+{
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 lane_mask = _mm_castsi128_ps(
+        _mm_cmplt_epi32(_mm_set_epi32(3, 2, 1, 0), _mm_set1_epi32(int(n))));
+    size_t i = 0;
+    for (; i + 1 < count; ++i) {
+        const uint8_t *elem = view[i];
+        __m128i v;
+        if (sizeof(T) == 1) {
+            int32_t bytes;
+            std::memcpy(&bytes, elem, sizeof(bytes));
+            v = _mm_cvtsi32_si128(bytes);
+            // Place each byte in the high half of a 16-bit lane to sign extend it
+            v = std::is_signed<T>::value ? _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8)
+                                         : _mm_unpacklo_epi8(v, zero);
+        } else {
+            v = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(elem));
+        }
+        v = std::is_signed<T>::value ? _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)
+                                     : _mm_unpacklo_epi16(v, zero);
+        __m128 f = _mm_mul_ps(_mm_cvtepi32_ps(v), vscale);
+        if (normalized) {
+            f = _mm_max_ps(f, _mm_set1_ps(-1.f));
+        }
+        _mm_storeu_ps(out + i * n_components, _mm_and_ps(f, lane_mask));
+    }
+    return i;
+}
+
+// Widen the packed 8 or 16 bit indices 16 at a time, returning the number widened
+size_t widen_packed_sse2(const uint8_t *src, size_t n, size_t index_size, uint32_t *out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i lo16, hi16;
+        if (index_size == 1) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+            lo16 = _mm_unpacklo_epi8(v, zero);
+            hi16 = _mm_unpackhi_epi8(v, zero);
+        } else {
+            const __m128i *p = reinterpret_cast<const __m128i *>(src + i * 2);
+            lo16 = _mm_loadu_si128(p);
+            hi16 = _mm_loadu_si128(p + 1);
+        }
+        __m128i *dst = reinterpret_cast<__m128i *>(out + i);
+        _mm_storeu_si128(dst, _mm_unpacklo_epi16(lo16, zero));
+        _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(lo16, zero));
+        _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(hi16, zero));
+        _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(hi16, zero));
+    }
+    return i;
+}
+#endif
+
+/* Decode the first n components of type T of each strided element, zeroing the rest of
+ * the element's n_components. The component type is resolved once by the caller instead of
+ * for each component
+ */
+template <typename T>
+void decode_strided(const BufferView &view,
+                    size_t count,
+                    size_t n,
+                    size_t n_components,
+                    float scale,
+                    bool normalized,
+                    float *out)
+{
+    size_t i = 0;
+#ifdef BUFFER_VIEW_SSE2
+    if (std::is_integral<T>::value && sizeof(T) <= 2 && n_components <= 4 &&
+        view.stride >= 4 * sizeof(T)) {
+        i = decode_strided_sse2<T>(view, count, n, n_components, scale, normalized, out);
+    }
+#endif
+    for (; i < count; ++i) {
+        const uint8_t *elem = view[i];
+        float *dst = out + i * n_components;
+        for (size_t c = 0; c < n; ++c) {
+            dst[c] = decode_component<T>(elem + c * sizeof(T), scale, normalized);
+        }
+        std::fill(dst + n, dst + n_components, 0.f);
+    }
+}
+
+// The view of the accessor's elements, with the accessor's byte offset applied
+BufferView accessor_view(const tinygltf::Accessor &accessor, const tinygltf::Model &model)
+{
+    BufferView view(model.bufferViews[accessor.bufferView],
+                    model,
+                    gltf_base_stride(accessor.type, accessor.componentType));
+    view.buf += accessor.byteOffset;
+    return view;
+}
+
+}
 
 BufferView::BufferView(const tinygltf::BufferView &view,
                        const tinygltf::Model &model,
@@ -20,3 +255,118 @@ const uint8_t *BufferView::operator[](const size_t i) const
     return buf + i * stride;
 }
 
+
+void read_gltf_floats(const tinygltf::Accessor &accessor,
+                      const tinygltf::Model &model,
+                      size_t n_components,
+                      float *out)
+{
+    const DTYPE dtype = gltf_type_to_dtype(accessor.type, accessor.componentType);
+    const size_t accessor_components = dtype_components(dtype);
+    const size_t component_size = dtype_stride(dtype) / accessor_components;
+    const size_t n = std::min(n_components, accessor_components);
+    const BufferView view = accessor_view(accessor, model);
+    const float scale = accessor.normalized ? normalized_scale(accessor.componentType) : 1.f;
+    const size_t count = accessor.count;
+    if (count == 0) {
+        return;
+    }
+
+    // Packed elements with the components requested are decoded as one run
+    const bool packed =
+        view.stride == dtype_stride(dtype) && n_components == accessor_components;
+    if (packed && accessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT) {
+        std::memcpy(out, view[0], count * n * sizeof(float));
+        return;
+    }
+    if (packed) {
+        const size_t total = count * n;
+        size_t i = 0;
+#ifdef BUFFER_VIEW_SSE2
+        if (component_size <= 2) {
+            i = decode_packed_sse2(
+                view[0], total, accessor.componentType, scale, accessor.normalized, out);
+        }
+#endif
+        for (; i < total; ++i) {
+            out[i] = decode_component(view[0] + i * component_size,
+                                      accessor.componentType,
+                                      scale,
+                                      accessor.normalized);
+        }
+        return;
+    }
+
+    const bool normalized = accessor.normalized;
+    switch (accessor.componentType) {
+    case TINYGLTF_COMPONENT_TYPE_BYTE:
+        decode_strided<int8_t>(view, count, n, n_components, scale, normalized, out);
+        break;
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+        decode_strided<uint8_t>(view, count, n, n_components, scale, normalized, out);
+        break;
+    case TINYGLTF_COMPONENT_TYPE_SHORT:
+        decode_strided<int16_t>(view, count, n, n_components, scale, normalized, out);
+        break;
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+        decode_strided<uint16_t>(view, count, n, n_components, scale, normalized, out);
+        break;
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+        decode_strided<uint32_t>(view, count, n, n_components, scale, normalized, out);
+        break;
+    default:
+        decode_strided<float>(view, count, n, n_components, scale, normalized, out);
+        break;
+    }
+}
+
+std::vector<glm::uvec3> read_gltf_triangles(const tinygltf::Accessor &accessor,
+                                            const tinygltf::Model &model)
+{
+    size_t index_size = 0;
+    switch (accessor.componentType) {
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+        index_size = 1;
+        break;
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+        index_size = 2;
+        break;
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+        index_size = 4;
+        break;
+    default:
+        std::cout << "Unsupported index type\n";
+        throw std::runtime_error("Unsupported index component type");
+    }
+
+    const BufferView view = accessor_view(accessor, model);
+    std::vector<glm::uvec3> triangles(accessor.count / 3);
+    uint32_t *out = reinterpret_cast<uint32_t *>(triangles.data());
+    const size_t count = triangles.size() * 3;
+    if (count == 0) {
+        return triangles;
+    }
+    if (view.stride != index_size) {
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t index = 0;
+            // Indices are little endian, as is every platform DXR runs on
+            std::memcpy(&index, view[i], index_size);
+            out[i] = index;
+        }
+        return triangles;
+    }
+    if (index_size == 4) {
+        std::memcpy(out, view[0], count * sizeof(uint32_t));
+        return triangles;
+    }
+
+    size_t i = 0;
+#ifdef BUFFER_VIEW_SSE2
+    i = widen_packed_sse2(view[0], count, index_size, out);
+#endif
+    for (; i < count; ++i) {
+        out[i] = index_size == 1 ? view[0][i]
+                                 : *reinterpret_cast<const uint16_t *>(view[0] + i * 2);
+    }
+    return triangles;
+}
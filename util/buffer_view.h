@@ -1,5 +1,7 @@
 #pragma once
 
+#include <vector>
+#include <glm/glm.hpp>
 #include "gltf_types.h"
 #include "tiny_gltf.h"
 
@@ -42,8 +44,26 @@ public:
     const T *end() const;
 
     size_t size() const;
+
+    // Check if the elements are tightly packed, so they can be viewed as an array
+    bool packed() const;
 };
 
+/* Read the accessor's float or integer components as floats into out, which must have
+ * room for n_components floats per element. Normalized integers are decoded to [0, 1] or
+ * [-1, 1], packed 8 and 16 bit components are decoded with SSE2 when it's available
+ */
+void read_gltf_floats(const tinygltf::Accessor &accessor,
+                      const tinygltf::Model &model,
+                      size_t n_components,
+                      float *out);
+
+/* Read the triangles of the 8, 16 or 32 bit unsigned index accessor, with the indices
+ * widened to 32 bits. Packed 8 and 16 bit indices are widened with SSE2 when it's available
+ */
+std::vector<glm::uvec3> read_gltf_triangles(const tinygltf::Accessor &accessor,
+                                            const tinygltf::Model &model);
+
 template <typename T>
 Accessor<T>::Accessor(const tinygltf::Accessor &accessor, const tinygltf::Model &model)
     : view(model.bufferViews[accessor.bufferView],
@@ -89,3 +109,10 @@ size_t Accessor<T>::size() const
 {
     return count;
 }
+
+template <typename T>
+bool Accessor<T>::packed() const
+{
+    return view.stride == sizeof(T);
+}
+
@@ -0,0 +1,117 @@
+#include "dds.h"
+#include <array>
+#include <fstream>
+
+namespace {
+
+const uint32_t DDS_MAGIC = 0x20534444;
+const uint32_t DDSD_CAPS = 0x1;
+const uint32_t DDSD_HEIGHT = 0x2;
+const uint32_t DDSD_WIDTH = 0x4;
+const uint32_t DDSD_PITCH = 0x8;
+const uint32_t DDSD_PIXELFORMAT = 0x1000;
+const uint32_t DDSD_LINEARSIZE = 0x80000;
+const uint32_t DDPF_FOURCC = 0x4;
+const uint32_t DDSCAPS_TEXTURE = 0x1000;
+const uint32_t D3D10_RESOURCE_DIMENSION_TEXTURE2D = 3;
+
+struct DDSPixelFormat {
+    uint32_t size = sizeof(DDSPixelFormat);
+    uint32_t flags = DDPF_FOURCC;
+    // "DX10", the format is given in the extended header
+    uint32_t four_cc = 0x30315844;
+    std::array<uint32_t, 5> bit_masks = {0};
+};
+
+struct DDSHeader {
+    uint32_t size = sizeof(DDSHeader);
+    uint32_t flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT;
+    uint32_t height = 0;
+    uint32_t width = 0;
+    uint32_t pitch_or_linear_size = 0;
+    uint32_t depth = 0;
+    uint32_t mip_map_count = 1;
+    std::array<uint32_t, 11> reserved1 = {0};
+    DDSPixelFormat pixel_format;
+    uint32_t caps = DDSCAPS_TEXTURE;
+    std::array<uint32_t, 3> caps_extra = {0};
+    uint32_t reserved2 = 0;
+};
+
+struct DDSHeaderDX10 {
+    uint32_t dxgi_format = 0;
+    uint32_t resource_dimension = D3D10_RESOURCE_DIMENSION_TEXTURE2D;
+    uint32_t misc_flag = 0;
+    uint32_t array_size = 1;
+    uint32_t misc_flags2 = 0;
+};
+
+static_assert(sizeof(DDSHeader) == 124, "DDS header must be 124 bytes");
+
+}
+
+size_t dds_element_size(DXGI_FORMAT format)
+{
+    switch (format) {
+    case DXGI_FORMAT_R8_UNORM:
+        return 1;
+    case DXGI_FORMAT_R16_UNORM:
+    case DXGI_FORMAT_R16_FLOAT:
+        return 2;
+    case DXGI_FORMAT_R8G8B8A8_UNORM:
+        return 4;
+    case DXGI_FORMAT_BC4_UNORM:
+        return 8;
+    case DXGI_FORMAT_BC5_UNORM:
+        return 16;
+    default:
+        return 0;
+    }
+}
+
+bool dds_block_compressed(DXGI_FORMAT format)
+{
+    return format == DXGI_FORMAT_BC4_UNORM || format == DXGI_FORMAT_BC5_UNORM;
+}
+
+bool write_dds(const std::string &fname,
+               const glm::uvec2 &dims,
+               DXGI_FORMAT format,
+               const std::vector<uint8_t> &data)
+{
+    const size_t element_size = dds_element_size(format);
+    if (element_size == 0) {
+        return false;
+    }
+
+    DDSHeader header;
+    header.width = dims.x;
+    header.height = dims.y;
+    if (dds_block_compressed(format)) {
+        const glm::uvec2 num_blocks = (dims + glm::uvec2(3)) / glm::uvec2(4);
+        header.flags |= DDSD_LINEARSIZE;
+        header.pitch_or_linear_size = num_blocks.x * num_blocks.y * element_size;
+    } else {
+        header.flags |= DDSD_PITCH;
+        header.pitch_or_linear_size = dims.x * element_size;
+    }
+    const size_t data_size = dds_block_compressed(format)
+                                 ? header.pitch_or_linear_size
+                                 : size_t(header.pitch_or_linear_size) * dims.y;
+    if (data.size() < data_size) {
+        return false;
+    }
+
+    DDSHeaderDX10 header_dx10;
+    header_dx10.dxgi_format = format;
+
+    std::ofstream fout(fname.c_str(), std::ios::binary);
+    if (!fout) {
+        return false;
+    }
+    fout.write(reinterpret_cast<const char *>(&DDS_MAGIC), sizeof(DDS_MAGIC));
+    fout.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    fout.write(reinterpret_cast<const char *>(&header_dx10), sizeof(header_dx10));
+    fout.write(reinterpret_cast<const char *>(data.data()), data_size);
+    return bool(fout);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <dxgiformat.h>
+#include <glm/glm.hpp>
+
+// Size in bytes of a pixel of the format, or of a 4x4 block for the block compressed formats.
+// Returns 0 for formats that can't be written
+size_t dds_element_size(DXGI_FORMAT format);
+
+bool dds_block_compressed(DXGI_FORMAT format);
+
+/* Write the single mip 2D image to a DDS file with the DX10 header. The data holds tightly
+ * packed rows of pixels, or of 4x4 blocks for the block compressed formats
+ */
+bool write_dds(const std::string &fname,
+               const glm::uvec2 &dims,
+               DXGI_FORMAT format,
+               const std::vector<uint8_t> &data);
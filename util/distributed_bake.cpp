@@ -0,0 +1,415 @@
+#include "distributed_bake.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "dxr/dx12_utils.h"
+#include "dxr/dxr_utils.h"
+#include "multi_gpu_bake.h"
+#include "scene_cache.h"
+#include "trace.h"
+#include "util.h"
+
+void run_bake_worker(const AppOptions &options)
+{
+    ComPtr<ID3D12Device5> device = dxr::create_device();
+    if (!dxr::dxr_available(device)) {
+        std::cout << "DXR 1.1 is required for inline ray tracing, but is not supported\n";
+        throw std::runtime_error("DXR 1.1 is not supported");
+    }
+    dxr::CommandContext cmd_ctx(device.Get());
+    dxr::GpuProfiler profiler(device.Get(), cmd_ctx.queue.Get(), gpu_profiler_regions);
+
+    // The job directory is passed in place of the scene file
+    BakeJobQueue queue(options.scene_file);
+    const std::string worker = bake_worker_name();
+    std::cout << "Bake worker " << worker << " waiting for jobs in " << queue.directory()
+              << "\n";
+    uint64_t last_job_id = 0;
+    while (true) {
+        BakeJob job;
+        if (!queue.read_job(job) || job.job_id == last_job_id || queue.finished(job)) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            continue;
+        }
+        last_job_id = job.job_id;
+        std::cout << "Joining bake job " << std::hex << job.job_id << std::dec << "\n";
+
+        SceneLoadOptions load_options = options.scene_load;
+        load_options.occluder_proxy_ratio = job.occluder_proxy_ratio;
+        load_options.occluder_near_field = job.occluder_near_field;
+        load_options.occluder_class_fields = job.occluder_class_fields;
+        load_options.occluder_small_size = job.occluder_small_size;
+        load_options.occluder_tiny_size = job.occluder_tiny_size;
+        BakeScene bake_scene;
+        bake_scene.bvh_profile = resolve_bvh_profile(options.bvh_profile, job.n_samples);
+        // The BVHs are only cached in a local --atlas-cache, not the shared job directory
+        bake_scene.cache_dir = options.atlas_options.cache_dir;
+        if (!load_cached_bake_scene(
+                scene_cache_file_name(queue.directory(), job.scene_cache_key),
+                job.scene_cache_key,
+                load_options,
+                device.Get(),
+                cmd_ctx,
+                profiler,
+                nullptr,
+                bake_scene)) {
+            std::cout << "Warning: Failed to load the scene cache of job " << std::hex
+                      << job.job_id << std::dec << ", skipping it\n";
+            continue;
+        }
+
+        const DXGI_FORMAT ao_format = DXGI_FORMAT(job.ao_format);
+        BakeTarget bake_target =
+            create_bake_target(device.Get(), job.atlas_size, 0, ao_format);
+        BakePipeline bake_pipeline = create_bake_pipeline(device.Get(), ao_format);
+        RayStatsQuery ray_stats_query = create_ray_stats_query(device.Get(), cmd_ctx);
+
+        AtlasParams atlas_params(job.atlas_size);
+        atlas_params.n_samples = job.n_samples;
+        atlas_params.ao_length = job.ao_length;
+        atlas_params.samples_per_frame = job.samples_per_frame;
+        atlas_params.sampler_type = job.sampler_type;
+        atlas_params.sampler_seed = job.sampler_seed;
+        atlas_params.near_field_radius = bake_scene.near_field_radius;
+
+        // Each worker starts claiming at its own tile, so they don't contend for the same
+        const std::vector<glm::uvec2> tiles = job.tiles();
+        Hasher hasher;
+        hasher.add(worker.data(), worker.size());
+        const size_t first_tile = hasher.h % tiles.size();
+        size_t baked_tiles = 0;
+        BakeJob current;
+        while (!queue.finished(job) && queue.read_job(current) &&
+               current.job_id == job.job_id) {
+            bool baked = false;
+            for (size_t i = 0; i < tiles.size() && !baked; ++i) {
+                const uint32_t t = (first_tile + i) % tiles.size();
+                if (!queue.claim_tile(job, t, worker)) {
+                    continue;
+                }
+                // The heartbeat after each frame keeps the claim, if it was released the
+                // tile has been requeued and the bake is abandoned
+                uint32_t beat = 0;
+                bool lost = false;
+                const RayStats stats = bake_tile_samples(cmd_ctx,
+                                                         bake_pipeline,
+                                                         bake_scene,
+                                                         bake_target,
+                                                         ray_stats_query,
+                                                         atlas_params,
+                                                         job.tile_size,
+                                                         tiles[t],
+                                                         profiler,
+                                                         [&]() {
+                                                             lost = !queue.heartbeat(
+                                                                 job, t, worker, ++beat);
+                                                             return !lost;
+                                                         });
+                baked = true;
+                if (lost) {
+                    std::cout << "Warning: Lost the claim on tile " << t << "\n";
+                    continue;
+                }
+                const glm::uvec2 size =
+                    glm::min(glm::uvec2(job.tile_size), job.atlas_size - tiles[t]);
+                BakeTileResult result =
+                    read_back_bake_tile(device.Get(), cmd_ctx, bake_target, tiles[t], size);
+                result.tile_id = t;
+                result.rays = stats.rays;
+                result.hits = stats.hits;
+                result.gpu_ms = stats.gpu_ms;
+                queue.write_result(job, result);
+                ++baked_tiles;
+                std::cout << "Baked tile " << t << " in " << stats.gpu_ms << "ms, "
+                          << stats.rays * 1e-3 / std::max(stats.gpu_ms, 1e-6)
+                          << " Mrays/s\n";
+            }
+            if (!baked) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(500));
+            }
+        }
+        std::cout << "Bake job " << std::hex << job.job_id << std::dec << " done, baked "
+                  << baked_tiles << "/" << tiles.size() << " tiles\n";
+    }
+}
+
+BakeTileResult read_back_bake_tile(ID3D12Device5 *device,
+                                   dxr::CommandContext &cmd_ctx,
+                                   BakeTarget &bake_target,
+                                   const glm::uvec2 &origin,
+                                   const glm::uvec2 &size)
+{
+    dxr::Texture2D &ao_image = bake_target.ao_image;
+    const glm::uvec2 dims = ao_image.dims();
+    const size_t pixel_size = ao_image.pixel_size();
+    const size_t ao_row_pitch =
+        align_to(size.x * pixel_size, D3D12_TEXTURE_DATA_PITCH_ALIGNMENT);
+    const size_t accum_offset = ao_row_pitch * size.y;
+    const size_t accum_row_size = size.x * sizeof(glm::vec2);
+    dxr::Buffer readback_buf = dxr::Buffer::readback(
+        device, accum_offset + accum_row_size * size.y, D3D12_RESOURCE_STATE_COPY_DEST);
+
+    const D3D12_RESOURCE_STATES prev_state = ao_image.state();
+    cmd_ctx.begin();
+    {
+        const std::array<D3D12_RESOURCE_BARRIER, 2> b = {
+            dxr::barrier_transition(ao_image, D3D12_RESOURCE_STATE_COPY_SOURCE),
+            dxr::barrier_transition(bake_target.accum_buf, D3D12_RESOURCE_STATE_COPY_SOURCE)};
+        cmd_ctx.cmd_list->ResourceBarrier(b.size(), b.data());
+    }
+    D3D12_TEXTURE_COPY_LOCATION dst_desc = {0};
+    dst_desc.pResource = readback_buf.get();
+    dst_desc.Type = D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT;
+    dst_desc.PlacedFootprint.Offset = readback_buf.offset();
+    dst_desc.PlacedFootprint.Footprint.Format = ao_image.pixel_format();
+    dst_desc.PlacedFootprint.Footprint.Width = size.x;
+    dst_desc.PlacedFootprint.Footprint.Height = size.y;
+    dst_desc.PlacedFootprint.Footprint.Depth = 1;
+    dst_desc.PlacedFootprint.Footprint.RowPitch = ao_row_pitch;
+
+    D3D12_TEXTURE_COPY_LOCATION src_desc = {0};
+    src_desc.pResource = ao_image.get();
+    src_desc.Type = D3D12_TEXTURE_COPY_TYPE_SUBRESOURCE_INDEX;
+    src_desc.SubresourceIndex = 0;
+
+    D3D12_BOX region = {0};
+    region.left = origin.x;
+    region.right = origin.x + size.x;
+    region.top = origin.y;
+    region.bottom = origin.y + size.y;
+    region.front = 0;
+    region.back = 1;
+    cmd_ctx.cmd_list->CopyTextureRegion(&dst_desc, 0, 0, 0, &src_desc, &region);
+    // The accumulation buffer is linear, so each of the tile's rows is its own copy
+    for (uint32_t y = 0; y < size.y; ++y) {
+        cmd_ctx.cmd_list->CopyBufferRegion(
+            readback_buf.get(),
+            readback_buf.offset() + accum_offset + y * accum_row_size,
+            bake_target.accum_buf.get(),
+            ((size_t(origin.y) + y) * dims.x + origin.x) * sizeof(glm::vec2),
+            accum_row_size);
+    }
+    {
+        const std::array<D3D12_RESOURCE_BARRIER, 2> b = {
+            dxr::barrier_transition(ao_image, prev_state),
+            dxr::barrier_transition(bake_target.accum_buf,
+                                    D3D12_RESOURCE_STATE_UNORDERED_ACCESS)};
+        cmd_ctx.cmd_list->ResourceBarrier(b.size(), b.data());
+    }
+    cmd_ctx.submit_and_sync();
+
+    BakeTileResult tile;
+    tile.origin = origin;
+    tile.size = size;
+    tile.ao_pixel_size = pixel_size;
+    tile.ao_pixels.resize(size_t(size.x) * size.y * pixel_size);
+    tile.accum.resize(size_t(size.x) * size.y);
+    const uint8_t *data = static_cast<const uint8_t *>(readback_buf.map());
+    const size_t ao_row_size = size.x * pixel_size;
+    for (uint32_t y = 0; y < size.y; ++y) {
+        std::memcpy(tile.ao_pixels.data() + y * ao_row_size,
+                    data + y * ao_row_pitch,
+                    ao_row_size);
+    }
+    std::memcpy(tile.accum.data(), data + accum_offset, accum_row_size * size.y);
+    readback_buf.unmap();
+    return tile;
+}
+
+void upload_bake_tile(ID3D12Device5 *device,
+                      dxr::CommandContext &cmd_ctx,
+                      BakeTarget &bake_target,
+                      const BakeTileResult &tile)
+{
+    dxr::Texture2D &ao_image = bake_target.ao_image;
+    const glm::uvec2 dims = ao_image.dims();
+    const size_t ao_row_size = tile.size.x * tile.ao_pixel_size;
+    const size_t ao_row_pitch = align_to(ao_row_size, D3D12_TEXTURE_DATA_PITCH_ALIGNMENT);
+    const size_t accum_offset = ao_row_pitch * tile.size.y;
+    const size_t accum_row_size = tile.size.x * sizeof(glm::vec2);
+    dxr::Buffer upload_buf =
+        dxr::Buffer::upload(device,
+                            accum_offset + accum_row_size * tile.size.y,
+                            D3D12_RESOURCE_STATE_GENERIC_READ);
+    uint8_t *data = static_cast<uint8_t *>(upload_buf.map());
+    for (uint32_t y = 0; y < tile.size.y; ++y) {
+        std::memcpy(data + y * ao_row_pitch,
+                    tile.ao_pixels.data() + y * ao_row_size,
+                    ao_row_size);
+    }
+    std::memcpy(data + accum_offset, tile.accum.data(), accum_row_size * tile.size.y);
+    upload_buf.unmap();
+
+    const D3D12_RESOURCE_STATES prev_state = ao_image.state();
+    cmd_ctx.begin();
+    {
+        const std::array<D3D12_RESOURCE_BARRIER, 2> b = {
+            dxr::barrier_transition(ao_image, D3D12_RESOURCE_STATE_COPY_DEST),
+            dxr::barrier_transition(bake_target.accum_buf, D3D12_RESOURCE_STATE_COPY_DEST)};
+        cmd_ctx.cmd_list->ResourceBarrier(b.size(), b.data());
+    }
+    D3D12_TEXTURE_COPY_LOCATION dst_desc = {0};
+    dst_desc.pResource = ao_image.get();
+    dst_desc.Type = D3D12_TEXTURE_COPY_TYPE_SUBRESOURCE_INDEX;
+    dst_desc.SubresourceIndex = 0;
+
+    D3D12_TEXTURE_COPY_LOCATION src_desc = {0};
+    src_desc.pResource = upload_buf.get();
+    src_desc.Type = D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT;
+    src_desc.PlacedFootprint.Offset = upload_buf.offset();
+    src_desc.PlacedFootprint.Footprint.Format = ao_image.pixel_format();
+    src_desc.PlacedFootprint.Footprint.Width = tile.size.x;
+    src_desc.PlacedFootprint.Footprint.Height = tile.size.y;
+    src_desc.PlacedFootprint.Footprint.Depth = 1;
+    src_desc.PlacedFootprint.Footprint.RowPitch = ao_row_pitch;
+    cmd_ctx.cmd_list->CopyTextureRegion(
+        &dst_desc, tile.origin.x, tile.origin.y, 0, &src_desc, nullptr);
+    for (uint32_t y = 0; y < tile.size.y; ++y) {
+        cmd_ctx.cmd_list->CopyBufferRegion(
+            bake_target.accum_buf.get(),
+            ((size_t(tile.origin.y) + y) * dims.x + tile.origin.x) * sizeof(glm::vec2),
+            upload_buf.get(),
+            upload_buf.offset() + accum_offset + y * accum_row_size,
+            accum_row_size);
+    }
+    {
+        const std::array<D3D12_RESOURCE_BARRIER, 2> b = {
+            dxr::barrier_transition(ao_image, prev_state),
+            dxr::barrier_transition(bake_target.accum_buf,
+                                    D3D12_RESOURCE_STATE_UNORDERED_ACCESS)};
+        cmd_ctx.cmd_list->ResourceBarrier(b.size(), b.data());
+    }
+    cmd_ctx.submit_and_sync();
+}
+
+RayStats bake_distributed_tiles(ID3D12Device5 *device,
+                                dxr::CommandContext &cmd_ctx,
+                                BakePipeline &pipeline,
+                                BakeScene &bake_scene,
+                                BakeTarget &bake_target,
+                                RayStatsQuery &ray_stats_query,
+                                const AtlasParams &atlas_params,
+                                const AppOptions &options,
+                                dxr::GpuProfiler &profiler)
+{
+    TRACE_SCOPE("bake_distributed_tiles");
+    BakeJobQueue queue(options.distribute_dir);
+    const std::string coordinator = bake_worker_name();
+
+    BakeJob job;
+    job.scene_cache_key =
+        scene_cache_key(options.scene_file, options.scene_load, options.atlas_options);
+    job.occluder_proxy_ratio = options.scene_load.occluder_proxy_ratio;
+    job.occluder_near_field = options.scene_load.occluder_near_field;
+    job.occluder_class_fields = options.scene_load.occluder_class_fields;
+    job.occluder_small_size = options.scene_load.occluder_small_size;
+    job.occluder_tiny_size = options.scene_load.occluder_tiny_size;
+    job.atlas_size = bake_scene.atlas_size;
+    job.tile_size = options.tile_size;
+    job.n_samples = atlas_params.n_samples;
+    job.samples_per_frame = atlas_params.samples_per_frame;
+    job.ao_length = atlas_params.ao_length;
+    job.sampler_type = atlas_params.sampler_type;
+    job.sampler_seed = atlas_params.sampler_seed;
+    job.ao_format = bake_target.ao_image.pixel_format();
+    // The job ID only has to differ from earlier jobs in the directory
+    Hasher hasher;
+    hasher.add(job.scene_cache_key);
+    hasher.add(std::chrono::system_clock::now().time_since_epoch().count());
+    hasher.add(coordinator.data(), coordinator.size());
+    job.job_id = hasher.h;
+
+    const std::vector<glm::uvec2> tiles = job.tiles();
+    queue.publish(job);
+    std::cout << "Distributed bake job " << std::hex << job.job_id << std::dec
+              << " published to " << options.distribute_dir << ", " << tiles.size()
+              << " tiles\n";
+
+    // The last claim seen on each tile and when it last changed, to notice stalled workers
+    struct TileLease {
+        std::string claim;
+        std::chrono::steady_clock::time_point changed;
+    };
+    std::vector<TileLease> leases(tiles.size());
+    std::vector<bool> merged(tiles.size(), false);
+    size_t num_merged = 0;
+    size_t local_tiles = 0;
+    RayStats local_stats;
+    RayStats remote_stats;
+
+    const auto poll_workers = [&]() {
+        const auto now = std::chrono::steady_clock::now();
+        for (uint32_t t = 0; t < tiles.size(); ++t) {
+            if (merged[t]) {
+                continue;
+            }
+            BakeTileResult result;
+            if (queue.read_result(job, t, result)) {
+                upload_bake_tile(device, cmd_ctx, bake_target, result);
+                merged[t] = true;
+                ++num_merged;
+                remote_stats.rays += result.rays;
+                remote_stats.hits += result.hits;
+                remote_stats.gpu_ms += result.gpu_ms;
+                continue;
+            }
+            const std::string claim = queue.read_claim(job, t);
+            if (claim != leases[t].claim) {
+                leases[t].claim = claim;
+                leases[t].changed = now;
+            } else if (!claim.empty() &&
+                       std::chrono::duration<float>(now - leases[t].changed).count() >
+                           options.worker_timeout) {
+                std::cout << "Warning: Worker " << claim.substr(0, claim.find(' '))
+                          << " stalled on tile " << t << ", requeuing it\n";
+                queue.release_claim(job, t);
+                leases[t].claim.clear();
+                leases[t].changed = now;
+            }
+        }
+    };
+
+    while (num_merged < tiles.size()) {
+        poll_workers();
+        bool baked = false;
+        for (uint32_t t = 0; t < tiles.size() && !baked; ++t) {
+            if (merged[t] || !queue.claim_tile(job, t, coordinator)) {
+                continue;
+            }
+            const RayStats tile_stats = bake_tile_samples(cmd_ctx,
+                                                          pipeline,
+                                                          bake_scene,
+                                                          bake_target,
+                                                          ray_stats_query,
+                                                          atlas_params,
+                                                          options.tile_size,
+                                                          tiles[t],
+                                                          profiler);
+            local_stats.rays += tile_stats.rays;
+            local_stats.hits += tile_stats.hits;
+            local_stats.gpu_ms += tile_stats.gpu_ms;
+            merged[t] = true;
+            ++num_merged;
+            ++local_tiles;
+            baked = true;
+        }
+        if (!baked && num_merged < tiles.size()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        }
+    }
+    queue.finish(job);
+    std::cout << "Distributed bake: " << local_tiles << "/" << tiles.size()
+              << " tiles baked by the coordinator, " << tiles.size() - local_tiles
+              << " by the workers\n";
+
+    RayStats stats;
+    stats.rays = local_stats.rays + remote_stats.rays;
+    stats.hits = local_stats.hits + remote_stats.hits;
+    stats.gpu_ms = local_stats.gpu_ms + remote_stats.gpu_ms;
+    return stats;
+}
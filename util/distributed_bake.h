@@ -0,0 +1,40 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include "ao_bake.h"
+#include "bake_job.h"
+
+/* Run as a worker of the distributed bakes in the job directory: wait for a job, map its
+ * scene cache and bake the tiles it can claim, writing back each tile's result, until the
+ * job completes. Then wait for the next job, until the process is stopped
+ */
+void run_bake_worker(const AppOptions &options);
+
+// Read back the AO and accumulation of the bake target's texels in the tile
+BakeTileResult read_back_bake_tile(ID3D12Device5 *device,
+                                   dxr::CommandContext &cmd_ctx,
+                                   BakeTarget &bake_target,
+                                   const glm::uvec2 &origin,
+                                   const glm::uvec2 &size);
+
+// Upload the tile's AO and accumulation over its texels in the bake target
+void upload_bake_tile(ID3D12Device5 *device,
+                      dxr::CommandContext &cmd_ctx,
+                      BakeTarget &bake_target,
+                      const BakeTileResult &tile);
+
+/* Coordinate the distributed bake of the atlas's tiles in the job directory, publishing
+ * the job and baking tiles itself while merging the workers' results into the bake target
+ * as they arrive. Claims whose heartbeat stalls for the worker timeout are released, so
+ * the tiles of lost workers are baked again by another node. Returns the rays traced
+ * and the GPU time summed over all nodes
+ */
+RayStats bake_distributed_tiles(ID3D12Device5 *device,
+                                dxr::CommandContext &cmd_ctx,
+                                BakePipeline &pipeline,
+                                BakeScene &bake_scene,
+                                BakeTarget &bake_target,
+                                RayStatsQuery &ray_stats_query,
+                                const AtlasParams &atlas_params,
+                                const AppOptions &options,
+                                dxr::GpuProfiler &profiler);
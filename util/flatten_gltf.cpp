@@ -1,6 +1,7 @@
 #include "flatten_gltf.h"
-#include <iterator>
 #include <string>
+#include <utility>
+#include <vector>
 #include "tiny_gltf.h"
 #include <glm/ext.hpp>
 #include <glm/glm.hpp>
@@ -29,67 +30,26 @@ glm::mat4 read_node_transform(const tinygltf::Node &n)
     return transform;
 }
 
-bool gltf_is_single_level(const tinygltf::Model &model)
+void flatten_gltf(const tinygltf::Model &model, const GltfMeshFn &mesh_fn)
 {
-    // Recursively traverse the GLTF scene graph and break once we
-    // encounter multi-level instancing
-    for (const auto &n : model.scenes[model.defaultScene].nodes) {
-        const auto &node = model.nodes[n];
-        if (!node.children.empty()) {
-            return false;
-        }
-    }
-    return true;
-}
-
-void flatten_gltf_node(const tinygltf::Node &node,
-                       const tinygltf::Model &model,
-                       const glm::mat4 &parent_transform,
-                       std::vector<tinygltf::Node> &flattened)
-{
-    const glm::mat4 transform = parent_transform * read_node_transform(node);
-    tinygltf::Node flat = node;
-    flat.children.clear();
-    // Clear the old transform and set the new flattened one
-    flat.scale.clear();
-    flat.rotation.clear();
-    flat.translation.clear();
-    flat.matrix.clear();
-    std::copy(glm::value_ptr(transform),
-              glm::value_ptr(transform) + 16,
-              std::back_inserter(flat.matrix));
-    if (flat.mesh != -1 || flat.camera != -1 || flat.skin != -1) {
-        flattened.push_back(flat);
+    // Walk the hierarchy depth first with an explicit stack of nodes and their parent's world
+    // transform, so deeply nested scenes don't overflow the call stack
+    std::vector<std::pair<int, glm::mat4>> stack;
+    const auto &roots = model.scenes[model.defaultScene].nodes;
+    for (auto it = roots.rbegin(); it != roots.rend(); ++it) {
+        stack.emplace_back(*it, glm::mat4(1.f));
     }
-
-    for (const auto &c : node.children) {
-        flatten_gltf_node(model.nodes[c], model, transform, flattened);
-    }
-}
-
-void flatten_gltf(tinygltf::Model &model)
-{
-    if (gltf_is_single_level(model)) {
-        return;
-    }
-
-    // If the GLTF model is not single-level we'll make a new scene which
-    // is single level, and set this as the new default scene
-    std::vector<tinygltf::Node> flattened_nodes;
-    for (const auto &n : model.scenes[model.defaultScene].nodes) {
-        glm::mat4 transform(1.f);
-        flatten_gltf_node(model.nodes[n], model, transform, flattened_nodes);
-    }
-
-    const size_t flat_scene_start = model.nodes.size();
-    std::copy(flattened_nodes.begin(), flattened_nodes.end(), std::back_inserter(model.nodes));
-
-    tinygltf::Scene flattened_scene = model.scenes[model.defaultScene];
-    flattened_scene.name += "_flattened";
-    flattened_scene.nodes.clear();
-    for (size_t i = 0; i < flattened_nodes.size(); ++i) {
-        flattened_scene.nodes.push_back(flat_scene_start + i);
+    while (!stack.empty()) {
+        const auto entry = stack.back();
+        stack.pop_back();
+        const tinygltf::Node &node = model.nodes[entry.first];
+        const glm::mat4 transform = entry.second * read_node_transform(node);
+        if (node.mesh != -1) {
+            mesh_fn(node, transform);
+        }
+        // Push the children in reverse to visit them in order
+        for (auto it = node.children.rbegin(); it != node.children.rend(); ++it) {
+            stack.emplace_back(*it, transform);
+        }
     }
-    model.defaultScene = model.scenes.size();
-    model.scenes.push_back(flattened_scene);
 }
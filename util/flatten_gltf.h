@@ -1,15 +1,16 @@
 #pragma once
 
+#include <functional>
 #include <string>
 #include "tiny_gltf.h"
 #include <glm/glm.hpp>
 
 glm::mat4 read_node_transform(const tinygltf::Node &n);
 
-// Check if the GLTF scene contains only single-level instancing
-bool gltf_is_single_level(const tinygltf::Model &model);
+using GltfMeshFn = std::function<void(const tinygltf::Node &, const glm::mat4 &)>;
 
-/* Convert the potentially multi-level instanced GLTf scene to one which uses only
- * single level instancing.
+/* Call mesh_fn with each node of the default scene referencing a mesh and the node's world
+ * transform. Multi-level instancing is walked in place, each mesh node is visited once per
+ * path to it through the hierarchy without copying the nodes or meshes
  */
-void flatten_gltf(tinygltf::Model &model);
+void flatten_gltf(const tinygltf::Model &model, const GltfMeshFn &mesh_fn);
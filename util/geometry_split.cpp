@@ -0,0 +1,180 @@
+#include "geometry_split.h"
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include "trace.h"
+#include "util.h"
+
+namespace {
+
+// Spread the lower 10 bits of v out to every third bit
+uint32_t spread_bits(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// Order the triangles of the geometry along a Morton curve through their centroids
+std::vector<uint32_t> morton_order(const Geometry &g)
+{
+    const ArrayView<glm::vec3> vertices = g.vertex_data();
+    const ArrayView<glm::uvec3> indices = g.index_data();
+    std::vector<glm::vec3> centroids(indices.size());
+    glm::vec3 lower(std::numeric_limits<float>::infinity());
+    glm::vec3 upper(-std::numeric_limits<float>::infinity());
+    for (size_t i = 0; i < indices.size(); ++i) {
+        const glm::uvec3 &tri = indices[i];
+        centroids[i] = (vertices[tri.x] + vertices[tri.y] + vertices[tri.z]) / 3.f;
+        lower = glm::min(lower, centroids[i]);
+        upper = glm::max(upper, centroids[i]);
+    }
+    const glm::vec3 extent = glm::max(upper - lower, glm::vec3(1e-20f));
+
+    std::vector<uint32_t> codes(indices.size());
+    for (size_t i = 0; i < indices.size(); ++i) {
+        const glm::vec3 p = (centroids[i] - lower) / extent * 1024.f;
+        const glm::uvec3 q = glm::uvec3(glm::clamp(p, glm::vec3(0.f), glm::vec3(1023.f)));
+        codes[i] = (spread_bits(q.x) << 2) | (spread_bits(q.y) << 1) | spread_bits(q.z);
+    }
+    std::vector<uint32_t> order(indices.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](const uint32_t a, const uint32_t b) {
+        return codes[a] < codes[b];
+    });
+    return order;
+}
+
+// Build a geometry from the triangles of g, keeping only the vertices they reference
+Geometry extract_chunk(const Geometry &g, const uint32_t *tris, size_t num_tris)
+{
+    const ArrayView<glm::vec3> vertices = g.vertex_data();
+    const ArrayView<glm::vec3> normals = g.normal_data();
+    const ArrayView<glm::vec2> uvs = g.uv_data();
+    const ArrayView<glm::vec2> lightmap_uvs = g.lightmap_uv_data();
+    const ArrayView<glm::uvec3> indices = g.index_data();
+    Geometry out;
+    out.alpha_tested = g.alpha_tested;
+    phmap::flat_hash_map<uint32_t, uint32_t> vertex_remap;
+    out.indices.reserve(num_tris);
+    for (size_t t = 0; t < num_tris; ++t) {
+        glm::uvec3 tri;
+        for (int i = 0; i < 3; ++i) {
+            const uint32_t v = indices[tris[t]][i];
+            auto inserted =
+                vertex_remap.insert(std::make_pair(v, uint32_t(out.vertices.size())));
+            if (inserted.second) {
+                out.vertices.push_back(vertices[v]);
+                if (!normals.empty()) {
+                    out.normals.push_back(normals[v]);
+                }
+                if (!uvs.empty()) {
+                    out.uvs.push_back(uvs[v]);
+                }
+                if (!lightmap_uvs.empty()) {
+                    out.lightmap_uvs.push_back(lightmap_uvs[v]);
+                }
+            }
+            tri[i] = inserted.first->second;
+        }
+        out.indices.push_back(tri);
+    }
+    return out;
+}
+
+/* Split the geometry into chunks of consecutive triangles along the Morton curve, cutting a
+ * chunk when adding the next triangle would exceed either limit
+ */
+std::vector<Geometry> split_geometry(const Geometry &g, const GeometrySplitLimits &limits)
+{
+    const std::vector<uint32_t> order = morton_order(g);
+    const ArrayView<glm::uvec3> indices = g.index_data();
+
+    // The chunk each vertex was last referenced by, to count the chunk's unique vertices
+    std::vector<uint32_t> vertex_chunk(g.vertex_data().size(), uint32_t(-1));
+    std::vector<size_t> chunk_starts = {0};
+    size_t chunk_vertices = 0;
+    for (size_t i = 0; i < order.size(); ++i) {
+        const glm::uvec3 &tri = indices[order[i]];
+        size_t new_vertices = 0;
+        for (int j = 0; j < 3; ++j) {
+            new_vertices += vertex_chunk[tri[j]] != chunk_starts.size() - 1 ? 1 : 0;
+        }
+        const size_t chunk_tris = i - chunk_starts.back();
+        if (chunk_tris > 0 && (chunk_tris + 1 > limits.max_triangles ||
+                               chunk_vertices + new_vertices > limits.max_vertices)) {
+            chunk_starts.push_back(i);
+            chunk_vertices = 0;
+        }
+        const uint32_t chunk = chunk_starts.size() - 1;
+        for (int j = 0; j < 3; ++j) {
+            if (vertex_chunk[tri[j]] != chunk) {
+                vertex_chunk[tri[j]] = chunk;
+                ++chunk_vertices;
+            }
+        }
+    }
+    chunk_starts.push_back(order.size());
+
+    std::vector<Geometry> chunks(chunk_starts.size() - 1);
+    parallel_tasks(chunks.size(), [&](size_t c) {
+        chunks[c] = extract_chunk(
+            g, order.data() + chunk_starts[c], chunk_starts[c + 1] - chunk_starts[c]);
+    });
+    return chunks;
+}
+
+}
+
+void split_oversized_geometries(Scene &scene,
+                                const GeometrySplitLimits &limits,
+                                GeometrySplitStats &stats)
+{
+    TRACE_SCOPE("split_oversized_geometries");
+    // The original geometry each geometry of the split meshes came from
+    std::vector<std::vector<size_t>> mesh_source_geometry(scene.meshes.size());
+    for (size_t mesh_id = 0; mesh_id < scene.meshes.size(); ++mesh_id) {
+        Mesh &mesh = scene.meshes[mesh_id];
+        auto is_oversized = [&](const Geometry &g) {
+            return g.index_data().size() > limits.max_triangles ||
+                   g.vertex_data().size() > limits.max_vertices;
+        };
+        if (std::none_of(mesh.geometries.begin(), mesh.geometries.end(), is_oversized)) {
+            continue;
+        }
+
+        std::vector<Geometry> geometries;
+        std::vector<size_t> &source_geometry = mesh_source_geometry[mesh_id];
+        for (size_t i = 0; i < mesh.geometries.size(); ++i) {
+            Geometry &g = mesh.geometries[i];
+            if (!is_oversized(g)) {
+                geometries.push_back(std::move(g));
+                source_geometry.push_back(i);
+                continue;
+            }
+            std::vector<Geometry> chunks = split_geometry(g, limits);
+            ++stats.split_geometries;
+            stats.chunks += chunks.size();
+            for (auto &c : chunks) {
+                geometries.push_back(std::move(c));
+                source_geometry.push_back(i);
+            }
+        }
+        mesh.geometries = std::move(geometries);
+    }
+
+    for (auto &inst : scene.instances) {
+        const std::vector<size_t> &source_geometry = mesh_source_geometry[inst.mesh_id];
+        if (source_geometry.empty()) {
+            continue;
+        }
+        std::vector<uint32_t> material_ids;
+        for (const auto &s : source_geometry) {
+            material_ids.push_back(s < inst.material_ids.size() ? inst.material_ids[s]
+                                                                : uint32_t(-1));
+        }
+        inst.material_ids = std::move(material_ids);
+    }
+}
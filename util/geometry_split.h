@@ -0,0 +1,25 @@
+#pragma once
+
+#include <vector>
+#include "scene.h"
+
+// The largest geometry kept whole, larger ones are split into chunks under both limits
+struct GeometrySplitLimits {
+    size_t max_triangles = 1 << 22;
+    size_t max_vertices = 1 << 22;
+};
+
+struct GeometrySplitStats {
+    size_t split_geometries = 0;
+    size_t chunks = 0;
+};
+
+/* Split the geometries over the limits into spatially coherent chunks, replacing each in
+ * its mesh with its chunks so they're built as geometries of the mesh's BLAS and drawn as
+ * separate ranges. The triangles are ordered along a Morton curve through their centroids
+ * and cut into consecutive runs under the limits. The instances' material IDs are updated
+ * to match, and each chunk keeps its geometry's alpha tested flag
+ */
+void split_oversized_geometries(Scene &scene,
+                                const GeometrySplitLimits &limits,
+                                GeometrySplitStats &stats);
@@ -0,0 +1,801 @@
+#include "image_export.h"
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <queue>
+#include "thread_pool.h"
+#include "trace.h"
+#include "util.h"
+
+namespace {
+
+// The uncompressed bytes of each PNG band deflated on its own
+const size_t png_band_bytes = 4 * 1024 * 1024;
+// Candidate matches followed per position by the LZ77 match search
+const int max_match_chain = 16;
+const size_t deflate_window = 32768;
+const size_t max_match_length = 258;
+const uint32_t hash_bits = 15;
+// The LZ77 symbols written per Huffman block, each block building its own code
+const size_t deflate_block_tokens = 64 * 1024;
+const size_t num_lit_codes = 288;
+const size_t num_dist_codes = 30;
+const size_t num_code_length_codes = 19;
+// The order the lengths of the code length code are written in the block header
+const std::array<uint8_t, 19> code_length_order = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+const std::array<uint16_t, 29> length_base = {3,  4,  5,  6,   7,   8,   9,   10,  11, 13,
+                                              15, 17, 19, 23,  27,  31,  35,  43,  51, 59,
+                                              67, 83, 99, 115, 131, 163, 195, 227, 258};
+const std::array<uint8_t, 29> length_extra = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                              2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const std::array<uint16_t, 30> dist_base = {
+    1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+    193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const std::array<uint8_t, 30> dist_extra = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                            6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13,
+                                            13};
+
+// Writes the deflate bit stream, filling each byte from its least significant bit
+class BitWriter {
+    std::vector<uint8_t> &out;
+    uint32_t bits = 0;
+    uint32_t count = 0;
+
+public:
+    explicit BitWriter(std::vector<uint8_t> &out) : out(out) {}
+
+    void put(uint32_t value, uint32_t n)
+    {
+        bits |= value << count;
+        count += n;
+        while (count >= 8) {
+            out.push_back(bits & 0xff);
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+
+    // Pad the stream to the next byte with zero bits
+    void align()
+    {
+        if (count > 0) {
+            out.push_back(bits & 0xff);
+            bits = 0;
+            count = 0;
+        }
+    }
+};
+
+// The Huffman codes are packed from their most significant bit, so are written reversed
+uint32_t reverse_bits(uint32_t code, uint32_t n)
+{
+    uint32_t r = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        r = (r << 1) | (code & 1);
+        code >>= 1;
+    }
+    return r;
+}
+
+// A literal, or a match of length bytes at distance back if distance isn't 0
+struct LzToken {
+    uint16_t literal_or_length;
+    uint16_t distance;
+};
+
+size_t length_code(uint32_t length)
+{
+    return std::upper_bound(length_base.begin(), length_base.end(), length) -
+           length_base.begin() - 1;
+}
+
+size_t dist_code(uint32_t distance)
+{
+    return std::upper_bound(dist_base.begin(), dist_base.end(), distance) - dist_base.begin() -
+           1;
+}
+
+/* Build the code lengths of a Huffman code for the symbol frequencies, limited to max_bits
+ * bits. If the code would be deeper the frequencies are flattened until it fits. At least
+ * two symbols are given codes, as decoders reject codes with a single one
+ */
+std::vector<uint8_t> huffman_lengths(std::vector<uint32_t> freqs, uint32_t max_bits)
+{
+    const uint32_t n = freqs.size();
+    size_t used = std::count_if(freqs.begin(), freqs.end(), [](uint32_t f) { return f > 0; });
+    for (uint32_t s = 0; used < 2 && s < n; ++s) {
+        if (freqs[s] == 0) {
+            freqs[s] = 1;
+            ++used;
+        }
+    }
+
+    std::vector<uint8_t> lengths(n, 0);
+    while (true) {
+        // The leaves are nodes [0, n) and the internal nodes follow, each after its children
+        using Node = std::pair<uint64_t, uint32_t>;
+        std::priority_queue<Node, std::vector<Node>, std::greater<Node>> queue;
+        for (uint32_t s = 0; s < n; ++s) {
+            if (freqs[s] > 0) {
+                queue.push(Node(freqs[s], s));
+            }
+        }
+        std::vector<uint32_t> parent(2 * n, 0);
+        uint32_t next = n;
+        while (queue.size() > 1) {
+            const Node a = queue.top();
+            queue.pop();
+            const Node b = queue.top();
+            queue.pop();
+            parent[a.second] = next;
+            parent[b.second] = next;
+            queue.push(Node(a.first + b.first, next++));
+        }
+        std::vector<uint32_t> depth(next, 0);
+        for (uint32_t node = next - 1; node-- > n;) {
+            depth[node] = depth[parent[node]] + 1;
+        }
+        uint32_t max_length = 0;
+        for (uint32_t s = 0; s < n; ++s) {
+            if (freqs[s] > 0) {
+                lengths[s] = depth[parent[s]] + 1;
+                max_length = std::max(max_length, uint32_t(lengths[s]));
+            }
+        }
+        if (max_length <= max_bits) {
+            return lengths;
+        }
+        for (auto &f : freqs) {
+            if (f > 0) {
+                f = (f >> 1) | 1;
+            }
+        }
+    }
+}
+
+// The canonical Huffman codes for the code lengths, reversed to be written directly
+std::vector<uint16_t> canonical_codes(const std::vector<uint8_t> &lengths)
+{
+    std::array<uint32_t, 16> length_count = {0};
+    for (const auto l : lengths) {
+        ++length_count[l];
+    }
+    length_count[0] = 0;
+    std::array<uint32_t, 16> next_code = {0};
+    uint32_t code = 0;
+    for (size_t bits = 1; bits < next_code.size(); ++bits) {
+        code = (code + length_count[bits - 1]) << 1;
+        next_code[bits] = code;
+    }
+    std::vector<uint16_t> codes(lengths.size(), 0);
+    for (size_t s = 0; s < lengths.size(); ++s) {
+        if (lengths[s] > 0) {
+            codes[s] = reverse_bits(next_code[lengths[s]]++, lengths[s]);
+        }
+    }
+    return codes;
+}
+
+// The code lengths of the fixed literal/length code
+std::vector<uint8_t> fixed_lit_lengths()
+{
+    std::vector<uint8_t> lengths(num_lit_codes, 8);
+    std::fill(lengths.begin() + 144, lengths.begin() + 256, 9);
+    std::fill(lengths.begin() + 256, lengths.begin() + 280, 7);
+    return lengths;
+}
+
+// A code length code symbol and the value of its extra bits
+using CodeLengthSymbol = std::pair<uint8_t, uint8_t>;
+
+/* Run length encode the code lengths with the code length code's repeat symbols: 16
+ * repeats the previous length 3-6 times, 17 and 18 write 3-10 and 11-138 zeros
+ */
+std::vector<CodeLengthSymbol> encode_code_lengths(const std::vector<uint8_t> &lengths)
+{
+    std::vector<CodeLengthSymbol> symbols;
+    size_t i = 0;
+    while (i < lengths.size()) {
+        const uint8_t l = lengths[i];
+        size_t run = 1;
+        while (i + run < lengths.size() && lengths[i + run] == l) {
+            ++run;
+        }
+        i += run;
+        if (l == 0) {
+            while (run >= 11) {
+                const size_t r = std::min(run, size_t(138));
+                symbols.emplace_back(18, r - 11);
+                run -= r;
+            }
+            if (run >= 3) {
+                symbols.emplace_back(17, run - 3);
+                run = 0;
+            }
+        } else {
+            symbols.emplace_back(l, 0);
+            --run;
+            while (run >= 3) {
+                const size_t r = std::min(run, size_t(6));
+                symbols.emplace_back(16, r - 3);
+                run -= r;
+            }
+        }
+        for (; run > 0; --run) {
+            symbols.emplace_back(l, 0);
+        }
+    }
+    return symbols;
+}
+
+uint32_t code_length_extra_bits(uint8_t symbol)
+{
+    return symbol == 16 ? 2 : symbol == 17 ? 3 : symbol == 18 ? 7 : 0;
+}
+
+/* Write the tokens as a Huffman block, with the code built for their symbols or the fixed
+ * code, whichever is smaller. The fixed code wins for small blocks, where the dynamic
+ * code's header outweighs its savings
+ */
+void put_block(BitWriter &w, const std::vector<LzToken> &tokens, bool last)
+{
+    std::vector<uint32_t> lit_freqs(num_lit_codes, 0);
+    std::vector<uint32_t> dist_freqs(num_dist_codes, 0);
+    uint64_t extra_bits = 0;
+    for (const auto &t : tokens) {
+        if (t.distance == 0) {
+            ++lit_freqs[t.literal_or_length];
+        } else {
+            const size_t lc = length_code(t.literal_or_length);
+            const size_t dc = dist_code(t.distance);
+            ++lit_freqs[257 + lc];
+            ++dist_freqs[dc];
+            extra_bits += length_extra[lc] + dist_extra[dc];
+        }
+    }
+    ++lit_freqs[256];
+
+    // Only the codes up to 285 and 29 are valid, the rest aren't given lengths
+    std::vector<uint8_t> lit_lengths = huffman_lengths(
+        std::vector<uint32_t>(lit_freqs.begin(), lit_freqs.begin() + 286), 15);
+    std::vector<uint8_t> dist_lengths = huffman_lengths(dist_freqs, 15);
+    size_t n_lit = 286;
+    while (n_lit > 257 && lit_lengths[n_lit - 1] == 0) {
+        --n_lit;
+    }
+    size_t n_dist = num_dist_codes;
+    while (n_dist > 1 && dist_lengths[n_dist - 1] == 0) {
+        --n_dist;
+    }
+
+    // The literal/length and distance code lengths are run length encoded as one sequence
+    std::vector<uint8_t> all_lengths(lit_lengths.begin(), lit_lengths.begin() + n_lit);
+    all_lengths.insert(all_lengths.end(), dist_lengths.begin(), dist_lengths.begin() + n_dist);
+    const std::vector<CodeLengthSymbol> cl_symbols =
+        encode_code_lengths(all_lengths);
+    std::vector<uint32_t> cl_freqs(num_code_length_codes, 0);
+    for (const auto &s : cl_symbols) {
+        ++cl_freqs[s.first];
+    }
+    const std::vector<uint8_t> cl_lengths = huffman_lengths(cl_freqs, 7);
+    size_t n_cl = num_code_length_codes;
+    while (n_cl > 4 && cl_lengths[code_length_order[n_cl - 1]] == 0) {
+        --n_cl;
+    }
+
+    const std::vector<uint8_t> fixed_lengths = fixed_lit_lengths();
+    uint64_t dynamic_bits = 14 + 3 * n_cl + extra_bits;
+    uint64_t fixed_bits = extra_bits;
+    for (const auto &s : cl_symbols) {
+        dynamic_bits += cl_lengths[s.first] + code_length_extra_bits(s.first);
+    }
+    for (size_t s = 0; s < 286; ++s) {
+        dynamic_bits += uint64_t(lit_freqs[s]) * lit_lengths[s];
+        fixed_bits += uint64_t(lit_freqs[s]) * fixed_lengths[s];
+    }
+    for (size_t s = 0; s < num_dist_codes; ++s) {
+        dynamic_bits += uint64_t(dist_freqs[s]) * dist_lengths[s];
+        fixed_bits += uint64_t(dist_freqs[s]) * 5;
+    }
+
+    w.put(last ? 1 : 0, 1);
+    if (fixed_bits <= dynamic_bits) {
+        w.put(1, 2);
+        lit_lengths = fixed_lengths;
+        dist_lengths = std::vector<uint8_t>(num_dist_codes, 5);
+    } else {
+        w.put(2, 2);
+        w.put(n_lit - 257, 5);
+        w.put(n_dist - 1, 5);
+        w.put(n_cl - 4, 4);
+        for (size_t i = 0; i < n_cl; ++i) {
+            w.put(cl_lengths[code_length_order[i]], 3);
+        }
+        const std::vector<uint16_t> cl_codes = canonical_codes(cl_lengths);
+        for (const auto &s : cl_symbols) {
+            w.put(cl_codes[s.first], cl_lengths[s.first]);
+            w.put(s.second, code_length_extra_bits(s.first));
+        }
+    }
+
+    const std::vector<uint16_t> lit_codes = canonical_codes(lit_lengths);
+    const std::vector<uint16_t> dist_codes = canonical_codes(dist_lengths);
+    for (const auto &t : tokens) {
+        if (t.distance == 0) {
+            w.put(lit_codes[t.literal_or_length], lit_lengths[t.literal_or_length]);
+            continue;
+        }
+        const size_t lc = length_code(t.literal_or_length);
+        w.put(lit_codes[257 + lc], lit_lengths[257 + lc]);
+        w.put(t.literal_or_length - length_base[lc], length_extra[lc]);
+        const size_t dc = dist_code(t.distance);
+        w.put(dist_codes[dc], dist_lengths[dc]);
+        w.put(t.distance - dist_base[dc], dist_extra[dc]);
+    }
+    w.put(lit_codes[256], lit_lengths[256]);
+}
+
+uint32_t hash3(const uint8_t *p)
+{
+    const uint32_t v = uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16);
+    return (v * 2654435761u) >> (32 - hash_bits);
+}
+
+/* Deflate the data into Huffman blocks appended to out, see put_block. If last is set the
+ * blocks end the stream, otherwise they're followed by an empty stored block which pads the
+ * stream to a byte, so the next independently deflated data can follow it directly
+ */
+void deflate(const uint8_t *data, size_t size, bool last, std::vector<uint8_t> &out)
+{
+    BitWriter w(out);
+    std::vector<LzToken> tokens;
+    tokens.reserve(std::min(size, deflate_block_tokens));
+
+    std::vector<int32_t> head(size_t(1) << hash_bits, -1);
+    std::vector<int32_t> prev(size, -1);
+    auto insert = [&](size_t i) {
+        if (i + 3 <= size) {
+            const uint32_t h = hash3(data + i);
+            prev[i] = head[h];
+            head[h] = int32_t(i);
+        }
+    };
+    size_t i = 0;
+    while (i < size) {
+        size_t best_length = 0;
+        size_t best_distance = 0;
+        if (i + 3 <= size) {
+            const size_t max_length = std::min(max_match_length, size - i);
+            int32_t candidate = head[hash3(data + i)];
+            for (int chain = 0; candidate >= 0 && chain < max_match_chain &&
+                                i - size_t(candidate) <= deflate_window;
+                 ++chain) {
+                const uint8_t *a = data + candidate;
+                const uint8_t *b = data + i;
+                if (a[best_length] == b[best_length]) {
+                    size_t length = 0;
+                    while (length < max_length && a[length] == b[length]) {
+                        ++length;
+                    }
+                    if (length > best_length) {
+                        best_length = length;
+                        best_distance = i - candidate;
+                        if (length == max_length) {
+                            break;
+                        }
+                    }
+                }
+                candidate = prev[candidate];
+            }
+        }
+        if (best_length >= 3) {
+            tokens.push_back(LzToken{uint16_t(best_length), uint16_t(best_distance)});
+            for (size_t j = 0; j < best_length; ++j) {
+                insert(i + j);
+            }
+            i += best_length;
+        } else {
+            tokens.push_back(LzToken{data[i], 0});
+            insert(i);
+            ++i;
+        }
+        if (tokens.size() == deflate_block_tokens && i < size) {
+            put_block(w, tokens, false);
+            tokens.clear();
+        }
+    }
+    put_block(w, tokens, last);
+
+    if (last) {
+        w.align();
+    } else {
+        w.put(0, 3);
+        w.align();
+        const uint8_t flush[] = {0x00, 0x00, 0xff, 0xff};
+        out.insert(out.end(), flush, flush + sizeof(flush));
+    }
+}
+
+uint32_t adler32(const uint8_t *data, size_t size)
+{
+    const uint32_t base = 65521;
+    uint32_t a = 1;
+    uint32_t b = 0;
+    while (size > 0) {
+        // The sums can't overflow within 5552 bytes
+        const size_t n = std::min(size, size_t(5552));
+        for (size_t i = 0; i < n; ++i) {
+            a += data[i];
+            b += a;
+        }
+        a %= base;
+        b %= base;
+        data += n;
+        size -= n;
+    }
+    return (b << 16) | a;
+}
+
+// The Adler-32 of two adjacent blocks of data from theirs, the second block being size2 long
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t size2)
+{
+    const uint64_t base = 65521;
+    const uint64_t rem = size2 % base;
+    const uint64_t a1 = adler1 & 0xffff;
+    const uint64_t b1 = adler1 >> 16;
+    const uint64_t a2 = adler2 & 0xffff;
+    const uint64_t b2 = adler2 >> 16;
+    const uint64_t a = (a1 + a2 + base - 1) % base;
+    const uint64_t b = (rem * a1 + b1 + b2 + base - rem) % base;
+    return uint32_t((b << 16) | a);
+}
+
+uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size)
+{
+    static const std::array<uint32_t, 256> table = []() {
+        std::array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void put_u32_be(std::vector<uint8_t> &out, uint32_t v)
+{
+    const uint8_t b[] = {uint8_t(v >> 24), uint8_t(v >> 16), uint8_t(v >> 8), uint8_t(v)};
+    out.insert(out.end(), b, b + 4);
+}
+
+void write_png_chunk(std::ofstream &fout,
+                     const char *type,
+                     const std::vector<uint8_t> &data)
+{
+    std::vector<uint8_t> header;
+    put_u32_be(header, data.size());
+    header.insert(header.end(), type, type + 4);
+    uint32_t crc = crc32(0, header.data() + 4, 4);
+    crc = crc32(crc, data.data(), data.size());
+    std::vector<uint8_t> crc_bytes;
+    put_u32_be(crc_bytes, crc);
+    fout.write(reinterpret_cast<const char *>(header.data()), header.size());
+    fout.write(reinterpret_cast<const char *>(data.data()), data.size());
+    fout.write(reinterpret_cast<const char *>(crc_bytes.data()), crc_bytes.size());
+}
+
+uint8_t paeth(int a, int b, int c)
+{
+    const int p = a + b - c;
+    const int pa = std::abs(p - a);
+    const int pb = std::abs(p - b);
+    const int pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+    return pb <= pc ? b : c;
+}
+
+/* Filter the row with each PNG filter and write the one with the smallest sum of absolute
+ * signed bytes, prefixed with its type, to out
+ */
+void filter_png_row(const uint8_t *row,
+                    const uint8_t *prev_row,
+                    size_t row_bytes,
+                    size_t bpp,
+                    uint8_t *out,
+                    std::vector<uint8_t> &scratch)
+{
+    scratch.resize(row_bytes);
+    uint64_t best_sum = ~uint64_t(0);
+    for (uint8_t filter = 0; filter < 5; ++filter) {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < row_bytes; ++i) {
+            const int a = i >= bpp ? row[i - bpp] : 0;
+            const int b = prev_row ? prev_row[i] : 0;
+            const int c = i >= bpp && prev_row ? prev_row[i - bpp] : 0;
+            uint8_t v = row[i];
+            switch (filter) {
+            case 1:
+                v -= a;
+                break;
+            case 2:
+                v -= b;
+                break;
+            case 3:
+                v -= (a + b) / 2;
+                break;
+            case 4:
+                v -= paeth(a, b, c);
+                break;
+            }
+            scratch[i] = v;
+            sum += std::abs(int(int8_t(v)));
+        }
+        if (sum < best_sum) {
+            best_sum = sum;
+            out[0] = filter;
+            std::memcpy(out + 1, scratch.data(), row_bytes);
+        }
+    }
+}
+
+// Swap the 16-bit values of the row to the big endian order of PNG and EXR files
+void swap_bytes_u16(uint8_t *row, size_t row_bytes)
+{
+    for (size_t i = 0; i + 1 < row_bytes; i += 2) {
+        std::swap(row[i], row[i + 1]);
+    }
+}
+
+template <typename T>
+void put_le(std::vector<uint8_t> &out, T v)
+{
+    const uint8_t *b = reinterpret_cast<const uint8_t *>(&v);
+    out.insert(out.end(), b, b + sizeof(T));
+}
+
+void put_exr_attribute(std::vector<uint8_t> &out,
+                       const char *name,
+                       const char *type,
+                       const std::vector<uint8_t> &value)
+{
+    out.insert(out.end(), name, name + std::strlen(name) + 1);
+    out.insert(out.end(), type, type + std::strlen(type) + 1);
+    put_le<int32_t>(out, value.size());
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+}
+
+std::vector<uint8_t> zlib_compress(const uint8_t *data, size_t size)
+{
+    // The header selects deflate with a 32K window and the FCHECK making it a multiple of 31
+    std::vector<uint8_t> out = {0x78, 0x01};
+    deflate(data, size, true, out);
+    put_u32_be(out, adler32(data, size));
+    return out;
+}
+
+bool write_png(const std::string &fname,
+               const glm::uvec2 &dims,
+               uint32_t channels,
+               uint32_t bit_depth,
+               const ImageRowFn &row_fn)
+{
+    TRACE_SCOPE("write_png");
+    if (channels < 1 || channels > 4 || (bit_depth != 8 && bit_depth != 16)) {
+        return false;
+    }
+    const size_t bpp = channels * bit_depth / 8;
+    const size_t row_bytes = dims.x * bpp;
+    // Bands are capped in size, but split small images over all the threads too
+    const size_t n_threads = thread_pool().num_threads();
+    const size_t band_rows = std::max(std::min(png_band_bytes / std::max(row_bytes, size_t(1)),
+                                               (dims.y + n_threads - 1) / n_threads),
+                                      size_t(1));
+    const size_t n_bands = (dims.y + band_rows - 1) / band_rows;
+
+    // Each band filters its rows, including the row before it for the filters to see, and
+    // deflates them on their own
+    std::vector<std::vector<uint8_t>> bands(n_bands);
+    std::vector<uint32_t> band_adler(n_bands, 1);
+    std::vector<size_t> band_size(n_bands, 0);
+    parallel_tasks(n_bands, [&](size_t b) {
+        const uint32_t y_begin = b * band_rows;
+        const uint32_t y_end = std::min(size_t(dims.y), (b + 1) * band_rows);
+        std::vector<uint8_t> filtered((y_end - y_begin) * (row_bytes + 1));
+        std::vector<uint8_t> row(row_bytes);
+        std::vector<uint8_t> prev_row;
+        std::vector<uint8_t> scratch;
+        if (y_begin > 0) {
+            prev_row.resize(row_bytes);
+            row_fn(y_begin - 1, prev_row.data());
+            if (bit_depth == 16) {
+                swap_bytes_u16(prev_row.data(), row_bytes);
+            }
+        }
+        for (uint32_t y = y_begin; y < y_end; ++y) {
+            row_fn(y, row.data());
+            if (bit_depth == 16) {
+                swap_bytes_u16(row.data(), row_bytes);
+            }
+            filter_png_row(row.data(),
+                           prev_row.empty() ? nullptr : prev_row.data(),
+                           row_bytes,
+                           bpp,
+                           filtered.data() + (y - y_begin) * (row_bytes + 1),
+                           scratch);
+            prev_row.swap(row);
+            row.resize(row_bytes);
+        }
+        band_adler[b] = adler32(filtered.data(), filtered.size());
+        band_size[b] = filtered.size();
+        deflate(filtered.data(), filtered.size(), b + 1 == n_bands, bands[b]);
+    });
+
+    std::ofstream fout(fname.c_str(), std::ios::binary);
+    if (!fout) {
+        return false;
+    }
+    const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    fout.write(reinterpret_cast<const char *>(signature), sizeof(signature));
+
+    const uint8_t color_types[] = {0, 4, 2, 6};
+    std::vector<uint8_t> ihdr;
+    put_u32_be(ihdr, dims.x);
+    put_u32_be(ihdr, dims.y);
+    ihdr.push_back(bit_depth);
+    ihdr.push_back(color_types[channels - 1]);
+    ihdr.push_back(0);
+    ihdr.push_back(0);
+    ihdr.push_back(0);
+    write_png_chunk(fout, "IHDR", ihdr);
+
+    // Each band is an IDAT chunk of the zlib stream, which starts with the zlib header and
+    // ends with the Adler-32 of all the bands' data
+    uint32_t adler = 1;
+    for (size_t b = 0; b < n_bands; ++b) {
+        adler = adler32_combine(adler, band_adler[b], band_size[b]);
+    }
+    for (size_t b = 0; b < n_bands; ++b) {
+        std::vector<uint8_t> &data = bands[b];
+        if (b == 0) {
+            const uint8_t zlib_header[] = {0x78, 0x01};
+            data.insert(data.begin(), zlib_header, zlib_header + 2);
+        }
+        if (b + 1 == n_bands) {
+            put_u32_be(data, adler);
+        }
+        write_png_chunk(fout, "IDAT", data);
+        std::vector<uint8_t>().swap(data);
+    }
+    write_png_chunk(fout, "IEND", std::vector<uint8_t>());
+    return bool(fout);
+}
+
+bool write_exr(const std::string &fname,
+               const glm::uvec2 &dims,
+               uint32_t channels,
+               ExrCompression compression,
+               const ImageRowFn &row_fn)
+{
+    TRACE_SCOPE("write_exr");
+    // The channels are stored in alphabetical order, picked from the rows' channels
+    std::vector<std::pair<const char *, uint32_t>> file_channels;
+    if (channels == 1) {
+        file_channels = {{"Y", 0}};
+    } else if (channels == 3) {
+        file_channels = {{"B", 2}, {"G", 1}, {"R", 0}};
+    } else if (channels == 4) {
+        file_channels = {{"A", 3}, {"B", 2}, {"G", 1}, {"R", 0}};
+    } else {
+        return false;
+    }
+
+    std::vector<uint8_t> header = {0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0};
+    std::vector<uint8_t> value;
+    for (const auto &c : file_channels) {
+        value.insert(value.end(), c.first, c.first + std::strlen(c.first) + 1);
+        // HALF pixels, linear, reserved bytes and the x and y sampling
+        put_le<int32_t>(value, 1);
+        put_le<uint32_t>(value, 0);
+        put_le<int32_t>(value, 1);
+        put_le<int32_t>(value, 1);
+    }
+    value.push_back(0);
+    put_exr_attribute(header, "channels", "chlist", value);
+    put_exr_attribute(header, "compression", "compression", {uint8_t(compression)});
+    value.clear();
+    put_le<int32_t>(value, 0);
+    put_le<int32_t>(value, 0);
+    put_le<int32_t>(value, dims.x - 1);
+    put_le<int32_t>(value, dims.y - 1);
+    put_exr_attribute(header, "dataWindow", "box2i", value);
+    put_exr_attribute(header, "displayWindow", "box2i", value);
+    put_exr_attribute(header, "lineOrder", "lineOrder", {0});
+    value.clear();
+    put_le<float>(value, 1.f);
+    put_exr_attribute(header, "pixelAspectRatio", "float", value);
+    put_exr_attribute(header, "screenWindowWidth", "float", value);
+    value.clear();
+    put_le<float>(value, 0.f);
+    put_le<float>(value, 0.f);
+    put_exr_attribute(header, "screenWindowCenter", "v2f", value);
+    header.push_back(0);
+
+    const uint32_t block_lines = compression == EXR_COMPRESSION_ZIP ? 16 : 1;
+    const size_t n_blocks = (dims.y + block_lines - 1) / block_lines;
+    const size_t row_values = size_t(dims.x) * channels;
+    std::vector<std::vector<uint8_t>> blocks(n_blocks);
+    parallel_tasks(n_blocks, [&](size_t b) {
+        const uint32_t y_begin = b * block_lines;
+        const uint32_t y_end = std::min(dims.y, y_begin + block_lines);
+        // Each line stores the channels one after the other
+        std::vector<uint16_t> row(row_values);
+        std::vector<uint8_t> raw(size_t(y_end - y_begin) * row_values * 2);
+        uint16_t *lines = reinterpret_cast<uint16_t *>(raw.data());
+        for (uint32_t y = y_begin; y < y_end; ++y) {
+            row_fn(y, row.data());
+            uint16_t *line = lines + size_t(y - y_begin) * row_values;
+            for (size_t c = 0; c < file_channels.size(); ++c) {
+                const uint32_t src = file_channels[c].second;
+                for (uint32_t x = 0; x < dims.x; ++x) {
+                    line[c * dims.x + x] = row[size_t(x) * channels + src];
+                }
+            }
+        }
+
+        std::vector<uint8_t> data;
+        if (compression != EXR_COMPRESSION_NONE) {
+            // The bytes are split into the even and odd bytes, then delta encoded
+            std::vector<uint8_t> split(raw.size());
+            const size_t half = (raw.size() + 1) / 2;
+            for (size_t i = 0; i < raw.size(); ++i) {
+                split[(i & 1) ? half + i / 2 : i / 2] = raw[i];
+            }
+            for (size_t i = split.size() - 1; i > 0; --i) {
+                split[i] = uint8_t(int(split[i]) - int(split[i - 1]) + 128);
+            }
+            data = zlib_compress(split.data(), split.size());
+        }
+        // Blocks which don't compress are stored raw, as readers detect by their size
+        if (compression == EXR_COMPRESSION_NONE || data.size() >= raw.size()) {
+            data.swap(raw);
+        }
+        std::vector<uint8_t> &block = blocks[b];
+        put_le<int32_t>(block, y_begin);
+        put_le<int32_t>(block, data.size());
+        block.insert(block.end(), data.begin(), data.end());
+    });
+
+    std::ofstream fout(fname.c_str(), std::ios::binary);
+    if (!fout) {
+        return false;
+    }
+    std::vector<uint8_t> offsets;
+    uint64_t offset = header.size() + n_blocks * sizeof(uint64_t);
+    for (const auto &block : blocks) {
+        put_le<uint64_t>(offsets, offset);
+        offset += block.size();
+    }
+    fout.write(reinterpret_cast<const char *>(header.data()), header.size());
+    fout.write(reinterpret_cast<const char *>(offsets.data()), offsets.size());
+    for (const auto &block : blocks) {
+        fout.write(reinterpret_cast<const char *>(block.data()), block.size());
+    }
+    return bool(fout);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+/* Fills row y of the image with its pixels' channels interleaved. The rows are requested
+ * from the thread pool's threads in any order, so the function must be safe to call
+ * concurrently. The images are converted row by row as they're compressed, so the caller's
+ * pixels can be read directly, e.g. from the readback buffer, without a full-size copy
+ */
+using ImageRowFn = std::function<void(uint32_t y, void *row)>;
+
+/* Write a PNG with 1 to 4 channels of 8 or 16 bits, 16-bit rows holding native uint16
+ * values. The rows are filtered and deflated in bands across the thread pool, each band an
+ * independent deflate stream ended by a sync flush, so the bands are concatenated into the
+ * PNG's zlib stream without recompressing. Returns false if the file couldn't be written
+ */
+bool write_png(const std::string &fname,
+               const glm::uvec2 &dims,
+               uint32_t channels,
+               uint32_t bit_depth,
+               const ImageRowFn &row_fn);
+
+// The EXR compression types of the EXR writer, matching the values in the EXR header
+enum ExrCompression : uint8_t {
+    EXR_COMPRESSION_NONE = 0,
+    // Deflate each scanline on its own
+    EXR_COMPRESSION_ZIPS = 2,
+    // Deflate blocks of 16 scanlines
+    EXR_COMPRESSION_ZIP = 3,
+};
+
+/* Write a scanline EXR of half float channels: Y for 1 channel, RGB for 3 and RGBA for 4.
+ * The rows hold the raw half bits of each pixel's channels in that order. The scanline
+ * blocks are compressed across the thread pool. Returns false if the channel count isn't
+ * supported or the file couldn't be written
+ */
+bool write_exr(const std::string &fname,
+               const glm::uvec2 &dims,
+               uint32_t channels,
+               ExrCompression compression,
+               const ImageRowFn &row_fn);
+
+/* Compress the data to a zlib stream with a greedy LZ77, trading some compression for
+ * speed. Each block takes a Huffman code built for its symbols, or the fixed deflate code
+ * when that's smaller
+ */
+std::vector<uint8_t> zlib_compress(const uint8_t *data, size_t size);
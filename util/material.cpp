@@ -1,4 +1,5 @@
 #include "material.h"
+#include <cstring>
 #include <stdexcept>
 #include "stb_image.h"
 
@@ -31,3 +32,39 @@ Image::Image(const uint8_t *buf,
 {
 }
 
+bool Image::deferred() const
+{
+    return !file.empty() || !encoded.empty();
+}
+
+void Image::decode()
+{
+    if (!deferred()) {
+        return;
+    }
+    int n = 0;
+    uint8_t *data = nullptr;
+    if (!encoded.empty()) {
+        data = stbi_load_from_memory(encoded.data(), encoded.size(), &width, &height, &n, 4);
+    } else {
+        data = stbi_load(file.c_str(), &width, &height, &n, 4);
+    }
+    if (!data) {
+        throw std::runtime_error("Failed to load " + (file.empty() ? name : file));
+    }
+    channels = 4;
+    const size_t row_bytes = size_t(width) * channels;
+    img.resize(row_bytes * height);
+    for (int y = 0; y < height; ++y) {
+        const int src_row = flip_y ? height - 1 - y : y;
+        std::memcpy(&img[y * row_bytes], data + src_row * row_bytes, row_bytes);
+    }
+    stbi_image_free(data);
+    file.clear();
+    encoded = std::vector<uint8_t>();
+}
+
+bool AlphaMask::enabled() const
+{
+    return texture != -1;
+}
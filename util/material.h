@@ -15,6 +15,10 @@ struct Image {
     int channels = -1;
     std::vector<uint8_t> img;
     ColorSpace color_space = LINEAR;
+    // The file or encoded file data of an image whose decode was deferred, see decode
+    std::string file;
+    std::vector<uint8_t> encoded;
+    bool flip_y = false;
 
     Image(const std::string &file, const std::string &name, ColorSpace color_space = LINEAR);
     Image(const uint8_t *buf,
@@ -24,6 +28,15 @@ struct Image {
           const std::string &name,
           ColorSpace color_space = LINEAR);
     Image() = default;
+
+    // If the image's decode was deferred and it hasn't been decoded yet
+    bool deferred() const;
+
+    /* Decode the deferred image to 8-bit RGBA, flipping it vertically if flip_y is set, and
+     * release the encoded data. stb_image's global state isn't touched, so images can be
+     * decoded in parallel
+     */
+    void decode();
 };
 
 struct DisneyMaterial {
@@ -44,3 +57,14 @@ struct DisneyMaterial {
     float specular_transmission = 0;
     glm::vec2 pad = glm::vec2(0);
 };
+
+/* The alpha cutout of a material, the surface is cut away where the channel of the texture
+ * is below cutoff. Materials without an alpha texture are opaque
+ */
+struct AlphaMask {
+    int32_t texture = -1;
+    uint32_t channel = 3;
+    float cutoff = 0.5f;
+
+    bool enabled() const;
+};
@@ -4,7 +4,42 @@
 
 size_t Geometry::num_tris() const
 {
-    return indices.size();
+    return index_data().size();
+}
+
+ArrayView<glm::vec3> Geometry::vertex_data() const
+{
+    return vertex_view.data() ? vertex_view : ArrayView<glm::vec3>(vertices);
+}
+
+ArrayView<glm::vec3> Geometry::normal_data() const
+{
+    return normal_view.data() ? normal_view : ArrayView<glm::vec3>(normals);
+}
+
+ArrayView<glm::vec2> Geometry::uv_data() const
+{
+    return uv_view.data() ? uv_view : ArrayView<glm::vec2>(uvs);
+}
+
+ArrayView<glm::vec2> Geometry::lightmap_uv_data() const
+{
+    return lightmap_uv_view.data() ? lightmap_uv_view : ArrayView<glm::vec2>(lightmap_uvs);
+}
+
+ArrayView<glm::uvec3> Geometry::index_data() const
+{
+    return index_view.data() ? index_view : ArrayView<glm::uvec3>(indices);
+}
+
+void Geometry::clear_views()
+{
+    vertex_view = ArrayView<glm::vec3>();
+    normal_view = ArrayView<glm::vec3>();
+    uv_view = ArrayView<glm::vec2>();
+    lightmap_uv_view = ArrayView<glm::vec2>();
+    index_view = ArrayView<glm::uvec3>();
+    source = nullptr;
 }
 
 Mesh::Mesh(const std::vector<Geometry> &geometries) : geometries(geometries) {}
@@ -17,6 +52,16 @@ size_t Mesh::num_tris() const
         });
 }
 
+uint32_t parse_occluder_class(const std::string &name)
+{
+    for (size_t i = 0; i < occluder_class_names.size(); ++i) {
+        if (name == occluder_class_names[i]) {
+            return i;
+        }
+    }
+    return OCCLUDER_CLASS_UNTAGGED;
+}
+
 Instance::Instance(const glm::mat4 &transform,
                    size_t mesh_id,
                    const std::vector<uint32_t> &material_ids)
@@ -1,14 +1,66 @@
 #pragma once
 
+#include <array>
+#include <memory>
+#include <string>
 #include <vector>
 #include <glm/glm.hpp>
 
+// A read-only view of a tightly packed array, which may be in memory the viewer doesn't own
+template <typename T>
+class ArrayView {
+    const T *ptr = nullptr;
+    size_t count = 0;
+
+public:
+    ArrayView() = default;
+
+    ArrayView(const T *ptr, size_t count);
+
+    ArrayView(const std::vector<T> &v);
+
+    const T *data() const;
+
+    const T *begin() const;
+
+    const T *end() const;
+
+    const T &operator[](const size_t i) const;
+
+    size_t size() const;
+
+    bool empty() const;
+};
+
 struct Geometry {
     std::vector<glm::vec3> vertices, normals;
     std::vector<glm::vec2> uvs;
+    // The authored lightmap uvs of the geometry, if the scene's lightmap uv set was loaded.
+    // The unwrap uses them in place of charting the mesh and drops them
+    std::vector<glm::vec2> lightmap_uvs;
     std::vector<glm::uvec3> indices;
+    // Geometry loaded without copying references its attributes in the source, e.g. the
+    // mapped scene file, through the views instead of storing them in the vectors above.
+    // Each attribute is read from its view if set, or from its vector otherwise
+    std::shared_ptr<const void> source;
+    ArrayView<glm::vec3> vertex_view, normal_view;
+    ArrayView<glm::vec2> uv_view, lightmap_uv_view;
+    ArrayView<glm::uvec3> index_view;
+    // Alpha tested geometry is built into the BVH as non-opaque, so rays test the cutout
+    // of the triangles they hit. Other geometry is opaque
+    bool alpha_tested = false;
 
     size_t num_tris() const;
+
+    // The geometry's attributes, from the source if viewed or the vectors otherwise
+    ArrayView<glm::vec3> vertex_data() const;
+    ArrayView<glm::vec3> normal_data() const;
+    ArrayView<glm::vec2> uv_data() const;
+    ArrayView<glm::vec2> lightmap_uv_data() const;
+    ArrayView<glm::uvec3> index_data() const;
+
+    // Drop the views and the reference to the source, once the vectors hold all attributes
+    void clear_views();
 };
 
 struct Mesh {
@@ -21,11 +73,30 @@ struct Mesh {
     size_t num_tris() const;
 };
 
+/* The occluder classes the instances are sorted into, which the bake can drop from some or
+ * all of the AO rays. Instances are tagged with their class in the scene file, untagged
+ * instances are classified by the size of their world bounds when the scene is baked
+ */
+enum OccluderClass : uint32_t {
+    OCCLUDER_CLASS_HERO = 0,
+    OCCLUDER_CLASS_LARGE = 1,
+    OCCLUDER_CLASS_SMALL = 2,
+    OCCLUDER_CLASS_TINY = 3,
+    OCCLUDER_CLASS_UNTAGGED = 0xff,
+};
+
+const std::array<const char *, 4> occluder_class_names = {"hero", "large", "small", "tiny"};
+
+// Parse the occluder class's name, returns OCCLUDER_CLASS_UNTAGGED if it's not a class
+uint32_t parse_occluder_class(const std::string &name);
+
 struct Instance {
     glm::mat4 transform;
     size_t mesh_id;
     // Material IDs for the geometry in this instance's mesh
     std::vector<uint32_t> material_ids;
+    // The OccluderClass the instance is tagged with in the scene file
+    uint32_t occluder_class = OCCLUDER_CLASS_UNTAGGED;
 
     Instance(const glm::mat4 &transform,
              size_t mesh_id,
@@ -33,3 +104,49 @@ struct Instance {
 
     Instance() = default;
 };
+
+template <typename T>
+ArrayView<T>::ArrayView(const T *ptr, size_t count) : ptr(ptr), count(count)
+{
+}
+
+template <typename T>
+ArrayView<T>::ArrayView(const std::vector<T> &v) : ptr(v.data()), count(v.size())
+{
+}
+
+template <typename T>
+const T *ArrayView<T>::data() const
+{
+    return ptr;
+}
+
+template <typename T>
+const T *ArrayView<T>::begin() const
+{
+    return ptr;
+}
+
+template <typename T>
+const T *ArrayView<T>::end() const
+{
+    return ptr + count;
+}
+
+template <typename T>
+const T &ArrayView<T>::operator[](const size_t i) const
+{
+    return ptr[i];
+}
+
+template <typename T>
+size_t ArrayView<T>::size() const
+{
+    return count;
+}
+
+template <typename T>
+bool ArrayView<T>::empty() const
+{
+    return count == 0;
+}
@@ -0,0 +1,308 @@
+#include "mesh_optimize.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include "phmap.h"
+#include "trace.h"
+#include "util.h"
+
+namespace {
+
+// A vertex's attributes, compared bitwise so only exact duplicates are welded
+struct WeldKey {
+    glm::vec3 position = glm::vec3(0.f);
+    glm::vec3 normal = glm::vec3(0.f);
+    glm::vec2 uv = glm::vec2(0.f);
+    glm::vec2 lightmap_uv = glm::vec2(0.f);
+
+    bool operator==(const WeldKey &k) const
+    {
+        return std::memcmp(this, &k, sizeof(WeldKey)) == 0;
+    }
+};
+
+struct WeldKeyHash {
+    size_t operator()(const WeldKey &k) const
+    {
+        Hasher hasher;
+        hasher.add(k);
+        return hasher.h;
+    }
+};
+
+// The geometry's attributes and flat index list while it's being optimized
+struct OptimizeGeometry {
+    std::vector<glm::vec3> vertices, normals;
+    std::vector<glm::vec2> uvs, lightmap_uvs;
+    std::vector<uint32_t> indices;
+};
+
+// Merge the vertices with identical attributes, keeping the first of each
+void weld_vertices(OptimizeGeometry &g)
+{
+    const bool has_normals = g.normals.size() == g.vertices.size();
+    const bool has_uvs = g.uvs.size() == g.vertices.size();
+    const bool has_lightmap_uvs = g.lightmap_uvs.size() == g.vertices.size();
+    phmap::flat_hash_map<WeldKey, uint32_t, WeldKeyHash> welded;
+    welded.reserve(g.vertices.size());
+    std::vector<uint32_t> remap(g.vertices.size());
+    OptimizeGeometry out;
+    for (size_t i = 0; i < g.vertices.size(); ++i) {
+        WeldKey key;
+        key.position = g.vertices[i];
+        if (has_normals) {
+            key.normal = g.normals[i];
+        }
+        if (has_uvs) {
+            key.uv = g.uvs[i];
+        }
+        if (has_lightmap_uvs) {
+            key.lightmap_uv = g.lightmap_uvs[i];
+        }
+        auto inserted = welded.insert(std::make_pair(key, uint32_t(out.vertices.size())));
+        if (inserted.second) {
+            out.vertices.push_back(g.vertices[i]);
+            if (has_normals) {
+                out.normals.push_back(g.normals[i]);
+            }
+            if (has_uvs) {
+                out.uvs.push_back(g.uvs[i]);
+            }
+            if (has_lightmap_uvs) {
+                out.lightmap_uvs.push_back(g.lightmap_uvs[i]);
+            }
+        }
+        remap[i] = inserted.first->second;
+    }
+    for (auto &idx : g.indices) {
+        idx = remap[idx];
+    }
+    g.vertices = std::move(out.vertices);
+    g.normals = std::move(out.normals);
+    g.uvs = std::move(out.uvs);
+    g.lightmap_uvs = std::move(out.lightmap_uvs);
+}
+
+// Count the vertices transformed by the triangles with a FIFO post-transform cache
+size_t count_cache_misses(const std::vector<uint32_t> &indices, size_t n_vertices)
+{
+    const uint64_t never = std::numeric_limits<uint64_t>::max();
+    std::vector<uint64_t> cached_at(n_vertices, never);
+    uint64_t misses = 0;
+    for (const auto &v : indices) {
+        if (cached_at[v] == never || misses - cached_at[v] >= vertex_cache_size) {
+            cached_at[v] = misses++;
+        }
+    }
+    return misses;
+}
+
+/* Order the triangles for the post-transform cache with Tipsify (Sander et al., "Fast
+ * Triangle Reordering for Vertex Locality and Reduced Overdraw", 2007). Fans around a
+ * vertex are emitted at a time, moving to the adjacent vertex that's still in the cache
+ * and has the most triangles left, or back to a recently used vertex at a dead end.
+ * Returns the new order of the triangles
+ */
+std::vector<uint32_t> tipsify(const std::vector<uint32_t> &indices, size_t n_vertices)
+{
+    const size_t n_tris = indices.size() / 3;
+    // The triangles using each vertex
+    std::vector<uint32_t> adjacency_offsets(n_vertices + 1, 0);
+    for (const auto &v : indices) {
+        ++adjacency_offsets[v + 1];
+    }
+    for (size_t i = 0; i < n_vertices; ++i) {
+        adjacency_offsets[i + 1] += adjacency_offsets[i];
+    }
+    std::vector<uint32_t> live(n_vertices, 0);
+    std::vector<uint32_t> adjacency(indices.size());
+    for (size_t i = 0; i < indices.size(); ++i) {
+        const uint32_t v = indices[i];
+        adjacency[adjacency_offsets[v] + live[v]++] = i / 3;
+    }
+
+    const int64_t k = vertex_cache_size;
+    std::vector<int64_t> cache_time(n_vertices, 0);
+    std::vector<bool> emitted(n_tris, false);
+    std::vector<uint32_t> dead_end;
+    std::vector<uint32_t> candidates;
+    std::vector<uint32_t> order;
+    order.reserve(n_tris);
+    int64_t time = k + 1;
+    size_t cursor = 0;
+    int64_t fan = n_vertices > 0 ? 0 : -1;
+    while (fan >= 0) {
+        candidates.clear();
+        for (uint32_t a = adjacency_offsets[fan]; a < adjacency_offsets[fan + 1]; ++a) {
+            const uint32_t t = adjacency[a];
+            if (emitted[t]) {
+                continue;
+            }
+            for (int j = 0; j < 3; ++j) {
+                const uint32_t v = indices[t * 3 + j];
+                dead_end.push_back(v);
+                candidates.push_back(v);
+                --live[v];
+                if (time - cache_time[v] > k) {
+                    cache_time[v] = time++;
+                }
+            }
+            emitted[t] = true;
+            order.push_back(t);
+        }
+
+        // Pick the candidate still in the cache after its remaining triangles are emitted
+        // that entered the cache earliest
+        int64_t next = -1;
+        int64_t best_priority = -1;
+        for (const auto &v : candidates) {
+            if (live[v] == 0) {
+                continue;
+            }
+            int64_t priority = 0;
+            if (time - cache_time[v] + 2 * int64_t(live[v]) <= k) {
+                priority = time - cache_time[v];
+            }
+            if (priority > best_priority) {
+                best_priority = priority;
+                next = v;
+            }
+        }
+        // At a dead end go back to the most recent vertex with triangles left, or the
+        // next one in input order
+        while (next == -1 && !dead_end.empty()) {
+            const uint32_t v = dead_end.back();
+            dead_end.pop_back();
+            if (live[v] > 0) {
+                next = v;
+            }
+        }
+        while (next == -1 && cursor < n_vertices) {
+            if (live[cursor] > 0) {
+                next = cursor;
+            }
+            ++cursor;
+        }
+        fan = next;
+    }
+    return order;
+}
+
+// Renumber the vertices in the order the triangles first reference them, dropping unused ones
+void reorder_vertex_fetch(OptimizeGeometry &g)
+{
+    const bool has_normals = g.normals.size() == g.vertices.size();
+    const bool has_uvs = g.uvs.size() == g.vertices.size();
+    const bool has_lightmap_uvs = g.lightmap_uvs.size() == g.vertices.size();
+    std::vector<uint32_t> remap(g.vertices.size(), uint32_t(-1));
+    OptimizeGeometry out;
+    out.vertices.reserve(g.vertices.size());
+    for (auto &idx : g.indices) {
+        if (remap[idx] == uint32_t(-1)) {
+            remap[idx] = out.vertices.size();
+            out.vertices.push_back(g.vertices[idx]);
+            if (has_normals) {
+                out.normals.push_back(g.normals[idx]);
+            }
+            if (has_uvs) {
+                out.uvs.push_back(g.uvs[idx]);
+            }
+            if (has_lightmap_uvs) {
+                out.lightmap_uvs.push_back(g.lightmap_uvs[idx]);
+            }
+        }
+        idx = remap[idx];
+    }
+    g.vertices = std::move(out.vertices);
+    g.normals = std::move(out.normals);
+    g.uvs = std::move(out.uvs);
+    g.lightmap_uvs = std::move(out.lightmap_uvs);
+}
+
+}
+
+double average_cache_miss_ratio(const MeshOptimizeStats &stats)
+{
+    return stats.triangles > 0 ? double(stats.cache_misses_after) / stats.triangles : 0.0;
+}
+
+void optimize_geometry(Geometry &geom,
+                       bool weld,
+                       bool reorder_triangles,
+                       MeshOptimizeStats &stats)
+{
+    const ArrayView<glm::vec3> vertices = geom.vertex_data();
+    const ArrayView<glm::vec3> normals = geom.normal_data();
+    const ArrayView<glm::vec2> uvs = geom.uv_data();
+    const ArrayView<glm::vec2> lightmap_uvs = geom.lightmap_uv_data();
+    const ArrayView<glm::uvec3> indices = geom.index_data();
+
+    OptimizeGeometry g;
+    g.vertices = std::vector<glm::vec3>(vertices.begin(), vertices.end());
+    g.normals = std::vector<glm::vec3>(normals.begin(), normals.end());
+    g.uvs = std::vector<glm::vec2>(uvs.begin(), uvs.end());
+    g.lightmap_uvs = std::vector<glm::vec2>(lightmap_uvs.begin(), lightmap_uvs.end());
+    g.indices.reserve(indices.size() * 3);
+    for (const auto &tri : indices) {
+        g.indices.insert(g.indices.end(), {tri.x, tri.y, tri.z});
+    }
+
+    stats.vertices_before += g.vertices.size();
+    stats.triangles += indices.size();
+    stats.cache_misses_before += count_cache_misses(g.indices, g.vertices.size());
+    if (weld) {
+        weld_vertices(g);
+    }
+    if (reorder_triangles) {
+        const std::vector<uint32_t> order = tipsify(g.indices, g.vertices.size());
+        std::vector<uint32_t> reordered;
+        reordered.reserve(g.indices.size());
+        for (const auto &t : order) {
+            reordered.insert(reordered.end(), &g.indices[t * 3], &g.indices[t * 3] + 3);
+        }
+        g.indices = std::move(reordered);
+    }
+    reorder_vertex_fetch(g);
+    stats.vertices_after += g.vertices.size();
+    stats.cache_misses_after += count_cache_misses(g.indices, g.vertices.size());
+
+    std::vector<glm::uvec3> tris;
+    tris.reserve(g.indices.size() / 3);
+    for (size_t i = 0; i < g.indices.size(); i += 3) {
+        tris.emplace_back(g.indices[i], g.indices[i + 1], g.indices[i + 2]);
+    }
+    geom.vertices = std::move(g.vertices);
+    geom.normals = std::move(g.normals);
+    geom.uvs = std::move(g.uvs);
+    geom.lightmap_uvs = std::move(g.lightmap_uvs);
+    geom.indices = std::move(tris);
+    geom.clear_views();
+}
+
+void optimize_meshes(std::vector<Mesh> &meshes, bool weld, MeshOptimizeStats &stats)
+{
+    TRACE_SCOPE("optimize_meshes");
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<Geometry *> geometries;
+    for (auto &m : meshes) {
+        for (auto &g : m.geometries) {
+            geometries.push_back(&g);
+        }
+    }
+    std::vector<MeshOptimizeStats> geometry_stats(geometries.size());
+    parallel_tasks(geometries.size(), [&](size_t i) {
+        Geometry &g = *geometries[i];
+        optimize_geometry(g, weld, !g.alpha_tested, geometry_stats[i]);
+    });
+    for (const auto &s : geometry_stats) {
+        stats.vertices_before += s.vertices_before;
+        stats.vertices_after += s.vertices_after;
+        stats.triangles += s.triangles;
+        stats.cache_misses_before += s.cache_misses_before;
+        stats.cache_misses_after += s.cache_misses_after;
+    }
+    stats.optimize_ms += std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+}
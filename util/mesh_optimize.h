@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include "mesh.h"
+
+// The stages of the scene load the geometry can be optimized at
+enum MeshOptimizeStage {
+    // Before the unwrap, welding the vertices so xatlas has fewer to chart
+    MESH_OPTIMIZE_PRE_UNWRAP = 1,
+    // After the unwrap, reordering the atlas geometry for the bake's rasterization
+    MESH_OPTIMIZE_POST_UNWRAP = 2,
+};
+
+// The vertex cache size Tipsify optimizes for and the cache misses are counted with
+const uint32_t vertex_cache_size = 16;
+
+struct MeshOptimizeStats {
+    size_t vertices_before = 0;
+    size_t vertices_after = 0;
+    size_t triangles = 0;
+    // The post-transform vertex cache misses of the triangles before and after
+    size_t cache_misses_before = 0;
+    size_t cache_misses_after = 0;
+    double optimize_ms = 0.0;
+};
+
+// The vertices transformed per triangle with a FIFO cache of vertex_cache_size, in [0.5, 3]
+double average_cache_miss_ratio(const MeshOptimizeStats &stats);
+
+/* Optimize the geometry: vertices with identical attributes are welded if weld is set, the
+ * triangles are reordered for the post-transform vertex cache with Tipsify if
+ * reorder_triangles is set, and the vertices are renumbered in the order the triangles
+ * first reference them for fetch locality, dropping any unused ones. The triangles must
+ * keep their order if data is indexed by primitive, e.g. the alpha tested geometry's uvs.
+ * The geometry is left holding its attributes in its vectors
+ */
+void optimize_geometry(Geometry &geom,
+                       bool weld,
+                       bool reorder_triangles,
+                       MeshOptimizeStats &stats);
+
+/* Optimize all the geometries of the meshes in parallel with optimize_geometry, alpha
+ * tested geometry keeps its triangle order
+ */
+void optimize_meshes(std::vector<Mesh> &meshes, bool weld, MeshOptimizeStats &stats);
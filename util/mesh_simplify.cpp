@@ -0,0 +1,398 @@
+#include "mesh_simplify.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <queue>
+#include "phmap.h"
+#include "util.h"
+
+namespace {
+
+// Boundary edges are held in place by a plane through them with this weight relative to
+// the triangle planes
+const double boundary_weight = 100.0;
+// A collapse is skipped if it turns a triangle's normal by more than about 80 degrees
+const double min_normal_cos = 0.2;
+
+// The symmetric 4x4 matrix of the squared distance to a set of planes
+struct Quadric {
+    double a2 = 0.0, ab = 0.0, ac = 0.0, ad = 0.0;
+    double b2 = 0.0, bc = 0.0, bd = 0.0;
+    double c2 = 0.0, cd = 0.0;
+    double d2 = 0.0;
+
+    Quadric() = default;
+
+    // The quadric of the plane n.p + d = 0, scaled by the weight
+    Quadric(const glm::dvec3 &n, double d, double w)
+        : a2(w * n.x * n.x),
+          ab(w * n.x * n.y),
+          ac(w * n.x * n.z),
+          ad(w * n.x * d),
+          b2(w * n.y * n.y),
+          bc(w * n.y * n.z),
+          bd(w * n.y * d),
+          c2(w * n.z * n.z),
+          cd(w * n.z * d),
+          d2(w * d * d)
+    {
+    }
+
+    Quadric &operator+=(const Quadric &q)
+    {
+        a2 += q.a2;
+        ab += q.ab;
+        ac += q.ac;
+        ad += q.ad;
+        b2 += q.b2;
+        bc += q.bc;
+        bd += q.bd;
+        c2 += q.c2;
+        cd += q.cd;
+        d2 += q.d2;
+        return *this;
+    }
+
+    double error(const glm::dvec3 &p) const
+    {
+        return a2 * p.x * p.x + 2.0 * ab * p.x * p.y + 2.0 * ac * p.x * p.z +
+               2.0 * ad * p.x + b2 * p.y * p.y + 2.0 * bc * p.y * p.z + 2.0 * bd * p.y +
+               c2 * p.z * p.z + 2.0 * cd * p.z + d2;
+    }
+
+    // Solve for the position minimizing the error, returns false if the system is singular
+    bool optimal(glm::dvec3 &p) const
+    {
+        const glm::dmat3 a(a2, ab, ac, ab, b2, bc, ac, bc, c2);
+        const double det = glm::determinant(a);
+        if (std::abs(det) < 1e-12) {
+            return false;
+        }
+        p = glm::inverse(a) * glm::dvec3(-ad, -bd, -cd);
+        return true;
+    }
+};
+
+struct PositionHash {
+    size_t operator()(const glm::vec3 &p) const
+    {
+        Hasher hasher;
+        hasher.add(p);
+        return hasher.h;
+    }
+};
+
+struct PositionEq {
+    bool operator()(const glm::vec3 &a, const glm::vec3 &b) const
+    {
+        return std::memcmp(&a, &b, sizeof(glm::vec3)) == 0;
+    }
+};
+
+// A candidate collapse of v1 into v0, valid while both vertices are at their versions
+struct Collapse {
+    double cost;
+    uint32_t v0, v1;
+    uint32_t version0, version1;
+    glm::dvec3 position;
+
+    bool operator<(const Collapse &c) const
+    {
+        // The priority queue is a max heap, so the cheapest collapse must compare greatest
+        return cost > c.cost;
+    }
+};
+
+class Simplifier {
+    std::vector<glm::dvec3> positions;
+    std::vector<glm::uvec3> tris;
+    std::vector<bool> tri_alive;
+    std::vector<Quadric> quadrics;
+    std::vector<std::vector<uint32_t>> vertex_tris;
+    std::vector<uint32_t> version;
+    std::vector<bool> vertex_alive;
+    std::priority_queue<Collapse> heap;
+    size_t live_tris = 0;
+
+    glm::dvec3 tri_normal(const glm::uvec3 &t) const
+    {
+        return glm::cross(positions[t.y] - positions[t.x], positions[t.z] - positions[t.x]);
+    }
+
+    void push_collapse(uint32_t v0, uint32_t v1)
+    {
+        Quadric q = quadrics[v0];
+        q += quadrics[v1];
+        Collapse c;
+        c.v0 = v0;
+        c.v1 = v1;
+        c.version0 = version[v0];
+        c.version1 = version[v1];
+        if (!q.optimal(c.position)) {
+            // Fall back to the best of the endpoints and midpoint
+            const glm::dvec3 candidates[3] = {
+                positions[v0], positions[v1], 0.5 * (positions[v0] + positions[v1])};
+            c.position = candidates[0];
+            for (const auto &p : candidates) {
+                if (q.error(p) < q.error(c.position)) {
+                    c.position = p;
+                }
+            }
+        }
+        c.cost = std::max(q.error(c.position), 0.0);
+        heap.push(c);
+    }
+
+    // Check the triangles of v moving to p keep their orientation, skipping ones with other
+    bool keeps_orientation(uint32_t v, uint32_t other, const glm::dvec3 &p) const
+    {
+        for (const auto &t : vertex_tris[v]) {
+            if (!tri_alive[t]) {
+                continue;
+            }
+            glm::uvec3 tri = tris[t];
+            if (tri.x == other || tri.y == other || tri.z == other) {
+                continue;
+            }
+            const glm::dvec3 before = tri_normal(tri);
+            glm::dvec3 pts[3] = {positions[tri.x], positions[tri.y], positions[tri.z]};
+            for (int i = 0; i < 3; ++i) {
+                if (tri[i] == v) {
+                    pts[i] = p;
+                }
+            }
+            const glm::dvec3 after = glm::cross(pts[1] - pts[0], pts[2] - pts[0]);
+            const double len = glm::length(before) * glm::length(after);
+            if (len == 0.0 || glm::dot(before, after) < min_normal_cos * len) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void collapse(const Collapse &c)
+    {
+        const uint32_t v0 = c.v0;
+        const uint32_t v1 = c.v1;
+        for (const auto &t : vertex_tris[v1]) {
+            if (!tri_alive[t]) {
+                continue;
+            }
+            glm::uvec3 &tri = tris[t];
+            if (tri.x == v0 || tri.y == v0 || tri.z == v0) {
+                tri_alive[t] = false;
+                --live_tris;
+                continue;
+            }
+            for (int i = 0; i < 3; ++i) {
+                if (tri[i] == v1) {
+                    tri[i] = v0;
+                }
+            }
+            vertex_tris[v0].push_back(t);
+        }
+        vertex_tris[v1].clear();
+        vertex_alive[v1] = false;
+        positions[v0] = c.position;
+        quadrics[v0] += quadrics[v1];
+        ++version[v0];
+
+        // Drop the dead triangles from v0's list and queue the collapses of its new edges
+        auto &v0_tris = vertex_tris[v0];
+        v0_tris.erase(std::remove_if(v0_tris.begin(),
+                                     v0_tris.end(),
+                                     [&](const uint32_t t) { return !tri_alive[t]; }),
+                      v0_tris.end());
+        for (const auto &t : v0_tris) {
+            const glm::uvec3 &tri = tris[t];
+            for (int i = 0; i < 3; ++i) {
+                if (tri[i] != v0) {
+                    push_collapse(v0, tri[i]);
+                }
+            }
+        }
+    }
+
+public:
+    Simplifier(const Geometry &geom)
+    {
+        // Weld the vertices by position
+        const ArrayView<glm::vec3> vertices = geom.vertex_data();
+        const ArrayView<glm::uvec3> indices = geom.index_data();
+        phmap::flat_hash_map<glm::vec3, uint32_t, PositionHash, PositionEq> welded;
+        std::vector<uint32_t> remap(vertices.size());
+        for (size_t i = 0; i < vertices.size(); ++i) {
+            auto inserted = welded.insert(std::make_pair(vertices[i], positions.size()));
+            if (inserted.second) {
+                positions.push_back(glm::dvec3(vertices[i]));
+            }
+            remap[i] = inserted.first->second;
+        }
+        for (const auto &t : indices) {
+            const glm::uvec3 tri(remap[t.x], remap[t.y], remap[t.z]);
+            if (tri.x != tri.y && tri.x != tri.z && tri.y != tri.z) {
+                tris.push_back(tri);
+            }
+        }
+        live_tris = tris.size();
+        tri_alive.resize(tris.size(), true);
+        quadrics.resize(positions.size());
+        vertex_tris.resize(positions.size());
+        version.resize(positions.size(), 0);
+        vertex_alive.resize(positions.size(), true);
+
+        // Accumulate the area weighted triangle planes and count the uses of each edge
+        phmap::flat_hash_map<uint64_t, uint32_t> edge_uses;
+        auto edge_key = [](uint32_t a, uint32_t b) {
+            return (uint64_t(std::min(a, b)) << 32) | std::max(a, b);
+        };
+        for (size_t t = 0; t < tris.size(); ++t) {
+            const glm::uvec3 &tri = tris[t];
+            const glm::dvec3 n = tri_normal(tri);
+            const double len = glm::length(n);
+            if (len > 0.0) {
+                const glm::dvec3 un = n / len;
+                const Quadric q(un, -glm::dot(un, positions[tri.x]), 0.5 * len);
+                for (int i = 0; i < 3; ++i) {
+                    quadrics[tri[i]] += q;
+                }
+            }
+            for (int i = 0; i < 3; ++i) {
+                vertex_tris[tri[i]].push_back(t);
+                ++edge_uses[edge_key(tri[i], tri[(i + 1) % 3])];
+            }
+        }
+        // Constrain the boundary edges with a plane through the edge perpendicular to the
+        // triangle, so the boundary doesn't erode
+        for (const auto &tri : tris) {
+            const glm::dvec3 n = tri_normal(tri);
+            for (int i = 0; i < 3; ++i) {
+                const uint32_t a = tri[i];
+                const uint32_t b = tri[(i + 1) % 3];
+                if (edge_uses[edge_key(a, b)] != 1) {
+                    continue;
+                }
+                const glm::dvec3 e = positions[b] - positions[a];
+                const glm::dvec3 bn = glm::cross(e, n);
+                const double len = glm::length(bn);
+                if (len == 0.0) {
+                    continue;
+                }
+                const glm::dvec3 ubn = bn / len;
+                const Quadric q(
+                    ubn, -glm::dot(ubn, positions[a]), boundary_weight * glm::dot(e, e));
+                quadrics[a] += q;
+                quadrics[b] += q;
+            }
+        }
+
+        for (const auto &tri : tris) {
+            for (int i = 0; i < 3; ++i) {
+                const uint32_t a = tri[i];
+                const uint32_t b = tri[(i + 1) % 3];
+                if (a < b) {
+                    push_collapse(a, b);
+                }
+            }
+        }
+    }
+
+    Geometry simplify(size_t target_tris)
+    {
+        while (live_tris > target_tris && !heap.empty()) {
+            const Collapse c = heap.top();
+            heap.pop();
+            if (!vertex_alive[c.v0] || !vertex_alive[c.v1] || version[c.v0] != c.version0 ||
+                version[c.v1] != c.version1) {
+                continue;
+            }
+            if (!keeps_orientation(c.v0, c.v1, c.position) ||
+                !keeps_orientation(c.v1, c.v0, c.position)) {
+                continue;
+            }
+            collapse(c);
+        }
+
+        Geometry out;
+        std::vector<uint32_t> remap(positions.size(), uint32_t(-1));
+        for (size_t t = 0; t < tris.size(); ++t) {
+            if (!tri_alive[t]) {
+                continue;
+            }
+            glm::uvec3 tri;
+            for (int i = 0; i < 3; ++i) {
+                const uint32_t v = tris[t][i];
+                if (remap[v] == uint32_t(-1)) {
+                    remap[v] = out.vertices.size();
+                    out.vertices.push_back(glm::vec3(positions[v]));
+                }
+                tri[i] = remap[v];
+            }
+            out.indices.push_back(tri);
+        }
+        return out;
+    }
+};
+
+}
+
+Geometry simplify_geometry(const Geometry &geom, float target_ratio)
+{
+    const size_t target_tris =
+        size_t(std::ceil(geom.index_data().size() * glm::clamp(target_ratio, 0.f, 1.f)));
+    Simplifier simplifier(geom);
+    return simplifier.simplify(target_tris);
+}
+
+MeshProxies simplify_meshes(const std::vector<Mesh> &meshes,
+                            float target_ratio,
+                            size_t min_triangles,
+                            MeshSimplifyStats &stats)
+{
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<Mesh> proxies(meshes.size());
+    // The geometries to simplify, as their mesh and geometry indices
+    std::vector<std::pair<size_t, size_t>> geometries;
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        const Mesh &m = meshes[i];
+        const bool alpha_tested =
+            std::any_of(m.geometries.begin(), m.geometries.end(), [](const Geometry &g) {
+                return g.alpha_tested;
+            });
+        if (alpha_tested || m.num_tris() < min_triangles) {
+            continue;
+        }
+        proxies[i].geometries.resize(m.geometries.size());
+        for (size_t j = 0; j < m.geometries.size(); ++j) {
+            geometries.emplace_back(i, j);
+        }
+    }
+    parallel_tasks(geometries.size(), [&](size_t i) {
+        const auto &g = geometries[i];
+        proxies[g.first].geometries[g.second] =
+            simplify_geometry(meshes[g.first].geometries[g.second], target_ratio);
+    });
+
+    MeshProxies result;
+    result.mesh_proxy.resize(meshes.size(), uint32_t(-1));
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        // Geometries simplified away entirely are dropped
+        auto &geoms = proxies[i].geometries;
+        geoms.erase(std::remove_if(geoms.begin(),
+                                   geoms.end(),
+                                   [](const Geometry &g) { return g.indices.empty(); }),
+                    geoms.end());
+        if (geoms.empty()) {
+            continue;
+        }
+        stats.triangles_before += meshes[i].num_tris();
+        stats.triangles_after += proxies[i].num_tris();
+        result.mesh_proxy[i] = result.meshes.size();
+        result.meshes.push_back(std::move(proxies[i]));
+    }
+    stats.simplify_ms += std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+    return result;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vector>
+#include "mesh.h"
+
+struct MeshSimplifyStats {
+    size_t triangles_before = 0;
+    size_t triangles_after = 0;
+    double simplify_ms = 0.0;
+};
+
+/* Simplify the geometry to about target_ratio of its triangles by quadric error edge
+ * collapses (Garland and Heckbert, "Surface Simplification Using Quadric Error Metrics",
+ * 1997). The vertices are first welded by position alone so the uv and normal seams don't
+ * stop the collapses, and the open boundaries are weighted to keep their shape. Collapses
+ * that would flip a triangle are skipped. The simplified geometry only has positions and
+ * indices, it's meant for occlusion rather than rendering
+ */
+Geometry simplify_geometry(const Geometry &geom, float target_ratio);
+
+// The simplified proxies of a set of meshes
+struct MeshProxies {
+    std::vector<Mesh> meshes;
+    // Index of each mesh's proxy in meshes, or -1 if it has none
+    std::vector<uint32_t> mesh_proxy;
+};
+
+/* Simplify the geometries of the meshes with simplify_geometry in parallel, into a proxy
+ * for each mesh. Meshes with fewer than min_triangles triangles or any alpha tested geometry,
+ * which must keep its triangles for the alpha test, don't get a proxy
+ */
+MeshProxies simplify_meshes(const std::vector<Mesh> &meshes,
+                            float target_ratio,
+                            size_t min_triangles,
+                            MeshSimplifyStats &stats);
@@ -0,0 +1,306 @@
+#include "multi_gpu_bake.h"
+#include <algorithm>
+#include <codecvt>
+#include <exception>
+#include <iostream>
+#include <locale>
+#include <string>
+#include <thread>
+#include "dxr/dx12_utils.h"
+#include "dxr/dxr_utils.h"
+#include "util.h"
+
+std::vector<std::unique_ptr<BakeDevice>> create_bake_devices(ID3D12Device5 *primary,
+                                                             const BakeScene &bake_scene,
+                                                             const BakeSceneSource &source,
+                                                             uint32_t bake_outputs,
+                                                             DXGI_FORMAT ao_format)
+{
+    const DXGI_ADAPTER_DESC1 primary_desc = dxr::adapter_desc(primary);
+    std::vector<std::unique_ptr<BakeDevice>> bake_devices;
+    for (auto &device : dxr::create_devices()) {
+        const DXGI_ADAPTER_DESC1 desc = dxr::adapter_desc(device.Get());
+        if ((desc.AdapterLuid.LowPart == primary_desc.AdapterLuid.LowPart &&
+             desc.AdapterLuid.HighPart == primary_desc.AdapterLuid.HighPart) ||
+            !dxr::dxr_available(device)) {
+            continue;
+        }
+        std::wstring_convert<std::codecvt_utf8<wchar_t>> conv;
+        std::cout << "Bake device " << bake_devices.size() + 1 << ": "
+                  << conv.to_bytes(desc.Description) << "\n";
+
+        std::unique_ptr<BakeDevice> d = std::make_unique<BakeDevice>();
+        d->device = device;
+        d->cmd_ctx = std::make_unique<dxr::CommandContext>(device.Get());
+        d->profiler = std::make_unique<dxr::GpuProfiler>(
+            device.Get(),
+            d->cmd_ctx->queue.Get(),
+            gpu_profiler_regions,
+            3,
+            "Bake Device " + std::to_string(bake_devices.size() + 1) + " Queue");
+
+        BakeScene &scene = d->bake_scene;
+        scene.mesh_bounds = bake_scene.mesh_bounds;
+        scene.instance_regions = bake_scene.instance_regions;
+        scene.bvh_profile = bake_scene.bvh_profile;
+        scene.atlas_cache_key = bake_scene.atlas_cache_key;
+        scene.atlas_size = bake_scene.atlas_size;
+        scene.world_lower = bake_scene.world_lower;
+        scene.world_upper = bake_scene.world_upper;
+        scene.scene_info = bake_scene.scene_info;
+        scene.near_field_radius = bake_scene.near_field_radius;
+        if (desc.VendorId == primary_desc.VendorId &&
+            desc.DeviceId == primary_desc.DeviceId) {
+            scene.cache_dir = bake_scene.cache_dir;
+        }
+        upload_bake_scene(device.Get(),
+                          *d->cmd_ctx,
+                          source.scene,
+                          source.alpha_geometries,
+                          source.occluder_proxies,
+                          scene,
+                          *d->profiler);
+        resolve_gpu_profile(*d->cmd_ctx, *d->profiler);
+
+        d->bake_target =
+            create_bake_target(device.Get(), scene.atlas_size, bake_outputs, ao_format);
+        d->pipeline = create_bake_pipeline(device.Get(), ao_format);
+        d->ray_stats_query = create_ray_stats_query(device.Get(), *d->cmd_ctx);
+        bake_devices.push_back(std::move(d));
+    }
+    return bake_devices;
+}
+
+RayStats bake_multi_gpu_tiles(ID3D12Device5 *device,
+                              dxr::CommandContext &cmd_ctx,
+                              BakePipeline &pipeline,
+                              BakeScene &bake_scene,
+                              BakeTarget &bake_target,
+                              RayStatsQuery &ray_stats_query,
+                              const AtlasParams &atlas_params,
+                              uint32_t tile_size,
+                              std::vector<std::unique_ptr<BakeDevice>> &bake_devices,
+                              dxr::GpuProfiler &profiler)
+{
+    const glm::uvec2 atlas_size = bake_scene.atlas_size;
+    RayStats total_stats;
+
+    // Each device takes the next tile from the queue once it's baked all samples of
+    // its last, so faster GPUs take more of the atlas
+    std::vector<glm::uvec2> tiles;
+    for (uint32_t y = 0; y < atlas_size.y; y += tile_size) {
+        for (uint32_t x = 0; x < atlas_size.x; x += tile_size) {
+            tiles.push_back(glm::uvec2(x, y));
+        }
+    }
+    std::atomic<size_t> next_tile(0);
+    // The primary device's tiles and stats come last
+    std::vector<std::vector<size_t>> device_tiles(bake_devices.size() + 1);
+    std::vector<RayStats> device_stats(bake_devices.size() + 1);
+    std::vector<std::exception_ptr> errors(bake_devices.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < bake_devices.size(); ++i) {
+        threads.emplace_back([&, i]() {
+            BakeDevice &d = *bake_devices[i];
+            try {
+                device_stats[i] = bake_tile_queue(*d.cmd_ctx,
+                                                  d.pipeline,
+                                                  d.bake_scene,
+                                                  d.bake_target,
+                                                  d.ray_stats_query,
+                                                  atlas_params,
+                                                  tile_size,
+                                                  tiles,
+                                                  next_tile,
+                                                  device_tiles[i],
+                                                  *d.profiler);
+            } catch (...) {
+                // Stop the other devices from taking more tiles
+                next_tile = tiles.size();
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    device_stats.back() = bake_tile_queue(cmd_ctx,
+                                          pipeline,
+                                          bake_scene,
+                                          bake_target,
+                                          ray_stats_query,
+                                          atlas_params,
+                                          tile_size,
+                                          tiles,
+                                          next_tile,
+                                          device_tiles.back(),
+                                          profiler);
+    for (auto &t : threads) {
+        t.join();
+    }
+    for (const auto &e : errors) {
+        if (e) {
+            std::rethrow_exception(e);
+        }
+    }
+    assemble_device_tiles(device,
+                          cmd_ctx,
+                          bake_target,
+                          bake_devices,
+                          device_tiles,
+                          tiles,
+                          tile_size);
+    // The devices bake in parallel, so the GPU time is that of the busiest
+    for (size_t i = 0; i < device_stats.size(); ++i) {
+        const RayStats &stats = device_stats[i];
+        const size_t device_id = i + 1 == device_stats.size() ? 0 : i + 1;
+        std::cout << "Bake device " << device_id << ": " << device_tiles[i].size() << "/"
+                  << tiles.size() << " tiles, " << pretty_print_count(stats.rays)
+                  << " rays, "
+                  << stats.rays * 1e-3 / std::max(stats.gpu_ms, 1e-6) << " Mrays/s\n";
+        total_stats.rays += stats.rays;
+        total_stats.hits += stats.hits;
+        total_stats.gpu_ms = std::max(total_stats.gpu_ms, stats.gpu_ms);
+    }
+    return total_stats;
+}
+
+RayStats bake_tile_queue(dxr::CommandContext &cmd_ctx,
+                         BakePipeline &pipeline,
+                         BakeScene &bake_scene,
+                         BakeTarget &bake_target,
+                         RayStatsQuery &ray_stats_query,
+                         AtlasParams atlas_params,
+                         uint32_t tile_size,
+                         const std::vector<glm::uvec2> &tiles,
+                         std::atomic<size_t> &next_tile,
+                         std::vector<size_t> &baked_tiles,
+                         dxr::GpuProfiler &profiler)
+{
+    RayStats stats;
+    for (size_t t = next_tile++; t < tiles.size(); t = next_tile++) {
+        const RayStats tile_stats = bake_tile_samples(cmd_ctx,
+                                                      pipeline,
+                                                      bake_scene,
+                                                      bake_target,
+                                                      ray_stats_query,
+                                                      atlas_params,
+                                                      tile_size,
+                                                      tiles[t],
+                                                      profiler);
+        stats.rays += tile_stats.rays;
+        stats.hits += tile_stats.hits;
+        stats.gpu_ms += tile_stats.gpu_ms;
+        baked_tiles.push_back(t);
+    }
+    return stats;
+}
+
+RayStats bake_tile_samples(dxr::CommandContext &cmd_ctx,
+                           BakePipeline &pipeline,
+                           BakeScene &bake_scene,
+                           BakeTarget &bake_target,
+                           RayStatsQuery &ray_stats_query,
+                           AtlasParams atlas_params,
+                           uint32_t tile_size,
+                           const glm::uvec2 &tile,
+                           dxr::GpuProfiler &profiler,
+                           const std::function<bool()> &frame_done)
+{
+    RayStats stats;
+    atlas_params.frame_id = 0;
+    for (int accumulated = 0; accumulated < atlas_params.n_samples;
+         accumulated += atlas_params.samples_per_frame) {
+        begin_ray_stats(cmd_ctx, ray_stats_query, bake_target);
+        bake_frame(cmd_ctx,
+                   pipeline,
+                   bake_scene,
+                   bake_target,
+                   atlas_params,
+                   tile_size,
+                   {tile},
+                   profiler);
+        const RayStats frame_stats = end_ray_stats(cmd_ctx, ray_stats_query, bake_target);
+        ++atlas_params.frame_id;
+        stats.rays += frame_stats.rays;
+        stats.hits += frame_stats.hits;
+        stats.gpu_ms += frame_stats.gpu_ms;
+        resolve_gpu_profile(cmd_ctx, profiler);
+        if (frame_done && !frame_done()) {
+            break;
+        }
+    }
+    return stats;
+}
+
+void assemble_device_tiles(ID3D12Device5 *device,
+                           dxr::CommandContext &cmd_ctx,
+                           BakeTarget &bake_target,
+                           std::vector<std::unique_ptr<BakeDevice>> &bake_devices,
+                           const std::vector<std::vector<size_t>> &device_tiles,
+                           const std::vector<glm::uvec2> &tiles,
+                           uint32_t tile_size)
+{
+    const glm::uvec2 dims = bake_target.ao_image.dims();
+    const bool has_extras = bake_target.extras_buf.get() != nullptr;
+    const bool has_light = bake_target.light_buf.get() != nullptr;
+    std::vector<uint8_t> ao_pixels = read_back_ao_image(device, cmd_ctx, bake_target.ao_image);
+    std::vector<uint8_t> accum = read_back_buffer(device, cmd_ctx, bake_target.accum_buf);
+    std::vector<uint8_t> extras;
+    if (has_extras) {
+        extras = read_back_buffer(device, cmd_ctx, bake_target.extras_buf);
+    }
+    std::vector<uint8_t> light;
+    if (has_light) {
+        light = read_back_buffer(device, cmd_ctx, bake_target.light_buf);
+    }
+
+    for (size_t i = 0; i < bake_devices.size(); ++i) {
+        if (device_tiles[i].empty()) {
+            continue;
+        }
+        BakeDevice &d = *bake_devices[i];
+        std::vector<glm::uvec2> baked_tiles;
+        for (const auto &t : device_tiles[i]) {
+            baked_tiles.push_back(tiles[t]);
+        }
+        copy_image_tiles(
+            ao_pixels,
+            read_back_ao_image(d.device.Get(), *d.cmd_ctx, d.bake_target.ao_image),
+            dims,
+            bake_target.ao_image.pixel_size(),
+            baked_tiles,
+            tile_size);
+        copy_image_tiles(
+            accum,
+            read_back_buffer(d.device.Get(), *d.cmd_ctx, d.bake_target.accum_buf),
+            dims,
+            sizeof(glm::vec2),
+            baked_tiles,
+            tile_size);
+        if (has_extras) {
+            copy_image_tiles(
+                extras,
+                read_back_buffer(d.device.Get(), *d.cmd_ctx, d.bake_target.extras_buf),
+                dims,
+                sizeof(glm::vec4),
+                baked_tiles,
+                tile_size);
+        }
+        if (has_light) {
+            copy_image_tiles(
+                light,
+                read_back_buffer(d.device.Get(), *d.cmd_ctx, d.bake_target.light_buf),
+                dims,
+                sizeof(glm::vec4),
+                baked_tiles,
+                tile_size);
+        }
+    }
+
+    upload_ao_image(device, cmd_ctx, bake_target.ao_image, ao_pixels);
+    upload_buffer(device, cmd_ctx, bake_target.accum_buf, accum);
+    if (has_extras) {
+        upload_buffer(device, cmd_ctx, bake_target.extras_buf, extras);
+    }
+    if (has_light) {
+        upload_buffer(device, cmd_ctx, bake_target.light_buf, light);
+    }
+}
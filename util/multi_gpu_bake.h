@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <glm/glm.hpp>
+#include "ao_bake.h"
+
+// A GPU taking part in the multi-GPU bake, with its own copy of the scene and bake target
+struct BakeDevice {
+    ComPtr<ID3D12Device5> device;
+    std::unique_ptr<dxr::CommandContext> cmd_ctx;
+    std::unique_ptr<dxr::GpuProfiler> profiler;
+    BakeScene bake_scene;
+    BakeTarget bake_target;
+    BakePipeline pipeline;
+    RayStatsQuery ray_stats_query;
+};
+
+/* Create a bake device for each GPU supporting DXR 1.1 other than the primary device's,
+ * uploading the scene to it and building its BVHs like the primary's bake scene. Devices on
+ * a different adapter model than the primary skip the BVH cache, so their BLASes don't
+ * replace the primary's
+ */
+std::vector<std::unique_ptr<BakeDevice>> create_bake_devices(ID3D12Device5 *primary,
+                                                             const BakeScene &bake_scene,
+                                                             const BakeSceneSource &source,
+                                                             uint32_t bake_outputs,
+                                                             DXGI_FORMAT ao_format);
+
+/* Bake the atlas's tiles on the primary device and all the bake devices in parallel, each
+ * taking the next tile from a shared queue once it's baked all samples of its last. The
+ * tiles are then assembled into the primary's bake target. Returns the rays traced, and the
+ * GPU time of the busiest device
+ */
+RayStats bake_multi_gpu_tiles(ID3D12Device5 *device,
+                              dxr::CommandContext &cmd_ctx,
+                              BakePipeline &pipeline,
+                              BakeScene &bake_scene,
+                              BakeTarget &bake_target,
+                              RayStatsQuery &ray_stats_query,
+                              const AtlasParams &atlas_params,
+                              uint32_t tile_size,
+                              std::vector<std::unique_ptr<BakeDevice>> &bake_devices,
+                              dxr::GpuProfiler &profiler);
+
+/* Take tiles from the shared queue until it's empty, baking all the samples of each tile
+ * before taking the next. The indices of the tiles baked are appended to baked_tiles,
+ * and the rays traced are returned
+ */
+RayStats bake_tile_queue(dxr::CommandContext &cmd_ctx,
+                         BakePipeline &pipeline,
+                         BakeScene &bake_scene,
+                         BakeTarget &bake_target,
+                         RayStatsQuery &ray_stats_query,
+                         AtlasParams atlas_params,
+                         uint32_t tile_size,
+                         const std::vector<glm::uvec2> &tiles,
+                         std::atomic<size_t> &next_tile,
+                         std::vector<size_t> &baked_tiles,
+                         dxr::GpuProfiler &profiler);
+
+/* Bake all the samples of the tile from frame 0, calling frame_done after each frame if
+ * it's set. The tile's bake stops early if frame_done returns false. Returns the rays traced
+ */
+RayStats bake_tile_samples(dxr::CommandContext &cmd_ctx,
+                           BakePipeline &pipeline,
+                           BakeScene &bake_scene,
+                           BakeTarget &bake_target,
+                           RayStatsQuery &ray_stats_query,
+                           AtlasParams atlas_params,
+                           uint32_t tile_size,
+                           const glm::uvec2 &tile,
+                           dxr::GpuProfiler &profiler,
+                           const std::function<bool()> &frame_done = nullptr);
+
+/* Copy the tiles baked by each bake device into the primary's bake target. The AO image,
+ * sample accumulation and extras are read back from each device, merged on the host and
+ * uploaded to the primary, so it can denoise, dilate and write them out as usual
+ */
+void assemble_device_tiles(ID3D12Device5 *device,
+                           dxr::CommandContext &cmd_ctx,
+                           BakeTarget &bake_target,
+                           std::vector<std::unique_ptr<BakeDevice>> &bake_devices,
+                           const std::vector<std::vector<size_t>> &device_tiles,
+                           const std::vector<glm::uvec2> &tiles,
+                           uint32_t tile_size);
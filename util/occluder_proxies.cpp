@@ -0,0 +1,115 @@
+#include "occluder_proxies.h"
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include "dxr/dx12_utils.h"
+#include "dxr/dxr_utils.h"
+#include "trace.h"
+#include "util.h"
+
+// Meshes with fewer triangles than this are traced at full res by all AO rays
+const size_t min_occluder_proxy_tris = 4096;
+
+MeshProxies simplify_occluder_proxies(const Scene &scene,
+                                      const SceneLoadOptions &load_options,
+                                      BakeScene &bake_scene)
+{
+    TRACE_SCOPE("simplify_occluder_proxies");
+    bake_scene.near_field_radius = 0.f;
+    const float ratio = load_options.occluder_proxy_ratio;
+    if (ratio <= 0.f || ratio >= 1.f) {
+        return MeshProxies();
+    }
+    MeshSimplifyStats stats;
+    MeshProxies proxies = simplify_meshes(scene.meshes, ratio, min_occluder_proxy_tris, stats);
+    if (proxies.meshes.empty()) {
+        std::cout << "No meshes to simplify into occluder proxies\n";
+        return proxies;
+    }
+    bake_scene.near_field_radius = load_options.occluder_near_field;
+    std::cout << "Occluder proxies: " << proxies.meshes.size() << " meshes simplified in "
+              << stats.simplify_ms << "ms, " << pretty_print_count(stats.triangles_before)
+              << " -> " << pretty_print_count(stats.triangles_after)
+              << " triangles, near field radius: " << bake_scene.near_field_radius << "\n";
+    return proxies;
+}
+
+void classify_occluders(const Scene &scene,
+                        const SceneLoadOptions &load_options,
+                        BakeScene &bake_scene)
+{
+    bake_scene.instance_occluder_mask.clear();
+    const auto &fields = load_options.occluder_class_fields;
+    const uint32_t all_fields = OCCLUDER_MASK_NEAR | OCCLUDER_MASK_FAR;
+    if (std::all_of(
+            fields.begin(), fields.end(), [&](uint32_t f) { return f == all_fields; })) {
+        return;
+    }
+
+    const float scene_size = glm::length(bake_scene.world_upper - bake_scene.world_lower);
+    std::array<size_t, 4> class_counts = {};
+    bake_scene.instance_occluder_mask.reserve(scene.instances.size());
+    for (const auto &inst : scene.instances) {
+        uint32_t occluder_class = inst.occluder_class;
+        if (occluder_class >= class_counts.size()) {
+            const auto b = instance_world_bounds(
+                bake_scene, dxr::TlasInstance(inst.transform, inst.mesh_id));
+            const float size = glm::length(b[1] - b[0]);
+            if (size < load_options.occluder_tiny_size * scene_size) {
+                occluder_class = OCCLUDER_CLASS_TINY;
+            } else if (size < load_options.occluder_small_size * scene_size) {
+                occluder_class = OCCLUDER_CLASS_SMALL;
+            } else {
+                occluder_class = OCCLUDER_CLASS_LARGE;
+            }
+        }
+        ++class_counts[occluder_class];
+        bake_scene.instance_occluder_mask.push_back(fields[occluder_class]);
+    }
+
+    // Without proxies the whole ray is in the far field, so the near field only classes
+    // need a near field to occlude in
+    const bool near_only = std::find(fields.begin(), fields.end(), OCCLUDER_MASK_NEAR) !=
+                           fields.end();
+    if (near_only && bake_scene.near_field_radius == 0.f) {
+        bake_scene.near_field_radius = load_options.occluder_near_field;
+    }
+
+    std::cout << "Occluder classes:";
+    for (size_t i = 0; i < class_counts.size(); ++i) {
+        const size_t f = std::distance(
+            occluder_fields.begin(),
+            std::find(occluder_fields.begin(), occluder_fields.end(), fields[i]));
+        std::cout << " " << occluder_class_names[i] << " "
+                  << pretty_print_count(class_counts[i]) << " ("
+                  << (f < occluder_field_names.size() ? occluder_field_names[f] : "custom")
+                  << ")";
+    }
+    std::cout << ", near field radius: " << bake_scene.near_field_radius << "\n";
+}
+
+void build_occluder_proxies(ID3D12Device5 *device,
+                            dxr::CommandContext &cmd_ctx,
+                            dxr::UploadRing &upload_ring,
+                            const MeshProxies &occluder_proxies,
+                            BakeScene &bake_scene,
+                            D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags,
+                            dxr::GpuProfiler &profiler)
+{
+    bake_scene.proxies.clear();
+    bake_scene.mesh_proxy = occluder_proxies.mesh_proxy;
+    if (occluder_proxies.meshes.empty()) {
+        return;
+    }
+    dxr::MeshBuildStats stats;
+    bake_scene.proxies = dxr::build_mesh_bvhs(device,
+                                              cmd_ctx,
+                                              upload_ring,
+                                              occluder_proxies.meshes,
+                                              &stats,
+                                              0,
+                                              &profiler,
+                                              build_flags);
+    std::cout << "Occluder proxy BLAS build: " << stats.build_ms << "ms, "
+              << pretty_print_count(stats.compacted_bytes) << "b\n";
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "ao_bake.h"
+#include "mesh_simplify.h"
+#include "scene.h"
+
+/* Simplify the scene's meshes into the occluder proxies the far field AO rays are traced
+ * against, if enabled by the load options, and set the bake scene's near field radius.
+ * Returns no proxies if they're disabled
+ */
+MeshProxies simplify_occluder_proxies(const Scene &scene,
+                                      const SceneLoadOptions &load_options,
+                                      BakeScene &bake_scene);
+
+/* Sort the scene's instances into their occluder classes, tagged or by the size of their
+ * world bounds, and set the fields each instance occludes by the load options' class
+ * fields. If a class only occludes the near field and there are no occluder proxies, the
+ * near field radius is set to the load options' near field. The scene bounds must be set
+ */
+void classify_occluders(const Scene &scene,
+                        const SceneLoadOptions &load_options,
+                        BakeScene &bake_scene);
+
+/* Build the BLASes of the occluder proxies with the build flags, they aren't cached as
+ * they're cheap to build. Sets the bake scene's proxies and the proxy of each mesh
+ */
+void build_occluder_proxies(ID3D12Device5 *device,
+                            dxr::CommandContext &cmd_ctx,
+                            dxr::UploadRing &upload_ring,
+                            const MeshProxies &occluder_proxies,
+                            BakeScene &bake_scene,
+                            D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags,
+                            dxr::GpuProfiler &profiler);
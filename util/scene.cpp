@@ -1,5 +1,6 @@
 #include "scene.h"
 #include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <numeric>
 #include <stdexcept>
@@ -9,6 +10,7 @@
 #include "flatten_gltf.h"
 #include "gltf_types.h"
 #include "json.hpp"
+#include "trace.h"
 #include "phmap_utils.h"
 #include "stb_image.h"
 #include "tiny_gltf.h"
@@ -33,19 +35,243 @@ bool operator==(const glm::uvec3 &a, const glm::uvec3 &b)
     return a.x == b.x && a.y == b.y && a.z == b.z;
 }
 
-Scene::Scene(const std::string &fname)
+namespace {
+
+// OBJ shapes with more face vertices than this are remapped in parallel on their own,
+// smaller ones are remapped serially with several shapes at once
+const size_t parallel_remap_corners = 1 << 18;
+
+// An image whose decode is deferred until the scene knows which textures are needed
+Image deferred_image(const std::string &name, ColorSpace color_space, bool flip_y)
+{
+    Image img;
+    img.name = name;
+    img.color_space = color_space;
+    img.flip_y = flip_y;
+    return img;
+}
+
+/* tinygltf image loader keeping the encoded image data in the image instead of decoding
+ * it, the scene decodes the images it needs afterwards
+ */
+bool keep_encoded_gltf_image(tinygltf::Image *image,
+                             const int,
+                             std::string *,
+                             std::string *,
+                             int,
+                             int,
+                             const unsigned char *bytes,
+                             int size,
+                             void *)
+{
+    image->image = std::vector<unsigned char>(bytes, bytes + size);
+    return true;
+}
+
+// The position, normal and texcoord indices of the OBJ face vertex
+glm::uvec3 obj_corner_key(const tinyobj::mesh_t &obj_mesh, size_t corner)
+{
+    const tinyobj::index_t &idx = obj_mesh.indices[corner];
+    return glm::uvec3(idx.vertex_index, idx.normal_index, idx.texcoord_index);
+}
+
+glm::vec3 obj_position(const tinyobj::attrib_t &attrib, uint32_t i)
+{
+    return glm::vec3(
+        attrib.vertices[3 * i], attrib.vertices[3 * i + 1], attrib.vertices[3 * i + 2]);
+}
+
+glm::vec3 obj_normal(const tinyobj::attrib_t &attrib, uint32_t i)
+{
+    return glm::normalize(glm::vec3(
+        attrib.normals[3 * i], attrib.normals[3 * i + 1], attrib.normals[3 * i + 2]));
+}
+
+glm::vec2 obj_texcoord(const tinyobj::attrib_t &attrib, uint32_t i)
+{
+    return glm::vec2(attrib.texcoords[2 * i], attrib.texcoords[2 * i + 1]);
+}
+
+/* Remap the shape from 3 indices per-vert (independent for pos, normal & uv) used by
+ * tinyobjloader over to single index per-vert (single for pos, normal & uv tuple) used by
+ * renderers. Vertices are numbered in the order they're first referenced by the faces
+ */
+Geometry remap_obj_shape(const tinyobj::attrib_t &attrib, const tinyobj::mesh_t &obj_mesh)
+{
+    const size_t n_corners = obj_mesh.indices.size();
+    phmap::flat_hash_map<glm::uvec3, uint32_t> index_mapping;
+    index_mapping.reserve(std::min(n_corners, attrib.vertices.size() / 3));
+
+    Geometry geom;
+    geom.indices.reserve(n_corners / 3);
+    geom.vertices.reserve(std::min(n_corners, attrib.vertices.size() / 3));
+    for (size_t f = 0; f < n_corners / 3; ++f) {
+        glm::uvec3 tri_indices;
+        for (size_t i = 0; i < 3; ++i) {
+            const glm::uvec3 idx = obj_corner_key(obj_mesh, f * 3 + i);
+            auto fnd = index_mapping.find(idx);
+            if (fnd != index_mapping.end()) {
+                tri_indices[i] = fnd->second;
+                continue;
+            }
+            tri_indices[i] = geom.vertices.size();
+            index_mapping[idx] = tri_indices[i];
+
+            geom.vertices.push_back(obj_position(attrib, idx.x));
+            if (idx.y != uint32_t(-1)) {
+                geom.normals.push_back(obj_normal(attrib, idx.y));
+            }
+            if (idx.z != uint32_t(-1)) {
+                geom.uvs.push_back(obj_texcoord(attrib, idx.z));
+            }
+        }
+        geom.indices.push_back(tri_indices);
+    }
+    return geom;
+}
+
+/* Remap the shape like remap_obj_shape across the loader threads, producing the same
+ * geometry. The face vertices are split into buckets by the hash of their indices, keeping
+ * their order, and each bucket finds the first reference to each of its vertices with its
+ * own map. The vertices are then numbered in the order of their first reference
+ */
+Geometry remap_obj_shape_parallel(const tinyobj::attrib_t &attrib,
+                                  const tinyobj::mesh_t &obj_mesh)
+{
+    const size_t n_corners = obj_mesh.indices.size();
+    const size_t n_buckets = size_t(loader_thread_count()) * 4;
+    const size_t n_chunks = loader_thread_count();
+    const size_t chunk_size = (n_corners + n_chunks - 1) / n_chunks;
+    const std::hash<glm::uvec3> hasher;
+
+    // Count the face vertices of each chunk in each bucket
+    std::vector<uint32_t> corner_bucket(n_corners, 0);
+    std::vector<size_t> chunk_counts(n_chunks * n_buckets, 0);
+    parallel_tasks(n_chunks, [&](size_t c) {
+        const size_t end = std::min((c + 1) * chunk_size, n_corners);
+        for (size_t i = c * chunk_size; i < end; ++i) {
+            // The map in each bucket hashes by the low bits, so buckets take the high bits
+            const uint64_t h = hasher(obj_corner_key(obj_mesh, i));
+            corner_bucket[i] = uint32_t((h >> 32) % n_buckets);
+            ++chunk_counts[c * n_buckets + corner_bucket[i]];
+        }
+    });
+
+    // Offset of each chunk's face vertices in each bucket, with the chunks in order so each
+    // bucket lists its face vertices in order
+    std::vector<size_t> bucket_start(n_buckets + 1, 0);
+    std::vector<size_t> chunk_offsets(n_chunks * n_buckets, 0);
+    size_t offset = 0;
+    for (size_t b = 0; b < n_buckets; ++b) {
+        bucket_start[b] = offset;
+        for (size_t c = 0; c < n_chunks; ++c) {
+            chunk_offsets[c * n_buckets + b] = offset;
+            offset += chunk_counts[c * n_buckets + b];
+        }
+    }
+    bucket_start[n_buckets] = offset;
+
+    std::vector<uint32_t> bucket_corners(n_corners, 0);
+    parallel_tasks(n_chunks, [&](size_t c) {
+        const size_t end = std::min((c + 1) * chunk_size, n_corners);
+        for (size_t i = c * chunk_size; i < end; ++i) {
+            bucket_corners[chunk_offsets[c * n_buckets + corner_bucket[i]]++] = i;
+        }
+    });
+
+    // Find the first face vertex referencing the same vertex as each face vertex
+    std::vector<uint32_t> first_corner(n_corners, 0);
+    parallel_tasks(n_buckets, [&](size_t b) {
+        phmap::flat_hash_map<glm::uvec3, uint32_t> index_mapping;
+        index_mapping.reserve(bucket_start[b + 1] - bucket_start[b]);
+        for (size_t i = bucket_start[b]; i < bucket_start[b + 1]; ++i) {
+            const uint32_t corner = bucket_corners[i];
+            auto fnd = index_mapping.find(obj_corner_key(obj_mesh, corner));
+            if (fnd != index_mapping.end()) {
+                first_corner[corner] = fnd->second;
+            } else {
+                index_mapping[obj_corner_key(obj_mesh, corner)] = corner;
+                first_corner[corner] = corner;
+            }
+        }
+    });
+    bucket_corners = std::vector<uint32_t>();
+    corner_bucket = std::vector<uint32_t>();
+
+    // Number the vertices by their first reference, along with the normals and uvs of the
+    // vertices that have them
+    std::vector<uint32_t> vertex_ids(n_corners, 0);
+    std::vector<uint32_t> vertex_corners;
+    size_t n_normals = 0;
+    size_t n_uvs = 0;
+    for (size_t i = 0; i < n_corners; ++i) {
+        if (first_corner[i] == i) {
+            vertex_ids[i] = vertex_corners.size();
+            vertex_corners.push_back(i);
+            const glm::uvec3 idx = obj_corner_key(obj_mesh, i);
+            n_normals += idx.y != uint32_t(-1) ? 1 : 0;
+            n_uvs += idx.z != uint32_t(-1) ? 1 : 0;
+        }
+    }
+
+    Geometry geom;
+    geom.indices.resize(n_corners / 3);
+    geom.vertices.resize(vertex_corners.size());
+    geom.normals.resize(n_normals);
+    geom.uvs.resize(n_uvs);
+    // Normals and uvs are only output for the vertices that have them, so with a mix of
+    // vertices with and without them they're written in order on one thread
+    const bool packed_attribs =
+        (n_normals == 0 || n_normals == vertex_corners.size()) &&
+        (n_uvs == 0 || n_uvs == vertex_corners.size());
+    const size_t n_vertex_chunks = packed_attribs ? n_chunks : 1;
+    const size_t vertex_chunk_size =
+        (vertex_corners.size() + n_vertex_chunks - 1) / n_vertex_chunks;
+    parallel_tasks(n_vertex_chunks, [&](size_t c) {
+        const size_t begin = c * vertex_chunk_size;
+        const size_t end = std::min(begin + vertex_chunk_size, vertex_corners.size());
+        size_t normal = packed_attribs ? begin : 0;
+        size_t uv = packed_attribs ? begin : 0;
+        for (size_t v = begin; v < end; ++v) {
+            const glm::uvec3 idx = obj_corner_key(obj_mesh, vertex_corners[v]);
+            geom.vertices[v] = obj_position(attrib, idx.x);
+            if (idx.y != uint32_t(-1)) {
+                geom.normals[normal++] = obj_normal(attrib, idx.y);
+            }
+            if (idx.z != uint32_t(-1)) {
+                geom.uvs[uv++] = obj_texcoord(attrib, idx.z);
+            }
+        }
+    });
+    parallel_tasks(n_chunks, [&](size_t c) {
+        const size_t end = std::min((c + 1) * chunk_size, n_corners);
+        for (size_t i = c * chunk_size; i < end; ++i) {
+            geom.indices[i / 3][i % 3] = vertex_ids[first_corner[i]];
+        }
+    });
+    return geom;
+}
+
+}
+
+Scene::Scene(const std::string &fname) : Scene(fname, LOAD_ALL_TEXTURES) {}
+
+Scene::Scene(const std::string &fname,
+             TextureLoad texture_load,
+             const std::string &lightmap_uv_set)
 {
     const std::string ext = get_file_extension(fname);
     if (ext == "obj") {
         load_obj(fname);
     } else if (ext == "gltf" || ext == "glb") {
-        load_gltf(fname);
+        load_gltf(fname, lightmap_uv_set);
     } else if (ext == "crts") {
         load_crts(fname);
     } else {
         std::cout << "Unsupported file type '" << ext << "'\n";
         throw std::runtime_error("Unsupported file type " + ext);
     }
+    decode_textures(texture_load);
 }
 
 size_t Scene::unique_tris() const
@@ -74,6 +300,7 @@ size_t Scene::num_geometries() const
 
 void Scene::load_obj(const std::string &file)
 {
+    TRACE_SCOPE("Scene::load_obj");
     std::cout << "Loading OBJ: " << file << "\n";
 
     // Load the model w/ tinyobjloader. We just take any OBJ groups etc. stuff
@@ -97,12 +324,13 @@ void Scene::load_obj(const std::string &file)
     for (size_t s = 0; s < shapes.size(); ++s) {
         // We load with triangulate on so we know the mesh will be all triangle faces
         const tinyobj::mesh_t &obj_mesh = shapes[s].mesh;
+        for (const auto &n : obj_mesh.num_face_vertices) {
+            if (n != 3) {
+                throw std::runtime_error("Non-triangle face found in " + file + "-" +
+                                         shapes[s].name);
+            }
+        }
 
-        // We've got to remap from 3 indices per-vert (independent for pos, normal & uv) used
-        // by tinyobjloader over to single index per-vert (single for pos, normal & uv tuple)
-        // used by renderers
-        phmap::parallel_flat_hash_map<glm::uvec3, uint32_t> index_mapping;
-        Geometry geom;
         // Note: not supporting per-primitive materials
         material_ids.push_back(obj_mesh.material_ids[0]);
 
@@ -114,47 +342,25 @@ void Scene::load_obj(const std::string &file)
                    "wrong."
                    " Please reexport your mesh with each material group as an OBJ group\n";
         }
+    }
 
-        for (size_t f = 0; f < obj_mesh.num_face_vertices.size(); ++f) {
-            if (obj_mesh.num_face_vertices[f] != 3) {
-                throw std::runtime_error("Non-triangle face found in " + file + "-" +
-                                         shapes[s].name);
-            }
-
-            glm::uvec3 tri_indices;
-            for (size_t i = 0; i < 3; ++i) {
-                const glm::uvec3 idx(obj_mesh.indices[f * 3 + i].vertex_index,
-                                     obj_mesh.indices[f * 3 + i].normal_index,
-                                     obj_mesh.indices[f * 3 + i].texcoord_index);
-                uint32_t vert_idx = 0;
-                auto fnd = index_mapping.find(idx);
-                if (fnd != index_mapping.end()) {
-                    vert_idx = fnd->second;
-                } else {
-                    vert_idx = geom.vertices.size();
-                    index_mapping[idx] = vert_idx;
-
-                    geom.vertices.emplace_back(attrib.vertices[3 * idx.x],
-                                               attrib.vertices[3 * idx.x + 1],
-                                               attrib.vertices[3 * idx.x + 2]);
-
-                    if (idx.y != uint32_t(-1)) {
-                        glm::vec3 n(attrib.normals[3 * idx.y],
-                                    attrib.normals[3 * idx.y + 1],
-                                    attrib.normals[3 * idx.y + 2]);
-                        geom.normals.push_back(glm::normalize(n));
-                    }
-
-                    if (idx.z != uint32_t(-1)) {
-                        geom.uvs.emplace_back(attrib.texcoords[2 * idx.z],
-                                              attrib.texcoords[2 * idx.z + 1]);
-                    }
-                }
-                tri_indices[i] = vert_idx;
-            }
-            geom.indices.push_back(tri_indices);
+    // The small shapes are remapped several at once, then the large ones each across all
+    // threads
+    mesh.geometries.resize(shapes.size());
+    std::vector<size_t> small_shapes, large_shapes;
+    for (size_t s = 0; s < shapes.size(); ++s) {
+        if (shapes[s].mesh.indices.size() > parallel_remap_corners) {
+            large_shapes.push_back(s);
+        } else {
+            small_shapes.push_back(s);
         }
-        mesh.geometries.push_back(geom);
+    }
+    parallel_tasks(small_shapes.size(), [&](size_t i) {
+        const size_t s = small_shapes[i];
+        mesh.geometries[s] = remap_obj_shape(attrib, shapes[s].mesh);
+    });
+    for (const auto &s : large_shapes) {
+        mesh.geometries[s] = remap_obj_shape_parallel(attrib, shapes[s].mesh);
     }
     meshes.push_back(mesh);
 
@@ -175,14 +381,31 @@ void Scene::load_obj(const std::string &file)
             canonicalize_path(path);
             if (texture_ids.find(m.diffuse_texname) == texture_ids.end()) {
                 texture_ids[m.diffuse_texname] = textures.size();
-                textures.emplace_back(obj_base_dir + "/" + path, m.diffuse_texname, SRGB);
+                textures.push_back(deferred_image(m.diffuse_texname, SRGB, true));
+                textures.back().file = obj_base_dir + "/" + path;
             }
             const int32_t id = texture_ids[m.diffuse_texname];
             uint32_t tex_mask = TEXTURED_PARAM_MASK;
             SET_TEXTURE_ID(tex_mask, id);
             d.base_color.r = *reinterpret_cast<float *>(&tex_mask);
         }
+        // The map_d cutout is usually a grayscale mask, unless it's the diffuse texture's
+        // alpha channel
+        AlphaMask alpha_mask;
+        if (!m.alpha_texname.empty()) {
+            std::string path = m.alpha_texname;
+            canonicalize_path(path);
+            if (texture_ids.find(m.alpha_texname) == texture_ids.end()) {
+                texture_ids[m.alpha_texname] = textures.size();
+                textures.push_back(deferred_image(m.alpha_texname, LINEAR, true));
+                textures.back().file = obj_base_dir + "/" + path;
+            }
+            alpha_mask.texture = texture_ids[m.alpha_texname];
+            alpha_mask.channel = m.alpha_texname == m.diffuse_texname ? 3 : 0;
+        }
         materials.push_back(d);
+        alpha_masks.resize(materials.size());
+        alpha_masks.back() = alpha_mask;
     }
 
     validate_materials();
@@ -199,12 +422,16 @@ void Scene::load_obj(const std::string &file)
     lights.push_back(light);
 }
 
-void Scene::load_gltf(const std::string &fname)
+void Scene::load_gltf(const std::string &fname, const std::string &lightmap_uv_set)
 {
+    TRACE_SCOPE("Scene::load_gltf");
     std::cout << "Loading GLTF " << fname << "\n";
 
-    tinygltf::Model model;
+    // The geometry views the model's buffers, so it's kept alive until the views are dropped
+    auto model_ptr = std::make_shared<tinygltf::Model>();
+    tinygltf::Model &model = *model_ptr;
     tinygltf::TinyGLTF context;
+    context.SetImageLoader(keep_encoded_gltf_image, nullptr);
     std::string err, warn;
     bool ret = false;
     if (get_file_extension(fname) == "gltf") {
@@ -225,8 +452,6 @@ void Scene::load_gltf(const std::string &fname)
         model.defaultScene = 0;
     }
 
-    flatten_gltf(model);
-
     std::vector<std::vector<uint32_t>> mesh_material_ids;
     // Load the meshes
     for (auto &m : model.meshes) {
@@ -234,6 +459,7 @@ void Scene::load_gltf(const std::string &fname)
         std::vector<uint32_t> material_ids;
         for (auto &p : m.primitives) {
             Geometry geom;
+            geom.source = model_ptr;
             material_ids.push_back(p.material);
 
             if (p.mode != TINYGLTF_MODE_TRIANGLES) {
@@ -242,51 +468,61 @@ void Scene::load_gltf(const std::string &fname)
                     "Unsupported primitive mode! Only triangles are supported");
             }
 
-            // Note: assumes there is a POSITION (is this required by the gltf spec?)
-            Accessor<glm::vec3> pos_accessor(model.accessors[p.attributes["POSITION"]], model);
-            for (size_t i = 0; i < pos_accessor.size(); ++i) {
-                geom.vertices.push_back(pos_accessor[i]);
+            // Note: assumes there is a POSITION (is this required by the gltf spec?). Packed
+            // float attributes are viewed in place, others are decoded in bulk, e.g. the
+            // quantized attributes of KHR_mesh_quantization
+            const tinygltf::Accessor &pos = model.accessors[p.attributes["POSITION"]];
+            Accessor<glm::vec3> pos_accessor(pos, model);
+            if (pos.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT && pos_accessor.packed()) {
+                geom.vertex_view = ArrayView<glm::vec3>(&pos_accessor[0], pos_accessor.size());
+            } else {
+                geom.vertices.resize(pos.count);
+                read_gltf_floats(pos, model, 3, glm::value_ptr(geom.vertices[0]));
             }
 
             // Note: GLTF can have multiple texture coordinates used by different textures
-            // (owch) I don't plan to support this
-            auto fnd = p.attributes.find("TEXCOORD_0");
-            if (fnd != p.attributes.end()) {
-                Accessor<glm::vec2> uv_accessor(model.accessors[fnd->second], model);
-                for (size_t i = 0; i < uv_accessor.size(); ++i) {
-                    geom.uvs.push_back(uv_accessor[i]);
+            // (owch) I don't plan to support this. Only the lightmap uv set is also read
+            auto read_uvs = [&](const std::string &attribute,
+                                ArrayView<glm::vec2> &view,
+                                std::vector<glm::vec2> &uvs) {
+                auto fnd = p.attributes.find(attribute);
+                if (fnd == p.attributes.end()) {
+                    return;
                 }
+                const tinygltf::Accessor &uv = model.accessors[fnd->second];
+                Accessor<glm::vec2> uv_accessor(uv, model);
+                if (uv.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT &&
+                    uv_accessor.packed()) {
+                    view = ArrayView<glm::vec2>(&uv_accessor[0], uv_accessor.size());
+                } else {
+                    uvs.resize(uv.count);
+                    read_gltf_floats(uv, model, 2, glm::value_ptr(uvs[0]));
+                }
+            };
+            read_uvs("TEXCOORD_0", geom.uv_view, geom.uvs);
+            if (!lightmap_uv_set.empty()) {
+                read_uvs(lightmap_uv_set, geom.lightmap_uv_view, geom.lightmap_uvs);
             }
 
 #if 0
             fnd = p.attributes.find("NORMAL");
             if (fnd != p.attributes.end()) {
-                Accessor<glm::vec3> normal_accessor(model.accessors[fnd->second], model);
-                for (size_t i = 0; i < normal_accessor.size(); ++i) {
-                    geom.normals.push_back(normal_accessor[i]);
-                }
+                const tinygltf::Accessor &normal = model.accessors[fnd->second];
+                geom.normals.resize(normal.count);
+                read_gltf_floats(normal, model, 3, glm::value_ptr(geom.normals[0]));
             }
 #endif
 
-            if (model.accessors[p.indices].componentType ==
-                TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT) {
-                Accessor<uint16_t> index_accessor(model.accessors[p.indices], model);
-                for (size_t i = 0; i < index_accessor.size() / 3; ++i) {
-                    geom.indices.push_back(glm::uvec3(index_accessor[i * 3],
-                                                      index_accessor[i * 3 + 1],
-                                                      index_accessor[i * 3 + 2]));
-                }
-            } else if (model.accessors[p.indices].componentType ==
-                       TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT) {
-                Accessor<uint32_t> index_accessor(model.accessors[p.indices], model);
-                for (size_t i = 0; i < index_accessor.size() / 3; ++i) {
-                    geom.indices.push_back(glm::uvec3(index_accessor[i * 3],
-                                                      index_accessor[i * 3 + 1],
-                                                      index_accessor[i * 3 + 2]));
-                }
+            // Packed 32-bit indices are viewed in place, others are widened in bulk
+            const tinygltf::Accessor &indices = model.accessors[p.indices];
+            Accessor<uint32_t> index_accessor(indices, model);
+            if (indices.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT &&
+                index_accessor.packed()) {
+                geom.index_view = ArrayView<glm::uvec3>(
+                    reinterpret_cast<const glm::uvec3 *>(&index_accessor[0]),
+                    index_accessor.size() / 3);
             } else {
-                std::cout << "Unsupported index type\n";
-                throw std::runtime_error("Unsupported index component type");
+                geom.indices = read_gltf_triangles(indices, model);
             }
             mesh.geometries.push_back(geom);
         }
@@ -294,25 +530,12 @@ void Scene::load_gltf(const std::string &fname)
         meshes.push_back(mesh);
     }
 
-    // Load images
-    for (const auto &img : model.images) {
-        if (img.component != 4) {
-            std::cout << "WILL: Check non-4 component image support\n";
-        }
-        if (img.pixel_type != TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE) {
-            std::cout << "Non-uchar images are not supported\n";
-            throw std::runtime_error("Unsupported image pixel type");
-        }
-
-        Image texture;
-        texture.name = img.name;
-        texture.width = img.width;
-        texture.height = img.height;
-        texture.channels = img.component;
-        texture.img = img.image;
-        // Assume linear unless we find it used as a color texture
-        texture.color_space = LINEAR;
-        textures.push_back(texture);
+    // Load images, the loader kept their encoded data which is moved out of the model, as
+    // it's kept alive by the geometry views. Assume linear unless we find it used as a
+    // color texture
+    for (auto &img : model.images) {
+        textures.push_back(deferred_image(img.name, LINEAR, false));
+        textures.back().encoded = std::move(img.image);
     }
 
     // Load materials
@@ -351,16 +574,30 @@ void Scene::load_gltf(const std::string &fname)
             SET_TEXTURE_CHANNEL(tex_mask, 1);
             mat.roughness = *reinterpret_cast<float *>(&tex_mask);
         }
+        // Blended materials are cut out at the default cutoff, as the bake can't blend the
+        // occlusion. Images are decoded to RGBA, so those without alpha are opaque
+        AlphaMask alpha_mask;
+        if ((m.alphaMode == "MASK" || m.alphaMode == "BLEND") &&
+            m.pbrMetallicRoughness.baseColorTexture.index != -1) {
+            alpha_mask.texture =
+                model.textures[m.pbrMetallicRoughness.baseColorTexture.index].source;
+            alpha_mask.cutoff = m.alphaMode == "MASK" ? float(m.alphaCutoff) : 0.5f;
+        }
         materials.push_back(mat);
+        alpha_masks.resize(materials.size());
+        alpha_masks.back() = alpha_mask;
     }
 
-    for (const auto &nid : model.scenes[model.defaultScene].nodes) {
-        const tinygltf::Node &n = model.nodes[nid];
-        if (n.mesh != -1) {
-            const glm::mat4 transform = read_node_transform(n);
-            instances.emplace_back(transform, n.mesh, mesh_material_ids[n.mesh]);
+    // The instances reference the meshes loaded above, nested instancing doesn't copy them
+    // Nodes can be tagged with their occluder class by an "occluder_class" string in their
+    // extras, e.g. "hero" or "tiny"
+    flatten_gltf(model, [&](const tinygltf::Node &n, const glm::mat4 &transform) {
+        instances.emplace_back(transform, n.mesh, mesh_material_ids[n.mesh]);
+        if (n.extras.Has("occluder_class") && n.extras.Get("occluder_class").IsString()) {
+            instances.back().occluder_class =
+                parse_occluder_class(n.extras.Get("occluder_class").Get<std::string>());
         }
-    }
+    });
 
     validate_materials();
 
@@ -380,6 +617,7 @@ void Scene::load_gltf(const std::string &fname)
 void Scene::load_crts(const std::string &file)
 {
     using json = nlohmann::json;
+    TRACE_SCOPE("Scene::load_crts");
     std::cout << "Loading CRTS " << file << "\n";
 
     auto mapping = std::make_shared<FileMapping>(file);
@@ -394,7 +632,9 @@ void Scene::load_crts(const std::string &file)
     for (size_t i = 0; i < header["meshes"].size(); ++i) {
         auto &m = header["meshes"][i];
 
+        // The geometry views its data in the mapped file instead of copying it
         Geometry geom;
+        geom.source = mapping;
         {
             const uint64_t view_id = m["positions"].get<uint64_t>();
             auto &v = header["buffer_views"][view_id];
@@ -403,7 +643,7 @@ void Scene::load_crts(const std::string &file)
                             v["byte_length"].get<uint64_t>(),
                             dtype_stride(dtype));
             Accessor<glm::vec3> accessor(view);
-            geom.vertices = std::vector<glm::vec3>(accessor.begin(), accessor.end());
+            geom.vertex_view = ArrayView<glm::vec3>(accessor.begin(), accessor.size());
         }
         {
             const uint64_t view_id = m["indices"].get<uint64_t>();
@@ -413,7 +653,7 @@ void Scene::load_crts(const std::string &file)
                             v["byte_length"].get<uint64_t>(),
                             dtype_stride(dtype));
             Accessor<glm::uvec3> accessor(view);
-            geom.indices = std::vector<glm::uvec3>(accessor.begin(), accessor.end());
+            geom.index_view = ArrayView<glm::uvec3>(accessor.begin(), accessor.size());
         }
         if (m.find("texcoords") != m.end()) {
             const uint64_t view_id = m["texcoords"].get<uint64_t>();
@@ -423,7 +663,7 @@ void Scene::load_crts(const std::string &file)
                             v["byte_length"].get<uint64_t>(),
                             dtype_stride(dtype));
             Accessor<glm::vec2> accessor(view);
-            geom.uvs = std::vector<glm::vec2>(accessor.begin(), accessor.end());
+            geom.uv_view = ArrayView<glm::vec2>(accessor.begin(), accessor.size());
         }
 #if 0
         if (m.find("normals") != m.end()) {
@@ -454,23 +694,13 @@ void Scene::load_crts(const std::string &file)
                         dtype_stride(dtype));
         Accessor<uint8_t> accessor(view);
 
-        stbi_set_flip_vertically_on_load(1);
-        int x, y, n;
-        uint8_t *img_data =
-            stbi_load_from_memory(accessor.begin(), accessor.size(), &x, &y, &n, 4);
-        stbi_set_flip_vertically_on_load(0);
-        if (!img_data) {
-            std::cout << "Failed to load " << img["name"].get<std::string>() << " from view\n";
-            throw std::runtime_error("Failed to load " + img["name"].get<std::string>());
-        }
-
         ColorSpace color_space = SRGB;
         if (img["color_space"].get<std::string>() == "LINEAR") {
             color_space = LINEAR;
         }
 
-        textures.emplace_back(img_data, x, y, 4, img["name"].get<std::string>(), color_space);
-        stbi_image_free(img_data);
+        textures.push_back(deferred_image(img["name"].get<std::string>(), color_space, true));
+        textures.back().encoded = std::vector<uint8_t>(accessor.begin(), accessor.end());
     }
 
     for (size_t i = 0; i < header["materials"].size(); ++i) {
@@ -523,6 +753,10 @@ void Scene::load_crts(const std::string &file)
         if (type == "MESH") {
             const auto mat_id = std::vector<uint32_t>{n["material"].get<uint32_t>()};
             instances.emplace_back(matrix, n["mesh"].get<uint64_t>(), mat_id);
+            if (n.find("occluder_class") != n.end()) {
+                instances.back().occluder_class =
+                    parse_occluder_class(n["occluder_class"].get<std::string>());
+            }
         } else if (type == "LIGHT") {
             QuadLight light;
             const auto color = glm::make_vec3(n["color"].get<std::vector<float>>().data());
@@ -586,4 +820,41 @@ void Scene::validate_materials()
             }
         }
     }
+    // Materials without a cutout, e.g. all those of crts scenes, are opaque
+    alpha_masks.resize(materials.size());
+}
+
+void Scene::decode_textures(TextureLoad texture_load)
+{
+    TRACE_SCOPE("Scene::decode_textures");
+    if (texture_load == LOAD_NO_TEXTURES) {
+        std::fill(alpha_masks.begin(), alpha_masks.end(), AlphaMask());
+        return;
+    }
+    std::vector<bool> needed(textures.size(), texture_load == LOAD_ALL_TEXTURES);
+    for (const auto &m : alpha_masks) {
+        if (m.enabled()) {
+            needed[m.texture] = true;
+        }
+    }
+    std::vector<size_t> decode;
+    for (size_t i = 0; i < textures.size(); ++i) {
+        if (needed[i] && textures[i].deferred()) {
+            decode.push_back(i);
+        }
+    }
+    if (decode.empty()) {
+        return;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    parallel_tasks(decode.size(), [&](size_t i) {
+        TRACE_SCOPE("Decode Texture");
+        textures[decode[i]].decode();
+    });
+    std::cout << "Decoded " << decode.size() << " of " << textures.size() << " textures in "
+              << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                           start)
+                     .count()
+              << "ms\n";
 }
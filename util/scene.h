@@ -10,14 +10,33 @@
 #include "phmap.h"
 #include <glm/glm.hpp>
 
+// Which of the scene's textures are decoded by the load, the rest are left undecoded
+enum TextureLoad {
+    LOAD_ALL_TEXTURES,
+    // Only the textures used by alpha masks, the only ones the AO bake reads
+    LOAD_ALPHA_TEXTURES,
+    // None, the alpha masks are disabled
+    LOAD_NO_TEXTURES,
+};
+
 struct Scene {
     std::vector<Mesh> meshes;
     std::vector<Instance> instances;
     std::vector<DisneyMaterial> materials;
+    // The alpha cutout of each material
+    std::vector<AlphaMask> alpha_masks;
     std::vector<Image> textures;
     std::vector<QuadLight> lights;
     std::vector<Camera> cameras;
 
+    /* Load the scene, decoding the textures selected by texture_load in parallel. Textures
+     * that aren't decoded keep their name and color space but have no data, see
+     * Image::deferred. If lightmap_uv_set names a glTF attribute, e.g. TEXCOORD_1, it's
+     * loaded as the geometries' lightmap uvs
+     */
+    Scene(const std::string &fname,
+          TextureLoad texture_load,
+          const std::string &lightmap_uv_set = std::string());
     Scene(const std::string &fname);
     Scene() = default;
 
@@ -32,9 +51,11 @@ struct Scene {
 private:
     void load_obj(const std::string &file);
 
-    void load_gltf(const std::string &file);
+    void load_gltf(const std::string &file, const std::string &lightmap_uv_set);
 
     void load_crts(const std::string &file);
 
     void validate_materials();
+
+    void decode_textures(TextureLoad texture_load);
 };
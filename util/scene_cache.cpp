@@ -0,0 +1,433 @@
+#include "scene_cache.h"
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "file_mapping.h"
+#include "trace.h"
+#include "util.h"
+
+namespace {
+
+// Bump if the cache file layout, the loaders or the unwrap change to invalidate old caches
+const uint32_t SCENE_CACHE_VERSION = 3;
+const uint32_t SCENE_CACHE_MAGIC = 0x43534353; // SCSC
+
+struct SceneCacheHeader {
+    uint32_t magic = SCENE_CACHE_MAGIC;
+    uint32_t version = SCENE_CACHE_VERSION;
+    uint64_t key = 0;
+    uint32_t num_meshes = 0;
+    uint32_t num_geometries = 0;
+    uint32_t num_instances = 0;
+    uint32_t num_material_ids = 0;
+    uint32_t num_alpha_geometries = 0;
+    uint32_t num_textures = 0;
+    // The AtlasResult, the instance regions are stored in their own section
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t page_width = 0;
+    uint32_t page_height = 0;
+    uint32_t page_grid_x = 0;
+    uint32_t page_grid_y = 0;
+    uint32_t chart_count = 0;
+    uint32_t atlas_count = 0;
+    uint32_t instanced_meshes = 0;
+    uint32_t num_lights = 0;
+    uint64_t atlas_cache_key = 0;
+    // The section offsets of the SceneCacheGeometry, SceneCacheInstance, material ID,
+    // InstanceAtlasRegion, SceneCacheAlphaGeometry, SceneCacheTexture and QuadLight tables
+    // and the scene info string
+    uint64_t geometries_offset = 0;
+    uint64_t instances_offset = 0;
+    uint64_t material_ids_offset = 0;
+    uint64_t regions_offset = 0;
+    uint64_t alpha_geometries_offset = 0;
+    uint64_t textures_offset = 0;
+    uint64_t lights_offset = 0;
+    uint64_t info_offset = 0;
+    uint64_t info_bytes = 0;
+};
+
+// The instance's material IDs are num_materials entries of the material ID table
+struct SceneCacheInstance {
+    glm::mat4 transform;
+    uint32_t mesh_id = 0;
+    uint32_t first_material = 0;
+    uint32_t num_materials = 0;
+    uint32_t occluder_class = OCCLUDER_CLASS_UNTAGGED;
+};
+
+struct SceneCacheAlphaGeometry {
+    uint32_t mesh_id = 0;
+    uint32_t geometry = 0;
+    uint32_t texture = 0;
+    uint32_t channel = 0;
+    float cutoff = 0.f;
+    uint32_t num_uvs = 0;
+    uint64_t uvs_offset = 0;
+};
+
+// Textures not used by the alpha test have no data
+struct SceneCacheTexture {
+    int32_t width = -1;
+    int32_t height = -1;
+    int32_t channels = -1;
+    uint32_t color_space = LINEAR;
+    uint64_t data_offset = 0;
+    uint64_t data_bytes = 0;
+};
+
+// Check that the section of count T's at offset is within the file
+template <typename T>
+bool valid_section(const FileMapping &mapping, uint64_t offset, uint64_t count)
+{
+    return offset <= mapping.nbytes() && count <= (mapping.nbytes() - offset) / sizeof(T);
+}
+
+template <typename T>
+ArrayView<T> view_section(const FileMapping &mapping, uint64_t offset, uint64_t count)
+{
+    if (count == 0) {
+        return ArrayView<T>();
+    }
+    return ArrayView<T>(reinterpret_cast<const T *>(mapping.data() + offset), count);
+}
+
+}
+
+uint64_t scene_cache_key(const std::string &scene_file,
+                         const SceneLoadOptions &load_options,
+                         const AtlasOptions &options)
+{
+    Hasher hasher;
+    hasher.add(SCENE_CACHE_VERSION);
+    hasher.add(scene_file.data(), scene_file.size());
+    struct stat file_stat = {};
+    if (stat(scene_file.c_str(), &file_stat) == 0) {
+        hasher.add(uint64_t(file_stat.st_size));
+        hasher.add(uint64_t(file_stat.st_mtime));
+    }
+    hasher.add(uint32_t(load_options.texture_load));
+    hasher.add(load_options.mesh_optimize);
+    hasher.add(uint64_t(load_options.split_limits.max_triangles));
+    hasher.add(uint64_t(load_options.split_limits.max_vertices));
+    hasher.add(load_options.lightmap_uv_set.data(), load_options.lightmap_uv_set.size());
+    hash_atlas_options(hasher, options);
+    return hasher.h;
+}
+
+std::string scene_cache_file_name(const std::string &cache_dir, uint64_t key)
+{
+    std::stringstream ss;
+    ss << cache_dir << "/scene_" << std::hex << std::setw(16) << std::setfill('0') << key
+       << ".bin";
+    return ss.str();
+}
+
+bool load_scene_cache(const std::string &fname, uint64_t key, CachedScene &cached)
+{
+    TRACE_SCOPE("load_scene_cache");
+    if (!std::ifstream(fname.c_str()).good()) {
+        return false;
+    }
+
+    auto mapping = std::make_shared<FileMapping>(fname);
+    SceneCacheHeader header;
+    if (mapping->nbytes() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, mapping->data(), sizeof(header));
+    if (header.magic != SCENE_CACHE_MAGIC || header.version != SCENE_CACHE_VERSION ||
+        header.key != key) {
+        return false;
+    }
+    if (!valid_section<SceneCacheGeometry>(
+            *mapping, header.geometries_offset, header.num_geometries) ||
+        !valid_section<SceneCacheInstance>(
+            *mapping, header.instances_offset, header.num_instances) ||
+        !valid_section<uint32_t>(
+            *mapping, header.material_ids_offset, header.num_material_ids) ||
+        !valid_section<InstanceAtlasRegion>(
+            *mapping, header.regions_offset, header.num_instances) ||
+        !valid_section<SceneCacheAlphaGeometry>(
+            *mapping, header.alpha_geometries_offset, header.num_alpha_geometries) ||
+        !valid_section<SceneCacheTexture>(
+            *mapping, header.textures_offset, header.num_textures) ||
+        !valid_section<QuadLight>(*mapping, header.lights_offset, header.num_lights) ||
+        !valid_section<char>(*mapping, header.info_offset, header.info_bytes)) {
+        return false;
+    }
+
+    // Validate every section before setting up the scene
+    const ArrayView<SceneCacheGeometry> geometries = view_section<SceneCacheGeometry>(
+        *mapping, header.geometries_offset, header.num_geometries);
+    for (const auto &g : geometries) {
+        if (g.mesh_id >= header.num_meshes ||
+            !valid_section<glm::vec3>(*mapping, g.positions_offset, g.vertex_count) ||
+            !valid_section<glm::vec3>(*mapping, g.normals_offset, g.vertex_count) ||
+            !valid_section<glm::vec2>(*mapping, g.uvs_offset, g.uv_count) ||
+            !valid_section<glm::uvec3>(*mapping, g.indices_offset, g.tri_count)) {
+            return false;
+        }
+    }
+    const ArrayView<SceneCacheInstance> instances = view_section<SceneCacheInstance>(
+        *mapping, header.instances_offset, header.num_instances);
+    for (const auto &inst : instances) {
+        if (inst.mesh_id >= header.num_meshes ||
+            uint64_t(inst.first_material) + inst.num_materials > header.num_material_ids) {
+            return false;
+        }
+    }
+    const ArrayView<SceneCacheAlphaGeometry> alpha_geometries =
+        view_section<SceneCacheAlphaGeometry>(
+            *mapping, header.alpha_geometries_offset, header.num_alpha_geometries);
+    for (const auto &a : alpha_geometries) {
+        if (a.mesh_id >= header.num_meshes || a.texture >= header.num_textures ||
+            !valid_section<glm::vec2>(*mapping, a.uvs_offset, a.num_uvs)) {
+            return false;
+        }
+    }
+    const ArrayView<SceneCacheTexture> textures = view_section<SceneCacheTexture>(
+        *mapping, header.textures_offset, header.num_textures);
+    for (const auto &t : textures) {
+        if (!valid_section<uint8_t>(*mapping, t.data_offset, t.data_bytes)) {
+            return false;
+        }
+    }
+
+    Scene &scene = cached.scene;
+    scene.meshes.resize(header.num_meshes);
+    for (const auto &g : geometries) {
+        Geometry geom;
+        geom.source = mapping;
+        geom.alpha_tested = g.alpha_tested != 0;
+        geom.vertex_view =
+            view_section<glm::vec3>(*mapping, g.positions_offset, g.vertex_count);
+        geom.normal_view = view_section<glm::vec3>(*mapping, g.normals_offset, g.vertex_count);
+        geom.uv_view = view_section<glm::vec2>(*mapping, g.uvs_offset, g.uv_count);
+        geom.index_view = view_section<glm::uvec3>(*mapping, g.indices_offset, g.tri_count);
+        scene.meshes[g.mesh_id].geometries.push_back(geom);
+    }
+
+    const ArrayView<uint32_t> material_ids = view_section<uint32_t>(
+        *mapping, header.material_ids_offset, header.num_material_ids);
+    for (const auto &inst : instances) {
+        const uint32_t *ids = material_ids.data() + inst.first_material;
+        scene.instances.emplace_back(inst.transform,
+                                     inst.mesh_id,
+                                     std::vector<uint32_t>(ids, ids + inst.num_materials));
+        scene.instances.back().occluder_class = inst.occluder_class;
+    }
+
+    for (const auto &t : textures) {
+        Image img;
+        img.width = t.width;
+        img.height = t.height;
+        img.channels = t.channels;
+        img.color_space = static_cast<ColorSpace>(t.color_space);
+        const uint8_t *data = mapping->data() + t.data_offset;
+        img.img = std::vector<uint8_t>(data, data + t.data_bytes);
+        scene.textures.push_back(img);
+    }
+
+    for (const auto &a : alpha_geometries) {
+        AlphaTestedGeometry alpha;
+        alpha.mesh_id = a.mesh_id;
+        alpha.geometry = a.geometry;
+        alpha.texture = a.texture;
+        alpha.channel = a.channel;
+        alpha.cutoff = a.cutoff;
+        const ArrayView<glm::vec2> uvs =
+            view_section<glm::vec2>(*mapping, a.uvs_offset, a.num_uvs);
+        alpha.uvs = std::vector<glm::vec2>(uvs.begin(), uvs.end());
+        cached.alpha_geometries.push_back(alpha);
+    }
+
+    AtlasResult &atlas = cached.atlas;
+    atlas.size = glm::uvec2(header.width, header.height);
+    atlas.page_size = glm::uvec2(header.page_width, header.page_height);
+    atlas.page_grid = glm::uvec2(header.page_grid_x, header.page_grid_y);
+    atlas.chart_count = header.chart_count;
+    atlas.atlas_count = header.atlas_count;
+    atlas.instanced_meshes = header.instanced_meshes;
+    atlas.cache_key = header.atlas_cache_key;
+    atlas.from_cache = true;
+    const ArrayView<InstanceAtlasRegion> regions = view_section<InstanceAtlasRegion>(
+        *mapping, header.regions_offset, header.num_instances);
+    atlas.instance_regions = std::vector<InstanceAtlasRegion>(regions.begin(), regions.end());
+
+    const ArrayView<QuadLight> lights =
+        view_section<QuadLight>(*mapping, header.lights_offset, header.num_lights);
+    scene.lights = std::vector<QuadLight>(lights.begin(), lights.end());
+
+    const char *info = reinterpret_cast<const char *>(mapping->data() + header.info_offset);
+    cached.scene_info = std::string(info, info + header.info_bytes);
+    return true;
+}
+
+SceneCacheWriter::SceneCacheWriter(const std::string &fname, uint64_t key)
+    : fname(fname), fout(fname.c_str(), std::ios::binary), key(key)
+{
+    // The header is left zeroed until the file is finished
+    const std::vector<uint8_t> zeros(sizeof(SceneCacheHeader), 0);
+    fout.write(reinterpret_cast<const char *>(zeros.data()), zeros.size());
+}
+
+SceneCacheWriter::~SceneCacheWriter()
+{
+    if (!finished) {
+        fout.close();
+        std::remove(fname.c_str());
+    }
+}
+
+uint64_t SceneCacheWriter::begin_section()
+{
+    const uint64_t offset = fout.tellp();
+    const uint64_t aligned = align_to(offset, scene_cache_alignment);
+    const std::vector<char> padding(aligned - offset, 0);
+    fout.write(padding.data(), padding.size());
+    return aligned;
+}
+
+uint64_t SceneCacheWriter::write_section(const void *data, size_t nbytes)
+{
+    const uint64_t offset = begin_section();
+    fout.write(static_cast<const char *>(data), nbytes);
+    return offset;
+}
+
+void SceneCacheWriter::add_mesh(const Mesh &mesh)
+{
+    for (const auto &g : mesh.geometries) {
+        const ArrayView<glm::vec3> vertices = g.vertex_data();
+        const ArrayView<glm::vec3> normals = g.normal_data();
+        const ArrayView<glm::vec2> uvs = g.uv_data();
+        const ArrayView<glm::uvec3> indices = g.index_data();
+        if (normals.size() != vertices.size()) {
+            throw std::runtime_error("Scene cache geometry must have a normal per vertex");
+        }
+
+        SceneCacheGeometry cg;
+        cg.mesh_id = num_meshes;
+        cg.alpha_tested = g.alpha_tested ? 1 : 0;
+        cg.vertex_count = vertices.size();
+        cg.uv_count = uvs.size();
+        cg.tri_count = indices.size();
+        cg.positions_offset =
+            write_section(vertices.data(), vertices.size() * sizeof(glm::vec3));
+        cg.normals_offset =
+            write_section(normals.data(), normals.size() * sizeof(glm::vec3));
+        cg.uvs_offset = write_section(uvs.data(), uvs.size() * sizeof(glm::vec2));
+        cg.indices_offset =
+            write_section(indices.data(), indices.size() * sizeof(glm::uvec3));
+        geometries.push_back(cg);
+    }
+    ++num_meshes;
+}
+
+void SceneCacheWriter::finish(const Scene &scene,
+                              const std::vector<AlphaTestedGeometry> &alpha_geometries,
+                              const AtlasResult &atlas,
+                              const std::string &scene_info)
+{
+    SceneCacheHeader header;
+    header.key = key;
+    header.num_meshes = num_meshes;
+    header.num_geometries = geometries.size();
+    header.geometries_offset =
+        write_section(geometries.data(), geometries.size() * sizeof(SceneCacheGeometry));
+
+    std::vector<SceneCacheInstance> instances;
+    std::vector<uint32_t> material_ids;
+    for (const auto &inst : scene.instances) {
+        SceneCacheInstance ci;
+        ci.transform = inst.transform;
+        ci.mesh_id = inst.mesh_id;
+        ci.first_material = material_ids.size();
+        ci.num_materials = inst.material_ids.size();
+        ci.occluder_class = inst.occluder_class;
+        material_ids.insert(
+            material_ids.end(), inst.material_ids.begin(), inst.material_ids.end());
+        instances.push_back(ci);
+    }
+    header.num_instances = instances.size();
+    header.num_material_ids = material_ids.size();
+    header.instances_offset =
+        write_section(instances.data(), instances.size() * sizeof(SceneCacheInstance));
+    header.material_ids_offset =
+        write_section(material_ids.data(), material_ids.size() * sizeof(uint32_t));
+    header.regions_offset = write_section(
+        atlas.instance_regions.data(),
+        atlas.instance_regions.size() * sizeof(InstanceAtlasRegion));
+
+    // Only the textures the alpha test reads are stored
+    std::vector<bool> alpha_textures(scene.textures.size(), false);
+    std::vector<SceneCacheAlphaGeometry> cached_alpha;
+    for (const auto &a : alpha_geometries) {
+        alpha_textures[a.texture] = true;
+        SceneCacheAlphaGeometry ca;
+        ca.mesh_id = a.mesh_id;
+        ca.geometry = a.geometry;
+        ca.texture = a.texture;
+        ca.channel = a.channel;
+        ca.cutoff = a.cutoff;
+        ca.num_uvs = a.uvs.size();
+        ca.uvs_offset = write_section(a.uvs.data(), a.uvs.size() * sizeof(glm::vec2));
+        cached_alpha.push_back(ca);
+    }
+    header.num_alpha_geometries = cached_alpha.size();
+    header.alpha_geometries_offset = write_section(
+        cached_alpha.data(), cached_alpha.size() * sizeof(SceneCacheAlphaGeometry));
+
+    std::vector<SceneCacheTexture> textures;
+    for (size_t i = 0; i < scene.textures.size(); ++i) {
+        const Image &img = scene.textures[i];
+        SceneCacheTexture ct;
+        ct.color_space = img.color_space;
+        if (alpha_textures[i]) {
+            ct.width = img.width;
+            ct.height = img.height;
+            ct.channels = img.channels;
+            ct.data_bytes = img.img.size();
+            ct.data_offset = write_section(img.img.data(), img.img.size());
+        }
+        textures.push_back(ct);
+    }
+    header.num_textures = textures.size();
+    header.textures_offset =
+        write_section(textures.data(), textures.size() * sizeof(SceneCacheTexture));
+
+    header.num_lights = scene.lights.size();
+    header.lights_offset =
+        write_section(scene.lights.data(), scene.lights.size() * sizeof(QuadLight));
+
+    header.info_bytes = scene_info.size();
+    header.info_offset = write_section(scene_info.data(), scene_info.size());
+
+    header.width = atlas.size.x;
+    header.height = atlas.size.y;
+    header.page_width = atlas.page_size.x;
+    header.page_height = atlas.page_size.y;
+    header.page_grid_x = atlas.page_grid.x;
+    header.page_grid_y = atlas.page_grid.y;
+    header.chart_count = atlas.chart_count;
+    header.atlas_count = atlas.atlas_count;
+    header.instanced_meshes = atlas.instanced_meshes;
+    header.atlas_cache_key = atlas.cache_key;
+
+    fout.seekp(0);
+    fout.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    fout.close();
+    if (!fout) {
+        std::cout << "Failed to write scene cache " << fname << "\n";
+        return;
+    }
+    finished = true;
+}
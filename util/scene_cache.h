@@ -0,0 +1,117 @@
+#pragma once
+
+#include <array>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "alpha_test.h"
+#include "atlas.h"
+#include "geometry_split.h"
+#include "scene.h"
+
+// How the scene is loaded and prepared before it's unwrapped and uploaded
+struct SceneLoadOptions {
+    // The scene textures to decode, the bake only reads the alpha masks
+    TextureLoad texture_load = LOAD_ALPHA_TEXTURES;
+    // The MeshOptimizeStage flags of the stages to optimize the geometry at
+    uint32_t mesh_optimize = 0;
+    GeometrySplitLimits split_limits;
+    // The glTF uv set used as the lightmap uvs where they're valid, e.g. TEXCOORD_1, none if
+    // empty. The meshes without valid lightmap uvs are charted with xatlas
+    std::string lightmap_uv_set;
+    // The fraction of the triangles the occluder proxies keep, disabled if 0, and the
+    // distance the AO rays trace the full-res meshes before the proxies. The proxies are
+    // simplified from the loaded or cached scene, so they don't change the cache key
+    float occluder_proxy_ratio = 0.f;
+    float occluder_near_field = 1.f;
+    // The OccluderMask of the fields of the AO rays each OccluderClass occludes, the near
+    // field only classes occlude within occluder_near_field of the receiver. Untagged
+    // instances whose world bounds' diagonal is below the fraction of the scene's are small
+    // or tiny. The classes are assigned when the scene is baked, so don't change the key.
+    // By default every class occludes both fields
+    std::array<uint32_t, 4> occluder_class_fields = {{3, 3, 3, 3}};
+    float occluder_small_size = 0.05f;
+    float occluder_tiny_size = 0.01f;
+};
+
+// Alignment of each section of the scene cache file
+const uint64_t scene_cache_alignment = 256;
+
+/* The unwrapped scene stored in the scene cache, with everything the bake needs to upload
+ * it without loading or unwrapping the scene file again. Only the textures used by the alpha
+ * tested geometry are stored, the others are left empty. The lights are stored for the direct
+ * lighting bake, the materials aren't stored
+ */
+struct CachedScene {
+    Scene scene;
+    std::vector<AlphaTestedGeometry> alpha_geometries;
+    AtlasResult atlas;
+    std::string scene_info;
+};
+
+// The geometry of each mesh is stored in order, each array in its own section
+struct SceneCacheGeometry {
+    uint32_t mesh_id = 0;
+    uint32_t alpha_tested = 0;
+    uint32_t vertex_count = 0;
+    uint32_t uv_count = 0;
+    uint32_t tri_count = 0;
+    uint32_t pad = 0;
+    uint64_t positions_offset = 0;
+    uint64_t normals_offset = 0;
+    uint64_t uvs_offset = 0;
+    uint64_t indices_offset = 0;
+};
+
+/* The key of the scene file's cache entry, hashing the file's path, size and modification
+ * time with the load and atlas options. Files the scene references, e.g. glTF buffers,
+ * aren't hashed
+ */
+uint64_t scene_cache_key(const std::string &scene_file,
+                         const SceneLoadOptions &load_options,
+                         const AtlasOptions &options);
+
+std::string scene_cache_file_name(const std::string &cache_dir, uint64_t key);
+
+/* Map the scene cache file and set up the cached scene from it, with the geometry viewing
+ * the mapped arrays. Returns false if the file doesn't exist or isn't a complete cache for
+ * the key
+ */
+bool load_scene_cache(const std::string &fname, uint64_t key, CachedScene &cached);
+
+/* Writes the scene cache while the meshes are unwrapped, so the geometry can be released as
+ * it's written. Each array is placed in its own section aligned to scene_cache_alignment,
+ * so the mapped file can be uploaded without repacking. The header is written last, so a
+ * file that's never finished is never loaded and is removed when the writer is destroyed
+ */
+class SceneCacheWriter {
+    std::string fname;
+    std::ofstream fout;
+    uint64_t key = 0;
+    uint32_t num_meshes = 0;
+    std::vector<SceneCacheGeometry> geometries;
+    bool finished = false;
+
+    // Pad the file to the next aligned section, returning its offset
+    uint64_t begin_section();
+
+    uint64_t write_section(const void *data, size_t nbytes);
+
+public:
+    SceneCacheWriter(const std::string &fname, uint64_t key);
+
+    ~SceneCacheWriter();
+
+    SceneCacheWriter(const SceneCacheWriter &) = delete;
+
+    SceneCacheWriter &operator=(const SceneCacheWriter &) = delete;
+
+    // Write the unwrapped geometry of the next mesh, the meshes must be added in order
+    void add_mesh(const Mesh &mesh);
+
+    // Write the instances, alpha test data and atlas after the last mesh to complete the file
+    void finish(const Scene &scene,
+                const std::vector<AlphaTestedGeometry> &alpha_geometries,
+                const AtlasResult &atlas,
+                const std::string &scene_info);
+};
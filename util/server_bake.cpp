@@ -0,0 +1,352 @@
+#include "server_bake.h"
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "dxr/dx12_utils.h"
+#include "dxr/dxr_utils.h"
+#include "trace.h"
+#include "util.h"
+
+void run_bake_server(const AppOptions &options)
+{
+    ComPtr<ID3D12Device5> device = dxr::create_device();
+    if (!dxr::dxr_available(device)) {
+        std::cout << "DXR 1.1 is required for inline ray tracing, but is not supported\n";
+        throw std::runtime_error("DXR 1.1 is not supported");
+    }
+
+    dxr::HeapAllocator heap_allocator(device.Get());
+    if (options.placed_resources) {
+        dxr::set_resource_allocator(&heap_allocator);
+    }
+    std::unique_ptr<dxr::PipelineCache> pipeline_cache =
+        open_pipeline_cache(device.Get(), options);
+    dxr::CommandContext cmd_ctx(device.Get());
+    dxr::GpuProfiler profiler(device.Get(), cmd_ctx.queue.Get(), gpu_profiler_regions);
+    dxr::AsyncReadback readback(device.Get());
+    HeadlessPipelines pipelines;
+
+    ServerQueue queue;
+    queue.max_jobs = options.server_jobs;
+    queue.vram_budget = options.server_vram_budget_mb > 0.0
+                            ? uint64_t(options.server_vram_budget_mb * 1024 * 1024)
+                            : dxr::video_memory_info(device.Get()).Budget;
+
+    // The pipe name is passed in place of the scene file
+    BakeServerPipe pipe(options.scene_file);
+    std::cout << "Bake server listening on " << pipe.path() << ", holding up to "
+              << queue.max_jobs << " jobs within " << pretty_print_count(queue.vram_budget)
+              << "b of video memory\n";
+
+    // The listener and loaders run until the process is stopped, like the bake loop
+    std::thread listener([&]() {
+        if (trace_enabled()) {
+            trace_set_thread_name("Server Listener");
+        }
+        while (true) {
+            std::unique_ptr<BakeConnection> connection = pipe.accept();
+            if (!connection) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(server_vram_poll_ms));
+                continue;
+            }
+            ServerJob job;
+            job.received = std::chrono::steady_clock::now();
+            std::string message;
+            if (!connection->read_message(message)) {
+                continue;
+            }
+            try {
+                job.request = decode_bake_request(message);
+                job.options = bake_request_options(options, job.request);
+            } catch (const std::exception &e) {
+                BakeReply reply;
+                reply.error = e.what();
+                connection->write_message(encode_bake_reply(reply));
+                continue;
+            }
+            job.connection = std::move(connection);
+            {
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.pending.push_back(std::move(job));
+            }
+            queue.cv.notify_all();
+        }
+    });
+    std::vector<std::thread> loaders;
+    for (size_t i = 0; i < queue.max_jobs; ++i) {
+        loaders.emplace_back([&]() { run_server_loader(queue, device.Get()); });
+    }
+
+    size_t served = 0;
+    size_t failed = 0;
+    while (true) {
+        ServerJob job;
+        {
+            std::unique_lock<std::mutex> lock(queue.mutex);
+            queue.cv.wait(lock, [&]() { return !queue.loaded.empty(); });
+            job = std::move(queue.loaded.front());
+            queue.loaded.pop_front();
+            queue.baking = true;
+        }
+
+        const AppOptions &job_options = job.options;
+        std::cout << "Server job " << served + 1 << ": " << job_options.scene_file
+                  << " (queued " << job.queue_ms << "ms, loaded in " << job.load_ms
+                  << "ms)\n";
+        BakeReply reply;
+        reply.queue_ms = job.queue_ms;
+        reply.load_ms = job.load_ms;
+        reply.atlas_size = job.bake_scene.atlas_size;
+        if (!job.error.empty()) {
+            reply.error = "Failed to load " + job_options.scene_file + ": " + job.error;
+        } else {
+            const auto bake_start = std::chrono::steady_clock::now();
+            try {
+                BakeSceneSource scene_source;
+                const RayStats stats = bake_headless_scene(device.Get(),
+                                                           cmd_ctx,
+                                                           profiler,
+                                                           job_options,
+                                                           job.bake_scene,
+                                                           scene_source,
+                                                           nullptr,
+                                                           pipeline_cache.get(),
+                                                           readback,
+                                                           pipelines);
+                // The reply is only sent once the AO map is written, for the client to read
+                readback.flush();
+                reply.ok = true;
+                reply.rays = stats.rays;
+                reply.hits = stats.hits;
+                reply.gpu_ms = stats.gpu_ms;
+                for (const std::string *f : {&job_options.bake_output,
+                                             &job_options.bent_normal_output,
+                                             &job_options.hit_distance_output,
+                                             &job_options.direct_light_output}) {
+                    if (!f->empty()) {
+                        reply.outputs.push_back(*f);
+                    }
+                }
+            } catch (const std::exception &e) {
+                reply.error = "Failed to bake " + job_options.scene_file + ": " + e.what();
+                // The AO map's write may have been queued before the bake failed
+                try {
+                    readback.flush();
+                } catch (const std::exception &) {
+                }
+            }
+            reply.bake_ms = std::chrono::duration<double, std::milli>(
+                                std::chrono::steady_clock::now() - bake_start)
+                                .count();
+        }
+        // The scene is released before the loaders are let in, so they see its memory freed
+        job.bake_scene = BakeScene();
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.baking = false;
+        }
+        queue.cv.notify_all();
+
+        ++served;
+        if (!reply.ok) {
+            ++failed;
+            std::cout << "Error: " << reply.error << "\n";
+        }
+        if (!job.connection->write_message(encode_bake_reply(reply))) {
+            std::cout << "Warning: The client of job " << served
+                      << " disconnected before its reply\n";
+        }
+        std::cout << "Served " << served << " jobs, " << failed << " failed\n";
+    }
+}
+
+void run_server_loader(ServerQueue &queue, ID3D12Device5 *device)
+{
+    if (trace_enabled()) {
+        trace_set_thread_name("Server Loader");
+    }
+    dxr::CommandContext cmd_ctx(device);
+    dxr::GpuProfiler profiler(
+        device, cmd_ctx.queue.Get(), gpu_profiler_regions, 3, "Server Loader Queue");
+    while (true) {
+        ServerJob job;
+        {
+            std::unique_lock<std::mutex> lock(queue.mutex);
+            auto admit = [&]() {
+                const size_t held =
+                    queue.loading + queue.loaded.size() + (queue.baking ? 1 : 0);
+                if (queue.pending.empty() || held >= queue.max_jobs) {
+                    return false;
+                }
+                // A job is admitted over budget if the server holds no others, so the
+                // server can't stall on memory used outside of it
+                return held == 0 || dxr::video_memory_usage(device) < queue.vram_budget;
+            };
+            // The bake's memory is freed as it finishes, but the rest of the device's usage
+            // changes without notifying the queue so it's polled
+            while (!queue.cv.wait_for(
+                lock, std::chrono::milliseconds(server_vram_poll_ms), admit)) {
+            }
+            job = std::move(queue.pending.front());
+            queue.pending.pop_front();
+            ++queue.loading;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        job.queue_ms = std::chrono::duration<double, std::milli>(start - job.received).count();
+        // A job failing to load is replied to with the error, the server carries on
+        try {
+            const AppOptions &options = job.options;
+            job.bake_scene =
+                load_bake_scene(options.scene_file,
+                                options.scene_load,
+                                options.atlas_options,
+                                resolve_bvh_profile(options.bvh_profile, options.n_samples),
+                                device,
+                                cmd_ctx,
+                                nullptr,
+                                profiler,
+                                nullptr);
+            resolve_gpu_profile(cmd_ctx, profiler);
+        } catch (const std::exception &e) {
+            job.error = e.what();
+        }
+        job.load_ms =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                .count();
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            --queue.loading;
+            queue.loaded.push_back(std::move(job));
+        }
+        queue.cv.notify_all();
+    }
+}
+
+AppOptions bake_request_options(const AppOptions &server_options, const BakeRequest &request)
+{
+    AppOptions options = server_options;
+    options.scene_file = request.scene_file;
+    canonicalize_path(options.scene_file);
+    options.bake_output = request.bake_output;
+    options.bent_normal_output = request.bent_normal_output;
+    options.hit_distance_output = request.hit_distance_output;
+    options.direct_light_output = request.direct_light_output;
+    if (request.n_samples >= 0) {
+        options.n_samples = std::max(request.n_samples, 1);
+    }
+    if (request.samples_per_frame >= 0) {
+        options.samples_per_frame = request.samples_per_frame;
+    }
+    if (request.ao_length >= 0.f) {
+        options.ao_length = request.ao_length;
+    }
+    if (!request.sampler.empty()) {
+        auto fnd = std::find(sampler_names.begin(), sampler_names.end(), request.sampler);
+        if (fnd == sampler_names.end()) {
+            throw std::runtime_error("Unrecognized sampler " + request.sampler);
+        }
+        options.sampler_type = std::distance(sampler_names.begin(), fnd);
+    }
+    if (request.sampler_seed >= 0) {
+        options.sampler_seed = uint32_t(request.sampler_seed);
+    }
+    if (!request.ao_format.empty()) {
+        auto fnd =
+            std::find(ao_format_names.begin(), ao_format_names.end(), request.ao_format);
+        if (fnd == ao_format_names.end()) {
+            throw std::runtime_error("Unrecognized AO format " + request.ao_format);
+        }
+        options.ao_format = ao_formats[std::distance(ao_format_names.begin(), fnd)];
+        options.compress_ao = request.ao_format == "bc4";
+    }
+    if (request.gutter >= 0) {
+        options.gutter = std::min(uint32_t(request.gutter), max_gutter);
+    }
+
+    if (requested_bake_outputs(options) != 0 && (options.wavefront || options.adaptive)) {
+        throw std::runtime_error("The extra maps are only supported by the raster and "
+                                 "compute bakes");
+    }
+    if (!options.direct_light_output.empty()) {
+        const std::string ext = get_file_extension(options.direct_light_output);
+        if (options.compute_bake) {
+            throw std::runtime_error("The direct lighting is only supported by the raster "
+                                     "bake");
+        }
+        if (ext != "png" && ext != "hdr" && ext != "exr") {
+            throw std::runtime_error("The direct lighting must be written to a .png, .hdr "
+                                     "or .exr file");
+        }
+    }
+    return options;
+}
+
+bool submit_bake(const AppOptions &options)
+{
+    const AppOptions defaults = AppOptions();
+    BakeRequest request;
+    request.scene_file = options.scene_file;
+    request.bake_output = options.bake_output;
+    request.bent_normal_output = options.bent_normal_output;
+    request.hit_distance_output = options.hit_distance_output;
+    request.direct_light_output = options.direct_light_output;
+    // The settings left at their defaults keep the server's
+    if (options.n_samples != defaults.n_samples) {
+        request.n_samples = options.n_samples;
+    }
+    if (options.samples_per_frame != defaults.samples_per_frame) {
+        request.samples_per_frame = options.samples_per_frame;
+    }
+    if (options.ao_length != defaults.ao_length) {
+        request.ao_length = options.ao_length;
+    }
+    if (options.sampler_type != defaults.sampler_type) {
+        request.sampler = sampler_names[options.sampler_type];
+    }
+    if (options.sampler_seed != defaults.sampler_seed) {
+        request.sampler_seed = options.sampler_seed;
+    }
+    if (options.compress_ao) {
+        request.ao_format = "bc4";
+    } else if (options.ao_format != defaults.ao_format) {
+        const size_t format =
+            std::find(ao_formats.begin(), ao_formats.end(), options.ao_format) -
+            ao_formats.begin();
+        request.ao_format = ao_format_names[format];
+    }
+    if (options.gutter != defaults.gutter) {
+        request.gutter = options.gutter;
+    }
+    make_request_paths_absolute(request);
+
+    std::unique_ptr<BakeConnection> connection =
+        connect_bake_server(options.submit_pipe, server_connect_timeout_ms);
+    if (!connection) {
+        std::cout << "Error: No bake server is serving " << options.submit_pipe << "\n";
+        return false;
+    }
+    std::string message;
+    if (!connection->write_message(encode_bake_request(request)) ||
+        !connection->read_message(message)) {
+        std::cout << "Error: Lost the connection to the bake server\n";
+        return false;
+    }
+    const BakeReply reply = decode_bake_reply(message);
+    if (!reply.ok) {
+        std::cout << "Error: The bake server failed the bake: " << reply.error << "\n";
+        return false;
+    }
+    std::cout << "Baked " << reply.atlas_size.x << "x" << reply.atlas_size.y << " atlas, "
+              << pretty_print_count(reply.rays) << " rays in " << reply.gpu_ms
+              << "ms GPU time (queued " << reply.queue_ms << "ms, loaded in " << reply.load_ms
+              << "ms, baked in " << reply.bake_ms << "ms)\n";
+    for (const auto &f : reply.outputs) {
+        std::cout << "Map written to " << f << "\n";
+    }
+    return true;
+}
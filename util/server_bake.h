@@ -0,0 +1,65 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "ao_bake.h"
+#include "bake_server.h"
+
+/* A job sent to the bake server, with the connection its reply is written to. The job's
+ * options are the server's with the request's outputs and settings
+ */
+struct ServerJob {
+    BakeRequest request;
+    AppOptions options;
+    std::unique_ptr<BakeConnection> connection;
+    std::chrono::steady_clock::time_point received;
+    BakeScene bake_scene;
+    double queue_ms = 0.0;
+    double load_ms = 0.0;
+    // Set if the scene failed to load, it's replied to without baking
+    std::string error;
+};
+
+/* The jobs received by the bake server and those loaded for the bake. A loader only takes
+ * the next job while fewer than max_jobs jobs are loading, loaded or baking and the
+ * device's video memory usage is below the budget, bounding the scenes held at once
+ */
+struct ServerQueue {
+    size_t max_jobs = 0;
+    uint64_t vram_budget = 0;
+
+    // The queue state below is guarded by the mutex
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<ServerJob> pending;
+    std::deque<ServerJob> loaded;
+    size_t loading = 0;
+    bool baking = false;
+};
+
+/* Serve the headless bakes sent to the local pipe named by the scene file until the
+ * process is stopped. The device, pipeline cache, headless pipelines, upload rings and
+ * readback are created once and kept warm across the jobs. The jobs are loaded on up to
+ * server_jobs loader threads while the GPU bakes one job at a time, and each job gets its
+ * reply with its output files and stats once its maps are written
+ */
+void run_bake_server(const AppOptions &options);
+
+/* Load the server's jobs on the calling thread, with its own command context and profiler,
+ * as they're admitted by the queue's job count and video memory budget
+ */
+void run_server_loader(ServerQueue &queue, ID3D12Device5 *device);
+
+/* The options of the server's job: the server's options with the request's outputs and the
+ * bake settings it sets. Throws if a setting is invalid
+ */
+AppOptions bake_request_options(const AppOptions &server_options, const BakeRequest &request);
+
+/* Send the headless bake to the bake server set in the options and print its reply,
+ * returns false if the server couldn't be reached or the bake failed
+ */
+bool submit_bake(const AppOptions &options);
@@ -0,0 +1,261 @@
+#include "thread_pool.h"
+#include <algorithm>
+#include <string>
+#include "trace.h"
+
+namespace {
+
+// The pool and queue of the worker running on this thread, if it's one of a pool's workers
+thread_local ThreadPool *worker_pool = nullptr;
+thread_local size_t worker_queue = 0;
+
+uint32_t shared_thread_count = 0;
+
+}
+
+struct ThreadPool::TaskState {
+    std::function<void()> fn;
+    // The unfinished dependencies, plus one held while the task is submitted
+    std::atomic<size_t> pending;
+    std::atomic<bool> done;
+    std::mutex mutex;
+    std::vector<Task> successors;
+    std::exception_ptr error;
+
+    TaskState() : pending(1), done(false) {}
+};
+
+ThreadPool::ThreadPool(uint32_t n_threads) : queued(0), next_queue(0), shutdown(false)
+{
+    n_threads = std::max(n_threads, 1u);
+    for (uint32_t i = 0; i < n_threads; ++i) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    // The waiting thread runs tasks too, so one fewer worker is started
+    for (uint32_t i = 0; i + 1 < n_threads; ++i) {
+        workers.emplace_back([this, i]() { worker_loop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        shutdown = true;
+    }
+    wake.notify_all();
+    for (auto &w : workers) {
+        w.join();
+    }
+}
+
+uint32_t ThreadPool::num_threads() const
+{
+    return queues.size();
+}
+
+ThreadPool::Task ThreadPool::submit(std::function<void()> fn, const std::vector<Task> &deps)
+{
+    Task task = std::make_shared<TaskState>();
+    task->fn = std::move(fn);
+    for (const auto &d : deps) {
+        std::lock_guard<std::mutex> lock(d->mutex);
+        if (!d->done) {
+            ++task->pending;
+            d->successors.push_back(task);
+        } else if (d->error) {
+            std::lock_guard<std::mutex> task_lock(task->mutex);
+            if (!task->error) {
+                task->error = d->error;
+            }
+        }
+    }
+    if (--task->pending == 0) {
+        enqueue(task);
+    }
+    return task;
+}
+
+void ThreadPool::wait(const Task &task)
+{
+    while (!task->done) {
+        const size_t queue = worker_pool == this ? worker_queue : 0;
+        Task t = try_pop(queue);
+        if (t) {
+            run(t);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wake.wait(lock, [&]() { return task->done || queued > 0; });
+    }
+    std::lock_guard<std::mutex> lock(task->mutex);
+    if (task->error) {
+        std::rethrow_exception(task->error);
+    }
+}
+
+void ThreadPool::parallel_for(size_t n,
+                              size_t grain,
+                              const std::function<void(size_t, size_t)> &fn)
+{
+    grain = std::max(grain, size_t(1));
+    const size_t n_ranges = (n + grain - 1) / grain;
+    if (n_ranges <= 1 || num_threads() == 1) {
+        for (size_t begin = 0; begin < n; begin += grain) {
+            fn(begin, std::min(begin + grain, n));
+        }
+        return;
+    }
+
+    std::atomic<bool> failed(false);
+    std::vector<Task> tasks;
+    tasks.reserve(n_ranges);
+    for (size_t r = 0; r < n_ranges; ++r) {
+        tasks.push_back(submit([&, r]() {
+            if (failed) {
+                return;
+            }
+            try {
+                fn(r * grain, std::min((r + 1) * grain, n));
+            } catch (...) {
+                failed = true;
+                throw;
+            }
+        }));
+    }
+    // The ranges reference the locals, so all are waited on before rethrowing
+    std::exception_ptr error;
+    for (const auto &t : tasks) {
+        try {
+            wait(t);
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void ThreadPool::enqueue(const Task &task)
+{
+    const size_t queue =
+        worker_pool == this ? worker_queue : next_queue++ % queues.size();
+    {
+        std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+        queues[queue]->tasks.push_back(task);
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        ++queued;
+    }
+    wake.notify_all();
+}
+
+ThreadPool::Task ThreadPool::try_pop(size_t queue)
+{
+    if (queued == 0) {
+        return nullptr;
+    }
+    {
+        Queue &q = *queues[queue];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (!q.tasks.empty()) {
+            Task task = q.tasks.back();
+            q.tasks.pop_back();
+            --queued;
+            return task;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); ++i) {
+        Queue &q = *queues[(queue + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (!q.tasks.empty()) {
+            Task task = q.tasks.front();
+            q.tasks.pop_front();
+            --queued;
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+void ThreadPool::run(const Task &task)
+{
+    bool skip = false;
+    {
+        std::lock_guard<std::mutex> lock(task->mutex);
+        skip = task->error != nullptr;
+    }
+    if (!skip) {
+        try {
+            task->fn();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(task->mutex);
+            task->error = std::current_exception();
+        }
+    }
+    task->fn = nullptr;
+
+    std::vector<Task> successors;
+    std::exception_ptr error;
+    {
+        std::lock_guard<std::mutex> lock(task->mutex);
+        task->done = true;
+        successors.swap(task->successors);
+        error = task->error;
+    }
+    for (const auto &s : successors) {
+        if (error) {
+            std::lock_guard<std::mutex> lock(s->mutex);
+            if (!s->error) {
+                s->error = error;
+            }
+        }
+        if (--s->pending == 0) {
+            enqueue(s);
+        }
+    }
+    // Wake the threads waiting on the task
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+    }
+    wake.notify_all();
+}
+
+void ThreadPool::worker_loop(size_t queue)
+{
+    worker_pool = this;
+    worker_queue = queue;
+    bool named = false;
+    while (true) {
+        Task task = try_pop(queue);
+        if (task) {
+            if (!named && trace_enabled()) {
+                trace_set_thread_name("Worker " + std::to_string(queue));
+                named = true;
+            }
+            run(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wake.wait(lock, [&]() { return shutdown || queued > 0; });
+        if (shutdown) {
+            return;
+        }
+    }
+}
+
+void set_thread_count(uint32_t n_threads)
+{
+    shared_thread_count = n_threads;
+}
+
+ThreadPool &thread_pool()
+{
+    static ThreadPool pool(shared_thread_count > 0 ? shared_thread_count
+                                                   : std::thread::hardware_concurrency());
+    return pool;
+}
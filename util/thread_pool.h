@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* The work-stealing task scheduler shared by the loaders, mesh processing and exporters, so
+ * the stages don't each spin up threads of their own. Each worker pops tasks from the back
+ * of its own deque and steals from the front of the others' once it runs out. Tasks
+ * submitted from a worker go on its deque, others are spread over the deques in turn.
+ * Threads waiting on a task run queued tasks meanwhile, so tasks can submit and wait on
+ * nested work without deadlocking the pool
+ */
+class ThreadPool {
+public:
+    struct TaskState;
+    using Task = std::shared_ptr<TaskState>;
+
+    // Create the pool running tasks on n_threads threads, including the waiting thread
+    explicit ThreadPool(uint32_t n_threads);
+
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    uint32_t num_threads() const;
+
+    /* Queue the task to run once all of its dependencies have finished. If a dependency
+     * threw, the task is skipped and waiting on it rethrows the dependency's exception
+     */
+    Task submit(std::function<void()> fn, const std::vector<Task> &deps = {});
+
+    // Wait for the task to finish, running queued tasks meanwhile, rethrowing its exception
+    void wait(const Task &task);
+
+    /* Run fn over the ranges [begin, end) of up to grain items splitting [0, n) across the
+     * pool, returning once all have run. After a range throws the ranges not yet started
+     * are skipped, and the first exception is rethrown
+     */
+    void parallel_for(size_t n, size_t grain, const std::function<void(size_t, size_t)> &fn);
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> queued;
+    std::atomic<size_t> next_queue;
+    std::atomic<bool> shutdown;
+    // Idle workers and waiters sleep until a task is queued or finishes
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+
+    void enqueue(const Task &task);
+
+    // Pop a task from the queue's back, or steal one from the front of another queue
+    Task try_pop(size_t queue);
+
+    void run(const Task &task);
+
+    void worker_loop(size_t queue);
+};
+
+/* Set the number of threads of the shared pool, 0 to use one per hardware thread. Must be
+ * called before the pool is first used
+ */
+void set_thread_count(uint32_t n_threads);
+
+// The shared pool, created with the thread count on first use
+ThreadPool &thread_pool();
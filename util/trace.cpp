@@ -0,0 +1,183 @@
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "json.hpp"
+
+namespace {
+
+struct TraceEvent {
+    const char *name;
+    double start_us;
+    double end_us;
+};
+
+struct ThreadTrace {
+    uint32_t id = 0;
+    std::string name;
+    std::vector<TraceEvent> events;
+};
+
+struct TrackEvent {
+    uint32_t track;
+    std::string name;
+    double start_us;
+    double end_us;
+};
+
+std::atomic<bool> enabled(false);
+std::chrono::steady_clock::time_point origin;
+
+// Guards the lists of threads and tracks, each thread's events are only touched by it
+std::mutex trace_mutex;
+// The thread_local buffers are shared with the list so their events outlive the threads
+std::vector<std::shared_ptr<ThreadTrace>> threads;
+std::vector<std::string> track_names;
+std::vector<TrackEvent> track_events;
+
+ThreadTrace &thread_trace()
+{
+    thread_local std::shared_ptr<ThreadTrace> trace;
+    if (!trace) {
+        trace = std::make_shared<ThreadTrace>();
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        trace->id = threads.size() + 1;
+        threads.push_back(trace);
+    }
+    return *trace;
+}
+
+}
+
+void trace_enable()
+{
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    if (!enabled) {
+        origin = std::chrono::steady_clock::now();
+        enabled = true;
+    }
+}
+
+bool trace_enabled()
+{
+    return enabled;
+}
+
+double trace_now_us()
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() -
+                                                     origin)
+        .count();
+}
+
+void trace_set_thread_name(const std::string &name)
+{
+    thread_trace().name = name;
+}
+
+void trace_record(const char *name, double start_us, double end_us)
+{
+    thread_trace().events.push_back(TraceEvent{name, start_us, end_us});
+}
+
+uint32_t trace_add_track(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    track_names.push_back(name);
+    return track_names.size() - 1;
+}
+
+void trace_record_track(uint32_t track,
+                        const std::string &name,
+                        double start_us,
+                        double end_us)
+{
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    track_events.push_back(TrackEvent{track, name, start_us, end_us});
+}
+
+bool write_trace(const std::string &fname)
+{
+    using json = nlohmann::json;
+    // The threads are listed under one process and the other tracks under a second
+    const auto metadata = [](const char *type,
+                             int pid,
+                             uint32_t tid,
+                             const std::string &name) {
+        json m;
+        m["name"] = type;
+        m["ph"] = "M";
+        m["pid"] = pid;
+        m["tid"] = tid;
+        m["args"]["name"] = name;
+        return m;
+    };
+    const auto complete_event = [](const std::string &name,
+                                   const char *category,
+                                   int pid,
+                                   uint32_t tid,
+                                   double start_us,
+                                   double end_us) {
+        json e;
+        e["name"] = name;
+        e["cat"] = category;
+        e["ph"] = "X";
+        e["pid"] = pid;
+        e["tid"] = tid;
+        e["ts"] = start_us;
+        e["dur"] = std::max(end_us - start_us, 0.0);
+        return e;
+    };
+
+    json events = json::array();
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    events.push_back(metadata("process_name", 1, 0, "CPU"));
+    for (const auto &t : threads) {
+        const std::string name = t->name.empty() ? "Thread " + std::to_string(t->id) : t->name;
+        events.push_back(metadata("thread_name", 1, t->id, name));
+        for (const auto &e : t->events) {
+            events.push_back(complete_event(e.name, "cpu", 1, t->id, e.start_us, e.end_us));
+        }
+    }
+    if (!track_names.empty()) {
+        events.push_back(metadata("process_name", 2, 0, "GPU"));
+    }
+    for (size_t i = 0; i < track_names.size(); ++i) {
+        events.push_back(metadata("thread_name", 2, i, track_names[i]));
+    }
+    for (const auto &e : track_events) {
+        events.push_back(complete_event(e.name, "gpu", 2, e.track, e.start_us, e.end_us));
+    }
+
+    json trace;
+    trace["traceEvents"] = events;
+    trace["displayTimeUnit"] = "ms";
+
+    std::ofstream fout(fname.c_str());
+    if (!fout) {
+        std::cout << "Error: Failed to write trace to " << fname << "\n";
+        return false;
+    }
+    fout << trace.dump() << "\n";
+    std::cout << "Wrote trace with " << events.size() << " events to " << fname << "\n";
+    return true;
+}
+
+TraceScope::TraceScope(const char *name) : name(trace_enabled() ? name : nullptr), start_us(0)
+{
+    if (this->name) {
+        start_us = trace_now_us();
+    }
+}
+
+TraceScope::~TraceScope()
+{
+    if (name) {
+        trace_record(name, start_us, trace_now_us());
+    }
+}
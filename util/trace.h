@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+/* CPU trace instrumentation written out in the Chrome trace event format, which
+ * chrome://tracing and Perfetto open. Each thread records its scopes into a buffer of its
+ * own without locking, so the scopes can be placed in the loader threads' tasks. Nothing
+ * is recorded until trace_enable is called, and the TRACE_SCOPE macro compiles to nothing
+ * unless DXR_AO_TRACE is defined. Tracks for other timelines, like the GPU profiler's
+ * regions, can be added to the same trace
+ */
+
+// Start recording the trace, times are measured from the first call
+void trace_enable();
+bool trace_enabled();
+
+// Microseconds since the trace was enabled
+double trace_now_us();
+
+// Name the calling thread's track in the trace
+void trace_set_thread_name(const std::string &name);
+
+// Record a scope on the calling thread's track. name must outlive the trace
+void trace_record(const char *name, double start_us, double end_us);
+
+// Add a track for a timeline recorded outside the CPU threads, returning its id
+uint32_t trace_add_track(const std::string &name);
+
+// Record an event on a track added with trace_add_track, from any thread
+void trace_record_track(uint32_t track,
+                        const std::string &name,
+                        double start_us,
+                        double end_us);
+
+/* Write the events recorded so far to a Chrome trace JSON file. The threads which recorded
+ * scopes must not be recording while the trace is written. Returns false if the file
+ * couldn't be written
+ */
+bool write_trace(const std::string &fname);
+
+class TraceScope {
+    const char *name;
+    double start_us;
+
+public:
+    TraceScope(const char *name);
+    ~TraceScope();
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+};
+
+#define TRACE_CONCAT_IMPL(A, B) A##B
+#define TRACE_CONCAT(A, B) TRACE_CONCAT_IMPL(A, B)
+
+#ifdef DXR_AO_TRACE
+#define TRACE_SCOPE(NAME) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(NAME)
+#else
+#define TRACE_SCOPE(NAME)
+#endif
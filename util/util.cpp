@@ -5,6 +5,7 @@
 #else
 #include <cpuid.h>
 #endif
+#include "thread_pool.h"
 #include "util.h"
 #include <glm/ext.hpp>
 
@@ -35,6 +36,20 @@ std::string pretty_print_count(const double count)
     return std::to_string(count);
 }
 
+uint32_t loader_thread_count()
+{
+    return thread_pool().num_threads();
+}
+
+void parallel_tasks(size_t n, const std::function<void(size_t)> &task)
+{
+    thread_pool().parallel_for(n, 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            task(i);
+        }
+    });
+}
+
 uint64_t align_to(uint64_t val, uint64_t align)
 {
     return ((val + align - 1) / align) * align;
@@ -1,11 +1,51 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
 #include <string>
+#include <vector>
 #include <glm/glm.hpp>
 
+// 64-bit FNV-1a
+struct Hasher {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    void add(const void *data, size_t nbytes)
+    {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        for (size_t i = 0; i < nbytes; ++i) {
+            h = (h ^ bytes[i]) * 0x100000001b3ULL;
+        }
+    }
+
+    template <typename T>
+    void add(const T &v)
+    {
+        add(&v, sizeof(T));
+    }
+
+    template <typename T>
+    void add(const std::vector<T> &v)
+    {
+        add(v.size());
+        if (!v.empty()) {
+            add(v.data(), v.size() * sizeof(T));
+        }
+    }
+};
+
 // Format the count as #G, #M, #K, depending on its magnitude
 std::string pretty_print_count(const double count);
 
+// The number of threads the scene loading and mesh processing tasks are run on, those of
+// the shared thread pool
+uint32_t loader_thread_count();
+
+/* Run the tasks 0..n-1 on the shared thread pool, returning once all have run. The first
+ * exception thrown by a task is rethrown once the tasks already started are done
+ */
+void parallel_tasks(size_t n, const std::function<void(size_t)> &task);
+
 uint64_t align_to(uint64_t val, uint64_t align);
 
 void ortho_basis(glm::vec3 &v_x, glm::vec3 &v_y, const glm::vec3 &n);
@@ -0,0 +1,145 @@
+#include "vertex_ao_gltf.h"
+#include <cstring>
+#include <iostream>
+#include "json.hpp"
+#include "tiny_gltf.h"
+#include "util.h"
+#include <glm/glm.hpp>
+
+namespace {
+
+// Append the data to the buffer as a new buffer view, aligned to 4 bytes
+int add_buffer_view(tinygltf::Model &model, const void *data, size_t nbytes, int target)
+{
+    std::vector<unsigned char> &buf = model.buffers[0].data;
+    buf.resize(align_to(buf.size(), 4));
+
+    tinygltf::BufferView view;
+    view.buffer = 0;
+    view.byteOffset = buf.size();
+    view.byteLength = nbytes;
+    view.target = target;
+    buf.resize(buf.size() + nbytes);
+    if (nbytes > 0) {
+        std::memcpy(buf.data() + view.byteOffset, data, nbytes);
+    }
+    model.bufferViews.push_back(view);
+    return model.bufferViews.size() - 1;
+}
+
+int add_accessor(tinygltf::Model &model,
+                 const void *data,
+                 size_t count,
+                 int type,
+                 size_t element_size,
+                 int component_type,
+                 int target)
+{
+    tinygltf::Accessor accessor;
+    accessor.bufferView = add_buffer_view(model, data, count * element_size, target);
+    accessor.componentType = component_type;
+    accessor.count = count;
+    accessor.type = type;
+    model.accessors.push_back(accessor);
+    return model.accessors.size() - 1;
+}
+
+}
+
+bool write_vertex_ao_gltf(const std::string &fname, const Scene &scene, const VertexAO &ao)
+{
+    tinygltf::Model model;
+    model.asset.version = "2.0";
+    model.asset.generator = "dxr-ao-bake";
+    model.buffers.resize(1);
+
+    for (size_t i = 0; i < scene.meshes.size(); ++i) {
+        tinygltf::Mesh mesh;
+        const auto &geometries = scene.meshes[i].geometries;
+        for (size_t j = 0; j < geometries.size(); ++j) {
+            const Geometry &geom = geometries[j];
+            const ArrayView<glm::vec3> vertices = geom.vertex_data();
+            const ArrayView<glm::vec3> normals = geom.normal_data();
+            const ArrayView<glm::vec2> uvs = geom.uv_data();
+            const ArrayView<glm::uvec3> indices = geom.index_data();
+            const std::vector<float> &vertex_ao = ao[i][j];
+
+            tinygltf::Primitive prim;
+            prim.mode = TINYGLTF_MODE_TRIANGLES;
+            const int position = add_accessor(model,
+                                              vertices.data(),
+                                              vertices.size(),
+                                              TINYGLTF_TYPE_VEC3,
+                                              sizeof(glm::vec3),
+                                              TINYGLTF_COMPONENT_TYPE_FLOAT,
+                                              TINYGLTF_TARGET_ARRAY_BUFFER);
+            // The position accessor must have its bounds
+            glm::vec3 lower(1e20f);
+            glm::vec3 upper(-1e20f);
+            for (const auto &v : vertices) {
+                lower = glm::min(lower, v);
+                upper = glm::max(upper, v);
+            }
+            model.accessors[position].minValues = {lower.x, lower.y, lower.z};
+            model.accessors[position].maxValues = {upper.x, upper.y, upper.z};
+            prim.attributes["POSITION"] = position;
+            prim.attributes["NORMAL"] = add_accessor(model,
+                                                     normals.data(),
+                                                     normals.size(),
+                                                     TINYGLTF_TYPE_VEC3,
+                                                     sizeof(glm::vec3),
+                                                     TINYGLTF_COMPONENT_TYPE_FLOAT,
+                                                     TINYGLTF_TARGET_ARRAY_BUFFER);
+            if (uvs.size() == vertices.size()) {
+                prim.attributes["TEXCOORD_0"] = add_accessor(model,
+                                                             uvs.data(),
+                                                             uvs.size(),
+                                                             TINYGLTF_TYPE_VEC2,
+                                                             sizeof(glm::vec2),
+                                                             TINYGLTF_COMPONENT_TYPE_FLOAT,
+                                                             TINYGLTF_TARGET_ARRAY_BUFFER);
+            }
+            std::vector<glm::vec3> colors(vertices.size(), glm::vec3(1.f));
+            for (size_t k = 0; k < colors.size() && k < vertex_ao.size(); ++k) {
+                colors[k] = glm::vec3(vertex_ao[k]);
+            }
+            prim.attributes["COLOR_0"] = add_accessor(model,
+                                                      colors.data(),
+                                                      colors.size(),
+                                                      TINYGLTF_TYPE_VEC3,
+                                                      sizeof(glm::vec3),
+                                                      TINYGLTF_COMPONENT_TYPE_FLOAT,
+                                                      TINYGLTF_TARGET_ARRAY_BUFFER);
+            prim.indices = add_accessor(model,
+                                        indices.data(),
+                                        indices.size() * 3,
+                                        TINYGLTF_TYPE_SCALAR,
+                                        sizeof(uint32_t),
+                                        TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT,
+                                        TINYGLTF_TARGET_ELEMENT_ARRAY_BUFFER);
+            mesh.primitives.push_back(prim);
+        }
+        model.meshes.push_back(mesh);
+    }
+
+    tinygltf::Scene gltf_scene;
+    for (const auto &inst : scene.instances) {
+        tinygltf::Node node;
+        node.mesh = inst.mesh_id;
+        const float *m = &inst.transform[0][0];
+        node.matrix = std::vector<double>(m, m + 16);
+        gltf_scene.nodes.push_back(model.nodes.size());
+        model.nodes.push_back(node);
+    }
+    model.scenes.push_back(gltf_scene);
+    model.defaultScene = 0;
+
+    const bool binary = get_file_extension(fname) == "glb";
+    tinygltf::TinyGLTF context;
+    if (!context.WriteGltfSceneToFile(&model, fname, false, binary, true, binary)) {
+        std::cout << "Failed to write vertex AO to " << fname << "\n";
+        return false;
+    }
+    std::cout << "Vertex AO written to " << fname << "\n";
+    return true;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "scene.h"
+
+/* The baked AO of each vertex of each geometry of each mesh of the scene, indexed as
+ * [mesh][geometry][vertex]
+ */
+using VertexAO = std::vector<std::vector<std::vector<float>>>;
+
+/* Write the scene's meshes and instances to a glTF file with the vertex AO as the COLOR_0
+ * of each primitive, a float RGB grey. Each geometry is written as a primitive with its
+ * positions, normals, uvs if it has them and indices, and each instance as a node. The
+ * materials and textures aren't written. Files ending in .glb are written as binary glTF,
+ * others as .gltf with the buffer in a .bin file alongside. Returns false if the file
+ * couldn't be written
+ */
+bool write_vertex_ao_gltf(const std::string &fname, const Scene &scene, const VertexAO &ao);
@@ -0,0 +1,63 @@
+#include "util.hlsl"
+#include "sampler.hlsl"
+#include "trace_ao.hlsl"
+
+// Bakes the AO of mesh vertices instead of atlas texels, tracing the AO rays about each
+// vertex's normal from its world space position. The vertices are baked in chunks, each
+// dispatch takes a frame of samples for the chunk's vertices like the atlas bakes
+
+// A vertex's world space position and normal, matches VertexSample in main.cpp
+struct VertexSample {
+    float3 position;
+    float3 normal;
+};
+
+RaytracingAccelerationStructure scene : register(t0);
+StructuredBuffer<VertexSample> vertices : register(t1);
+
+// Running sum of the unoccluded samples (x) and total samples (y) taken for each vertex
+RWStructuredBuffer<float2> accum_buffer : register(u0);
+
+cbuffer VertexAOInfo : register(b0) {
+    uint num_vertices;
+    // The index of the chunk's first vertex among all baked vertices, which seeds each
+    // vertex's samples so they don't depend on the chunking
+    uint first_vertex;
+    int n_samples;
+    int samples_per_frame;
+    float ao_length;
+    // The ray origins are offset along the normal, as the rays start on the triangles
+    // sharing the vertex rather than within one
+    float ray_offset;
+    // The accumulation is reset when frame_id is 0
+    uint frame_id;
+    uint sampler_type;
+    uint sampler_seed;
+}
+
+[numthreads(64, 1, 1)]
+void csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    if (thread_id.x >= num_vertices) {
+        return;
+    }
+    const VertexSample v = vertices[thread_id.x];
+    float2 accum = frame_id == 0 ? float2(0.f, 0.f) : accum_buffer[thread_id.x];
+    const int batch_samples = min(samples_per_frame, max(n_samples - int(accum.y), 0));
+
+    // Vertices without a normal have no hemisphere to sample, so count as unoccluded
+    float n_occluded = 0.f;
+    if (dot(v.normal, v.normal) > 0.f) {
+        SampleGenerator sg = make_sample_generator(sampler_type,
+                                                   first_vertex + thread_id.x,
+                                                   uint(accum.y),
+                                                   frame_id,
+                                                   sampler_seed,
+                                                   float2(0.f, 0.f));
+        const float3 n = normalize(v.normal);
+        n_occluded = trace_ao_rays(
+            scene, v.position + n * ray_offset, n, ao_length, 0.f, batch_samples, sg);
+    }
+    accum += float2(batch_samples - n_occluded, batch_samples);
+    accum_buffer[thread_id.x] = accum;
+}
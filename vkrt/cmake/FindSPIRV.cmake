@@ -0,0 +1,52 @@
+# Find dxc with SPIR-V code generation, the Vulkan SDK's build includes it
+find_program(SPIRV_SHADER_COMPILER NAMES dxc
+	HINTS $ENV{VULKAN_SDK}/bin)
+
+# Compile an HLSL shader to SPIR-V and embed it in a header, like add_dxil_embed_library
+# in FindD3D12.cmake. The header is named <lib>_embedded_spv.h and the array <lib>_spv.
+# The first shader in the list should be the main shader, while others contain
+# dependencies. The include paths and defines should not have the -I or -D prefix
+function(add_spirv_embed_library)
+	set(options INCLUDE_DIRECTORIES COMPILE_DEFINITIONS COMPILE_OPTIONS)
+	cmake_parse_arguments(PARSE_ARGV 1 SPIRV "" "" "${options}")
+
+	set(HLSL_INCLUDE_DIRS "")
+	foreach (inc ${SPIRV_INCLUDE_DIRECTORIES})
+		file(TO_NATIVE_PATH "${inc}" native_path)
+		list(APPEND HLSL_INCLUDE_DIRS "-I${native_path}")
+	endforeach()
+
+	set(HLSL_COMPILE_DEFNS "")
+	foreach (def ${SPIRV_COMPILE_DEFINITIONS})
+		list(APPEND HLSL_COMPILE_DEFNS "-D${def}")
+	endforeach()
+
+	set(SPIRV_LIB ${ARGV0})
+	set(HLSL_SRCS "")
+	foreach (shader ${SPIRV_UNPARSED_ARGUMENTS})
+		list(APPEND HLSL_SRCS "${CMAKE_CURRENT_LIST_DIR}/${shader}")
+	endforeach()
+	list(GET SPIRV_UNPARSED_ARGUMENTS 0 MAIN_SHADER)
+
+	set(SPIRV_EMBED_FILE "${CMAKE_CURRENT_BINARY_DIR}/${SPIRV_LIB}_embedded_spv.h")
+	add_custom_command(OUTPUT ${SPIRV_EMBED_FILE}
+		COMMAND ${SPIRV_SHADER_COMPILER} ${CMAKE_CURRENT_LIST_DIR}/${MAIN_SHADER}
+		-spirv -fspv-target-env=vulkan1.3
+		-Fh ${SPIRV_EMBED_FILE} -Vn ${SPIRV_LIB}_spv
+		${HLSL_INCLUDE_DIRS} ${HLSL_COMPILE_DEFNS} ${SPIRV_COMPILE_OPTIONS}
+		DEPENDS ${HLSL_SRCS}
+		COMMENT "Compiling and embedding ${MAIN_SHADER} into ${SPIRV_EMBED_FILE}")
+
+	set(SPIRV_CMAKE_CUSTOM_WRAPPER ${SPIRV_LIB}_custom_target)
+	add_custom_target(${SPIRV_CMAKE_CUSTOM_WRAPPER} ALL DEPENDS ${SPIRV_EMBED_FILE})
+
+	add_library(${SPIRV_LIB} INTERFACE)
+	add_dependencies(${SPIRV_LIB} ${SPIRV_CMAKE_CUSTOM_WRAPPER})
+	target_include_directories(${SPIRV_LIB} INTERFACE
+		$<BUILD_INTERFACE:${CMAKE_CURRENT_BINARY_DIR}>)
+endfunction()
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(SPIRV DEFAULT_MSG SPIRV_SHADER_COMPILER)
+
+mark_as_advanced(SPIRV_SHADER_COMPILER)
@@ -0,0 +1,374 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <SDL.h>
+#include "atlas.h"
+#include "image_export.h"
+#include "imgui.h"
+#include "scene.h"
+#include "trace.h"
+#include "util.h"
+#include "util/display/gldisplay.h"
+#include "util/display/imgui_impl_sdl.h"
+#include "vk_bake_backend.h"
+#ifdef DXR_AO_EMBREE
+#include "embree_bake_backend.h"
+#endif
+
+/* The portable AO bake through the BakeBackend interface, baking with the Vulkan backend so
+ * it runs where D3D12 isn't available. It bakes the same raster and ray query kernel as
+ * dxr_ao_bake's default bake, with a subset of its options, either headless to an image or
+ * progressively in a GL viewer window. When built with Embree the bake can run on the CPU
+ * instead, and falls back to it when there's no Vulkan ray query device
+ */
+
+const std::string USAGE =
+    "Usage: <obj/gltf_file> [options]\n"
+    "Options:\n"
+    "  -img <w> <h>          Set the viewer window size\n"
+    "  --bake <out.png>      Bake the AO map without opening a window, write it to the\n"
+    "                        output file and exit\n"
+    "  --samples <n>         Number of AO samples to take per texel (default 16)\n"
+    "  --ao-length <l>       Max length of the AO rays (default 5)\n"
+    "  --samples-per-frame <n>\n"
+    "                        Accumulate the samples progressively, tracing n samples per\n"
+    "                        texel each frame. By default the viewer traces 16 per frame\n"
+    "                        and the headless bake traces all in one pass\n"
+    "  --sampler <s>         Set the AO ray sampler: lcg, sobol (default) or r2\n"
+    "  --sampler-seed <n>    Seed the sampler, to decorrelate separate bakes\n"
+    "  --tile-size <n>       Bake the atlas in tiles of n x n texels (default 2048)\n"
+    "  --atlas-cache <dir>   Cache the xatlas unwrap in the directory and reuse it when the\n"
+    "                        geometry and atlas options are unchanged\n"
+    "  --atlas-texels-per-unit <t>\n"
+    "                        Set the xatlas world to texel scale\n"
+    "  --atlas-resolution <n>\n"
+    "                        Set the xatlas target atlas resolution\n"
+    "  --atlas-fast          Use cheap chart and pack options for a quick preview unwrap\n"
+    "  --trace <out.json>    Write a Chrome trace of the load, unwrap and bake\n"
+    "  --backend <b>         Bake with the vulkan (default) or embree backend, embree is\n"
+    "                        only available when built with DXR_AO_EMBREE\n";
+
+// The samplers the backends support, in SAMPLER_* order
+const std::vector<std::string> sampler_names = {"lcg", "sobol", "r2"};
+
+struct VkBakeOptions {
+    std::string scene_file;
+    std::string bake_output;
+    std::string trace_output;
+    std::string backend = "vulkan";
+    BakeSettings settings;
+    // 0 picks the default of the headless bake or the viewer
+    int samples_per_frame = 0;
+    uint32_t tile_size = 2048;
+    AtlasOptions atlas_options;
+    int win_width = 1280;
+    int win_height = 720;
+};
+
+VkBakeOptions parse_args(const std::vector<std::string> &args);
+
+/* Create the backend named, the Vulkan backend falls back to the Embree backend when it's
+ * built and the Vulkan device can't be created
+ */
+std::unique_ptr<BakeBackend> create_backend(const std::string &name);
+
+// Convert the AO to grayscale RGBA8 texels
+std::vector<uint32_t> ao_to_rgba8(const std::vector<float> &ao);
+
+int run_headless_bake(BakeBackend &backend,
+                      const AtlasResult &atlas,
+                      const VkBakeOptions &options);
+
+int run_viewer(BakeBackend &backend, const AtlasResult &atlas, const VkBakeOptions &options);
+
+int main(int argc, const char **argv)
+{
+    const std::vector<std::string> args(argv, argv + argc);
+    auto fnd_help = std::find_if(args.begin(), args.end(), [](const std::string &a) {
+        return a == "-h" || a == "--help";
+    });
+
+    if (argc < 2 || fnd_help != args.end()) {
+        std::cout << USAGE;
+        return 1;
+    }
+
+    const VkBakeOptions options = parse_args(args);
+    if (!options.trace_output.empty()) {
+#ifndef DXR_AO_TRACE
+        std::cout << "Warning: built without DXR_AO_TRACE, the trace will be empty\n";
+#endif
+        trace_enable();
+        trace_set_thread_name("Main");
+    }
+
+    std::unique_ptr<BakeBackend> backend = create_backend(options.backend);
+    std::cout << "Baking with " << backend->name() << " on " << backend->device_name()
+              << "\n";
+
+    Scene scene(options.scene_file, LOAD_NO_TEXTURES);
+    std::cout << "Scene '" << options.scene_file << "' loaded:\n"
+              << "# Unique Triangles: " << pretty_print_count(scene.unique_tris()) << "\n"
+              << "# Total Triangles: " << pretty_print_count(scene.total_tris()) << "\n";
+
+    const AtlasResult atlas =
+        unwrap_meshes(scene.meshes, scene.instances, options.atlas_options);
+    std::cout << "Atlas size: " << atlas.size.x << "x" << atlas.size.y << ", "
+              << atlas.chart_count << " charts\n";
+    if (atlas.size.x == 0 || atlas.size.y == 0) {
+        std::cout << "Error: The unwrap produced an empty atlas\n";
+        return 1;
+    }
+
+    backend->set_scene(scene, atlas);
+    const double build_ms = backend->build_accel();
+    std::cout << "Acceleration structures built in " << build_ms << "ms\n";
+
+    int result = 0;
+    if (!options.bake_output.empty()) {
+        result = run_headless_bake(*backend, atlas, options);
+    } else {
+        result = run_viewer(*backend, atlas, options);
+    }
+
+    if (!options.trace_output.empty()) {
+        write_trace(options.trace_output);
+    }
+    return result;
+}
+
+VkBakeOptions parse_args(const std::vector<std::string> &args)
+{
+    VkBakeOptions options;
+    options.scene_file = args[1];
+    canonicalize_path(options.scene_file);
+
+    for (size_t i = 2; i < args.size(); ++i) {
+        if (args[i] == "-img") {
+            options.win_width = std::stoi(args[++i]);
+            options.win_height = std::stoi(args[++i]);
+        } else if (args[i] == "--bake") {
+            options.bake_output = args[++i];
+        } else if (args[i] == "--samples") {
+            options.settings.n_samples = std::stoi(args[++i]);
+        } else if (args[i] == "--ao-length") {
+            options.settings.ao_length = std::stof(args[++i]);
+        } else if (args[i] == "--samples-per-frame") {
+            options.samples_per_frame = std::max(std::stoi(args[++i]), 1);
+        } else if (args[i] == "--sampler") {
+            const std::string name = args[++i];
+            auto fnd = std::find(sampler_names.begin(), sampler_names.end(), name);
+            if (fnd == sampler_names.end()) {
+                std::cout << "Unrecognized sampler " << name << "\n" << USAGE;
+                std::exit(1);
+            }
+            options.settings.sampler_type = std::distance(sampler_names.begin(), fnd);
+        } else if (args[i] == "--sampler-seed") {
+            options.settings.sampler_seed = std::stoul(args[++i]);
+        } else if (args[i] == "--tile-size") {
+            options.tile_size = std::max(std::stoi(args[++i]), 1);
+        } else if (args[i] == "--atlas-cache") {
+            options.atlas_options.cache_dir = args[++i];
+        } else if (args[i] == "--atlas-texels-per-unit") {
+            options.atlas_options.pack_options.texelsPerUnit = std::stof(args[++i]);
+        } else if (args[i] == "--atlas-resolution") {
+            options.atlas_options.pack_options.resolution = std::stoi(args[++i]);
+        } else if (args[i] == "--atlas-fast") {
+            set_fast_atlas_options(options.atlas_options);
+        } else if (args[i] == "--trace") {
+            options.trace_output = args[++i];
+        } else if (args[i] == "--backend") {
+            options.backend = args[++i];
+            if (options.backend != "vulkan" && options.backend != "embree") {
+                std::cout << "Unrecognized backend " << options.backend << "\n" << USAGE;
+                std::exit(1);
+            }
+        } else {
+            std::cout << "Warning: Unrecognized option '" << args[i] << "'\n";
+        }
+    }
+    return options;
+}
+
+std::unique_ptr<BakeBackend> create_backend(const std::string &name)
+{
+#ifdef DXR_AO_EMBREE
+    if (name == "embree") {
+        return std::unique_ptr<BakeBackend>(new EmbreeBakeBackend());
+    }
+    try {
+        return std::unique_ptr<BakeBackend>(new VulkanBakeBackend());
+    } catch (const std::runtime_error &e) {
+        std::cout << "Warning: Failed to create the Vulkan backend (" << e.what()
+                  << "), falling back to the Embree backend\n";
+        return std::unique_ptr<BakeBackend>(new EmbreeBakeBackend());
+    }
+#else
+    if (name == "embree") {
+        std::cout << "Error: Built without DXR_AO_EMBREE, the embree backend is unavailable\n";
+        std::exit(1);
+    }
+    return std::unique_ptr<BakeBackend>(new VulkanBakeBackend());
+#endif
+}
+
+std::vector<uint32_t> ao_to_rgba8(const std::vector<float> &ao)
+{
+    std::vector<uint32_t> img(ao.size(), 0);
+    for (size_t i = 0; i < ao.size(); ++i) {
+        const uint32_t v = std::round(glm::clamp(ao[i], 0.f, 1.f) * 255.f);
+        img[i] = 0xff000000 | (v << 16) | (v << 8) | v;
+    }
+    return img;
+}
+
+int run_headless_bake(BakeBackend &backend,
+                      const AtlasResult &atlas,
+                      const VkBakeOptions &options)
+{
+    TRACE_SCOPE("Headless Bake");
+    BakeSettings settings = options.settings;
+    settings.samples_per_frame =
+        options.samples_per_frame > 0 ? options.samples_per_frame : settings.n_samples;
+
+    const uint32_t n_frames =
+        (settings.n_samples + settings.samples_per_frame - 1) / settings.samples_per_frame;
+    uint64_t total_rays = 0;
+    float total_gpu_ms = 0.f;
+    for (uint32_t frame_id = 0; frame_id < n_frames; ++frame_id) {
+        const BakeTileStats stats =
+            bake_frame(backend, atlas.size, options.tile_size, frame_id, settings);
+        total_rays += stats.rays;
+        total_gpu_ms += stats.gpu_ms;
+    }
+    std::cout << "Baked " << settings.n_samples << " samples in " << n_frames << " frames, "
+              << total_gpu_ms << "ms bake time, "
+              << pretty_print_count(total_rays / (total_gpu_ms * 1e-3)) << "Rays/s\n";
+
+    const std::vector<uint32_t> img = ao_to_rgba8(backend.readback());
+    const bool ok = write_png(options.bake_output, atlas.size, 4, 8, [&](uint32_t y, void *row) {
+        std::memcpy(row, img.data() + size_t(y) * atlas.size.x, atlas.size.x * 4);
+    });
+    if (!ok) {
+        std::cout << "Error: Failed to write AO map to " << options.bake_output << "\n";
+        return 1;
+    }
+    std::cout << "AO map written to " << options.bake_output << "\n";
+    return 0;
+}
+
+int run_viewer(BakeBackend &backend, const AtlasResult &atlas, const VkBakeOptions &options)
+{
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        std::cerr << "Failed to init SDL: " << SDL_GetError() << "\n";
+        return 1;
+    }
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 5);
+
+    SDL_Window *window = SDL_CreateWindow("Vulkan AO Baking",
+                                          SDL_WINDOWPOS_CENTERED,
+                                          SDL_WINDOWPOS_CENTERED,
+                                          options.win_width,
+                                          options.win_height,
+                                          SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
+    ImGui::CreateContext();
+    ImGui::StyleColorsDark();
+
+    {
+        GLDisplay display(window);
+        glm::ivec2 fb_dims(options.win_width, options.win_height);
+        display.resize(fb_dims.x, fb_dims.y);
+
+        BakeSettings settings = options.settings;
+        settings.samples_per_frame = options.samples_per_frame > 0
+                                         ? options.samples_per_frame
+                                         : std::min(settings.n_samples, 16);
+        const uint32_t n_frames = (settings.n_samples + settings.samples_per_frame - 1) /
+                                  settings.samples_per_frame;
+
+        uint32_t frame_id = 0;
+        BakeTileStats frame_stats;
+        std::vector<float> ao(atlas.size.x * atlas.size.y, 0.f);
+        std::vector<uint32_t> img;
+        bool done = false;
+        while (!done) {
+            SDL_Event event;
+            while (SDL_PollEvent(&event)) {
+                ImGui_ImplSDL2_ProcessEvent(&event);
+                if (event.type == SDL_QUIT ||
+                    (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)) {
+                    done = true;
+                }
+                if (event.type == SDL_WINDOWEVENT &&
+                    event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+                    fb_dims = glm::ivec2(event.window.data1, event.window.data2);
+                    display.resize(fb_dims.x, fb_dims.y);
+                }
+            }
+
+            // Bake a frame over the atlas until all samples are taken, reading back each
+            if (frame_id < n_frames) {
+                frame_stats =
+                    bake_frame(backend, atlas.size, options.tile_size, frame_id, settings);
+                ao = backend.readback();
+                ++frame_id;
+            }
+
+            // The atlas is fit to the window with nearest sampling, the GL display shows the
+            // image at the framebuffer size
+            const float scale =
+                std::min(float(fb_dims.x) / atlas.size.x, float(fb_dims.y) / atlas.size.y);
+            img.assign(size_t(fb_dims.x) * fb_dims.y, 0xff000000);
+            for (int y = 0; y < fb_dims.y; ++y) {
+                const uint32_t ty = y / scale;
+                if (ty >= atlas.size.y) {
+                    break;
+                }
+                for (int x = 0; x < fb_dims.x; ++x) {
+                    const uint32_t tx = x / scale;
+                    if (tx >= atlas.size.x) {
+                        break;
+                    }
+                    const uint32_t v = std::round(
+                        glm::clamp(ao[size_t(ty) * atlas.size.x + tx], 0.f, 1.f) * 255.f);
+                    img[size_t(y) * fb_dims.x + x] =
+                        0xff000000 | (v << 16) | (v << 8) | v;
+                }
+            }
+
+            ImGui_ImplSDL2_NewFrame(window);
+            display.new_frame();
+            ImGui::NewFrame();
+            ImGui::Begin("Bake Info");
+            ImGui::Text("Backend: %s", backend.name().c_str());
+            ImGui::Text("Device: %s", backend.device_name().c_str());
+            ImGui::Text("Atlas: %ux%u", atlas.size.x, atlas.size.y);
+            ImGui::Text("Samples: %u/%d",
+                        std::min(frame_id * settings.samples_per_frame,
+                                 uint32_t(settings.n_samples)),
+                        settings.n_samples);
+            ImGui::Text("Frame GPU Time: %.2fms", frame_stats.gpu_ms);
+            if (frame_stats.gpu_ms > 0.f) {
+                ImGui::Text("Rays/s: %s",
+                            pretty_print_count(frame_stats.rays / (frame_stats.gpu_ms * 1e-3))
+                                .c_str());
+            }
+            ImGui::End();
+            ImGui::Render();
+
+            display.display(img);
+        }
+    }
+
+    ImGui::DestroyContext();
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+    return 0;
+}
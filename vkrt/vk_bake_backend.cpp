@@ -0,0 +1,730 @@
+#include "vk_bake_backend.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include "trace.h"
+#include "util.h"
+
+#include "vk_render_ao_map_fs_embedded_spv.h"
+#include "vk_render_ao_map_vs_embedded_spv.h"
+
+namespace {
+
+// Matches BakeInstance in vk_render_ao_map.hlsl
+struct BakeInstance {
+    glm::mat4 transform;
+    glm::mat4 normal_transform;
+    glm::vec2 uv_offset;
+    glm::vec2 uv_scale;
+};
+
+// Matches the AtlasInfo constants in vk_render_ao_map.hlsl
+struct AtlasInfo {
+    glm::ivec2 dimensions;
+    int n_samples;
+    float ao_length;
+    uint32_t frame_id;
+    int samples_per_frame;
+    uint32_t sampler_seed;
+    uint32_t sampler_type;
+};
+
+// The RAY_STATS_* counters in trace_ao.hlsl
+struct RayStatsCounters {
+    uint32_t rays[2];
+    uint32_t hits[2];
+    uint32_t active_texels;
+    uint32_t pad[3];
+};
+
+const VkBufferUsageFlags geometry_usage =
+    VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
+    VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+}
+
+VulkanBakeBackend::VulkanBakeBackend()
+    : device(std::make_unique<vkrt::Device>()),
+      cmd_ctx(std::make_unique<vkrt::CommandContext>(*device))
+{
+    build_pipeline();
+
+    VkQueryPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    pool_info.queryCount = 2;
+    CHECK_VULKAN(vkCreateQueryPool(
+        device->logical_device(), &pool_info, nullptr, &timestamp_pool));
+}
+
+VulkanBakeBackend::~VulkanBakeBackend()
+{
+    VkDevice vkdev = device->logical_device();
+    vkDeviceWaitIdle(vkdev);
+    release_accel();
+
+    positions = nullptr;
+    normals = nullptr;
+    uvs = nullptr;
+    indices = nullptr;
+    instance_buf = nullptr;
+    accum_buf = nullptr;
+    ray_stats = nullptr;
+    atlas_info = nullptr;
+
+    vkDestroyQueryPool(vkdev, timestamp_pool, nullptr);
+    vkDestroyPipeline(vkdev, pipeline, nullptr);
+    vkDestroyPipelineLayout(vkdev, pipeline_layout, nullptr);
+    vkDestroyDescriptorPool(vkdev, desc_pool, nullptr);
+    vkDestroyDescriptorSetLayout(vkdev, desc_layout, nullptr);
+}
+
+std::string VulkanBakeBackend::name()
+{
+    return "Vulkan Ray Query";
+}
+
+std::string VulkanBakeBackend::device_name()
+{
+    return device->device_name();
+}
+
+void VulkanBakeBackend::set_scene(const Scene &scene, const AtlasResult &atlas)
+{
+    TRACE_SCOPE("Vulkan Set Scene");
+    vkDeviceWaitIdle(device->logical_device());
+    release_accel();
+
+    std::vector<glm::vec3> all_positions, all_normals;
+    std::vector<glm::vec2> all_uvs;
+    std::vector<uint32_t> all_indices;
+    mesh_geometries.clear();
+    for (const auto &mesh : scene.meshes) {
+        std::vector<GeometryRange> ranges;
+        for (const auto &geom : mesh.geometries) {
+            GeometryRange range;
+            range.first_vertex = all_positions.size();
+            range.num_vertices = geom.vertex_data().size();
+            range.first_index = all_indices.size();
+            range.num_indices = geom.index_data().size() * 3;
+            ranges.push_back(range);
+
+            const auto verts = geom.vertex_data();
+            const auto norms = geom.normal_data();
+            const auto tex = geom.uv_data();
+            const auto tris = geom.index_data();
+            all_positions.insert(all_positions.end(), verts.begin(), verts.end());
+            all_normals.insert(all_normals.end(), norms.begin(), norms.end());
+            all_uvs.insert(all_uvs.end(), tex.begin(), tex.end());
+            for (const auto &t : tris) {
+                all_indices.insert(all_indices.end(), {t.x, t.y, t.z});
+            }
+        }
+        mesh_geometries.push_back(ranges);
+    }
+
+    positions = upload(all_positions.data(),
+                       all_positions.size() * sizeof(glm::vec3),
+                       geometry_usage | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+    normals = upload(all_normals.data(),
+                     all_normals.size() * sizeof(glm::vec3),
+                     VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    uvs = upload(all_uvs.data(),
+                 all_uvs.size() * sizeof(glm::vec2),
+                 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    indices = upload(all_indices.data(),
+                     all_indices.size() * sizeof(uint32_t),
+                     geometry_usage | VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+
+    instance_meshes.clear();
+    instance_transforms.clear();
+    std::vector<BakeInstance> bake_instances;
+    for (size_t i = 0; i < scene.instances.size(); ++i) {
+        const auto &inst = scene.instances[i];
+        const InstanceAtlasRegion region = i < atlas.instance_regions.size()
+                                               ? atlas.instance_regions[i]
+                                               : InstanceAtlasRegion();
+        BakeInstance bi;
+        bi.transform = inst.transform;
+        bi.normal_transform = glm::transpose(glm::inverse(inst.transform));
+        bi.uv_offset = region.uv_offset;
+        bi.uv_scale = region.uv_scale;
+        bake_instances.push_back(bi);
+        instance_meshes.push_back(inst.mesh_id);
+        instance_transforms.push_back(inst.transform);
+    }
+    instance_buf = upload(bake_instances.data(),
+                          bake_instances.size() * sizeof(BakeInstance),
+                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                              VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+
+    atlas_size = atlas.size;
+    const size_t accum_size = size_t(atlas_size.x) * atlas_size.y * sizeof(glm::vec2);
+    accum_buf = vkrt::Buffer::device(*device,
+                                     accum_size,
+                                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                         VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                                         VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    ray_stats = vkrt::Buffer::host(
+        *device, sizeof(RayStatsCounters), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    atlas_info =
+        vkrt::Buffer::host(*device, sizeof(AtlasInfo), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
+
+    // Texels outside the tiles baked so far read back as unbaked
+    cmd_ctx->begin();
+    vkCmdFillBuffer(cmd_ctx->cmd_buf, accum_buf->handle(), 0, VK_WHOLE_SIZE, 0);
+    cmd_ctx->submit_and_sync();
+}
+
+double VulkanBakeBackend::build_accel()
+{
+    TRACE_SCOPE("Vulkan Build Accel");
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+
+    VkDevice vkdev = device->logical_device();
+    vkDeviceWaitIdle(vkdev);
+    release_accel();
+
+    const VkDeviceAddress position_addr = positions->device_address();
+    const VkDeviceAddress index_addr = indices->device_address();
+    const size_t scratch_alignment =
+        device->accel_properties().minAccelerationStructureScratchOffsetAlignment;
+
+    // Size the meshes' BLASes, which are placed in one buffer and built with one scratch
+    // buffer in sequence
+    std::vector<std::vector<VkAccelerationStructureGeometryKHR>> blas_geometries;
+    std::vector<std::vector<VkAccelerationStructureBuildRangeInfoKHR>> blas_ranges;
+    std::vector<VkAccelerationStructureBuildGeometryInfoKHR> blas_builds;
+    std::vector<VkAccelerationStructureBuildSizesInfoKHR> blas_sizes;
+    std::vector<size_t> blas_offsets;
+    size_t blas_buf_size = 0;
+    size_t scratch_size = 0;
+    for (const auto &ranges : mesh_geometries) {
+        std::vector<VkAccelerationStructureGeometryKHR> geometries;
+        std::vector<VkAccelerationStructureBuildRangeInfoKHR> build_ranges;
+        std::vector<uint32_t> max_primitives;
+        for (const auto &r : ranges) {
+            VkAccelerationStructureGeometryKHR g = {};
+            g.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+            g.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+            g.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+
+            auto &tris = g.geometry.triangles;
+            tris.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
+            tris.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
+            tris.vertexData.deviceAddress =
+                position_addr + uint64_t(r.first_vertex) * sizeof(glm::vec3);
+            tris.vertexStride = sizeof(glm::vec3);
+            tris.maxVertex = std::max(r.num_vertices, 1u) - 1;
+            tris.indexType = VK_INDEX_TYPE_UINT32;
+            tris.indexData.deviceAddress =
+                index_addr + uint64_t(r.first_index) * sizeof(uint32_t);
+            geometries.push_back(g);
+
+            VkAccelerationStructureBuildRangeInfoKHR range = {};
+            range.primitiveCount = r.num_indices / 3;
+            build_ranges.push_back(range);
+            max_primitives.push_back(range.primitiveCount);
+        }
+        blas_geometries.push_back(geometries);
+        blas_ranges.push_back(build_ranges);
+
+        VkAccelerationStructureBuildGeometryInfoKHR build = {};
+        build.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+        build.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        build.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+        build.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+        build.geometryCount = blas_geometries.back().size();
+        build.pGeometries = blas_geometries.back().data();
+
+        VkAccelerationStructureBuildSizesInfoKHR sizes = {};
+        sizes.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+        vkrt::GetAccelerationStructureBuildSizesKHR(
+            vkdev,
+            VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+            &build,
+            max_primitives.data(),
+            &sizes);
+
+        // Acceleration structures must be placed at 256 byte aligned offsets
+        blas_offsets.push_back(align_to(blas_buf_size, 256));
+        blas_buf_size = blas_offsets.back() + sizes.accelerationStructureSize;
+        scratch_size = std::max(scratch_size, size_t(sizes.buildScratchSize));
+        blas_builds.push_back(build);
+        blas_sizes.push_back(sizes);
+    }
+
+    blas_buf = vkrt::Buffer::device(*device,
+                                    std::max(blas_buf_size, size_t(256)),
+                                    VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR |
+                                        VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+    auto scratch = vkrt::Buffer::device(*device,
+                                        scratch_size + scratch_alignment,
+                                        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+    const VkDeviceAddress scratch_addr =
+        align_to(scratch->device_address(), scratch_alignment);
+
+    cmd_ctx->begin();
+    for (size_t i = 0; i < blas_builds.size(); ++i) {
+        VkAccelerationStructureCreateInfoKHR create_info = {};
+        create_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+        create_info.buffer = blas_buf->handle();
+        create_info.offset = blas_offsets[i];
+        create_info.size = blas_sizes[i].accelerationStructureSize;
+        create_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        VkAccelerationStructureKHR as = VK_NULL_HANDLE;
+        CHECK_VULKAN(vkrt::CreateAccelerationStructureKHR(vkdev, &create_info, nullptr, &as));
+        blas.push_back(as);
+
+        blas_builds[i].dstAccelerationStructure = as;
+        blas_builds[i].scratchData.deviceAddress = scratch_addr;
+        const VkAccelerationStructureBuildRangeInfoKHR *ranges = blas_ranges[i].data();
+        vkrt::CmdBuildAccelerationStructuresKHR(cmd_ctx->cmd_buf, 1, &blas_builds[i], &ranges);
+
+        // The next build reuses the scratch buffer, and the TLAS build reads the BLASes
+        vkrt::memory_barrier(cmd_ctx->cmd_buf,
+                             VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                             VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+                             VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                             VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR |
+                                 VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR);
+    }
+
+    // The TLAS instances are written directly to a host visible buffer
+    std::vector<VkDeviceAddress> blas_addrs;
+    for (const auto &as : blas) {
+        VkAccelerationStructureDeviceAddressInfoKHR addr_info = {};
+        addr_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+        addr_info.accelerationStructure = as;
+        blas_addrs.push_back(
+            vkrt::GetAccelerationStructureDeviceAddressKHR(vkdev, &addr_info));
+    }
+    const uint32_t num_instances = instance_meshes.size();
+    tlas_instances = vkrt::Buffer::host(
+        *device,
+        std::max(num_instances, 1u) * sizeof(VkAccelerationStructureInstanceKHR),
+        VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+    {
+        auto *instances =
+            reinterpret_cast<VkAccelerationStructureInstanceKHR *>(tlas_instances->map());
+        for (uint32_t i = 0; i < num_instances; ++i) {
+            VkAccelerationStructureInstanceKHR &inst = instances[i];
+            std::memset(&inst, 0, sizeof(VkAccelerationStructureInstanceKHR));
+            // The transform is row major 3x4, glm's is column major
+            const glm::mat4 &m = instance_transforms[i];
+            for (int r = 0; r < 3; ++r) {
+                for (int c = 0; c < 4; ++c) {
+                    inst.transform.matrix[r][c] = m[c][r];
+                }
+            }
+            // The scene has no occluder proxies, so the instances are in both fields
+            inst.mask = 0xff;
+            inst.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
+            inst.accelerationStructureReference = blas_addrs[instance_meshes[i]];
+        }
+        tlas_instances->unmap();
+    }
+
+    VkAccelerationStructureGeometryKHR instance_geom = {};
+    instance_geom.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+    instance_geom.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+    instance_geom.geometry.instances.sType =
+        VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+    instance_geom.geometry.instances.data.deviceAddress = tlas_instances->device_address();
+
+    VkAccelerationStructureBuildGeometryInfoKHR tlas_build = {};
+    tlas_build.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+    tlas_build.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+    tlas_build.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+    tlas_build.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+    tlas_build.geometryCount = 1;
+    tlas_build.pGeometries = &instance_geom;
+
+    VkAccelerationStructureBuildSizesInfoKHR tlas_sizes = {};
+    tlas_sizes.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+    vkrt::GetAccelerationStructureBuildSizesKHR(
+        vkdev,
+        VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+        &tlas_build,
+        &num_instances,
+        &tlas_sizes);
+
+    tlas_buf = vkrt::Buffer::device(*device,
+                                    tlas_sizes.accelerationStructureSize,
+                                    VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR |
+                                        VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+    auto tlas_scratch = vkrt::Buffer::device(*device,
+                                             tlas_sizes.buildScratchSize + scratch_alignment,
+                                             VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                                 VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+
+    VkAccelerationStructureCreateInfoKHR tlas_create_info = {};
+    tlas_create_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+    tlas_create_info.buffer = tlas_buf->handle();
+    tlas_create_info.size = tlas_sizes.accelerationStructureSize;
+    tlas_create_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+    CHECK_VULKAN(
+        vkrt::CreateAccelerationStructureKHR(vkdev, &tlas_create_info, nullptr, &tlas));
+
+    tlas_build.dstAccelerationStructure = tlas;
+    tlas_build.scratchData.deviceAddress =
+        align_to(tlas_scratch->device_address(), scratch_alignment);
+    VkAccelerationStructureBuildRangeInfoKHR tlas_range = {};
+    tlas_range.primitiveCount = num_instances;
+    const VkAccelerationStructureBuildRangeInfoKHR *tlas_ranges = &tlas_range;
+    vkrt::CmdBuildAccelerationStructuresKHR(cmd_ctx->cmd_buf, 1, &tlas_build, &tlas_ranges);
+
+    vkrt::memory_barrier(cmd_ctx->cmd_buf,
+                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                         VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR);
+    cmd_ctx->submit_and_sync();
+
+    update_descriptor_set();
+
+    return duration_cast<duration<double, std::milli>>(steady_clock::now() - start).count();
+}
+
+BakeTileStats VulkanBakeBackend::bake_tile(const glm::uvec2 &origin,
+                                           const glm::uvec2 &size,
+                                           uint32_t frame_id,
+                                           const BakeSettings &settings)
+{
+    if (tlas == VK_NULL_HANDLE) {
+        throw std::runtime_error("build_accel must be called before baking");
+    }
+
+    AtlasInfo info = {};
+    info.dimensions = glm::ivec2(atlas_size);
+    info.n_samples = settings.n_samples;
+    info.ao_length = settings.ao_length;
+    info.frame_id = frame_id;
+    info.samples_per_frame = settings.samples_per_frame;
+    info.sampler_seed = settings.sampler_seed;
+    info.sampler_type = settings.sampler_type;
+    std::memcpy(atlas_info->map(), &info, sizeof(AtlasInfo));
+    atlas_info->unmap();
+
+    std::memset(ray_stats->map(), 0, sizeof(RayStatsCounters));
+    ray_stats->unmap();
+
+    VkCommandBuffer cmd_buf = cmd_ctx->cmd_buf;
+    cmd_ctx->begin();
+    vkCmdResetQueryPool(cmd_buf, timestamp_pool, 0, 2);
+    vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestamp_pool, 0);
+
+    // The atlas is rendered without attachments, the fragment shader writes the texels'
+    // accumulation directly and only the tile is rasterized
+    VkRenderingInfo render_info = {};
+    render_info.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
+    render_info.renderArea.offset.x = origin.x;
+    render_info.renderArea.offset.y = origin.y;
+    render_info.renderArea.extent.width = size.x;
+    render_info.renderArea.extent.height = size.y;
+    render_info.layerCount = 1;
+    vkCmdBeginRendering(cmd_buf, &render_info);
+
+    VkViewport viewport = {};
+    viewport.width = atlas_size.x;
+    viewport.height = atlas_size.y;
+    viewport.maxDepth = 1.f;
+    vkCmdSetViewport(cmd_buf, 0, 1, &viewport);
+    vkCmdSetScissor(cmd_buf, 0, 1, &render_info.renderArea);
+
+    vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+    vkCmdBindDescriptorSets(cmd_buf,
+                            VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            pipeline_layout,
+                            0,
+                            1,
+                            &desc_set,
+                            0,
+                            nullptr);
+
+    const std::array<VkBuffer, 3> vertex_buffers = {
+        positions->handle(), normals->handle(), uvs->handle()};
+    const std::array<VkDeviceSize, 3> vertex_offsets = {0, 0, 0};
+    vkCmdBindVertexBuffers(cmd_buf, 0, 3, vertex_buffers.data(), vertex_offsets.data());
+    vkCmdBindIndexBuffer(cmd_buf, indices->handle(), 0, VK_INDEX_TYPE_UINT32);
+
+    for (uint32_t i = 0; i < instance_meshes.size(); ++i) {
+        vkCmdPushConstants(
+            cmd_buf, pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(uint32_t), &i);
+        for (const auto &r : mesh_geometries[instance_meshes[i]]) {
+            vkCmdDrawIndexed(cmd_buf, r.num_indices, 1, r.first_index, r.first_vertex, 0);
+        }
+    }
+    vkCmdEndRendering(cmd_buf);
+
+    vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestamp_pool, 1);
+    cmd_ctx->submit_and_sync();
+
+    std::array<uint64_t, 2> timestamps = {0, 0};
+    CHECK_VULKAN(vkGetQueryPoolResults(device->logical_device(),
+                                       timestamp_pool,
+                                       0,
+                                       2,
+                                       sizeof(timestamps),
+                                       timestamps.data(),
+                                       sizeof(uint64_t),
+                                       VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+
+    RayStatsCounters counters;
+    std::memcpy(&counters, ray_stats->map(), sizeof(RayStatsCounters));
+    ray_stats->unmap();
+
+    BakeTileStats stats;
+    stats.rays = counters.rays[0] | (uint64_t(counters.rays[1]) << 32);
+    stats.hits = counters.hits[0] | (uint64_t(counters.hits[1]) << 32);
+    stats.active_texels = counters.active_texels;
+    stats.gpu_ms = (timestamps[1] - timestamps[0]) *
+                   device->properties().limits.timestampPeriod * 1e-6f;
+    return stats;
+}
+
+std::vector<float> VulkanBakeBackend::readback()
+{
+    TRACE_SCOPE("Vulkan Readback");
+    auto readback_buf =
+        vkrt::Buffer::host(*device, accum_buf->size(), VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+
+    cmd_ctx->begin();
+    VkBufferCopy copy = {};
+    copy.size = accum_buf->size();
+    vkCmdCopyBuffer(cmd_ctx->cmd_buf, accum_buf->handle(), readback_buf->handle(), 1, &copy);
+    cmd_ctx->submit_and_sync();
+
+    const size_t num_texels = size_t(atlas_size.x) * atlas_size.y;
+    std::vector<float> ao(num_texels, 0.f);
+    const glm::vec2 *accum = reinterpret_cast<const glm::vec2 *>(readback_buf->map());
+    for (size_t i = 0; i < num_texels; ++i) {
+        ao[i] = accum[i].x / std::max(accum[i].y, 1.f);
+    }
+    readback_buf->unmap();
+    return ao;
+}
+
+void VulkanBakeBackend::build_pipeline()
+{
+    VkDevice vkdev = device->logical_device();
+
+    const std::array<VkDescriptorType, 5> binding_types = {
+        VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR,
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER};
+    std::vector<VkDescriptorSetLayoutBinding> bindings;
+    std::vector<VkDescriptorPoolSize> pool_sizes;
+    for (uint32_t i = 0; i < binding_types.size(); ++i) {
+        VkDescriptorSetLayoutBinding b = {};
+        b.binding = i;
+        b.descriptorType = binding_types[i];
+        b.descriptorCount = 1;
+        b.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+        bindings.push_back(b);
+
+        VkDescriptorPoolSize s = {};
+        s.type = binding_types[i];
+        s.descriptorCount = 1;
+        pool_sizes.push_back(s);
+    }
+
+    VkDescriptorSetLayoutCreateInfo layout_info = {};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = bindings.size();
+    layout_info.pBindings = bindings.data();
+    CHECK_VULKAN(vkCreateDescriptorSetLayout(vkdev, &layout_info, nullptr, &desc_layout));
+
+    VkDescriptorPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = 1;
+    pool_info.poolSizeCount = pool_sizes.size();
+    pool_info.pPoolSizes = pool_sizes.data();
+    CHECK_VULKAN(vkCreateDescriptorPool(vkdev, &pool_info, nullptr, &desc_pool));
+
+    VkDescriptorSetAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    alloc_info.descriptorPool = desc_pool;
+    alloc_info.descriptorSetCount = 1;
+    alloc_info.pSetLayouts = &desc_layout;
+    CHECK_VULKAN(vkAllocateDescriptorSets(vkdev, &alloc_info, &desc_set));
+
+    // The draw's instance is passed as a push constant
+    VkPushConstantRange push_constants = {};
+    push_constants.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    push_constants.size = sizeof(uint32_t);
+
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {};
+    pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_info.setLayoutCount = 1;
+    pipeline_layout_info.pSetLayouts = &desc_layout;
+    pipeline_layout_info.pushConstantRangeCount = 1;
+    pipeline_layout_info.pPushConstantRanges = &push_constants;
+    CHECK_VULKAN(
+        vkCreatePipelineLayout(vkdev, &pipeline_layout_info, nullptr, &pipeline_layout));
+
+    VkShaderModule vs = vkrt::create_shader_module(
+        vkdev, vk_render_ao_map_vs_spv, sizeof(vk_render_ao_map_vs_spv));
+    VkShaderModule fs = vkrt::create_shader_module(
+        vkdev, vk_render_ao_map_fs_spv, sizeof(vk_render_ao_map_fs_spv));
+
+    std::array<VkPipelineShaderStageCreateInfo, 2> stages = {};
+    stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    stages[0].module = vs;
+    stages[0].pName = "vsmain";
+    stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    stages[1].module = fs;
+    stages[1].pName = "fsmain";
+
+    // The positions, normals and uvs are each in their own buffer
+    const std::array<uint32_t, 3> attrib_sizes = {
+        sizeof(glm::vec3), sizeof(glm::vec3), sizeof(glm::vec2)};
+    const std::array<VkFormat, 3> attrib_formats = {
+        VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32_SFLOAT};
+    std::array<VkVertexInputBindingDescription, 3> vertex_bindings = {};
+    std::array<VkVertexInputAttributeDescription, 3> vertex_attribs = {};
+    for (uint32_t i = 0; i < 3; ++i) {
+        vertex_bindings[i].binding = i;
+        vertex_bindings[i].stride = attrib_sizes[i];
+        vertex_bindings[i].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+        vertex_attribs[i].location = i;
+        vertex_attribs[i].binding = i;
+        vertex_attribs[i].format = attrib_formats[i];
+    }
+
+    VkPipelineVertexInputStateCreateInfo vertex_input = {};
+    vertex_input.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertex_input.vertexBindingDescriptionCount = vertex_bindings.size();
+    vertex_input.pVertexBindingDescriptions = vertex_bindings.data();
+    vertex_input.vertexAttributeDescriptionCount = vertex_attribs.size();
+    vertex_input.pVertexAttributeDescriptions = vertex_attribs.data();
+
+    VkPipelineInputAssemblyStateCreateInfo input_assembly = {};
+    input_assembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    input_assembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+    VkPipelineViewportStateCreateInfo viewport_state = {};
+    viewport_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewport_state.viewportCount = 1;
+    viewport_state.scissorCount = 1;
+
+    VkPipelineRasterizationStateCreateInfo rasterizer = {};
+    rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterizer.cullMode = VK_CULL_MODE_NONE;
+    rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+    rasterizer.lineWidth = 1.f;
+
+    VkPipelineMultisampleStateCreateInfo multisampling = {};
+    multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+    VkPipelineColorBlendStateCreateInfo blending = {};
+    blending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+
+    const std::array<VkDynamicState, 2> dynamic_states = {VK_DYNAMIC_STATE_VIEWPORT,
+                                                          VK_DYNAMIC_STATE_SCISSOR};
+    VkPipelineDynamicStateCreateInfo dynamic_state = {};
+    dynamic_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamic_state.dynamicStateCount = dynamic_states.size();
+    dynamic_state.pDynamicStates = dynamic_states.data();
+
+    VkPipelineRenderingCreateInfo rendering_info = {};
+    rendering_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO;
+
+    VkGraphicsPipelineCreateInfo pipeline_info = {};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipeline_info.pNext = &rendering_info;
+    pipeline_info.stageCount = stages.size();
+    pipeline_info.pStages = stages.data();
+    pipeline_info.pVertexInputState = &vertex_input;
+    pipeline_info.pInputAssemblyState = &input_assembly;
+    pipeline_info.pViewportState = &viewport_state;
+    pipeline_info.pRasterizationState = &rasterizer;
+    pipeline_info.pMultisampleState = &multisampling;
+    pipeline_info.pColorBlendState = &blending;
+    pipeline_info.pDynamicState = &dynamic_state;
+    pipeline_info.layout = pipeline_layout;
+    CHECK_VULKAN(vkCreateGraphicsPipelines(
+        vkdev, VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &pipeline));
+
+    vkDestroyShaderModule(vkdev, vs, nullptr);
+    vkDestroyShaderModule(vkdev, fs, nullptr);
+}
+
+void VulkanBakeBackend::release_accel()
+{
+    VkDevice vkdev = device->logical_device();
+    for (auto &as : blas) {
+        vkrt::DestroyAccelerationStructureKHR(vkdev, as, nullptr);
+    }
+    blas.clear();
+    if (tlas != VK_NULL_HANDLE) {
+        vkrt::DestroyAccelerationStructureKHR(vkdev, tlas, nullptr);
+        tlas = VK_NULL_HANDLE;
+    }
+    blas_buf = nullptr;
+    tlas_buf = nullptr;
+    tlas_instances = nullptr;
+}
+
+void VulkanBakeBackend::update_descriptor_set()
+{
+    VkWriteDescriptorSetAccelerationStructureKHR as_write = {};
+    as_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR;
+    as_write.accelerationStructureCount = 1;
+    as_write.pAccelerationStructures = &tlas;
+
+    const std::array<vkrt::Buffer *, 4> buffers = {
+        instance_buf.get(), accum_buf.get(), ray_stats.get(), atlas_info.get()};
+    std::array<VkDescriptorBufferInfo, 4> buffer_infos = {};
+    std::array<VkWriteDescriptorSet, 5> writes = {};
+    for (uint32_t i = 0; i < writes.size(); ++i) {
+        writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[i].dstSet = desc_set;
+        writes[i].dstBinding = i;
+        writes[i].descriptorCount = 1;
+        if (i == 0) {
+            writes[i].descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+            writes[i].pNext = &as_write;
+            continue;
+        }
+        buffer_infos[i - 1].buffer = buffers[i - 1]->handle();
+        buffer_infos[i - 1].range = VK_WHOLE_SIZE;
+        writes[i].descriptorType = i == 4 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER
+                                          : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writes[i].pBufferInfo = &buffer_infos[i - 1];
+    }
+    vkUpdateDescriptorSets(
+        device->logical_device(), writes.size(), writes.data(), 0, nullptr);
+}
+
+std::shared_ptr<vkrt::Buffer> VulkanBakeBackend::upload(const void *data,
+                                                        size_t nbytes,
+                                                        VkBufferUsageFlags usage)
+{
+    // Empty buffers can't be created, so empty data still gets a small buffer
+    const size_t buf_size = std::max(nbytes, size_t(16));
+    auto upload_buf =
+        vkrt::Buffer::host(*device, buf_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+    if (nbytes > 0) {
+        std::memcpy(upload_buf->map(), data, nbytes);
+        upload_buf->unmap();
+    }
+    auto buf = vkrt::Buffer::device(*device, buf_size, usage);
+
+    cmd_ctx->begin();
+    VkBufferCopy copy = {};
+    copy.size = buf_size;
+    vkCmdCopyBuffer(cmd_ctx->cmd_buf, upload_buf->handle(), buf->handle(), 1, &copy);
+    cmd_ctx->submit_and_sync();
+    return buf;
+}
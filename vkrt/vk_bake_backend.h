@@ -0,0 +1,74 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "bake_backend.h"
+#include "vk_utils.h"
+
+/* The Vulkan bake backend, baking with the same raster and inline ray query kernel as the
+ * D3D12 app through VK_KHR_ray_query, so the bake can run on Linux. The meshes' BLASes are
+ * built into a shared buffer without compaction, and alpha tested geometry is treated as
+ * opaque
+ */
+class VulkanBakeBackend : public BakeBackend {
+    std::unique_ptr<vkrt::Device> device;
+    std::unique_ptr<vkrt::CommandContext> cmd_ctx;
+
+    // The geometry's vertices and indices are stored in one buffer per attribute, with
+    // each geometry's indices relative to its first vertex
+    struct GeometryRange {
+        uint32_t first_vertex = 0;
+        uint32_t num_vertices = 0;
+        uint32_t first_index = 0;
+        uint32_t num_indices = 0;
+    };
+    std::vector<std::vector<GeometryRange>> mesh_geometries;
+    std::vector<uint32_t> instance_meshes;
+    std::vector<glm::mat4> instance_transforms;
+    std::shared_ptr<vkrt::Buffer> positions, normals, uvs, indices, instance_buf;
+
+    std::vector<VkAccelerationStructureKHR> blas;
+    VkAccelerationStructureKHR tlas = VK_NULL_HANDLE;
+    std::shared_ptr<vkrt::Buffer> blas_buf, tlas_buf, tlas_instances;
+
+    glm::uvec2 atlas_size = glm::uvec2(0);
+    std::shared_ptr<vkrt::Buffer> accum_buf, ray_stats, atlas_info;
+
+    VkDescriptorSetLayout desc_layout = VK_NULL_HANDLE;
+    VkDescriptorPool desc_pool = VK_NULL_HANDLE;
+    VkDescriptorSet desc_set = VK_NULL_HANDLE;
+    VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VkQueryPool timestamp_pool = VK_NULL_HANDLE;
+
+public:
+    VulkanBakeBackend();
+    ~VulkanBakeBackend() override;
+
+    std::string name() override;
+
+    std::string device_name() override;
+
+    void set_scene(const Scene &scene, const AtlasResult &atlas) override;
+
+    double build_accel() override;
+
+    BakeTileStats bake_tile(const glm::uvec2 &origin,
+                            const glm::uvec2 &size,
+                            uint32_t frame_id,
+                            const BakeSettings &settings) override;
+
+    std::vector<float> readback() override;
+
+private:
+    void build_pipeline();
+
+    void release_accel();
+
+    void update_descriptor_set();
+
+    // Upload the data to a new device local buffer with the usage
+    std::shared_ptr<vkrt::Buffer> upload(const void *data,
+                                         size_t nbytes,
+                                         VkBufferUsageFlags usage);
+};
@@ -0,0 +1,88 @@
+// The Vulkan bake kernel, compiled to SPIR-V: the atlas is rasterized like in
+// render_ao_map.hlsl and each texel traces its AO rays with inline ray queries. The
+// geometry is drawn unquantized, one draw per instance geometry, and the scene is opaque.
+// The AO is resolved from the accumulation when it's read back
+#define ALPHA_TEST 0
+
+#include "util.hlsl"
+#include "sampler.hlsl"
+#include "trace_ao.hlsl"
+
+struct VSInput {
+    [[vk::location(0)]] float3 position: POSITION0;
+    [[vk::location(1)]] float3 normal: NORMAL0;
+    [[vk::location(2)]] float2 uv: TEXCOORD0;
+};
+
+struct FSInput {
+    float4 uv_position: SV_POSITION;
+    float3 world_position: TEXCOORD0;
+    float3 normal: NORMAL0;
+};
+
+// The transform and atlas region of each instance, matches BakeInstance in
+// vk_bake_backend.cpp
+struct BakeInstance {
+    float4x4 transform;
+    float4x4 normal_transform;
+    float2 uv_offset;
+    float2 uv_scale;
+};
+
+[[vk::binding(0)]] RaytracingAccelerationStructure scene;
+[[vk::binding(1)]] StructuredBuffer<BakeInstance> instances;
+// Running sum of the unoccluded samples (x) and total samples (y) taken for each texel
+[[vk::binding(2)]] RWStructuredBuffer<float2> accum_buffer;
+// The RAY_STATS_* counters, reset before each bake tile
+[[vk::binding(3)]] RWByteAddressBuffer ray_stats;
+
+[[vk::binding(4)]] cbuffer AtlasInfo {
+    int2 dimensions;
+    int n_samples;
+    float ao_length;
+    // The accumulation is reset when frame_id is 0
+    uint frame_id;
+    int samples_per_frame;
+    uint sampler_seed;
+    // The SAMPLER_* generator, there's no blue noise tile bound so it takes no rotation
+    uint sampler_type;
+}
+
+struct DrawInfo {
+    uint instance_id;
+};
+
+[[vk::push_constant]] DrawInfo draw_info;
+
+FSInput vsmain(VSInput input)
+{
+    const BakeInstance inst = instances[draw_info.instance_id];
+    const float2 uv = input.uv * inst.uv_scale + inst.uv_offset;
+
+    // Vulkan's clip space y points down, flipped so the atlas has the same layout as the
+    // D3D12 bake's
+    FSInput result;
+    result.uv_position = float4(uv.x * 2.f - 1.f, 1.f - uv.y * 2.f, 0.f, 1.f);
+    result.world_position = mul(inst.transform, float4(input.position, 1.f)).xyz;
+    result.normal = mul(inst.normal_transform, float4(input.normal, 0.f)).xyz;
+    return result;
+}
+
+void fsmain(FSInput input)
+{
+    const uint2 texel = uint2(input.uv_position.xy);
+    const uint pixel_id = texel.y * dimensions.x + texel.x;
+
+    float2 accum = frame_id == 0 ? float2(0.f, 0.f) : accum_buffer[pixel_id];
+    const int batch_samples = min(samples_per_frame, max(n_samples - int(accum.y), 0));
+
+    SampleGenerator sg = make_sample_generator(
+        sampler_type, pixel_id, uint(accum.y), frame_id, sampler_seed, float2(0.f, 0.f));
+    // The scene has no occluder proxies, so the rays are traced in the far field only
+    const float n_occluded = trace_ao_rays(
+        scene, input.world_position, input.normal, ao_length, 0.f, batch_samples, sg);
+
+    accum += float2(batch_samples - n_occluded, batch_samples);
+    accum_buffer[pixel_id] = accum;
+    record_ray_stats(ray_stats, batch_samples, uint(n_occluded), batch_samples > 0);
+}
@@ -0,0 +1,403 @@
+#include "vk_utils.h"
+#include <algorithm>
+#include <cstring>
+
+namespace vkrt {
+
+PFN_vkCreateAccelerationStructureKHR CreateAccelerationStructureKHR = nullptr;
+PFN_vkDestroyAccelerationStructureKHR DestroyAccelerationStructureKHR = nullptr;
+PFN_vkGetAccelerationStructureBuildSizesKHR GetAccelerationStructureBuildSizesKHR = nullptr;
+PFN_vkGetAccelerationStructureDeviceAddressKHR GetAccelerationStructureDeviceAddressKHR =
+    nullptr;
+PFN_vkCmdBuildAccelerationStructuresKHR CmdBuildAccelerationStructuresKHR = nullptr;
+
+namespace {
+
+const std::vector<const char *> device_extensions = {
+    VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
+    VK_KHR_RAY_QUERY_EXTENSION_NAME,
+    VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME,
+};
+
+#ifndef NDEBUG
+bool has_layer(const char *name)
+{
+    uint32_t count = 0;
+    vkEnumerateInstanceLayerProperties(&count, nullptr);
+    std::vector<VkLayerProperties> layers(count);
+    vkEnumerateInstanceLayerProperties(&count, layers.data());
+    return std::find_if(layers.begin(), layers.end(), [&](const VkLayerProperties &l) {
+               return std::strcmp(l.layerName, name) == 0;
+           }) != layers.end();
+}
+#endif
+
+bool supports_ray_queries(VkPhysicalDevice device)
+{
+    VkPhysicalDeviceProperties props = {};
+    vkGetPhysicalDeviceProperties(device, &props);
+    if (props.apiVersion < VK_API_VERSION_1_3) {
+        return false;
+    }
+
+    uint32_t count = 0;
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &count, nullptr);
+    std::vector<VkExtensionProperties> extensions(count);
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &count, extensions.data());
+    for (const auto &name : device_extensions) {
+        auto fnd = std::find_if(
+            extensions.begin(), extensions.end(), [&](const VkExtensionProperties &e) {
+                return std::strcmp(e.extensionName, name) == 0;
+            });
+        if (fnd == extensions.end()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+Device::Device()
+{
+    VkApplicationInfo app_info = {};
+    app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+    app_info.pApplicationName = "vk_ao_bake";
+    app_info.pEngineName = "vk_ao_bake";
+    app_info.apiVersion = VK_API_VERSION_1_3;
+
+    std::vector<const char *> layers;
+#ifndef NDEBUG
+    if (has_layer("VK_LAYER_KHRONOS_validation")) {
+        layers.push_back("VK_LAYER_KHRONOS_validation");
+    }
+#endif
+
+    VkInstanceCreateInfo create_info = {};
+    create_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+    create_info.pApplicationInfo = &app_info;
+    create_info.enabledLayerCount = layers.size();
+    create_info.ppEnabledLayerNames = layers.data();
+    CHECK_VULKAN(vkCreateInstance(&create_info, nullptr, &vk_instance));
+
+    uint32_t device_count = 0;
+    vkEnumeratePhysicalDevices(vk_instance, &device_count, nullptr);
+    std::vector<VkPhysicalDevice> devices(device_count);
+    vkEnumeratePhysicalDevices(vk_instance, &device_count, devices.data());
+    for (const auto &d : devices) {
+        if (supports_ray_queries(d)) {
+            vk_physical_device = d;
+            break;
+        }
+    }
+    if (vk_physical_device == VK_NULL_HANDLE) {
+        vkDestroyInstance(vk_instance, nullptr);
+        std::cout << "Error: No Vulkan 1.3 GPU supporting ray queries was found\n";
+        throw std::runtime_error("No Vulkan GPU supporting ray queries");
+    }
+
+    uint32_t num_queue_families = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(vk_physical_device, &num_queue_families, nullptr);
+    std::vector<VkQueueFamilyProperties> family_props(num_queue_families);
+    vkGetPhysicalDeviceQueueFamilyProperties(
+        vk_physical_device, &num_queue_families, family_props.data());
+    for (uint32_t i = 0; i < num_queue_families; ++i) {
+        if (family_props[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+            graphics_queue_index = i;
+            break;
+        }
+    }
+
+    const float queue_priority = 1.f;
+    VkDeviceQueueCreateInfo queue_create_info = {};
+    queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queue_create_info.queueFamilyIndex = graphics_queue_index;
+    queue_create_info.queueCount = 1;
+    queue_create_info.pQueuePriorities = &queue_priority;
+
+    // The bake kernel writes its accumulation from the fragment shader, traces ray queries
+    // and is drawn with dynamic rendering without attachments
+    VkPhysicalDeviceRayQueryFeaturesKHR ray_query_features = {};
+    ray_query_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_QUERY_FEATURES_KHR;
+    ray_query_features.rayQuery = VK_TRUE;
+
+    VkPhysicalDeviceAccelerationStructureFeaturesKHR as_features = {};
+    as_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
+    as_features.accelerationStructure = VK_TRUE;
+    as_features.pNext = &ray_query_features;
+
+    VkPhysicalDeviceVulkan13Features vk13_features = {};
+    vk13_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+    vk13_features.dynamicRendering = VK_TRUE;
+    vk13_features.pNext = &as_features;
+
+    VkPhysicalDeviceVulkan12Features vk12_features = {};
+    vk12_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    vk12_features.bufferDeviceAddress = VK_TRUE;
+    vk12_features.pNext = &vk13_features;
+
+    VkPhysicalDeviceFeatures2 device_features = {};
+    device_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    device_features.features.fragmentStoresAndAtomics = VK_TRUE;
+    device_features.pNext = &vk12_features;
+
+    VkDeviceCreateInfo device_create_info = {};
+    device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    device_create_info.queueCreateInfoCount = 1;
+    device_create_info.pQueueCreateInfos = &queue_create_info;
+    device_create_info.enabledExtensionCount = device_extensions.size();
+    device_create_info.ppEnabledExtensionNames = device_extensions.data();
+    device_create_info.pNext = &device_features;
+    CHECK_VULKAN(vkCreateDevice(vk_physical_device, &device_create_info, nullptr, &vk_device));
+
+    vkGetDeviceQueue(vk_device, graphics_queue_index, 0, &queue);
+
+    vkGetPhysicalDeviceProperties(vk_physical_device, &device_props);
+    vkGetPhysicalDeviceMemoryProperties(vk_physical_device, &mem_props);
+
+    as_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR;
+    VkPhysicalDeviceProperties2 props = {};
+    props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    props.pNext = &as_props;
+    vkGetPhysicalDeviceProperties2(vk_physical_device, &props);
+
+    CreateAccelerationStructureKHR = reinterpret_cast<PFN_vkCreateAccelerationStructureKHR>(
+        vkGetDeviceProcAddr(vk_device, "vkCreateAccelerationStructureKHR"));
+    DestroyAccelerationStructureKHR = reinterpret_cast<PFN_vkDestroyAccelerationStructureKHR>(
+        vkGetDeviceProcAddr(vk_device, "vkDestroyAccelerationStructureKHR"));
+    GetAccelerationStructureBuildSizesKHR =
+        reinterpret_cast<PFN_vkGetAccelerationStructureBuildSizesKHR>(
+            vkGetDeviceProcAddr(vk_device, "vkGetAccelerationStructureBuildSizesKHR"));
+    GetAccelerationStructureDeviceAddressKHR =
+        reinterpret_cast<PFN_vkGetAccelerationStructureDeviceAddressKHR>(
+            vkGetDeviceProcAddr(vk_device, "vkGetAccelerationStructureDeviceAddressKHR"));
+    CmdBuildAccelerationStructuresKHR =
+        reinterpret_cast<PFN_vkCmdBuildAccelerationStructuresKHR>(
+            vkGetDeviceProcAddr(vk_device, "vkCmdBuildAccelerationStructuresKHR"));
+}
+
+Device::~Device()
+{
+    if (vk_device != VK_NULL_HANDLE) {
+        vkDestroyDevice(vk_device, nullptr);
+        vkDestroyInstance(vk_instance, nullptr);
+    }
+}
+
+VkDevice Device::logical_device()
+{
+    return vk_device;
+}
+
+VkPhysicalDevice Device::physical_device()
+{
+    return vk_physical_device;
+}
+
+VkQueue Device::graphics_queue()
+{
+    return queue;
+}
+
+uint32_t Device::queue_index() const
+{
+    return graphics_queue_index;
+}
+
+uint32_t Device::memory_type_index(uint32_t type_filter, VkMemoryPropertyFlags props) const
+{
+    for (uint32_t i = 0; i < mem_props.memoryTypeCount; ++i) {
+        if ((type_filter & (1 << i)) &&
+            (mem_props.memoryTypes[i].propertyFlags & props) == props) {
+            return i;
+        }
+    }
+    throw std::runtime_error("Failed to find a matching Vulkan memory type");
+}
+
+const VkPhysicalDeviceProperties &Device::properties() const
+{
+    return device_props;
+}
+
+const VkPhysicalDeviceAccelerationStructurePropertiesKHR &Device::accel_properties() const
+{
+    return as_props;
+}
+
+std::string Device::device_name() const
+{
+    return device_props.deviceName;
+}
+
+std::shared_ptr<Buffer> Buffer::make_buffer(Device &device,
+                                            size_t nbytes,
+                                            VkBufferUsageFlags usage,
+                                            VkMemoryPropertyFlags mem_props)
+{
+    auto b = std::make_shared<Buffer>();
+    b->vk_device = device.logical_device();
+    b->buf_size = nbytes;
+    b->host_visible = mem_props & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+
+    VkBufferCreateInfo create_info = {};
+    create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    create_info.size = nbytes;
+    create_info.usage = usage;
+    create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    CHECK_VULKAN(vkCreateBuffer(b->vk_device, &create_info, nullptr, &b->buf));
+
+    VkMemoryRequirements mem_reqs = {};
+    vkGetBufferMemoryRequirements(b->vk_device, b->buf, &mem_reqs);
+
+    VkMemoryAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = mem_reqs.size;
+    alloc_info.memoryTypeIndex = device.memory_type_index(mem_reqs.memoryTypeBits, mem_props);
+
+    VkMemoryAllocateFlagsInfo flags_info = {};
+    flags_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
+    flags_info.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+    if (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) {
+        alloc_info.pNext = &flags_info;
+    }
+    CHECK_VULKAN(vkAllocateMemory(b->vk_device, &alloc_info, nullptr, &b->mem));
+    CHECK_VULKAN(vkBindBufferMemory(b->vk_device, b->buf, b->mem, 0));
+    return b;
+}
+
+Buffer::~Buffer()
+{
+    if (buf != VK_NULL_HANDLE) {
+        vkDestroyBuffer(vk_device, buf, nullptr);
+        vkFreeMemory(vk_device, mem, nullptr);
+    }
+}
+
+std::shared_ptr<Buffer> Buffer::host(Device &device, size_t nbytes, VkBufferUsageFlags usage)
+{
+    return make_buffer(device,
+                       nbytes,
+                       usage,
+                       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                           VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+}
+
+std::shared_ptr<Buffer> Buffer::device(Device &device,
+                                       size_t nbytes,
+                                       VkBufferUsageFlags usage)
+{
+    return make_buffer(device, nbytes, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+}
+
+void *Buffer::map()
+{
+    if (!host_visible) {
+        throw std::runtime_error("Can't map a device local buffer");
+    }
+    void *mapping = nullptr;
+    CHECK_VULKAN(vkMapMemory(vk_device, mem, 0, buf_size, 0, &mapping));
+    return mapping;
+}
+
+void Buffer::unmap()
+{
+    vkUnmapMemory(vk_device, mem);
+}
+
+size_t Buffer::size() const
+{
+    return buf_size;
+}
+
+VkBuffer Buffer::handle() const
+{
+    return buf;
+}
+
+VkDeviceAddress Buffer::device_address() const
+{
+    VkBufferDeviceAddressInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
+    info.buffer = buf;
+    return vkGetBufferDeviceAddress(vk_device, &info);
+}
+
+CommandContext::CommandContext(Device &dev) : device(&dev)
+{
+    VkCommandPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    pool_info.queueFamilyIndex = device->queue_index();
+    CHECK_VULKAN(vkCreateCommandPool(device->logical_device(), &pool_info, nullptr, &pool));
+
+    VkCommandBufferAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    alloc_info.commandPool = pool;
+    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    alloc_info.commandBufferCount = 1;
+    CHECK_VULKAN(vkAllocateCommandBuffers(device->logical_device(), &alloc_info, &cmd_buf));
+
+    VkFenceCreateInfo fence_info = {};
+    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    CHECK_VULKAN(vkCreateFence(device->logical_device(), &fence_info, nullptr, &fence));
+}
+
+CommandContext::~CommandContext()
+{
+    vkDestroyFence(device->logical_device(), fence, nullptr);
+    vkDestroyCommandPool(device->logical_device(), pool, nullptr);
+}
+
+void CommandContext::begin()
+{
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    CHECK_VULKAN(vkBeginCommandBuffer(cmd_buf, &begin_info));
+}
+
+void CommandContext::submit_and_sync()
+{
+    CHECK_VULKAN(vkEndCommandBuffer(cmd_buf));
+
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &cmd_buf;
+    CHECK_VULKAN(vkQueueSubmit(device->graphics_queue(), 1, &submit_info, fence));
+    CHECK_VULKAN(vkWaitForFences(device->logical_device(), 1, &fence, true, UINT64_MAX));
+    CHECK_VULKAN(vkResetFences(device->logical_device(), 1, &fence));
+    CHECK_VULKAN(vkResetCommandBuffer(cmd_buf, 0));
+}
+
+VkShaderModule create_shader_module(VkDevice device, const void *code, size_t nbytes)
+{
+    std::vector<uint32_t> words((nbytes + 3) / 4, 0);
+    std::memcpy(words.data(), code, nbytes);
+
+    VkShaderModuleCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    info.codeSize = nbytes;
+    info.pCode = words.data();
+
+    VkShaderModule module = VK_NULL_HANDLE;
+    CHECK_VULKAN(vkCreateShaderModule(device, &info, nullptr, &module));
+    return module;
+}
+
+void memory_barrier(VkCommandBuffer cmd_buf,
+                    VkPipelineStageFlags src_stage,
+                    VkAccessFlags src_access,
+                    VkPipelineStageFlags dst_stage,
+                    VkAccessFlags dst_access)
+{
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = src_access;
+    barrier.dstAccessMask = dst_access;
+    vkCmdPipelineBarrier(
+        cmd_buf, src_stage, dst_stage, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// Utilities for general Vulkan ease of use
+
+#define CHECK_VULKAN(FN)                                                                 \
+    {                                                                                    \
+        VkResult vk_err = FN;                                                            \
+        if (vk_err != VK_SUCCESS) {                                                      \
+            std::cout << #FN << " failed due to " << vk_err << std::endl << std::flush; \
+            throw std::runtime_error(#FN);                                               \
+        }                                                                                \
+    }
+
+namespace vkrt {
+
+// The ray tracing extension entry points, which the loader doesn't export. Loaded by the
+// Device once it's created
+extern PFN_vkCreateAccelerationStructureKHR CreateAccelerationStructureKHR;
+extern PFN_vkDestroyAccelerationStructureKHR DestroyAccelerationStructureKHR;
+extern PFN_vkGetAccelerationStructureBuildSizesKHR GetAccelerationStructureBuildSizesKHR;
+extern PFN_vkGetAccelerationStructureDeviceAddressKHR
+    GetAccelerationStructureDeviceAddressKHR;
+extern PFN_vkCmdBuildAccelerationStructuresKHR CmdBuildAccelerationStructuresKHR;
+
+/* A Vulkan 1.3 device with a single graphics queue on the first GPU supporting ray queries,
+ * enabling the validation layer in debug builds if it's installed. Throws if no GPU
+ * supports them
+ */
+class Device {
+    VkInstance vk_instance = VK_NULL_HANDLE;
+    VkPhysicalDevice vk_physical_device = VK_NULL_HANDLE;
+    VkDevice vk_device = VK_NULL_HANDLE;
+    VkQueue queue = VK_NULL_HANDLE;
+    uint32_t graphics_queue_index = -1;
+
+    VkPhysicalDeviceProperties device_props = {};
+    VkPhysicalDeviceMemoryProperties mem_props = {};
+    VkPhysicalDeviceAccelerationStructurePropertiesKHR as_props = {};
+
+public:
+    Device();
+    ~Device();
+
+    Device(const Device &) = delete;
+    Device &operator=(const Device &) = delete;
+
+    VkDevice logical_device();
+    VkPhysicalDevice physical_device();
+    VkQueue graphics_queue();
+    uint32_t queue_index() const;
+
+    // Find a memory type in the type bits with the properties, throws if there's none
+    uint32_t memory_type_index(uint32_t type_filter, VkMemoryPropertyFlags props) const;
+
+    const VkPhysicalDeviceProperties &properties() const;
+    const VkPhysicalDeviceAccelerationStructurePropertiesKHR &accel_properties() const;
+
+    std::string device_name() const;
+};
+
+/* A buffer with its own memory allocation, either host visible and coherent for uploads,
+ * readback and small per frame data, or device local. Buffers with the device address usage
+ * get memory allocated for it
+ */
+class Buffer {
+    VkDevice vk_device = VK_NULL_HANDLE;
+    VkBuffer buf = VK_NULL_HANDLE;
+    VkDeviceMemory mem = VK_NULL_HANDLE;
+    size_t buf_size = 0;
+    bool host_visible = false;
+
+    static std::shared_ptr<Buffer> make_buffer(Device &device,
+                                               size_t nbytes,
+                                               VkBufferUsageFlags usage,
+                                               VkMemoryPropertyFlags mem_props);
+
+public:
+    Buffer() = default;
+    ~Buffer();
+
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+
+    static std::shared_ptr<Buffer> host(Device &device,
+                                        size_t nbytes,
+                                        VkBufferUsageFlags usage);
+
+    static std::shared_ptr<Buffer> device(Device &device,
+                                          size_t nbytes,
+                                          VkBufferUsageFlags usage);
+
+    // Map the host visible buffer, the mapping is coherent
+    void *map();
+    void unmap();
+
+    size_t size() const;
+    VkBuffer handle() const;
+    VkDeviceAddress device_address() const;
+};
+
+/* A command buffer and fence for recording work on the device's queue and waiting on it,
+ * each begin must be followed by a submit_and_sync before the next
+ */
+class CommandContext {
+    Device *device = nullptr;
+    VkCommandPool pool = VK_NULL_HANDLE;
+    VkFence fence = VK_NULL_HANDLE;
+
+public:
+    VkCommandBuffer cmd_buf = VK_NULL_HANDLE;
+
+    CommandContext(Device &device);
+    ~CommandContext();
+
+    CommandContext(const CommandContext &) = delete;
+    CommandContext &operator=(const CommandContext &) = delete;
+
+    void begin();
+
+    // Submit the commands recorded and wait for the queue to finish them
+    void submit_and_sync();
+};
+
+// Create a shader module from SPIR-V, which is copied so the code needn't be word aligned
+VkShaderModule create_shader_module(VkDevice device, const void *code, size_t nbytes);
+
+// A barrier between the commands before and after it in the stages, over all memory
+void memory_barrier(VkCommandBuffer cmd_buf,
+                    VkPipelineStageFlags src_stage,
+                    VkAccessFlags src_access,
+                    VkPipelineStageFlags dst_stage,
+                    VkAccessFlags dst_access);
+
+}
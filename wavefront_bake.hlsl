@@ -0,0 +1,237 @@
+#include "util.hlsl"
+#include "sampler.hlsl"
+#include "trace_ao.hlsl"
+#include "texel_data.hlsl"
+
+// The wavefront bake path. Instead of each thread tracing all the rays for its texel,
+// the AO rays for a chunk of the texel list are generated into a buffer, binned by
+// direction and origin and traced in the binned order. Rays traced together by a
+// wave then take similar paths through the BVH. The occlusion results are scattered
+// back to the texels with atomics and resolved into the accumulation buffer
+
+// Rays are binned by an 8x8 octahedral direction bin and 4x4x4 grid cell of the origin
+#define NUM_DIRECTION_BINS 64
+#define NUM_ORIGIN_BINS 64
+#define NUM_RAY_BINS (NUM_DIRECTION_BINS * NUM_ORIGIN_BINS)
+#define SCAN_GROUP_SIZE 1024
+#define BINS_PER_SCAN_THREAD (NUM_RAY_BINS / SCAN_GROUP_SIZE)
+#define INVALID_RAY_BIN 0xffffffff
+
+struct WavefrontRay {
+    float3 origin;
+    // Index of the ray's texel within the chunk
+    uint texel_index;
+    float3 direction;
+    uint bin;
+};
+
+RaytracingAccelerationStructure scene : register(t0);
+StructuredBuffer<TexelData> texels : register(t1);
+StructuredBuffer<float2> blue_noise : register(t2);
+
+RWStructuredBuffer<float2> accum_buffer : register(u0);
+RWTexture2D<float4> ao_output : register(u1);
+// The rays generated for the chunk, samples_per_frame slots per texel
+RWStructuredBuffer<WavefrontRay> rays : register(u2);
+RWStructuredBuffer<WavefrontRay> binned_rays : register(u3);
+RWStructuredBuffer<uint> bin_counts : register(u4);
+// The start of each bin in binned_rays, followed by the total number of rays
+RWStructuredBuffer<uint> bin_offsets : register(u5);
+RWStructuredBuffer<uint> texel_occlusion : register(u6);
+// The RAY_STATS_* counters, reset before each bake frame
+RWByteAddressBuffer ray_stats : register(u7);
+
+cbuffer AtlasInfo : register(b0) {
+    int2 dimensions; 
+    int n_samples;
+    float ao_length;
+    // The accumulation is reset when frame_id is 0
+    uint frame_id;
+    int samples_per_frame;
+    // The SAMPLER_* sample generator to use and the seed to decorrelate separate bakes
+    uint sampler_type;
+    uint sampler_seed;
+    // The extra output maps aren't supported by this bake
+    uint bake_outputs;
+    // The AO rays trace the full-res geometry within near_field_radius and the occluder
+    // proxies beyond it, 0 if the scene has no proxies
+    float near_field_radius;
+    // The range of the texel list to bake in this dispatch
+    uint texel_offset;
+    uint num_texels;
+    // The per-texel sample budget isn't supported by this bake
+    uint use_sample_budget;
+    // Maps world space positions into [0, 1] over the scene bounds
+    float3 scene_lower;
+    uint pad1;
+    float3 scene_inv_extent;
+    uint pad2;
+}
+
+groupshared uint scan_sums[SCAN_GROUP_SIZE];
+
+uint direction_bin(float3 dir)
+{
+    // Octahedral mapping of the direction into [0, 1]^2
+    float2 p = dir.xy / (abs(dir.x) + abs(dir.y) + abs(dir.z));
+    if (dir.z < 0.f) {
+        p = (1.f - abs(p.yx)) * float2(p.x >= 0.f ? 1.f : -1.f, p.y >= 0.f ? 1.f : -1.f);
+    }
+    const uint2 bin = min(uint2((p * 0.5f + 0.5f) * 8.f), uint2(7, 7));
+    return bin.y * 8 + bin.x;
+}
+
+uint origin_bin(float3 origin)
+{
+    const float3 p = saturate((origin - scene_lower) * scene_inv_extent);
+    const uint3 cell = min(uint3(p * 4.f), uint3(3, 3, 3));
+    // Interleave the 2 bits of each axis so nearby cells get nearby bins
+    uint code = 0;
+    for (uint i = 0; i < 2; ++i) {
+        code |= ((cell.x >> i) & 1) << (3 * i);
+        code |= ((cell.y >> i) & 1) << (3 * i + 1);
+        code |= ((cell.z >> i) & 1) << (3 * i + 2);
+    }
+    return code;
+}
+
+// The number of samples the texel has taken in previous frames
+int texel_prev_samples(uint pixel_id)
+{
+    return frame_id == 0 ? 0 : int(accum_buffer[pixel_id].y);
+}
+
+// The number of samples to take for the texel this frame, stopping once it has taken
+// n_samples
+int texel_batch_samples(uint pixel_id)
+{
+    return min(samples_per_frame, max(n_samples - texel_prev_samples(pixel_id), 0));
+}
+
+uint texel_pixel_id(TexelData t)
+{
+    const uint2 texel = texel_coords(t);
+    return texel.y * dimensions.x + texel.x;
+}
+
+[numthreads(64, 1, 1)]
+void raygen_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    if (thread_id.x >= num_texels) {
+        return;
+    }
+    const TexelData t = texels[texel_offset + thread_id.x];
+    const uint pixel_id = texel_pixel_id(t);
+    const int batch_samples = texel_batch_samples(pixel_id);
+    // Same sample sequence as trace_ao_rays, so both paths produce the same image
+    SampleGenerator sg = make_sample_generator(sampler_type,
+                                               pixel_id,
+                                               texel_prev_samples(pixel_id),
+                                               frame_id,
+                                               sampler_seed,
+                                               blue_noise_value(blue_noise, texel_coords(t)));
+
+    float3 v_z = normalize(t.normal);
+    float3 v_x, v_y;
+    ortho_basis(v_x, v_y, v_z);
+
+    record_ray_stats(ray_stats, 0, 0, batch_samples > 0);
+
+    const uint origin = origin_bin(t.position);
+    for (int i = 0; i < samples_per_frame; ++i) {
+        WavefrontRay ray;
+        ray.origin = t.position;
+        ray.texel_index = thread_id.x;
+        ray.direction = float3(0.f, 0.f, 1.f);
+        ray.bin = INVALID_RAY_BIN;
+        if (i < batch_samples) {
+            ray.direction = sample_ao_direction(v_x, v_y, v_z, next_sample2d(sg));
+            ray.bin = direction_bin(ray.direction) * NUM_ORIGIN_BINS + origin;
+            InterlockedAdd(bin_counts[ray.bin], 1);
+        }
+        rays[thread_id.x * samples_per_frame + i] = ray;
+    }
+}
+
+// Exclusive scan of the bin counts to find the start of each bin, the counts are reset
+// for the next chunk
+[numthreads(SCAN_GROUP_SIZE, 1, 1)]
+void scan_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    const uint first_bin = thread_id.x * BINS_PER_SCAN_THREAD;
+    uint counts[BINS_PER_SCAN_THREAD];
+    uint thread_sum = 0;
+    for (uint i = 0; i < BINS_PER_SCAN_THREAD; ++i) {
+        counts[i] = bin_counts[first_bin + i];
+        bin_counts[first_bin + i] = 0;
+        thread_sum += counts[i];
+    }
+
+    scan_sums[thread_id.x] = thread_sum;
+    GroupMemoryBarrierWithGroupSync();
+    for (uint offset = 1; offset < SCAN_GROUP_SIZE; offset *= 2) {
+        const uint prev = thread_id.x >= offset ? scan_sums[thread_id.x - offset] : 0;
+        GroupMemoryBarrierWithGroupSync();
+        scan_sums[thread_id.x] += prev;
+        GroupMemoryBarrierWithGroupSync();
+    }
+
+    uint bin_start = scan_sums[thread_id.x] - thread_sum;
+    for (uint j = 0; j < BINS_PER_SCAN_THREAD; ++j) {
+        bin_offsets[first_bin + j] = bin_start;
+        bin_start += counts[j];
+    }
+    if (thread_id.x == SCAN_GROUP_SIZE - 1) {
+        bin_offsets[NUM_RAY_BINS] = bin_start;
+    }
+}
+
+[numthreads(64, 1, 1)]
+void scatter_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    if (thread_id.x >= num_texels * samples_per_frame) {
+        return;
+    }
+    const WavefrontRay ray = rays[thread_id.x];
+    if (ray.bin == INVALID_RAY_BIN) {
+        return;
+    }
+    uint index = 0;
+    InterlockedAdd(bin_offsets[ray.bin], 1, index);
+    binned_rays[index] = ray;
+}
+
+[numthreads(64, 1, 1)]
+void trace_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    if (thread_id.x >= bin_offsets[NUM_RAY_BINS]) {
+        return;
+    }
+    const WavefrontRay ray = binned_rays[thread_id.x];
+    const bool hit =
+        trace_ao_ray(scene, ray.origin, ray.direction, ao_length, near_field_radius);
+    if (hit) {
+        InterlockedAdd(texel_occlusion[ray.texel_index], 1);
+    }
+    record_ray_stats(ray_stats, 1, hit ? 1 : 0, false);
+}
+
+[numthreads(64, 1, 1)]
+void resolve_csmain(uint3 thread_id : SV_DispatchThreadID)
+{
+    if (thread_id.x >= num_texels) {
+        return;
+    }
+    const TexelData t = texels[texel_offset + thread_id.x];
+    const uint pixel_id = texel_pixel_id(t);
+    const int batch_samples = texel_batch_samples(pixel_id);
+
+    const float n_occluded = texel_occlusion[thread_id.x];
+    texel_occlusion[thread_id.x] = 0;
+
+    float2 accum = frame_id == 0 ? float2(0.f, 0.f) : accum_buffer[pixel_id];
+    accum += float2(batch_samples - n_occluded, batch_samples);
+    accum_buffer[pixel_id] = accum;
+
+    ao_output[texel_coords(t)] = accum.x / max(accum.y, 1.f);
+}